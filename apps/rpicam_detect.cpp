@@ -6,12 +6,18 @@
  */
 
 // Example: rpicam-detect --post-process-file object_detect_tf.json --lores-width 400 --lores-height 300 -t 0 --object cat -o cat%03d.jpg
+// Or, capturing the very frame each detection was made on: add --zsl --label-gap 5000 --dedup 0.7
 
+#include <algorithm>
 #include <chrono>
+#include <deque>
+#include <map>
 
 #include "core/rpicam_app.hpp"
 #include "core/still_options.hpp"
 
+#include "encoder/encode_pool.hpp"
+
 #include "image/image.hpp"
 
 #include "post_processing_stages/object_detect.hpp"
@@ -25,12 +31,35 @@ struct DetectOptions : public StillOptions
 			("object", value<std::string>(&object), "Name of object to detect")
 			("gap", value<unsigned int>(&gap)->default_value(30), "Smallest gap between captures in frames")
 			("timeformat", value<std::string>(&timeformat)->default_value("%m%d%H%M%S"), "Date/Time format string - see C++ strftime()")
+			("ring", value<unsigned int>(&ring)->default_value(8),
+			 "With --zsl, how many recent full resolution frames to keep, to find the one each detection was made on")
+			("label-gap", value<unsigned int>(&label_gap)->default_value(0),
+			 "With --zsl, smallest gap in milliseconds between captures of the same label")
+			("dedup", value<float>(&dedup)->default_value(0),
+			 "With --zsl, don't capture a label again while its box overlaps the last one captured by at least this "
+			 "much (intersection over union, 0 = off)")
 			;
 	}
 
 	std::string object;
 	unsigned int gap;
 	std::string timeformat;
+	unsigned int ring;
+	unsigned int label_gap;
+	float dedup;
+
+	virtual bool Parse(int argc, char *argv[]) override
+	{
+		if (StillOptions::Parse(argc, argv) == false)
+			return false;
+
+		if (Get().zsl && !ring)
+			throw std::runtime_error("--ring must be at least 1");
+		if (dedup < 0 || dedup > 1)
+			throw std::runtime_error("--dedup must be between 0 and 1");
+
+		return true;
+	}
 
 	virtual void Print() const override
 	{
@@ -38,6 +67,8 @@ struct DetectOptions : public StillOptions
 		std::cerr << "    object: " << object << std::endl;
 		std::cerr << "    gap: " << gap << std::endl;
 		std::cerr << "    timeformat: " << timeformat << std::endl;
+		if (Get().zsl)
+			std::cerr << "    ring: " << ring << ", label-gap: " << label_gap << "ms, dedup: " << dedup << std::endl;
 	}
 };
 
@@ -48,6 +79,30 @@ public:
 	DetectOptions *GetOptions() const { return static_cast<DetectOptions *>(RPiCamApp::GetOptions()); }
 };
 
+static std::string generate_filename(DetectOptions *options)
+{
+	uint32_t framestart = options->Get().framestart;
+	char filename[128];
+	if (options->Get().datetime)
+	{
+		std::time_t raw_time;
+		std::time(&raw_time);
+		char time_string[32];
+		std::tm *time_info = std::localtime(&raw_time);
+		std::strftime(time_string, sizeof(time_string), options->timeformat.c_str(), time_info);
+		snprintf(filename, sizeof(filename), "%s%s.%s", options->Get().output.c_str(), time_string,
+				 options->Get().encoding.c_str());
+	}
+	else if (options->Get().timestamp)
+		snprintf(filename, sizeof(filename), "%s%u.%s", options->Get().output.c_str(), (unsigned)time(NULL),
+				 options->Get().encoding.c_str());
+	else
+		snprintf(filename, sizeof(filename), options->Get().output.c_str(), framestart);
+	filename[sizeof(filename) - 1] = 0;
+	options->Set().framestart = framestart + 1;
+	return std::string(filename);
+}
+
 // The main even loop for the application.
 
 static void event_loop(RPiCamDetectApp &app)
@@ -109,29 +164,9 @@ static void event_loop(RPiCamDetectApp &app)
 			libcamera::Stream *stream = app.StillStream(&info);
 			BufferReadSync r(&app, completed_request->buffers[stream]);
 			const std::vector<libcamera::Span<uint8_t>> mem = r.Get();
-			uint32_t framestart = options->Get().framestart;
-
-			// Generate a filename for the output and save it.
-			char filename[128];
-			if (options->Get().datetime)
-			{
-				std::time_t raw_time;
-				std::time(&raw_time);
-				char time_string[32];
-				std::tm *time_info = std::localtime(&raw_time);
-				std::strftime(time_string, sizeof(time_string), options->timeformat.c_str(), time_info);
-				snprintf(filename, sizeof(filename), "%s%s.%s", options->Get().output.c_str(), time_string,
-						 options->Get().encoding.c_str());
-			}
-			else if (options->Get().timestamp)
-				snprintf(filename, sizeof(filename), "%s%u.%s", options->Get().output.c_str(), (unsigned)time(NULL),
-						 options->Get().encoding.c_str());
-			else
-				snprintf(filename, sizeof(filename), options->Get().output.c_str(), framestart);
-			filename[sizeof(filename) - 1] = 0;
-			options->Set().framestart = framestart + 1;
+			std::string filename = generate_filename(options);
 			LOG(1, "Save image " << filename);
-			jpeg_save(mem, info, completed_request->metadata, std::string(filename), app.CameraModel(), options);
+			jpeg_save(mem, info, completed_request->metadata, filename, app.CameraModel(), options);
 
 			// Restart camera in preview mode.
 			app.Teardown();
@@ -141,6 +176,152 @@ static void event_loop(RPiCamDetectApp &app)
 	}
 }
 
+// Saves the --zsl captures on the threads of an EncodePool, so that neither the camera nor the detection waits for
+// them. Each capture holds on to its request until it is saved.
+class DetectSaver
+{
+public:
+	DetectSaver(RPiCamDetectApp &app) : app_(app), pool_(app.GetOptions(), DEFAULT_THREADS, "DetectSaver")
+	{
+		pool_.Start(
+			[this](unsigned int num, EncodePool::EncodeItem &item, uint8_t *&encoded_buffer, size_t &buffer_len) {
+				Job *job = static_cast<Job *>(item.mem);
+				BufferReadSync r(&app_, job->payload->buffers[app_.StillStream()]);
+				jpeg_save(r.Get(), item.info, job->payload->metadata, job->filename, app_.CameraModel(),
+						  app_.GetOptions());
+			},
+			[](EncodePool::OutputItem &item) {},
+			[](void *mem) { delete static_cast<Job *>(mem); });
+	}
+	~DetectSaver() { pool_.Stop(); }
+
+	void Save(CompletedRequestPtr const &payload, std::string const &filename)
+	{
+		StreamInfo info;
+		app_.StillStream(&info);
+		int64_t timestamp_ns = payload->metadata.get(libcamera::controls::SensorTimestamp).value_or(0);
+		pool_.Push(new Job { payload, filename }, info, timestamp_ns / 1000, payload);
+	}
+
+private:
+	static constexpr unsigned int DEFAULT_THREADS = 2;
+
+	struct Job
+	{
+		CompletedRequestPtr payload;
+		std::string filename;
+	};
+
+	RPiCamDetectApp &app_;
+	EncodePool pool_;
+};
+
+// When each label was last captured, and where, for --label-gap and --dedup.
+struct LabelCapture
+{
+	std::chrono::steady_clock::time_point time;
+	libcamera::Rectangle box;
+};
+
+// Intersection over union of two boxes.
+static float overlap(libcamera::Rectangle const &a, libcamera::Rectangle const &b)
+{
+	int x0 = std::max(a.x, b.x), y0 = std::max(a.y, b.y);
+	int x1 = std::min(a.x + (int)a.width, b.x + (int)b.width), y1 = std::min(a.y + (int)a.height, b.y + (int)b.height);
+	if (x1 <= x0 || y1 <= y0)
+		return 0;
+	float intersection = (float)(x1 - x0) * (y1 - y0);
+	return intersection / ((float)a.width * a.height + (float)b.width * b.height - intersection);
+}
+
+// With --zsl, the camera stays in ZSL mode, and we keep a ring of the most recent full resolution frames. Detections
+// are made on a lores frame some way behind the one they arrive with, so we capture the full resolution frame from
+// the ring with the same sensor timestamp, and save it in the background.
+static void zsl_event_loop(RPiCamDetectApp &app)
+{
+	DetectOptions *options = app.GetOptions();
+	// Frames saved in the background hold on to buffers too, a couple at a time if all goes well.
+	constexpr unsigned int SAVE_BUFFERS = 2;
+	app.OpenCamera();
+	app.ConfigureZsl(RPiCamApp::FLAG_STILL_NONE, options->ring + SAVE_BUFFERS);
+	DetectSaver saver(app);
+	app.StartCamera();
+	auto start_time = std::chrono::high_resolution_clock::now();
+	unsigned int last_capture_frame = 0;
+	std::deque<CompletedRequestPtr> ring;
+	std::map<std::string, LabelCapture> captures;
+	int64_t last_detection_ns = -1;
+
+	while (true)
+	{
+		RPiCamApp::Msg msg = app.Wait();
+		if (msg.type == RPiCamApp::MsgType::Timeout)
+		{
+			LOG_ERROR("ERROR: Device timeout detected, attempting a restart!!!");
+			app.StopCamera();
+			app.StartCamera();
+			continue;
+		}
+		if (msg.type == RPiCamApp::MsgType::Quit)
+			return;
+
+		CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg.payload);
+		auto now = std::chrono::high_resolution_clock::now();
+		if (options->Get().timeout && (now - start_time) > options->Get().timeout.value)
+			return;
+
+		ring.push_back(completed_request);
+		if (ring.size() > options->ring)
+			ring.pop_front();
+		app.ShowPreview(completed_request, app.ViewfinderStream());
+
+		std::vector<Detection> detections;
+		if (completed_request->post_process_metadata.Get("object_detect.results", detections) != 0)
+			continue;
+		// Stages that don't say which frame their results came from have run on this one. The others attach the
+		// same results to every frame until their next inference finishes, and we only want to look at them once.
+		int64_t detection_ns = completed_request->metadata.get(libcamera::controls::SensorTimestamp).value_or(0);
+		completed_request->post_process_metadata.Get("object_detect.timestamp", detection_ns);
+		if (detection_ns == last_detection_ns)
+			continue;
+		last_detection_ns = detection_ns;
+
+		auto frame = std::find_if(ring.begin(), ring.end(), [detection_ns](CompletedRequestPtr const &r) {
+			return r->metadata.get(libcamera::controls::SensorTimestamp).value_or(0) == detection_ns;
+		});
+		if (frame == ring.end())
+			frame = ring.begin();
+		if ((*frame)->sequence - last_capture_frame < options->gap)
+			continue;
+
+		// Each label is captured at most once a frame, and only when --label-gap and --dedup allow.
+		auto steady_now = std::chrono::steady_clock::now();
+		std::vector<std::string> labels;
+		for (Detection const &d : detections)
+		{
+			if (d.name.find(options->object) == std::string::npos ||
+				std::find(labels.begin(), labels.end(), d.name) != labels.end())
+				continue;
+			auto it = captures.find(d.name);
+			if (it != captures.end() &&
+				(steady_now - it->second.time < std::chrono::milliseconds(options->label_gap) ||
+				 (options->dedup && overlap(d.box, it->second.box) >= options->dedup)))
+				continue;
+			captures[d.name] = { steady_now, d.box };
+			labels.push_back(d.name);
+		}
+		if (labels.empty())
+			continue;
+
+		if ((*frame)->metadata.get(libcamera::controls::SensorTimestamp).value_or(0) != detection_ns)
+			LOG_ERROR("WARNING: the detection's frame has left the ring, capturing the oldest (try a larger --ring)");
+		last_capture_frame = (*frame)->sequence;
+		std::string filename = generate_filename(options);
+		LOG(1, labels[0] << (labels.size() > 1 ? " and others" : "") << " detected, saving " << filename);
+		saver.Save(*frame, filename);
+	}
+}
+
 int main(int argc, char *argv[])
 {
 	try
@@ -154,7 +335,10 @@ int main(int argc, char *argv[])
 			if (options->Get().output.empty())
 				throw std::runtime_error("output file name required");
 
-			event_loop(app);
+			if (options->Get().zsl)
+				zsl_event_loop(app);
+			else
+				event_loop(app);
 		}
 	}
 	catch (std::exception const &e)
@@ -5,17 +5,45 @@
  * rpicam_raw.cpp - libcamera raw video record app.
  */
 
+#include <algorithm>
 #include <chrono>
+#include <condition_variable>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <mutex>
 #include <signal.h>
+#include <sys/resource.h>
+#include <thread>
+#include <unistd.h>
+
+#include <libcamera/formats.h>
 
 #include "core/rpicam_encoder.hpp"
 #include "core/stream_info.hpp"
+#include "core/trace.hpp"
 #include "encoder/null_encoder.hpp"
 #include "encoder/mjpeg_encoder.hpp"
 #include "encoder/png_encoder.hpp"
 #include "encoder/dng_encoder.hpp"
+#include "output/file_writer.hpp"
 #include "output/output.hpp"
+#include "post_processing_stages/change_gate.hpp"
+#include "post_processing_stages/motion_detect.hpp"
+#include "post_processing_stages/particle_analysis.hpp"
+#include "wassoc-utils/captureserver.hpp"
 #include "wassoc-utils/gpiohandler.hpp"
+#include "wassoc-utils/lampscheduler.hpp"
+#include "wassoc-utils/rawring.hpp"
+#include "wassoc-utils/runtimesettings.hpp"
+#include "wassoc-utils/storagegovernor.hpp"
+#include "wassoc-utils/strobemonitor.hpp"
+#include "wassoc-utils/thermalgovernor.hpp"
+#include "wassoc-utils/uploader.hpp"
 
 
 using namespace std::placeholders;
@@ -29,38 +57,69 @@ static void signal_handler(int signal_number)
 	LOG(1, "Received signal " << signal_number);
 }
 
+// SIGUSR2 asks for the --trace-file to be written out now.
+static void dump_trace_if_signalled(VideoOptions const *options)
+{
+	if (signal_received != SIGUSR2)
+		return;
+	signal_received = 0;
+	try
+	{
+		Trace::Get().Dump(options->Get().trace_file);
+	}
+	catch (std::exception const &e)
+	{
+		LOG_ERROR(e.what());
+	}
+}
+
+// The encoder for the frames we save, as the options ask. The stream's details are only needed for JPEG.
+static Encoder *create_encoder(VideoOptions const *options, StreamInfo const &info)
+{
+	if (options->Get().force_png)
+		return new PngEncoder(options);
+	else if (options->Get().force_jpeg || options->Get().force_still)
+		return Encoder::CreateJpeg(options, info);
+	return new DngEncoder(options);
+}
+
 class LibcameraRaw : public RPiCamEncoder
 {
 public:
 	LibcameraRaw() : RPiCamEncoder() {}
+	// --max-throughput plans only before the first start, not on restarts.
+	bool throughput_planned = false;
 protected:
 	// Force the use of "null" encoder.
 	void createEncoder() {
-		if (GetOptions()->Get().force_png) {
-			encoder_ = std::unique_ptr<Encoder>(new PngEncoder(GetOptions()));
-		} else if (GetOptions()->Get().force_jpeg || GetOptions()->Get().force_still) {
-			encoder_ = std::unique_ptr<Encoder>(new MjpegEncoder(GetOptions()));
-		} else {
-			encoder_ = std::unique_ptr<Encoder>(new DngEncoder(GetOptions()));
+		StreamInfo info;
+		if (GetOptions()->Get().force_jpeg) {
+			VideoStream(&info);
+		} else if (GetOptions()->Get().force_still) {
+			StillStream(&info);
 		}
+		encoder_ = std::unique_ptr<Encoder>(create_encoder(GetOptions(), info));
 	}
 };
 
-// The main even loop for the application.
+static void plan_max_throughput(LibcameraRaw &app);
 
-static void event_loop(LibcameraRaw &app, GpioHandler* lampHandler)
+// Open and configure the camera as the options ask, and start it and the encoder. Returns the stream we save.
+static libcamera::Stream *start_app(LibcameraRaw &app, std::string &streamName)
 {
-	unsigned int framesCaptured = 0;
-	StreamInfo info;
-	VideoOptions const *options = app.GetOptions();
-	std::unique_ptr<Output> output = std::unique_ptr<Output>(Output::Create(options));
-	app.SetEncodeOutputReadyCallback(std::bind(&Output::OutputReady, output.get(), _1, _2, _3, _4));
-	app.SetMetadataReadyCallback(std::bind(&Output::MetadataReady, output.get(), _1));
-
-	if (lampHandler) {
-		lampHandler->setNextLampColor();
-	}
+	VideoOptions *options = app.GetOptions();
+	// Any framerate makes OpenCamera find each sensor mode's fastest one, which the planner needs.
+	bool plan = options->Get().max_throughput && !app.throughput_planned;
+	std::optional<float> framerate = options->Get().framerate;
+	if (plan && !framerate)
+		options->Set().framerate = 1000;
 	app.OpenCamera();
+	if (plan)
+	{
+		options->Set().framerate = framerate;
+		plan_max_throughput(app);
+		app.throughput_planned = true;
+	}
 	if (options->Get().force_jpeg) {
 		app.ConfigureVideo(RPiCamEncoder::FLAG_VIDEO_JPEG_COLOURSPACE);
 	} else if (options->Get().force_still) {
@@ -69,32 +128,961 @@ static void event_loop(LibcameraRaw &app, GpioHandler* lampHandler)
 		app.ConfigureRawStream();
 	}
 	app.StartEncoder();
+	if (!options->Get().bracket_exposures.empty()) {
+		std::vector<libcamera::ControlList> ring;
+		for (unsigned int exposure : options->Get().bracket_exposures) {
+			libcamera::ControlList controls(libcamera::controls::controls);
+			controls.set(libcamera::controls::ExposureTimeMode, libcamera::controls::ExposureTimeModeManual);
+			controls.set(libcamera::controls::ExposureTime, (int32_t)exposure);
+			ring.push_back(std::move(controls));
+		}
+		app.SetControlRing(ring);
+	}
 	app.StartCamera();
-	auto start_time = std::chrono::high_resolution_clock::now();
-	auto last_capture_time = start_time;
-	libcamera::Stream *currentStream = nullptr;
-	std::string currentStreamName = "";
 	if (options->Get().force_jpeg) {
-		currentStream = app.VideoStream();
-		currentStreamName = "JPEG";
+		streamName = "JPEG";
+		return app.VideoStream();
 	} else if (options->Get().force_still) {
-		currentStream = app.StillStream();
-		currentStreamName = "STILL";
-	} else {
-		currentStream = app.RawStream();
-		currentStreamName = "RAW";
+		streamName = "STILL";
+		return app.StillStream();
+	}
+	streamName = "RAW";
+	return app.RawStream();
+}
+
+static void restart_camera(LibcameraRaw &app)
+{
+	LOG_ERROR("ERROR: Device timeout detected, attempting a restart!!!");
+	try
+	{
+		app.RestartCamera();
+	}
+	catch (std::exception const &e)
+	{
+		LOG_ERROR("ERROR: fast restart failed (" << e.what() << "), restarting from scratch");
+		app.StopCamera();
+		app.StartCamera();
+	}
+}
+
+// The settings that can be changed while running, as the options start them off.
+static RuntimeSettings initial_settings(VideoOptions const *options)
+{
+	RuntimeSettings settings;
+	settings.lamp_pattern = options->Get().lamp_pattern;
+	settings.every_nth_frame = std::max(options->Get().every_nth_frame, 1u);
+	settings.capture_interval = options->Get().capture_interval;
+	settings.png_compression_level = options->Get().png_compression_level;
+	settings.parent_directory = options->Get().parent_directory;
+	return settings;
+}
+
+// Show the lamp pattern from its first colour, and wait until it is. With --lamp-upload (lampSteps given) the whole
+// pattern goes to the controller to step through by itself; "running" says the camera is already streaming, so that
+// which frame gets the first step is only known once the controller's count has been read back.
+static void start_lamp_pattern(GpioHandler &lampHandler, std::shared_ptr<LampScheduler> const &lampScheduler,
+							   std::shared_ptr<LampStepTracker> const &lampSteps, bool running)
+{
+	if (lampSteps) {
+		std::vector<std::string> pattern = lampHandler.getLampPattern();
+		auto armed = [lampSteps, pattern, running](GpioHandler::LampAck const &ack) {
+			if (ack.ok)
+				lampSteps->reset(pattern, !running, ack.time);
+		};
+		if (!lampHandler.queueUploadLampPattern(armed).get().ok)
+			LOG_ERROR("ERROR: failed to upload the lamp pattern");
+		return;
+	}
+	lampScheduler->onQueued();
+	lampHandler.queueNextLampColor(0, [lampScheduler](GpioHandler::LampAck const &ack) {
+		lampScheduler->onAck(ack);
+	}).wait();
+}
+
+// Only an uploaded pattern is read back, to keep the frames lined up with the controller's steps.
+static void start_lamp_readback(GpioHandler &lampHandler, std::shared_ptr<LampStepTracker> const &lampSteps)
+{
+	if (lampSteps)
+		lampHandler.startReadback(std::chrono::seconds(1), [lampSteps](GpioHandler::LampReadback const &reading) {
+			lampSteps->onReadback(reading);
+		});
+}
+
+// Switch the lamp to a new pattern between frames. Frames are attributed to colours by when they were exposed, so
+// the ones already on their way are still tagged right.
+static void change_lamp_pattern(GpioHandler &lampHandler, std::shared_ptr<LampScheduler> const &lampScheduler,
+								std::shared_ptr<LampStepTracker> const &lampSteps, std::string const &pattern)
+{
+	lampHandler.setLampPattern(pattern);
+	start_lamp_pattern(lampHandler, lampScheduler, lampSteps, true);
+	LOG(1, "Lamp pattern now " << pattern);
+}
+
+// Attribute the lamp color from when the frame was actually exposed, not from when we dequeued it, and record it in
+// the frame's metadata.
+static std::string tag_lamp_color(CompletedRequestPtr &completed_request, GpioHandler &lampHandler,
+								  LampScheduler &lampScheduler, LampStepTracker *lampSteps, VideoOptions const *options,
+								  long long count)
+{
+	std::string currentLampColor = lampHandler.getCurrentLampColor();
+	auto sensorTimestamp = completed_request->metadata.get(libcamera::controls::SensorTimestamp);
+	if (lampSteps) {
+		// The controller stepped on this frame's own trigger edge, so it's a matter of which step it was.
+		auto frameDuration = completed_request->metadata.get(libcamera::controls::FrameDuration);
+		currentLampColor = lampSteps->attribute(completed_request->sequence, sensorTimestamp ? *sensorTimestamp : 0,
+												sensorTimestamp && frameDuration ? *frameDuration * 1000LL : 0);
+	} else if (sensorTimestamp) {
+		auto exposureTime = completed_request->metadata.get(libcamera::controls::ExposureTime);
+		int64_t end = *sensorTimestamp + (exposureTime ? *exposureTime : 0) * 1000LL;
+		LampScheduler::Attribution attribution = lampScheduler.attribute(*sensorTimestamp, end);
+		currentLampColor = attribution.color;
+		if (attribution.mixed) {
+			LOG(2, "Lamp color changing during frame " << count);
+			completed_request->post_process_metadata.Set(metadata_tags::lamp_mixed, true);
+		}
+	}
+	completed_request->post_process_metadata.Set(metadata_tags::lamp_color, currentLampColor);
+	completed_request->post_process_metadata.Set(metadata_tags::camera_serial_number, options->Get().camera_serial_number);
+	return currentLampColor;
+}
+
+// Record when the lamp's strobe and the sensor's XVS were measured to rise, from the frame's SensorTimestamp. A strobe
+// is looked for from halfway through the gap before the exposure to halfway through the one after, so that one that
+// fired a little early or late still shows up, by its offset, against the frame it was meant for.
+static void tag_strobe(CompletedRequestPtr &completed_request, StrobeMonitor &strobeMonitor, OutputFrameInfo &frameInfo)
+{
+	auto sensorTimestamp = completed_request->metadata.get(libcamera::controls::SensorTimestamp);
+	auto exposureTime = completed_request->metadata.get(libcamera::controls::ExposureTime);
+	auto frameDuration = completed_request->metadata.get(libcamera::controls::FrameDuration);
+	if (!sensorTimestamp || !exposureTime || !frameDuration)
+		return;
+	int64_t start = *sensorTimestamp, exposure = *exposureTime * 1000LL, frame = *frameDuration * 1000LL;
+	int64_t margin = std::max<int64_t>(frame - exposure, 0) / 2;
+
+	if (auto edge = strobeMonitor.edge(StrobeMonitor::STROBE, start - margin, start + exposure + margin)) {
+		frameInfo.strobe_offset_ns = *edge - start;
+		completed_request->post_process_metadata.Set(metadata_tags::strobe_offset, *edge - start);
+		if (*edge < start || *edge > start + exposure)
+			LOG(2, "Strobe " << (*edge - start) / 1000 << "us from the start of frame " << frameInfo.sequence
+							 << ", outside its exposure");
+	} else if (strobeMonitor.watching(StrobeMonitor::STROBE))
+		LOG(2, "No strobe seen for frame " << frameInfo.sequence);
+	if (auto edge = strobeMonitor.edge(StrobeMonitor::XVS, start - frame / 2, start + frame / 2)) {
+		frameInfo.xvs_offset_ns = *edge - start;
+		completed_request->post_process_metadata.Set(metadata_tags::xvs_offset, *edge - start);
+	}
+}
+
+// With --bracket-exposure, record which step of the exposures the frame was taken with.
+static void tag_bracket_step(CompletedRequestPtr &completed_request, OutputFrameInfo &frameInfo)
+{
+	if (!completed_request->control_step) {
+		LOG(2, "Frame " << frameInfo.sequence << " doesn't match any bracketing step");
+		return;
+	}
+	frameInfo.bracket_step = *completed_request->control_step;
+	completed_request->post_process_metadata.Set(metadata_tags::bracket_step, *completed_request->control_step);
+}
+
+// Pass on what the particle_analysis stage found, if it ran, for the metadata sidecar.
+static void tag_particles(CompletedRequestPtr &completed_request, OutputFrameInfo &frameInfo)
+{
+	if (auto particles = completed_request->post_process_metadata.Find(metadata_tags::particle_analysis_results))
+		frameInfo.particles = *particles;
+}
+
+// Watches the strobe and XVS lines, if we were asked to.
+static std::unique_ptr<StrobeMonitor> make_strobe_monitor(VideoOptions const *options)
+{
+	if (options->Get().strobe_gpio.empty() && options->Get().xvs_gpio.empty())
+		return nullptr;
+	return std::make_unique<StrobeMonitor>(options->Get().strobe_gpio, options->Get().xvs_gpio);
+}
+
+// Daemon mode: keep the camera streaming, with AGC/AWB converged and buffers and encoder ready, and capture bursts of
+// frames when asked over the --daemon-socket. Between bursts every frame is handed straight back to the camera. A
+// burst starts with the first frame to arrive after its command, once any new lamp pattern is showing.
+static void daemon_loop(LibcameraRaw &app, GpioHandler *lampHandler)
+{
+	VideoOptions *options = app.GetOptions();
+	RuntimeSettingsStore settingsStore(initial_settings(options));
+	CaptureServer server(options->Get().daemon_socket, &settingsStore);
+
+	// Each burst gets an Output of its own, so that it can write to its own directory. It is only replaced while
+	// the encoder is idle.
+	std::unique_ptr<Output> output;
+	app.SetEncodeOutputReadyCallback([&output](void *mem, size_t size, int64_t timestamp_us, bool keyframe) {
+		if (output)
+			output->OutputReady(mem, size, timestamp_us, keyframe);
+	});
+	app.SetMetadataReadyCallback([&output](libcamera::ControlList &metadata) {
+		if (output)
+			output->MetadataReady(metadata);
+	});
+
+	auto lampScheduler = std::make_shared<LampScheduler>();
+	auto recordLampChange = [lampScheduler](GpioHandler::LampAck const &ack) { lampScheduler->onAck(ack); };
+	std::shared_ptr<LampStepTracker> lampSteps;
+	if (options->Get().lamp_upload)
+		lampSteps = std::make_shared<LampStepTracker>();
+	std::unique_ptr<StrobeMonitor> strobeMonitor = make_strobe_monitor(options);
+	if (lampHandler) {
+		start_lamp_pattern(*lampHandler, lampScheduler, lampSteps, false);
+		start_lamp_readback(*lampHandler, lampSteps);
 	}
+	std::string streamName;
+	libcamera::Stream *stream = start_app(app, streamName);
+	StreamInfo info = app.GetStreamInfo(stream);
+	// --max-throughput may have changed some of them.
+	if (options->Get().max_throughput)
+		settingsStore.reset(initial_settings(options));
+	std::shared_ptr<RuntimeSettings const> settings = settingsStore.get();
+	uint64_t settingsGeneration = settingsStore.generation();
+	LOG(1, "Daemon listening on " << options->Get().daemon_socket << ", " << streamName << " stream "
+								  << info.width << "x" << info.height);
+
+	std::optional<CaptureServer::Command> burst;
+	unsigned int burstFrames = 0;
+	long long burstCount = 0;
+	auto finishBurst = [&]() {
+		// Let the encoder finish everything from this burst before the output goes.
+		app.StopEncoder();
+		output.reset();
+		app.StartEncoder();
+		server.finished(*burst, burstFrames);
+		LOG(1, "Capture " << burst->id << " finished, " << burstFrames << " frames");
+		burst.reset();
+	};
+
+	for (bool warmedUp = false; ;)
+	{
+		dump_trace_if_signalled(options);
+		if (signal_received == SIGTERM || signal_received == SIGINT || server.quitRequested()) {
+			LOG(1, "Daemon shutting down");
+			if (burst)
+				finishBurst();
+			app.StopCamera();
+			app.StopEncoder();
+			return;
+		}
+
+		LibcameraRaw::Msg msg = app.Wait();
+		if (msg.type == RPiCamApp::MsgType::Timeout)
+		{
+			restart_camera(app);
+			continue;
+		}
+		if (msg.type != LibcameraRaw::MsgType::RequestComplete)
+			throw std::runtime_error("unrecognised message!");
+		if (!warmedUp) {
+			// Skip the first frame to allow the camera to warm up
+			warmedUp = true;
+			continue;
+		}
+
+		// New settings take effect between bursts, each of which runs under the settings it started with. A burst's
+		// own pattern and directory still win for that burst.
+		if (!burst && settingsStore.generation() != settingsGeneration) {
+			settingsGeneration = settingsStore.generation();
+			std::shared_ptr<RuntimeSettings const> next = settingsStore.get();
+			if (lampHandler && next->lamp_pattern != settings->lamp_pattern)
+				change_lamp_pattern(*lampHandler, lampScheduler, lampSteps, next->lamp_pattern);
+			settings = next;
+			LOG(1, "Settings now " << settings->toString());
+		}
+
+		if (!burst && (burst = server.poll())) {
+			if (!burst->frames)
+				burst->frames = std::max(options->Get().total_frames, 1u);
+			options->Set().parent_directory = burst->dir.empty() ? settings->parent_directory : burst->dir;
+			output = std::unique_ptr<Output>(Output::Create(options));
+			output->setStreamInfo(&info);
+			if (lampHandler && !burst->pattern.empty()) {
+				lampHandler->setLampPattern(burst->pattern);
+				start_lamp_pattern(*lampHandler, lampScheduler, lampSteps, true);
+			}
+			burstFrames = 0;
+			burstCount = 0;
+			LOG(1, "Capture " << burst->id << ": " << burst->frames << " frames to " << options->Get().parent_directory);
+			// Frames that came in while we were setting up were exposed before the burst was ready.
+			continue;
+		}
+		if (!burst)
+			continue;
+
+		long long count = burstCount++;
+		long long everyNth = settings->every_nth_frame;
+		if (everyNth > 1 && count % everyNth != 0)
+			continue;
+
+		CompletedRequestPtr completed_request = std::get<CompletedRequestPtr>(msg.payload);
+		completed_request->post_process_metadata.Set(metadata_tags::png_compression_level,
+													 settings->png_compression_level);
+		OutputFrameInfo frameInfo = { completed_request->sequence, "" };
+		completed_request->post_process_metadata.Get(metadata_tags::change_gate_suppressed,
+													 frameInfo.suppressed_before);
+		tag_particles(completed_request, frameInfo);
+		if (lampHandler)
+			frameInfo.lamp_color = tag_lamp_color(completed_request, *lampHandler, *lampScheduler, lampSteps.get(), options, count);
+		if (strobeMonitor)
+			tag_strobe(completed_request, *strobeMonitor, frameInfo);
+		if (!options->Get().bracket_exposures.empty())
+			tag_bracket_step(completed_request, frameInfo);
+		output->FrameInfoReady(frameInfo);
+		if (!app.EncodeBuffer(completed_request, stream)) {
+			output->WithdrawFrameInfo();
+			continue;
+		}
+		auto wallClock = completed_request->metadata.get(libcamera::controls::FrameWallClock);
+		server.frame(*burst, burstFrames, completed_request->sequence, wallClock ? *wallClock : 0);
+		if (lampHandler && options->Get().lamp_cycle) {
+			lampScheduler->onQueued();
+			lampHandler->queueNextLampColor(count, recordLampChange);
+		}
+		if (++burstFrames == burst->frames)
+			finishBurst();
+	}
+}
+
+// --benchmark: push frames through the same encoder and output that a capture would use, but with no camera, to see
+// how each format fares. The frames are made up, or read from --benchmark-input, and are held in a few buffers that
+// must come back from the encoder before they are used again, just as the camera's must. With a --framerate, a frame
+// whose turn comes round with no buffer free is dropped, as the camera would drop it.
+
+static constexpr unsigned int BENCHMARK_BUFFERS = 4;
+
+static int64_t steady_us()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+			   std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// The formats to try: the raw ones for DNG, YUV420 for JPEG, and both for PNG.
+static std::vector<libcamera::PixelFormat> benchmark_formats(VideoOptions const *options)
+{
+	bool jpeg = options->Get().force_jpeg || options->Get().force_still;
+	std::vector<libcamera::PixelFormat> formats;
+	if (!jpeg)
+		formats = DngWriter::Formats();
+	if (jpeg || options->Get().force_png)
+		formats.push_back(libcamera::formats::YUV420);
+	if (options->Get().benchmark_format == "all")
+		return formats;
+
+	libcamera::PixelFormat format = libcamera::PixelFormat::fromString(options->Get().benchmark_format);
+	if (std::find(formats.begin(), formats.end(), format) == formats.end())
+		throw std::runtime_error("the encoder can't take --benchmark-format " + options->Get().benchmark_format);
+	return { format };
+}
+
+static StreamInfo benchmark_stream(libcamera::PixelFormat const &format, unsigned int width, unsigned int height)
+{
+	StreamInfo info;
+	info.width = width;
+	info.height = height;
+	info.pixel_format = format;
+	unsigned int row_bytes = info.width;
+	if (format == libcamera::formats::YUV420)
+	{
+		info.width &= ~1, info.height &= ~1;
+		info.colour_space = libcamera::ColorSpace::Sycc;
+	}
+	else
+		row_bytes = DngWriter::RowBytes(format, info.width);
+	// Rows are padded as libcamera pads them.
+	info.stride = (row_bytes + 63) & ~63;
+	return info;
+}
+
+// A gradient with some noise on it, so that the compressors have something like a real image to work on. Frames of
+// 16-bit samples get 10-bit values, which suit whatever depth they are meant to be.
+static void make_frame(uint8_t *mem, StreamInfo const &info, unsigned int n)
+{
+	uint32_t noise = 12345 + n;
+	auto next = [&noise]() {
+		noise = noise * 1664525 + 1013904223;
+		return noise >> 28;
+	};
+	bool yuv = info.pixel_format == libcamera::formats::YUV420;
+	unsigned int row_bytes = yuv ? info.width : DngWriter::RowBytes(info.pixel_format, info.width);
+	bool wide = !yuv && row_bytes == 2 * info.width;
+	for (unsigned int y = 0; y < info.height; y++)
+	{
+		uint8_t *row = mem + (size_t)y * info.stride;
+		if (wide)
+		{
+			uint16_t *samples = (uint16_t *)row;
+			for (unsigned int x = 0; x < info.width; x++)
+				samples[x] = ((x + y + n) * 1023 / (info.width + info.height) + next()) & 1023;
+		}
+		else
+		{
+			for (unsigned int x = 0; x < row_bytes; x++)
+				row[x] = ((x + y + n) * 255 / (row_bytes + info.height) + next()) & 255;
+		}
+	}
+	if (yuv)
+		memset(mem + (size_t)info.stride * info.height, 128, (size_t)info.stride * info.height / 2);
+}
+
+// Fill the buffers from a file of frames laid end to end, going round again if it holds fewer frames than buffers.
+static void read_frames(std::string const &filename, std::vector<std::vector<uint8_t>> &buffers)
+{
+	std::ifstream file(filename, std::ios::binary);
+	if (!file)
+		throw std::runtime_error("failed to open benchmark input " + filename);
+	unsigned int frames = 0;
+	while (frames < buffers.size() && file.read((char *)buffers[frames].data(), buffers[frames].size()))
+		frames++;
+	if (!frames)
+		throw std::runtime_error("benchmark input " + filename + " holds less than one frame");
+	for (unsigned int i = frames; i < buffers.size(); i++)
+		buffers[i] = buffers[i % frames];
+}
+
+struct BenchmarkResult
+{
+	double fps; // frames encoded and output a second
+	double bytes_per_frame;
+};
+
+// Push count frames of the given stream through. When planning (for --max-throughput) the frames are always made up,
+// go as fast as they can and are not written anywhere, and the results are only logged at verbose level 2.
+static BenchmarkResult benchmark_format(VideoOptions const *options, StreamInfo info, unsigned int count,
+										bool planning = false)
+{
+	libcamera::PixelFormat const &format = info.pixel_format;
+	size_t size = (size_t)info.stride * info.height * (format == libcamera::formats::YUV420 ? 3 : 2) / 2;
+	std::vector<std::vector<uint8_t>> buffers(BENCHMARK_BUFFERS, std::vector<uint8_t>(size));
+	if (!planning && !options->Get().benchmark_input.empty())
+		read_frames(options->Get().benchmark_input, buffers);
+	else
+	{
+		for (unsigned int i = 0; i < buffers.size(); i++)
+			make_frame(buffers[i].data(), info, i);
+	}
+
+	std::unique_ptr<Output> output(planning ? new Output(options) : Output::Create(options));
+	output->setStreamInfo(&info);
+	std::unique_ptr<Encoder> encoder(create_encoder(options, info));
+	if (encoder->UsesDmabuf())
+		throw std::runtime_error("--benchmark needs an encoder that reads frames from memory (try --jpeg-encoder "
+								 "libjpeg)");
+
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::vector<uint8_t *> free_buffers;
+	std::deque<uint8_t *> busy_buffers;
+	for (auto &buffer : buffers)
+		free_buffers.push_back(buffer.data());
+	std::vector<int64_t> latencies;
+	unsigned int outputs = 0, failed = 0;
+	uint64_t bytes_out = 0;
+
+	// A null buffer means the oldest one the encoder still has.
+	encoder->SetInputDoneCallback([&](void *mem) {
+		std::lock_guard<std::mutex> lock(mutex);
+		auto it = mem ? std::find(busy_buffers.begin(), busy_buffers.end(), mem) : busy_buffers.begin();
+		if (it == busy_buffers.end())
+			return;
+		free_buffers.push_back(*it);
+		busy_buffers.erase(it);
+		cond.notify_all();
+	});
+	// Latency is from handing the frame to the encoder until it has been output.
+	encoder->SetOutputReadyCallback([&](void *mem, size_t len, int64_t timestamp_us, bool keyframe) {
+		output->OutputReady(mem, len, timestamp_us, keyframe);
+		int64_t latency = steady_us() - timestamp_us;
+		std::lock_guard<std::mutex> lock(mutex);
+		if (mem)
+		{
+			latencies.push_back(latency);
+			bytes_out += len;
+		}
+		else
+			failed++;
+		outputs++;
+		cond.notify_all();
+	});
+
+	libcamera::ControlList metadata(libcamera::controls::controls);
+	metadata.set(libcamera::controls::ExposureTime, 10000);
+	metadata.set(libcamera::controls::AnalogueGain, 2.0f);
+	metadata.set(libcamera::controls::ColourGains, libcamera::Span<const float, 2>({ 2.0f, 1.5f }));
+
+	std::chrono::duration<double> period(0);
+	if (!planning && options->Get().framerate && *options->Get().framerate > 0)
+		period = std::chrono::duration<double>(1.0 / *options->Get().framerate);
+	struct rusage usage_start, usage_end;
+	getrusage(RUSAGE_SELF, &usage_start);
+	uint64_t allocations = BufferPool::Allocations(), reuses = BufferPool::Reuses();
+	auto start = std::chrono::steady_clock::now();
+
+	unsigned int pushed = 0, dropped = 0;
+	for (unsigned int i = 0; i < count && !signal_received; i++)
+	{
+		if (period.count())
+			std::this_thread::sleep_until(start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+													  i * period));
+		uint8_t *mem;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			if (period.count() && free_buffers.empty())
+			{
+				dropped++;
+				continue;
+			}
+			cond.wait(lock, [&] { return !free_buffers.empty(); });
+			mem = free_buffers.back();
+			free_buffers.pop_back();
+			busy_buffers.push_back(mem);
+		}
+		output->FrameInfoReady({ i, "" });
+		encoder->EncodeBuffer(-1, size, mem, info, steady_us(), Metadata(), metadata);
+		pushed++;
+	}
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		cond.wait(lock, [&] { return outputs == pushed; });
+	}
+
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	getrusage(RUSAGE_SELF, &usage_end);
+	allocations = BufferPool::Allocations() - allocations;
+	reuses = BufferPool::Reuses() - reuses;
+	encoder.reset();
+	output.reset();
+
+	auto cpu_seconds = [](struct rusage const &usage) {
+		return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+	};
+	double cpu = cpu_seconds(usage_end) - cpu_seconds(usage_start);
+	std::sort(latencies.begin(), latencies.end());
+	auto percentile = [&latencies](double p) {
+		if (latencies.empty())
+			return 0.0;
+		return latencies[std::min<size_t>(latencies.size() - 1, p * latencies.size())] / 1000.0;
+	};
+	unsigned int frames = latencies.size();
+	unsigned int level = planning ? 2 : 1;
+	LOG(level, format.toString() << " " << info.width << "x" << info.height << ": " << frames << " frames in "
+								 << elapsed.count() << "s, " << frames / elapsed.count() << " fps, "
+								 << bytes_out / elapsed.count() / 1e6 << " MB/s out");
+	LOG(level, "    latency ms: p50 " << percentile(0.5) << " p90 " << percentile(0.9) << " p99 "
+									   << percentile(0.99) << " max " << percentile(1.0));
+	LOG(level, "    cpu " << (frames ? cpu * 1000 / frames : 0.0) << " ms/frame, " << allocations
+						  << " pool allocations (" << reuses << " reused), " << dropped << " dropped, " << failed
+						  << " failed");
+	return { frames / elapsed.count(), frames ? (double)bytes_out / frames : 0.0 };
+}
+
+static void benchmark(VideoOptions const *options)
+{
+	std::vector<libcamera::PixelFormat> formats = benchmark_formats(options);
+	if (formats.size() > 1 && !options->Get().benchmark_input.empty())
+		throw std::runtime_error("--benchmark-input needs a single --benchmark-format");
+
+	LOG(1, "Benchmarking " << options->Get().benchmark << " frames of " << formats.size() << " format(s)");
+	for (auto const &format : formats)
+	{
+		if (signal_received)
+			break;
+		StreamInfo info = benchmark_stream(format, options->Get().width ? options->Get().width : 4056,
+										   options->Get().height ? options->Get().height : 3040);
+		benchmark_format(options, info, options->Get().benchmark);
+	}
+}
+
+// --max-throughput: before the camera is configured, measure how fast frames of each sensor mode can be unpacked and
+// encoded (by running them through benchmark_format) and how fast the --parent-directory takes them, and choose the
+// mode, bit depth and decimation that deliver the most pixels a second while leaving some headroom, so that the
+// capture keeps up without dropping frames. The measurements can be kept in a --throughput-cache, one per line as
+// tab-separated fields followed by the figures, and are only made again when the settings they depend on change.
+
+static constexpr unsigned int PLAN_FRAMES = 24;
+static constexpr double PLAN_HEADROOM = 0.8;
+static constexpr size_t STORAGE_TEST_BYTES = 128 << 20;
+static constexpr size_t STORAGE_TEST_CHUNK = 4 << 20;
+
+using ThroughputCache = std::map<std::string, std::vector<double>>;
+
+static ThroughputCache load_throughput_cache(std::string const &filename)
+{
+	ThroughputCache cache;
+	if (filename.empty())
+		return cache;
+	std::ifstream file(filename);
+	std::string line;
+	while (std::getline(file, line))
+	{
+		size_t tab = line.rfind('\t');
+		if (tab == std::string::npos)
+			continue;
+		std::istringstream fields(line.substr(tab + 1));
+		std::vector<double> values;
+		for (double value; fields >> value;)
+			values.push_back(value);
+		if (!values.empty())
+			cache[line.substr(0, tab)] = values;
+	}
+	return cache;
+}
+
+static void save_throughput_cache(std::string const &filename, ThroughputCache const &cache)
+{
+	std::string tmp = filename + ".tmp";
+	{
+		std::ofstream file(tmp, std::ios::trunc);
+		for (auto const &[key, values] : cache)
+		{
+			file << key << "\t";
+			for (unsigned int i = 0; i < values.size(); i++)
+				file << (i ? " " : "") << values[i];
+			file << "\n";
+		}
+		if (!file)
+		{
+			LOG_ERROR("WARNING: failed to write throughput cache " << tmp);
+			return;
+		}
+	}
+	if (rename(tmp.c_str(), filename.c_str()))
+		LOG_ERROR("WARNING: failed to rename throughput cache into place at " << filename);
+}
+
+// Sustained write speed to the directory in bytes a second, flushed to the device so that the page cache doesn't
+// flatter it.
+static double measure_storage(std::string const &dir)
+{
+	std::string filename = dir + "/.rpicam-raw-write-test";
+	int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		throw std::runtime_error("failed to open " + filename + ": " + strerror(errno));
+	std::vector<uint8_t> chunk(STORAGE_TEST_CHUNK, 0x5a);
+	auto start = std::chrono::steady_clock::now();
+	size_t written = 0;
+	bool ok = true;
+	while (written < STORAGE_TEST_BYTES && ok)
+	{
+		ssize_t n = write(fd, chunk.data(), chunk.size());
+		ok = n > 0;
+		written += ok ? n : 0;
+	}
+	ok = ok && fdatasync(fd) == 0;
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	int err = errno;
+	close(fd);
+	unlink(filename.c_str());
+	if (!ok)
+		throw std::runtime_error("failed to write " + filename + ": " + strerror(err));
+	return written / elapsed.count();
+}
+
+// The format to encode frames of the sensor mode from: its own if the DNG writer takes it, or else one as deep.
+static libcamera::PixelFormat plan_format(RPiCamApp::SensorMode const &sensor_mode)
+{
+	std::vector<libcamera::PixelFormat> formats = DngWriter::Formats();
+	if (std::find(formats.begin(), formats.end(), sensor_mode.format) != formats.end())
+		return sensor_mode.format;
+	for (auto const &format : formats)
+	{
+		if (RPiCamApp::SensorMode(sensor_mode.size, format, 0).depth() == sensor_mode.depth())
+			return format;
+	}
+	return {};
+}
+
+// Called with the camera open, so that its sensor modes (and their fastest framerates) are known, but before it is
+// configured. Any --mode, --force-8-bit, --force-10-bit, --framerate or --every-nth-frame the user gives narrows
+// the choice rather than being overridden.
+static void plan_max_throughput(LibcameraRaw &app)
+{
+	VideoOptions *options = app.GetOptions();
+	std::string const &cache_file = options->Get().throughput_cache;
+	ThroughputCache cache = load_throughput_cache(cache_file);
+	bool updated = false;
+	auto measured = [&](std::string const &key, auto &&measure) {
+		auto it = cache.find(key);
+		if (it != cache.end())
+			return it->second;
+		updated = true;
+		return cache[key] = measure();
+	};
+
+	std::string dir = options->Get().parent_directory.empty() ? "." : options->Get().parent_directory;
+	double storage = measured("storage\t" + dir, [&]() { return std::vector<double> { measure_storage(dir) }; })[0];
+	LOG(1, "Max throughput: storage takes " << storage / 1e6 << " MB/s");
+
+	Mode const &wanted = options->Get().mode;
+	std::vector<bool> eight_bit_choices = { false, true };
+	if (options->Get().force_8_bit)
+		eight_bit_choices = { true };
+	else if (options->Get().force_10_bit)
+		eight_bit_choices = { false };
+	bool force_8_bit = options->Get().force_8_bit;
+
+	struct Plan
+	{
+		RPiCamApp::SensorMode sensor_mode;
+		bool eight_bit;
+		unsigned int every_nth_frame;
+		double fps; // frames saved a second
+		double score;
+	};
+	std::optional<Plan> best;
+	for (auto const &sensor_mode : app.GetSensorModes())
+	{
+		if ((wanted.width && sensor_mode.size.width != wanted.width) ||
+			(wanted.height && sensor_mode.size.height != wanted.height) ||
+			(wanted.bit_depth && sensor_mode.depth() != wanted.bit_depth))
+			continue;
+		libcamera::PixelFormat format = plan_format(sensor_mode);
+		if (!format.isValid())
+			continue;
+		double camera_fps = sensor_mode.fps;
+		if (options->Get().framerate && *options->Get().framerate > 0)
+			camera_fps = camera_fps > 0 ? std::min<double>(camera_fps, *options->Get().framerate)
+										: *options->Get().framerate;
+
+		for (bool eight_bit : eight_bit_choices)
+		{
+			if (eight_bit && sensor_mode.depth() == 8 && eight_bit_choices.size() > 1)
+				continue; // the same as not forcing it
+			std::ostringstream key;
+			key << "encode\t" << format.toString() << "\t" << sensor_mode.size.width << "\t"
+				<< sensor_mode.size.height << "\t" << eight_bit << "\t" << options->Get().dng_compression
+				<< (options->Get().dng_fast ? ",fast" : "") << "," << options->Get().encode_threads;
+			std::vector<double> encode = measured(key.str(), [&]() {
+				options->Set().force_8_bit = eight_bit;
+				StreamInfo info = benchmark_stream(format, sensor_mode.size.width, sensor_mode.size.height);
+				BenchmarkResult result = benchmark_format(options, info, PLAN_FRAMES, true);
+				options->Set().force_8_bit = force_8_bit;
+				return std::vector<double> { result.fps, result.bytes_per_frame };
+			});
+			if (encode.size() < 2 || encode[0] <= 0 || encode[1] <= 0)
+				continue;
+
+			double fps = std::min(encode[0], storage / encode[1]) * PLAN_HEADROOM;
+			unsigned int every_nth_frame = std::max(options->Get().every_nth_frame, 1u);
+			if (camera_fps > fps)
+				every_nth_frame = std::max<unsigned int>(every_nth_frame, std::ceil(camera_fps / fps));
+			if (camera_fps > 0)
+				fps = camera_fps / every_nth_frame;
+			// Take 8 bits only when they deliver clearly more.
+			double score = fps * sensor_mode.size.width * sensor_mode.size.height * (eight_bit ? 0.9 : 1.0);
+			LOG(2, "Max throughput: " << sensor_mode.ToString() << (eight_bit ? " 8-bit" : "") << " encodes at "
+									  << encode[0] << " fps, " << encode[1] / 1e6 << " MB/frame, so every "
+									  << every_nth_frame << " frames, " << fps << " fps");
+			if (!best || score > best->score)
+				best = Plan { sensor_mode, eight_bit, every_nth_frame, fps, score };
+		}
+	}
+
+	if (updated && !cache_file.empty())
+		save_throughput_cache(cache_file, cache);
+	if (!best)
+		throw std::runtime_error("--max-throughput found no sensor mode to plan with");
+
+	options->Set().mode = Mode(best->sensor_mode.size.width, best->sensor_mode.size.height,
+							   best->sensor_mode.depth(), true);
+	options->Set().force_8_bit = best->eight_bit;
+	options->Set().every_nth_frame = best->every_nth_frame;
+	LOG(1, "Max throughput: chose mode " << options->Get().mode.ToString() << (best->eight_bit ? ", 8-bit" : "")
+										 << ", every " << best->every_nth_frame << " frames, " << best->fps
+										 << " fps saved");
+}
+
+// --raw-ring: copy a frame into the ring, so that its request can go straight back to the camera.
+static void keep_in_ring(LibcameraRaw &app, RawRing &ring, CompletedRequestPtr &completed_request,
+						 libcamera::Stream *stream, StreamInfo const &info, OutputFrameInfo const &frameInfo)
+{
+	libcamera::FrameBuffer *buffer = completed_request->buffers[stream];
+	BufferReadSync r(&app, buffer);
+	libcamera::Span span = r.Get()[0];
+	auto wallClock = completed_request->metadata.get(libcamera::controls::FrameWallClock);
+	int64_t timestamp_us = wallClock ? *wallClock : buffer->metadata().timestamp / 1000;
+	RawRing::Frame frame = { nullptr, span.size(), info, timestamp_us, completed_request->post_process_metadata,
+							 completed_request->metadata, frameInfo };
+	if (!ring.push(span.data(), std::move(frame)))
+		LOG(2, "Raw ring still being saved, frame " << frameInfo.sequence << " not kept");
+}
+
+// Hand everything in the ring to the encoder, oldest first. Returns how many frames that was.
+static unsigned int save_raw_ring(LibcameraRaw &app, RawRing &ring, Output &output)
+{
+	std::deque<RawRing::Frame> frames = ring.take();
+	for (RawRing::Frame &frame : frames)
+	{
+		output.FrameInfoReady(frame.frame_info);
+		app.EncodeCopy(frame.mem, frame.size, frame.info, frame.timestamp_us, frame.post_process_metadata,
+					   frame.metadata);
+	}
+	LOG(1, "Raw ring triggered, saving " << frames.size() << " frames, " << ring.framesLost()
+										 << " lost so far while saving");
+	return frames.size();
+}
+
+// The main even loop for the application.
+
+static void event_loop(LibcameraRaw &app, GpioHandler* lampHandler)
+{
+	unsigned int framesCaptured = 0;
+	StreamInfo info;
+	VideoOptions *options = app.GetOptions();
+	std::unique_ptr<Output> output = std::unique_ptr<Output>(Output::Create(options));
+	app.SetEncodeOutputReadyCallback(std::bind(&Output::OutputReady, output.get(), _1, _2, _3, _4));
+	app.SetMetadataReadyCallback(std::bind(&Output::MetadataReady, output.get(), _1));
+
+	// The storage governor and the uploader keep watching the directory they were started on, so that can't change
+	// under them.
+	bool governed = options->Get().storage_policy != "none";
+	bool uploading = !options->Get().upload_url.empty();
+	RuntimeSettingsStore settingsStore(initial_settings(options),
+									   [governed, uploading](RuntimeSettings const &old, RuntimeSettings const &next) {
+										   if (governed && next.parent_directory != old.parent_directory)
+											   return std::string("dir can't change under a --storage-policy");
+										   if (uploading && next.parent_directory != old.parent_directory)
+											   return std::string("dir can't change under an --upload-url");
+										   return std::string();
+									   });
+	std::unique_ptr<CaptureServer> controlServer;
+	if (!options->Get().control_socket.empty())
+		controlServer = std::make_unique<CaptureServer>(options->Get().control_socket, &settingsStore, false);
+
+	// Shared with the lamp I/O thread, which may still be finishing a change after we return.
+	auto lampScheduler = std::make_shared<LampScheduler>();
+	auto recordLampChange = [lampScheduler](GpioHandler::LampAck const &ack) { lampScheduler->onAck(ack); };
+	std::shared_ptr<LampStepTracker> lampSteps;
+	if (options->Get().lamp_upload)
+		lampSteps = std::make_shared<LampStepTracker>();
+	std::unique_ptr<StrobeMonitor> strobeMonitor = make_strobe_monitor(options);
+	if (lampHandler) {
+		start_lamp_pattern(*lampHandler, lampScheduler, lampSteps, false);
+		start_lamp_readback(*lampHandler, lampSteps);
+	}
+	// Frames are only saved once triggered, when the ring is saved and then the next --raw-ring-post frames are
+	// encoded as they come. The encoder may still hold copies from the ring after we return.
+	std::shared_ptr<RawRing> rawRing;
+	unsigned int ringPostFrames = 0;
+	if (options->Get().raw_ring) {
+		rawRing = std::make_shared<RawRing>(options->Get().raw_ring);
+		app.SetCopyDoneCallback([rawRing](void *mem) { rawRing->release(mem); });
+	}
+	std::unique_ptr<StorageGovernor> storageGovernor;
+	if (options->Get().storage_policy != "none") {
+		StorageGovernor::Policy policy = StorageGovernor::Policy::Stop;
+		if (options->Get().storage_policy == "decimate")
+			policy = StorageGovernor::Policy::Decimate;
+		else if (options->Get().storage_policy == "ring")
+			policy = StorageGovernor::Policy::Ring;
+		auto endTime = std::chrono::steady_clock::time_point::max();
+		if (options->Get().timeout)
+			endTime = std::chrono::steady_clock::now() + options->Get().timeout.value;
+		storageGovernor = std::make_unique<StorageGovernor>(
+			options->Get().parent_directory, options->Get().output_directory, policy,
+			(uint64_t)options->Get().min_free_space << 20, std::chrono::seconds(options->Get().storage_check_interval),
+			1 + options->Get().dir_lookahead, endTime);
+	}
+	// Directories go up once we've moved on from them, backing off whenever the files being written start to queue.
+	std::unique_ptr<Uploader> uploader;
+	if (uploading)
+		uploader = std::make_unique<Uploader>(
+			options->Get().upload_url, options->Get().parent_directory, options->Get().output_directory,
+			options->Get().upload_rate * 1e6, options->Get().upload_delete, 1 + options->Get().dir_lookahead,
+			[]() { return FileWriter::QueueDepth(); }, options->Get().upload_backoff_depth,
+			[](std::string const &directory) { return FileWriter::Writing(directory); });
+	std::unique_ptr<ThermalGovernor> thermalGovernor;
+	if (options->Get().thermal_limit)
+		thermalGovernor = std::make_unique<ThermalGovernor>(options->Get().thermal_limit,
+															options->Get().thermal_hysteresis);
+
+	// Thin the frames out on the camera thread, so that the ones we don't want are re-queued without ever being
+	// post-processed. The first frame always comes through, to be skipped below while the camera warms up. Frames
+	// also come through once we have been signalled or have run out of time, so that the loop below notices.
+	long long filterCount = -1;
+	int64_t firstTimestamp = 0, lastCaptureTimestamp = 0;
+	int64_t timeoutNs = std::chrono::duration_cast<std::chrono::nanoseconds>(options->Get().timeout.value).count();
+	StorageGovernor const *governor = storageGovernor.get();
+	ThermalGovernor const *thermal = thermalGovernor.get();
+	app.SetFrameFilter([&, governor, thermal](uint64_t, int64_t timestamp) {
+		long long count = filterCount++;
+		if (count < 0) {
+			firstTimestamp = lastCaptureTimestamp = timestamp;
+			return true;
+		}
+		if (signal_received || (governor && governor->shouldStop()) ||
+			(timeoutNs && timestamp - firstTimestamp > timeoutNs))
+			return true;
+		std::shared_ptr<RuntimeSettings const> settings = settingsStore.get();
+		if (settings->capture_interval > 0.0f) {
+			if (timestamp - lastCaptureTimestamp < (int64_t)(settings->capture_interval * 1e9))
+				return false;
+			lastCaptureTimestamp = timestamp;
+			return true;
+		}
+		// The storage governor may be thinning out frames further to save space, and the thermal governor to keep
+		// the SoC cool.
+		long long everyNth = settings->every_nth_frame;
+		if (governor)
+			everyNth *= governor->decimation();
+		if (thermal)
+			everyNth *= thermal->decimation();
+		return count % everyNth == 0;
+	});
+	// The filter refers to locals here, and the camera thread keeps calling it until the camera stops, so take it
+	// away however we leave, before they go.
+	struct FilterReset
+	{
+		LibcameraRaw &app;
+		~FilterReset() { app.SetFrameFilter(nullptr); }
+	} filterReset { app };
+
+	std::string currentStreamName;
+	libcamera::Stream *currentStream = start_app(app, currentStreamName);
+	auto start_time = std::chrono::high_resolution_clock::now();
+	// --max-throughput may have changed some of them.
+	if (options->Get().max_throughput)
+		settingsStore.reset(initial_settings(options));
+	std::shared_ptr<RuntimeSettings const> settings = settingsStore.get();
+	uint64_t settingsGeneration = settingsStore.generation();
+
+	bool autoBufferCount = options->Get().auto_buffer_count && !options->Get().buffer_count &&
+						   currentStream == app.RawStream();
+	uint64_t framesDropped = 0;
 
 	// TODO: handle timelapses where the requested framerate is less than one a second
 	for (long long count = -1; ; count++)
 	{
+		dump_trace_if_signalled(options);
 		// Check for termination signals
-		if (signal_received == SIGTERM || signal_received == SIGINT) {
-			LOG(1, "Shutting down due to signal " << signal_received);
+		if (signal_received == SIGTERM || signal_received == SIGINT ||
+			(controlServer && controlServer->quitRequested())) {
+			if (signal_received)
+				LOG(1, "Shutting down due to signal " << signal_received);
+			else
+				LOG(1, "Shutting down as asked over the control socket");
 			app.StopCamera();
 			app.StopEncoder();
 			return;
 		}
+
+		// If frames are being dropped and the measured encode latency says we need more buffers, reconfigure with
+		// more. The encoder is restarted too, which finishes off everything it's holding before the buffers go.
+		if (autoBufferCount && app.GetStallStats().frames_dropped > framesDropped) {
+			framesDropped = app.GetStallStats().frames_dropped;
+			unsigned int wanted = app.AutoBufferCount();
+			if (wanted > currentStream->configuration().bufferCount) {
+				LOG(1, "Frames dropped, increasing raw buffers from " << currentStream->configuration().bufferCount
+						<< " to " << wanted);
+				app.StopCamera();
+				app.StopEncoder();
+				app.Teardown();
+				app.ConfigureRawStream();
+				app.StartEncoder();
+				app.StartCamera();
+				currentStream = app.RawStream();
+			}
+		}
 		LibcameraRaw::Msg msg = app.Wait();
 
 		if (count == -1) {
@@ -104,9 +1092,7 @@ static void event_loop(LibcameraRaw &app, GpioHandler* lampHandler)
 
 		if (msg.type == RPiCamApp::MsgType::Timeout)
 		{
-			LOG_ERROR("ERROR: Device timeout detected, attempting a restart!!!");
-			app.StopCamera();
-			app.StartCamera();
+			restart_camera(app);
 			continue;
 		}
 		if (msg.type != LibcameraRaw::MsgType::RequestComplete)
@@ -120,6 +1106,26 @@ static void event_loop(LibcameraRaw &app, GpioHandler* lampHandler)
 								  << cfg.pixelFormat.toString());
 		}
 
+		// New settings take effect between frames; the frame filter picks up its own as soon as they change. Only a
+		// new directory needs the encoder to finish what it has, so that every file goes where it was meant to.
+		if (settingsStore.generation() != settingsGeneration) {
+			settingsGeneration = settingsStore.generation();
+			std::shared_ptr<RuntimeSettings const> next = settingsStore.get();
+			if (lampHandler && next->lamp_pattern != settings->lamp_pattern)
+				change_lamp_pattern(*lampHandler, lampScheduler, lampSteps, next->lamp_pattern);
+			if (next->parent_directory != settings->parent_directory) {
+				app.StopEncoder();
+				options->Set().parent_directory = next->parent_directory;
+				output = std::unique_ptr<Output>(Output::Create(options));
+				output->setStreamInfo(&info);
+				app.SetEncodeOutputReadyCallback(std::bind(&Output::OutputReady, output.get(), _1, _2, _3, _4));
+				app.SetMetadataReadyCallback(std::bind(&Output::MetadataReady, output.get(), _1));
+				app.StartEncoder();
+			}
+			settings = next;
+			LOG(1, "Settings now " << settings->toString());
+		}
+
 		LOG(2, currentStreamName << " frame " << count);
 		auto now = std::chrono::high_resolution_clock::now();
 		if (options->Get().timeout && (now - start_time) > options->Get().timeout.value)
@@ -128,32 +1134,61 @@ static void event_loop(LibcameraRaw &app, GpioHandler* lampHandler)
 			app.StopEncoder();
 			return;
 		}
-		if (options->Get().capture_interval && options->Get().capture_interval > 0.0f) {
-			float time_since_last_capture = std::chrono::duration<float>(now - last_capture_time).count();
-			if (time_since_last_capture >= options->Get().capture_interval) {
-				last_capture_time = now;
-			} else {
-				continue;
+		// Frames have already been thinned out by the frame filter, so we only update the lamp after the correct
+		// image has been captured
+		CompletedRequestPtr completed_request = std::get<CompletedRequestPtr>(msg.payload);
+		unsigned int pngLevel = settings->png_compression_level;
+		if (thermal)
+			pngLevel = thermal->pngLevel(pngLevel);
+		completed_request->post_process_metadata.Set(metadata_tags::png_compression_level, pngLevel);
+		OutputFrameInfo frameInfo = { completed_request->sequence, "" };
+		completed_request->post_process_metadata.Get(metadata_tags::change_gate_suppressed,
+													 frameInfo.suppressed_before);
+		tag_particles(completed_request, frameInfo);
+		if (thermal && thermal->step())
+			frameInfo.thermal_step = thermal->step();
+		if (lampHandler)
+			frameInfo.lamp_color = tag_lamp_color(completed_request, *lampHandler, *lampScheduler, lampSteps.get(), options, count);
+		if (strobeMonitor)
+			tag_strobe(completed_request, *strobeMonitor, frameInfo);
+		if (!options->Get().bracket_exposures.empty())
+			tag_bracket_step(completed_request, frameInfo);
+		bool save = true;
+		if (rawRing) {
+			bool motion = false;
+			completed_request->post_process_metadata.Get(metadata_tags::motion_detect_result, motion);
+			bool triggered = motion || signal_received == SIGUSR1 ||
+							 (controlServer && controlServer->triggerRequested());
+			if (signal_received == SIGUSR1)
+				signal_received = 0;
+			if (triggered) {
+				framesCaptured += save_raw_ring(app, *rawRing, *output);
+				ringPostFrames = options->Get().raw_ring_post + 1;
 			}
-		} else if (options->Get().every_nth_frame > 1 && count % (long long)options->Get().every_nth_frame != 0) {
-			continue;
+			save = ringPostFrames > 0;
+			if (save)
+				ringPostFrames--;
+			else
+				keep_in_ring(app, *rawRing, completed_request, currentStream, info, frameInfo);
 		}
-		// Placing this after the interval check so we only update the lamp after the correct image has been captured
-		CompletedRequestPtr completed_request = std::get<CompletedRequestPtr>(msg.payload);
-		if (lampHandler) {
-			std::string currentLampColor = lampHandler->getCurrentLampColor();
-			// lampHandler->setNextLampColor();
-			completed_request->post_process_metadata.Set("exif_data.lamp_color", currentLampColor);
-			completed_request->post_process_metadata.Set("exif_data.camera_serial_number", options->Get().camera_serial_number);
+		if (save) {
+			output->FrameInfoReady(frameInfo);
+			if (!app.EncodeBuffer(completed_request, currentStream))
+			{
+				output->WithdrawFrameInfo();
+				// Keep advancing our "start time" if we're still waiting to start recording (e.g.
+				// waiting for synchronisation with another camera).
+				start_time = now;
+			}
+			framesCaptured++;
 		}
-		if (!app.EncodeBuffer(completed_request, currentStream))
-		{
-			// Keep advancing our "start time" if we're still waiting to start recording (e.g.
-			// waiting for synchronisation with another camera).
-			start_time = now;
+		if (lampHandler && options->Get().lamp_cycle) {
+			// Doesn't block; the frames exposed under the new color are picked out by timestamp later.
+			lampScheduler->onQueued();
+			lampHandler->queueNextLampColor(count, recordLampChange);
 		}
-		framesCaptured++;
-		if (options->Get().total_frames && framesCaptured == options->Get().total_frames) {
+		if ((options->Get().total_frames && framesCaptured >= options->Get().total_frames) ||
+			(storageGovernor && storageGovernor->shouldStop())) {
 			app.StopCamera();
 			app.StopEncoder();
 			return;
@@ -161,6 +1196,74 @@ static void event_loop(LibcameraRaw &app, GpioHandler* lampHandler)
 	}
 }
 
+// --cameras runs a LibcameraRaw for each camera, each with the usual event loop on a thread of its own. They share
+// the process's camera manager and encode cores. Each parses the command line again, with its own --camera, so that
+// anything set up for the camera while parsing (like the imx708's HDR mode) is done for the right one.
+static int run_cameras(LibcameraRaw &first, int argc, char *argv[], GpioHandler *lampHandler)
+{
+	std::vector<unsigned int> indices = first.GetOptions()->Get().camera_list;
+	std::string parent = first.GetOptions()->Get().parent_directory;
+	std::vector<std::unique_ptr<LibcameraRaw>> apps;
+	for (unsigned int index : indices)
+	{
+		// Any --camera of the user's own goes, or the option would be given twice.
+		std::vector<char *> args;
+		for (int i = 0; i < argc; i++)
+		{
+			std::string arg = argv[i];
+			if (arg == "--camera" && i + 1 < argc)
+				i++;
+			else if (arg.rfind("--camera=", 0) != 0)
+				args.push_back(argv[i]);
+		}
+		std::string camera_arg = "--camera=" + std::to_string(index);
+		args.push_back(camera_arg.data());
+		int num_args = args.size();
+		args.push_back(nullptr);
+
+		auto app = std::make_unique<LibcameraRaw>();
+		VideoOptions *options = app->GetOptions();
+		if (!options->Parse(num_args, args.data()))
+			return 0;
+		options->Set().codec = "yuv420";
+		options->Set().denoise = "cdn_off";
+		options->Set().nopreview = true;
+		std::filesystem::path dir = std::filesystem::path(parent) / ("cam" + std::to_string(index));
+		std::filesystem::create_directories(dir);
+		options->Set().parent_directory = dir.string();
+		// The GPIO lines can only be watched by one of them, which goes with the lamp.
+		if (!apps.empty())
+			options->Set().strobe_gpio = options->Set().xvs_gpio = "";
+		apps.push_back(std::move(app));
+	}
+	// Now nothing holds the camera manager that parsing made, the cameras get a fresh one that sees what was changed.
+	first.ReleaseCameraManager();
+	for (auto &app : apps)
+		app->ReleaseCameraManager();
+
+	std::atomic<bool> failed = false;
+	std::vector<std::thread> threads;
+	for (unsigned int i = 0; i < apps.size(); i++)
+	{
+		threads.emplace_back([&, i]() {
+			try
+			{
+				event_loop(*apps[i], i == 0 ? lampHandler : nullptr);
+			}
+			catch (std::exception const &e)
+			{
+				LOG_ERROR("ERROR: *** camera " << indices[i] << ": " << e.what() << " ***");
+				failed = true;
+				// Bring the other cameras down too.
+				signal_received = SIGTERM;
+			}
+		});
+	}
+	for (std::thread &thread : threads)
+		thread.join();
+	return failed ? -1 : 0;
+}
+
 int main(int argc, char *argv[])
 {
 	try
@@ -172,21 +1275,40 @@ int main(int argc, char *argv[])
 			// Register signal handlers for graceful shutdown
 			signal(SIGTERM, signal_handler);
 			signal(SIGINT, signal_handler);
-			GpioHandler* lampHandler = nullptr;
-			if (!options->Get().without_lamp) {
-				lampHandler = new GpioHandler(options->Get().lamp_pattern, options->Get().r_brightness, options->Get().g_brightness, options->Get().b_brightness, options->Get().disable_illumination_trigger, options->Get().fire_and_forget);
-			}
 			// Disable any codec (h.264/libav) based operations.
 			options->Set().codec = "yuv420";
 			options->Set().denoise = "cdn_off";
 			options->Set().nopreview = true;
 			if (options->Get().verbose >= 2)
 				options->Get().Print();
+			if (options->Get().benchmark)
+			{
+				benchmark(options);
+				return 0;
+			}
+			GpioHandler* lampHandler = nullptr;
+			if (options->Get().raw_ring)
+				signal(SIGUSR1, signal_handler);
+			if (!options->Get().trace_file.empty())
+				signal(SIGUSR2, signal_handler);
+			if (!options->Get().without_lamp) {
+				if (GpioHandler::baudRate(options->Get().lamp_baud) == B0)
+					throw std::runtime_error("--lamp-baud should be a standard baud rate");
+				lampHandler = new GpioHandler(options->Get().lamp_pattern, options->Get().r_brightness, options->Get().g_brightness, options->Get().b_brightness, options->Get().disable_illumination_trigger, options->Get().fire_and_forget, options->Get().lamp_baud, options->Get().lamp_protocol == "binary");
+			}
 
-			event_loop(app, lampHandler);
+			int ret = 0;
+			if (!options->Get().daemon_socket.empty())
+				daemon_loop(app, lampHandler);
+			else if (options->Get().camera_list.size() > 1)
+				ret = run_cameras(app, argc, argv, lampHandler);
+			else
+				event_loop(app, lampHandler);
 			if (lampHandler) {
 				delete lampHandler;
 			}
+			if (ret)
+				return ret;
 		}
 	}
 	catch (std::exception const &e)
@@ -5,6 +5,7 @@
  * rpicam_still.cpp - libcamera stills capture app.
  */
 #include <chrono>
+#include <deque>
 #include <filesystem>
 #include <poll.h>
 #include <signal.h>
@@ -18,6 +19,8 @@
 #include "core/still_options.hpp"
 #include "core/options.hpp"
 
+#include "encoder/encode_pool.hpp"
+
 #include "output/output.hpp"
 
 #include "image/image.hpp"
@@ -98,6 +101,13 @@ static void save_image(RPiCamStillApp &app, CompletedRequestPtr &payload, Stream
 	LOG(2, "Saved image " << info.width << " x " << info.height << " to file " << filename);
 }
 
+static void advance_framestart(StillOptions *options)
+{
+	options->Set().framestart++;
+	if (options->Get().wrap)
+		options->Set().framestart %= options->Get().wrap;
+}
+
 static void save_images(RPiCamStillApp &app, CompletedRequestPtr &payload)
 {
 	StillOptions *options = app.GetOptions();
@@ -109,9 +119,132 @@ static void save_images(RPiCamStillApp &app, CompletedRequestPtr &payload)
 		filename = filename.substr(0, filename.rfind('.')) + ".dng";
 		save_image(app, payload, app.RawStream(), filename);
 	}
-	options->Set().framestart++;
-	if (options->Get().wrap)
-		options->Set().framestart %= options->Get().wrap;
+	advance_framestart(options);
+}
+
+// Saves the frames of --zsl-burst captures and --timelapse-pipeline shots on the threads of an EncodePool, so that
+// the camera never waits for one to be encoded. The frames hold on to their requests until they are saved, which is
+// why those modes configure extra buffers.
+class AsyncSaver
+{
+public:
+	AsyncSaver(RPiCamStillApp &app) : app_(app), pool_(app.GetOptions(), DEFAULT_THREADS, "AsyncSaver")
+	{
+		pool_.Start(
+			[this](unsigned int num, EncodePool::EncodeItem &item, uint8_t *&encoded_buffer, size_t &buffer_len) {
+				save(item, encoded_buffer, buffer_len);
+			},
+			[this](EncodePool::OutputItem &item) { output(item); },
+			[](void *mem) { delete static_cast<Job *>(mem); });
+	}
+	~AsyncSaver() { pool_.Stop(); }
+
+	// Save this frame of the stream to the file, and point the --latest link at it if "latest" is set.
+	void Save(CompletedRequestPtr const &payload, Stream *stream, std::string const &filename, bool latest)
+	{
+		int64_t timestamp_ns = payload->metadata.get(libcamera::controls::SensorTimestamp).value_or(0);
+		pool_.Push(new Job { payload, stream, filename, latest }, app_.GetStreamInfo(stream), timestamp_ns / 1000,
+				   payload);
+	}
+
+private:
+	static constexpr unsigned int DEFAULT_THREADS = 2;
+
+	struct Job
+	{
+		CompletedRequestPtr payload;
+		Stream *stream;
+		std::string filename;
+		bool latest;
+	};
+
+	void save(EncodePool::EncodeItem &item, uint8_t *&encoded_buffer, size_t &buffer_len)
+	{
+		Job *job = static_cast<Job *>(item.mem);
+		save_image(app_, job->payload, job->stream, job->filename);
+		// The "encoded" output is just the name of the file, for the output thread to make the link to. It sees the
+		// frames in order, so the link always ends up on the newest one.
+		if (job->latest)
+		{
+			encoded_buffer = (uint8_t *)strdup(job->filename.c_str());
+			buffer_len = job->filename.size();
+		}
+	}
+
+	void output(EncodePool::OutputItem &item)
+	{
+		if (item.mem)
+			update_latest_link((char const *)item.mem, app_.GetOptions());
+		free(item.mem);
+	}
+
+	RPiCamStillApp &app_;
+	EncodePool pool_;
+};
+
+// The state of a --zsl-burst capture. The frames leading up to the trigger are kept in a ring, and once the first
+// frame from after the trigger arrives (by its sensor timestamp) those are saved, followed by as many more as it takes
+// to make up the burst.
+struct Burst
+{
+	std::deque<CompletedRequestPtr> ring;
+	int64_t trigger_ns = 0;
+	bool triggered = false;
+	unsigned int remaining = 0;
+	unsigned int count = 0;
+};
+
+static void remember_frame(Burst &burst, CompletedRequestPtr const &payload, unsigned int size)
+{
+	if (!size)
+		return;
+	burst.ring.push_back(payload);
+	while (burst.ring.size() > size)
+		burst.ring.pop_front();
+}
+
+// Queue the still (and raw) images of this frame for saving. "number" is added to names made from the date or time,
+// which would otherwise be the same for every frame saved within the second.
+static void queue_save(RPiCamStillApp &app, AsyncSaver &saver, CompletedRequestPtr const &payload, unsigned int number)
+{
+	StillOptions *options = app.GetOptions();
+	std::string filename = generate_filename(options);
+	if (options->Get().datetime || options->Get().timestamp)
+	{
+		size_t dot = filename.rfind('.');
+		filename = filename.substr(0, dot) + "-" + std::to_string(number) + filename.substr(dot);
+	}
+	saver.Save(payload, app.StillStream(), filename, true);
+	if (options->Get().raw)
+		saver.Save(payload, app.RawStream(), filename.substr(0, filename.rfind('.')) + ".dng", false);
+	advance_framestart(options);
+}
+
+// Returns true once every frame of the burst has been queued for saving.
+static bool burst_frame(RPiCamStillApp &app, AsyncSaver &saver, Burst &burst, CompletedRequestPtr const &payload)
+{
+	StillOptions const *options = app.GetOptions();
+	int64_t timestamp_ns = payload->metadata.get(libcamera::controls::SensorTimestamp).value_or(0);
+	if (!burst.triggered)
+	{
+		// Frames that were already on their way when we were triggered are still "before" it.
+		if (timestamp_ns < burst.trigger_ns)
+		{
+			remember_frame(burst, payload, options->Get().zsl_pre);
+			return false;
+		}
+		burst.triggered = true;
+		LOG(1, "Still capture burst triggered, " << burst.ring.size() << " frames from before");
+		for (auto const &frame : burst.ring)
+			queue_save(app, saver, frame, burst.count++);
+		burst.ring.clear();
+	}
+	if (burst.remaining)
+	{
+		queue_save(app, saver, payload, burst.count++);
+		burst.remaining--;
+	}
+	return burst.remaining == 0;
 }
 
 static void save_metadata(StillOptions const *options, libcamera::ControlList &metadata)
@@ -162,6 +295,115 @@ static int get_key_or_signal(StillOptions const *options, pollfd p[1])
 	return key;
 }
 
+// The --timelapse-pipeline loop. The camera stays in the still configuration throughout, with its frame duration set
+// to the timelapse interval (or a whole fraction of it, when the interval is longer than the sensor allows), so that
+// the sensor itself times the shots. It first runs a few frames at the normal rate to let AE/AWB settle, and once it
+// starts shooting, the frames that fall between shots go straight back to the camera.
+static void pipelined_timelapse(RPiCamStillApp &app, unsigned int still_flags)
+{
+	StillOptions const *options = app.GetOptions();
+	// We hold on to the shots until they're saved, so the camera needs some spare buffers.
+	if (!options->Get().buffer_count)
+		still_flags |= RPiCamApp::FLAG_STILL_TRIPLE_BUFFER;
+	app.ConfigureStill(still_flags);
+
+	int64_t interval_us = options->Get().timelapse.get<std::chrono::microseconds>();
+	auto [min_frame_us, max_frame_us] = app.FrameDurationRange();
+	int64_t frames_per_shot = (interval_us + max_frame_us - 1) / max_frame_us;
+	int64_t frame_us = std::max(interval_us / frames_per_shot, min_frame_us);
+	if (interval_us < min_frame_us)
+	{
+		LOG_ERROR("WARNING: timelapse interval is shorter than the shortest frame, " << min_frame_us << "us");
+		interval_us = min_frame_us;
+	}
+	LOG(1, "Timelapse pipeline: " << frames_per_shot << " frame(s) of " << frame_us << "us per shot");
+
+	// A frame is taken as the shot if it comes within half a frame of when the shot is due. The frame filter, on the
+	// camera thread, shares the next shot's time with us.
+	int64_t interval_ns = interval_us * 1000, tolerance_ns = frame_us * 1000 / 2;
+	auto next_shot_ns = std::make_shared<std::atomic<int64_t>>(0);
+	app.SetFrameFilter([next_shot_ns, tolerance_ns](uint64_t, int64_t timestamp) {
+		return timestamp >= *next_shot_ns - tolerance_ns;
+	});
+
+	AsyncSaver saver(app);
+	app.StartCamera();
+	auto start_time = std::chrono::high_resolution_clock::now();
+	constexpr unsigned int TIMELAPSE_SETTLE_FRAMES = 6;
+	unsigned int settle_frames = TIMELAPSE_SETTLE_FRAMES;
+	unsigned int shots = 0;
+	while (true)
+	{
+		RPiCamApp::Msg msg = app.Wait();
+		if (msg.type == RPiCamApp::MsgType::Timeout)
+		{
+			LOG_ERROR("ERROR: Device timeout detected, attempting a restart!!!");
+			app.StopCamera();
+			app.StartCamera();
+			continue;
+		}
+		if (msg.type == RPiCamApp::MsgType::Quit)
+			return;
+		else if (msg.type != RPiCamApp::MsgType::RequestComplete)
+			throw std::runtime_error("unrecognised message!");
+
+		auto now = std::chrono::high_resolution_clock::now();
+		if (options->Get().timeout && (now - start_time) > options->Get().timeout.value)
+			return;
+		if (settle_frames)
+		{
+			settle_frames--;
+			continue;
+		}
+
+		CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg.payload);
+		libcamera::ControlList &metadata = completed_request->metadata;
+		int64_t timestamp_ns = metadata.get(libcamera::controls::SensorTimestamp).value_or(0);
+		if (shots)
+		{
+			// Frames that were already on their way when the filter last moved on are turned away here.
+			int64_t early_ns = *next_shot_ns - tolerance_ns;
+			if (timestamp_ns < early_ns)
+				continue;
+			int64_t missed = (timestamp_ns - early_ns) / interval_ns;
+			if (missed)
+				LOG_ERROR("WARNING: timelapse missed " << missed << " shots");
+			*next_shot_ns += (missed + 1) * interval_ns;
+		}
+		else
+		{
+			// The first shot fixes the timing of the rest, and the sensor goes to the timelapse frame rate.
+			*next_shot_ns = timestamp_ns + interval_ns;
+			libcamera::ControlList cl;
+			cl.set(libcamera::controls::FrameDurationLimits,
+				   libcamera::Span<const int64_t, 2>({ frame_us, frame_us }));
+			if (options->Get().timelapse_lock)
+			{
+				auto exposure = metadata.get(libcamera::controls::ExposureTime);
+				auto gain = metadata.get(libcamera::controls::AnalogueGain);
+				auto colour_gains = metadata.get(libcamera::controls::ColourGains);
+				if (exposure && gain)
+				{
+					cl.set(libcamera::controls::ExposureTimeMode, libcamera::controls::ExposureTimeModeManual);
+					cl.set(libcamera::controls::ExposureTime, *exposure);
+					cl.set(libcamera::controls::AnalogueGainMode, libcamera::controls::AnalogueGainModeManual);
+					cl.set(libcamera::controls::AnalogueGain, *gain);
+				}
+				if (colour_gains)
+					cl.set(libcamera::controls::ColourGains,
+						   libcamera::Span<const float, 2>({ (*colour_gains)[0], (*colour_gains)[1] }));
+				LOG(1, "Timelapse exposure and colour gains locked");
+			}
+			app.SetControls(cl);
+		}
+
+		LOG(1, "Timelapse shot " << shots);
+		queue_save(app, saver, completed_request, shots++);
+		if (!options->Get().metadata.empty())
+			save_metadata(options, metadata);
+	}
+}
+
 // The main even loop for the application.
 
 static void event_loop(RPiCamStillApp &app)
@@ -188,6 +430,12 @@ static void event_loop(RPiCamStillApp &app)
 	signal(SIGUSR2, default_signal_handler);
 	pollfd p[1] = { { STDIN_FILENO, POLLIN, 0 } };
 
+	if (options->Get().timelapse_pipeline)
+	{
+		pipelined_timelapse(app, still_flags);
+		return;
+	}
+
 	if (options->Get().immediate)
 	{
 		app.ConfigureStill(still_flags);
@@ -202,7 +450,7 @@ static void event_loop(RPiCamStillApp &app)
 		}
 	}
 	else if (options->Get().zsl)
-		app.ConfigureZsl();
+		app.ConfigureZsl(still_flags, options->Get().zsl_burst);
 	else
 		app.ConfigureViewfinder();
 	app.StartCamera();
@@ -219,6 +467,11 @@ static void event_loop(RPiCamStillApp &app)
 	} af_wait_state = AF_WAIT_NONE;
 	int af_wait_timeout = 0;
 
+	std::unique_ptr<AsyncSaver> burst_saver;
+	if (options->Get().zsl_burst)
+		burst_saver = std::make_unique<AsyncSaver>(app);
+	Burst burst;
+
 	bool want_capture = options->Get().immediate;
 	for (unsigned int count = 0;; count++)
 	{
@@ -250,6 +503,8 @@ static void event_loop(RPiCamStillApp &app)
 		{
 			LOG(2, "Viewfinder frame " << count);
 			timelapse_frames++;
+			if (burst_saver)
+				remember_frame(burst, completed_request, options->Get().zsl_pre);
 
 			bool timed_out = options->Get().timeout && (now - start_time) > options->Get().timeout.value;
 			bool timelapse_timed_out = options->Get().timelapse &&
@@ -291,6 +546,16 @@ static void event_loop(RPiCamStillApp &app)
 				keypressed = false;
 				af_wait_state = AF_WAIT_NONE;
 				timelapse_time = std::chrono::high_resolution_clock::now();
+				if (burst_saver)
+				{
+					// The sensor timestamps come from the same clock.
+					burst.trigger_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+										   std::chrono::steady_clock::now().time_since_epoch())
+										   .count();
+					burst.triggered = false;
+					burst.remaining = options->Get().zsl_burst - options->Get().zsl_pre;
+					burst.count = 0;
+				}
 				if (!options->Get().zsl)
 				{
 					app.StopCamera();
@@ -314,11 +579,22 @@ static void event_loop(RPiCamStillApp &app)
 		// otherwise quit.
 		else if (app.StillStream() && want_capture)
 		{
+			// A burst goes on for some frames, and the preview with it.
+			if (burst_saver && !burst_frame(app, *burst_saver, burst, completed_request))
+			{
+				app.ShowPreview(completed_request, app.ViewfinderStream());
+				continue;
+			}
 			want_capture = false;
 			if (!options->Get().zsl)
 				app.StopCamera();
-			LOG(1, "Still capture image received");
-			save_images(app, completed_request);
+			if (burst_saver)
+				LOG(1, "Still capture burst of " << burst.count << " frames queued for saving");
+			else
+			{
+				LOG(1, "Still capture image received");
+				save_images(app, completed_request);
+			}
 			if (!options->Get().metadata.empty())
 				save_metadata(options, completed_request->metadata);
 			timelapse_frames = 0;
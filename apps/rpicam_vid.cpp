@@ -13,6 +13,9 @@
 
 #include "core/rpicam_encoder.hpp"
 #include "output/output.hpp"
+#include "post_processing_stages/change_gate.hpp"
+#include "post_processing_stages/motion_detect.hpp"
+#include "post_processing_stages/particle_analysis.hpp"
 
 using namespace std::placeholders;
 
@@ -118,8 +121,22 @@ static void event_loop(RPiCamEncoder &app)
 			return;
 		}
 		CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg.payload);
+		OutputFrameInfo frame_info = { completed_request->sequence, "" };
+		completed_request->post_process_metadata.Get(metadata_tags::motion_detect_result, frame_info.motion);
+		completed_request->post_process_metadata.Get(metadata_tags::change_gate_suppressed,
+													 frame_info.suppressed_before);
+		if (auto particles = completed_request->post_process_metadata.Find(metadata_tags::particle_analysis_results))
+			frame_info.particles = *particles;
+		frame_info.sensor_timestamp_ns =
+			completed_request->metadata.get(libcamera::controls::SensorTimestamp).value_or(0);
+		// A libav container never passes frames back to the Output, which would then never take these.
+		bool frame_info_queued = app.EncoderOutputsEachFrame();
+		if (frame_info_queued)
+			output->FrameInfoReady(frame_info);
 		if (!app.EncodeBuffer(completed_request, app.VideoStream()))
 		{
+			if (frame_info_queued)
+				output->WithdrawFrameInfo();
 			// Keep advancing our "start time" if we're still waiting to start recording (e.g.
 			// waiting for synchronisation with another camera).
 			start_time = now;
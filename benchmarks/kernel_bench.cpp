@@ -0,0 +1,263 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * kernel_bench.cpp - time the pixel kernels on their own
+ */
+
+// Runs each of the hot pixel kernels over frames of a few representative sizes, and reports how long a frame takes
+// and how fast that is in GB/s of the data the kernel reads. The kernels are picked just as the apps pick them, so the
+// NEON ones are used wherever the CPU has them; run this on each Pi to compare. Give a name, or part of one, to run
+// only those kernels, e.g.
+//   rpicam-kernel-bench unpack
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "core/stream_info.hpp"
+
+#include "encoder/dng_unpack.hpp"
+
+#include "post_processing_stages/hdr_image.hpp"
+#include "post_processing_stages/motion_detect_kernels.hpp"
+#include "post_processing_stages/post_processing_stage.hpp"
+#include "post_processing_stages/pwl.hpp"
+
+struct Size
+{
+	unsigned int width;
+	unsigned int height;
+};
+
+// Full frames: a Camera Module 3 binned mode, and the HQ camera binned and at full resolution.
+static const std::vector<Size> frame_sizes = { { 2304, 1296 }, { 2028, 1520 }, { 4056, 3040 } };
+// Low resolution images, as the motion detector is given.
+static const std::vector<Size> lores_sizes = { { 320, 240 }, { 640, 480 }, { 1280, 960 } };
+
+static constexpr std::chrono::duration<double> MIN_TIME(0.5);
+
+static char const *filter = nullptr;
+
+// Something other than zeroes for the kernels to chew on.
+static std::vector<uint8_t> noise(size_t size, uint32_t seed)
+{
+	std::vector<uint8_t> data(size);
+	for (auto &byte : data)
+	{
+		seed = seed * 1664525 + 1013904223;
+		byte = seed >> 24;
+	}
+	return data;
+}
+
+static unsigned int align(unsigned int value, unsigned int alignment)
+{
+	return (value + alignment - 1) / alignment * alignment;
+}
+
+// Time fn for at least MIN_TIME (and at least 3 calls), after one call to warm up, and print the time per call and the
+// rate at which it gets through "bytes".
+template <typename F>
+static void bench(char const *kernel, Size const &size, double bytes, F &&fn)
+{
+	if (filter && !strstr(kernel, filter))
+		return;
+
+	fn();
+	unsigned int calls = 0;
+	auto start = std::chrono::steady_clock::now();
+	std::chrono::duration<double> elapsed;
+	do
+	{
+		fn();
+		calls++;
+		elapsed = std::chrono::steady_clock::now() - start;
+	} while (elapsed < MIN_TIME || calls < 3);
+
+	double seconds = elapsed.count() / calls;
+	printf("%-24s %5ux%-5u %9.3f ms %8.2f GB/s\n", kernel, size.width, size.height, seconds * 1000,
+		   bytes / seconds / 1e9);
+}
+
+static void bench_unpack()
+{
+	struct Unpack
+	{
+		char const *name;
+		unsigned int bits;
+		void (*fn)(uint8_t const *, StreamInfo const &, uint8_t *, uint16_t *);
+	};
+	static const Unpack unpacks[] = {
+		{ "unpack_10bit", 10, unpack_10bit },
+		{ "unpack_12bit", 12, unpack_12bit },
+		{ "unpack_12bit_to_8bit", 12, unpack_12bit_to_8bit },
+		{ "unpack_12bit_to_10bit", 12, unpack_12bit_to_10bit },
+	};
+
+	for (Size const &size : frame_sizes)
+	{
+		std::vector<uint8_t> dest(2 * size.width * size.height);
+		std::vector<uint16_t> dest16(align(size.width, 8) * size.height);
+		for (Unpack const &unpack : unpacks)
+		{
+			StreamInfo info;
+			info.width = size.width;
+			info.height = size.height;
+			info.stride = align(size.width * unpack.bits / 8, 64);
+			std::vector<uint8_t> src = noise(info.stride * info.height, 1);
+			bench(unpack.name, size, src.size(), [&]() { unpack.fn(src.data(), info, dest.data(), dest16.data()); });
+		}
+
+		// PiSP compressed frames are a byte a pixel, in 8-pixel blocks.
+		StreamInfo info;
+		info.width = size.width;
+		info.height = size.height;
+		info.stride = align(size.width, 64);
+		std::vector<uint8_t> src = noise(info.stride * info.height, 2);
+		bench("uncompress", size, src.size(), [&]() { uncompress(src.data(), info, dest16.data()); });
+
+		// The DNG thumbnail, at its default of a pixel for every 8x8, from the unpacked 16-bit frame.
+		static constexpr unsigned int step = 8;
+		std::vector<uint8_t> lut(THUMBNAIL_LUT_SIZE, 128);
+		std::vector<uint8_t> thumbnail(3 * (size.width / step));
+		unsigned int stride16 = align(size.width, 8);
+		bench("thumbnail_row", size, 2.0 * stride16 * size.height / (step / 2), [&]() {
+			for (unsigned int y = 0; y + 1 < size.height; y += step)
+				thumbnail_row(dest16.data() + y * stride16, stride16, thumbnail.data(), size.width / step, step, 2,
+							  lut.data());
+		});
+	}
+}
+
+static void bench_yuv420_to_rgb()
+{
+	for (Size const &size : frame_sizes)
+	{
+		StreamInfo src_info, dst_info;
+		src_info.width = dst_info.width = size.width;
+		src_info.height = dst_info.height = size.height;
+		src_info.stride = align(size.width, 64);
+		dst_info.stride = size.width * 3;
+		std::vector<uint8_t> src = noise(src_info.stride * src_info.height * 3 / 2, 3);
+		std::vector<uint8_t> dst(dst_info.stride * dst_info.height);
+		bench("Yuv420ToRgb", size, src.size(),
+			  [&]() { PostProcessingStage::Yuv420ToRgb(dst.data(), src.data(), src_info, dst_info); });
+	}
+}
+
+// The motion detector's work on each frame: a gather of the subsampled roi, and a count of the pixels that differ
+// from the last frame's.
+static void bench_motion_detect()
+{
+	MotionDetectKernels const &kernels = motion_detect_kernels();
+	uint8_t limit[256];
+	for (unsigned int i = 0; i < 256; i++)
+		limit[i] = std::min(255.0, i * 0.1 + 10);
+
+	for (Size const &size : lores_sizes)
+	{
+		std::vector<uint8_t> src = noise(2 * size.width * size.height, 4);
+		std::vector<uint8_t> previous = noise(size.width * size.height, 5);
+		std::vector<uint8_t> frame(size.width * size.height);
+		bench("motion_gather_hskip2", size, src.size(), [&]() {
+			for (unsigned int y = 0; y < size.height; y++)
+				kernels.gather_row(src.data() + 2 * y * size.width, frame.data() + y * size.width, size.width, 2);
+		});
+
+		volatile unsigned int count = 0;
+		bench("motion_count", size, 2 * frame.size(), [&]() {
+			unsigned int n = 0;
+			for (unsigned int y = 0; y < size.height; y++)
+				n += kernels.count_row(previous.data() + y * size.width, frame.data() + y * size.width, limit,
+									   size.width);
+			count = n;
+		});
+	}
+}
+
+// The low pass filter as the HDR stage would run it on 8 accumulated frames, with the settings from hdr.json, and the
+// histogram of the result that the global tonemap is made from.
+static void bench_hdr()
+{
+	LpFilterConfig config;
+	config.strength = 0.2;
+	config.threshold.Append(0, 10.0);
+	config.threshold.Append(2048, 205.0);
+	config.threshold.Append(4095, 205.0);
+
+	for (Size const &size : frame_sizes)
+	{
+		HdrImage image(size.width, size.height, size.width * size.height);
+		image.dynamic_range = 2048;
+		std::vector<uint8_t> values = noise(size.width * size.height, 6);
+		for (unsigned int i = 0; i < values.size(); i++)
+			image.P(i) = (i % size.width + i / size.width + (values[i] >> 4)) % 2048;
+		bench("HdrImage::LpFilter", size, 2 * image.pixels.size(), [&]() { image.LpFilter(config); });
+		std::vector<uint32_t> bins(image.dynamic_range);
+		bench("AccumulateHistogram", size, 2 * size.width * size.height, [&]() {
+			AccumulateHistogram(&image.pixels[0], size.width * size.height, &bins[0], bins.size());
+		});
+	}
+}
+
+// Pwl::Eval over a frame's worth of pixel values, as a tonemap or threshold LUT would be generated, both walking
+// through in order with a span hint and looking up each value cold, and then the same curve baked into a PwlLut, with
+// 12-bit and (interpolated) 16-bit inputs.
+static void bench_pwl()
+{
+	Pwl pwl;
+	for (unsigned int i = 0; i <= 16; i++)
+		pwl.Append(i * 4096.0 / 16, 4096.0 * std::sqrt(i / 16.0));
+	PwlLut<int> lut(pwl);
+
+	for (Size const &size : frame_sizes)
+	{
+		unsigned int n = size.width * size.height;
+		std::vector<uint8_t> values = noise(n, 7);
+		volatile double sink = 0;
+		bench("Pwl::Eval_span", size, n * sizeof(double), [&]() {
+			double sum = 0;
+			int span = -1;
+			for (unsigned int i = 0; i < n; i++)
+				sum += pwl.Eval(i * 4096.0 / n, &span);
+			sink = sum;
+		});
+		bench("Pwl::Eval", size, n * sizeof(double), [&]() {
+			double sum = 0;
+			for (unsigned int i = 0; i < n; i++)
+				sum += pwl.Eval(values[i] * 16.0);
+			sink = sum;
+		});
+		bench("PwlLut", size, n, [&]() {
+			int sum = 0;
+			for (unsigned int i = 0; i < n; i++)
+				sum += lut[values[i] * 16];
+			sink = sum;
+		});
+		bench("PwlLut::Interp", size, n, [&]() {
+			int sum = 0;
+			for (unsigned int i = 0; i < n; i++)
+				sum += lut.Interp(values[i] * 256 + i % 256, 4);
+			sink = sum;
+		});
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1)
+		filter = argv[1];
+
+	printf("%-24s %11s %12s %13s\n", "kernel", "size", "per frame", "rate");
+	bench_unpack();
+	bench_yuv420_to_rgb();
+	bench_motion_detect();
+	bench_hdr();
+	bench_pwl();
+	return 0;
+}
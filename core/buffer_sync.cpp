@@ -9,41 +9,161 @@
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 
+#include <chrono>
+#include <stdexcept>
+
 #include "core/buffer_sync.hpp"
 #include "core/rpicam_app.hpp"
 #include "core/logging.hpp"
 
-BufferWriteSync::BufferWriteSync(RPiCamApp *app, libcamera::FrameBuffer *fb)
-	: fb_(fb)
+void BufferSyncManager::Configure(Policy policy, bool cached_heap)
+{
+	// Uncached memory never has stale or dirty cache lines, so there is nothing to sync.
+	policy_ = policy == Policy::Auto && !cached_heap ? Policy::Never : policy;
+	state_.clear();
+}
+
+bool BufferSyncManager::sync(libcamera::FrameBuffer *fb, uint64_t flags)
 {
 	struct dma_buf_sync dma_sync {};
-	dma_sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_RW;
+	dma_sync.flags = flags;
 
-	auto it = app->mapped_buffers_.find(fb_);
-	if (it == app->mapped_buffers_.end())
+	auto start = std::chrono::steady_clock::now();
+	int ret = ::ioctl(fb->planes()[0].fd.get(), DMA_BUF_IOCTL_SYNC, &dma_sync);
+	time_ns_ += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+	ioctls_++;
+	return ret == 0;
+}
+
+void BufferSyncManager::Begin(libcamera::FrameBuffer *fb)
+{
+	frames_++;
+	if (policy_ == Policy::Never)
 	{
-		LOG_ERROR("failed to find buffer in BufferWriteSync");
+		skipped_++;
+		return;
+	}
+
+	if (!sync(fb, DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ))
+		throw std::runtime_error("failed to sync dma buf on request complete");
+	std::lock_guard<std::mutex> lock(mutex_);
+	state_[fb] = { true, false };
+}
+
+void BufferSyncManager::BeginWrite(libcamera::FrameBuffer *fb)
+{
+	if (policy_ == Policy::Always)
+	{
+		if (!sync(fb, DMA_BUF_SYNC_START | DMA_BUF_SYNC_RW))
+			LOG_ERROR("failed to lock-sync-write dma buf");
 		return;
 	}
 
-	int ret = ::ioctl(fb_->planes()[0].fd.get(), DMA_BUF_IOCTL_SYNC, &dma_sync);
-	if (ret)
+	if (policy_ == Policy::Never)
 	{
+		skipped_++;
+		return;
+	}
+
+	// The caches were already invalidated when the request completed, unless the buffer has been flushed since.
+	std::lock_guard<std::mutex> lock(mutex_);
+	State &state = state_[fb];
+	if (state.started)
+		skipped_++;
+	else if (!sync(fb, DMA_BUF_SYNC_START | DMA_BUF_SYNC_RW))
 		LOG_ERROR("failed to lock-sync-write dma buf");
+	state = { true, true };
+}
+
+void BufferSyncManager::EndWrite(libcamera::FrameBuffer *fb)
+{
+	if (policy_ == Policy::Always)
+	{
+		if (!sync(fb, DMA_BUF_SYNC_END | DMA_BUF_SYNC_RW))
+			LOG_ERROR("failed to unlock-sync-write dma buf");
+		return;
+	}
+	// Otherwise the writes get cleaned out when the buffer is flushed or ended.
+	skipped_++;
+}
+
+void BufferSyncManager::Flush(libcamera::FrameBuffer *fb)
+{
+	if (policy_ != Policy::Auto)
+		return;
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	State &state = state_[fb];
+	if (!state.dirty)
+		return;
+	if (!sync(fb, DMA_BUF_SYNC_END | DMA_BUF_SYNC_RW))
+		LOG_ERROR("failed to flush dma buf");
+	state = { false, false };
+}
+
+void BufferSyncManager::Invalidate(libcamera::FrameBuffer *fb)
+{
+	if (policy_ == Policy::Never)
+	{
+		skipped_++;
+		return;
+	}
+
+	// A START drops whatever the CPU caches hold of the buffer. End() pairs it with an END as usual.
+	if (!sync(fb, DMA_BUF_SYNC_START | DMA_BUF_SYNC_RW))
+		LOG_ERROR("failed to invalidate dma buf");
+	if (policy_ == Policy::Auto)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		state_[fb] = { true, false };
+	}
+}
+
+void BufferSyncManager::End(libcamera::FrameBuffer *fb)
+{
+	if (policy_ == Policy::Never)
+	{
+		skipped_++;
+		return;
+	}
+
+	uint64_t flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
+	if (policy_ == Policy::Auto)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		State &state = state_[fb];
+		if (!state.started)
+		{
+			skipped_++;
+			return;
+		}
+		if (state.dirty)
+			flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_RW;
+		state = { false, false };
+	}
+
+	if (!sync(fb, flags))
+		throw std::runtime_error("failed to sync dma buf on queue request");
+}
+
+BufferWriteSync::BufferWriteSync(RPiCamApp *app, libcamera::FrameBuffer *fb)
+	: app_(app), fb_(fb)
+{
+	auto it = app->mapped_buffers_.find(fb_);
+	if (it == app->mapped_buffers_.end())
+	{
+		LOG_ERROR("failed to find buffer in BufferWriteSync");
 		return;
 	}
 
+	app_->buffer_sync_.BeginWrite(fb_);
 	planes_ = it->second;
 }
 
 BufferWriteSync::~BufferWriteSync()
 {
-	struct dma_buf_sync dma_sync {};
-	dma_sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_RW;
-
-	int ret = ::ioctl(fb_->planes()[0].fd.get(), DMA_BUF_IOCTL_SYNC, &dma_sync);
-	if (ret)
-		LOG_ERROR("failed to unlock-sync-write dma buf");
+	if (!planes_.empty())
+		app_->buffer_sync_.EndWrite(fb_);
 }
 
 const std::vector<libcamera::Span<uint8_t>> &BufferWriteSync::Get() const
@@ -51,6 +171,16 @@ const std::vector<libcamera::Span<uint8_t>> &BufferWriteSync::Get() const
 	return planes_;
 }
 
+BufferDeviceSync::BufferDeviceSync(RPiCamApp *app, libcamera::FrameBuffer *fb) : app_(app), fb_(fb)
+{
+	app_->buffer_sync_.Flush(fb_);
+}
+
+BufferDeviceSync::~BufferDeviceSync()
+{
+	app_->buffer_sync_.Invalidate(fb_);
+}
+
 BufferReadSync::BufferReadSync(RPiCamApp *app, libcamera::FrameBuffer *fb)
 {
 	auto it = app->mapped_buffers_.find(fb);
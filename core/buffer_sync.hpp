@@ -7,10 +7,71 @@
 
 #pragma once
 
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+
 #include <libcamera/framebuffer.h>
 
 class RPiCamApp;
 
+// Issues the DMA_BUF_IOCTL_SYNC calls for the camera buffers, keeping track of what CPU access each buffer already
+// has. With the "auto" policy, a frame on a cached heap costs one START when the request completes and one END when
+// the buffer is requeued (or handed to a device, see Flush()), however many stages read or write it. Uncached heaps
+// need no syncs at all. The "always" policy syncs around every write, as we used to.
+class BufferSyncManager
+{
+public:
+	enum class Policy
+	{
+		Auto,
+		Always,
+		Never,
+	};
+
+	struct Stats
+	{
+		uint64_t frames; // buffers that have completed
+		uint64_t ioctls; // syncs issued
+		uint64_t skipped; // syncs that would have been issued under the "always" policy
+		uint64_t time_ns; // spent in the ioctls
+	};
+
+	void Configure(Policy policy, bool cached_heap);
+
+	// The buffer has been filled by the camera. The CPU may read it from now on.
+	void Begin(libcamera::FrameBuffer *fb);
+	// The CPU is about to write the buffer, and has finished writing it.
+	void BeginWrite(libcamera::FrameBuffer *fb);
+	void EndWrite(libcamera::FrameBuffer *fb);
+	// Make any CPU writes visible before a device (encoder, display, GPU) reads the buffer.
+	void Flush(libcamera::FrameBuffer *fb);
+	// A device (the GPU) has written the buffer. The CPU may read and write it again from now on.
+	void Invalidate(libcamera::FrameBuffer *fb);
+	// The buffer is going back to the camera.
+	void End(libcamera::FrameBuffer *fb);
+
+	Stats GetStats() const { return { frames_, ioctls_, skipped_, time_ns_ }; }
+
+private:
+	struct State
+	{
+		bool started = false;
+		bool dirty = false;
+	};
+
+	bool sync(libcamera::FrameBuffer *fb, uint64_t flags);
+
+	Policy policy_ = Policy::Always;
+	std::mutex mutex_;
+	std::map<libcamera::FrameBuffer *, State> state_;
+	std::atomic<uint64_t> frames_ { 0 };
+	std::atomic<uint64_t> ioctls_ { 0 };
+	std::atomic<uint64_t> skipped_ { 0 };
+	std::atomic<uint64_t> time_ns_ { 0 };
+};
+
 class BufferWriteSync
 {
 public:
@@ -20,10 +81,25 @@ public:
 	const std::vector<libcamera::Span<uint8_t>> &Get() const;
 
 private:
+	RPiCamApp *app_;
 	libcamera::FrameBuffer *fb_;
 	std::vector<libcamera::Span<uint8_t>> planes_;
 };
 
+// For handing a camera buffer to a device (the GPU) that reads and writes it through its DMABUF, for as long as
+// this is in scope: CPU writes are flushed out first, and the CPU caches are invalidated afterwards so that the CPU
+// sees what the device wrote.
+class BufferDeviceSync
+{
+public:
+	BufferDeviceSync(RPiCamApp *app, libcamera::FrameBuffer *fb);
+	~BufferDeviceSync();
+
+private:
+	RPiCamApp *app_;
+	libcamera::FrameBuffer *fb_;
+};
+
 class BufferReadSync
 {
 public:
@@ -7,12 +7,49 @@
 
 #pragma once
 
+#include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
 
 #include <libcamera/controls.h>
 #include <libcamera/request.h>
 
 #include "core/metadata.hpp"
+#include "core/overlay.hpp"
+
+// Data derived from a frame, such as the RGB images inference stages want, made the first time anyone asks for it
+// and then shared with everyone else who asks for the same thing. Stages running at the same time may ask at once:
+// one of them makes it and the others wait.
+class FrameCache
+{
+public:
+	std::vector<uint8_t> const &Get(std::string const &key, std::function<void(std::vector<uint8_t> &)> const &make)
+	{
+		Entry *entry;
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			std::unique_ptr<Entry> &e = entries_[key];
+			if (!e)
+				e = std::make_unique<Entry>();
+			entry = e.get();
+		}
+		std::call_once(entry->once, make, entry->data);
+		return entry->data;
+	}
+
+private:
+	struct Entry
+	{
+		std::once_flag once;
+		std::vector<uint8_t> data;
+	};
+	std::mutex mutex_;
+	std::map<std::string, std::unique_ptr<Entry>> entries_;
+};
 
 struct CompletedRequest
 {
@@ -31,6 +68,11 @@ struct CompletedRequest
 	Request *request;
 	float framerate;
 	Metadata post_process_metadata;
+	FrameCache cache;
+	// What the stages want the preview to draw over the frame.
+	Overlay overlay;
+	// With a control ring (RPiCamApp::SetControlRing), the step of it the frame was taken with, if that could be told.
+	std::optional<unsigned int> control_step;
 };
 
 using CompletedRequestPtr = std::shared_ptr<CompletedRequest>;
@@ -8,6 +8,7 @@
 #include "dma_heaps.hpp"
 
 #include <array>
+#include <utility>
 #include <fcntl.h>
 #include <linux/dma-buf.h>
 #include <linux/dma-heap.h>
@@ -18,30 +19,45 @@
 
 namespace
 {
+struct HeapName
+{
+	const char *name;
+	bool cached; // CPU mappings go through the cache, so need DMA_BUF_IOCTL_SYNC
+};
+
 /*
  * /dev/dma-heap/vidbuf_cached sym links to either the system heap (Pi 5) or the
  * CMA allocator (Pi 4 and below). If missing, fallback to the CMA allocator.
  */
-const std::vector<const char *> heapNames
+const std::vector<HeapName> heapNames
 {
-	"/dev/dma_heap/vidbuf_cached",
-	"/dev/dma_heap/linux,cma",
+	{ "/dev/dma_heap/vidbuf_cached", true },
+	{ "/dev/dma_heap/linux,cma", true },
+};
+
+const std::vector<std::pair<const char *, HeapName>> namedHeaps
+{
+	{ "cma", { "/dev/dma_heap/linux,cma", true } },
+	{ "system", { "/dev/dma_heap/system", true } },
+	{ "system-uncached", { "/dev/dma_heap/system-uncached", false } },
 };
 
 } // namespace
 
 DmaHeap::DmaHeap()
 {
-	for (const char *name : heapNames)
+	for (const HeapName &heap : heapNames)
 	{
-		int ret = ::open(name, O_RDWR | O_CLOEXEC, 0);
+		int ret = ::open(heap.name, O_RDWR | O_CLOEXEC, 0);
 		if (ret < 0)
 		{
-			LOG(2, "Failed to open " << name << ": " << ret);
+			LOG(2, "Failed to open " << heap.name << ": " << ret);
 			continue;
 		}
 
 		dmaHeapHandle_ = libcamera::UniqueFD(ret);
+		cached_ = heap.cached;
+		name_ = heap.name;
 		break;
 	}
 
@@ -49,6 +65,31 @@ DmaHeap::DmaHeap()
 		LOG_ERROR("Could not open any dmaHeap device");
 }
 
+bool DmaHeap::select(std::string const &heap)
+{
+	if (heap == "auto")
+		return isValid();
+
+	HeapName chosen = { heap.c_str(), heap.find("uncached") == std::string::npos };
+	for (auto const &[key, named] : namedHeaps)
+	{
+		if (heap == key)
+			chosen = named;
+	}
+
+	int ret = ::open(chosen.name, O_RDWR | O_CLOEXEC, 0);
+	if (ret < 0)
+	{
+		LOG_ERROR("Could not open dmaHeap device " << chosen.name);
+		return false;
+	}
+
+	dmaHeapHandle_ = libcamera::UniqueFD(ret);
+	cached_ = chosen.cached;
+	name_ = chosen.name;
+	return true;
+}
+
 DmaHeap::~DmaHeap()
 {
 }
@@ -9,16 +9,38 @@
 
 #include <stddef.h>
 
+#include <string>
+
 #include <libcamera/base/unique_fd.h>
 
+// The heap the camera buffers come from decides how fast the CPU can get at them:
+//
+// - Cached heaps (vidbuf_cached, linux,cma, system) give full memory bandwidth to CPU consumers that read every
+//   byte, such as the DNG unpack, the PNG and MJPEG encoders and the motion detector, but every frame costs a
+//   cache invalidate (and a clean, if the CPU writes to it).
+// - Uncached heaps (system-uncached) need no cache maintenance at all, which suits frames that go straight to
+//   hardware (the H.264 encoder, the preview), but CPU reads from them are many times slower, so they are a poor
+//   choice for anything that processes the image in software.
+// - The system heap isn't physically contiguous, so can only be used where the ISP has an IOMMU (Pi 5). On earlier
+//   models use CMA.
+//
+// With --verbose 2 the CPU read rate of the camera buffers is measured and logged at startup, to compare heaps on a
+// given system.
 class DmaHeap
 {
 public:
 	DmaHeap();
 	~DmaHeap();
+	// Use the named heap instead: "auto" (the default), "cma", "system", "system-uncached" or the path to a heap
+	// device. Returns false if it couldn't be opened.
+	bool select(std::string const &heap);
 	bool isValid() const { return dmaHeapHandle_.isValid(); }
+	bool cached() const { return cached_; }
+	std::string const &name() const { return name_; }
 	libcamera::UniqueFD alloc(const char *name, std::size_t size) const;
 
 private:
 	libcamera::UniqueFD dmaHeapHandle_;
+	bool cached_ = true;
+	std::string name_;
 };
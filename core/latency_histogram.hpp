@@ -0,0 +1,73 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * latency_histogram.hpp - Lock-free latency histogram with percentiles.
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+// Latencies in microseconds, counted in buckets four to each power of two, so that percentiles come out within
+// about 20%. Any number of threads may Add() at once.
+class LatencyHistogram
+{
+public:
+	void Add(uint64_t us)
+	{
+		counts_[bucket(us)].fetch_add(1, std::memory_order_relaxed);
+		total_.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	uint64_t Count() const { return total_.load(std::memory_order_relaxed); }
+
+	// The upper bound of the bucket holding the given fraction (0 to 1) of the samples, or 0 with no samples.
+	uint64_t Percentile(double fraction) const
+	{
+		uint64_t total = Count();
+		if (!total)
+			return 0;
+		uint64_t wanted = fraction * total + 0.5, seen = 0;
+		for (unsigned int i = 0; i < BUCKETS; i++)
+		{
+			seen += counts_[i].load(std::memory_order_relaxed);
+			if (seen >= wanted && seen)
+				return upper(i);
+		}
+		return upper(BUCKETS - 1);
+	}
+
+	void Reset()
+	{
+		for (auto &count : counts_)
+			count.store(0, std::memory_order_relaxed);
+		total_.store(0, std::memory_order_relaxed);
+	}
+
+private:
+	static constexpr unsigned int BUCKETS = 128;
+
+	static unsigned int bucket(uint64_t us)
+	{
+		if (us < 4)
+			return us;
+		if (us >= UINT64_C(1) << 32)
+			return BUCKETS - 1;
+		unsigned int e = 63 - __builtin_clzll(us);
+		return 4 * (e - 1) + ((us >> (e - 2)) & 3);
+	}
+
+	static uint64_t upper(unsigned int i)
+	{
+		if (i < 4)
+			return i;
+		unsigned int e = i / 4 + 1;
+		return ((uint64_t)(4 + i % 4 + 1) << (e - 2)) - 1;
+	}
+
+	std::array<std::atomic<uint64_t>, BUCKETS> counts_ {};
+	std::atomic<uint64_t> total_ { 0 };
+};
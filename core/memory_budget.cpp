@@ -0,0 +1,147 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * memory_budget.cpp - Accounting for the memory held by the app's frame buffers, against configurable limits.
+ */
+
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+
+#include "core/logging.hpp"
+#include "core/memory_budget.hpp"
+
+static char const *account_names[MemoryBudget::NUM_ACCOUNTS] = { "encoder", "staging", "output" };
+
+MemoryBudget &MemoryBudget::Get()
+{
+	static MemoryBudget budget;
+	return budget;
+}
+
+char const *MemoryBudget::Name(Account account)
+{
+	return account_names[account];
+}
+
+MemoryBudget::Limits MemoryBudget::Parse(std::string const &spec)
+{
+	Limits limits {};
+	std::stringstream stream(spec);
+	std::string item;
+	while (std::getline(stream, item, ','))
+	{
+		if (item.empty())
+			continue;
+		size_t equals = item.find('=');
+		std::string name = equals == std::string::npos ? "total" : item.substr(0, equals);
+		std::string value = equals == std::string::npos ? item : item.substr(equals + 1);
+
+		unsigned int index = 0;
+		while (index < NUM_ACCOUNTS && name != account_names[index])
+			index++;
+		if (index == NUM_ACCOUNTS && name != "total")
+			throw std::runtime_error("unknown --memory-budget subsystem " + name);
+
+		size_t pos = 0;
+		unsigned long mb = 0;
+		try
+		{
+			mb = std::stoul(value, &pos);
+		}
+		catch (std::exception const &)
+		{
+			pos = 0;
+		}
+		if (!pos || pos != value.size())
+			throw std::runtime_error("bad --memory-budget limit " + item);
+		limits[index] = (size_t)mb << 20;
+	}
+	return limits;
+}
+
+void MemoryBudget::Configure(Limits const &limits, bool block)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	for (unsigned int i = 0; i < limits.size(); i++)
+		usage_[i].limit = limits[i];
+	block_ = block;
+	cond_.notify_all();
+}
+
+void MemoryBudget::Charge(Account account, size_t bytes)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	for (Usage *usage : { &usage_[account], &usage_[NUM_ACCOUNTS] })
+	{
+		usage->bytes += bytes;
+		usage->peak = std::max(usage->peak, usage->bytes);
+	}
+}
+
+void MemoryBudget::Credit(Account account, size_t bytes)
+{
+	if (!bytes)
+		return;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		for (Usage *usage : { &usage_[account], &usage_[NUM_ACCOUNTS] })
+			usage->bytes -= std::min(usage->bytes, bytes);
+	}
+	cond_.notify_all();
+}
+
+bool MemoryBudget::available(Account account, size_t bytes) const
+{
+	for (Usage const *usage : { &usage_[account], &usage_[NUM_ACCOUNTS] })
+	{
+		if (usage->limit && usage->bytes + bytes > usage->limit)
+			return false;
+	}
+	return true;
+}
+
+bool MemoryBudget::Available(Account account, size_t bytes)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return available(account, bytes);
+}
+
+bool MemoryBudget::Wait(Account account, size_t bytes, std::chrono::milliseconds timeout)
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	return cond_.wait_for(lock, timeout, [&] { return available(account, bytes); });
+}
+
+void MemoryBudget::Refuse(Account account)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	usage_[account].refused++;
+	usage_[NUM_ACCOUNTS].refused++;
+
+	// At most once a second, so as not to add to our troubles.
+	auto now = std::chrono::steady_clock::now();
+	if (now - last_report_ < std::chrono::seconds(1))
+		return;
+	last_report_ = now;
+	Usage const &usage = usage_[account], &total = usage_[NUM_ACCOUNTS];
+	LOG_ERROR("WARNING: MemoryBudget: " << account_names[account] << " holding " << (usage.bytes >> 20) << "MB of "
+										<< (usage.limit >> 20) << "MB, all " << (total.bytes >> 20) << "MB of "
+										<< (total.limit >> 20) << "MB, "
+										<< usage.refused - reported_refused_[account]
+										<< " refused since the last report");
+	reported_refused_[account] = usage.refused;
+}
+
+MemoryBudget::Usage MemoryBudget::GetUsage(Account account)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return usage_[account];
+}
+
+MemoryBudget::Usage MemoryBudget::GetTotal()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return usage_[NUM_ACCOUNTS];
+}
@@ -0,0 +1,79 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * memory_budget.hpp - Accounting for the memory held by the app's frame buffers, against configurable limits.
+ */
+
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+// Keeps count of the memory in the buffers that grow when something downstream stalls (slow storage, say), by the
+// subsystem holding it, so that a stall ends in dropped or delayed frames rather than with the OOM killer. Limits are
+// set with --memory-budget, for each subsystem and/or for all of them together. Allocations are never refused here.
+// Instead, the places where frames come in ask whether there's room, and either wait for some ("block") or turn the
+// frame away ("drop"), as --memory-policy says. Usage and peaks go out with every --telemetry report.
+class MemoryBudget
+{
+public:
+	enum Account
+	{
+		ENCODER, // encoded frames and the encoders' working buffers
+		STAGING, // copies of camera frames waiting to be encoded
+		OUTPUT, // files waiting to be written, and the circular buffer
+		NUM_ACCOUNTS
+	};
+
+	struct Usage
+	{
+		size_t bytes;
+		size_t peak;
+		size_t limit; // 0 for none
+		uint64_t refused; // frames or buffers turned away for want of room
+	};
+
+	// Limits in bytes, for each account and then for the total.
+	typedef std::array<size_t, NUM_ACCOUNTS + 1> Limits;
+
+	// One budget is shared by the whole process, as that's what the OOM killer looks at.
+	static MemoryBudget &Get();
+	static char const *Name(Account account);
+	// Parse a --memory-budget: a comma separated list of limits in MB, each "<account>=<MB>" or, for the total,
+	// "total=<MB>" or just "<MB>". Throws if it doesn't parse.
+	static Limits Parse(std::string const &spec);
+
+	void Configure(Limits const &limits, bool block);
+	bool Blocking() const { return block_; }
+
+	void Charge(Account account, size_t bytes);
+	void Credit(Account account, size_t bytes);
+	// Whether another "bytes" would leave both the account and the total within their limits.
+	bool Available(Account account, size_t bytes = 0);
+	// Wait until Available(), or the timeout passes. Only Credit() wakes us, so other accounts' memory going is missed
+	// until the timeout.
+	bool Wait(Account account, size_t bytes, std::chrono::milliseconds timeout);
+	// Count a frame or buffer turned away, and warn about it now and again.
+	void Refuse(Account account);
+
+	Usage GetUsage(Account account);
+	Usage GetTotal();
+
+private:
+	MemoryBudget() = default;
+
+	bool available(Account account, size_t bytes) const;
+
+	std::mutex mutex_;
+	std::condition_variable cond_;
+	bool block_ = true;
+	std::array<Usage, NUM_ACCOUNTS + 1> usage_ {};
+	std::array<uint64_t, NUM_ACCOUNTS> reported_refused_ {};
+	std::chrono::steady_clock::time_point last_report_;
+};
@@ -7,100 +7,232 @@
 #pragma once
 
 // A simple class for carrying arbitrary metadata, for example about an image.
+//
+// Tags are reduced to 64-bit keys by hashing their names, which a constexpr
+// MetadataKey or MetadataTag does at compile time, so that lookups are integer
+// compares over a short flat array rather than string compares in a map. The
+// entries are shared between copies and only copied when a shared copy is
+// written to, which makes handing metadata to the encoders cheap.
+//
+// There is no locking. Only one thread may write to a Metadata object, and
+// nobody else may be using that same object while it does. Where another
+// thread needs the metadata, give it its own copy.
 
+#include <algorithm>
 #include <any>
-#include <map>
-#include <mutex>
+#include <array>
+#include <cstdint>
+#include <memory>
 #include <string>
+#include <vector>
 
-class Metadata
+class MetadataKey
 {
 public:
-	Metadata() = default;
+	constexpr MetadataKey(char const *name) : id_(hash(name)) {}
+	MetadataKey(std::string const &name) : id_(hash(name.c_str())) {}
+
+	constexpr uint64_t Id() const { return id_; }
 
-	Metadata(Metadata const &other)
+private:
+	// 64-bit FNV-1a.
+	static constexpr uint64_t hash(char const *name)
 	{
-		std::scoped_lock other_lock(other.mutex_);
-		data_ = other.data_;
+		uint64_t h = 14695981039346656037ull;
+		for (; *name; name++)
+			h = (h ^ (uint8_t)*name) * 1099511628211ull;
+		return h;
 	}
 
-	Metadata(Metadata &&other)
+	uint64_t id_;
+};
+
+// A key that also fixes the type of the value stored under it.
+template <typename T>
+class MetadataTag : public MetadataKey
+{
+public:
+	using Type = T;
+	constexpr MetadataTag(char const *name) : MetadataKey(name) {}
+};
+
+class Metadata
+{
+public:
+	Metadata() = default;
+	Metadata(Metadata const &other) = default;
+	Metadata(Metadata &&other) noexcept : data_(std::move(other.data_)) {}
+
+	Metadata &operator=(Metadata const &other) = default;
+	Metadata &operator=(Metadata &&other) noexcept
 	{
-		std::scoped_lock other_lock(other.mutex_);
 		data_ = std::move(other.data_);
-		other.data_.clear();
+		other.data_.reset();
+		return *this;
 	}
 
 	template <typename T>
-	void Set(std::string const &tag, T &&value)
+	void Set(MetadataKey key, T &&value)
 	{
-		std::scoped_lock lock(mutex_);
-		data_.insert_or_assign(tag, std::forward<T>(value));
+		assign<std::decay_t<T>>(entry(key.Id()), std::forward<T>(value));
 	}
 
+	template <typename T, typename U>
+	void Set(MetadataTag<T> const &tag, U &&value)
+	{
+		assign<T>(entry(tag.Id()), std::forward<U>(value));
+	}
+
+	// Throws std::bad_any_cast if the value has a different type.
 	template <typename T>
-	int Get(std::string const &tag, T &value) const
+	int Get(MetadataKey key, T &value) const
 	{
-		std::scoped_lock lock(mutex_);
-		auto it = data_.find(tag);
-		if (it == data_.end())
+		Entry const *e = find(key.Id());
+		if (!e)
 			return -1;
-		value = std::any_cast<T>(it->second);
+		value = std::any_cast<T const &>(e->value);
 		return 0;
 	}
 
-	void Clear()
+	// In-place access. The pointer is good until the Metadata is next changed.
+	template <typename T>
+	T const *Find(MetadataTag<T> const &tag) const
 	{
-		std::scoped_lock lock(mutex_);
-		data_.clear();
+		Entry const *e = find(tag.Id());
+		return e ? std::any_cast<T>(&e->value) : nullptr;
 	}
 
-	Metadata &operator=(Metadata const &other)
+	void Clear()
 	{
-		std::scoped_lock lock(mutex_, other.mutex_);
-		data_ = other.data_;
-		return *this;
+		if (data_.use_count() == 1)
+			data_->clear();
+		else
+			data_.reset();
 	}
 
-	Metadata &operator=(Metadata &&other)
+	// Move over everything from other that we don't already have. What's left in other is what clashed.
+	void Merge(Metadata &other)
 	{
-		std::scoped_lock lock(mutex_, other.mutex_);
-		data_ = std::move(other.data_);
-		other.data_.clear();
-		return *this;
+		if (!other.data_ || this == &other)
+			return;
+		Store &from = other.writable();
+		for (unsigned int i = 0; i < from.size;)
+		{
+			Entry &e = from.at(i);
+			if (find(e.id))
+				i++;
+			else
+			{
+				entry(e.id).value = std::move(e.value);
+				from.erase(i);
+			}
+		}
 	}
 
-	void Merge(Metadata &other)
+private:
+	struct Entry
 	{
-		std::scoped_lock lock(mutex_, other.mutex_);
-		data_.merge(other.data_);
-	}
+		uint64_t id = 0;
+		std::any value;
+	};
 
-	template <typename T>
-	T *GetLocked(std::string const &tag)
+	// Enough for a typical frame's worth of tags without going to the overflow vector.
+	static constexpr unsigned int INLINE_ENTRIES = 16;
+
+	struct Store
 	{
-		// This allows in-place access to the Metadata contents,
-		// for which you should be holding the lock.
-		auto it = data_.find(tag);
-		if (it == data_.end())
+		Entry &at(unsigned int i) { return i < INLINE_ENTRIES ? entries[i] : overflow[i - INLINE_ENTRIES]; }
+		Entry const &at(unsigned int i) const
+		{
+			return i < INLINE_ENTRIES ? entries[i] : overflow[i - INLINE_ENTRIES];
+		}
+		Entry &add(uint64_t id)
+		{
+			if (size >= INLINE_ENTRIES)
+				overflow.emplace_back();
+			Entry &e = at(size++);
+			e.id = id;
+			return e;
+		}
+		void erase(unsigned int i)
+		{
+			Entry &last = at(size - 1);
+			if (&at(i) != &last)
+				at(i) = std::move(last);
+			last.value.reset();
+			if (--size >= INLINE_ENTRIES)
+				overflow.pop_back();
+		}
+		void clear()
+		{
+			for (unsigned int i = 0; i < std::min(size, INLINE_ENTRIES); i++)
+				entries[i].value.reset();
+			overflow.clear();
+			size = 0;
+		}
+
+		unsigned int size = 0;
+		std::array<Entry, INLINE_ENTRIES> entries;
+		std::vector<Entry> overflow;
+	};
+
+	Entry const *find(uint64_t id) const
+	{
+		if (!data_)
 			return nullptr;
-		return std::any_cast<T>(&it->second);
+		for (unsigned int i = 0; i < data_->size; i++)
+		{
+			if (data_->at(i).id == id)
+				return &data_->at(i);
+		}
+		return nullptr;
 	}
 
-	template <typename T>
-	void SetLocked(std::string const &tag, T &&value)
+	// Anyone else sharing the store must keep seeing it unchanged, so take a copy first.
+	Store &writable()
 	{
-		// Use this only if you're holding the lock yourself.
-		data_.insert_or_assign(tag, std::forward<T>(value));
+		if (!data_)
+			data_ = std::make_shared<Store>();
+		else if (data_.use_count() > 1)
+			data_ = std::make_shared<Store>(*data_);
+		return *data_;
 	}
 
-	// Note: use of (lowercase) lock and unlock means you can create scoped
-	// locks with the standard lock classes.
-	// e.g. std::lock_guard<RPiController::Metadata> lock(metadata)
-	void lock() { mutex_.lock(); }
-	void unlock() { mutex_.unlock(); }
+	Entry &entry(uint64_t id)
+	{
+		Store &store = writable();
+		Entry *e = const_cast<Entry *>(find(id));
+		return e ? *e : store.add(id);
+	}
 
-private:
-	mutable std::mutex mutex_;
-	std::map<std::string, std::any> data_;
+	// Re-use the existing value where it's the same type, which saves reallocating strings and vectors every frame.
+	template <typename T, typename U>
+	static void assign(Entry &e, U &&value)
+	{
+		if (T *p = std::any_cast<T>(&e.value))
+			*p = std::forward<U>(value);
+		else
+			e.value.emplace<T>(std::forward<U>(value));
+	}
+
+	std::shared_ptr<Store> data_;
 };
+
+// Tags shared between the apps and the encoders.
+namespace metadata_tags
+{
+inline constexpr MetadataTag<std::string> lamp_color("exif_data.lamp_color");
+inline constexpr MetadataTag<bool> lamp_mixed("lamp.mixed");
+// When the lamp's strobe and the sensor's XVS lines were measured to rise (--strobe-gpio, --xvs-gpio), in ns from the
+// frame's SensorTimestamp.
+inline constexpr MetadataTag<int64_t> strobe_offset("lamp.strobe_offset_ns");
+inline constexpr MetadataTag<int64_t> xvs_offset("lamp.xvs_offset_ns");
+// Which step of --bracket-exposure the frame was taken with.
+inline constexpr MetadataTag<unsigned int> bracket_step("bracket.step");
+inline constexpr MetadataTag<std::string> camera_serial_number("exif_data.camera_serial_number");
+inline constexpr MetadataTag<float> shutter_speed("exif_data.shutter_speed");
+inline constexpr MetadataTag<float> analogue_gain("exif_data.analogue_gain");
+inline constexpr MetadataTag<float> digital_gain("exif_data.digital_gain");
+// Overrides --png-compression-level, for settings changed while running.
+inline constexpr MetadataTag<unsigned int> png_compression_level("png.compression_level");
+} // namespace metadata_tags
@@ -19,6 +19,7 @@
 #include <libcamera/logging.h>
 #include <libcamera/property_ids.h>
 
+#include "core/memory_budget.hpp"
 #include "core/options.hpp"
 
 namespace fs = std::filesystem;
@@ -224,13 +225,64 @@ Options::Options()
 		("post-process-file", value<std::string>(&v_->post_process_file),
 			"Set the file name for configuring the post-processing")
 		("post-process-libs", value<std::string>(&v_->post_process_libs),
-			"Set a custom location for the post-processing library .so files")
+			"Set a custom location for the post-processing library .so files. A module with a <module>.stages "
+			"manifest beside it is only loaded when the post-processing file uses one of the stages it lists")
+		("post-process-threads", value<unsigned int>(&v_->post_process_threads)->default_value(0),
+			"Number of post-processing worker threads (0 = one per CPU core)")
+		("post-process-affinity", value<std::string>(&v_->post_process_affinity),
+			"Pin the post-processing worker threads to these CPUs, e.g. \"2,3\" or \"1-3\"")
+		("post-process-queue", value<unsigned int>(&v_->post_process_queue)->default_value(4),
+			"Maximum number of frames waiting for a free post-processing worker (0 = unlimited)")
+		("post-process-overflow", value<std::string>(&v_->post_process_overflow)->default_value("block"),
+			"What to do with a new frame when the post-processing queue is full: \"block\" the camera until a "
+			"worker is free, or \"drop\" the new frame")
+		("post-process-stats", value<unsigned int>(&v_->post_process_stats)->default_value(0),
+			"Report post-processing stage latencies, drops, queue depth and end-to-end latency every so many "
+			"seconds (0 = never)")
+		("post-process-stats-file", value<std::string>(&v_->post_process_stats_file)->default_value(""),
+			"Also write each --post-process-stats report, as JSON, to this file")
+		("telemetry", value<unsigned int>(&v_->telemetry)->default_value(0),
+			"Report every frame lost, wherever it was lost, and the latency of each stage from the sensor timestamp, "
+			"every so many seconds (0 = never)")
+		("telemetry-file", value<std::string>(&v_->telemetry_file)->default_value(""),
+			"Also write each --telemetry report to this file")
+		("telemetry-format", value<std::string>(&v_->telemetry_format)->default_value("text"),
+			"Format of the --telemetry-file, \"text\" or \"prometheus\" (the Prometheus text exposition format)")
+		("memory-budget", value<std::string>(&v_->memory_budget)->default_value(""),
+			"Limit the memory held in frame buffers, in MB: a comma separated list of \"encoder=<MB>\", "
+			"\"staging=<MB>\", \"output=<MB>\" and \"total=<MB>\" (or just \"<MB>\" for the total)")
+		("memory-policy", value<std::string>(&v_->memory_policy)->default_value("block"),
+			"What to do with a new frame when the --memory-budget is used up: \"block\" until some memory is "
+			"freed, or \"drop\" the frame")
+		("trace-file", value<std::string>(&v_->trace_file)->default_value(""),
+			"Record what each thread does with every frame and write it to this file as a Chrome JSON trace (for "
+			"Perfetto or chrome://tracing) on exit, and, in rpicam-raw, on SIGUSR2")
+		("trace-events", value<unsigned int>(&v_->trace_events)->default_value(65536),
+			"How many of its most recent --trace-file events each thread keeps")
+		("buffer-sync", value<std::string>(&v_->buffer_sync)->default_value("auto"),
+			"How to keep the CPU's view of the camera buffers coherent: \"auto\" (one sync per frame, none on "
+			"uncached heaps), \"always\" (sync around every stage that writes a buffer) or \"none\"")
+		("dma-heap", value<std::string>(&v_->dma_heap)->default_value("auto"),
+			"Where to allocate the camera buffers: \"auto\", \"cma\", \"system\" (Pi 5 only), \"system-uncached\" "
+			"(only for frames that software doesn't read) or the path of a heap device")
+		("startup-cache", value<std::string>(&v_->startup_cache)->default_value(""),
+			"File in which to keep each camera's list of sensor modes, so that later runs needn't enumerate them again")
+		("startup-timing", value<bool>(&v_->startup_timing)->default_value(false)->implicit_value(true),
+			"Report how long each phase of starting up took, up to the first frame")
 		("nopreview,n", value<bool>(&v_->nopreview)->default_value(false)->implicit_value(true),
 			"Do not show a preview window")
 		("preview,p", value<std::string>(&v_->preview)->default_value("0,0,0,0"),
 			"Set the preview window dimensions, given as x,y,width,height e.g. 0,0,640,480")
 		("fullscreen,f", value<bool>(&v_->fullscreen)->default_value(false)->implicit_value(true),
 			"Use a fullscreen preview window")
+		("preview-fps", value<float>(&v_->preview_fps)->default_value(0),
+			"Show no more than this many frames per second in the preview window (0 = every frame)")
+		("preview-lores", value<bool>(&v_->preview_lores)->default_value(false)->implicit_value(true),
+			"Preview the lores stream, adding one sized for the preview window if there isn't one, and copy each "
+			"frame so that the camera buffers are never held by the preview")
+		("preview-mailbox", value<bool>(&v_->preview_mailbox)->default_value(false)->implicit_value(true),
+			"In the DRM preview, always show the newest frame, skipping any that arrive while the display is busy, "
+			"rather than waiting to show every one")
 		("qt-preview", value<bool>(&v_->qt_preview)->default_value(false)->implicit_value(true),
 			"Use Qt-based preview window (WARNING: causes heavy CPU load, fullscreen not supported)")
 		("hflip", value<bool>(&v_->hflip_)->default_value(false)->implicit_value(true), "Request a horizontal flip transform")
@@ -286,6 +338,9 @@ Options::Options()
 		("viewfinder-mode", value<std::string>(&v_->viewfinder_mode_string),
 			"Camera mode for preview as W:H:bit-depth:packing, where packing is P (packed) or U (unpacked)")
 		("buffer-count", value<unsigned int>(&v_->buffer_count)->default_value(0), "Number of in-flight requests (and buffers) configured for video, raw, and still.")
+		("auto-buffer-count", value<bool>(&v_->auto_buffer_count)->default_value(false)->implicit_value(true),
+			"Size the raw stream's buffers from the measured encode latency and the frame period, instead of the "
+			"fixed default. Ignored if --buffer-count is given.")
 		("viewfinder-buffer-count", value<unsigned int>(&v_->viewfinder_buffer_count)->default_value(0), "Number of in-flight requests (and buffers) configured for preview window.")
 		("no-raw", value<bool>(&v_->no_raw)->default_value(false)->implicit_value(true),
 			"Disable requesting of a RAW stream. Will override any manual mode reqest the mode choice when setting framerate.")
@@ -306,7 +361,8 @@ Options::Options()
 		("metadata", value<std::string>(&v_->metadata),
 			"Save captured image metadata to a file or \"-\" for stdout")
 		("metadata-format", value<std::string>(&v_->metadata_format)->default_value("json"),
-			"Format to save the metadata in, either txt or json (requires --metadata)")
+			"Format to save the metadata in, either txt, json or bin, a compact binary format that "
+			"utils/metadata_convert.py turns into the others (requires --metadata)")
 		("flicker-period", value<std::string>(&v_->flicker_period_)->default_value("0s"),
 			"Manual flicker correction period"
 			"\nSet to 10000us to cancel 50Hz flicker."
@@ -318,6 +374,33 @@ Options::Options()
 			"Set the directory in which to place the output file")
 		("max-directory-size", value<unsigned int>(&v_->max_directory_size),
 			"Sets the maximum directory size before creating a new one")
+		("dir-lookahead", value<unsigned int>(&v_->dir_lookahead)->default_value(0),
+			"Create this many output directories ahead of time on a background thread, so that rolling over to a "
+			"new directory doesn't hold up capture")
+		("preallocate", value<unsigned int>(&v_->preallocate)->default_value(0),
+			"Create this many output files ahead of time on a background thread, reserving space for each at the "
+			"size of the previous file")
+		("storage-policy", value<std::string>(&v_->storage_policy)->default_value("none"),
+			"What to do as the output filesystem fills: none, decimate (save ever fewer frames), ring (delete the "
+			"oldest output directories) or stop (finish cleanly)")
+		("min-free-space", value<unsigned int>(&v_->min_free_space)->default_value(1024),
+			"Free space (in MB) on the output filesystem below which the --storage-policy takes effect")
+		("storage-check-interval", value<unsigned int>(&v_->storage_check_interval)->default_value(10),
+			"Seconds between checks of the free space on the output filesystem")
+		("upload-url", value<std::string>(&v_->upload_url),
+			"Upload each output directory, once capture has moved on from it, to this http:// URL by PUTting its "
+			"files under <url>/<directory>/")
+		("upload-rate", value<float>(&v_->upload_rate)->default_value(0),
+			"Most MB/s to upload at, 0 for no limit")
+		("upload-delete", value<bool>(&v_->upload_delete)->default_value(false)->implicit_value(true),
+			"Delete each output directory once every file in it has been uploaded")
+		("upload-backoff-depth", value<unsigned int>(&v_->upload_backoff_depth)->default_value(2),
+			"Pause uploading while at least this many files are waiting to be written (with --write-behind)")
+		("thermal-limit", value<float>(&v_->thermal_limit)->default_value(0),
+			"SoC temperature (in C) above which, or while the SoC is throttling, capture is stepped down to cheaper "
+			"PNG compression and then fewer frames, 0 to leave it alone")
+		("thermal-hysteresis", value<float>(&v_->thermal_hysteresis)->default_value(5),
+			"How far (in C) under the --thermal-limit the SoC must be before capture steps back up")
 		("total-frames", value<unsigned int>(&v_->total_frames)->default_value(0),
 			"Sets the maximum number of frames saved before the process terminates")
 		("raw-as-dng", value<bool>(&v_->force_dng)->default_value(false)->implicit_value(true),
@@ -326,8 +409,30 @@ Options::Options()
 			"dng output is 8 bpp")
 		("force-10-bit", value<bool>(&v_->force_10_bit)->default_value(false)->implicit_value(true),
 			"dng output is 10 bpp")
+		("dng-fast", value<bool>(&v_->dng_fast)->default_value(false)->implicit_value(true),
+			"Write DNGs from a precomputed header without libtiff. Raw data keeps its bit depth and no thumbnail "
+			"is included; --force-8-bit, --force-10-bit and compressed input use the normal writer")
+		("dng-compression", value<std::string>(&v_->dng_compression)->default_value("none"),
+			"DNG raw data compression, none, ljpeg (lossless JPEG tiles, usually around half the size), zstd or pisp. "
+			"ljpeg and zstd use the fast writer, so they don't apply with --force-8-bit, --force-10-bit or compressed "
+			"input. zstd tiles are much quicker to make than ljpeg ones, if a little bigger, but need "
+			"utils/dng_zstd_convert.py to make standard DNGs of them later. pisp keeps PiSP compressed input as it is, "
+			"in DNGs that utils/pisp_dng_convert.py turns into standard ones later; other input is written as with none")
+		("dng-zstd-level", value<int>(&v_->dng_zstd_level)->default_value(1),
+			"zstd level for --dng-compression zstd, from -7 (fastest) to 22 (smallest)")
+		("dng-thumbnail", value<unsigned int>(&v_->dng_thumbnail)->default_value(8),
+			"How much smaller than the image the DNG thumbnail is, a power of two from 2 to 64 (the fast writer "
+			"includes no thumbnail)")
+		("dng-thumbnail-gamma", value<float>(&v_->dng_thumbnail_gamma)->default_value(2.0),
+			"Gamma of the DNG thumbnail (2 is a square root)")
 		("lamp-pattern", value<std::string>(&v_->lamp_pattern),
 			"Set the lamp pattern to use")
+		("lamp-cycle", value<bool>(&v_->lamp_cycle)->default_value(false)->implicit_value(true),
+			"Advance the lamp pattern after every captured frame, attributing each frame's lamp color from its "
+			"sensor timestamp")
+		("lamp-upload", value<bool>(&v_->lamp_upload)->default_value(false)->implicit_value(true),
+			"Upload the lamp pattern to the lamp controller, which then steps through it by itself on every "
+			"illumination trigger edge, so once per sensor frame whether the frame is saved or not")
 		("disable-illumination-trigger", value<bool>(&v_->disable_illumination_trigger)->default_value(false)->implicit_value(true),
 			"Disable the illumination trigger")
 		("r-brightness", value<unsigned int>(&v_->r_brightness)->default_value(100),
@@ -346,18 +451,101 @@ Options::Options()
 			"Force the use of the PNG encoder")
 		("png-compression-level", value<unsigned int>(&v_->png_compression_level)->default_value(6),
 			"Set the compression level of the PNG encoder")
+		("png-threads", value<unsigned int>(&v_->png_threads)->default_value(1),
+			"Number of threads that deflate each PNG frame in parallel row bands (0 = one per CPU core, "
+			"1 = a single libpng stream)")
+		("png-demosaic", value<std::string>(&v_->png_demosaic)->default_value("none"),
+			"Write Bayer frames as PNG in colour: \"half\" makes each 2x2 quad one white balanced RGB pixel of a "
+			"half size image, \"none\" writes the mosaic as grey. 8-bit Bayer frames are always written as grey")
+		("jpeg-threads", value<unsigned int>(&v_->jpeg_threads)->default_value(1),
+			"Number of threads that compress each JPEG in parallel row bands, joined with restart markers "
+			"(0 = one per CPU core, 1 = a single libjpeg stream)")
 		("force-still", value<bool>(&v_->force_still)->default_value(false)->implicit_value(true),
 			"Force the use of the still encoder")
+		("bracket-exposure", value<std::string>(&v_->bracket_exposure)->default_value(""),
+			"Cycle the exposure time through these, in us (e.g. 1000,2000,4000), a step each frame, recording the "
+			"step each frame was actually taken with")
 		("every-nth-frame", value<unsigned int>(&v_->every_nth_frame)->default_value(1),
 			"Sets the number of frames to skip between captures")
 		("without-lamp", value<bool>(&v_->without_lamp)->default_value(false)->implicit_value(true),
 			"Disables the lamp")
 		("output-metadata-location", value<std::string>(&v_->output_metadata_location)->default_value(""),
 			"Set the location of the output metadata file")
+		("output-metadata-format", value<std::string>(&v_->output_metadata_format)->default_value("json"),
+			"Format of the output metadata file, either json (the whole file is rewritten every frame) or "
+			"ndjson (one record is appended per frame)")
+		("output-metadata-flush-interval", value<unsigned int>(&v_->output_metadata_flush_interval)->default_value(30),
+			"Flush the ndjson metadata file every this many frames (0 = only when closing, --flush flushes every frame)")
+		("output-metadata-merge", value<std::string>(&v_->output_metadata_merge)->default_value(""),
+			"When using ndjson metadata, merge all the records into a single json file with this name on exit")
+		("write-behind", value<unsigned int>(&v_->write_behind)->default_value(0),
+			"Write output files on a background thread, with at most this many files in flight (0 = write them "
+			"synchronously). Each file is held in memory until it is closed, so this is meant for one image per file")
+		("write-direct", value<bool>(&v_->write_direct)->default_value(false)->implicit_value(true),
+			"With --write-behind, open output files with O_DIRECT so they bypass the page cache")
+		("write-backend", value<std::string>(&v_->write_backend)->default_value("auto"),
+			"Backend for --write-behind: auto, uring or thread (plain blocking writes)")
+		("archive", value<unsigned int>(&v_->archive)->default_value(0)->implicit_value(1024),
+			"Append frames into archive files of up to the given size (in MB), each ending with an index of its "
+			"frames, rather than writing a file per frame")
+		("frame-checksum", value<bool>(&v_->frame_checksum)->default_value(false)->implicit_value(true),
+			"Checksum every frame written (CRC-32C) as it goes out, and record it in the output metadata file and "
+			"the archive index")
 		("fire-and-forget", value<bool>(&v_->fire_and_forget)->default_value(false)->implicit_value(true),
 			"Fire and forget the lamp commands")
+		("lamp-baud", value<unsigned int>(&v_->lamp_baud)->default_value(9600),
+			"Baud rate of the lamp controller's serial lines, a standard rate up to 4000000 that the UART supports")
+		("strobe-gpio", value<std::string>(&v_->strobe_gpio)->default_value(""),
+			"Time the lamp's strobe on this GPIO line, given as <chip>:<offset> (e.g. gpiochip0:17), and record when "
+			"it fired against each frame")
+		("xvs-gpio", value<std::string>(&v_->xvs_gpio)->default_value(""),
+			"Time the sensor's XVS (vertical sync) on this GPIO line, given as <chip>:<offset>, and record it against "
+			"each frame")
+		("lamp-protocol", value<std::string>(&v_->lamp_protocol)->default_value("ascii"),
+			"Protocol spoken to the lamp controller: ascii, or binary for CRC checked frames with several commands "
+			"in flight at once")
 		("camera-serial-number", value<std::string>(&v_->camera_serial_number)->default_value(""),
 			"Set the serial number of the camera (used for EXIF data)")
+		("daemon-socket", value<std::string>(&v_->daemon_socket)->default_value(""),
+			"Run as a daemon with the camera kept streaming, capturing bursts of frames as asked over this Unix "
+			"socket, or tcp:HOST:PORT (\"capture [frames=N] [pattern=R,G,B] [dir=PATH] [report=frames]\", "
+			"\"status\", \"set KEY=VALUE...\", \"settings\" or \"quit\")")
+		("benchmark", value<unsigned int>(&v_->benchmark)->default_value(0),
+			"Without the camera, push this many made-up frames of --width x --height through the encoder and "
+			"output, at --framerate or as fast as they go, and report how they fared (0 = off)")
+		("benchmark-format", value<std::string>(&v_->benchmark_format)->default_value("all"),
+			"Pixel format of the --benchmark frames, such as SRGGB12_CSI2P or YUV420, or \"all\" for every one the "
+			"encoder takes")
+		("benchmark-input", value<std::string>(&v_->benchmark_input),
+			"Take the --benchmark frames from this file of raw frames, laid end to end, rather than making them up")
+		("max-throughput", value<bool>(&v_->max_throughput)->default_value(false)->implicit_value(true),
+			"Before starting, measure how fast frames of each sensor mode can be encoded and the --parent-directory "
+			"written, and choose the mode, bit depth and --every-nth-frame giving the most pixels a second that can "
+			"be kept up with (raw/DNG capture only)")
+		("throughput-cache", value<std::string>(&v_->throughput_cache)->default_value(""),
+			"File holding the --max-throughput measurements, so that they are only made the first time")
+		("control-socket", value<std::string>(&v_->control_socket)->default_value(""),
+			"Take changes to the lamp pattern, every_nth_frame, capture_interval, png_level and dir while "
+			"capturing, without restarting the camera, over this Unix socket, or tcp:HOST:PORT (\"set KEY=VALUE...\", "
+			"\"settings\", \"trigger\" or \"quit\"); a --daemon-socket takes them too")
+		("shm-ring", value<std::string>(&v_->shm_ring)->default_value(""),
+			"Also publish every output frame, with its sequence number, timestamps, lamp color and stream details, "
+			"in a ring in this POSIX shared memory object (such as /rpicam-raw), for other processes to read")
+		("shm-slots", value<unsigned int>(&v_->shm_slots)->default_value(8),
+			"Number of frames the --shm-ring holds")
+		("shm-slot-size", value<unsigned int>(&v_->shm_slot_size)->default_value(0),
+			"Size of each --shm-ring slot in MB (0 = twice the first frame)")
+		("raw-ring", value<unsigned int>(&v_->raw_ring)->default_value(0),
+			"Keep this many of the latest frames in memory, unencoded, and save them only when triggered: by "
+			"SIGUSR1, by \"trigger\" on the --control-socket, or by motion from the motion_detect stage (0 = off, "
+			"save every frame)")
+		("raw-ring-post", value<unsigned int>(&v_->raw_ring_post)->default_value(0),
+			"With --raw-ring, also save this many frames after the one that was triggered, starting over if "
+			"triggered again")
+		("cameras", value<std::string>(&v_->cameras)->default_value(""),
+			"Capture from several cameras at once in this one process, given as a list of camera indices like 0,1. "
+			"Each camera's files go in a subdirectory camN of the --parent-directory, and only the first drives the "
+			"lamp and watches the --strobe-gpio and --xvs-gpio lines")
 		// End Wassoc custom options
 		;
 	// clang-format on
@@ -605,6 +793,8 @@ bool OptsInternal::Parse(boost::program_options::variables_map &vm, RPiCamApp *a
 
 	if (sscanf(preview.c_str(), "%u,%u,%u,%u", &preview_x, &preview_y, &preview_width, &preview_height) != 4)
 		preview_x = preview_y = preview_width = preview_height = 0; // use default window
+	if (preview_fps < 0)
+		throw std::runtime_error("--preview-fps must not be negative");
 
 	transform = Transform::Identity;
 	if (hflip_)
@@ -698,14 +888,188 @@ bool OptsInternal::Parse(boost::program_options::variables_map &vm, RPiCamApp *a
 	sharpness = std::clamp(sharpness, 0.0f, 15.99f); // limits are arbitrary..
 
 	png_compression_level = std::clamp(png_compression_level, (unsigned int)0, (unsigned int)10);
+	if (png_demosaic != "none" && png_demosaic != "half")
+		throw std::runtime_error("--png-demosaic should be none or half");
 
 	if (strcasecmp(metadata_format.c_str(), "json") == 0)
 		metadata_format = "json";
 	else if (strcasecmp(metadata_format.c_str(), "txt") == 0)
 		metadata_format = "txt";
+	else if (strcasecmp(metadata_format.c_str(), "bin") == 0)
+		metadata_format = "bin";
 	else
 		throw std::runtime_error("unrecognised metadata format " + metadata_format);
 
+	if (strcasecmp(output_metadata_format.c_str(), "json") == 0)
+		output_metadata_format = "json";
+	else if (strcasecmp(output_metadata_format.c_str(), "ndjson") == 0)
+		output_metadata_format = "ndjson";
+	else
+		throw std::runtime_error("unrecognised output metadata format " + output_metadata_format);
+	if (!output_metadata_merge.empty() && output_metadata_format != "ndjson")
+		LOG_ERROR("WARNING: --output-metadata-merge is only used with the ndjson output metadata format");
+
+	if (strcasecmp(dng_compression.c_str(), "none") == 0)
+		dng_compression = "none";
+	else if (strcasecmp(dng_compression.c_str(), "ljpeg") == 0)
+		dng_compression = "ljpeg";
+	else if (strcasecmp(dng_compression.c_str(), "zstd") == 0)
+		dng_compression = "zstd";
+	else if (strcasecmp(dng_compression.c_str(), "pisp") == 0)
+		dng_compression = "pisp";
+	else
+		throw std::runtime_error("unrecognised DNG compression " + dng_compression);
+#if !ZSTD_PRESENT
+	if (dng_compression == "zstd")
+		throw std::runtime_error("--dng-compression zstd is not available in this build");
+#endif
+	if (dng_zstd_level < -7 || dng_zstd_level > 22)
+		throw std::runtime_error("--dng-zstd-level should be from -7 to 22");
+	if (dng_compression != "none" && (force_8_bit || force_10_bit))
+		LOG_ERROR("WARNING: --dng-compression " << dng_compression
+												<< " is ignored with --force-8-bit and --force-10-bit");
+
+	if (dng_thumbnail < 2 || dng_thumbnail > 64 || (dng_thumbnail & (dng_thumbnail - 1)))
+		throw std::runtime_error("--dng-thumbnail should be a power of two from 2 to 64");
+	if (dng_thumbnail_gamma <= 0)
+		throw std::runtime_error("--dng-thumbnail-gamma should be more than 0");
+
+	if (strcasecmp(write_backend.c_str(), "auto") == 0)
+		write_backend = "auto";
+	else if (strcasecmp(write_backend.c_str(), "uring") == 0)
+		write_backend = "uring";
+	else if (strcasecmp(write_backend.c_str(), "thread") == 0)
+		write_backend = "thread";
+	else
+		throw std::runtime_error("unrecognised write backend " + write_backend);
+
+	if (strcasecmp(storage_policy.c_str(), "none") == 0)
+		storage_policy = "none";
+	else if (strcasecmp(storage_policy.c_str(), "decimate") == 0)
+		storage_policy = "decimate";
+	else if (strcasecmp(storage_policy.c_str(), "ring") == 0)
+		storage_policy = "ring";
+	else if (strcasecmp(storage_policy.c_str(), "stop") == 0)
+		storage_policy = "stop";
+	else
+		throw std::runtime_error("unrecognised storage policy " + storage_policy);
+	if (!control_socket.empty() && !daemon_socket.empty())
+		throw std::runtime_error("--control-socket isn't needed with --daemon-socket, which takes the same commands");
+	if (!shm_ring.empty() && (shm_ring[0] != '/' || shm_ring.find('/', 1) != std::string::npos))
+		throw std::runtime_error("--shm-ring should be a name starting with /, and with no other /");
+	if (max_throughput && (force_jpeg || force_still || force_png))
+		throw std::runtime_error("--max-throughput only plans raw/DNG capture");
+	if (raw_ring && (force_jpeg || force_still))
+		throw std::runtime_error("--raw-ring only keeps raw frames, for DNG or PNG output");
+	if (raw_ring && !daemon_socket.empty())
+		throw std::runtime_error("--raw-ring can't be used with --daemon-socket, which captures only when asked");
+	bracket_exposures.clear();
+	for (size_t start = 0; start < bracket_exposure.size();)
+	{
+		size_t end = std::min(bracket_exposure.find(',', start), bracket_exposure.size());
+		try
+		{
+			size_t used;
+			unsigned long exposure = std::stoul(bracket_exposure.substr(start, end - start), &used);
+			if (!exposure || used != end - start)
+				throw std::invalid_argument("bad exposure");
+			bracket_exposures.push_back(exposure);
+		}
+		catch (std::exception const &)
+		{
+			throw std::runtime_error("--bracket-exposure should be a list of exposure times in us, like 1000,2000");
+		}
+		start = end + 1;
+	}
+	camera_list.clear();
+	for (size_t start = 0; start < cameras.size();)
+	{
+		size_t end = std::min(cameras.find(',', start), cameras.size());
+		try
+		{
+			size_t used;
+			unsigned long index = std::stoul(cameras.substr(start, end - start), &used);
+			if (used != end - start || std::count(camera_list.begin(), camera_list.end(), index))
+				throw std::invalid_argument("bad camera");
+			camera_list.push_back(index);
+		}
+		catch (std::exception const &)
+		{
+			throw std::runtime_error("--cameras should be a list of different camera indices, like 0,1");
+		}
+		start = end + 1;
+	}
+	if (camera_list.size() == 1)
+		throw std::runtime_error("--cameras is for capturing from two or more cameras; use --camera for one");
+	if (camera_list.size() > 1 && (!daemon_socket.empty() || !control_socket.empty() || !shm_ring.empty() ||
+								   !metadata.empty() || !save_pts.empty() || benchmark))
+		throw std::runtime_error("--cameras can't be used with --daemon-socket, --control-socket, --shm-ring, "
+								 "--metadata, --save-pts or --benchmark, which would be shared between the cameras");
+	for (std::string const *gpio : { &strobe_gpio, &xvs_gpio })
+		if (!gpio->empty() && (gpio->rfind(':') == std::string::npos || gpio->rfind(':') + 1 == gpio->size()))
+			throw std::runtime_error("--strobe-gpio and --xvs-gpio should be given as <chip>:<offset>");
+	if (lamp_protocol != "ascii" && lamp_protocol != "binary")
+		throw std::runtime_error("--lamp-protocol should be ascii or binary");
+	if (lamp_upload && disable_illumination_trigger)
+		throw std::runtime_error("--lamp-upload steps the pattern on the illumination trigger, so needs it enabled");
+	if (lamp_upload && lamp_cycle)
+		throw std::runtime_error("--lamp-upload and --lamp-cycle are two ways of cycling the lamp; give only one");
+
+	if (storage_policy != "none" && parent_directory.empty())
+		throw std::runtime_error("--storage-policy needs a --parent-directory to watch");
+	if (!storage_check_interval)
+		storage_check_interval = 1;
+	if (!upload_url.empty())
+	{
+		if (upload_url.rfind("http://", 0) != 0)
+			throw std::runtime_error("--upload-url should be an http:// URL");
+		if (parent_directory.empty())
+			throw std::runtime_error("--upload-url needs a --parent-directory to upload from");
+	}
+	if (upload_rate < 0)
+		throw std::runtime_error("--upload-rate can't be negative");
+	if (thermal_limit < 0 || thermal_hysteresis < 0)
+		throw std::runtime_error("--thermal-limit and --thermal-hysteresis can't be negative");
+
+	if (strcasecmp(post_process_overflow.c_str(), "block") == 0)
+		post_process_overflow = "block";
+	else if (strcasecmp(post_process_overflow.c_str(), "drop") == 0)
+		post_process_overflow = "drop";
+	else
+		throw std::runtime_error("unrecognised post-process overflow policy " + post_process_overflow);
+
+	if (strcasecmp(telemetry_format.c_str(), "text") == 0)
+		telemetry_format = "text";
+	else if (strcasecmp(telemetry_format.c_str(), "prometheus") == 0)
+		telemetry_format = "prometheus";
+	else
+		throw std::runtime_error("unrecognised telemetry format " + telemetry_format);
+
+	// Throws if the budget doesn't parse.
+	MemoryBudget::Parse(memory_budget);
+	if (strcasecmp(memory_policy.c_str(), "block") == 0)
+		memory_policy = "block";
+	else if (strcasecmp(memory_policy.c_str(), "drop") == 0)
+		memory_policy = "drop";
+	else
+		throw std::runtime_error("unrecognised memory policy " + memory_policy);
+#if !RPICAM_TRACE
+	if (!trace_file.empty())
+		throw std::runtime_error("--trace-file needs a build with -Denable_trace=true");
+#endif
+
+	if (strcasecmp(buffer_sync.c_str(), "auto") == 0)
+		buffer_sync = "auto";
+	else if (strcasecmp(buffer_sync.c_str(), "always") == 0)
+		buffer_sync = "always";
+	else if (strcasecmp(buffer_sync.c_str(), "none") == 0)
+		buffer_sync = "none";
+	else
+		throw std::runtime_error("unrecognised buffer sync policy " + buffer_sync);
+	if (dma_heap != "auto" && dma_heap != "cma" && dma_heap != "system" && dma_heap != "system-uncached" &&
+		dma_heap.rfind("/dev/", 0) != 0)
+		throw std::runtime_error("unrecognised dma heap " + dma_heap);
+
 	mode = Mode(mode_string);
 	viewfinder_mode = Mode(viewfinder_mode_string);
 
@@ -725,6 +1089,25 @@ void OptsInternal::Print() const
 	std::cerr << "    output: " << output << std::endl;
 	std::cerr << "    post_process_file: " << post_process_file << std::endl;
 	std::cerr << "    post_process_libs: " << post_process_libs << std::endl;
+	std::cerr << "    post_process_threads: " << post_process_threads << std::endl;
+	if (!post_process_affinity.empty())
+		std::cerr << "    post_process_affinity: " << post_process_affinity << std::endl;
+	std::cerr << "    post_process_queue: " << post_process_queue << std::endl;
+	std::cerr << "    post_process_overflow: " << post_process_overflow << std::endl;
+	std::cerr << "    post_process_stats: " << post_process_stats << std::endl;
+	if (!post_process_stats_file.empty())
+		std::cerr << "    post_process_stats_file: " << post_process_stats_file << std::endl;
+	std::cerr << "    telemetry: " << telemetry << std::endl;
+	if (!telemetry_file.empty())
+		std::cerr << "    telemetry_file: " << telemetry_file << " (" << telemetry_format << ")" << std::endl;
+	if (!memory_budget.empty())
+		std::cerr << "    memory_budget: " << memory_budget << " (" << memory_policy << ")" << std::endl;
+	if (!trace_file.empty())
+		std::cerr << "    trace_file: " << trace_file << " (" << trace_events << " events per thread)" << std::endl;
+	std::cerr << "    buffer_sync: " << buffer_sync << std::endl;
+	std::cerr << "    dma_heap: " << dma_heap << std::endl;
+	std::cerr << "    startup_cache: " << (startup_cache.empty() ? "none" : startup_cache) << std::endl;
+	std::cerr << "    startup_timing: " << startup_timing << std::endl;
 	if (nopreview)
 		std::cerr << "    preview: none" << std::endl;
 	else if (fullscreen)
@@ -735,6 +1118,12 @@ void OptsInternal::Print() const
 		std::cerr << "    preview: " << preview_x << "," << preview_y << "," << preview_width << ","
 					<< preview_height << std::endl;
 	std::cerr << "    qt-preview: " << qt_preview << std::endl;
+	if (preview_fps)
+		std::cerr << "    preview-fps: " << preview_fps << std::endl;
+	if (preview_lores)
+		std::cerr << "    preview-lores: " << preview_lores << std::endl;
+	if (preview_mailbox)
+		std::cerr << "    preview-mailbox: " << preview_mailbox << std::endl;
 	std::cerr << "    transform: " << transformToString(transform) << std::endl;
 	if (roi_width == 0 || roi_height == 0)
 		std::cerr << "    roi: all" << std::endl;
@@ -785,12 +1174,31 @@ void OptsInternal::Print() const
 	std::cerr << "    viewfinder-mode: " << viewfinder_mode.ToString() << std::endl;
 	if (buffer_count > 0)
 		std::cerr << "    buffer-count: " << buffer_count << std::endl;
+	else if (auto_buffer_count)
+		std::cerr << "    buffer-count: auto" << std::endl;
 	if (viewfinder_buffer_count > 0)
 		std::cerr << "    viewfinder-buffer-count: " << viewfinder_buffer_count << std::endl;
 	std::cerr << "    metadata: " << metadata << std::endl;
 	std::cerr << "    metadata-format: " << metadata_format << std::endl;
 }
 
+void OptsInternal::ParseEncodePool()
+{
+	if (encode_priority < 0 || encode_priority > 99 || encode_output_priority < 0 || encode_output_priority > 99)
+		throw std::runtime_error("encode thread priorities must be in the range 0 to 99");
+
+	if (strcasecmp(encode_queue_policy.c_str(), "block") == 0)
+		encode_queue_policy = "block";
+	else if (strcasecmp(encode_queue_policy.c_str(), "drop-oldest") == 0)
+		encode_queue_policy = "drop-oldest";
+	else if (strcasecmp(encode_queue_policy.c_str(), "drop-newest") == 0)
+		encode_queue_policy = "drop-newest";
+	else if (strcasecmp(encode_queue_policy.c_str(), "degrade") == 0)
+		encode_queue_policy = "degrade";
+	else
+		throw std::runtime_error("unrecognised encode queue policy " + encode_queue_policy);
+}
+
 bool OptsInternal::ParseVideo()
 {
 	bitrate.set(bitrate_);
@@ -831,6 +1239,17 @@ bool OptsInternal::ParseVideo()
 		level = "4.2";
 	}
 
+	ParseEncodePool();
+
+	if (strcasecmp(jpeg_encoder.c_str(), "auto") == 0)
+		jpeg_encoder = "auto";
+	else if (strcasecmp(jpeg_encoder.c_str(), "hardware") == 0)
+		jpeg_encoder = "hardware";
+	else if (strcasecmp(jpeg_encoder.c_str(), "software") == 0)
+		jpeg_encoder = "software";
+	else
+		throw std::runtime_error("unrecognised JPEG encoder " + jpeg_encoder);
+
 #ifndef DISABLE_RPI_FEATURES
 	if (strcasecmp(sync_.c_str(), "off") == 0)
 		sync = 0;
@@ -861,6 +1280,33 @@ void OptsInternal::PrintVideo() const
 	std::cerr << "    split: " << split << std::endl;
 	std::cerr << "    segment: " << segment << std::endl;
 	std::cerr << "    circular: " << circular << std::endl;
+	if (circular_trigger)
+		std::cerr << "    circular-trigger: " << circular_trigger << std::endl;
+	if (motion_postroll)
+		std::cerr << "    motion-postroll: " << motion_postroll << "ms" << std::endl;
+	if (udp_gso)
+		std::cerr << "    udp-gso: " << udp_gso << std::endl;
+	if (net_zerocopy)
+		std::cerr << "    net-zerocopy: " << net_zerocopy << std::endl;
+	if (output.compare(0, 6, "rtp://") == 0)
+		std::cerr << "    rtp: mtu " << rtp_mtu << ", pace " << rtp_pace << (rtp_txtime ? ", txtime" : "")
+				  << std::endl;
+	if (fanout)
+		std::cerr << "    fanout: " << fanout << " clients, queue " << fanout_queue << std::endl;
+	std::cerr << "    encode-threads: " << encode_threads << std::endl;
+	if (!encode_affinity.empty())
+		std::cerr << "    encode-affinity: " << encode_affinity << std::endl;
+	std::cerr << "    encode-priority: " << encode_priority << std::endl;
+	if (!encode_output_affinity.empty())
+		std::cerr << "    encode-output-affinity: " << encode_output_affinity << std::endl;
+	std::cerr << "    encode-output-priority: " << encode_output_priority << std::endl;
+	if (encode_staging)
+		std::cerr << "    encode-staging: " << encode_staging << std::endl;
+	if (encode_queue)
+		std::cerr << "    encode-queue: " << encode_queue << " frames, " << encode_queue_policy << std::endl;
+	std::cerr << "    jpeg-encoder: " << jpeg_encoder << std::endl;
+	if (low_latency)
+		std::cerr << "    low-latency: " << low_latency << std::endl;
 #ifndef DISABLE_RPI_FEATURES
 	std::cerr << "    sync: " << sync << std::endl;
 #endif
@@ -891,6 +1337,16 @@ bool OptsInternal::ParseStill()
 	else
 		throw std::runtime_error("invalid encoding format " + encoding);
 
+	if (zsl_burst && (!zsl || immediate))
+		throw std::runtime_error("--zsl-burst needs --zsl, and cannot be used with --immediate");
+	if (timelapse_pipeline && (!timelapse || zsl || immediate))
+		throw std::runtime_error("--timelapse-pipeline needs --timelapse, and cannot be used with --zsl or --immediate");
+	if (timelapse_lock && !timelapse_pipeline)
+		throw std::runtime_error("--timelapse-lock needs --timelapse-pipeline");
+	if (zsl_pre > zsl_burst)
+		throw std::runtime_error("--zsl-pre cannot be more than --zsl-burst");
+	ParseEncodePool();
+
 	return true;
 }
 
@@ -901,6 +1357,8 @@ void OptsInternal::PrintStill() const
 	std::cerr << "    raw: " << raw << std::endl;
 	std::cerr << "    restart: " << restart << std::endl;
 	std::cerr << "    timelapse: " << timelapse.get() << "ms" << std::endl;
+	if (timelapse_pipeline)
+		std::cerr << "    timelapse-pipeline: " << timelapse_pipeline << ", lock: " << timelapse_lock << std::endl;
 	std::cerr << "    framestart: " << framestart << std::endl;
 	std::cerr << "    datetime: " << datetime << std::endl;
 	std::cerr << "    timestamp: " << timestamp << std::endl;
@@ -913,6 +1371,13 @@ void OptsInternal::PrintStill() const
 	std::cerr << "    immediate " << immediate << std::endl;
 	std::cerr << "    AF on capture: " << af_on_capture << std::endl;
 	std::cerr << "    Zero shutter lag: " << zsl << std::endl;
+	if (zsl_burst)
+	{
+		std::cerr << "    zsl-burst: " << zsl_burst << " frames, " << zsl_pre << " before the trigger" << std::endl;
+		std::cerr << "    encode-threads: " << encode_threads << std::endl;
+		if (encode_queue)
+			std::cerr << "    encode-queue: " << encode_queue << " frames, " << encode_queue_policy << std::endl;
+	}
 	for (auto &s : exif)
 		std::cerr << "    EXIF: " << s << std::endl;
 }
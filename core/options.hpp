@@ -178,6 +178,9 @@ struct OptsInternal
 	bool ParseVideo();
 	void PrintVideo() const;
 
+	// The options for an EncodePool, shared by rpicam-vid's encoders and rpicam-still's ZSL bursts.
+	void ParseEncodePool();
+
 	bool ParseStill();
 	void PrintStill() const;
 
@@ -190,12 +193,32 @@ struct OptsInternal
 	std::string output;
 	std::string post_process_file;
 	std::string post_process_libs;
+	unsigned int post_process_threads;
+	std::string post_process_affinity;
+	unsigned int post_process_queue;
+	std::string post_process_overflow;
+	unsigned int post_process_stats;
+	std::string post_process_stats_file;
+	unsigned int telemetry;
+	std::string telemetry_file;
+	std::string telemetry_format;
+	std::string memory_budget;
+	std::string memory_policy;
+	std::string trace_file;
+	unsigned int trace_events;
+	std::string buffer_sync;
+	std::string dma_heap;
+	std::string startup_cache;
+	bool startup_timing;
 	unsigned int width;
 	unsigned int height;
 	bool nopreview;
 	std::string preview;
 	bool fullscreen;
 	unsigned int preview_x, preview_y, preview_width, preview_height;
+	float preview_fps;
+	bool preview_lores;
+	bool preview_mailbox;
 	libcamera::Transform transform;
 	std::string roi;
 	float roi_x, roi_y, roi_width, roi_height;
@@ -233,6 +256,7 @@ struct OptsInternal
 	std::string viewfinder_mode_string;
 	Mode viewfinder_mode;
 	unsigned int buffer_count;
+	bool auto_buffer_count;
 	unsigned int viewfinder_buffer_count;
 	std::string afMode;
 	int afMode_index;
@@ -255,26 +279,75 @@ struct OptsInternal
 	std::string parent_directory;
 	std::string output_directory;
 	unsigned int max_directory_size;
+	unsigned int dir_lookahead;
+	unsigned int preallocate;
+	std::string storage_policy;
+	unsigned int min_free_space;
+	unsigned int storage_check_interval;
+	std::string upload_url;
+	float upload_rate;
+	bool upload_delete;
+	unsigned int upload_backoff_depth;
+	float thermal_limit;
+	float thermal_hysteresis;
 	unsigned int total_frames;
 	bool force_dng;
 	bool force_8_bit;
 	bool force_10_bit;
+	bool dng_fast;
+	std::string dng_compression;
+	int dng_zstd_level;
+	unsigned int dng_thumbnail;
+	float dng_thumbnail_gamma;
 	std::string lamp_pattern;
+	bool lamp_cycle;
+	bool lamp_upload;
 	bool monochrome;
 	float capture_interval;
 	bool force_jpeg;
 	bool force_still;
 	bool force_png;
 	unsigned int png_compression_level;
+	unsigned int png_threads;
+	std::string png_demosaic;
+	unsigned int jpeg_threads;
 	unsigned int every_nth_frame;
+	std::string bracket_exposure;
+	std::vector<unsigned int> bracket_exposures; // from bracket_exposure, in us
 	bool without_lamp;
 	bool disable_illumination_trigger;
 	unsigned int r_brightness;
 	unsigned int g_brightness;
 	unsigned int b_brightness;
 	std::string output_metadata_location;
+	std::string output_metadata_format;
+	unsigned int output_metadata_flush_interval;
+	std::string output_metadata_merge;
+	bool frame_checksum;
+	unsigned int write_behind;
+	bool write_direct;
+	std::string write_backend;
+	unsigned int archive;
 	bool fire_and_forget;
+	unsigned int lamp_baud;
+	std::string strobe_gpio;
+	std::string xvs_gpio;
+	std::string lamp_protocol;
 	std::string camera_serial_number;
+	std::string daemon_socket;
+	unsigned int benchmark;
+	std::string benchmark_format;
+	std::string benchmark_input;
+	bool max_throughput;
+	std::string throughput_cache;
+	std::string shm_ring;
+	unsigned int shm_slots;
+	unsigned int shm_slot_size;
+	std::string control_socket;
+	unsigned int raw_ring;
+	unsigned int raw_ring_post;
+	std::string cameras;
+	std::vector<unsigned int> camera_list; // from cameras
 	// End Wassoc custom options
 	
 	bool hflip_;
@@ -295,6 +368,7 @@ struct OptsInternal
 	std::string libav_video_codec;
 	std::string libav_video_codec_opts;
 	std::string libav_format;
+	uint32_t libav_fragment;
 	bool libav_audio;
 	std::string audio_codec;
 	std::string audio_device;
@@ -306,6 +380,13 @@ struct OptsInternal
 	std::string save_pts;
 	int quality;
 	bool listen;
+	unsigned int udp_gso;
+	bool net_zerocopy;
+	unsigned int rtp_mtu;
+	float rtp_pace;
+	bool rtp_txtime;
+	unsigned int fanout;
+	unsigned int fanout_queue;
 	bool keypress;
 	bool signal;
 	std::string initial;
@@ -313,7 +394,18 @@ struct OptsInternal
 	bool split;
 	uint32_t segment;
 	size_t circular;
+	bool circular_trigger;
+	unsigned int motion_postroll;
 	uint32_t frames;
+	unsigned int encode_threads;
+	std::string encode_affinity;
+	int encode_priority;
+	std::string encode_output_affinity;
+	int encode_output_priority;
+	unsigned int encode_staging;
+	unsigned int encode_queue;
+	std::string encode_queue_policy;
+	std::string jpeg_encoder;
 	bool low_latency;
 #ifndef DISABLE_RPI_FEATURES
 	uint32_t sync;
@@ -343,6 +435,10 @@ struct OptsInternal
 	std::string latest;
 	bool immediate;
 	bool zsl;
+	unsigned int zsl_burst;
+	unsigned int zsl_pre;
+	bool timelapse_pipeline;
+	bool timelapse_lock;
 	std::string timelapse_;
 };
 
@@ -0,0 +1,149 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * overlay.cpp - annotations for the preview to draw over a frame.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "core/overlay.hpp"
+
+namespace
+{
+
+class Canvas
+{
+public:
+	Canvas(uint32_t *pixels, int width, int height, unsigned int stride)
+		: pixels_(pixels), width_(width), height_(height), stride_(stride)
+	{
+	}
+
+	// Paint argb over the pixel with the given coverage, 0 to 255.
+	void Blend(int x, int y, uint32_t argb, unsigned int coverage)
+	{
+		unsigned int a = ((argb >> 24) * coverage + 127) / 255;
+		if (!a)
+			return;
+		uint32_t &dst = pixels_[y * stride_ / 4 + x];
+		unsigned int inv = 255 - a;
+		uint32_t out = 0;
+		for (unsigned int shift = 0; shift < 32; shift += 8)
+		{
+			unsigned int s = shift == 24 ? 255 : (argb >> shift) & 0xff;
+			unsigned int d = (dst >> shift) & 0xff;
+			out |= std::min((s * a + d * inv + 127) / 255, 255u) << shift;
+		}
+		dst = out;
+	}
+
+	// Corners inclusive to exclusive, clipped to the canvas.
+	void Fill(int x0, int y0, int x1, int y1, uint32_t argb)
+	{
+		x0 = std::max(x0, 0), y0 = std::max(y0, 0);
+		x1 = std::min(x1, width_), y1 = std::min(y1, height_);
+		for (int y = y0; y < y1; y++)
+			for (int x = x0; x < x1; x++)
+				Blend(x, y, argb, 255);
+	}
+
+	// Paint every pixel of the bounding box for which inside(x, y) holds, so that nothing is painted twice.
+	template <typename F>
+	void Shape(int x0, int y0, int x1, int y1, uint32_t argb, F inside)
+	{
+		x0 = std::max(x0, 0), y0 = std::max(y0, 0);
+		x1 = std::min(x1, width_), y1 = std::min(y1, height_);
+		for (int y = y0; y < y1; y++)
+			for (int x = x0; x < x1; x++)
+				if (inside(x + 0.5, y + 0.5))
+					Blend(x, y, argb, 255);
+	}
+
+	int Width() const { return width_; }
+	int Height() const { return height_; }
+
+private:
+	uint32_t *pixels_;
+	int width_;
+	int height_;
+	unsigned int stride_;
+};
+
+} // namespace
+
+void OverlayLayer::Render(uint32_t *canvas, unsigned int canvas_width, unsigned int canvas_height,
+						  unsigned int stride) const
+{
+	for (unsigned int y = 0; y < canvas_height; y++)
+		memset(reinterpret_cast<uint8_t *>(canvas) + y * stride, 0, canvas_width * 4);
+
+	Canvas c(canvas, canvas_width, canvas_height, stride);
+	for (OverlayItem const &item : items)
+	{
+		if (!item.width || !item.height)
+			continue;
+		double sx = canvas_width / (double)item.width, sy = canvas_height / (double)item.height;
+		auto X = [sx](int x) { return (int)std::lround(x * sx); };
+		auto Y = [sy](int y) { return (int)std::lround(y * sy); };
+		double t = std::max(item.thickness * (sx + sy) / 2, 1.0);
+		int it = std::lround(t);
+		switch (item.shape)
+		{
+		case OverlayItem::Shape::Line:
+		{
+			double ax = item.x0 * sx, ay = item.y0 * sy, bx = item.x1 * sx, by = item.y1 * sy;
+			double dx = bx - ax, dy = by - ay, len2 = dx * dx + dy * dy, r2 = t * t / 4;
+			c.Shape(std::floor(std::min(ax, bx) - t), std::floor(std::min(ay, by) - t), std::ceil(std::max(ax, bx) + t),
+					std::ceil(std::max(ay, by) + t), item.argb, [&](double x, double y) {
+						double f = len2 > 0 ? std::clamp(((x - ax) * dx + (y - ay) * dy) / len2, 0.0, 1.0) : 0;
+						double ex = ax + f * dx - x, ey = ay + f * dy - y;
+						return ex * ex + ey * ey <= r2;
+					});
+			break;
+		}
+		case OverlayItem::Shape::Rect:
+		{
+			int x0 = X(item.x0), y0 = Y(item.y0), x1 = X(item.x1), y1 = Y(item.y1);
+			c.Fill(x0, y0, x1, std::min(y0 + it, y1), item.argb);
+			c.Fill(x0, std::max(y1 - it, y0 + it), x1, y1, item.argb);
+			c.Fill(x0, y0 + it, std::min(x0 + it, x1), y1 - it, item.argb);
+			c.Fill(std::max(x1 - it, x0 + it), y0 + it, x1, y1 - it, item.argb);
+			break;
+		}
+		case OverlayItem::Shape::FilledRect:
+			c.Fill(X(item.x0), Y(item.y0), X(item.x1), Y(item.y1), item.argb);
+			break;
+		case OverlayItem::Shape::Circle:
+		{
+			double cx = item.x0 * sx, cy = item.y0 * sy, r = item.x1 * (sx + sy) / 2, h = t / 2;
+			c.Shape(std::floor(cx - r - t), std::floor(cy - r - t), std::ceil(cx + r + t), std::ceil(cy + r + t),
+					item.argb, [&](double x, double y) { return std::abs(std::hypot(x - cx, y - cy) - r) <= h; });
+			break;
+		}
+		case OverlayItem::Shape::Mask:
+		{
+			int w = item.x1 - item.x0, h = item.y1 - item.y0;
+			if (!item.mask || w <= 0 || h <= 0 || item.mask->size() < (size_t)w * h)
+				break;
+			// Nearest neighbour is plenty for text the size the stages draw it.
+			int x0 = std::max(X(item.x0), 0), y0 = std::max(Y(item.y0), 0);
+			int x1 = std::min(X(item.x1), c.Width()), y1 = std::min(Y(item.y1), c.Height());
+			for (int y = y0; y < y1; y++)
+			{
+				int my = std::clamp((int)((y + 0.5) / sy) - item.y0, 0, h - 1);
+				uint8_t const *row = item.mask->data() + my * w;
+				for (int x = x0; x < x1; x++)
+				{
+					int mx = std::clamp((int)((x + 0.5) / sx) - item.x0, 0, w - 1);
+					if (row[mx])
+						c.Blend(x, y, item.argb, row[mx]);
+				}
+			}
+			break;
+		}
+		}
+	}
+}
@@ -0,0 +1,89 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * overlay.hpp - annotations for the preview to draw over a frame.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Drawing stages can hand what they draw to the preview, which puts it on a layer of its own over the frame, rather
+// than drawing it into the frame itself. That leaves the recorded frames clean, and costs the stages nothing per pixel
+// of the image. Colours are ARGB, 0xAARRGGBB, not premultiplied.
+struct OverlayItem
+{
+	enum class Shape
+	{
+		// From (x0, y0) to (x1, y1).
+		Line,
+		// Corners (x0, y0) inclusive to (x1, y1) exclusive; Rect is the outline, FilledRect the whole of it.
+		Rect,
+		FilledRect,
+		// The outline of the circle centred on (x0, y0) of radius x1.
+		Circle,
+		// The colour painted wherever the mask is set, in proportion to it. The mask is x1 - x0 by y1 - y0 bytes,
+		// one per pixel with no padding, from (x0, y0).
+		Mask,
+	};
+
+	bool operator==(OverlayItem const &other) const
+	{
+		return shape == other.shape && x0 == other.x0 && y0 == other.y0 && x1 == other.x1 && y1 == other.y1 &&
+			   thickness == other.thickness && argb == other.argb && width == other.width && height == other.height &&
+			   (mask == other.mask || (mask && other.mask && *mask == *other.mask));
+	}
+
+	Shape shape;
+	int x0, y0, x1, y1;
+	int thickness = 1;
+	uint32_t argb = 0xffffffff;
+	std::shared_ptr<std::vector<uint8_t> const> mask;
+	// The coordinates are in the pixels of an image of width by height, that of the stream the stage that drew the
+	// item was looking at. Overlay::Add fills these in.
+	unsigned int width = 0;
+	unsigned int height = 0;
+};
+
+// Everything the stages drew on one frame. Previews scale each item from the image it was drawn for to whatever size
+// they show the frame.
+struct OverlayLayer
+{
+	bool operator==(OverlayLayer const &other) const { return items == other.items; }
+	bool operator!=(OverlayLayer const &other) const { return !(*this == other); }
+
+	// Draw the items into a width by height canvas of premultiplied ARGB, which is cleared first.
+	void Render(uint32_t *canvas, unsigned int canvas_width, unsigned int canvas_height, unsigned int stride) const;
+
+	std::vector<OverlayItem> items;
+};
+
+// A CompletedRequest's overlay. Stages running at the same time may add to it at once, each with items drawn for its
+// own stream of width by height.
+class Overlay
+{
+public:
+	void Add(unsigned int width, unsigned int height, std::vector<OverlayItem> items)
+	{
+		for (OverlayItem &item : items)
+			item.width = width, item.height = height;
+		std::lock_guard<std::mutex> lock(mutex_);
+		layer_.items.insert(layer_.items.end(), std::make_move_iterator(items.begin()),
+							std::make_move_iterator(items.end()));
+	}
+
+	OverlayLayer Get() const
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		return layer_;
+	}
+
+private:
+	mutable std::mutex mutex_;
+	OverlayLayer layer_;
+};
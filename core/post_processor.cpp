@@ -5,14 +5,20 @@
  * post_processor.cpp - Post processor implementation.
  */
 
+#include <algorithm>
 #include <dlfcn.h>
+#include <cstdio>
 #include <filesystem>
+#include <fstream>
 #include <iostream>
 #include <map>
+#include <sstream>
 
 #include "core/options.hpp"
 #include "core/rpicam_app.hpp"
 #include "core/post_processor.hpp"
+#include "core/thread_utils.hpp"
+#include "core/trace.hpp"
 
 #include "post_processing_stages/post_processing_stage.hpp"
 
@@ -72,7 +78,8 @@ const void *PostProcessingLib::GetSymbol(const std::string &symbol)
 	return symbol_map_[symbol];
 }
 
-PostProcessor::PostProcessor(RPiCamApp *app) : app_(app)
+PostProcessor::PostProcessor(RPiCamApp *app)
+	: app_(app), quit_(false), drop_on_overflow_(false), max_queued_(0), dropped_(0)
 {
 }
 
@@ -91,15 +98,61 @@ void PostProcessor::LoadModules(const std::string &lib_dir)
 	if (!fs::exists(path))
 		return;
 
-	// Dynamically load all .so files from the system postprocessing lib path.
-	// This will automatically register the stages with the factory.
+	// Loading a module registers its stages with the factory. Modules with a manifest of their stages beside them
+	// (<module>.stages, one stage name per line) are only loaded once Read() finds one of those stages in the JSON,
+	// as the bigger ones (Hailo, IMX500, OpenCV, TFLite) cost a good deal of startup time and memory. Modules without
+	// one are loaded now.
 	for (auto const &p : fs::recursive_directory_iterator(path))
 	{
-		if (p.path().extension() == ext)
-			dynamic_stages_.emplace_back(p.path().string());
+		if (p.path().extension() != ext)
+			continue;
+		fs::path manifest = fs::path(p.path()).replace_extension(".stages");
+		std::ifstream in(manifest);
+		if (!in)
+		{
+			loadModule(p.path().string());
+			continue;
+		}
+		for (std::string line; std::getline(in, line);)
+		{
+			if (!line.empty() && line[0] != '#')
+				lazy_modules_.emplace(line, p.path().string());
+		}
+	}
+}
+
+void PostProcessor::loadModule(std::string const &path)
+{
+	if (loaded_modules_.insert(path).second)
+	{
+		LOG(2, "Loading post processing module " << path);
+		dynamic_stages_.emplace_back(path);
 	}
 }
 
+static std::vector<std::string> read_list(boost::property_tree::ptree const &node, char const *key)
+{
+	// Either a JSON array of strings or a single comma-separated string.
+	std::vector<std::string> list;
+	auto child = node.get_child_optional(key);
+	if (!child)
+		return list;
+	if (child->empty())
+	{
+		std::string value = child->get_value<std::string>();
+		std::stringstream ss(value);
+		for (std::string item; std::getline(ss, item, ',');)
+			if (!item.empty())
+				list.push_back(item);
+	}
+	else
+	{
+		for (auto const &item : *child)
+			list.push_back(item.second.get_value<std::string>());
+	}
+	return list;
+}
+
 void PostProcessor::Read(std::string const &filename)
 {
 	boost::property_tree::ptree root;
@@ -147,16 +200,92 @@ void PostProcessor::Read(std::string const &filename)
 				LOG(1, "Reading post processing stage \"" << key_and_value.first << "\"");
 				stage->Read(key_and_value.second);
 				stages_.push_back(StagePtr(stage));
+				StageDeps deps = { read_list(key_and_value.second, "after"), read_list(key_and_value.second, "reads"),
+								   read_list(key_and_value.second, "writes") };
+				// Declaring nothing at all means the stage may touch anything.
+				if (deps.reads.empty() && deps.writes.empty())
+					deps.writes = { "*" };
+				stage_deps_.push_back(std::move(deps));
 			}
 			else
 				LOG(1, "No post processing stage found for \"" << key_and_value.first << "\"");
 		}
 	}
+
+	scheduleStages();
+}
+
+void PostProcessor::scheduleStages()
+{
+	auto uses = [](std::vector<std::string> const &list, std::string const &buffer) {
+		return std::find(list.begin(), list.end(), "*") != list.end() ||
+			   std::find(list.begin(), list.end(), buffer) != list.end();
+	};
+	auto conflict = [&uses](StageDeps const &a, StageDeps const &b) {
+		for (auto const &w : a.writes)
+			if (uses(b.reads, w) || uses(b.writes, w) || (w == "*" && (!b.reads.empty() || !b.writes.empty())))
+				return true;
+		for (auto const &w : b.writes)
+			if (uses(a.reads, w) || (w == "*" && !a.reads.empty()))
+				return true;
+		return false;
+	};
+
+	std::vector<unsigned int> step(stages_.size(), 0);
+	unsigned int num_steps = 0;
+	for (unsigned int j = 0; j < stages_.size(); j++)
+	{
+		for (auto const &name : stage_deps_[j].after)
+		{
+			bool found = false;
+			for (unsigned int i = 0; i < j; i++)
+			{
+				if (name == stages_[i]->Name())
+				{
+					step[j] = std::max(step[j], step[i] + 1);
+					found = true;
+				}
+			}
+			if (!found)
+				throw std::runtime_error("post-processing stage " + std::string(stages_[j]->Name()) +
+										 " comes after unknown or later stage " + name);
+		}
+		for (unsigned int i = 0; i < j; i++)
+		{
+			if (conflict(stage_deps_[i], stage_deps_[j]))
+				step[j] = std::max(step[j], step[i] + 1);
+		}
+		num_steps = std::max(num_steps, step[j] + 1);
+	}
+
+	steps_.assign(num_steps, {});
+	for (unsigned int j = 0; j < stages_.size(); j++)
+		steps_[step[j]].push_back(j);
+
+	if (steps_.size() < stages_.size())
+	{
+		LOG(1, "Post-processing stages run in " << steps_.size() << " steps:");
+		for (auto const &s : steps_)
+		{
+			std::stringstream ss;
+			for (unsigned int index : s)
+				ss << " " << stages_[index]->Name();
+			LOG(1, "   " << ss.str());
+		}
+	}
 }
 
 PostProcessingStage *PostProcessor::createPostProcessingStage(char const *name)
 {
 	auto it = GetPostProcessingStages().find(std::string(name));
+	if (it == GetPostProcessingStages().end())
+	{
+		auto module = lazy_modules_.find(name);
+		if (module == lazy_modules_.end())
+			return nullptr;
+		loadModule(module->second);
+		it = GetPostProcessingStages().find(std::string(name));
+	}
 	return it != GetPostProcessingStages().end() ? (*it->second)(app_) : nullptr;
 }
 
@@ -184,8 +313,41 @@ void PostProcessor::Configure()
 void PostProcessor::Start()
 {
 	quit_ = false;
+	dropped_ = 0;
+
+	// The statistics are only worth gathering when there are stages to run.
+	stats_enabled_ = !stages_.empty() && app_->GetOptions()->Get().post_process_stats > 0;
+	stage_stats_.clear();
+	for (unsigned int i = 0; i < stages_.size(); i++)
+		stage_stats_.push_back(std::make_unique<StageStats>());
+	end_to_end_.Reset();
+	max_queue_depth_ = 0;
+	queue_depth_sum_ = queue_depth_samples_ = 0;
+	stats_dropped_ = 0;
+	last_report_ = std::chrono::steady_clock::now();
+
 	output_thread_ = std::thread(&PostProcessor::outputThread, this);
 
+	// Requests are handed to a fixed pool of workers rather than a new thread per frame. The pool only exists
+	// when there are stages to run, otherwise Process() passes requests straight through.
+	if (!stages_.empty())
+	{
+		Options const *options = app_->GetOptions();
+		unsigned int num_threads = options->Get().post_process_threads;
+		if (!num_threads)
+			num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+		std::vector<unsigned int> cpus = parse_cpu_list(options->Get().post_process_affinity);
+		max_queued_ = options->Get().post_process_queue;
+		drop_on_overflow_ = options->Get().post_process_overflow == "drop";
+
+		for (unsigned int i = 0; i < num_threads; i++)
+		{
+			worker_threads_.emplace_back(&PostProcessor::workerThread, this);
+			set_thread_affinity(worker_threads_.back(), cpus);
+		}
+		LOG(2, "PostProcessor: started " << num_threads << " worker threads");
+	}
+
 	for (auto &stage : stages_)
 	{
 		stage->Start();
@@ -194,6 +356,7 @@ void PostProcessor::Start()
 
 void PostProcessor::Process(CompletedRequestPtr &request)
 {
+	TRACE_SCOPE("post_process_queue", { "sequence", request->sequence });
 	if (stages_.empty())
 	{
 		callback_(request);
@@ -201,27 +364,146 @@ void PostProcessor::Process(CompletedRequestPtr &request)
 	}
 
 	std::unique_lock<std::mutex> l(mutex_);
+
+	// When every worker is busy and the queue of waiting requests is full we either drop this request (the
+	// caller's reference is released, returning the buffers to the camera) or block the caller until a worker
+	// picks up the next job. Blocking holds up the camera's completion thread, so the sensor ends up dropping
+	// frames instead of us.
+	if (max_queued_ && jobs_.size() >= max_queued_)
+	{
+		if (drop_on_overflow_)
+		{
+			dropped_++;
+			stats_dropped_++;
+			app_->GetTelemetry().Add(Telemetry::POST_PROCESS_DROPS);
+			LOG(2, "PostProcessor: all workers busy, dropping frame");
+			return;
+		}
+		space_cv_.wait(l, [this] { return quit_ || jobs_.size() < max_queued_; });
+	}
+
 	requests_.push(std::move(request)); // caller has given us ownership of this reference
 
-	std::promise<bool> promise;
-	auto process_fn = [this](CompletedRequestPtr &request, std::promise<bool> promise) {
-		bool drop_request = false;
-		for (auto &stage : stages_)
+	// Queue the futures to ensure we have correct ordering in the output thread. The promise/future return value
+	// tells us when all the streams for this request have been processed and output_ready_callback_ can be called.
+	Job job;
+	job.request = &requests_.back();
+	futures_.push(job.promise.get_future());
+	jobs_.push(std::move(job));
+	worker_cv_.notify_one();
+
+	if (stats_enabled_)
+	{
+		max_queue_depth_ = std::max<unsigned int>(max_queue_depth_, futures_.size());
+		queue_depth_sum_ += futures_.size();
+		queue_depth_samples_++;
+	}
+}
+
+void PostProcessor::workerThread()
+{
+	while (true)
+	{
+		Job job;
 		{
-			if (stage->Process(request))
-			{
-				drop_request = true;
+			std::unique_lock<std::mutex> l(mutex_);
+
+			worker_cv_.wait(l, [this] { return quit_ || !jobs_.empty() || !tasks_.empty(); });
+
+			// Stages handed out from frames already under way come first, as those frames are waiting for them.
+			if (runTask(l))
+				continue;
+
+			// Only quit when there are no jobs left to run.
+			if (jobs_.empty())
 				break;
-			}
+
+			job = std::move(jobs_.front());
+			jobs_.pop();
+			space_cv_.notify_one();
+		}
+
+		bool drop_request = runStages(*job.request);
+		job.promise.set_value(drop_request);
+
+		// Take the lock so the output thread can't miss the notification between testing and waiting.
+		{
+			std::unique_lock<std::mutex> l(mutex_);
 		}
-		promise.set_value(drop_request);
 		cv_.notify_one();
-	};
+	}
+}
 
-	// Queue the futures to ensure we have correct ordering in the output thread. The promise/future return value
-	// tells us when all the streams for this request have been processed and output_ready_callback_ can be called.
-	futures_.push(promise.get_future());
-	std::thread { process_fn, std::ref(requests_.back()), std::move(promise) }.detach();
+bool PostProcessor::runStages(CompletedRequestPtr &request)
+{
+	for (auto const &step : steps_)
+	{
+		if (step.size() == 1)
+		{
+			if (runStage(step[0], request))
+				return true;
+			continue;
+		}
+
+		// Hand all but the first stage of this step to the other workers, and run the first one ourselves.
+		std::vector<std::future<bool>> results;
+		{
+			std::unique_lock<std::mutex> l(mutex_);
+			for (unsigned int i = 1; i < step.size(); i++)
+			{
+				std::packaged_task<bool()> task([this, index = step[i], &request] { return runStage(index, request); });
+				results.push_back(task.get_future());
+				tasks_.push(std::move(task));
+			}
+		}
+		worker_cv_.notify_all();
+
+		bool drop_request = runStage(step[0], request);
+		for (auto &result : results)
+		{
+			// If nobody else is free, run what's left ourselves, or else we could all end up waiting on each other.
+			while (result.wait_for(0s) != std::future_status::ready)
+			{
+				std::unique_lock<std::mutex> l(mutex_);
+				if (!runTask(l))
+				{
+					l.unlock();
+					result.wait();
+				}
+			}
+			drop_request |= result.get();
+		}
+		if (drop_request)
+			return true;
+	}
+	return false;
+}
+
+bool PostProcessor::runStage(unsigned int index, CompletedRequestPtr &request)
+{
+	TRACE_SCOPE(stages_[index]->Name(), { "sequence", request->sequence });
+	auto start = std::chrono::steady_clock::now();
+	bool drop_request = stages_[index]->Process(request);
+	if (stats_enabled_)
+	{
+		auto elapsed = std::chrono::steady_clock::now() - start;
+		stage_stats_[index]->latency.Add(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+		if (drop_request)
+			stage_stats_[index]->drops++;
+	}
+	return drop_request;
+}
+
+bool PostProcessor::runTask(std::unique_lock<std::mutex> &lock)
+{
+	// Called with the lock held, which is dropped while the task runs.
+	if (tasks_.empty())
+		return false;
+	std::packaged_task<bool()> task = std::move(tasks_.front());
+	tasks_.pop();
+	lock.unlock();
+	task();
+	return true;
 }
 
 void PostProcessor::outputThread()
@@ -245,13 +527,94 @@ void PostProcessor::outputThread()
 
 			drop_request = futures_.front().get();
 			futures_.pop();
+			if (drop_request)
+				app_->GetTelemetry().Add(Telemetry::STAGE_DROPS);
 			request = std::move(requests_.front()); // reuse as it's being dropped from the queue
 			requests_.pop();
 		}
 
+		if (stats_enabled_)
+		{
+			auto ts = request->metadata.get(libcamera::controls::SensorTimestamp);
+			if (!drop_request && ts)
+			{
+				int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+								  std::chrono::steady_clock::now().time_since_epoch())
+								  .count();
+				end_to_end_.Add(std::max<int64_t>(now - *ts, 0) / 1000);
+			}
+			if (std::chrono::steady_clock::now() - last_report_ >=
+				std::chrono::seconds(app_->GetOptions()->Get().post_process_stats))
+				reportStats();
+		}
+
 		if (!drop_request)
+		{
+			TRACE_SCOPE("post_process_output", { "sequence", request->sequence });
 			callback_(request); // callback can take over ownership from us
+		}
+	}
+}
+
+void PostProcessor::reportStats()
+{
+	auto now = std::chrono::steady_clock::now();
+	double interval = std::chrono::duration<double>(now - last_report_).count();
+	last_report_ = now;
+
+	unsigned int max_depth, dropped;
+	double mean_depth;
+	{
+		std::unique_lock<std::mutex> l(mutex_);
+		max_depth = max_queue_depth_;
+		mean_depth = queue_depth_samples_ ? (double)queue_depth_sum_ / queue_depth_samples_ : 0;
+		dropped = stats_dropped_;
+		max_queue_depth_ = 0;
+		queue_depth_sum_ = queue_depth_samples_ = 0;
+		stats_dropped_ = 0;
+	}
+
+	std::stringstream log, json;
+	log << "PostProcessor: " << end_to_end_.Count() << " frames in " << interval << "s, end-to-end p50 "
+		<< end_to_end_.Percentile(0.5) << "us p99 " << end_to_end_.Percentile(0.99) << "us, queue depth max "
+		<< max_depth << " mean " << mean_depth << ", " << dropped << " dropped on overflow";
+	json << "{\"interval_s\": " << interval << ", \"frames\": " << end_to_end_.Count()
+		 << ", \"end_to_end_us\": {\"p50\": " << end_to_end_.Percentile(0.5)
+		 << ", \"p99\": " << end_to_end_.Percentile(0.99) << "}, \"queue_depth\": {\"max\": " << max_depth
+		 << ", \"mean\": " << mean_depth << "}, \"overflow_drops\": " << dropped << ", \"stages\": [";
+	for (unsigned int i = 0; i < stages_.size(); i++)
+	{
+		StageStats &stats = *stage_stats_[i];
+		uint64_t drops = stats.drops.exchange(0);
+		log << "\n    " << stages_[i]->Name() << ": " << stats.latency.Count() << " frames, p50 "
+			<< stats.latency.Percentile(0.5) << "us p99 " << stats.latency.Percentile(0.99) << "us, " << drops
+			<< " dropped";
+		json << (i ? ", " : "") << "{\"name\": \"" << stages_[i]->Name() << "\", \"frames\": "
+			 << stats.latency.Count() << ", \"p50_us\": " << stats.latency.Percentile(0.5)
+			 << ", \"p99_us\": " << stats.latency.Percentile(0.99) << ", \"drops\": " << drops << "}";
+		stats.latency.Reset();
+	}
+	json << "]}\n";
+	end_to_end_.Reset();
+
+	LOG(1, log.str());
+
+	std::string const &filename = app_->GetOptions()->Get().post_process_stats_file;
+	if (filename.empty())
+		return;
+	// Replace the file whole, so that anything polling it never reads half a report.
+	std::string tmp = filename + ".tmp";
+	{
+		std::ofstream file(tmp, std::ios::trunc);
+		file << json.str();
+		if (!file)
+		{
+			LOG_ERROR("WARNING: PostProcessor: failed to write " << tmp);
+			return;
+		}
 	}
+	if (std::rename(tmp.c_str(), filename.c_str()))
+		LOG_ERROR("WARNING: PostProcessor: failed to replace " << filename);
 }
 
 void PostProcessor::Stop()
@@ -265,9 +628,23 @@ void PostProcessor::Stop()
 		std::unique_lock<std::mutex> l(mutex_);
 		quit_ = true;
 		cv_.notify_one();
+		worker_cv_.notify_all();
+		space_cv_.notify_all();
 	}
 
+	// Workers drain any outstanding jobs before exiting, and the output thread then drains the futures.
+	for (auto &t : worker_threads_)
+		t.join();
+	worker_threads_.clear();
+
 	output_thread_.join();
+
+	if (stats_enabled_)
+		reportStats();
+	stats_enabled_ = false;
+
+	if (dropped_)
+		LOG(1, "PostProcessor: dropped " << dropped_ << " frames with all workers busy");
 }
 
 void PostProcessor::Teardown()
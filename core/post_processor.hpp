@@ -10,10 +10,16 @@
 #include <chrono>
 #include <condition_variable>
 #include <future>
+#include <map>
 #include <mutex>
 #include <queue>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include "core/completed_request.hpp"
+#include "core/latency_histogram.hpp"
 #include "core/logging.hpp"
 
 namespace libcamera
@@ -74,17 +80,72 @@ public:
 
 private:
 	PostProcessingStage *createPostProcessingStage(char const *name);
+	void loadModule(std::string const &path);
+	void scheduleStages();
+	bool runStages(CompletedRequestPtr &request);
+	bool runStage(unsigned int index, CompletedRequestPtr &request);
+	bool runTask(std::unique_lock<std::mutex> &lock);
+	void reportStats();
 
 	RPiCamApp *app_;
 	std::vector<StagePtr> stages_;
+	// For each stage, what it must wait for: the stages named in its "after" list, and any earlier stage whose
+	// "reads"/"writes" buffers conflict with its own. A stage that declares no buffers uses everything, so waits for
+	// all the stages before it. The stages are run in steps, all the stages in each step at once.
+	struct StageDeps
+	{
+		std::vector<std::string> after;
+		std::vector<std::string> reads;
+		std::vector<std::string> writes;
+	};
+	std::vector<StageDeps> stage_deps_;
+	std::vector<std::vector<unsigned int>> steps_;
 	std::vector<PostProcessingLib> dynamic_stages_;
+	// Modules that came with a manifest of their stages, by stage, waiting to be loaded until one of those stages is
+	// asked for.
+	std::map<std::string, std::string> lazy_modules_;
+	std::set<std::string> loaded_modules_;
 	void outputThread();
+	void workerThread();
+
+	// A request waiting for a worker thread, and the promise through which the worker reports back to the
+	// output thread.
+	struct Job
+	{
+		CompletedRequestPtr *request = nullptr;
+		std::promise<bool> promise;
+	};
 
 	std::queue<CompletedRequestPtr> requests_;
 	std::queue<std::future<bool>> futures_;
+	std::queue<Job> jobs_;
+	// Stages from a frame's current step that its worker has handed out for other workers to run alongside it.
+	std::queue<std::packaged_task<bool()>> tasks_;
 	std::thread output_thread_;
+	std::vector<std::thread> worker_threads_;
 	bool quit_;
+	bool drop_on_overflow_;
+	unsigned int max_queued_;
+	unsigned int dropped_;
 	PostProcessorCallback callback_;
 	std::mutex mutex_;
 	std::condition_variable cv_;
+	std::condition_variable worker_cv_;
+	std::condition_variable space_cv_;
+
+	// Statistics for --post-process-stats, each covering the time since the last report. Stage latencies are
+	// measured on the workers, end-to-end latency (sensor timestamp to the output callback) on the output thread.
+	struct StageStats
+	{
+		LatencyHistogram latency;
+		std::atomic<uint64_t> drops { 0 };
+	};
+	bool stats_enabled_ = false;
+	std::vector<std::unique_ptr<StageStats>> stage_stats_;
+	LatencyHistogram end_to_end_;
+	unsigned int max_queue_depth_ = 0;
+	uint64_t queue_depth_sum_ = 0;
+	uint64_t queue_depth_samples_ = 0;
+	unsigned int stats_dropped_ = 0;
+	std::chrono::steady_clock::time_point last_report_;
 };
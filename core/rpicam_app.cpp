@@ -8,11 +8,17 @@
 #include "preview/preview.hpp"
 
 #include "core/frame_info.hpp"
+#include "core/memory_budget.hpp"
 #include "core/rpicam_app.hpp"
 #include "core/options.hpp"
+#include "core/trace.hpp"
 
+#include <algorithm>
 #include <cmath>
+#include <cstdio>
+#include <cstring>
 #include <fcntl.h>
+#include <fstream>
 #include <stdlib.h>
 
 #include <sys/ioctl.h>
@@ -26,6 +32,19 @@
 
 unsigned int RPiCamApp::verbosity = 1;
 
+// Declared before the camera_stop_mutex_ lock, so that once the lock has gone it wakes the camera thread if that is
+// waiting to re-queue a filtered request (see requeueFiltered).
+struct StopWaitNotifier
+{
+	std::mutex &mutex;
+	std::condition_variable &cond;
+	~StopWaitNotifier()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		cond.notify_all();
+	}
+};
+
 static libcamera::PixelFormat mode_to_pixel_format(Mode const &mode)
 {
 	// The saving grace here is that we can ignore the Bayer order and return anything -
@@ -108,15 +127,47 @@ RPiCamApp::~RPiCamApp()
 	StopCamera();
 	Teardown();
 	CloseCamera();
+
+	if (Trace::Get().Recording() && !options_->Get().trace_file.empty())
+	{
+		try
+		{
+			Trace::Get().Dump(options_->Get().trace_file);
+		}
+		catch (std::exception const &e)
+		{
+			LOG_ERROR(e.what());
+		}
+	}
+}
+
+// libcamera allows only one camera manager in a process, so that any number of RPiCamApps, each with a camera of its
+// own, can run in one process by sharing it. It goes when the last of them lets go.
+static std::shared_ptr<libcamera::CameraManager> shared_camera_manager()
+{
+	static std::mutex mutex;
+	static std::weak_ptr<libcamera::CameraManager> shared;
+	std::lock_guard<std::mutex> lock(mutex);
+	std::shared_ptr<libcamera::CameraManager> camera_manager = shared.lock();
+	if (!camera_manager)
+	{
+		camera_manager = std::make_shared<libcamera::CameraManager>();
+		int ret = camera_manager->start();
+		if (ret)
+			throw std::runtime_error("camera manager failed to start, code " + std::to_string(-ret));
+		shared = camera_manager;
+	}
+	return camera_manager;
 }
 
 void RPiCamApp::initCameraManager()
 {
+	// Letting go first means a fresh camera manager (to see a change to the sensor's HDR mode, say), but only if no
+	// other RPiCamApp in the process holds this one; see ReleaseCameraManager().
 	camera_manager_.reset();
-	camera_manager_ = std::make_unique<CameraManager>();
-	int ret = camera_manager_->start();
-	if (ret)
-		throw std::runtime_error("camera manager failed to start, code " + std::to_string(-ret));
+	camera_manager_ = shared_camera_manager();
+	if (camera_manager_.use_count() > 1)
+		LOG(2, "Sharing the camera manager with another camera");
 }
 
 std::string const &RPiCamApp::CameraId() const
@@ -137,9 +188,11 @@ void RPiCamApp::OpenCamera()
 	preview_->SetDoneCallback(std::bind(&RPiCamApp::previewDoneCallback, this, std::placeholders::_1));
 
 	LOG(2, "Opening camera...");
+	startup_mark_ = std::chrono::steady_clock::now();
 
 	if (!camera_manager_)
 		initCameraManager();
+	startupPhase("camera manager");
 
 	std::vector<std::shared_ptr<libcamera::Camera>> cameras = GetCameras();
 	if (cameras.size() == 0)
@@ -158,6 +211,7 @@ void RPiCamApp::OpenCamera()
 	camera_acquired_ = true;
 
 	LOG(2, "Acquired camera " << cam_id);
+	startupPhase("acquire");
 
 	if (!options_->Get().post_process_file.empty())
 	{
@@ -165,8 +219,19 @@ void RPiCamApp::OpenCamera()
 		post_processor_.Read(options_->Get().post_process_file);
 	}
 	// The queue takes over ownership from the post-processor.
-	post_processor_.SetCallback(
-		[this](CompletedRequestPtr &r) { this->msg_queue_.Post(Msg(MsgType::RequestComplete, std::move(r))); });
+	post_processor_.SetCallback([this](CompletedRequestPtr &r) {
+		if (auto ts = r->metadata.get(controls::SensorTimestamp))
+			telemetry_.Latency(Telemetry::POST_PROCESSED, *ts);
+		this->msg_queue_.Post(Msg(MsgType::RequestComplete, std::move(r)));
+	});
+
+	startupPhase("post-processing");
+
+	if (loadSensorModes())
+	{
+		startupPhase("sensor modes (cached)");
+		return;
+	}
 
 	// We're going to make a list of all the available sensor modes, but we only populate
 	// the framerate field if the user has requested a framerate (as this requires us actually
@@ -210,6 +275,105 @@ void RPiCamApp::OpenCamera()
 		libcamera::logSetLevel("RPI", "INFO");
 		libcamera::logSetLevel("Camera", "INFO");
 	}
+
+	saveSensorModes();
+	startupPhase("sensor modes");
+}
+
+// The cache holds one line per sensor mode: camera id, model, format, width, height and the fastest framerate. A
+// framerate of 0 means it wasn't measured, which is fine unless the user has asked for a framerate.
+bool RPiCamApp::loadSensorModes()
+{
+	std::string const &filename = options_->Get().startup_cache;
+	if (filename.empty())
+		return false;
+
+	std::ifstream file(filename);
+	std::string line;
+	std::vector<SensorMode> modes;
+	while (std::getline(file, line))
+	{
+		std::istringstream fields(line);
+		std::string id, model, format;
+		unsigned int width, height;
+		double fps;
+		if (!std::getline(fields, id, '\t') || !std::getline(fields, model, '\t') ||
+			!std::getline(fields, format, '\t') || !(fields >> width >> height >> fps))
+			continue;
+		if (id != CameraId() || model != CameraModel())
+			continue;
+		if (options_->Get().framerate && fps <= 0)
+			return false;
+		libcamera::PixelFormat pix = libcamera::PixelFormat::fromString(format);
+		if (!pix.isValid())
+			return false;
+		modes.emplace_back(libcamera::Size(width, height), pix, fps);
+	}
+
+	if (modes.empty())
+		return false;
+	sensor_modes_ = std::move(modes);
+	LOG(2, "Loaded " << sensor_modes_.size() << " sensor modes from " << filename);
+	return true;
+}
+
+void RPiCamApp::saveSensorModes() const
+{
+	std::string const &filename = options_->Get().startup_cache;
+	if (filename.empty())
+		return;
+
+	// Keep whatever other cameras have put there.
+	std::vector<std::string> lines;
+	{
+		std::ifstream file(filename);
+		std::string line;
+		std::string prefix = CameraId() + "\t";
+		while (std::getline(file, line))
+			if (line.rfind(prefix, 0) != 0)
+				lines.push_back(line);
+	}
+	for (auto const &mode : sensor_modes_)
+	{
+		std::ostringstream line;
+		line << CameraId() << "\t" << CameraModel() << "\t" << mode.format.toString() << "\t" << mode.size.width
+			 << " " << mode.size.height << " " << mode.fps;
+		lines.push_back(line.str());
+	}
+
+	// Write it all out and rename it into place, so that a concurrent reader never sees half a file.
+	std::string tmp = filename + ".tmp";
+	{
+		std::ofstream file(tmp, std::ios::trunc);
+		for (auto const &line : lines)
+			file << line << "\n";
+		if (!file)
+		{
+			LOG_ERROR("WARNING: failed to write startup cache " << tmp);
+			return;
+		}
+	}
+	if (std::rename(tmp.c_str(), filename.c_str()))
+		LOG_ERROR("WARNING: failed to replace startup cache " << filename);
+}
+
+void RPiCamApp::startupPhase(char const *name)
+{
+	if (!options_->Get().startup_timing || startup_reported_)
+		return;
+
+	auto now = std::chrono::steady_clock::now();
+	auto us = std::chrono::duration_cast<std::chrono::microseconds>(now - startup_mark_).count();
+	std::ostringstream phase;
+	phase << (startup_phases_.empty() ? "" : ", ") << name << " " << us / 1000.0 << "ms";
+	startup_phases_ += phase.str();
+	startup_mark_ = now;
+
+	if (!strcmp(name, "first frame"))
+	{
+		LOG(1, "Startup timing: " << startup_phases_);
+		startup_reported_ = true;
+	}
 }
 
 void RPiCamApp::CloseCamera()
@@ -283,6 +447,8 @@ void RPiCamApp::ConfigureViewfinder()
 
 	int lores_stream_num = 0, raw_stream_num = 0;
 	bool have_lores_stream = options_->Get().lores_width && options_->Get().lores_height;
+	bool preview_lores = options_->Get().preview_lores && !options_->Get().nopreview && !have_lores_stream;
+	have_lores_stream |= preview_lores;
 
 	StreamRoles stream_roles = { StreamRole::Viewfinder };
 	int stream_num = 1;
@@ -330,7 +496,8 @@ void RPiCamApp::ConfigureViewfinder()
 
 	if (have_lores_stream)
 	{
-		Size lores_size(options_->Get().lores_width, options_->Get().lores_height);
+		Size lores_size = preview_lores ? previewLoresSize(size)
+										: Size(options_->Get().lores_width, options_->Get().lores_height);
 		lores_size.alignDownTo(2, 2);
 		if (lores_size.width > size.width || lores_size.height > size.height)
 			throw std::runtime_error("Low res image larger than viewfinder");
@@ -371,7 +538,7 @@ void RPiCamApp::ConfigureViewfinder()
 	LOG(2, "Viewfinder setup complete");
 }
 
-void RPiCamApp::ConfigureZsl(unsigned int still_flags)
+void RPiCamApp::ConfigureZsl(unsigned int still_flags, unsigned int held_buffers)
 {
 	LOG(2, "Configuring ZSL...");
 
@@ -393,8 +560,8 @@ void RPiCamApp::ConfigureZsl(unsigned int still_flags)
 	if (options_->Get().buffer_count > 0)
 		configuration_->at(0).bufferCount = options_->Get().buffer_count;
 	else
-		// Use the viewfinder stream buffer count if none has been provided
-		configuration_->at(0).bufferCount = configuration_->at(1).bufferCount;
+		// Use the viewfinder stream buffer count if none has been provided, plus those the application holds.
+		configuration_->at(0).bufferCount = configuration_->at(1).bufferCount + held_buffers;
 	if (options_->Get().width)
 		configuration_->at(0).size.width = options_->Get().width;
 	if (options_->Get().height)
@@ -536,6 +703,8 @@ void RPiCamApp::ConfigureVideo(unsigned int flags)
 	LOG(2, "Configuring video...");
 
 	bool have_lores_stream = options_->Get().lores_width && options_->Get().lores_height;
+	bool preview_lores = options_->Get().preview_lores && !options_->Get().nopreview && !have_lores_stream;
+	have_lores_stream |= preview_lores;
 	StreamRoles stream_roles = { StreamRole::VideoRecording };
 	int lores_index = 1;
 	if (!options_->Get().no_raw)
@@ -581,7 +750,8 @@ void RPiCamApp::ConfigureVideo(unsigned int flags)
 
 	if (have_lores_stream)
 	{
-		Size lores_size(options_->Get().lores_width, options_->Get().lores_height);
+		Size lores_size = preview_lores ? previewLoresSize(configuration_->at(0).size)
+										: Size(options_->Get().lores_width, options_->Get().lores_height);
 		lores_size.alignDownTo(2, 2);
 		if (lores_size.width > configuration_->at(0).size.width ||
 			lores_size.height > configuration_->at(0).size.height)
@@ -611,7 +781,16 @@ void RPiCamApp::ConfigureRawStream()
 {
 	LOG(2, "Configuring raw stream...");
 
+	// The ISP can give us a YUV viewfinder and/or lores stream alongside the raw one, for stages that want a cheap
+	// processed image (motion detection and the like) rather than having to pick the Bayer data apart themselves.
+	bool have_viewfinder_stream = options_->Get().viewfinder_width && options_->Get().viewfinder_height;
+	bool have_lores_stream = options_->Get().lores_width && options_->Get().lores_height;
 	StreamRoles stream_roles = { StreamRole::Raw };
+	int viewfinder_index = 0, lores_index = 0, stream_num = 1;
+	if (have_viewfinder_stream)
+		stream_roles.push_back(StreamRole::Viewfinder), viewfinder_index = stream_num++;
+	if (have_lores_stream)
+		stream_roles.push_back(StreamRole::Viewfinder), lores_index = stream_num++;
 	configuration_ = camera_->generateConfiguration(stream_roles);
 	if (!configuration_)
 		throw std::runtime_error("failed to generate raw stream configuration");
@@ -622,6 +801,11 @@ void RPiCamApp::ConfigureRawStream()
 	cfg.bufferCount = 6; // 6 buffers is better than 4
 	if (options_->Get().buffer_count > 0)
 		cfg.bufferCount = options_->Get().buffer_count;
+	else if (options_->Get().auto_buffer_count)
+	{
+		cfg.bufferCount = AutoBufferCount();
+		LOG(1, "Raw stream using " << cfg.bufferCount << " buffers");
+	}
 	if (options_->Get().width)
 		cfg.size.width = options_->Get().width;
 	if (options_->Get().height)
@@ -635,7 +819,34 @@ void RPiCamApp::ConfigureRawStream()
 	configuration_->sensorConfig = libcamera::SensorConfiguration();
 	configuration_->sensorConfig->outputSize = options_->Get().mode.Size();
 	configuration_->sensorConfig->bitDepth = options_->Get().mode.bit_depth;
-	configuration_->at(0).bufferCount = configuration_->at(0).bufferCount;
+
+	// The processed streams get as many buffers as the raw one, as every request carries one of each.
+	Size mode_size = options_->Get().mode.Size();
+	if (have_viewfinder_stream)
+	{
+		Size size(options_->Get().viewfinder_width, options_->Get().viewfinder_height);
+		size.alignDownTo(2, 2);
+		if (size.width > mode_size.width || size.height > mode_size.height)
+			throw std::runtime_error("Viewfinder image larger than raw");
+		configuration_->at(viewfinder_index).pixelFormat = libcamera::formats::YUV420;
+		configuration_->at(viewfinder_index).size = size;
+		configuration_->at(viewfinder_index).bufferCount = configuration_->at(0).bufferCount;
+		configuration_->at(viewfinder_index).colorSpace = libcamera::ColorSpace::Sycc;
+	}
+	if (have_lores_stream)
+	{
+		Size size(options_->Get().lores_width, options_->Get().lores_height);
+		size.alignDownTo(2, 2);
+		// The second ISP output can't be bigger than the first.
+		Size max_size = have_viewfinder_stream ? configuration_->at(viewfinder_index).size : mode_size;
+		if (size.width > max_size.width || size.height > max_size.height)
+			throw std::runtime_error(have_viewfinder_stream ? "Low res image larger than viewfinder"
+															: "Low res image larger than raw");
+		configuration_->at(lores_index).pixelFormat = lores_format_;
+		configuration_->at(lores_index).size = size;
+		configuration_->at(lores_index).bufferCount = configuration_->at(0).bufferCount;
+		configuration_->at(lores_index).colorSpace = libcamera::ColorSpace::Sycc;
+	}
 
 	configuration_->orientation = libcamera::Orientation::Rotate0 * options_->Get().transform;
 
@@ -643,6 +854,10 @@ void RPiCamApp::ConfigureRawStream()
 	setupCapture();
 
 	streams_["raw"] = configuration_->at(0).stream();
+	if (have_viewfinder_stream)
+		streams_["viewfinder"] = configuration_->at(viewfinder_index).stream();
+	if (have_lores_stream)
+		streams_["lores"] = configuration_->at(lores_index).stream();
 
 	LOG(2, "Configuring post processor...");
 
@@ -651,6 +866,22 @@ void RPiCamApp::ConfigureRawStream()
 	LOG(2, "Raw stream setup complete");
 }
 
+unsigned int RPiCamApp::AutoBufferCount() const
+{
+	// The pipeline keeps a couple of requests queued in the hardware, and the application is working on one. Beyond
+	// that we need enough to cover every frame that arrives while a buffer is held (e.g. by the encoder).
+	constexpr unsigned int pipeline_buffers = 3;
+	constexpr unsigned int min_buffers = 4, max_buffers = 32, default_buffers = 6;
+
+	std::chrono::microseconds hold = bufferHoldTime();
+	if (hold.count() <= 0)
+		return default_buffers;
+
+	double frame_period_us = 1e6 / options_->Get().framerate.value_or(DEFAULT_FRAMERATE);
+	unsigned int held = std::ceil(hold.count() / frame_period_us);
+	return std::clamp(pipeline_buffers + held, min_buffers, max_buffers);
+}
+
 void RPiCamApp::Teardown()
 {
 	stopPreview();
@@ -680,6 +911,7 @@ void RPiCamApp::StartCamera()
 {
 	// This makes all the Request objects that we shall need.
 	makeRequests();
+	startupPhase("requests");
 
 	// Build a list of initial controls that we must set in the camera before starting it.
 	// We don't overwrite anything the application may have set before calling us.
@@ -837,21 +1069,37 @@ void RPiCamApp::StartCamera()
 		controls_.set(controls::AeFlickerPeriod, options_->Get().flicker_period.get<std::chrono::microseconds>());
 	}
 
+	start_controls_ = controls_;
 	if (camera_->start(&controls_))
 		throw std::runtime_error("failed to start camera");
+	startupPhase("start");
 	controls_.clear();
 	camera_started_ = true;
 	last_timestamp_ = 0;
+	last_frame_sequence_.reset();
+	requests_queued_ = 0;
 
 	post_processor_.Start();
+	MemoryBudget::Get().Configure(MemoryBudget::Parse(options_->Get().memory_budget),
+								  options_->Get().memory_policy == "block");
+	if (!options_->Get().trace_file.empty() && !Trace::Get().Recording())
+		Trace::Get().Start(options_->Get().trace_events);
+	telemetry_.Start(options_->Get().telemetry, options_->Get().telemetry_file, options_->Get().telemetry_format);
 
 	camera_->requestCompleted.connect(this, &RPiCamApp::requestComplete);
 	LOG(1, "Number of requests: " << requests_.size());
 
+	{
+		std::lock_guard<std::mutex> lock(control_mutex_);
+		queued_steps_.clear();
+		control_step_seen_ = false;
+	}
 	for (std::unique_ptr<Request> &request : requests_)
 	{
+		attachControls(request.get(), false);
 		if (camera_->queueRequest(request.get()) < 0)
 			throw std::runtime_error("Failed to queue request");
+		requests_queued_++;
 	}
 
 	LOG(1, "Camera started!");
@@ -861,6 +1109,8 @@ void RPiCamApp::StopCamera()
 {
 	{
 		// We don't want QueueRequest to run asynchronously while we stop the camera.
+		setCameraStopping(true);
+		StopWaitNotifier notifier { stop_wait_mutex_, stop_wait_cond_ };
 		std::lock_guard<std::mutex> lock(camera_stop_mutex_);
 		if (camera_started_)
 		{
@@ -870,7 +1120,21 @@ void RPiCamApp::StopCamera()
 			post_processor_.Stop();
 
 			camera_started_ = false;
+
+			telemetry_.Stop();
+
+			StallStats stall = GetStallStats();
+			if (stall.frames_dropped)
+				LOG(1, "Frames dropped for lack of requests: " << stall.frames_dropped << " ("
+															   << stall.request_underruns << " request underruns)");
+
+			BufferSyncManager::Stats sync = buffer_sync_.GetStats();
+			if (sync.frames)
+				LOG(2, "Buffer syncs: " << sync.ioctls << " (" << (double)sync.ioctls / sync.frames << " per buffer, "
+										<< sync.time_ns / 1000 / sync.frames << "us per buffer), " << sync.skipped
+										<< " skipped");
 		}
+		setCameraStopping(false);
 	}
 
 	if (camera_)
@@ -890,6 +1154,73 @@ void RPiCamApp::StopCamera()
 		LOG(2, "Camera stopped!");
 }
 
+void RPiCamApp::RestartCamera()
+{
+	auto start = std::chrono::steady_clock::now();
+	unsigned int requeued = 0;
+	{
+		setCameraStopping(true);
+		StopWaitNotifier notifier { stop_wait_mutex_, stop_wait_cond_ };
+		std::lock_guard<std::mutex> stop_lock(camera_stop_mutex_);
+		setCameraStopping(false);
+		if (!camera_started_)
+			throw std::runtime_error("camera not running");
+
+		// Clearing camera_started_ first stops the requests cancelled here from reporting yet more timeouts.
+		camera_started_ = false;
+		setCameraStopping(true);
+		int ret = camera_->stop();
+		setCameraStopping(false);
+		if (ret)
+			throw std::runtime_error("failed to stop camera");
+
+		// Anything the application made since the last start goes on top of what we started with before.
+		ControlList controls;
+		{
+			std::lock_guard<std::mutex> lock(control_mutex_);
+			controls = std::move(controls_);
+			controls_.clear();
+		}
+		controls.merge(start_controls_);
+		if (camera_->start(&controls))
+			throw std::runtime_error("failed to restart camera");
+		camera_started_ = true;
+		last_timestamp_ = 0;
+		last_frame_sequence_.reset();
+
+		std::set<Request *> held;
+		{
+			std::lock_guard<std::mutex> lock(completed_requests_mutex_);
+			for (CompletedRequest *completed_request : completed_requests_)
+				held.insert(completed_request->request);
+		}
+		{
+			std::lock_guard<std::mutex> lock(control_mutex_);
+			queued_steps_.clear();
+			control_step_seen_ = false;
+		}
+		for (std::unique_ptr<Request> &request : requests_)
+		{
+			if (held.count(request.get()))
+				continue;
+			request->reuse(Request::ReuseBuffers);
+			attachControls(request.get(), false);
+			if (camera_->queueRequest(request.get()) < 0)
+				throw std::runtime_error("failed to re-queue request");
+			requests_queued_++;
+			requeued++;
+		}
+	}
+
+	// Any other timeouts reported before we stopped are for the same failure.
+	msg_queue_.Remove([](Msg const &msg) { return msg.type == MsgType::Timeout; });
+
+	auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+	camera_restarts_++;
+	LOG(1, "Camera restarted in " << elapsed.count() / 1000.0 << "ms, " << requeued << " requests re-queued ("
+								  << camera_restarts_ << " restarts)");
+}
+
 RPiCamApp::Msg RPiCamApp::Wait()
 {
 	return msg_queue_.Wait();
@@ -901,6 +1232,7 @@ void RPiCamApp::queueRequest(CompletedRequest *completed_request)
 
 	// This function may run asynchronously so needs protection from the
 	// camera stopping at the same time.
+	StopWaitNotifier notifier { stop_wait_mutex_, stop_wait_cond_ };
 	std::lock_guard<std::mutex> stop_lock(camera_stop_mutex_);
 
 	// An application could be holding a CompletedRequest while it stops and re-starts
@@ -927,28 +1259,21 @@ void RPiCamApp::queueRequest(CompletedRequest *completed_request)
 
 	for (auto const &p : buffers)
 	{
-		struct dma_buf_sync dma_sync {};
-		dma_sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
-
 		auto it = mapped_buffers_.find(p.second);
 		if (it == mapped_buffers_.end())
 			throw std::runtime_error("failed to identify queue request buffer");
 
-		int ret = ::ioctl(p.second->planes()[0].fd.get(), DMA_BUF_IOCTL_SYNC, &dma_sync);
-		if (ret)
-			throw std::runtime_error("failed to sync dma buf on queue request");
+		buffer_sync_.End(p.second);
 
 		if (request->addBuffer(p.first, p.second) < 0)
 			throw std::runtime_error("failed to add buffer to request in QueueRequest");
 	}
 
-	{
-		std::lock_guard<std::mutex> lock(control_mutex_);
-		request->controls() = std::move(controls_);
-	}
+	attachControls(request);
 
 	if (camera_->queueRequest(request) < 0)
 		throw std::runtime_error("failed to queue request");
+	requests_queued_++;
 }
 
 void RPiCamApp::PostMessage(MsgType &t, MsgPayload &p)
@@ -1018,14 +1343,50 @@ const libcamera::CameraManager *RPiCamApp::GetCameraManager()
 
 void RPiCamApp::ShowPreview(CompletedRequestPtr &completed_request, Stream *stream)
 {
+	// With --preview-lores we show the lores stream instead, so long as it's something the preview can show.
+	if (options_->Get().preview_lores)
+	{
+		Stream *lores = LoresStream();
+		if (lores && lores->configuration().pixelFormat == libcamera::formats::YUV420)
+			stream = lores;
+	}
+
 	std::lock_guard<std::mutex> lock(preview_item_mutex_);
+	auto now = std::chrono::steady_clock::now();
+	std::chrono::steady_clock::duration interval {};
+	if (options_->Get().preview_fps)
+	{
+		// Frames skipped to keep to the rate aren't drops. Allow a little early, or camera jitter would have us
+		// skip a frame too many each time.
+		interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+			std::chrono::duration<double>(1.0 / options_->Get().preview_fps));
+		if (now < preview_last_shown_ + interval - interval / 4)
+			return;
+	}
+
 	if (!preview_item_.stream)
+	{
 		preview_item_ = PreviewItem(completed_request, stream); // copy the shared_ptr here
+		// Keep to the rate's own schedule, unless we've fallen more than a frame behind it.
+		preview_last_shown_ = now - preview_last_shown_ > 2 * interval ? now : preview_last_shown_ + interval;
+	}
 	else
 		preview_frames_dropped_++;
 	preview_cond_var_.notify_one();
 }
 
+void RPiCamApp::SetControlRing(std::vector<ControlList> const &ring)
+{
+	std::lock_guard<std::mutex> lock(control_mutex_);
+	control_ring_ = ring;
+	control_ring_next_ = 0;
+	if (ring.empty())
+	{
+		queued_steps_.clear();
+		control_step_seen_ = false;
+	}
+}
+
 void RPiCamApp::SetControls(const ControlList &controls)
 {
 	std::lock_guard<std::mutex> lock(control_mutex_);
@@ -1037,6 +1398,14 @@ void RPiCamApp::SetControls(const ControlList &controls)
 		controls_.set(c.first, c.second);
 }
 
+std::pair<int64_t, int64_t> RPiCamApp::FrameDurationRange() const
+{
+	auto it = camera_->controls().find(&controls::FrameDurationLimits);
+	if (it == camera_->controls().end())
+		throw std::runtime_error("camera has no frame duration limits");
+	return { it->second.min().get<int64_t>(), it->second.max().get<int64_t>() };
+}
+
 StreamInfo RPiCamApp::GetStreamInfo(Stream const *stream) const
 {
 	StreamConfiguration const &cfg = stream->configuration();
@@ -1049,6 +1418,36 @@ StreamInfo RPiCamApp::GetStreamInfo(Stream const *stream) const
 	return info;
 }
 
+void RPiCamApp::measureBufferReadRate()
+{
+	// Read through the largest buffer a few times, the way a software consumer would, so that the heap choices can
+	// be compared. The buffer isn't being used yet, so this has no effect on the frames.
+	libcamera::Span<uint8_t> const *largest = nullptr;
+	for (auto const &[fb, planes] : mapped_buffers_)
+	{
+		for (auto const &plane : planes)
+			if (!largest || plane.size() > largest->size())
+				largest = &plane;
+	}
+	if (!largest || largest->size() < sizeof(uint64_t))
+		return;
+
+	constexpr unsigned int passes = 4;
+	uint64_t const *words = reinterpret_cast<uint64_t const *>(largest->data());
+	size_t count = largest->size() / sizeof(uint64_t);
+	volatile uint64_t sum = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned int pass = 0; pass < passes; pass++)
+	{
+		uint64_t s = 0;
+		for (size_t i = 0; i < count; i++)
+			s += words[i];
+		sum = sum + s;
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	LOG(2, "Camera buffer CPU read rate: " << (passes * largest->size() / elapsed.count() / 1e6) << " MB/s");
+}
+
 void RPiCamApp::setupCapture()
 {
 	// First finish setting up the configuration.
@@ -1064,12 +1463,18 @@ void RPiCamApp::setupCapture()
 	if (camera_->configure(configuration_.get()) < 0)
 		throw std::runtime_error("failed to configure streams");
 	LOG(2, "Camera streams configured");
+	startupPhase("configure");
 
-	LOG(2, "Available controls:");
-	for (auto const &[id, info] : camera_->controls())
-		LOG(2, "    " << id->name() << " : " << info.toString());
+	if (GetVerbosity() >= 2)
+	{
+		LOG(2, "Available controls:");
+		for (auto const &[id, info] : camera_->controls())
+			LOG(2, "    " << id->name() << " : " << info.toString());
+	}
 
 	// Next allocate all the buffers we need, mmap them and store them on a free list.
+	if (!dma_heap_.select(options_->Get().dma_heap))
+		throw std::runtime_error("failed to open dma heap " + options_->Get().dma_heap);
 
 	for (StreamConfiguration &config : *configuration_)
 	{
@@ -1090,14 +1495,27 @@ void RPiCamApp::setupCapture()
 			plane[0].length = config.frameSize;
 
 			fb.push_back(std::make_unique<FrameBuffer>(plane));
-			void *memory = mmap(NULL, config.frameSize, PROT_READ | PROT_WRITE, MAP_SHARED, plane[0].fd.get(), 0);
+			// Fault the whole buffer in now, rather than on the first frames.
+			void *memory = mmap(NULL, config.frameSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+								plane[0].fd.get(), 0);
+			if (memory == MAP_FAILED)
+				throw std::runtime_error("failed to mmap capture buffer");
 			mapped_buffers_[fb.back().get()].push_back(
 						libcamera::Span<uint8_t>(static_cast<uint8_t *>(memory), config.frameSize));
 		}
 
 		frame_buffers_[stream] = std::move(fb);
 	}
-	LOG(2, "Buffers allocated and mapped");
+	LOG(2, "Buffers allocated and mapped from " << dma_heap_.name() << (dma_heap_.cached() ? "" : " (uncached)"));
+	if (GetVerbosity() >= 2)
+		measureBufferReadRate();
+	startupPhase("buffers");
+
+	std::string const &sync_policy = options_->Get().buffer_sync;
+	buffer_sync_.Configure(sync_policy == "always" ? BufferSyncManager::Policy::Always
+						   : sync_policy == "none" ? BufferSyncManager::Policy::Never
+												   : BufferSyncManager::Policy::Auto,
+						   dma_heap_.cached());
 
 	startPreview();
 
@@ -1148,30 +1566,63 @@ void RPiCamApp::makeRequests()
 
 void RPiCamApp::requestComplete(Request *request)
 {
+	// Once the camera has nothing left queued, the sensor's frames are being thrown away. Cancelled requests aren't
+	// underruns though, as they all come back together when the camera stops or times out.
+	bool underrun = --requests_queued_ == 0;
+
 	if (request->status() == Request::RequestCancelled)
 	{
 		// If the request is cancelled while the camera is still running, it indicates
 		// a hardware timeout. Let the application handle this error.
 		if (camera_started_)
+		{
+			telemetry_.Add(Telemetry::TIMEOUTS);
 			msg_queue_.Post(Msg(MsgType::Timeout));
+		}
 
 		return;
 	}
+	if (underrun && camera_started_)
+		telemetry_.Add(Telemetry::REQUEST_UNDERRUNS);
+	telemetry_.Add(Telemetry::FRAMES);
+
+	// Gaps in the frame sequence numbers count the frames that were dropped.
+	uint32_t frame_sequence = request->buffers().begin()->second->metadata().sequence;
+	if (last_frame_sequence_ && frame_sequence > *last_frame_sequence_ + 1)
+		telemetry_.Add(Telemetry::SENSOR_DROPS, frame_sequence - *last_frame_sequence_ - 1);
+	last_frame_sequence_ = frame_sequence;
+
+	bool wanted = true;
+	{
+		std::lock_guard<std::mutex> lock(frame_filter_mutex_);
+		if (frame_filter_)
+		{
+			auto ts = request->metadata().get(controls::SensorTimestamp);
+			int64_t timestamp = ts ? *ts : request->buffers().begin()->second->metadata().timestamp;
+			wanted = frame_filter_(sequence_, timestamp);
+		}
+	}
+	if (!wanted)
+	{
+		TRACE_EVENT("frame_filtered", { "sensor_sequence", frame_sequence });
+		telemetry_.Add(Telemetry::FILTERED);
+		sequence_++;
+		requeueFiltered(request);
+		return;
+	}
 
-	struct dma_buf_sync dma_sync {};
-	dma_sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ;
 	for (auto const &buffer_map : request->buffers())
 	{
 		auto it = mapped_buffers_.find(buffer_map.second);
 		if (it == mapped_buffers_.end())
 			throw std::runtime_error("failed to identify request complete buffer");
 
-		int ret = ::ioctl(buffer_map.second->planes()[0].fd.get(), DMA_BUF_IOCTL_SYNC, &dma_sync);
-		if (ret)
-			throw std::runtime_error("failed to sync dma buf on request complete");
+		buffer_sync_.Begin(buffer_map.second);
 	}
 
+	TRACE_EVENT("request_complete", { "sequence", sequence_ }, { "sensor_sequence", frame_sequence });
 	CompletedRequest *r = new CompletedRequest(sequence_++, request);
+	r->control_step = controlStepTaken(r->metadata);
 	CompletedRequestPtr payload(r, 
 		[this](CompletedRequest *cr) {
 			this->queueRequest(cr);
@@ -1183,13 +1634,19 @@ void RPiCamApp::requestComplete(Request *request)
 
 	// Framebuffer reports possibly being in a startup or error state, ignore these.
 	if (r->buffers.begin()->second->metadata().status != libcamera::FrameMetadata::FrameSuccess)
+	{
+		telemetry_.Add(Telemetry::FRAME_ERRORS);
 		return;
+	}
+	startupPhase("first frame");
 
 	// We calculate the instantaneous framerate in case anyone wants it.
 	// Use the sensor timestamp if possible as it ought to be less glitchy than
 	// the buffer timestamps.
 	auto ts = payload->metadata.get(controls::SensorTimestamp);
 	uint64_t timestamp = ts ? *ts : payload->buffers.begin()->second->metadata().timestamp;
+	if (ts)
+		telemetry_.Latency(Telemetry::COMPLETED, *ts);
 	if (last_timestamp_ == 0 || last_timestamp_ == timestamp)
 		payload->framerate = 0;
 	else
@@ -1199,6 +1656,102 @@ void RPiCamApp::requestComplete(Request *request)
 	post_processor_.Process(payload); // post-processor can re-use our shared_ptr
 }
 
+void RPiCamApp::requeueFiltered(Request *request)
+{
+	// We're on the camera thread, which has to keep going while the camera stops, so never wait for the stop lock
+	// then. Whoever is stopping the camera deals with requests that weren't re-queued. Otherwise sleep until whoever
+	// has the lock lets go of it; holding stop_wait_mutex_ between trying and waiting means we can't miss that.
+	std::unique_lock<std::mutex> stop_lock(camera_stop_mutex_, std::defer_lock);
+	{
+		std::unique_lock<std::mutex> wait_lock(stop_wait_mutex_);
+		while (!stop_lock.try_lock())
+		{
+			if (camera_stopping_)
+				return;
+			stop_wait_cond_.wait(wait_lock);
+		}
+	}
+	if (!camera_started_)
+		return;
+
+	request->reuse(Request::ReuseBuffers);
+	attachControls(request);
+	if (camera_->queueRequest(request) < 0)
+		throw std::runtime_error("failed to re-queue filtered request");
+	requests_queued_++;
+}
+
+void RPiCamApp::setCameraStopping(bool stopping)
+{
+	std::lock_guard<std::mutex> lock(stop_wait_mutex_);
+	camera_stopping_ = stopping;
+	if (stopping)
+		stop_wait_cond_.notify_all();
+}
+
+// Give a request the controls from SetControls, if "pending", and the next step of the control ring.
+void RPiCamApp::attachControls(Request *request, bool pending)
+{
+	std::lock_guard<std::mutex> lock(control_mutex_);
+	if (pending)
+		request->controls() = std::move(controls_);
+	if (control_ring_.empty())
+		return;
+
+	unsigned int step = control_ring_next_;
+	control_ring_next_ = (step + 1) % control_ring_.size();
+	for (auto const &c : control_ring_[step])
+		request->controls().set(c.first, c.second);
+	queued_steps_.push_back({ step, control_ring_[step] });
+	// Steps that never seem to take (an exposure longer than the frame allows, say) mustn't pile up.
+	if (queued_steps_.size() > 64)
+	{
+		queued_steps_.pop_front();
+		control_step_seen_ = false;
+	}
+}
+
+// Whether a frame's metadata shows a step's controls, as far as it reports them. Exposure times come back rounded to
+// whole sensor lines, and gains to what the sensor can do.
+static bool step_taken(ControlList const &step, ControlList const &metadata)
+{
+	auto exposure = step.get(controls::ExposureTime);
+	auto actual_exposure = metadata.get(controls::ExposureTime);
+	if (exposure && actual_exposure && std::abs(*actual_exposure - *exposure) > std::max(*exposure / 50, 50))
+		return false;
+	auto gain = step.get(controls::AnalogueGain);
+	auto actual_gain = metadata.get(controls::AnalogueGain);
+	if (gain && actual_gain && std::abs(*actual_gain - *gain) > *gain * 0.02f)
+		return false;
+	return true;
+}
+
+// Steps take effect in the order they were queued, and once things are going, one a frame. So the step after the one
+// the last frame was taken with is tried first, then that one again (in case two steps in a row are alike, or a frame
+// was held back), and only then the ones after, as happens after dropped frames.
+std::optional<unsigned int> RPiCamApp::controlStepTaken(ControlList const &metadata)
+{
+	std::lock_guard<std::mutex> lock(control_mutex_);
+	size_t next = control_step_seen_ ? 1 : 0;
+	std::vector<size_t> order;
+	if (next < queued_steps_.size())
+		order.push_back(next);
+	if (control_step_seen_)
+		order.push_back(0);
+	for (size_t i = next + 1; i < queued_steps_.size(); i++)
+		order.push_back(i);
+
+	for (size_t i : order)
+	{
+		if (!step_taken(queued_steps_[i].controls, metadata))
+			continue;
+		queued_steps_.erase(queued_steps_.begin(), queued_steps_.begin() + i);
+		control_step_seen_ = true;
+		return queued_steps_.front().step;
+	}
+	return std::nullopt;
+}
+
 void RPiCamApp::previewDoneCallback(int fd)
 {
 	std::lock_guard<std::mutex> lock(preview_mutex_);
@@ -1229,8 +1782,78 @@ void RPiCamApp::stopPreview()
 	preview_completed_requests_.clear();
 }
 
+libcamera::Size RPiCamApp::previewLoresSize(Size const &main_size) const
+{
+	// Just big enough for the preview window, in the main stream's aspect ratio.
+	Size window(1920, 1080);
+	if (!options_->Get().fullscreen)
+		window = Size(options_->Get().preview_width ? options_->Get().preview_width : 640,
+					  options_->Get().preview_height ? options_->Get().preview_height : 480);
+
+	Size size = window.boundedToAspectRatio(main_size);
+	size.boundTo(main_size);
+	Size max_size;
+	preview_->MaxImageSize(max_size.width, max_size.height);
+	if (max_size.width && max_size.height)
+		size.boundTo(max_size.boundedToAspectRatio(size));
+	size.alignDownTo(2, 2);
+	LOG(2, "Preview lores size is " << size.toString());
+	return size;
+}
+
 void RPiCamApp::previewThread()
 {
+	// With --preview-lores, frames are copied into buffers of our own, so the request can go straight back to the
+	// camera. Enough that there's always one the preview isn't using.
+	static constexpr unsigned int NUM_PREVIEW_COPIES = 3;
+	struct PreviewCopy
+	{
+		libcamera::UniqueFD fd;
+		libcamera::Span<uint8_t> span;
+	};
+	std::vector<PreviewCopy> copies;
+	auto free_copies = [&copies]() {
+		for (PreviewCopy &copy : copies)
+			munmap(copy.span.data(), copy.span.size());
+		copies.clear();
+	};
+	auto alloc_copy = [this, &copies](size_t size) -> PreviewCopy * {
+		libcamera::UniqueFD fd = dma_heap_.alloc("rpicam-apps-preview", size);
+		void *mem = fd.isValid() ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd.get(), 0) : MAP_FAILED;
+		if (mem == MAP_FAILED)
+		{
+			LOG(1, "Failed to allocate preview buffer, previewing the camera buffer");
+			return nullptr;
+		}
+		copies.push_back({ std::move(fd), libcamera::Span<uint8_t>((uint8_t *)mem, size) });
+		return &copies.back();
+	};
+
+	// Import everything the preview is going to show now, so that there are no imports on the first frames.
+	// Normally that's the main stream's buffers, but with --preview-lores it's our copies of the lores stream.
+	for (unsigned int i = 0; i < configuration_->size(); i++)
+	{
+		StreamConfiguration const &config = configuration_->at(i);
+		if (config.pixelFormat != libcamera::formats::YUV420 || (i != 0) != options_->Get().preview_lores)
+			continue;
+		StreamInfo info = GetStreamInfo(config.stream());
+		if (options_->Get().preview_lores)
+		{
+			while (copies.size() < NUM_PREVIEW_COPIES && alloc_copy(config.frameSize))
+				preview_->Import(copies.back().fd.get(), copies.back().span.size(), info);
+		}
+		else
+		{
+			auto it = frame_buffers_.find(config.stream());
+			if (it != frame_buffers_.end())
+			{
+				for (auto const &fb : it->second)
+					preview_->Import(fb->planes()[0].fd.get(), fb->planes()[0].length, info);
+			}
+		}
+		break;
+	}
+
 	while (true)
 	{
 		PreviewItem item;
@@ -1240,6 +1863,7 @@ void RPiCamApp::previewThread()
 			if (preview_abort_)
 			{
 				preview_->Reset();
+				free_copies();
 				return;
 			}
 			else if (preview_item_.stream)
@@ -1253,24 +1877,73 @@ void RPiCamApp::previewThread()
 
 		StreamInfo info = GetStreamInfo(item.stream);
 		FrameBuffer *buffer = item.completed_request->buffers[item.stream];
-		BufferReadSync r(this, buffer);
-		libcamera::Span span = r.Get()[0];
 
 		// Fill the frame info with the ControlList items and ancillary bits.
 		FrameInfo frame_info(item.completed_request);
+		OverlayLayer overlay = item.completed_request->overlay.Get();
+
+		PreviewCopy *copy = nullptr;
+		if (options_->Get().preview_lores)
+		{
+			std::lock_guard<std::mutex> lock(preview_mutex_);
+			for (PreviewCopy &c : copies)
+			{
+				if (!preview_completed_requests_.count(c.fd.get()))
+				{
+					copy = &c;
+					break;
+				}
+			}
+			if (copy && copy->span.size() < buffer->planes()[0].length)
+			{
+				// The stream has changed size, so start again. None of these can still be on display.
+				free_copies();
+				copy = nullptr;
+			}
+			if (!copy && copies.size() < NUM_PREVIEW_COPIES)
+				copy = alloc_copy(buffer->planes()[0].length);
+		}
 
-		int fd = buffer->planes()[0].fd.get();
+		int fd;
+		libcamera::Span<uint8_t> span;
+		if (copy)
 		{
+			{
+				BufferReadSync r(this, buffer);
+				span = r.Get()[0];
+				dma_buf_sync sync = { DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE };
+				if (dma_heap_.cached())
+					ioctl(copy->fd.get(), DMA_BUF_IOCTL_SYNC, &sync);
+				memcpy(copy->span.data(), span.data(), span.size());
+				sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE;
+				if (dma_heap_.cached())
+					ioctl(copy->fd.get(), DMA_BUF_IOCTL_SYNC, &sync);
+			}
+			fd = copy->fd.get();
+			span = libcamera::Span<uint8_t>(copy->span.data(), span.size());
+			// This is the preview done with the camera's buffer.
+			item.completed_request.reset();
+			std::lock_guard<std::mutex> lock(preview_mutex_);
+			preview_completed_requests_[fd] = nullptr;
+		}
+		else
+		{
+			BufferReadSync r(this, buffer);
+			span = r.Get()[0];
+			fd = buffer->planes()[0].fd.get();
 			std::lock_guard<std::mutex> lock(preview_mutex_);
 			// the reference to the shared_ptr moves to the map here
 			preview_completed_requests_[fd] = std::move(item.completed_request);
+			buffer_sync_.Flush(buffer);
 		}
+
 		if (preview_->Quit())
 		{
 			LOG(2, "Preview window has quit");
 			msg_queue_.Post(Msg(MsgType::Quit));
 		}
 		preview_frames_displayed_++;
+		preview_->SetOverlay(overlay);
 		preview_->Show(fd, span, info);
 		if (!options_->Get().info_text.empty())
 		{
@@ -9,15 +9,20 @@
 
 #include <sys/mman.h>
 
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <deque>
 #include <iostream>
 #include <memory>
 #include <mutex>
+#include <optional>
 #include <queue>
 #include <set>
 #include <sstream>
 #include <string>
 #include <thread>
+#include <utility>
 #include <variant>
 #include <vector>
 
@@ -35,6 +40,7 @@
 #include "core/dma_heaps.hpp"
 #include "core/post_processor.hpp"
 #include "core/stream_info.hpp"
+#include "core/telemetry.hpp"
 
 struct Options;
 class Preview;
@@ -134,16 +140,26 @@ public:
 	std::string CameraModel() const;
 	void OpenCamera();
 	void CloseCamera();
+	// Let go of the camera manager that parsing the options made, so that OpenCamera starts a fresh one. A program
+	// with several RPiCamApps calls this on all of them once they have all parsed their options: only when none of
+	// them holds the old one can the fresh one see changes made while parsing, such as the imx708's HDR mode.
+	void ReleaseCameraManager() { camera_manager_.reset(); }
 
 	void ConfigureViewfinder();
 	void ConfigureStill(unsigned int flags = FLAG_STILL_NONE);
 	void ConfigureVideo(unsigned int flags = FLAG_VIDEO_NONE);
-	void ConfigureZsl(unsigned int still_flags = FLAG_STILL_NONE);
+	// held_buffers is how many frames the application may hold on to at once (in a ZSL ring, or waiting to be saved)
+	// while the camera carries on.
+	void ConfigureZsl(unsigned int still_flags = FLAG_STILL_NONE, unsigned int held_buffers = 0);
 	void ConfigureRawStream();
 
 	void Teardown();
 	void StartCamera();
 	void StopCamera();
+	// Recover from a device timeout without tearing anything down. The configuration, buffers and requests are all
+	// kept; the camera is stopped and started again and the requests that aren't held by the application are
+	// re-queued straight away. Completed requests still held are re-queued when they are released, as usual.
+	void RestartCamera();
 
 	Msg Wait();
 	void PostMessage(MsgType &t, MsgPayload &p);
@@ -161,15 +177,52 @@ public:
 	{
 		return GetCameras(camera_manager_.get());
 	}
+	// The sensor modes found when the camera was opened.
+	std::vector<SensorMode> const &GetSensorModes() const { return sensor_modes_; }
 
 	void ShowPreview(CompletedRequestPtr &completed_request, Stream *stream);
 
 	void SetControls(const ControlList &controls);
+	// Bracketing: a ring of control sets that the requests take one each, in turn, as they are queued, on top of
+	// anything from SetControls. The pipeline applies a request's controls a few frames after it was queued, so each
+	// CompletedRequest reports in control_step which step of the ring its frame was actually taken with, found from
+	// the frame's ExposureTime and AnalogueGain. An empty ring stops bracketing.
+	void SetControlRing(std::vector<ControlList> const &ring);
+	// Decides, before a frame is post-processed or even made into a CompletedRequest, whether the application wants
+	// it. Frames it turns down go straight back to the camera. It is given the frame's sequence number and sensor
+	// timestamp (in ns), and runs on the camera thread. Set it before starting the camera. Setting another filter,
+	// or nullptr, waits for any call already in progress, so the old one is never called again once this returns.
+	using FrameFilter = std::function<bool(uint64_t sequence, int64_t timestamp)>;
+	void SetFrameFilter(FrameFilter filter)
+	{
+		std::lock_guard<std::mutex> lock(frame_filter_mutex_);
+		frame_filter_ = std::move(filter);
+	}
 	StreamInfo GetStreamInfo(Stream const *stream) const;
+
+	// Frames the sensor produced that never reached us because no request was queued for them, and the number of
+	// times the camera was left with no requests queued at all.
+	struct StallStats
+	{
+		uint64_t frames_dropped;
+		uint64_t request_underruns;
+	};
+	StallStats GetStallStats() const
+	{
+		return { telemetry_.Get(Telemetry::SENSOR_DROPS), telemetry_.Get(Telemetry::REQUEST_UNDERRUNS) };
+	}
+	// Where every part of the app counts the frames it loses (see --telemetry).
+	Telemetry &GetTelemetry() { return telemetry_; }
+	// What the DMA_BUF_IOCTL_SYNC calls on the camera buffers have cost so far.
+	BufferSyncManager::Stats GetBufferSyncStats() const { return buffer_sync_.GetStats(); }
+	// The raw stream buffer count that --auto-buffer-count picks, given the latest buffer hold time.
+	unsigned int AutoBufferCount() const;
 	const ControlList &GetProperties() const
 	{
 		return camera_->properties();
 	}
+	// The shortest and longest frame durations (in us) that the camera allows in its current configuration.
+	std::pair<int64_t, int64_t> FrameDurationRange() const;
 
 	static unsigned int verbosity;
 	static unsigned int GetVerbosity() { return verbosity; }
@@ -186,11 +239,18 @@ public:
 	}
 
 	friend class BufferWriteSync;
+	friend class BufferDeviceSync;
 	friend class BufferReadSync;
 	friend class PostProcessor;
 	friend struct OptsInternal;
 
 protected:
+	// How long the application typically holds on to a completed request, for sizing the buffer pool. Zero if it
+	// isn't known.
+	virtual std::chrono::microseconds bufferHoldTime() const { return std::chrono::microseconds(0); }
+	// Call before handing a camera buffer to a device that reads it through its DMABUF.
+	void flushBuffer(FrameBuffer *fb) { buffer_sync_.Flush(fb); }
+
 	std::unique_ptr<Options> options_;
 
 private:
@@ -218,6 +278,18 @@ private:
 			std::unique_lock<std::mutex> lock(mutex_);
 			queue_ = {};
 		}
+		template <typename P>
+		void Remove(P pred)
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			std::queue<T> kept;
+			for (; !queue_.empty(); queue_.pop())
+			{
+				if (!pred(queue_.front()))
+					kept.push(std::move(queue_.front()));
+			}
+			queue_ = std::move(kept);
+		}
 
 	private:
 		std::queue<T> queue_;
@@ -240,6 +312,14 @@ private:
 	};
 
 	void initCameraManager();
+	bool loadSensorModes();
+	void saveSensorModes() const;
+	void startupPhase(char const *name);
+	void measureBufferReadRate();
+	void requeueFiltered(Request *request);
+	void setCameraStopping(bool stopping);
+	void attachControls(Request *request, bool pending = true);
+	std::optional<unsigned int> controlStepTaken(ControlList const &metadata);
 	void setupCapture();
 	void makeRequests();
 	void queueRequest(CompletedRequest *completed_request);
@@ -248,22 +328,32 @@ private:
 	void startPreview();
 	void stopPreview();
 	void previewThread();
+	libcamera::Size previewLoresSize(libcamera::Size const &main_size) const;
 	void configureDenoise(const std::string &denoise_mode);
 	Mode selectMode(const Mode &mode) const;
 
-	std::unique_ptr<CameraManager> camera_manager_;
+	std::shared_ptr<CameraManager> camera_manager_;
 	std::shared_ptr<Camera> camera_;
 	bool camera_acquired_ = false;
 	std::unique_ptr<CameraConfiguration> configuration_;
 	std::map<FrameBuffer *, std::vector<libcamera::Span<uint8_t>>> mapped_buffers_;
 	std::map<std::string, Stream *> streams_;
 	DmaHeap dma_heap_;
+	BufferSyncManager buffer_sync_;
 	std::map<Stream *, std::vector<std::unique_ptr<FrameBuffer>>> frame_buffers_;
 	std::vector<std::unique_ptr<Request>> requests_;
 	std::mutex completed_requests_mutex_;
 	std::set<CompletedRequest *> completed_requests_;
 	bool camera_started_ = false;
 	std::mutex camera_stop_mutex_;
+	// Set while the camera is being stopped, so that the camera thread never waits for camera_stop_mutex_ then.
+	std::atomic<bool> camera_stopping_ { false };
+	// The camera thread sleeps on this while someone else has camera_stop_mutex_. It is woken whenever they let go of
+	// it, or the camera starts stopping.
+	std::mutex stop_wait_mutex_;
+	std::condition_variable stop_wait_cond_;
+	std::mutex frame_filter_mutex_;
+	FrameFilter frame_filter_;
 	MessageQueue<Msg> msg_queue_;
 	std::vector<SensorMode> sensor_modes_;
 	// Related to the preview window.
@@ -276,13 +366,38 @@ private:
 	bool preview_abort_ = false;
 	uint32_t preview_frames_displayed_ = 0;
 	uint32_t preview_frames_dropped_ = 0;
+	// With --preview-fps, when we last took a frame for the preview.
+	std::chrono::steady_clock::time_point preview_last_shown_;
 	std::thread preview_thread_;
 	// For setting camera controls.
 	std::mutex control_mutex_;
 	ControlList controls_;
+	// For SetControlRing, also under control_mutex_: the ring, the next step to hand out, and the steps handed out but
+	// not yet superseded, oldest first. While control_step_seen_, the first of those is the step the last frame was
+	// taken with.
+	struct QueuedStep
+	{
+		unsigned int step;
+		ControlList controls;
+	};
+	std::vector<ControlList> control_ring_;
+	unsigned int control_ring_next_ = 0;
+	std::deque<QueuedStep> queued_steps_;
+	bool control_step_seen_ = false;
+	// The controls the camera was last started with, for RestartCamera.
+	ControlList start_controls_;
 	// Other:
 	uint64_t last_timestamp_;
 	uint64_t sequence_ = 0;
+	// Stall accounting.
+	std::atomic<unsigned int> requests_queued_ { 0 };
+	std::optional<uint32_t> last_frame_sequence_;
+	Telemetry telemetry_;
+	// Startup timing (--startup-timing), reported with the first frame.
+	std::chrono::steady_clock::time_point startup_mark_;
+	std::string startup_phases_;
+	bool startup_reported_ = false;
+	unsigned int camera_restarts_ = 0;
 	PostProcessor post_processor_;
 	libcamera::PixelFormat lores_format_ = libcamera::formats::YUV420;
 };
@@ -7,11 +7,17 @@
 
 #pragma once
 
+#include <algorithm>
+#include <cstring>
+#include <deque>
+
 #include "core/rpicam_app.hpp"
 #include "core/stream_info.hpp"
+#include "core/trace.hpp"
 #include "core/video_options.hpp"
 
 #include "encoder/encoder.hpp"
+#include "encoder/staging_pool.hpp"
 
 typedef std::function<void(void *, size_t, int64_t, bool)> EncodeOutputReadyCallback;
 typedef std::function<void(libcamera::ControlList &)> MetadataReadyCallback;
@@ -22,11 +28,26 @@ public:
 	using Stream = libcamera::Stream;
 	using FrameBuffer = libcamera::FrameBuffer;
 
-	RPiCamEncoder() : RPiCamApp(std::make_unique<VideoOptions>()) {}
+	RPiCamEncoder() : RPiCamApp(std::make_unique<VideoOptions>())
+	{
+		GetTelemetry().AddSource("encode_drops", "Frames the encoder dropped with its queue full",
+								 [this]() { return encodeQueueTotals().dropped; });
+		GetTelemetry().AddSource("encode_degraded", "Frames the encoder degraded to keep up",
+								 [this]() { return encodeQueueTotals().degraded; });
+	}
+	// The telemetry reads our encoder's counts, so must stop before we go.
+	~RPiCamEncoder() { GetTelemetry().Stop(); }
 
 	void StartEncoder()
 	{
-		createEncoder();
+		{
+			std::lock_guard<std::mutex> lock(encoder_mutex_);
+			createEncoder();
+		}
+		if (GetOptions()->Get().encode_staging && !encoder_->UsesDmabuf())
+			staging_ = std::make_unique<StagingPool>(GetOptions()->Get().encode_staging);
+		else if (GetOptions()->Get().encode_staging)
+			LOG(1, "WARNING: --encode-staging ignored, the encoder needs the camera buffers themselves");
 		encoder_->SetInputDoneCallback(std::bind(&RPiCamEncoder::encodeBufferDone, this, std::placeholders::_1));
 		encoder_->SetOutputReadyCallback(encode_output_ready_callback_);
 
@@ -47,6 +68,8 @@ public:
 	// This is callback when the encoder gives you the encoded output data.
 	void SetEncodeOutputReadyCallback(EncodeOutputReadyCallback callback) { encode_output_ready_callback_ = callback; }
 	void SetMetadataReadyCallback(MetadataReadyCallback callback) { metadata_ready_callback_ = callback; }
+	// Where copies given to EncodeCopy() are handed back once the encoder has finished with them.
+	void SetCopyDoneCallback(std::function<void(void *)> callback) { copy_done_callback_ = callback; }
 	bool EncodeBuffer(CompletedRequestPtr &completed_request, Stream *stream)
 	{
 		assert(encoder_);
@@ -67,20 +90,83 @@ public:
 			throw std::runtime_error("no buffer to encode");
 		auto ts = completed_request->metadata.get(controls::FrameWallClock);
 		int64_t timestamp_us = ts ? *ts : buffer->metadata().timestamp / 1000;
+		int64_t sensor_ns = completed_request->metadata.get(controls::SensorTimestamp).value_or(0);
+		// From here on frames are known by their timestamp_us.
+		TRACE_SCOPE("encode_buffer", { "sequence", completed_request->sequence }, { "timestamp_us", timestamp_us });
+
+		// With staging, the frame is copied out and the request can go back to the camera as soon as our caller is
+		// done with it. If the staging buffers are all busy, the encoder just has to use the camera buffer.
+		void *staged = staging_ ? staging_->Acquire(span.size()) : nullptr;
+		if (staged)
+		{
+			memcpy(staged, mem, span.size());
+			bool want_metadata = metadata_ready_callback_ && !GetOptions()->Get().metadata.empty();
+			{
+				std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_);
+				encode_buffer_queue_.push_back({ staged, nullptr, std::chrono::steady_clock::now(),
+												 want_metadata ? completed_request->metadata : libcamera::ControlList(),
+												 sensor_ns, true, false, false });
+			}
+			encoder_->EncodeBuffer(-1, span.size(), staged, info, timestamp_us, completed_request->post_process_metadata,
+								   completed_request->metadata);
+			return true;
+		}
+
 		{
 			std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_);
-			encode_buffer_queue_.push(completed_request); // creates a new reference
+			encode_buffer_queue_.push_back({ mem, completed_request, std::chrono::steady_clock::now(), {}, sensor_ns,
+											 false, false, false }); // creates a new reference
 		}
-		// All encoders now accept metadata parameter
-		encoder_->EncodeBuffer(buffer->planes()[0].fd.get(), span.size(), mem, info, timestamp_us, completed_request->post_process_metadata, completed_request->metadata);
+		if (encoder_->UsesDmabuf())
+			flushBuffer(buffer);
+		// Encoders get a reference to the request, so the metadata need not be copied.
+		encoder_->EncodeBuffer(buffer->planes()[0].fd.get(), span.size(), mem, info, timestamp_us, completed_request);
 
 		// Tell our caller that encoding is underway.
 		return true;
 	}
+	// Encode a copy of a frame that we made ourselves and kept after its request went back to the camera (see
+	// --raw-ring). The copy comes back through the SetCopyDoneCallback() callback.
+	void EncodeCopy(void *mem, size_t size, StreamInfo const &info, int64_t timestamp_us,
+					Metadata const &post_process_metadata, libcamera::ControlList const &metadata)
+	{
+		assert(encoder_);
+		int64_t sensor_ns = metadata.get(controls::SensorTimestamp).value_or(0);
+		{
+			std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_);
+			encode_buffer_queue_.push_back({ mem, nullptr, std::chrono::steady_clock::now(), metadata, sensor_ns,
+											 false, true, false });
+		}
+		encoder_->EncodeBuffer(-1, size, mem, info, timestamp_us, post_process_metadata, metadata);
+	}
 	VideoOptions *GetOptions() const { return static_cast<VideoOptions *>(RPiCamApp::GetOptions()); }
-	void StopEncoder() { encoder_.reset(); }
+	// Frames the encoder has dropped or degraded because it couldn't keep up (see --encode-queue).
+	EncodePool::QueueStats GetEncodeQueueStats() const
+	{
+		return encoder_ ? encoder_->GetQueueStats() : EncodePool::QueueStats {};
+	}
+	// Whether the Output will see every frame encoded, so can be given details of each one.
+	bool EncoderOutputsEachFrame() const { return encoder_ && encoder_->OutputsEachFrame(); }
+	void StopEncoder()
+	{
+		EncodePool::QueueStats stats = GetEncodeQueueStats();
+		if (stats.dropped || stats.degraded)
+			LOG(1, "Encoder couldn't keep up: " << stats.dropped << " frames dropped, " << stats.degraded
+												<< " degraded");
+		{
+			std::lock_guard<std::mutex> lock(encoder_mutex_);
+			encode_queue_totals_.dropped += stats.dropped;
+			encode_queue_totals_.degraded += stats.degraded;
+			encoder_.reset();
+		}
+		staging_.reset();
+	}
 
 protected:
+	std::chrono::microseconds bufferHoldTime() const override
+	{
+		return std::chrono::microseconds(buffer_hold_time_us_.load());
+	}
 	virtual void createEncoder()
 	{
 		StreamInfo info;
@@ -89,29 +175,89 @@ protected:
 			throw std::runtime_error("video steam is not configured");
 		encoder_ = std::unique_ptr<Encoder>(Encoder::Create(GetOptions(), info));
 	}
+	// The encoder may be using the staging buffers, so it must go first.
+	std::unique_ptr<StagingPool> staging_;
 	std::unique_ptr<Encoder> encoder_;
 
 private:
 	void encodeBufferDone(void *mem)
 	{
-		// If non-NULL, mem would indicate which buffer has been completed, but
-		// currently we're just assuming everything is done in order. (We could
-		// handle this by replacing the queue with a vector of <mem, completed_request>
-		// pairs.)
-		assert(mem == nullptr);
+		// Buffers may come back in any order, and each request is released as soon as its own buffer does. A null
+		// mem is from an encoder that finishes in order, and means the oldest buffer outstanding. The metadata
+		// must still be reported in order though (the output pairs it up with the encoded frames), so finished
+		// entries wait in the queue until everything in front of them is done.
+		std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_);
+		auto it = std::find_if(encode_buffer_queue_.begin(), encode_buffer_queue_.end(),
+							   [mem](EncodingBuffer const &b) { return !b.done && (!mem || b.mem == mem); });
+		if (it == encode_buffer_queue_.end())
+			throw std::runtime_error("no buffer available to return");
+
+		updateBufferHoldTime(std::chrono::steady_clock::now() - it->queued);
+		if (it->sensor_ns)
+			GetTelemetry().Latency(Telemetry::ENCODED, it->sensor_ns);
+		it->done = true;
+		if (it->staged)
+			staging_->Release(it->mem);
+		else if (it->copy)
+			copy_done_callback_(it->mem);
+		bool want_metadata = metadata_ready_callback_ && !GetOptions()->Get().metadata.empty();
+		if (it != encode_buffer_queue_.begin())
 		{
-			std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_);
-			if (encode_buffer_queue_.empty())
-				throw std::runtime_error("no buffer available to return");
-			CompletedRequestPtr &completed_request = encode_buffer_queue_.front();
-			if (metadata_ready_callback_ && !GetOptions()->Get().metadata.empty())
-				metadata_ready_callback_(completed_request->metadata);
-			encode_buffer_queue_.pop(); // drop shared_ptr reference
+			if (it->request && want_metadata)
+				it->metadata = it->request->metadata;
+			it->request.reset(); // drop shared_ptr reference
+			return;
+		}
+
+		while (!encode_buffer_queue_.empty() && encode_buffer_queue_.front().done)
+		{
+			EncodingBuffer &front = encode_buffer_queue_.front();
+			if (want_metadata)
+				metadata_ready_callback_(front.request ? front.request->metadata : front.metadata);
+			encode_buffer_queue_.pop_front(); // drops any shared_ptr reference
 		}
 	}
 
-	std::queue<CompletedRequestPtr> encode_buffer_queue_;
+	// What all our encoders have dropped and degraded, for the telemetry.
+	EncodePool::QueueStats encodeQueueTotals()
+	{
+		std::lock_guard<std::mutex> lock(encoder_mutex_);
+		EncodePool::QueueStats stats = encode_queue_totals_;
+		if (encoder_)
+		{
+			EncodePool::QueueStats current = encoder_->GetQueueStats();
+			stats.dropped += current.dropped;
+			stats.degraded += current.degraded;
+		}
+		return stats;
+	}
+
+	void updateBufferHoldTime(std::chrono::steady_clock::duration held)
+	{
+		// Follow increases straight away, since it's the bursts that run us out of buffers, but decay slowly.
+		int64_t sample = std::chrono::duration_cast<std::chrono::microseconds>(held).count();
+		int64_t current = buffer_hold_time_us_.load();
+		buffer_hold_time_us_ = sample > current ? sample : current + (sample - current) / 16;
+	}
+
+	struct EncodingBuffer
+	{
+		void *mem;
+		CompletedRequestPtr request; // null once the encoder has finished with it, or if the frame was copied
+		std::chrono::steady_clock::time_point queued;
+		libcamera::ControlList metadata; // kept if the request is released before the metadata can be reported
+		int64_t sensor_ns;
+		bool staged;
+		bool copy; // from EncodeCopy()
+		bool done;
+	};
+	std::deque<EncodingBuffer> encode_buffer_queue_;
+	std::atomic<int64_t> buffer_hold_time_us_ { 0 };
 	std::mutex encode_buffer_queue_mutex_;
+	// Held while the encoder comes and goes, as the telemetry thread may be reading its counts.
+	std::mutex encoder_mutex_;
+	EncodePool::QueueStats encode_queue_totals_ {};
 	EncodeOutputReadyCallback encode_output_ready_callback_;
 	MetadataReadyCallback metadata_ready_callback_;
+	std::function<void(void *)> copy_done_callback_;
 };
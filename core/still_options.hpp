@@ -24,6 +24,12 @@ struct StillOptions : public Options
 			 "Add these extra EXIF tags to the output file")
 			("timelapse", value<std::string>(&v_->timelapse_)->default_value("0ms"),
 			 "Time interval between timelapse captures. If no units are provided default to ms.")
+			("timelapse-pipeline", value<bool>(&v_->timelapse_pipeline)->default_value(false)->implicit_value(true),
+			 "With --timelapse, stay in the still capture mode and let the sensor time the shots, saving them in the "
+			 "background, so that intervals down to the sensor's frame period are possible")
+			("timelapse-lock", value<bool>(&v_->timelapse_lock)->default_value(false)->implicit_value(true),
+			 "With --timelapse-pipeline, fix the exposure and colour gains at those of the first shot, rather than "
+			 "letting AE/AWB follow the light from shot to shot")
 			("framestart", value<uint32_t>(&v_->framestart)->default_value(0),
 			 "Initial frame counter value for timelapse captures")
 			("datetime", value<bool>(&v_->datetime)->default_value(false)->implicit_value(true),
@@ -50,6 +56,25 @@ struct StillOptions : public Options
 			 "Switch to AfModeAuto and trigger a scan just before capturing a still")
 			("zsl", value<bool>(&v_->zsl)->default_value(false)->implicit_value(true),
 			 "Switch to AfModeAuto and trigger a scan just before capturing a still")
+			("zsl-burst", value<unsigned int>(&v_->zsl_burst)->default_value(0),
+			 "With --zsl, save this many consecutive frames for each capture, rather than just one (0 = off)")
+			("zsl-pre", value<unsigned int>(&v_->zsl_pre)->default_value(0),
+			 "With --zsl-burst, how many of the frames in each burst come from before the capture was triggered")
+			("encode-threads", value<unsigned int>(&v_->encode_threads)->default_value(0),
+			 "Number of threads saving the frames of a --zsl-burst (0 = the default of 2)")
+			("encode-affinity", value<std::string>(&v_->encode_affinity),
+			 "Pin the --zsl-burst save threads to these CPUs, e.g. \"2,3\" or \"1-3\"")
+			("encode-priority", value<int>(&v_->encode_priority)->default_value(0),
+			 "Run the --zsl-burst save threads with this SCHED_FIFO priority (0 = normal scheduling)")
+			("encode-output-affinity", value<std::string>(&v_->encode_output_affinity),
+			 "Pin the --zsl-burst output thread, which updates the --latest link, to these CPUs")
+			("encode-output-priority", value<int>(&v_->encode_output_priority)->default_value(0),
+			 "Run the --zsl-burst output thread with this SCHED_FIFO priority (0 = normal scheduling)")
+			("encode-queue", value<unsigned int>(&v_->encode_queue)->default_value(0),
+			 "Most --zsl-burst frames that may wait to be saved, each holding a camera buffer (0 = no limit)")
+			("encode-queue-policy", value<std::string>(&v_->encode_queue_policy)->default_value("block"),
+			 "What to do with a frame when the --encode-queue is full: \"block\" until there's room, or "
+			 "\"drop-oldest\" or \"drop-newest\" frame")
 			;
 		// clang-format on
 	}
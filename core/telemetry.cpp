@@ -0,0 +1,171 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * telemetry.cpp - frame loss and latency accounting for the whole app.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+#include "core/logging.hpp"
+#include "core/memory_budget.hpp"
+#include "core/telemetry.hpp"
+
+struct Description
+{
+	char const *name;
+	char const *help;
+};
+
+static const Description counter_descriptions[Telemetry::NUM_COUNTERS] = {
+	{ "frames", "Frames completed by the camera" },
+	{ "sensor_drops", "Frames the sensor produced that never reached us (sequence number gaps)" },
+	{ "request_underruns", "Times the camera was left with no requests queued" },
+	{ "frame_errors", "Frames completed in an error or startup state" },
+	{ "timeouts", "Requests cancelled while the camera was running" },
+	{ "filtered", "Frames turned down by the application's frame filter" },
+	{ "post_process_drops", "Frames dropped with the post-processing queue full" },
+	{ "stage_drops", "Frames a post-processing stage asked to drop" },
+};
+
+static char const *stage_names[Telemetry::NUM_STAGES] = { "completed", "post_processed", "encoded" };
+
+void Telemetry::Latency(Stage stage, int64_t sensor_ns)
+{
+	int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+					  std::chrono::steady_clock::now().time_since_epoch()).count();
+	latencies_[stage].Add(std::max<int64_t>(now - sensor_ns, 0) / 1000);
+}
+
+void Telemetry::AddSource(std::string const &name, std::string const &help, std::function<uint64_t()> read)
+{
+	std::lock_guard<std::mutex> lock(sources_mutex_);
+	sources_.push_back({ name, help, std::move(read) });
+}
+
+void Telemetry::Start(unsigned int interval, std::string const &filename, std::string const &format)
+{
+	Stop();
+	if (!interval)
+		return;
+
+	interval_ = interval;
+	filename_ = filename;
+	prometheus_ = format == "prometheus";
+	abort_ = false;
+	thread_ = std::thread(&Telemetry::reportThread, this);
+}
+
+void Telemetry::Stop()
+{
+	if (!thread_.joinable())
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+	}
+	cond_.notify_one();
+	thread_.join();
+	report();
+}
+
+void Telemetry::reportThread()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	while (!cond_.wait_for(lock, std::chrono::seconds(interval_), [this] { return abort_; }))
+	{
+		lock.unlock();
+		report();
+		lock.lock();
+	}
+}
+
+void Telemetry::report()
+{
+	std::vector<std::pair<Description, uint64_t>> counts;
+	for (unsigned int i = 0; i < NUM_COUNTERS; i++)
+		counts.emplace_back(counter_descriptions[i], Get((Counter)i));
+	std::vector<Source> sources;
+	{
+		std::lock_guard<std::mutex> lock(sources_mutex_);
+		sources = sources_;
+	}
+	for (Source const &source : sources)
+		counts.emplace_back(Description { source.name.c_str(), source.help.c_str() }, source.read());
+
+	std::stringstream text, prometheus;
+	text << "Telemetry:";
+	for (auto const &[description, count] : counts)
+	{
+		text << " " << description.name << " " << count;
+		prometheus << "# HELP rpicam_" << description.name << "_total " << description.help << "\n"
+				   << "# TYPE rpicam_" << description.name << "_total counter\n"
+				   << "rpicam_" << description.name << "_total " << count << "\n";
+	}
+	text << "\n    latency from sensor timestamp:";
+	prometheus << "# HELP rpicam_latency_us Time from the sensor timestamp to each stage, since the last report\n"
+			   << "# TYPE rpicam_latency_us summary\n";
+	for (unsigned int i = 0; i < NUM_STAGES; i++)
+	{
+		LatencyHistogram &latency = latencies_[i];
+		text << " " << stage_names[i] << " p50 " << latency.Percentile(0.5) << "us p99 " << latency.Percentile(0.99)
+			 << "us";
+		for (double q : { 0.5, 0.9, 0.99 })
+			prometheus << "rpicam_latency_us{stage=\"" << stage_names[i] << "\",quantile=\"" << q << "\"} "
+					   << latency.Percentile(q) << "\n";
+		prometheus << "rpicam_latency_us_count{stage=\"" << stage_names[i] << "\"} " << latency.Count() << "\n";
+		latency.Reset();
+	}
+
+	// Memory is reported in bytes to Prometheus, but in MB to people.
+	text << "\n    memory held:";
+	prometheus << "# HELP rpicam_memory_bytes Memory held in frame buffers, by subsystem\n"
+			   << "# TYPE rpicam_memory_bytes gauge\n";
+	std::stringstream peaks, limits, refused;
+	peaks << "# HELP rpicam_memory_peak_bytes Most memory held in frame buffers at once, by subsystem\n"
+		  << "# TYPE rpicam_memory_peak_bytes gauge\n";
+	limits << "# HELP rpicam_memory_limit_bytes The --memory-budget for each subsystem (0 for none)\n"
+		   << "# TYPE rpicam_memory_limit_bytes gauge\n";
+	refused << "# HELP rpicam_memory_refused_total Frames and buffers turned away over the --memory-budget\n"
+			<< "# TYPE rpicam_memory_refused_total counter\n";
+	MemoryBudget &budget = MemoryBudget::Get();
+	for (unsigned int i = 0; i <= MemoryBudget::NUM_ACCOUNTS; i++)
+	{
+		bool total = i == MemoryBudget::NUM_ACCOUNTS;
+		char const *name = total ? "total" : MemoryBudget::Name((MemoryBudget::Account)i);
+		MemoryBudget::Usage usage = total ? budget.GetTotal() : budget.GetUsage((MemoryBudget::Account)i);
+		text << " " << name << " " << (usage.bytes >> 20) << "MB (peak " << (usage.peak >> 20) << "MB";
+		if (usage.limit)
+			text << " of " << (usage.limit >> 20) << "MB";
+		text << ", " << usage.refused << " refused)";
+		std::string label = "{subsystem=\"" + std::string(name) + "\"} ";
+		prometheus << "rpicam_memory_bytes" << label << usage.bytes << "\n";
+		peaks << "rpicam_memory_peak_bytes" << label << usage.peak << "\n";
+		limits << "rpicam_memory_limit_bytes" << label << usage.limit << "\n";
+		refused << "rpicam_memory_refused_total" << label << usage.refused << "\n";
+	}
+	prometheus << peaks.str() << limits.str() << refused.str();
+
+	LOG(1, text.str());
+
+	if (filename_.empty())
+		return;
+	// Replace the file whole, so that anything polling it never reads half a report.
+	std::string tmp = filename_ + ".tmp";
+	{
+		std::ofstream file(tmp, std::ios::trunc);
+		file << (prometheus_ ? prometheus.str() : text.str() + "\n");
+		if (!file)
+		{
+			LOG_ERROR("WARNING: Telemetry: failed to write " << tmp);
+			return;
+		}
+	}
+	if (std::rename(tmp.c_str(), filename_.c_str()))
+		LOG_ERROR("WARNING: Telemetry: failed to replace " << filename_);
+}
@@ -0,0 +1,89 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * telemetry.hpp - frame loss and latency accounting for the whole app.
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "core/latency_histogram.hpp"
+
+// Counts every frame we lose, wherever we lose it, so that none go missing silently, and how long frames take to get
+// through each stage of the app. With --telemetry, a summary goes to the log every so many seconds and, with
+// --telemetry-file, to a file, either as text or in the Prometheus text exposition format (for node_exporter's
+// textfile collector, say). Counters run for the life of the app; latency percentiles cover the time since the last
+// report. Each report also says how much memory the frame buffers are holding (see MemoryBudget). Any thread may
+// count things at any time.
+class Telemetry
+{
+public:
+	enum Counter
+	{
+		FRAMES, // frames completed by the camera
+		SENSOR_DROPS, // gaps in the sensor's frame sequence numbers
+		REQUEST_UNDERRUNS, // times the camera was left with no requests queued
+		FRAME_ERRORS, // frames completed without FrameSuccess
+		TIMEOUTS, // requests cancelled while the camera was running
+		FILTERED, // frames turned down by the application's frame filter (decimation)
+		POST_PROCESS_DROPS, // frames dropped with the post-processing queue full
+		STAGE_DROPS, // frames a post-processing stage asked to drop
+		NUM_COUNTERS
+	};
+	// Latencies are measured from the frame's sensor timestamp.
+	enum Stage
+	{
+		COMPLETED, // the camera completed the request
+		POST_PROCESSED, // the post-processing stages finished with it
+		ENCODED, // the encoder finished with the buffer
+		NUM_STAGES
+	};
+
+	~Telemetry() { Stop(); }
+
+	void Add(Counter counter, uint64_t n = 1) { counters_[counter].fetch_add(n, std::memory_order_relaxed); }
+	uint64_t Get(Counter counter) const { return counters_[counter].load(std::memory_order_relaxed); }
+	// Record a frame with this sensor timestamp (in ns) reaching the given stage now.
+	void Latency(Stage stage, int64_t sensor_ns);
+	// Report a count kept elsewhere (by the encoder, say) along with our own. It must never go down.
+	void AddSource(std::string const &name, std::string const &help, std::function<uint64_t()> read);
+
+	// Report every "interval" seconds until Stop(), which makes a final report. The format is "text" or
+	// "prometheus", and only affects the file.
+	void Start(unsigned int interval, std::string const &filename, std::string const &format);
+	void Stop();
+
+private:
+	struct Source
+	{
+		std::string name;
+		std::string help;
+		std::function<uint64_t()> read;
+	};
+
+	void reportThread();
+	void report();
+
+	std::array<std::atomic<uint64_t>, NUM_COUNTERS> counters_ {};
+	std::array<LatencyHistogram, NUM_STAGES> latencies_;
+	std::mutex sources_mutex_;
+	std::vector<Source> sources_;
+
+	unsigned int interval_ = 0;
+	std::string filename_;
+	bool prometheus_ = false;
+	std::mutex mutex_;
+	std::condition_variable cond_;
+	bool abort_ = false;
+	std::thread thread_;
+};
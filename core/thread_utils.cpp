@@ -0,0 +1,71 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * thread_utils.cpp - Thread placement helpers.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+#include "core/logging.hpp"
+#include "core/thread_utils.hpp"
+
+std::vector<unsigned int> parse_cpu_list(std::string const &list)
+{
+	std::vector<unsigned int> cpus;
+	std::stringstream ss(list);
+	std::string item;
+
+	while (std::getline(ss, item, ','))
+	{
+		if (item.empty())
+			continue;
+
+		unsigned int first, last;
+		char c;
+		int n = sscanf(item.c_str(), "%u%c%u", &first, &c, &last);
+		if (n == 1)
+			last = first;
+		else if (n != 3 || c != '-' || last < first)
+			throw std::runtime_error("Invalid CPU list: " + list);
+
+		for (unsigned int cpu = first; cpu <= last; cpu++)
+			cpus.push_back(cpu);
+	}
+
+	return cpus;
+}
+
+void set_thread_affinity(std::thread &thread, std::vector<unsigned int> const &cpus)
+{
+	if (cpus.empty())
+		return;
+
+	cpu_set_t cpuset;
+	CPU_ZERO(&cpuset);
+	for (unsigned int cpu : cpus)
+		CPU_SET(cpu, &cpuset);
+
+	int ret = pthread_setaffinity_np(thread.native_handle(), sizeof(cpuset), &cpuset);
+	if (ret)
+		LOG_ERROR("WARNING: failed to set thread affinity: " << strerror(ret));
+}
+
+void set_thread_priority(std::thread &thread, int priority)
+{
+	if (!priority)
+		return;
+
+	sched_param param = {};
+	param.sched_priority = priority;
+
+	int ret = pthread_setschedparam(thread.native_handle(), SCHED_FIFO, &param);
+	if (ret)
+		LOG_ERROR("WARNING: failed to set thread priority " << priority << ": " << strerror(ret));
+}
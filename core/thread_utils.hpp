@@ -0,0 +1,22 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * thread_utils.hpp - Thread placement helpers.
+ */
+
+#pragma once
+
+#include <string>
+#include <thread>
+#include <vector>
+
+// Parse a CPU list such as "0,2-3" into the individual CPU numbers. An empty string gives an empty list.
+std::vector<unsigned int> parse_cpu_list(std::string const &list);
+
+// Restrict a thread to run on the given CPUs. An empty list leaves the thread's affinity unchanged.
+void set_thread_affinity(std::thread &thread, std::vector<unsigned int> const &cpus);
+
+// Run a thread under SCHED_FIFO with the given priority (1 to 99). A priority of zero leaves the thread's scheduling
+// unchanged.
+void set_thread_priority(std::thread &thread, int priority);
@@ -0,0 +1,156 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * trace.cpp - Per-thread trace recording, written out as a Chrome JSON trace.
+ */
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <stdexcept>
+
+#include "core/logging.hpp"
+#include "core/trace.hpp"
+
+struct Trace::Event
+{
+	char const *name;
+	int64_t start_ns;
+	int64_t duration_ns;
+	TraceArg a;
+	TraceArg b;
+};
+
+// Only the thread that owns a ring writes to it. The head counts every event ever recorded, so a dump can tell which
+// slots were overwritten while it was reading them.
+struct Trace::ThreadRing
+{
+	pid_t tid;
+	// The thread is named in the trace after the first thing it recorded.
+	char const *first_name;
+	std::unique_ptr<Event[]> events;
+	unsigned int size;
+	std::atomic<uint64_t> head { 0 };
+};
+
+thread_local Trace::ThreadRing *Trace::thread_ring_ = nullptr;
+
+Trace::Trace() = default;
+Trace::~Trace() = default;
+
+Trace &Trace::Get()
+{
+	static Trace trace;
+	return trace;
+}
+
+int64_t Trace::Now()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+		.count();
+}
+
+void Trace::Start(unsigned int events)
+{
+	std::lock_guard<std::mutex> lock(rings_mutex_);
+	events_ = std::max(events, 1u);
+	recording_.store(true, std::memory_order_release);
+	LOG(2, "Trace: recording up to " << events_ << " events per thread");
+}
+
+Trace::ThreadRing *Trace::threadRing()
+{
+	if (!thread_ring_)
+	{
+		std::lock_guard<std::mutex> lock(rings_mutex_);
+		auto ring = std::make_unique<ThreadRing>();
+		ring->tid = syscall(SYS_gettid);
+		ring->first_name = nullptr;
+		ring->size = events_;
+		ring->events = std::make_unique<Event[]>(ring->size);
+		thread_ring_ = ring.get();
+		rings_.push_back(std::move(ring));
+	}
+	return thread_ring_;
+}
+
+void Trace::Record(char const *name, int64_t start_ns, int64_t duration_ns, TraceArg a, TraceArg b)
+{
+	ThreadRing *ring = threadRing();
+	uint64_t head = ring->head.load(std::memory_order_relaxed);
+	if (!head)
+		ring->first_name = name;
+	ring->events[head % ring->size] = { name, start_ns, duration_ns, a, b };
+	ring->head.store(head + 1, std::memory_order_release);
+}
+
+static void write_args(FILE *fp, TraceArg const &a, TraceArg const &b)
+{
+	if (!a.name)
+		return;
+	fprintf(fp, ",\"args\":{\"%s\":%" PRId64, a.name, a.value);
+	if (b.name)
+		fprintf(fp, ",\"%s\":%" PRId64, b.name, b.value);
+	fputc('}', fp);
+}
+
+void Trace::Dump(std::string const &filename)
+{
+	// Written alongside and renamed, so that whatever is watching for the file never sees half of it.
+	std::string tmp = filename + ".tmp";
+	FILE *fp = fopen(tmp.c_str(), "w");
+	if (!fp)
+		throw std::runtime_error("failed to open trace file " + tmp);
+
+	pid_t pid = getpid();
+	uint64_t total = 0;
+	std::vector<Event> events;
+	fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", fp);
+	char const *separator = "\n";
+	std::lock_guard<std::mutex> lock(rings_mutex_);
+	for (auto const &ring : rings_)
+	{
+		// Copy the ring out while its thread carries on, then forget any slots it got round to again meanwhile.
+		uint64_t head = ring->head.load(std::memory_order_acquire);
+		uint64_t first = head > ring->size ? head - ring->size : 0;
+		events.clear();
+		for (uint64_t i = first; i < head; i++)
+			events.push_back(ring->events[i % ring->size]);
+		uint64_t now = ring->head.load(std::memory_order_acquire);
+		size_t skip = now > first + ring->size ? std::min<size_t>(now - first - ring->size, events.size()) : 0;
+		if (skip == events.size())
+			continue;
+
+		fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+				separator, pid, ring->tid, ring->first_name ? ring->first_name : "thread");
+		separator = ",\n";
+		for (size_t i = skip; i < events.size(); i++)
+		{
+			Event const &e = events[i];
+			fprintf(fp, ",\n{\"name\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%" PRId64 ".%03d", e.name, pid, ring->tid,
+					e.start_ns / 1000, (int)(e.start_ns % 1000));
+			if (e.duration_ns >= 0)
+				fprintf(fp, ",\"ph\":\"X\",\"dur\":%" PRId64 ".%03d", e.duration_ns / 1000, (int)(e.duration_ns % 1000));
+			else
+				fputs(",\"ph\":\"i\",\"s\":\"t\"", fp);
+			write_args(fp, e.a, e.b);
+			fputc('}', fp);
+		}
+		total += events.size() - skip;
+	}
+	fputs("\n]}\n", fp);
+
+	bool failed = ferror(fp);
+	failed |= fclose(fp) != 0;
+	if (failed || rename(tmp.c_str(), filename.c_str()))
+	{
+		unlink(tmp.c_str());
+		throw std::runtime_error("failed to write trace file " + filename);
+	}
+	LOG(1, "Trace: wrote " << total << " events from " << rings_.size() << " threads to " << filename);
+}
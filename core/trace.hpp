@@ -0,0 +1,113 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * trace.hpp - Per-thread trace recording, written out as a Chrome JSON trace.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// A timeline of what each thread was doing, for finding out where a frame was held up. Trace points record into a
+// ring of the last --trace-events events kept by each thread, so recording takes no locks and never waits; a thread
+// that records faster than the rings are dumped just loses its oldest events. Dump() writes everything still in the
+// rings as Chrome JSON, which Perfetto (ui.perfetto.dev) and chrome://tracing open. Events carry up to two numeric
+// arguments, normally the frame's sequence number or its timestamp_us, so one frame can be followed from thread to
+// thread.
+//
+// Use the TRACE_SCOPE and TRACE_EVENT macros rather than the classes, as a build with -Denable_trace=false compiles
+// them away. Event and argument names must be string literals, as only the pointers are kept.
+struct TraceArg
+{
+	TraceArg() = default;
+	template <typename T>
+	TraceArg(char const *name, T value) : name(name), value(static_cast<int64_t>(value))
+	{
+	}
+	char const *name = nullptr;
+	int64_t value = 0;
+};
+
+class Trace
+{
+public:
+	static Trace &Get();
+	// Nanoseconds on the steady clock, which is CLOCK_MONOTONIC like the sensor timestamps.
+	static int64_t Now();
+
+	// Start recording, keeping up to "events" for each thread.
+	void Start(unsigned int events);
+	bool Recording() const { return recording_.load(std::memory_order_relaxed); }
+
+	// A span of "duration_ns" from "start_ns", or, with duration_ns < 0, a single instant.
+	void Record(char const *name, int64_t start_ns, int64_t duration_ns, TraceArg a = {}, TraceArg b = {});
+
+	void Instant(char const *name, TraceArg a = {}, TraceArg b = {})
+	{
+		if (Recording())
+			Record(name, Now(), -1, a, b);
+	}
+
+	// Write out what the rings hold, without stopping recording. Throws if the file can't be written.
+	void Dump(std::string const &filename);
+
+private:
+	struct Event;
+	struct ThreadRing;
+
+	Trace();
+	~Trace();
+	ThreadRing *threadRing();
+
+	std::atomic<bool> recording_ { false };
+	unsigned int events_ = 0;
+	// Rings outlive their threads, so that a dump still shows threads that have finished.
+	std::mutex rings_mutex_;
+	std::vector<std::unique_ptr<ThreadRing>> rings_;
+	static thread_local ThreadRing *thread_ring_;
+};
+
+// Records a span from its construction to the end of the enclosing scope.
+class TraceScope
+{
+public:
+	TraceScope(char const *name, TraceArg a = {}, TraceArg b = {})
+		: name_(name), a_(a), b_(b), start_(Trace::Get().Recording() ? Trace::Now() : -1)
+	{
+	}
+	~TraceScope()
+	{
+		if (start_ >= 0)
+			Trace::Get().Record(name_, start_, Trace::Now() - start_, a_, b_);
+	}
+
+private:
+	char const *name_;
+	TraceArg a_;
+	TraceArg b_;
+	int64_t start_;
+};
+
+#if RPICAM_TRACE
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+// TRACE_SCOPE("name"[, { "arg", value }[, { "arg", value }]])
+#define TRACE_SCOPE(...) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(__VA_ARGS__)
+// TRACE_EVENT("name"[, { "arg", value }[, { "arg", value }]])
+#define TRACE_EVENT(...) Trace::Get().Instant(__VA_ARGS__)
+#else
+#define TRACE_SCOPE(...) \
+	do                   \
+	{                    \
+	} while (0)
+#define TRACE_EVENT(...) \
+	do                   \
+	{                    \
+	} while (0)
+#endif
@@ -44,6 +44,23 @@ struct VideoOptions : public Options
 			 "Set the MJPEG quality parameter (mjpeg only)")
 			("listen,l", value<bool>(&v_->listen)->default_value(false)->implicit_value(true),
 			 "Listen for an incoming client network connection before sending data to the client")
+			("udp-gso", value<unsigned int>(&v_->udp_gso)->default_value(0),
+			 "Send UDP output as datagrams of this many bytes, segmented by the kernel (UDP GSO) from large sends")
+			("net-zerocopy", value<bool>(&v_->net_zerocopy)->default_value(false)->implicit_value(true),
+			 "Send TCP output with MSG_ZEROCOPY. Each frame goes from a buffer that is kept until the kernel has "
+			 "finished with it, so the output only waits for the network when several frames are in flight")
+			("rtp-mtu", value<unsigned int>(&v_->rtp_mtu)->default_value(1400),
+			 "Largest packet to send to rtp:// output, in bytes, RTP header included")
+			("rtp-pace", value<float>(&v_->rtp_pace)->default_value(0.5),
+			 "Spread each frame's packets to rtp:// output over this fraction of the frame interval "
+			 "(0 sends them all at once)")
+			("rtp-txtime", value<bool>(&v_->rtp_txtime)->default_value(false)->implicit_value(true),
+			 "Have the kernel send each rtp:// packet at its time (SO_TXTIME on CLOCK_MONOTONIC, which needs the fq "
+			 "qdisc; etf, which wants CLOCK_TAI, drops them) rather than sleeping until then")
+			("fanout", value<unsigned int>(&v_->fanout)->default_value(0),
+			 "Serve tcp:// output to up to this many clients at once, which may connect and disconnect at any time")
+			("fanout-queue", value<unsigned int>(&v_->fanout_queue)->default_value(16),
+			 "Frames queued for each --fanout client before it is skipped forward to the next keyframe")
 			("keypress,k", value<bool>(&v_->keypress)->default_value(false)->implicit_value(true),
 			 "Pause or resume video recording when ENTER pressed")
 			("signal,s", value<bool>(&v_->signal)->default_value(false)->implicit_value(true),
@@ -56,8 +73,40 @@ struct VideoOptions : public Options
 			 "Break the recording into files of approximately this many milliseconds")
 			("circular", value<size_t>(&v_->circular)->default_value(0)->implicit_value(4),
 			 "Write output to a circular buffer of the given size (in MB) which is saved on exit")
+			("circular-trigger", value<bool>(&v_->circular_trigger)->default_value(false)->implicit_value(true),
+			 "With --circular, save the buffer to a new numbered file each time we are signalled, rather than on exit")
+			("motion-postroll", value<unsigned int>(&v_->motion_postroll)->default_value(0),
+			 "With --circular, record to a new numbered file whenever the motion_detect stage reports motion, "
+			 "starting with what's in the buffer and stopping this many milliseconds after the motion does")
 			("frames", value<unsigned int>(&v_->frames)->default_value(0),
 			 "Run for the exact number of frames specified. This will override any timeout set.")
+			("encode-threads", value<unsigned int>(&v_->encode_threads)->default_value(0),
+			 "Number of encode threads for the mjpeg, png and dng encoders (0 = the encoder's default)")
+			("encode-affinity", value<std::string>(&v_->encode_affinity),
+			 "Pin the encode threads to these CPUs, e.g. \"2,3\" or \"1-3\"")
+			("encode-priority", value<int>(&v_->encode_priority)->default_value(0),
+			 "Run the encode threads with this SCHED_FIFO priority (0 = normal scheduling)")
+			("encode-output-affinity", value<std::string>(&v_->encode_output_affinity),
+			 "Pin the encoder output thread to these CPUs, e.g. \"0\"")
+			("encode-output-priority", value<int>(&v_->encode_output_priority)->default_value(0),
+			 "Run the encoder output thread with this SCHED_FIFO priority (0 = normal scheduling)")
+			("encode-staging", value<unsigned int>(&v_->encode_staging)->default_value(0),
+			 "Copy frames into this many staging buffers for the mjpeg, png and dng encoders, so that camera buffers "
+			 "are returned at once however slow the encoding (0 = off)")
+			("encode-queue", value<unsigned int>(&v_->encode_queue)->default_value(0),
+			 "Most frames that may wait to be encoded by the mjpeg, png and dng encoders, each holding a camera or "
+			 "staging buffer (0 = no limit)")
+			("encode-queue-policy", value<std::string>(&v_->encode_queue_policy)->default_value("block"),
+			 "What to do with a frame when the --encode-queue is full: \"block\" until there's room, "
+			 "\"drop-oldest\" or \"drop-newest\" frame, or \"degrade\" (encode it more cheaply: png compression "
+			 "level 1, dng without compression or thumbnail, blocking only at twice the limit)")
+			("jpeg-encoder", value<std::string>(&v_->jpeg_encoder)->default_value("auto"),
+			 "JPEG encoder for mjpeg, \"hardware\" (the V4L2 codec), \"software\" (libjpeg) or \"auto\" (hardware "
+			 "where there is one, otherwise software)")
+			("low-latency", value<bool>(&v_->low_latency)->default_value(false)->implicit_value(true),
+			 "Encode for the least latency rather than the best compression: the libav/libx264 low latency presets, "
+			 "or for the hardware H.264 encoder, minimal buffering, no B-frames and intra refresh instead of "
+			 "frequent IDR frames")
 #if LIBAV_PRESENT
 			("libav-video-codec", value<std::string>(&v_->libav_video_codec)->default_value("h264_v4l2m2m"),
 			 "Sets the libav video codec to use. "
@@ -72,6 +121,11 @@ struct VideoOptions : public Options
 			 "Sets the libav encoder output format to use. "
 			 "Leave blank to try and deduce this from the filename.\n"
 			 "To list available formats, run  the \"ffmpeg -formats\" command.")
+			("libav-fragment", value<uint32_t>(&v_->libav_fragment)->default_value(0),
+			 "Write MP4/MOV output as fragments of at least this many milliseconds, each starting on a keyframe, "
+			 "syncing each one to disk as it completes so that a recording survives losing power (0 = off). "
+			 "With --segment, MP4/MOV output is also split into a new file on the first keyframe after every "
+			 "segment, and HLS output gets fMP4 segments of that length.")
 			("libav-audio", value<bool>(&v_->libav_audio)->default_value(false)->implicit_value(true),
 			 "Records an audio stream together with the video.")
 			("audio-codec", value<std::string>(&v_->audio_codec)->default_value("aac"),
@@ -94,8 +148,6 @@ struct VideoOptions : public Options
 			("av-sync", value<std::string>(&v_->av_sync_)->default_value("0us"),
 			 "Add a time offset (in microseconds if no units provided) to the audio stream, relative to the video stream. "
 			 "The offset value can be either positive or negative.")
-			("low-latency", value<bool>(&v_->low_latency)->default_value(false)->implicit_value(true),
-			 "Enables the libav/libx264 low latency presets for video encoding.")
 #endif
 #ifndef DISABLE_RPI_FEATURES
 			 ("sync", value<std::string>(&v_->sync_)->default_value("off"),
@@ -0,0 +1,136 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * buffer_pool.cpp - Recycling pool for encoder working and output buffers.
+ */
+
+#include <cstdlib>
+#include <stdexcept>
+
+#include "core/memory_budget.hpp"
+
+#include "buffer_pool.hpp"
+
+std::atomic<uint64_t> BufferPool::allocations_ { 0 };
+std::atomic<uint64_t> BufferPool::reuses_ { 0 };
+
+BufferPool::BufferPool(unsigned int max_free) : max_free_(max_free)
+{
+}
+
+BufferPool::~BufferPool()
+{
+	for (auto &[key, buffers] : free_)
+		for (auto &buffer : buffers)
+			freeBuffer(buffer.first, buffer.second);
+	// Anything still in use belongs to someone who outlived us; hand it back to the allocator regardless.
+	for (auto &[mem, allocation] : in_use_)
+		freeBuffer(mem, allocation.capacity);
+}
+
+void BufferPool::freeBuffer(uint8_t *mem, size_t capacity)
+{
+	free(mem);
+	MemoryBudget::Get().Credit(MemoryBudget::ENCODER, capacity);
+}
+
+uint8_t *BufferPool::Acquire(Key const &key, size_t size)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	auto it = free_.find(key);
+	if (it == free_.end())
+	{
+		// A new geometry for this slot means the stream has been reconfigured, so buffers kept for the old one
+		// won't be wanted again.
+		for (auto old = free_.begin(); old != free_.end();)
+		{
+			if (old->first.slot == key.slot)
+			{
+				for (auto &buffer : old->second)
+					freeBuffer(buffer.first, buffer.second);
+				old = free_.erase(old);
+			}
+			else
+				old++;
+		}
+	}
+	else
+	{
+		auto &buffers = it->second;
+		for (auto b = buffers.begin(); b != buffers.end(); b++)
+		{
+			if (b->second >= size)
+			{
+				uint8_t *mem = b->first;
+				in_use_.emplace(mem, Allocation { key, b->second });
+				buffers.erase(b);
+				reuses_++;
+				return mem;
+			}
+		}
+	}
+
+	uint8_t *mem = (uint8_t *)malloc(size);
+	if (!mem)
+		throw std::runtime_error("failed to allocate pool buffer");
+	allocations_++;
+	MemoryBudget::Get().Charge(MemoryBudget::ENCODER, size);
+	in_use_.emplace(mem, Allocation { key, size });
+	return mem;
+}
+
+uint8_t *BufferPool::Grow(uint8_t *mem, size_t size)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	auto it = in_use_.find(mem);
+	if (it == in_use_.end())
+		throw std::runtime_error("growing a buffer not owned by the pool");
+	if (it->second.capacity >= size)
+		return mem;
+
+	uint8_t *new_mem = (uint8_t *)realloc(mem, size);
+	if (!new_mem)
+		return nullptr;
+	allocations_++;
+	MemoryBudget::Get().Charge(MemoryBudget::ENCODER, size - it->second.capacity);
+
+	Allocation allocation { it->second.key, size };
+	in_use_.erase(it);
+	in_use_.emplace(new_mem, allocation);
+	return new_mem;
+}
+
+size_t BufferPool::Capacity(uint8_t *mem)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	auto it = in_use_.find(mem);
+	return it == in_use_.end() ? 0 : it->second.capacity;
+}
+
+void BufferPool::Release(uint8_t *mem)
+{
+	if (!mem)
+		return;
+
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	// This is called from destructors, so a buffer we don't know about is simply freed rather than thrown over.
+	auto it = in_use_.find(mem);
+	if (it == in_use_.end())
+	{
+		free(mem);
+		return;
+	}
+
+	// Buffers kept for re-use still count against the budget, so aren't kept once it's used up.
+	auto &buffers = free_[it->second.key];
+	if (buffers.size() < max_free_ && MemoryBudget::Get().Available(MemoryBudget::ENCODER))
+		buffers.emplace_back(mem, it->second.capacity);
+	else
+		freeBuffer(mem, it->second.capacity);
+	in_use_.erase(it);
+}
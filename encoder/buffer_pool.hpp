@@ -0,0 +1,91 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * buffer_pool.hpp - Recycling pool for encoder working and output buffers.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <vector>
+
+#include "core/stream_info.hpp"
+
+// Large per-frame buffers (encoded output, unpack scratch space) are taken from here and handed back once the frame
+// is finished with, so that at a steady frame geometry the encoders stop going through the allocator. Buffers are
+// plain malloc() memory and may be grown in place with Grow(). All of it, in use or kept for re-use, counts against
+// the encoders' share of the memory budget.
+class BufferPool
+{
+public:
+	// Buffers are recycled per stream geometry and per "slot", i.e. which of the encoder's buffers this is.
+	struct Key
+	{
+		Key(StreamInfo const &info, unsigned int slot)
+			: width(info.width), height(info.height), stride(info.stride), fourcc(info.pixel_format.fourcc()),
+			  slot(slot)
+		{
+		}
+		bool operator<(Key const &other) const
+		{
+			return std::tie(width, height, stride, fourcc, slot) <
+				   std::tie(other.width, other.height, other.stride, other.fourcc, other.slot);
+		}
+		unsigned int width;
+		unsigned int height;
+		unsigned int stride;
+		uint32_t fourcc;
+		unsigned int slot;
+	};
+
+	struct Releaser
+	{
+		BufferPool *pool;
+		void operator()(uint8_t *mem) const { pool->Release(mem); }
+	};
+	// A pool buffer that goes back to the pool when it goes out of scope.
+	typedef std::unique_ptr<uint8_t, Releaser> Ptr;
+
+	// At most max_free released buffers are kept per key; any more are freed.
+	explicit BufferPool(unsigned int max_free = 4);
+	~BufferPool();
+
+	// Return a buffer of at least size bytes. The contents are undefined.
+	uint8_t *Acquire(Key const &key, size_t size);
+	// As Acquire(), but the buffer is released automatically.
+	Ptr AcquirePtr(Key const &key, size_t size) { return Ptr(Acquire(key, size), Releaser { this }); }
+	// Grow a buffer obtained from Acquire(), preserving its contents. Returns nullptr on failure, in which case
+	// the original buffer is still valid.
+	uint8_t *Grow(uint8_t *mem, size_t size);
+	size_t Capacity(uint8_t *mem);
+	// Hand a buffer back for re-use. nullptr is ignored.
+	void Release(uint8_t *mem);
+
+	// How many times, over all the pools, a buffer was got from the allocator (or grown), and how many times one
+	// was recycled instead.
+	static uint64_t Allocations() { return allocations_; }
+	static uint64_t Reuses() { return reuses_; }
+
+private:
+	struct Allocation
+	{
+		Key key;
+		size_t capacity;
+	};
+
+	// Free a buffer, crediting the memory budget with it.
+	static void freeBuffer(uint8_t *mem, size_t capacity);
+
+	std::mutex mutex_;
+	unsigned int max_free_;
+	std::map<uint8_t *, Allocation> in_use_;
+	std::map<Key, std::vector<std::pair<uint8_t *, size_t>>> free_;
+	static std::atomic<uint64_t> allocations_;
+	static std::atomic<uint64_t> reuses_;
+};
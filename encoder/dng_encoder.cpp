@@ -5,31 +5,37 @@
  * dng_encoder.cpp - DNG video encoder.
  */
 
+#include <algorithm>
 #include <chrono>
 #include <cstring>
 #include <ctime>
 #include <limits>
 #include <map>
+#include <memory>
+#include <optional>
 #include <vector>
 #include <cmath>
 
 #include <tiffio.h>
+#if ZSTD_PRESENT
+#include <zstd.h>
+#endif
 #include <libcamera/control_ids.h>
 #include <libcamera/formats.h>
 
 #include "dng_encoder.hpp"
+#include "dng_ljpeg.hpp"
+#include "dng_unpack.hpp"
+#include "exif_template.hpp"
 #include "core/logging.hpp"
 #include "core/metadata.hpp"
+#include "post_processing_stages/parallel_rows.hpp"
 #include <libcamera/controls.h>
 
 #ifndef MAKE_STRING
 #define MAKE_STRING "Wassoc"
 #endif
 
-// Compression helpers (from dng.cpp)
-#define COMPRESS_OFFSET 2048
-#define COMPRESS_MODE 1
-
 using namespace libcamera;
 
 static char TIFF_RGGB[4] = { 0, 1, 1, 2 };
@@ -76,9 +82,13 @@ static const std::map<PixelFormat, BayerFormat> bayer_formats =
 	{ formats::SBGGR16, { "BGGR-16", 16, TIFF_BGGR, false, false } },
 	{ formats::SGBRG16, { "GBRG-16", 16, TIFF_GBRG, false, false } },
 
-	{ formats::R10_CSI2P, { "BGGR-10", 10, TIFF_BGGR, true, false } },
-	{ formats::R10, { "BGGR-10", 10, TIFF_BGGR, false, false } },
-	{ formats::R12, { "BGGR-12", 12, TIFF_BGGR, false, false } },
+	/* Monochrome sensors. */
+	{ formats::R8, { "MONO-8", 8, TIFF_MONO, false, false } },
+	{ formats::R10_CSI2P, { "MONO-10", 10, TIFF_MONO, true, false } },
+	{ formats::R10, { "MONO-10", 10, TIFF_MONO, false, false } },
+	{ formats::R12_CSI2P, { "MONO-12", 12, TIFF_MONO, true, false } },
+	{ formats::R12, { "MONO-12", 12, TIFF_MONO, false, false } },
+	{ formats::R16, { "MONO-16", 16, TIFF_MONO, false, false } },
 
 	/* PiSP compressed formats. */
 	{ formats::RGGB_PISP_COMP1, { "RGGB-16-PISP", 16, TIFF_RGGB, false, true } },
@@ -87,115 +97,10 @@ static const std::map<PixelFormat, BayerFormat> bayer_formats =
 	{ formats::BGGR_PISP_COMP1, { "BGGR-16-PISP", 16, TIFF_BGGR, false, true } },
 };
 
-// Helper functions from dng.cpp
-static void unpack_10bit(uint8_t const *src, StreamInfo const &info, uint8_t *dest, uint16_t *dest16Bit)
-{
-	unsigned int w_align = info.width & ~3;
-	for (unsigned int y = 0; y < info.height; y++, src += info.stride)
-	{
-		uint8_t const *ptr = src;
-		unsigned int x;
-		for (x = 0; x < w_align; x += 4, ptr += 5)
-		{
-			uint16_t val1 = (ptr[0] << 2) | ((ptr[4] >> 0) & 3);
-			uint16_t val2 = (ptr[1] << 2) | ((ptr[4] >> 2) & 3);
-			uint16_t val3 = (ptr[2] << 2) | ((ptr[4] >> 4) & 3);
-			uint16_t val4 = (ptr[3] << 2) | ((ptr[4] >> 6) & 3);
-			uint8_t byte1 = val1 >> 2;
-			uint8_t byte2 = ((val1 & 3) << 6) | (val2 >> 4);
-			uint8_t byte3 = ((val2 & 0xf) << 4) | (val3 >> 6);
-			uint8_t byte4 = ((val3 & 0x3f) << 2) | (val4 >> 8);
-			uint8_t byte5 = val4 & 0xff;
-			*dest++ = byte1;
-			*dest++ = byte2;
-			*dest++ = byte3;
-			*dest++ = byte4;
-			*dest++ = byte5;
-			*dest16Bit++ = val1;
-			*dest16Bit++ = val2;
-			*dest16Bit++ = val3;
-			*dest16Bit++ = val4;
-		}
-	}
-}
-
-static void unpack_12bit(uint8_t const *src, StreamInfo const &info, uint8_t *dest, uint16_t *dest16Bit)
-{
-	unsigned int w_align = info.width & ~1;
-	for (unsigned int y = 0; y < info.height; y++, src += info.stride)
-	{
-		uint8_t const *ptr = src;
-		unsigned int x;
-		for (x = 0; x < w_align; x += 2, ptr += 3)
-		{
-			uint16_t val1 = (ptr[0] << 4) | ((ptr[2] >> 0) & 15);
-			uint16_t val2 = (ptr[1] << 4) | ((ptr[2] >> 4) & 15);
-			uint8_t byte1 = val1 >> 4;
-			uint8_t byte2 = ((val1 & 0xf) << 4) | (val2 >> 8);
-			uint8_t byte3 = val2 & 0xff;
-			*dest++ = byte1;
-			*dest++ = byte2;
-			*dest++ = byte3;
-			*dest16Bit++ = val1;
-			*dest16Bit++ = val2;
-		}
-	}
-}
-
-static void unpack_12bit_to_8bit(uint8_t const *src, StreamInfo const &info, uint8_t *dest, uint16_t *dest16Bit)
-{
-	unsigned int w_align = info.width & ~1;
-	for (unsigned int y = 0; y < info.height; y++, src += info.stride)
-	{
-		uint8_t const *ptr = src;
-		unsigned int x;
-		for (x = 0; x < w_align; x += 2, ptr += 3)
-		{
-			uint16_t val1 = (ptr[0] << 4) | ((ptr[2] >> 0) & 15);
-			uint16_t val2 = (ptr[1] << 4) | ((ptr[2] >> 4) & 15);
-			uint8_t val1_as_8bit = ((float)val1 / 4096.f) * 256;
-			uint8_t val2_as_8bit = ((float)val2 / 4096.f) * 256;
-			*dest++ = val1_as_8bit;
-			*dest++ = val2_as_8bit;
-			*dest16Bit++ = val1;
-			*dest16Bit++ = val2;
-		}
-	}
-}
-
-static void unpack_12bit_to_10bit(uint8_t const *src, StreamInfo const &info, uint8_t *dest, uint16_t *dest16Bit)
+// Monochrome sensors, and colour ones whose output we're told to treat as monochrome, have no CFA and no colour.
+static bool is_mono(BayerFormat const &bayer_format, Options const *options)
 {
-	unsigned int w_align = info.width & ~1;
-	for (unsigned int y = 0; y < info.height; y++, src += info.stride)
-	{
-		uint8_t const *ptr = src;
-		unsigned int x;
-		for (x = 0; x < w_align; x += 4, ptr += 6)
-		{
-			uint16_t val1 = (ptr[0] << 4) | ((ptr[2] >> 0) & 15);
-			uint16_t val2 = (ptr[1] << 4) | ((ptr[2] >> 4) & 15);
-			uint16_t val3 = (ptr[3] << 4) | ((ptr[5] >> 0) & 15);
-			uint16_t val4 = (ptr[4] << 4) | ((ptr[5] >> 4) & 15);
-			uint16_t val1_as_10bit = ((float)val1 / 4096.f) * 1024;
-			uint16_t val2_as_10bit = ((float)val2 / 4096.f) * 1024;
-			uint16_t val3_as_10bit = ((float)val3 / 4096.f) * 1024;
-			uint16_t val4_as_10bit = ((float)val4 / 4096.f) * 1024;
-			uint8_t byte1 = val1_as_10bit >> 2;
-			uint8_t byte2 = ((val1_as_10bit & 3) << 6) | (val2_as_10bit >> 4);
-			uint8_t byte3 = ((val2_as_10bit & 0xf) << 4) | (val3_as_10bit >> 6);
-			uint8_t byte4 = ((val3_as_10bit & 0x3f) << 2) | (val4_as_10bit >> 8);
-			uint8_t byte5 = val4_as_10bit & 0xff;
-			*dest++ = byte1;
-			*dest++ = byte2;
-			*dest++ = byte3;
-			*dest++ = byte4;
-			*dest++ = byte5;
-			*dest16Bit++ = val1;
-			*dest16Bit++ = val2;
-			*dest16Bit++ = val3;
-			*dest16Bit++ = val4;
-		}
-	}
+	return bayer_format.order == TIFF_MONO || options->Get().monochrome;
 }
 
 static void unpack_16bit(uint8_t const *src, StreamInfo const &info, uint16_t *dest)
@@ -276,12 +181,31 @@ struct Matrix
 // Structure to hold memory buffer for TIFF encoding
 struct TiffMemoryBuffer
 {
+	BufferPool *pool;
 	uint8_t *data;
 	size_t size;
 	size_t capacity;
 	size_t position;
 };
 
+// Grow the buffer so that it holds at least "needed" bytes.
+static bool tiff_grow(TiffMemoryBuffer *buffer, size_t needed)
+{
+	if (needed <= buffer->capacity)
+		return true;
+
+	size_t new_capacity = buffer->capacity * 2;
+	if (new_capacity < needed)
+		new_capacity = needed + 1024 * 1024; // Add 1MB extra space
+
+	uint8_t *new_data = buffer->pool->Grow(buffer->data, new_capacity);
+	if (!new_data)
+		return false;
+	buffer->data = new_data;
+	buffer->capacity = new_capacity;
+	return true;
+}
+
 // Custom read function for libtiff (needed when reading back directories)
 static tsize_t tiff_read(thandle_t handle, tdata_t data, tsize_t size)
 {
@@ -305,23 +229,11 @@ static tsize_t tiff_write(thandle_t handle, tdata_t data, tsize_t size)
 {
 	TiffMemoryBuffer *buffer = (TiffMemoryBuffer *)handle;
 	
-	// Grow buffer if needed
-	if (buffer->position + size > buffer->capacity)
-	{
-		size_t new_capacity = buffer->capacity * 2;
-		if (new_capacity < buffer->position + size)
-			new_capacity = buffer->position + size + 1024 * 1024; // Add 1MB extra space
-		
-		size_t old_capacity = buffer->capacity;
-		uint8_t *new_data = (uint8_t *)realloc(buffer->data, new_capacity);
-		if (!new_data)
-			return -1;
-		buffer->data = new_data;
-		// Zero-initialize the newly allocated memory
-		if (new_capacity > old_capacity)
-			memset(buffer->data + old_capacity, 0, new_capacity - old_capacity);
-		buffer->capacity = new_capacity;
-	}
+	if (!tiff_grow(buffer, buffer->position + size))
+		return -1;
+	// Pool buffers are recycled, so zero any gap left by seeking past the end rather than writing stale data.
+	if (buffer->position > buffer->size)
+		memset(buffer->data + buffer->size, 0, buffer->position - buffer->size);
 	
 	memcpy(buffer->data + buffer->position, data, size);
 	buffer->position += size;
@@ -352,18 +264,8 @@ static toff_t tiff_seek(thandle_t handle, toff_t offset, int whence)
 	}
 	
 	// Grow buffer if seeking beyond current size
-	if (buffer->position > buffer->capacity)
-	{
-		size_t old_capacity = buffer->capacity;
-		size_t new_capacity = buffer->position + 1024 * 1024;
-		uint8_t *new_data = (uint8_t *)realloc(buffer->data, new_capacity);
-		if (!new_data)
-			return -1;
-		buffer->data = new_data;
-		// Zero-initialize the newly allocated memory
-		memset(buffer->data + old_capacity, 0, new_capacity - old_capacity);
-		buffer->capacity = new_capacity;
-	}
+	if (!tiff_grow(buffer, buffer->position))
+		return -1;
 	
 	return buffer->position;
 }
@@ -400,187 +302,710 @@ static void tiff_unmap(thandle_t handle, tdata_t base, toff_t size)
 }
 
 // Include helper functions from dng.cpp - we'll need to copy them or include them
-// For now, let's include the necessary parts inline or reference the original file
-// We'll need: unpack_10bit, unpack_12bit, unpack_12bit_to_8bit, unpack_12bit_to_10bit, 
-// unpack_16bit, copy_8bit, uncompress, and compression helpers
-
-static uint16_t postprocess(uint16_t a)
-{
-	if (COMPRESS_MODE & 2)
-	{
-		if (COMPRESS_MODE == 3 && a < 0x4000)
-			a = a >> 2;
-		else if (a < 0x1000)
-			a = a >> 4;
-		else if (a < 0x1800)
-			a = (a - 0x800) >> 3;
-		else if (a < 0x3000)
-			a = (a - 0x1000) >> 2;
-		else if (a < 0x6000)
-			a = (a - 0x2000) >> 1;
-		else if (a < 0xC000)
-			a = (a - 0x4000);
-		else
-			a = 2 * (a - 0x8000);
+// Helper functions from dng.cpp - we need to include them
+// For brevity, I'll reference that these should be copied from dng.cpp
+// In a real implementation, you might want to extract these to a shared header
+
+// Note: The unpack functions and uncompress function need to be included here
+// For now, I'll create a simplified version that references the original functions
+// In practice, you'd want to either:
+// 1. Extract these to a shared header/implementation file
+// 2. Include them directly here
+// 3. Link against the dng.cpp object file
+
+// For this implementation, I'll create a wrapper that can call the original dng_save logic
+// but adapted for memory output. Actually, let me create a complete implementation
+// that includes all the necessary helper functions inline.
+
+// Since the file is getting long, let me create the encoder structure first,
+// then we can refactor to share code with dng.cpp if needed.
+
+// Per-frame values for the DNG tags, taken from the frame's metadata.
+struct DngFrameParams
+{
+	float black_levels[4];
+	float exp_time; // seconds
+	uint16_t iso;
+	float neutral[3]; // these two are left unset for monochrome images
+	Matrix cam_xyz;
+	std::optional<double> subject_distance;
+};
+
+static DngFrameParams get_frame_params(ControlList const &metadata, BayerFormat const &bayer_format, bool mono,
+									   bool force8bit, bool force10bit)
+{
+	DngFrameParams params;
+
+	// Calculate black levels
+	float black = 4096 * (1 << bayer_format.bits) / 65536.0;
+	if(force8bit) {
+		black = 16 + 12;
+	} else if (force10bit) {
+		black = 64 + 4;
 	}
-	return std::min(0xFFFF, a + COMPRESS_OFFSET);
+	for (int i = 0; i < 4; i++)
+		params.black_levels[i] = black;
+	auto bl = metadata.get(libcamera::controls::SensorBlackLevels);
+	if (bl)
+	{
+		for (int i = 0; i < 4; i++)
+		{
+			int j = bayer_format.order[i];
+			j = j == 0 ? 0 : (j == 2 ? 3 : 1 + !!bayer_format.order[i ^ 1]);
+			params.black_levels[j] = (*bl)[mono ? 0 : i] * (1 << bayer_format.bits) / 65536.0;
+		}
+	}
+	else
+		LOG_ERROR("WARNING: no black level found, using default");
+	
+	// Get exposure time
+	auto exp = metadata.get(libcamera::controls::ExposureTime);
+	params.exp_time = 10000;
+	if (exp)
+		params.exp_time = *exp;
+	else
+		LOG_ERROR("WARNING: default to exposure time of " << params.exp_time << "us");
+	params.exp_time /= 1e6;
+	
+	// Get ISO
+	auto ag = metadata.get(libcamera::controls::AnalogueGain);
+	params.iso = 100;
+	if (ag)
+		params.iso = *ag * 100.0;
+	else
+		LOG_ERROR("WARNING: default to ISO value of " << params.iso);
+
+	auto lp = metadata.get(libcamera::controls::LensPosition);
+	if (lp)
+		params.subject_distance = (*lp > 0.0) ? (1.0 / *lp) : std::numeric_limits<double>::infinity();
+
+	// There's no colour to describe in a monochrome image.
+	if (mono)
+		return params;
+	
+	// White balance
+	params.neutral[0] = params.neutral[1] = params.neutral[2] = 1;
+	Matrix WB_GAINS(1, 1, 1);
+	auto cg = metadata.get(libcamera::controls::ColourGains);
+	if (cg)
+	{
+		params.neutral[0] = 1.0 / (*cg)[0];
+		params.neutral[2] = 1.0 / (*cg)[1];
+		WB_GAINS = Matrix((*cg)[0], 1, (*cg)[1]);
+	}
+	
+	// CCM
+	Matrix CCM(1.90255, -0.77478, -0.12777,
+			   -0.31338, 1.88197, -0.56858,
+			   -0.06001, -0.61785, 1.67786);
+	auto ccm = metadata.get(libcamera::controls::ColourCorrectionMatrix);
+	if (ccm)
+	{
+		CCM = Matrix((*ccm)[0], (*ccm)[1], (*ccm)[2], (*ccm)[3], (*ccm)[4], (*ccm)[5], (*ccm)[6], (*ccm)[7], (*ccm)[8]);
+	}
+	else
+		LOG_ERROR("WARNING: no CCM metadata found");
+	
+	// Color matrix
+	Matrix RGB2XYZ(0.4124564, 0.3575761, 0.1804375,
+				   0.2126729, 0.7151522, 0.0721750,
+				   0.0193339, 0.1191920, 0.9503041);
+	params.cam_xyz = (RGB2XYZ * CCM * WB_GAINS).Inv();
+
+	return params;
 }
 
-static uint16_t dequantize(uint16_t q, int qmode)
+// Fast DNG writer. Instead of unpacking and going through libtiff, we build the TIFF header and IFDs once per stream
+// configuration, then for each frame copy that template, patch the per-frame values in place and append the pixel
+// data. CSI2 packed rows are converted straight into TIFF bit order in the output buffer; unpacked 8 and 16 bit rows
+// are copied as they are. The file has a single raw IFD and no preview image. With --dng-compression ljpeg the pixel
+// data is instead a set of lossless JPEG tiles (DNG compression 7), encoded in parallel. --dng-compression zstd makes
+// zstd tiles the same way, behind a horizontal differencing predictor. That is TIFF's compression 50000, which libtiff
+// reads but raw converters generally don't, so utils/dng_zstd_convert.py turns these files into standard DNGs later.
+
+enum TiffType : uint16_t
+{
+	TIFF_TYPE_BYTE = 1,
+	TIFF_TYPE_ASCII = 2,
+	TIFF_TYPE_SHORT = 3,
+	TIFF_TYPE_LONG = 4,
+	TIFF_TYPE_RATIONAL = 5,
+	TIFF_TYPE_UNDEFINED = 7,
+	TIFF_TYPE_SRATIONAL = 10,
+};
+
+static unsigned int tiff_type_size(uint16_t type)
 {
-	switch (qmode)
+	switch (type)
 	{
-	case 0:
-		return (q < 320) ? 16 * q : 32 * (q - 160);
-	case 1:
-		return 64 * q;
-	case 2:
-		return 128 * q;
+	case TIFF_TYPE_SHORT:
+		return 2;
+	case TIFF_TYPE_LONG:
+		return 4;
+	case TIFF_TYPE_RATIONAL:
+	case TIFF_TYPE_SRATIONAL:
+		return 8;
 	default:
-		return (q < 94) ? 256 * q : std::min(0xFFFF, 512 * (q - 47));
+		return 1;
 	}
 }
 
-static void subBlockFunction(uint16_t *d, uint32_t w)
+namespace
+{
+
+// Tags we fill in per frame, or once the layout is known.
+enum : uint16_t
+{
+	TAG_STRIP_OFFSETS = 273,
+	TAG_PREDICTOR = 317,
+	TAG_TILE_OFFSETS = 324,
+	TAG_TILE_BYTE_COUNTS = 325,
+	TAG_EXPOSURE_TIME = 33434,
+	TAG_EXIF_IFD = 34665,
+	TAG_ISO = 34855,
+	TAG_DATE_TIME_ORIGINAL = 36867,
+	TAG_SUBJECT_DISTANCE = 37382,
+	TAG_USER_COMMENT = 37510,
+	TAG_BLACK_LEVEL = 50714,
+	TAG_COLOR_MATRIX1 = 50721,
+	TAG_AS_SHOT_NEUTRAL = 50728,
+	// Private: how native PiSP raw data was compressed, as SHORT[2] mode and offset.
+	TAG_PISP_COMPRESSION = 65000,
+};
+
+// Private compression scheme marking native PiSP raw data, so that nothing mistakes it for ordinary pixels.
+static constexpr uint16_t COMPRESSION_PISP = 65000;
+
+// TIFF's compression code for zstd, and the DNG predictor that differences each sample from the one two to its left,
+// the last of the same colour in a CFA row.
+static constexpr uint16_t COMPRESSION_ZSTD_TIFF = 50000;
+static constexpr uint16_t PREDICTOR_HORIZONTAL_X2 = 34892;
+
+// The EXIF user comment (the lamp colour and strobe timing) is given a fixed amount of room, so that the fast
+// writer's template needn't change with it: an 8-byte character code and then the text, nul-padded and cut short if
+// need be.
+static constexpr size_t USER_COMMENT_SIZE = 128;
+
+static void make_user_comment(Metadata const &metadata, uint8_t *dest)
 {
-	int q[4];
-	int qmode = (w & 3);
-	if (qmode < 3)
+	std::string comment = ExifTemplate::Comment(metadata).substr(0, USER_COMMENT_SIZE - 8);
+	memset(dest, 0, USER_COMMENT_SIZE);
+	memcpy(dest, "ASCII\0\0\0", 8);
+	memcpy(dest + 8, comment.data(), comment.size());
+}
+
+struct TiffIfd
+{
+	struct Entry
+	{
+		uint16_t tag;
+		uint16_t type;
+		uint32_t count;
+		std::vector<uint8_t> value;
+	};
+
+	void Add(uint16_t tag, uint16_t type, uint32_t count, void const *value = nullptr)
 	{
-		int field0 = (w >> 2) & 511;
-		int field1 = (w >> 11) & 127;
-		int field2 = (w >> 18) & 127;
-		int field3 = (w >> 25) & 127;
-		if (qmode == 2 && field0 >= 384)
+		Entry entry = { tag, type, count, std::vector<uint8_t>(count * tiff_type_size(type)) };
+		if (value)
+			memcpy(entry.value.data(), value, entry.value.size());
+		entries.push_back(std::move(entry));
+	}
+	void AddShort(uint16_t tag, uint16_t value) { Add(tag, TIFF_TYPE_SHORT, 1, &value); }
+	void AddLong(uint16_t tag, uint32_t value) { Add(tag, TIFF_TYPE_LONG, 1, &value); }
+	void AddString(uint16_t tag, std::string const &value) { Add(tag, TIFF_TYPE_ASCII, value.size() + 1, value.c_str()); }
+
+	std::vector<Entry> entries;
+};
+
+} // namespace
+
+// Fixed part of one configuration's DNG: everything up to the start of the pixel data.
+struct DngTemplate
+{
+	std::vector<uint8_t> header;
+	std::map<uint16_t, uint32_t> value_offset; // where each tag's value lives in the header
+	unsigned int start_x, start_y, width, height;
+	unsigned int bits; // bits per sample as stored in the file
+	size_t row_bytes;
+	// Monochrome images are LinearRaw, with no CFA or colour tags.
+	bool mono;
+	// Lossless JPEG or zstd tiles, when we have them.
+	bool tiled;
+	bool ljpeg;
+	unsigned int tiles_across, tiles_down;
+};
+
+// Compressed tile size. Big enough that the per-tile overheads don't matter, small enough to give every core some.
+static constexpr unsigned int TILE_SIZE = 256;
+
+// Read n samples of a row, starting at sample x (which must start a group of packed pixels), as 16-bit values.
+static void read_samples(uint8_t const *src, BayerFormat const &bayer_format, unsigned int x, unsigned int n,
+						 uint16_t *dest)
+{
+	if (bayer_format.packed && bayer_format.bits == 10)
+	{
+		// Every 4 pixels are their top 8 bits followed by a byte of the low 2 bits of each.
+		for (src += x / 4 * 5; n >= 4; n -= 4, src += 5, dest += 4)
 		{
-			q[1] = field0;
-			q[2] = field1 + 384;
+			dest[0] = (src[0] << 2) | (src[4] & 3);
+			dest[1] = (src[1] << 2) | ((src[4] >> 2) & 3);
+			dest[2] = (src[2] << 2) | ((src[4] >> 4) & 3);
+			dest[3] = (src[3] << 2) | (src[4] >> 6);
 		}
-		else
+	}
+	else if (bayer_format.packed)
+	{
+		// And every 2 pixels of 12-bit data are their top 8 bits, then a byte of the low 4 bits of both.
+		for (src += x / 2 * 3; n >= 2; n -= 2, src += 3, dest += 2)
 		{
-			q[1] = (field1 >= 64) ? field0 : field0 + 64 - field1;
-			q[2] = (field1 >= 64) ? field0 + field1 - 64 : field0;
+			dest[0] = (src[0] << 4) | (src[2] & 15);
+			dest[1] = (src[1] << 4) | (src[2] >> 4);
 		}
-		int p1 = std::max(0, q[1] - 64);
-		if (qmode == 2)
-			p1 = std::min(384, p1);
-		int p2 = std::max(0, q[2] - 64);
-		if (qmode == 2)
-			p2 = std::min(384, p2);
-		q[0] = p1 + field2;
-		q[3] = p2 + field3;
 	}
-	else
+	else if (bayer_format.bits == 8)
 	{
-		int pack0 = (w >> 2) & 32767;
-		int pack1 = (w >> 17) & 32767;
-		q[0] = (pack0 & 15) + 16 * ((pack0 >> 8) / 11);
-		q[1] = (pack0 >> 4) % 176;
-		q[2] = (pack1 & 15) + 16 * ((pack1 >> 8) / 11);
-		q[3] = (pack1 >> 4) % 176;
+		for (unsigned int i = 0; i < n; i++)
+			dest[i] = src[x + i];
 	}
-	d[0] = dequantize(q[0], qmode);
-	d[2] = dequantize(q[1], qmode);
-	d[4] = dequantize(q[2], qmode);
-	d[6] = dequantize(q[3], qmode);
+	else
+		memcpy(dest, src + 2 * x, 2 * n);
 }
 
-static void uncompress(uint8_t const *src, StreamInfo const &info, uint16_t *dest)
+// Lay the IFDs out one after another from "offset", followed by any values too big to live in their entries.
+static void tiff_layout(std::vector<TiffIfd *> const &ifds, DngTemplate &tmpl)
 {
-	unsigned int buf_stride_pixels = (info.width + 7) & ~7;
-	for (unsigned int y = 0; y < info.height; ++y)
+	auto put16 = [&](size_t pos, uint16_t v) { memcpy(&tmpl.header[pos], &v, 2); };
+	auto put32 = [&](size_t pos, uint32_t v) { memcpy(&tmpl.header[pos], &v, 4); };
+
+	size_t ifd_offset = tmpl.header.size();
+	size_t data_offset = ifd_offset;
+	for (TiffIfd *ifd : ifds)
 	{
-		uint16_t *dp = dest + y * buf_stride_pixels;
-		uint8_t const *sp = src + y * info.stride;
-		for (unsigned int x = 0; x < info.width; x+=8)
+		std::sort(ifd->entries.begin(), ifd->entries.end(),
+				  [](TiffIfd::Entry const &a, TiffIfd::Entry const &b) { return a.tag < b.tag; });
+		data_offset += 2 + 12 * ifd->entries.size() + 4;
+	}
+	tmpl.header.resize(data_offset);
+
+	for (unsigned int i = 0; i < ifds.size(); i++)
+	{
+		TiffIfd *ifd = ifds[i];
+		size_t pos = ifd_offset;
+		put16(pos, ifd->entries.size());
+		pos += 2;
+		for (auto const &entry : ifd->entries)
 		{
-			if (COMPRESS_MODE & 1)
-			{
-				uint32_t w0 = 0, w1 = 0;
-				for (int b = 0; b < 4; ++b)
-					w0 |= (*sp++) << (b * 8);
-				for (int b = 0; b < 4; ++b)
-					w1 |= (*sp++) << (b * 8);
-				subBlockFunction(dp, w0);
-				subBlockFunction(dp + 1, w1);
-				for (int i = 0; i < 8; ++i, ++dp)
-					*dp = postprocess(*dp);
-			}
-			else
+			put16(pos, entry.tag);
+			put16(pos + 2, entry.type);
+			put32(pos + 4, entry.count);
+			size_t value_pos = pos + 8;
+			if (entry.value.size() > 4)
 			{
-				for (int i = 0; i < 8; ++i)
-					*dp++ = postprocess((*sp++) << 8);
+				data_offset = (data_offset + 1) & ~1; // values must start on a word boundary
+				put32(value_pos, data_offset);
+				value_pos = data_offset;
+				data_offset += entry.value.size();
+				tmpl.header.resize(data_offset);
 			}
+			memcpy(&tmpl.header[value_pos], entry.value.data(), entry.value.size());
+			tmpl.value_offset[entry.tag] = value_pos;
+			pos += 12;
 		}
+		// These IFDs aren't chained; the Exif IFD is reached through its tag in the first one.
+		put32(pos, 0);
+		ifd_offset = pos + 4;
 	}
 }
 
-// Helper functions from dng.cpp - we need to include them
-// For brevity, I'll reference that these should be copied from dng.cpp
-// In a real implementation, you might want to extract these to a shared header
+static void put_rational(uint8_t *dest, double value)
+{
+	uint32_t rational[2] = { 0, 1 };
+	if (std::isinf(value))
+		rational[0] = 0xffffffff;
+	else if (value > 0)
+	{
+		rational[1] = value < 4000 ? 1000000 : 1;
+		rational[0] = std::lround(value * rational[1]);
+	}
+	memcpy(dest, rational, sizeof(rational));
+}
 
-// Note: The unpack functions and uncompress function need to be included here
-// For now, I'll create a simplified version that references the original functions
-// In practice, you'd want to either:
-// 1. Extract these to a shared header/implementation file
-// 2. Include them directly here
-// 3. Link against the dng.cpp object file
+static void put_srational(uint8_t *dest, double value)
+{
+	int32_t rational[2] = { (int32_t)std::lround(value * 1000000), 1000000 };
+	memcpy(dest, rational, sizeof(rational));
+}
 
-// For this implementation, I'll create a wrapper that can call the original dng_save logic
-// but adapted for memory output. Actually, let me create a complete implementation
-// that includes all the necessary helper functions inline.
+DngWriter::DngWriter(Options const *options, std::string const &cam_model)
+	: options_(options), cam_model_(cam_model), thumbnail_lut_(THUMBNAIL_LUT_SIZE)
+{
+	double exponent = 1.0 / options_->Get().dng_thumbnail_gamma;
+	for (unsigned int i = 0; i < THUMBNAIL_LUT_SIZE; i++)
+		thumbnail_lut_[i] = std::min(255.0, 256.0 * std::pow((i + 0.5) / THUMBNAIL_LUT_SIZE, exponent));
+}
 
-// Since the file is getting long, let me create the encoder structure first,
-// then we can refactor to share code with dng.cpp if needed.
+std::shared_ptr<const DngTemplate> DngWriter::getDngTemplate(StreamInfo const &info, BayerFormat const &bayer_format,
+															 Compression compression)
+{
+	std::lock_guard<std::mutex> lock(dng_template_mutex_);
+	std::shared_ptr<const DngTemplate> &cached = dng_template_[compression];
+	StreamInfo &cached_info = dng_template_info_[compression];
+	if (cached && cached_info.width == info.width && cached_info.height == info.height &&
+		cached_info.stride == info.stride && cached_info.pixel_format == info.pixel_format)
+		return cached;
 
-DngEncoder::DngEncoder(VideoOptions const *options)
-	: Encoder(options), abortEncode_(false), abortOutput_(false), index_(0)
+	auto tmpl = std::make_shared<DngTemplate>();
+
+	// ROI, rounded to whole groups of packed pixels so that rows start and end on byte boundaries, or to whole
+	// blocks of PiSP compressed ones, which are only ever here to be kept as they are.
+	bool pisp = bayer_format.compressed;
+	unsigned int group = pisp ? 8 : bayer_format.packed ? (bayer_format.bits == 10 ? 4 : 2) : 1;
+	tmpl->start_x = (unsigned int)((float)info.width * options_->Get().roi_x) / group * group;
+	tmpl->start_y = (float)info.height * options_->Get().roi_y;
+	tmpl->width = (float)info.width * options_->Get().roi_width;
+	tmpl->height = (float)info.height * options_->Get().roi_height;
+	if (!tmpl->width || tmpl->start_x + tmpl->width > info.width)
+		tmpl->width = info.width - tmpl->start_x;
+	if (!tmpl->height || tmpl->start_y + tmpl->height > info.height)
+		tmpl->height = info.height - tmpl->start_y;
+	tmpl->width = tmpl->width / group * group;
+
+	// Packed data keeps its depth; anything unpacked but deeper than 8 bits is stored in 16-bit samples, as is
+	// anything deeper than 8 bits in zstd tiles. Lossless JPEG is coded at the sensor's own depth. PiSP compressed
+	// data is a byte a pixel.
+	if (pisp)
+		compression = UNCOMPRESSED;
+	tmpl->ljpeg = compression == LJPEG;
+	tmpl->tiled = compression != UNCOMPRESSED;
+	if (pisp)
+		tmpl->bits = 8;
+	else if (tmpl->ljpeg)
+		tmpl->bits = bayer_format.bits;
+	else if (compression == ZSTD)
+		tmpl->bits = bayer_format.bits == 8 ? 8 : 16;
+	else
+		tmpl->bits = bayer_format.packed || bayer_format.bits == 8 ? bayer_format.bits : 16;
+	tmpl->row_bytes = (size_t)tmpl->width * tmpl->bits / 8;
+	tmpl->tiles_across = (tmpl->width + TILE_SIZE - 1) / TILE_SIZE;
+	tmpl->tiles_down = (tmpl->height + TILE_SIZE - 1) / TILE_SIZE;
+	unsigned int num_tiles = tmpl->tiles_across * tmpl->tiles_down;
+
+	TiffIfd raw;
+	TiffIfd exif;
+	bool mono = tmpl->mono = is_mono(bayer_format, options_);
+	const uint16_t cfa_repeat_pattern_dim[] = { 2, 2 };
+	uint16_t black_level_repeat_dim[] = { 2, 2 };
+	if (mono)
+		black_level_repeat_dim[0] = black_level_repeat_dim[1] = 1;
+	uint32_t white = (1 << bayer_format.bits) - 1;
+
+	raw.AddLong(254, 0); // NewSubFileType: main image
+	raw.AddLong(256, tmpl->width);
+	raw.AddLong(257, tmpl->height);
+	raw.AddShort(258, tmpl->bits);
+	if (pisp)
+		raw.AddShort(259, COMPRESSION_PISP);
+	else
+		raw.AddShort(259, tmpl->ljpeg ? 7 : compression == ZSTD ? COMPRESSION_ZSTD_TIFF : 1);
+	raw.AddShort(262, mono ? 34892 : 32803); // LinearRaw or CFA
+	raw.AddString(271, MAKE_STRING);
+	raw.AddString(272, cam_model_.c_str());
+	raw.AddShort(274, 1); // orientation: top left
+	raw.AddShort(277, 1); // samples per pixel
+	if (compression == ZSTD)
+		raw.AddShort(TAG_PREDICTOR, mono ? 2 : PREDICTOR_HORIZONTAL_X2);
+	if (tmpl->tiled)
+	{
+		raw.AddLong(322, TILE_SIZE); // tile width
+		raw.AddLong(323, TILE_SIZE); // tile length
+		raw.Add(TAG_TILE_OFFSETS, TIFF_TYPE_LONG, num_tiles);
+		raw.Add(TAG_TILE_BYTE_COUNTS, TIFF_TYPE_LONG, num_tiles);
+	}
+	else
+	{
+		raw.AddLong(TAG_STRIP_OFFSETS, 0);
+		raw.AddLong(278, tmpl->height); // rows per strip
+		raw.AddLong(279, tmpl->row_bytes * tmpl->height);
+	}
+	raw.AddShort(284, 1); // planar configuration: contiguous
+	raw.AddString(305, "shadowgraph-v3");
+	if (!mono)
+	{
+		raw.Add(33421, TIFF_TYPE_SHORT, 2, cfa_repeat_pattern_dim);
+		raw.Add(33422, TIFF_TYPE_BYTE, 4, bayer_format.order);
+	}
+	raw.AddLong(TAG_EXIF_IFD, 0);
+	raw.Add(50706, TIFF_TYPE_BYTE, 4, "\001\001\000\000");
+	raw.Add(50707, TIFF_TYPE_BYTE, 4, "\001\000\000\000");
+	raw.AddString(50708, (MAKE_STRING " " + cam_model_).c_str());
+	raw.Add(50713, TIFF_TYPE_SHORT, 2, black_level_repeat_dim);
+	raw.Add(TAG_BLACK_LEVEL, TIFF_TYPE_RATIONAL, mono ? 1 : 4);
+	raw.Add(50717, TIFF_TYPE_LONG, 1, &white);
+	if (!mono)
+	{
+		raw.Add(TAG_COLOR_MATRIX1, TIFF_TYPE_SRATIONAL, 9);
+		raw.Add(TAG_AS_SHOT_NEUTRAL, TIFF_TYPE_RATIONAL, 3);
+		raw.AddShort(50778, 21); // calibration illuminant: D65
+	}
+	if (pisp)
+	{
+		const uint16_t pisp_compression[] = { PISP_COMPRESS_MODE, PISP_COMPRESS_OFFSET };
+		raw.Add(TAG_PISP_COMPRESSION, TIFF_TYPE_SHORT, 2, pisp_compression);
+	}
+
+	exif.Add(TAG_EXPOSURE_TIME, TIFF_TYPE_RATIONAL, 1);
+	exif.AddShort(TAG_ISO, 0);
+	exif.Add(TAG_DATE_TIME_ORIGINAL, TIFF_TYPE_ASCII, 20);
+	exif.Add(TAG_SUBJECT_DISTANCE, TIFF_TYPE_RATIONAL, 1);
+	exif.Add(TAG_USER_COMMENT, TIFF_TYPE_UNDEFINED, USER_COMMENT_SIZE);
+
+	// Little-endian TIFF header, first IFD straight after it.
+	tmpl->header = { 'I', 'I', 42, 0, 8, 0, 0, 0 };
+	tiff_layout({ &raw, &exif }, *tmpl);
+	size_t exif_offset = 8 + 2 + 12 * raw.entries.size() + 4;
+	tmpl->header.resize((tmpl->header.size() + 15) & ~15); // start the pixel data on a 16-byte boundary
+	uint32_t strip_offset = tmpl->header.size(), exif_ifd = exif_offset;
+	if (!tmpl->tiled) // tile offsets and sizes are filled in per frame
+		memcpy(&tmpl->header[tmpl->value_offset[TAG_STRIP_OFFSETS]], &strip_offset, 4);
+	memcpy(&tmpl->header[tmpl->value_offset[TAG_EXIF_IFD]], &exif_ifd, 4);
+
+	LOG(2, "DngEncoder: built fast DNG template, " << tmpl->header.size() << " byte header, " << tmpl->width << "x"
+												   << tmpl->height << " " << tmpl->bits << "-bit"
+												   << (mono ? " mono" : "") << (tmpl->ljpeg ? ", lossless JPEG" : "")
+												   << (compression == ZSTD ? ", zstd" : "")
+												   << (pisp ? ", PiSP compressed" : ""));
+	cached_info = info;
+	cached = tmpl;
+	return cached;
+}
+
+void DngWriter::encodeFast(uint8_t const *mem, StreamInfo const &info, ControlList const &metadata,
+						   Metadata const &post_process_metadata, BayerFormat const &bayer_format,
+						   Compression compression, uint8_t *&encoded_buffer, size_t &buffer_len)
 {
-	options_ = options;
-	output_thread_ = std::thread(&DngEncoder::outputThread, this);
-	for (int i = 0; i < NUM_ENC_THREADS; i++)
-		encode_thread_[i] = std::thread(std::bind(&DngEncoder::encodeThread, this, i));
-	LOG(2, "Opened DngEncoder");
+	std::shared_ptr<const DngTemplate> tmpl = getDngTemplate(info, bayer_format, compression);
+	DngFrameParams params = get_frame_params(metadata, bayer_format, tmpl->mono, false, false);
+
+	TileSet tiles;
+	if (tmpl->tiled)
+		encodeTiles(mem, info, bayer_format, *tmpl, tiles);
+
+	size_t header_size = tmpl->header.size();
+	size_t size = header_size + tmpl->row_bytes * tmpl->height;
+	if (tmpl->tiled)
+	{
+		size = header_size;
+		for (auto const &tile : tiles)
+			size += tile.size();
+	}
+	uint8_t *buf = buffer_pool_.Acquire(BufferPool::Key(info, SLOT_OUTPUT), size);
+
+	memcpy(buf, tmpl->header.data(), header_size);
+	auto value = [&](uint16_t tag) { return buf + tmpl->value_offset.at(tag); };
+	for (int i = 0; i < (tmpl->mono ? 1 : 4); i++)
+		put_rational(value(TAG_BLACK_LEVEL) + 8 * i, params.black_levels[i]);
+	if (!tmpl->mono)
+	{
+		for (int i = 0; i < 9; i++)
+			put_srational(value(TAG_COLOR_MATRIX1) + 8 * i, params.cam_xyz.m[i]);
+		for (int i = 0; i < 3; i++)
+			put_rational(value(TAG_AS_SHOT_NEUTRAL) + 8 * i, params.neutral[i]);
+	}
+	put_rational(value(TAG_EXPOSURE_TIME), params.exp_time);
+	memcpy(value(TAG_ISO), &params.iso, 2);
+	put_rational(value(TAG_SUBJECT_DISTANCE), params.subject_distance.value_or(0));
+	time_t t;
+	time(&t);
+	strftime((char *)value(TAG_DATE_TIME_ORIGINAL), 20, "%Y:%m:%d %H:%M:%S", localtime(&t));
+	make_user_comment(post_process_metadata, value(TAG_USER_COMMENT));
+
+	if (tmpl->tiled)
+	{
+		uint8_t *dest = buf + header_size;
+		for (unsigned int i = 0; i < tiles.size(); i++)
+		{
+			uint32_t offset = dest - buf, count = tiles[i].size();
+			memcpy(value(TAG_TILE_OFFSETS) + 4 * i, &offset, 4);
+			memcpy(value(TAG_TILE_BYTE_COUNTS) + 4 * i, &count, 4);
+			memcpy(dest, tiles[i].data(), count);
+			dest += count;
+		}
+		releaseTiles(std::move(tiles));
+		encoded_buffer = buf;
+		buffer_len = size;
+		return;
+	}
+
+	uint8_t const *src = mem + (size_t)tmpl->start_y * info.stride;
+	uint8_t *dest = buf + header_size;
+	size_t src_x_offset = (size_t)tmpl->start_x * (bayer_format.packed ? bayer_format.bits : tmpl->bits) / 8;
+	for (unsigned int y = 0; y < tmpl->height; y++, src += info.stride, dest += tmpl->row_bytes)
+	{
+		if (!bayer_format.packed)
+			memcpy(dest, src + src_x_offset, tmpl->row_bytes);
+		else if (bayer_format.bits == 10)
+			repack_row_10bit(src + src_x_offset, dest, tmpl->width);
+		else
+			repack_row_12bit(src + src_x_offset, dest, tmpl->width);
+	}
+
+	encoded_buffer = buf;
+	buffer_len = size;
 }
 
-DngEncoder::~DngEncoder()
+#if ZSTD_PRESENT
+// Compress a tile of samples as TIFF wants it with a horizontal differencing predictor: each sample replaced by its
+// difference from the one "distance" to its left (modulo the sample size), in little-endian samples of "bits" bits.
+// The samples are overwritten with the differences.
+static void zstd_encode_tile(uint16_t *samples, unsigned int width, unsigned int height, unsigned int bits,
+							 unsigned int distance, int level, std::vector<uint8_t> &out)
 {
-	abortEncode_ = true;
-	for (int i = 0; i < NUM_ENC_THREADS; i++)
-		encode_thread_[i].join();
-	abortOutput_ = true;
-	output_thread_.join();
-	LOG(2, "DngEncoder closed");
+	thread_local std::unique_ptr<ZSTD_CCtx, size_t (*)(ZSTD_CCtx *)> cctx(ZSTD_createCCtx(), ZSTD_freeCCtx);
+	if (!cctx)
+		throw std::runtime_error("failed to create zstd context");
+
+	for (unsigned int y = 0; y < height; y++)
+	{
+		uint16_t *row = samples + y * width;
+		for (unsigned int x = width - 1; x >= distance; x--)
+			row[x] -= row[x - distance];
+	}
+	size_t size = (size_t)width * height * 2;
+	void const *src = samples;
+	thread_local std::vector<uint8_t> bytes;
+	if (bits == 8)
+	{
+		size /= 2;
+		bytes.resize(size);
+		for (size_t i = 0; i < size; i++)
+			bytes[i] = samples[i];
+		src = bytes.data();
+	}
+
+	out.resize(ZSTD_compressBound(size));
+	size_t ret = ZSTD_compressCCtx(cctx.get(), out.data(), out.size(), src, size, level);
+	if (ZSTD_isError(ret))
+		throw std::runtime_error(std::string("zstd failed: ") + ZSTD_getErrorName(ret));
+	out.resize(ret);
 }
+#endif
 
-void DngEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us, Metadata const &post_process_metadata, libcamera::ControlList const &control_list_metadata)
+void DngWriter::encodeTiles(uint8_t const *mem, StreamInfo const &info, BayerFormat const &bayer_format,
+							DngTemplate const &tmpl, TileSet &tiles)
 {
-	std::lock_guard<std::mutex> lock(encode_mutex_);
-	EncodeItem item = { mem, info, timestamp_us, index_++, post_process_metadata, control_list_metadata };
-	encode_queue_.push(item);
-	encode_cond_var_.notify_all();
+	{
+		std::lock_guard<std::mutex> lock(tile_sets_mutex_);
+		if (!free_tile_sets_.empty())
+		{
+			tiles = std::move(free_tile_sets_.back());
+			free_tile_sets_.pop_back();
+		}
+	}
+	tiles.resize(tmpl.tiles_across * tmpl.tiles_down);
+
+	// CFA rows are coded as pairs of samples, so that each is predicted from the last one of the same colour. Tiles
+	// hanging over the edge of the image are padded out with copies of the nearest samples of the same colour.
+	unsigned int components = tmpl.mono ? 1 : 2;
+#if ZSTD_PRESENT
+	int zstd_level = options_->Get().dng_zstd_level;
+#endif
+	ParallelFor(tiles.size(), [&](unsigned int i) {
+		thread_local std::vector<uint16_t> samples;
+		samples.resize(TILE_SIZE * TILE_SIZE);
+		unsigned int x0 = (i % tmpl.tiles_across) * TILE_SIZE, y0 = (i / tmpl.tiles_across) * TILE_SIZE;
+		unsigned int w = std::min(TILE_SIZE, tmpl.width - x0), h = std::min(TILE_SIZE, tmpl.height - y0);
+
+		for (unsigned int y = 0; y < TILE_SIZE; y++)
+		{
+			uint16_t *row = &samples[y * TILE_SIZE];
+			if (y >= h)
+			{
+				unsigned int from = y >= components ? y - components : y - 1;
+				memcpy(row, &samples[from * TILE_SIZE], TILE_SIZE * 2);
+				continue;
+			}
+			read_samples(mem + (size_t)(tmpl.start_y + y0 + y) * info.stride, bayer_format, tmpl.start_x + x0, w, row);
+			for (unsigned int x = w; x < TILE_SIZE; x++)
+				row[x] = row[x >= components ? x - components : x - 1];
+		}
+
+		if (tmpl.ljpeg)
+			ljpeg_encode_tile(samples.data(), TILE_SIZE, TILE_SIZE, tmpl.bits, components, tiles[i]);
+		else
+		{
+#if ZSTD_PRESENT
+			zstd_encode_tile(samples.data(), TILE_SIZE, TILE_SIZE, tmpl.bits, components, zstd_level, tiles[i]);
+#else
+			throw std::runtime_error("zstd DNG compression is not available in this build");
+#endif
+		}
+	});
 }
 
-// This is a large function - we'll need to adapt the dng_save logic
-// For now, let me create a structure that calls the core DNG writing logic
-// but outputs to memory instead of a file
+void DngWriter::releaseTiles(TileSet &&tiles)
+{
+	std::lock_guard<std::mutex> lock(tile_sets_mutex_);
+	free_tile_sets_.push_back(std::move(tiles));
+}
 
-void DngEncoder::encodeDNG(EncodeItem &item, uint8_t *&encoded_buffer, size_t &buffer_len)
+std::vector<PixelFormat> DngWriter::Formats()
 {
-	LOG(1, "Encoding DNG to memory buffer");
-	LOG(1, "Pixel format: " << item.info.pixel_format.toString());
+	std::vector<PixelFormat> formats;
+	for (auto const &[format, bayer_format] : bayer_formats)
+		formats.push_back(format);
+	return formats;
+}
+
+unsigned int DngWriter::RowBytes(PixelFormat const &format, unsigned int width)
+{
+	auto it = bayer_formats.find(format);
+	if (it == bayer_formats.end())
+		throw std::runtime_error("unsupported Bayer format");
+
+	BayerFormat const &bayer_format = it->second;
+	// Compressed rows are one byte a pixel, in whole 8-pixel blocks.
+	if (bayer_format.compressed)
+		return (width + 7) & ~7;
+	else if (bayer_format.packed)
+		return bayer_format.bits == 10 ? (width + 3) / 4 * 5 : (width + 1) / 2 * 3;
+	return bayer_format.bits == 8 ? width : 2 * width;
+}
+
+void DngWriter::Encode(void const *frame, StreamInfo const &info, ControlList const &metadata,
+					   Metadata const &post_process_metadata, uint8_t *&encoded_buffer, size_t &buffer_len,
+					   bool degraded)
+{
+	uint8_t const *mem = (uint8_t const *)frame;
+	LOG(2, "Encoding DNG to memory buffer");
+	LOG(2, "Pixel format: " << info.pixel_format.toString());
 	
 	// Check the Bayer format
-	auto it = bayer_formats.find(item.info.pixel_format);
+	auto it = bayer_formats.find(info.pixel_format);
 	if (it == bayer_formats.end())
 		throw std::runtime_error("unsupported Bayer format");
 	
 	BayerFormat const &bayer_format = it->second;
 	bool force8bit = options_->Get().force_8_bit;
 	bool force10bit = options_->Get().force_10_bit;
+
+	// The fast writer handles everything except bit-depth reduction, and PiSP compressed input unless that is to be
+	// kept as it is, and is the only one that does lossless JPEG and zstd.
+	Compression compression = UNCOMPRESSED;
+	if (!degraded && options_->Get().dng_compression == "ljpeg")
+		compression = LJPEG;
+	else if (!degraded && options_->Get().dng_compression == "zstd")
+		compression = ZSTD;
+	bool keep_pisp = options_->Get().dng_compression == "pisp" && bayer_format.compressed;
+	bool fast = options_->Get().dng_fast || compression != UNCOMPRESSED || keep_pisp || degraded;
+	if (fast && (!bayer_format.compressed || keep_pisp) && !force8bit && !force10bit)
+	{
+		encodeFast(mem, info, metadata, post_process_metadata, bayer_format, compression, encoded_buffer, buffer_len);
+		return;
+	}
 	
 	// Decompression will require a buffer that's 8 pixels aligned.
-	unsigned int buf_stride_pixels = item.info.width;
+	unsigned int buf_stride_pixels = info.width;
 	unsigned int buf_stride_pixels_padded = (buf_stride_pixels + 7) & ~7;
 	double bytesPerPixel = (double)bayer_format.bits / 8.0;
 	int bitsPerPixel = bayer_format.bits;
@@ -589,14 +1014,20 @@ void DngEncoder::encodeDNG(EncodeItem &item, uint8_t *&encoded_buffer, size_t &b
 	} else if (force10bit) {
 		bytesPerPixel = 1.25;
 	}
-	std::vector<uint8_t> buf8bit(int(item.info.width * bytesPerPixel * item.info.height));
-	std::vector<uint16_t> buf16Bit(buf_stride_pixels_padded * item.info.height);
+	// Scratch space comes from the pool; unpacking writes every byte we later read, so it needn't be cleared.
+	BufferPool::Ptr buf8bit_mem = buffer_pool_.AcquirePtr(BufferPool::Key(info, SLOT_8BIT),
+														   size_t(info.width * bytesPerPixel * info.height));
+	BufferPool::Ptr buf16bit_mem = buffer_pool_.AcquirePtr(BufferPool::Key(info, SLOT_16BIT),
+														   buf_stride_pixels_padded * info.height * sizeof(uint16_t));
+	uint8_t *buf8bit = buf8bit_mem.get();
+	uint16_t *buf16Bit = (uint16_t *)buf16bit_mem.get();
 	
 	// Unpack/process the raw data
 	if (bayer_format.compressed)
 	{
-		uncompress((uint8_t const*)item.mem, item.info, &buf16Bit[0]);
+		uncompress(mem, info, &buf16Bit[0]);
 		buf_stride_pixels = buf_stride_pixels_padded;
+		memset(buf8bit, 0, size_t(info.width * bytesPerPixel * info.height));
 	}
 	else if (bayer_format.packed)
 	{
@@ -609,100 +1040,36 @@ void DngEncoder::encodeDNG(EncodeItem &item, uint8_t *&encoded_buffer, size_t &b
 		switch (bayer_format.bits)
 		{
 		case 10:
-			unpack_10bit((uint8_t const*)item.mem, item.info, &buf8bit[0], &buf16Bit[0]);
+			unpack_10bit(mem, info, &buf8bit[0], &buf16Bit[0]);
 			break;
 		case 12:
 			if(force8bit) {
-				unpack_12bit_to_8bit((uint8_t const*)item.mem, item.info, &buf8bit[0], &buf16Bit[0]);
+				unpack_12bit_to_8bit(mem, info, &buf8bit[0], &buf16Bit[0]);
 			} else if (force10bit) {
-				unpack_12bit_to_10bit((uint8_t const*)item.mem, item.info, &buf8bit[0], &buf16Bit[0]);
+				unpack_12bit_to_10bit(mem, info, &buf8bit[0], &buf16Bit[0]);
 			} else {
-				unpack_12bit((uint8_t const*)item.mem, item.info, &buf8bit[0], &buf16Bit[0]);
+				unpack_12bit(mem, info, &buf8bit[0], &buf16Bit[0]);
 			}
 			break;
 		}
 	}
 	else {
 		if( bitsPerPixel == 8 ) {
-			copy_8bit((uint8_t const*)item.mem, item.info, &buf8bit[0], &buf16Bit[0]);
+			copy_8bit(mem, info, &buf8bit[0], &buf16Bit[0]);
 		} else {
-			unpack_16bit((uint8_t const*)item.mem, item.info, &buf16Bit[0]);
-		}
-	}
-	
-	// Calculate black levels
-	float black = 4096 * (1 << bayer_format.bits) / 65536.0;
-	if(force8bit) {
-		black = 16 + 12;
-	} else if (force10bit) {
-		black = 64 + 4;
-	}
-	float black_levels[] = { black, black, black, black };
-	auto bl = item.control_list_metadata.get(libcamera::controls::SensorBlackLevels);
-	if (bl)
-	{
-		for (int i = 0; i < 4; i++)
-		{
-			int j = bayer_format.order[i];
-			j = j == 0 ? 0 : (j == 2 ? 3 : 1 + !!bayer_format.order[i ^ 1]);
-			black_levels[j] = (*bl)[i] * (1 << bayer_format.bits) / 65536.0;
+			unpack_16bit(mem, info, &buf16Bit[0]);
+			memset(buf8bit, 0, size_t(info.width * bytesPerPixel * info.height));
 		}
 	}
-	else
-		LOG_ERROR("WARNING: no black level found, using default");
-	
-	// Get exposure time
-	auto exp = item.control_list_metadata.get(libcamera::controls::ExposureTime);
-	float exp_time = 10000;
-	if (exp)
-		exp_time = *exp;
-	else
-		LOG_ERROR("WARNING: default to exposure time of " << exp_time << "us");
-	exp_time /= 1e6;
-	
-	// Get ISO
-	auto ag = item.control_list_metadata.get(libcamera::controls::AnalogueGain);
-	uint16_t iso = 100;
-	if (ag)
-		iso = *ag * 100.0;
-	else
-		LOG_ERROR("WARNING: default to ISO value of " << iso);
-	
-	// White balance
-	float NEUTRAL[] = { 1, 1, 1 };
-	Matrix WB_GAINS(1, 1, 1);
-	auto cg = item.control_list_metadata.get(libcamera::controls::ColourGains);
-	if (cg)
-	{
-		NEUTRAL[0] = 1.0 / (*cg)[0];
-		NEUTRAL[2] = 1.0 / (*cg)[1];
-		WB_GAINS = Matrix((*cg)[0], 1, (*cg)[1]);
-	}
-	
-	// CCM
-	Matrix CCM(1.90255, -0.77478, -0.12777,
-			   -0.31338, 1.88197, -0.56858,
-			   -0.06001, -0.61785, 1.67786);
-	auto ccm = item.control_list_metadata.get(libcamera::controls::ColourCorrectionMatrix);
-	if (ccm)
-	{
-		CCM = Matrix((*ccm)[0], (*ccm)[1], (*ccm)[2], (*ccm)[3], (*ccm)[4], (*ccm)[5], (*ccm)[6], (*ccm)[7], (*ccm)[8]);
-	}
-	else
-		LOG_ERROR("WARNING: no CCM metadata found");
 	
-	// Color matrix
-	Matrix RGB2XYZ(0.4124564, 0.3575761, 0.1804375,
-				   0.2126729, 0.7151522, 0.0721750,
-				   0.0193339, 0.1191920, 0.9503041);
-	Matrix CAM_XYZ = (RGB2XYZ * CCM * WB_GAINS).Inv();
+	bool mono = is_mono(bayer_format, options_);
+	DngFrameParams params = get_frame_params(metadata, bayer_format, mono, force8bit, force10bit);
 	
 	// Initialize memory buffer for TIFF
-	TiffMemoryBuffer mem_buffer = { nullptr, 0, 0, 0 };
-	mem_buffer.capacity = item.info.width * item.info.height * 3; // Initial estimate
-	mem_buffer.data = (uint8_t *)malloc(mem_buffer.capacity);
-	if (!mem_buffer.data)
-		throw std::runtime_error("failed to allocate DNG memory buffer");
+	TiffMemoryBuffer mem_buffer = { &buffer_pool_, nullptr, 0, 0, 0 };
+	mem_buffer.data = buffer_pool_.Acquire(BufferPool::Key(info, SLOT_OUTPUT),
+										   info.width * info.height * 3); // Initial estimate
+	mem_buffer.capacity = buffer_pool_.Capacity(mem_buffer.data);
 	mem_buffer.size = 0;
 	mem_buffer.position = 0;
 	
@@ -718,24 +1085,23 @@ void DngEncoder::encodeDNG(EncodeItem &item, uint8_t *&encoded_buffer, size_t &b
 			throw std::runtime_error("could not open TIFF for memory writing");
 		
 		short cfa_repeat_pattern_dim[] = { 2, 2 };
-		if(options_->Get().monochrome) {
-			cfa_repeat_pattern_dim[0] = 1;
-			cfa_repeat_pattern_dim[1] = 1;
-		}
 		uint32_t white = (1 << bayer_format.bits) - 1;
 		toff_t offset_subifd = 0, offset_exififd = 0;
-		std::string unique_model = std::string(MAKE_STRING " shadowgraph-v3");
+		std::string unique_model = std::string(MAKE_STRING " ") + cam_model_;
 		
-		unsigned int thumbnailSizeMultiplier = 3;
 		// Thumbnail IFD
+		unsigned int thumbStep = options_->Get().dng_thumbnail;
+		unsigned int thumbWidth = std::max(info.width / thumbStep, 1u);
+		unsigned int thumbHeight = std::max(info.height / thumbStep, 1u);
 		TIFFSetField(tif, TIFFTAG_SUBFILETYPE, 1);
-		TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, item.info.width >> thumbnailSizeMultiplier);
-		TIFFSetField(tif, TIFFTAG_IMAGELENGTH, item.info.height >> thumbnailSizeMultiplier);
+		TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, thumbWidth);
+		TIFFSetField(tif, TIFFTAG_IMAGELENGTH, thumbHeight);
+		TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, thumbHeight);
 		TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, 8);
 		TIFFSetField(tif, TIFFTAG_COMPRESSION, COMPRESSION_NONE);
 		TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
 		TIFFSetField(tif, TIFFTAG_MAKE, MAKE_STRING);
-		TIFFSetField(tif, TIFFTAG_MODEL, "shadowgraph-v3");
+		TIFFSetField(tif, TIFFTAG_MODEL, cam_model_.c_str());
 		TIFFSetField(tif, TIFFTAG_DNGVERSION, "\001\001\000\000");
 		TIFFSetField(tif, TIFFTAG_DNGBACKWARDVERSION, "\001\000\000\000");
 		TIFFSetField(tif, TIFFTAG_UNIQUECAMERAMODEL, unique_model.c_str());
@@ -743,35 +1109,32 @@ void DngEncoder::encodeDNG(EncodeItem &item, uint8_t *&encoded_buffer, size_t &b
 		TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, 3);
 		TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
 		TIFFSetField(tif, TIFFTAG_SOFTWARE, "shadowgraph-v3");
-		TIFFSetField(tif, TIFFTAG_COLORMATRIX1, 9, CAM_XYZ.m);
-		TIFFSetField(tif, TIFFTAG_ASSHOTNEUTRAL, 3, NEUTRAL);
-		TIFFSetField(tif, TIFFTAG_CALIBRATIONILLUMINANT1, 21);
+		if (!mono)
+		{
+			TIFFSetField(tif, TIFFTAG_COLORMATRIX1, 9, params.cam_xyz.m);
+			TIFFSetField(tif, TIFFTAG_ASSHOTNEUTRAL, 3, params.neutral);
+			TIFFSetField(tif, TIFFTAG_CALIBRATIONILLUMINANT1, 21);
+		}
 		TIFFSetField(tif, TIFFTAG_SUBIFD, 1, &offset_subifd);
 		TIFFSetField(tif, TIFFTAG_EXIFIFD, offset_exififd);
 		
-		// Write thumbnail
-		std::vector<uint8_t> thumb_buf((item.info.width >> thumbnailSizeMultiplier) * 3);
-		for (unsigned int y = 0; y < (item.info.height >> thumbnailSizeMultiplier); y++)
-		{
-			for (unsigned int x = 0; x < (item.info.width >> thumbnailSizeMultiplier); x++)
-			{
-				unsigned int off = (y * buf_stride_pixels + x) << thumbnailSizeMultiplier;
-				uint32_t grey = buf16Bit[off] + buf16Bit[off + 1] + buf16Bit[off + buf_stride_pixels] + buf16Bit[off + buf_stride_pixels + 1];
-				grey = (grey << 14) >> bayer_format.bits;
-				grey = sqrt((double)grey);
-				thumb_buf[3 * x] = thumb_buf[3 * x + 1] = thumb_buf[3 * x + 2] = grey;
-			}
-			if (TIFFWriteScanline(tif, &thumb_buf[0], y, 0) != 1)
-				throw std::runtime_error("error writing DNG thumbnail data");
-		}
+		// Write the thumbnail in one strip. Each pixel is a 2x2 quad from the top left of its block, its sum (of
+		// bits + 2 bits) scaled to index the 12-bit LUT, which applies the gamma.
+		std::vector<uint8_t> thumb_buf(thumbWidth * thumbHeight * 3);
+		int thumbShift = (int)bayer_format.bits + 2 - 12;
+		for (unsigned int y = 0; y < thumbHeight; y++)
+			thumbnail_row(&buf16Bit[y * thumbStep * buf_stride_pixels], buf_stride_pixels,
+						  &thumb_buf[y * thumbWidth * 3], thumbWidth, thumbStep, thumbShift, thumbnail_lut_.data());
+		if (TIFFWriteEncodedStrip(tif, 0, thumb_buf.data(), thumb_buf.size()) < 0)
+			throw std::runtime_error("error writing DNG thumbnail data");
 		
 		TIFFWriteDirectory(tif);
 		
 		// ROI calculations
-		unsigned int startX = (float)item.info.width * options_->Get().roi_x;
-		unsigned int startY = (float)item.info.height * options_->Get().roi_y;
-		unsigned int width = (float)item.info.width * options_->Get().roi_width;
-		unsigned int height = (float)item.info.height * options_->Get().roi_height;
+		unsigned int startX = (float)info.width * options_->Get().roi_x;
+		unsigned int startY = (float)info.height * options_->Get().roi_y;
+		unsigned int width = (float)info.width * options_->Get().roi_width;
+		unsigned int height = (float)info.height * options_->Get().roi_height;
 		
 		if(bitsPerPixel == 10) {
 			startX -= startX % 4;
@@ -780,21 +1143,21 @@ void DngEncoder::encodeDNG(EncodeItem &item, uint8_t *&encoded_buffer, size_t &b
 		}
 		
 		if(width == 0) {
-			width = item.info.width - startX;
+			width = info.width - startX;
 		}
 		if(height == 0) {
-			height = item.info.height;
+			height = info.height;
 		}
 		
 		unsigned int endX = startX + width;
 		unsigned int endY = startY + height;
 		
-		if(endX > item.info.width) {
-			endX = item.info.width;
+		if(endX > info.width) {
+			endX = info.width;
 			width = endX - startX;
 		}
-		if(endY > item.info.height) {
-			endY = item.info.height;
+		if(endY > info.height) {
+			endY = info.height;
 			height = endY - startY;
 		}
 		
@@ -803,37 +1166,32 @@ void DngEncoder::encodeDNG(EncodeItem &item, uint8_t *&encoded_buffer, size_t &b
 		TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, width);
 		TIFFSetField(tif, TIFFTAG_IMAGELENGTH, height);
 		TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, bitsPerPixel);
-		if(options_->Get().monochrome) {
-			TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
-		} else {
-			TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_CFA);
-		}
 		TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, 1);
 		TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
-		TIFFSetField(tif, TIFFTAG_CFAREPEATPATTERNDIM, cfa_repeat_pattern_dim);
+		if (mono)
+			TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_LINEARRAW);
+		else
+		{
+			TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_CFA);
+			TIFFSetField(tif, TIFFTAG_CFAREPEATPATTERNDIM, cfa_repeat_pattern_dim);
 #if TIFFLIB_VERSION >= 20201219
-		if(options_->Get().monochrome) {
-			TIFFSetField(tif, TIFFTAG_CFAPATTERN, 4, TIFF_MONO);
-		} else {
 			TIFFSetField(tif, TIFFTAG_CFAPATTERN, 4, bayer_format.order);
-		}
 #else
-		if(options_->Get().monochrome) {
-			TIFFSetField(tif, TIFFTAG_CFAPATTERN, TIFF_MONO);
-		} else {
 			TIFFSetField(tif, TIFFTAG_CFAPATTERN, bayer_format.order);
-		}
 #endif
+		}
 		TIFFSetField(tif, TIFFTAG_WHITELEVEL, 1, &white);
-		const uint16_t black_level_repeat_dim[] = { 2, 2 };
+		uint16_t black_level_repeat_dim[] = { 2, 2 };
+		if (mono)
+			black_level_repeat_dim[0] = black_level_repeat_dim[1] = 1;
 		TIFFSetField(tif, TIFFTAG_BLACKLEVELREPEATDIM, &black_level_repeat_dim);
-		TIFFSetField(tif, TIFFTAG_BLACKLEVEL, 4, &black_levels);
+		TIFFSetField(tif, TIFFTAG_BLACKLEVEL, mono ? 1 : 4, &params.black_levels);
 		
 		// Write main image data
 		unsigned int rowNum = 0;
 		for (unsigned int y = startY; y < endY; y++)
 		{
-			unsigned int rowStartLocation = item.info.width * bytesPerPixel * y;
+			unsigned int rowStartLocation = info.width * bytesPerPixel * y;
 			unsigned int roiOffset = startX * bytesPerPixel;
 			if (TIFFWriteScanline(tif, &buf8bit[rowStartLocation + roiOffset], rowNum, 0) != 1)
 				throw std::runtime_error("error writing DNG image data");
@@ -852,15 +1210,14 @@ void DngEncoder::encodeDNG(EncodeItem &item, uint8_t *&encoded_buffer, size_t &b
 		char time_str[32];
 		strftime(time_str, 32, "%Y:%m:%d %H:%M:%S", time_info);
 		TIFFSetField(tif, EXIFTAG_DATETIMEORIGINAL, time_str);
-		TIFFSetField(tif, EXIFTAG_ISOSPEEDRATINGS, 1, &iso);
-		TIFFSetField(tif, EXIFTAG_EXPOSURETIME, exp_time);
+		TIFFSetField(tif, EXIFTAG_ISOSPEEDRATINGS, 1, &params.iso);
+		TIFFSetField(tif, EXIFTAG_EXPOSURETIME, params.exp_time);
 		
-		auto lp = item.control_list_metadata.get(libcamera::controls::LensPosition);
-		if (lp)
-		{
-			double dist = (*lp > 0.0) ? (1.0 / *lp) : std::numeric_limits<double>::infinity();
-			TIFFSetField(tif, EXIFTAG_SUBJECTDISTANCE, dist);
-		}
+		if (params.subject_distance)
+			TIFFSetField(tif, EXIFTAG_SUBJECTDISTANCE, *params.subject_distance);
+		uint8_t user_comment[USER_COMMENT_SIZE];
+		make_user_comment(post_process_metadata, user_comment);
+		TIFFSetField(tif, EXIFTAG_USERCOMMENT, (uint16_t)USER_COMMENT_SIZE, user_comment);
 		
 		TIFFCheckpointDirectory(tif);
 		offset_exififd = TIFFCurrentDirOffset(tif);
@@ -883,105 +1240,46 @@ void DngEncoder::encodeDNG(EncodeItem &item, uint8_t *&encoded_buffer, size_t &b
 	}
 	catch (std::exception const &e)
 	{
-		if (mem_buffer.data)
-			free(mem_buffer.data);
 		if (tif)
 			TIFFClose(tif);
+		buffer_pool_.Release(mem_buffer.data);
 		throw;
 	}
 }
 
-void DngEncoder::encodeThread(int num)
+DngEncoder::DngEncoder(VideoOptions const *options)
+	: Encoder(options), writer_(options), pool_(options, 2, "DngEncoder")
 {
-	std::chrono::duration<double> encode_time(0);
-	uint32_t frames = 0;
-	
-	EncodeItem encode_item;
-	while (true)
-	{
-		{
-			std::unique_lock<std::mutex> lock(encode_mutex_);
-			while (true)
-			{
-				using namespace std::chrono_literals;
-				if (abortEncode_ && encode_queue_.empty())
-				{
-					if (frames)
-						LOG(2, "Encode " << frames << " frames, average time " << encode_time.count() * 1000 / frames
-										 << "ms");
-					return;
-				}
-				if (!encode_queue_.empty())
-				{
-					encode_item = encode_queue_.front();
-					encode_queue_.pop();
-					break;
-				}
-				else
-					encode_cond_var_.wait_for(lock, 200ms);
-			}
-		}
-		
-		// Encode the buffer
-		uint8_t *encoded_buffer = nullptr;
-		size_t buffer_len = 0;
-		auto start_time = std::chrono::high_resolution_clock::now();
-		try
-		{
-			encodeDNG(encode_item, encoded_buffer, buffer_len);
-		}
-		catch (std::exception const &e)
-		{
-			LOG_ERROR("DNG encoding error: " << e.what());
-			// Continue to next frame
-			continue;
-		}
-		encode_time += (std::chrono::high_resolution_clock::now() - start_time);
-		frames++;
-		
-		// Push encoded buffer to output queue
-		OutputItem output_item = { encoded_buffer, buffer_len, encode_item.timestamp_us, encode_item.index };
-		std::lock_guard<std::mutex> lock(output_mutex_);
-		output_queue_[num].push(output_item);
-		output_cond_var_.notify_one();
-	}
+	pool_.Start(
+		[this](unsigned int, EncodeItem &item, uint8_t *&encoded_buffer, size_t &buffer_len) {
+			writer_.Encode(item.mem, item.info, *item.control_list_metadata, item.metadata, encoded_buffer,
+						   buffer_len, item.degraded);
+		},
+		[this](EncodePool::OutputItem &item) { outputItem(item); },
+		[this](void *mem) { input_done_callback_(mem); });
+	LOG(2, "Opened DngEncoder");
 }
 
-void DngEncoder::outputThread()
+DngEncoder::~DngEncoder()
 {
-	OutputItem item;
-	uint64_t index = 0;
-	while (true)
-	{
-		{
-			std::unique_lock<std::mutex> lock(output_mutex_);
-			while (true)
-			{
-				using namespace std::chrono_literals;
-				bool abort = abortOutput_ ? true : false;
-				for (auto &q : output_queue_)
-				{
-					if (abort && !q.empty())
-						abort = false;
-					
-					if (!q.empty() && q.front().index == index)
-					{
-						item = q.front();
-						q.pop();
-						goto got_item;
-					}
-				}
-				if (abort)
-					return;
-				
-				output_cond_var_.wait_for(lock, 200ms);
-			}
-		}
-	got_item:
-		input_done_callback_(nullptr);
-		
-		output_ready_callback_(item.mem, item.bytes_used, item.timestamp_us, true);
-		free(item.mem);
-		index++;
-	}
+	pool_.Stop();
+	LOG(2, "DngEncoder closed");
+}
+
+void DngEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us, Metadata const &post_process_metadata, libcamera::ControlList const &control_list_metadata)
+{
+	pool_.Push(mem, info, timestamp_us, post_process_metadata, control_list_metadata);
+}
+
+void DngEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us,
+							  CompletedRequestPtr const &completed_request)
+{
+	pool_.Push(mem, info, timestamp_us, completed_request);
+}
+
+void DngEncoder::outputItem(EncodePool::OutputItem &item)
+{
+	// Frames that were dropped or failed come through too, with no buffer, so the output can keep count.
+	output_ready_callback_(item.mem, item.bytes_used, item.timestamp_us, true);
+	writer_.Release((uint8_t *)item.mem);
 }
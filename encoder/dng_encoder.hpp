@@ -7,16 +7,72 @@
 
 #pragma once
 
-#include <condition_variable>
+#include <memory>
 #include <mutex>
-#include <queue>
-#include <thread>
+#include <string>
+#include <vector>
 
 #include <libcamera/controls.h>
 
+#include "buffer_pool.hpp"
+#include "encode_pool.hpp"
 #include "encoder.hpp"
 #include "core/metadata.hpp"
 
+struct BayerFormat;
+struct DngTemplate;
+
+// Makes complete DNG files in memory from raw frames. The DngEncoder runs one of these on its encode threads, and
+// dng_save() uses one for stills, so every DNG we write comes from the same code. Any number of threads may call
+// Encode() at once.
+class DngWriter
+{
+public:
+	DngWriter(Options const *options, std::string const &cam_model = "shadowgraph-v3");
+	// Encode a frame into a buffer of our own, to be handed back to Release() once it's been written out. A degraded
+	// frame is written as cheaply as we can: from the template, with no compression, whatever the options say. The
+	// lamp colour and strobe timing in "post_process_metadata" go in the EXIF user comment.
+	void Encode(void const *mem, StreamInfo const &info, libcamera::ControlList const &metadata,
+				Metadata const &post_process_metadata, uint8_t *&encoded_buffer, size_t &buffer_len,
+				bool degraded = false);
+	void Release(uint8_t *buffer) { buffer_pool_.Release(buffer); }
+
+	// The raw formats we can make DNGs from, and how many bytes a row of each "width" pixels wide takes up (before
+	// any padding). rpicam-raw --benchmark uses these to make up frames.
+	static std::vector<libcamera::PixelFormat> Formats();
+	static unsigned int RowBytes(libcamera::PixelFormat const &format, unsigned int width);
+
+private:
+	// How the fast writer stores the pixel data: in one uncompressed strip, or in lossless JPEG or zstd tiles.
+	enum Compression { UNCOMPRESSED, LJPEG, ZSTD, NUM_COMPRESSIONS };
+
+	void encodeFast(uint8_t const *mem, StreamInfo const &info, libcamera::ControlList const &metadata,
+					Metadata const &post_process_metadata, BayerFormat const &bayer_format, Compression compression,
+					uint8_t *&encoded_buffer, size_t &buffer_len);
+	std::shared_ptr<const DngTemplate> getDngTemplate(StreamInfo const &info, BayerFormat const &bayer_format,
+													  Compression compression);
+	// Compressed tiles, one per vector. The vectors are recycled, as they find their size after a frame or two.
+	typedef std::vector<std::vector<uint8_t>> TileSet;
+	void encodeTiles(uint8_t const *mem, StreamInfo const &info, BayerFormat const &bayer_format,
+					 DngTemplate const &tmpl, TileSet &tiles);
+	void releaseTiles(TileSet &&tiles);
+
+	// Buffer pool slots: the encoded output and the two unpack scratch buffers.
+	enum { SLOT_OUTPUT, SLOT_8BIT, SLOT_16BIT };
+
+	Options const *options_;
+	std::string cam_model_;
+	BufferPool buffer_pool_;
+	// Header templates for the fast writer, one for each compression, rebuilt when the stream configuration changes.
+	std::shared_ptr<const DngTemplate> dng_template_[NUM_COMPRESSIONS];
+	StreamInfo dng_template_info_[NUM_COMPRESSIONS];
+	std::mutex dng_template_mutex_;
+	std::vector<TileSet> free_tile_sets_;
+	std::mutex tile_sets_mutex_;
+	// Maps the sum of a 2x2 quad, scaled to 12 bits, to a thumbnail pixel.
+	std::vector<uint8_t> thumbnail_lut_;
+};
+
 class DngEncoder : public Encoder
 {
 public:
@@ -24,48 +80,16 @@ public:
 	~DngEncoder();
 	// Encode the given buffer.
 	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us, Metadata const &post_process_metadata = Metadata(), libcamera::ControlList const &control_list_metadata = libcamera::ControlList()) override;
+	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us,
+					  CompletedRequestPtr const &completed_request) override;
+	bool UsesDmabuf() const override { return false; }
+	EncodePool::QueueStats GetQueueStats() override { return pool_.GetQueueStats(); }
 
 private:
-	// These threads do the actual encoding.
-	void encodeThread(int num);
-
-	// Handle the output buffers in another thread so as not to block the encoders. The
-	// application can take its time, after which we return this buffer to the encoder for
-	// re-use.
-	void outputThread();
-
-	bool abortEncode_;
-	bool abortOutput_;
-	uint64_t index_;
-
-	// How many threads to use. Whichever thread is idle will pick up the next frame.
-	static const int NUM_ENC_THREADS = 2;
+	using EncodeItem = EncodePool::EncodeItem;
 
-	struct EncodeItem
-	{
-		void *mem;
-		StreamInfo info;
-		int64_t timestamp_us;
-		uint64_t index;
-		Metadata metadata; // Optional metadata for EXIF
-		libcamera::ControlList control_list_metadata; // Optional metadata for EXIF
-	};
-	std::queue<EncodeItem> encode_queue_;
-	std::mutex encode_mutex_;
-	std::condition_variable encode_cond_var_;
-	std::thread encode_thread_[NUM_ENC_THREADS];
-	void encodeDNG(EncodeItem &item, uint8_t *&encoded_buffer, size_t &buffer_len);
+	void outputItem(EncodePool::OutputItem &item);
 
-	struct OutputItem
-	{
-		void *mem;
-		size_t bytes_used;
-		int64_t timestamp_us;
-		uint64_t index;
-	};
-	std::queue<OutputItem> output_queue_[NUM_ENC_THREADS];
-	std::mutex output_mutex_;
-	std::condition_variable output_cond_var_;
-	std::thread output_thread_;
-	VideoOptions const *options_;
+	DngWriter writer_;
+	EncodePool pool_;
 };
@@ -0,0 +1,263 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * dng_ljpeg.cpp - Lossless JPEG tiles for compressed DNGs.
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+#include "dng_ljpeg.hpp"
+
+// Differences fall into one of 17 categories (SSSS, the number of bits in the difference), each of which is a
+// Huffman symbol followed by that many bits of the difference itself.
+static constexpr unsigned int NUM_SYMBOLS = 17;
+
+namespace
+{
+
+struct HuffmanTable
+{
+	uint8_t bits[17]; // number of codes of each length, 1 to 16
+	uint8_t values[NUM_SYMBOLS]; // the symbols, in order of increasing code length
+	unsigned int num_values;
+	uint16_t code[NUM_SYMBOLS];
+	uint8_t size[NUM_SYMBOLS];
+};
+
+class BitWriter
+{
+public:
+	BitWriter(std::vector<uint8_t> &out) : out_(out), acc_(0), count_(0) {}
+
+	void Put(uint32_t value, unsigned int bits)
+	{
+		acc_ = (acc_ << bits) | (value & ((1u << bits) - 1));
+		count_ += bits;
+		while (count_ >= 8)
+		{
+			count_ -= 8;
+			uint8_t byte = acc_ >> count_;
+			out_.push_back(byte);
+			if (byte == 0xff)
+				out_.push_back(0); // byte stuffing
+		}
+	}
+
+	// Pad the last byte with ones, as the standard asks.
+	void Flush()
+	{
+		if (count_)
+			Put(0x7f, 8 - count_);
+	}
+
+private:
+	std::vector<uint8_t> &out_;
+	uint64_t acc_;
+	unsigned int count_;
+};
+
+} // namespace
+
+// The usual JPEG way (T.81 Annex K.2, as libjpeg does it) of making code lengths no longer than 16 bits from the
+// symbol counts, with a dummy symbol so that no code is all ones.
+static void make_table(uint32_t const counts[NUM_SYMBOLS], HuffmanTable &table)
+{
+	uint64_t freq[NUM_SYMBOLS + 1];
+	int code_size[NUM_SYMBOLS + 1];
+	int others[NUM_SYMBOLS + 1];
+	for (unsigned int i = 0; i < NUM_SYMBOLS; i++)
+		freq[i] = counts[i];
+	freq[NUM_SYMBOLS] = 1;
+	std::fill(std::begin(code_size), std::end(code_size), 0);
+	std::fill(std::begin(others), std::end(others), -1);
+
+	while (true)
+	{
+		// Merge the two least frequent symbols (trees), c1 being the larger index on a tie.
+		int c1 = -1, c2 = -1;
+		uint64_t v = UINT64_MAX;
+		for (int i = 0; i <= (int)NUM_SYMBOLS; i++)
+			if (freq[i] && freq[i] <= v)
+				v = freq[i], c1 = i;
+		v = UINT64_MAX;
+		for (int i = 0; i <= (int)NUM_SYMBOLS; i++)
+			if (freq[i] && freq[i] <= v && i != c1)
+				v = freq[i], c2 = i;
+		if (c2 < 0)
+			break;
+
+		freq[c1] += freq[c2];
+		freq[c2] = 0;
+		code_size[c1]++;
+		while (others[c1] >= 0)
+		{
+			c1 = others[c1];
+			code_size[c1]++;
+		}
+		others[c1] = c2;
+		code_size[c2]++;
+		while (others[c2] >= 0)
+		{
+			c2 = others[c2];
+			code_size[c2]++;
+		}
+	}
+
+	unsigned int bits[33] = {};
+	for (unsigned int i = 0; i <= NUM_SYMBOLS; i++)
+		if (code_size[i])
+			bits[code_size[i]]++;
+
+	// Move any codes longer than 16 bits up the tree.
+	for (int i = 32; i > 16; i--)
+	{
+		while (bits[i] > 0)
+		{
+			int j = i - 2;
+			while (bits[j] == 0)
+				j--;
+			bits[i] -= 2;
+			bits[i - 1]++;
+			bits[j + 1] += 2;
+			bits[j]--;
+		}
+	}
+	// And drop the dummy symbol, which has one of the longest codes.
+	int longest = 16;
+	while (bits[longest] == 0)
+		longest--;
+	bits[longest]--;
+
+	table.bits[0] = 0;
+	for (int i = 1; i <= 16; i++)
+		table.bits[i] = bits[i];
+	table.num_values = 0;
+	for (int len = 1; len <= 32; len++)
+		for (unsigned int j = 0; j < NUM_SYMBOLS; j++)
+			if (code_size[j] == len)
+				table.values[table.num_values++] = j;
+
+	// Canonical codes, from the lengths as they are after limiting.
+	std::fill(std::begin(table.size), std::end(table.size), 0);
+	uint16_t code = 0;
+	for (unsigned int len = 1, k = 0; len <= 16; len++, code <<= 1)
+	{
+		for (unsigned int n = 0; n < table.bits[len]; n++, k++, code++)
+		{
+			table.code[table.values[k]] = code;
+			table.size[table.values[k]] = len;
+		}
+	}
+}
+
+// Difference category, and the bits that follow it (the low "category" bits of the returned value).
+static inline unsigned int categorise(int diff, uint32_t &extra)
+{
+	int16_t d = diff;
+	if (d == 0)
+	{
+		extra = 0;
+		return 0;
+	}
+	if (d == -32768)
+	{
+		extra = 0;
+		return 16; // a special case, with no extra bits
+	}
+	unsigned int magnitude = d < 0 ? -d : d;
+	unsigned int category = 32 - __builtin_clz(magnitude);
+	extra = d < 0 ? d - 1 : d;
+	return category;
+}
+
+// Run fn(sample, prediction) over the tile in coding order. A sample's prediction is the one "components" to its
+// left, except at the start of a row (the sample above) and along the very first row (half the range, then the
+// sample to the left).
+template <typename Fn>
+static inline void for_each_prediction(uint16_t const *samples, unsigned int width, unsigned int height,
+									   unsigned int bits, unsigned int components, Fn &&fn)
+{
+	for (unsigned int y = 0; y < height; y++)
+	{
+		uint16_t const *row = samples + (size_t)y * width;
+		for (unsigned int c = 0; c < components; c++)
+			fn(row[c], y ? (row - width)[c] : 1 << (bits - 1));
+		for (unsigned int x = components; x < width; x++)
+			fn(row[x], row[x - components]);
+	}
+}
+
+void ljpeg_encode_tile(uint16_t const *samples, unsigned int width, unsigned int height, unsigned int bits,
+					   unsigned int components, std::vector<uint8_t> &out)
+{
+	if (bits < 2 || bits > 16 || !components || width % components)
+		throw std::runtime_error("unsupported lossless JPEG tile layout");
+
+	// First pass: count the categories, to make the Huffman table from.
+	uint32_t counts[NUM_SYMBOLS] = {};
+	for_each_prediction(samples, width, height, bits, components, [&](int sample, int prediction) {
+		uint32_t extra;
+		counts[categorise(sample - prediction, extra)]++;
+	});
+	HuffmanTable table;
+	make_table(counts, table);
+
+	unsigned int jpeg_width = width / components;
+	out.clear();
+	auto put16 = [&](unsigned int v) {
+		out.push_back(v >> 8);
+		out.push_back(v & 0xff);
+	};
+
+	put16(0xffd8); // SOI
+
+	put16(0xffc4); // DHT, a single DC table used by every component
+	put16(2 + 1 + 16 + table.num_values);
+	out.push_back(0x00);
+	out.insert(out.end(), table.bits + 1, table.bits + 17);
+	out.insert(out.end(), table.values, table.values + table.num_values);
+
+	put16(0xffc3); // SOF3, lossless Huffman
+	put16(8 + 3 * components);
+	out.push_back(bits);
+	put16(height);
+	put16(jpeg_width);
+	out.push_back(components);
+	for (unsigned int c = 0; c < components; c++)
+	{
+		out.push_back(c);
+		out.push_back(0x11); // no subsampling
+		out.push_back(0); // no quantisation table, in lossless mode
+	}
+
+	put16(0xffda); // SOS
+	put16(6 + 2 * components);
+	out.push_back(components);
+	for (unsigned int c = 0; c < components; c++)
+	{
+		out.push_back(c);
+		out.push_back(0x00); // DC table 0
+	}
+	out.push_back(1); // predictor 1: the sample to the left
+	out.push_back(0); // Se, unused
+	out.push_back(0); // Ah/Al, no point transform
+
+	// Second pass: the entropy coded data. Raw data rarely compresses to much under half, so start with that much
+	// room (the vectors get reused, so this mostly happens only once anyway).
+	out.reserve(out.size() + (size_t)width * height * bits / 16);
+	BitWriter writer(out);
+	for_each_prediction(samples, width, height, bits, components, [&](int sample, int prediction) {
+		uint32_t extra;
+		unsigned int category = categorise(sample - prediction, extra);
+		writer.Put(table.code[category], table.size[category]);
+		if (category && category < 16)
+			writer.Put(extra, category);
+	});
+	writer.Flush();
+
+	put16(0xffd9); // EOI
+}
@@ -0,0 +1,19 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * dng_ljpeg.hpp - Lossless JPEG tiles for compressed DNGs.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// Encode a tile of samples as a lossless JPEG (ITU T.81 process 14, predictor 1, i.e. DNG compression 7), with
+// Huffman tables made for the tile. For CFA data, pass components = 2: the way Adobe lays these tiles out, each row
+// is then coded as width / 2 pixels of 2 interleaved components, so that every sample is predicted from the one two
+// to its left, of the same colour. Monochrome data uses a single component. The JPEG replaces whatever was in out,
+// though its memory is reused.
+void ljpeg_encode_tile(uint16_t const *samples, unsigned int width, unsigned int height, unsigned int bits,
+					   unsigned int components, std::vector<uint8_t> &out);
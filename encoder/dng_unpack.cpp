@@ -0,0 +1,617 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * dng_unpack.cpp - Raw unpacking kernels for the DNG encoder.
+ */
+
+#include <algorithm>
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#define HAVE_NEON_KERNELS 1
+#endif
+
+#include "core/logging.hpp"
+
+#include "dng_unpack.hpp"
+
+// Plain C kernels. These work on one row at a time so that the NEON kernels can hand them whatever is left at the
+// end of a row.
+
+static void unpack_10bit_row_c(uint8_t const *ptr, uint8_t *dest, uint16_t *dest16Bit, unsigned int width)
+{
+	for (unsigned int x = 0; x < width; x += 4, ptr += 5)
+	{
+		uint16_t val1 = (ptr[0] << 2) | ((ptr[4] >> 0) & 3);
+		uint16_t val2 = (ptr[1] << 2) | ((ptr[4] >> 2) & 3);
+		uint16_t val3 = (ptr[2] << 2) | ((ptr[4] >> 4) & 3);
+		uint16_t val4 = (ptr[3] << 2) | ((ptr[4] >> 6) & 3);
+		uint8_t byte1 = val1 >> 2;
+		uint8_t byte2 = ((val1 & 3) << 6) | (val2 >> 4);
+		uint8_t byte3 = ((val2 & 0xf) << 4) | (val3 >> 6);
+		uint8_t byte4 = ((val3 & 0x3f) << 2) | (val4 >> 8);
+		uint8_t byte5 = val4 & 0xff;
+		*dest++ = byte1;
+		*dest++ = byte2;
+		*dest++ = byte3;
+		*dest++ = byte4;
+		*dest++ = byte5;
+		if (dest16Bit)
+		{
+			*dest16Bit++ = val1;
+			*dest16Bit++ = val2;
+			*dest16Bit++ = val3;
+			*dest16Bit++ = val4;
+		}
+	}
+}
+
+static void unpack_12bit_row_c(uint8_t const *ptr, uint8_t *dest, uint16_t *dest16Bit, unsigned int width)
+{
+	for (unsigned int x = 0; x < width; x += 2, ptr += 3)
+	{
+		uint16_t val1 = (ptr[0] << 4) | ((ptr[2] >> 0) & 15);
+		uint16_t val2 = (ptr[1] << 4) | ((ptr[2] >> 4) & 15);
+		uint8_t byte1 = val1 >> 4;
+		uint8_t byte2 = ((val1 & 0xf) << 4) | (val2 >> 8);
+		uint8_t byte3 = val2 & 0xff;
+		*dest++ = byte1;
+		*dest++ = byte2;
+		*dest++ = byte3;
+		if (dest16Bit)
+		{
+			*dest16Bit++ = val1;
+			*dest16Bit++ = val2;
+		}
+	}
+}
+
+static void unpack_12bit_to_8bit_row_c(uint8_t const *ptr, uint8_t *dest, uint16_t *dest16Bit, unsigned int width)
+{
+	for (unsigned int x = 0; x < width; x += 2, ptr += 3)
+	{
+		uint16_t val1 = (ptr[0] << 4) | ((ptr[2] >> 0) & 15);
+		uint16_t val2 = (ptr[1] << 4) | ((ptr[2] >> 4) & 15);
+		uint8_t val1_as_8bit = ((float)val1 / 4096.f) * 256;
+		uint8_t val2_as_8bit = ((float)val2 / 4096.f) * 256;
+		*dest++ = val1_as_8bit;
+		*dest++ = val2_as_8bit;
+		*dest16Bit++ = val1;
+		*dest16Bit++ = val2;
+	}
+}
+
+static void unpack_12bit_to_10bit_row_c(uint8_t const *ptr, uint8_t *dest, uint16_t *dest16Bit, unsigned int width)
+{
+	for (unsigned int x = 0; x < width; x += 4, ptr += 6)
+	{
+		uint16_t val1 = (ptr[0] << 4) | ((ptr[2] >> 0) & 15);
+		uint16_t val2 = (ptr[1] << 4) | ((ptr[2] >> 4) & 15);
+		uint16_t val3 = (ptr[3] << 4) | ((ptr[5] >> 0) & 15);
+		uint16_t val4 = (ptr[4] << 4) | ((ptr[5] >> 4) & 15);
+		uint16_t val1_as_10bit = ((float)val1 / 4096.f) * 1024;
+		uint16_t val2_as_10bit = ((float)val2 / 4096.f) * 1024;
+		uint16_t val3_as_10bit = ((float)val3 / 4096.f) * 1024;
+		uint16_t val4_as_10bit = ((float)val4 / 4096.f) * 1024;
+		uint8_t byte1 = val1_as_10bit >> 2;
+		uint8_t byte2 = ((val1_as_10bit & 3) << 6) | (val2_as_10bit >> 4);
+		uint8_t byte3 = ((val2_as_10bit & 0xf) << 4) | (val3_as_10bit >> 6);
+		uint8_t byte4 = ((val3_as_10bit & 0x3f) << 2) | (val4_as_10bit >> 8);
+		uint8_t byte5 = val4_as_10bit & 0xff;
+		*dest++ = byte1;
+		*dest++ = byte2;
+		*dest++ = byte3;
+		*dest++ = byte4;
+		*dest++ = byte5;
+		*dest16Bit++ = val1;
+		*dest16Bit++ = val2;
+		*dest16Bit++ = val3;
+		*dest16Bit++ = val4;
+	}
+}
+
+static uint16_t postprocess(uint16_t a)
+{
+	if (PISP_COMPRESS_MODE & 2)
+	{
+		if (PISP_COMPRESS_MODE == 3 && a < 0x4000)
+			a = a >> 2;
+		else if (a < 0x1000)
+			a = a >> 4;
+		else if (a < 0x1800)
+			a = (a - 0x800) >> 3;
+		else if (a < 0x3000)
+			a = (a - 0x1000) >> 2;
+		else if (a < 0x6000)
+			a = (a - 0x2000) >> 1;
+		else if (a < 0xC000)
+			a = (a - 0x4000);
+		else
+			a = 2 * (a - 0x8000);
+	}
+	return std::min(0xFFFF, a + PISP_COMPRESS_OFFSET);
+}
+
+static uint16_t dequantize(uint16_t q, int qmode)
+{
+	switch (qmode)
+	{
+	case 0:
+		return (q < 320) ? 16 * q : 32 * (q - 160);
+	case 1:
+		return 64 * q;
+	case 2:
+		return 128 * q;
+	default:
+		return (q < 94) ? 256 * q : std::min(0xFFFF, 512 * (q - 47));
+	}
+}
+
+static void subBlockFunction(uint16_t *d, uint32_t w)
+{
+	int q[4];
+	int qmode = (w & 3);
+	if (qmode < 3)
+	{
+		int field0 = (w >> 2) & 511;
+		int field1 = (w >> 11) & 127;
+		int field2 = (w >> 18) & 127;
+		int field3 = (w >> 25) & 127;
+		if (qmode == 2 && field0 >= 384)
+		{
+			q[1] = field0;
+			q[2] = field1 + 384;
+		}
+		else
+		{
+			q[1] = (field1 >= 64) ? field0 : field0 + 64 - field1;
+			q[2] = (field1 >= 64) ? field0 + field1 - 64 : field0;
+		}
+		int p1 = std::max(0, q[1] - 64);
+		if (qmode == 2)
+			p1 = std::min(384, p1);
+		int p2 = std::max(0, q[2] - 64);
+		if (qmode == 2)
+			p2 = std::min(384, p2);
+		q[0] = p1 + field2;
+		q[3] = p2 + field3;
+	}
+	else
+	{
+		int pack0 = (w >> 2) & 32767;
+		int pack1 = (w >> 17) & 32767;
+		q[0] = (pack0 & 15) + 16 * ((pack0 >> 8) / 11);
+		q[1] = (pack0 >> 4) % 176;
+		q[2] = (pack1 & 15) + 16 * ((pack1 >> 8) / 11);
+		q[3] = (pack1 >> 4) % 176;
+	}
+	d[0] = dequantize(q[0], qmode);
+	d[2] = dequantize(q[1], qmode);
+	d[4] = dequantize(q[2], qmode);
+	d[6] = dequantize(q[3], qmode);
+}
+
+// Decode a row of "blocks" 8-pixel blocks.
+static void uncompress_row_c(uint8_t const *sp, uint16_t *dp, unsigned int blocks)
+{
+	for (unsigned int b = 0; b < blocks; b++)
+	{
+		if (PISP_COMPRESS_MODE & 1)
+		{
+			uint32_t w0 = 0, w1 = 0;
+			for (int b = 0; b < 4; ++b)
+				w0 |= (*sp++) << (b * 8);
+			for (int b = 0; b < 4; ++b)
+				w1 |= (*sp++) << (b * 8);
+			subBlockFunction(dp, w0);
+			subBlockFunction(dp + 1, w1);
+			for (int i = 0; i < 8; ++i, ++dp)
+				*dp = postprocess(*dp);
+		}
+		else
+		{
+			for (int i = 0; i < 8; ++i)
+				*dp++ = postprocess((*sp++) << 8);
+		}
+	}
+}
+
+static void repack_row_10bit_c(uint8_t const *src, uint8_t *dest, unsigned int width)
+{
+	unpack_10bit_row_c(src, dest, nullptr, width);
+}
+
+static void repack_row_12bit_c(uint8_t const *src, uint8_t *dest, unsigned int width)
+{
+	unpack_12bit_row_c(src, dest, nullptr, width);
+}
+
+// The sums of "count" 2x2 quads, "step" pixels apart, with their top rows in row0 and bottom rows in row1.
+static void quad_sums_c(uint16_t const *row0, uint16_t const *row1, uint32_t *sums, unsigned int count,
+						unsigned int step)
+{
+	for (unsigned int i = 0; i < count; i++, row0 += step, row1 += step)
+		sums[i] = row0[0] + row0[1] + row1[0] + row1[1];
+}
+
+#if HAVE_NEON_KERNELS
+
+// NEON kernels. The packed formats are handled with table lookups: each output byte is made from at most three
+// (shifted) input bytes, so we gather those with vqtbl1q_u8 and combine them with per-lane shifts. 0xff indices give
+// zero. Whatever doesn't fill a whole step at the end of a row goes to the C kernel.
+
+// CSI2 10-bit to TIFF 10-bit, three 5-byte groups at a time. Output bytes sit at the same offsets as the input
+// bytes they come from.
+static const uint8_t pack10_p_idx[16] = { 0, 4, 1, 2, 3, 5, 9, 6, 7, 8, 10, 14, 11, 12, 13, 0xff };
+static const int8_t pack10_p_shift[16] = { 0, 6, 6, 4, 2, 0, 6, 6, 4, 2, 0, 6, 6, 4, 2, 0 };
+static const uint8_t pack10_q_idx[16] = { 0xff, 1, 2, 3, 4, 0xff, 6, 7, 8, 9, 0xff, 11, 12, 13, 14, 0xff };
+static const int8_t pack10_q_shift[16] = { 0, -2, -4, -6, -6, 0, -2, -4, -6, -6, 0, -2, -4, -6, -6, 0 };
+static const uint8_t pack10_r_idx[16] = { 0xff, 0xff, 4, 4, 0xff, 0xff, 0xff, 9, 9, 0xff, 0xff, 0xff, 14, 14, 0xff, 0xff };
+static const int8_t pack10_r_shift[16] = { 0, 0, 2, -2, 0, 0, 0, 2, -2, 0, 0, 0, 2, -2, 0, 0 };
+static const uint8_t pack10_r_mask[16] = { 0, 0, 0x30, 0x0c, 0, 0, 0, 0x30, 0x0c, 0, 0, 0, 0x30, 0x0c, 0, 0 };
+
+static inline uint8x16_t pack10_neon(uint8x16_t in)
+{
+	uint8x16_t p = vshlq_u8(vqtbl1q_u8(in, vld1q_u8(pack10_p_idx)), vld1q_s8(pack10_p_shift));
+	uint8x16_t q = vshlq_u8(vqtbl1q_u8(in, vld1q_u8(pack10_q_idx)), vld1q_s8(pack10_q_shift));
+	uint8x16_t r = vshlq_u8(vqtbl1q_u8(in, vld1q_u8(pack10_r_idx)), vld1q_s8(pack10_r_shift));
+	return vorrq_u8(vorrq_u8(p, q), vandq_u8(r, vld1q_u8(pack10_r_mask)));
+}
+
+// The 12 pixels of three CSI2 10-bit groups as 16-bit samples.
+static const uint8_t unpack10_hi_idx[16] = { 0, 1, 2, 3, 5, 6, 7, 8, 10, 11, 12, 13, 0xff, 0xff, 0xff, 0xff };
+static const uint8_t unpack10_lo_idx[16] = { 4, 4, 4, 4, 9, 9, 9, 9, 14, 14, 14, 14, 0xff, 0xff, 0xff, 0xff };
+static const int8_t unpack10_lo_shift[16] = { 0, -2, -4, -6, 0, -2, -4, -6, 0, -2, -4, -6, 0, 0, 0, 0 };
+
+template <bool want16>
+static void unpack_10bit_row_neon(uint8_t const *src, uint8_t *dest, uint16_t *dest16Bit, unsigned int width)
+{
+	unsigned int bytes = width / 4 * 5, o = 0, x = 0;
+	for (; o + 16 <= bytes; o += 15, x += 12)
+	{
+		uint8x16_t in = vld1q_u8(src + o);
+		vst1q_u8(dest + o, pack10_neon(in));
+
+		if (want16)
+		{
+			uint8x16_t hi = vqtbl1q_u8(in, vld1q_u8(unpack10_hi_idx));
+			uint8x16_t lo = vandq_u8(vshlq_u8(vqtbl1q_u8(in, vld1q_u8(unpack10_lo_idx)), vld1q_s8(unpack10_lo_shift)),
+									 vdupq_n_u8(3));
+			uint16x8_t v0 = vorrq_u16(vshll_n_u8(vget_low_u8(hi), 2), vmovl_u8(vget_low_u8(lo)));
+			uint16x8_t v1 = vorrq_u16(vshll_n_u8(vget_high_u8(hi), 2), vmovl_u8(vget_high_u8(lo)));
+			vst1q_u16(dest16Bit + x, v0);
+			vst1_u16(dest16Bit + x + 8, vget_low_u16(v1));
+		}
+	}
+	unpack_10bit_row_c(src + o, dest + o, want16 ? dest16Bit + x : nullptr, width - x);
+}
+
+// CSI2 12-bit to TIFF 12-bit, five 3-byte groups at a time, again with output bytes at the input offsets.
+static const uint8_t pack12_p_idx[16] = { 0, 2, 1, 3, 5, 4, 6, 8, 7, 9, 11, 10, 12, 14, 13, 0xff };
+static const int8_t pack12_p_shift[16] = { 0, 4, 4, 0, 4, 4, 0, 4, 4, 0, 4, 4, 0, 4, 4, 0 };
+static const uint8_t pack12_q_idx[16] = { 0xff, 1, 2, 0xff, 4, 5, 0xff, 7, 8, 0xff, 10, 11, 0xff, 13, 14, 0xff };
+static const int8_t pack12_q_shift[16] = { 0, -4, -4, 0, -4, -4, 0, -4, -4, 0, -4, -4, 0, -4, -4, 0 };
+
+// The 10 pixels of five CSI2 12-bit groups.
+static const uint8_t unpack12_hi_idx[16] = { 0, 1, 3, 4, 6, 7, 9, 10, 12, 13, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+static const uint8_t unpack12_lo_idx[16] = { 2, 2, 5, 5, 8, 8, 11, 11, 14, 14, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+static const int8_t unpack12_lo_shift[16] = { 0, -4, 0, -4, 0, -4, 0, -4, 0, -4, 0, 0, 0, 0, 0, 0 };
+
+// Returns the high bytes of the 10 pixels, and their 16-bit values in v0 (first 8) and v1 (last 2).
+static inline uint8x16_t unpack12_neon(uint8x16_t in, uint16x8_t &v0, uint16x8_t &v1)
+{
+	uint8x16_t hi = vqtbl1q_u8(in, vld1q_u8(unpack12_hi_idx));
+	uint8x16_t lo = vandq_u8(vshlq_u8(vqtbl1q_u8(in, vld1q_u8(unpack12_lo_idx)), vld1q_s8(unpack12_lo_shift)),
+							 vdupq_n_u8(15));
+	v0 = vorrq_u16(vshll_n_u8(vget_low_u8(hi), 4), vmovl_u8(vget_low_u8(lo)));
+	v1 = vorrq_u16(vshll_n_u8(vget_high_u8(hi), 4), vmovl_u8(vget_high_u8(lo)));
+	return hi;
+}
+
+static inline void store16_10(uint16_t *dest16Bit, uint16x8_t v0, uint16x8_t v1)
+{
+	vst1q_u16(dest16Bit, v0);
+	vst1q_lane_u16(dest16Bit + 8, v1, 0);
+	vst1q_lane_u16(dest16Bit + 9, v1, 1);
+}
+
+template <bool want16>
+static void unpack_12bit_row_neon(uint8_t const *src, uint8_t *dest, uint16_t *dest16Bit, unsigned int width)
+{
+	unsigned int bytes = width / 2 * 3, o = 0, x = 0;
+	for (; o + 16 <= bytes; o += 15, x += 10)
+	{
+		uint8x16_t in = vld1q_u8(src + o);
+		uint8x16_t p = vshlq_u8(vqtbl1q_u8(in, vld1q_u8(pack12_p_idx)), vld1q_s8(pack12_p_shift));
+		uint8x16_t q = vshlq_u8(vqtbl1q_u8(in, vld1q_u8(pack12_q_idx)), vld1q_s8(pack12_q_shift));
+		vst1q_u8(dest + o, vorrq_u8(p, q));
+
+		if (want16)
+		{
+			uint16x8_t v0, v1;
+			unpack12_neon(in, v0, v1);
+			store16_10(dest16Bit + x, v0, v1);
+		}
+	}
+	unpack_12bit_row_c(src + o, dest + o, want16 ? dest16Bit + x : nullptr, width - x);
+}
+
+static void unpack_12bit_to_8bit_row_neon(uint8_t const *src, uint8_t *dest, uint16_t *dest16Bit, unsigned int width)
+{
+	// For 12-bit samples (v / 4096.f) * 256 is exactly v >> 4, i.e. the high byte of each CSI2 pixel.
+	unsigned int bytes = width / 2 * 3, o = 0, x = 0;
+	for (; o + 16 <= bytes; o += 15, x += 10)
+	{
+		uint16x8_t v0, v1;
+		uint8x16_t hi = unpack12_neon(vld1q_u8(src + o), v0, v1);
+		vst1_u8(dest + x, vget_low_u8(hi));
+		vst1q_lane_u8(dest + x + 8, hi, 8);
+		vst1q_lane_u8(dest + x + 9, hi, 9);
+		store16_10(dest16Bit + x, v0, v1);
+	}
+	unpack_12bit_to_8bit_row_c(src + o, dest + x, dest16Bit + x, width - x);
+}
+
+static const int8_t lo10_shift[8] = { 0, 2, 4, 6, 0, 2, 4, 6 };
+static const uint8_t csi2p10_idx[16] = { 0, 1, 2, 3, 8, 4, 5, 6, 7, 9, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+
+static void unpack_12bit_to_10bit_row_neon(uint8_t const *src, uint8_t *dest, uint16_t *dest16Bit,
+										   unsigned int width)
+{
+	// 8 pixels (four 3-byte groups in, two 5-byte groups out) per step. The samples are reduced to 10 bits
+	// ((v / 4096.f) * 1024 is exactly v >> 2), rearranged into CSI2 10-bit order and then packed as above.
+	unsigned int bytes = width / 2 * 3, o = 0, d = 0, x = 0;
+	for (; o + 16 <= bytes; o += 12, d += 10, x += 8)
+	{
+		uint16x8_t v12, unused;
+		unpack12_neon(vld1q_u8(src + o), v12, unused);
+		vst1q_u16(dest16Bit + x, v12);
+
+		uint16x8_t v10 = vshrq_n_u16(v12, 2);
+		uint8x8_t hi = vmovn_u16(vshrq_n_u16(v10, 2));
+		uint8x8_t lo = vshl_u8(vmovn_u16(vandq_u16(v10, vdupq_n_u16(3))), vld1_s8(lo10_shift));
+		// The low bits don't overlap, so adding neighbours is the same as or-ing them: [L0, L1, ...].
+		lo = vpadd_u8(lo, lo);
+		lo = vpadd_u8(lo, lo);
+		uint8x16_t csi2p = vqtbl1q_u8(vcombine_u8(hi, lo), vld1q_u8(csi2p10_idx));
+
+		uint8x16_t out = pack10_neon(csi2p);
+		vst1_u8(dest + d, vget_low_u8(out));
+		vst1q_lane_u8(dest + d + 8, out, 8);
+		vst1q_lane_u8(dest + d + 9, out, 9);
+	}
+	unpack_12bit_to_10bit_row_c(src + o, dest + d, dest16Bit + x, width - x);
+}
+
+static inline int32x4_t dequantize_neon(int32x4_t q, uint32x4_t qmode)
+{
+	int32x4_t d0 = vbslq_s32(vcltq_s32(q, vdupq_n_s32(320)), vmulq_n_s32(q, 16),
+							 vmulq_n_s32(vsubq_s32(q, vdupq_n_s32(160)), 32));
+	int32x4_t d1 = vmulq_n_s32(q, 64);
+	int32x4_t d2 = vmulq_n_s32(q, 128);
+	int32x4_t d3 = vbslq_s32(vcltq_s32(q, vdupq_n_s32(94)), vmulq_n_s32(q, 256),
+							 vminq_s32(vmulq_n_s32(vsubq_s32(q, vdupq_n_s32(47)), 512), vdupq_n_s32(0xFFFF)));
+	int32x4_t d = vbslq_s32(vceqq_u32(qmode, vdupq_n_u32(2)), d2, d3);
+	d = vbslq_s32(vceqq_u32(qmode, vdupq_n_u32(1)), d1, d);
+	return vbslq_s32(vceqq_u32(qmode, vdupq_n_u32(0)), d0, d);
+}
+
+static inline int32x4_t field_neon(uint32x4_t w, int shift, uint32_t mask)
+{
+	return vreinterpretq_s32_u32(vandq_u32(vshlq_u32(w, vdupq_n_s32(-shift)), vdupq_n_u32(mask)));
+}
+
+static void uncompress_row_neon(uint8_t const *sp, uint16_t *dp, unsigned int blocks)
+{
+	static_assert(PISP_COMPRESS_MODE == 1, "NEON uncompress only handles compression mode 1");
+
+	// The C version's subBlockFunction, four words (two blocks) at a time, evaluating both quantisation branches
+	// and selecting per lane. The divisions by 11 and 176 become multiply-shifts, exact over the field ranges.
+	unsigned int b = 0;
+	for (; b + 2 <= blocks; b += 2, sp += 16, dp += 16)
+	{
+		uint32x4_t w = vreinterpretq_u32_u8(vld1q_u8(sp));
+		uint32x4_t qmode = vandq_u32(w, vdupq_n_u32(3));
+		uint32x4_t is2 = vceqq_u32(qmode, vdupq_n_u32(2));
+
+		int32x4_t f0 = field_neon(w, 2, 511), f1 = field_neon(w, 11, 127);
+		int32x4_t f2 = field_neon(w, 18, 127), f3 = field_neon(w, 25, 127);
+		int32x4_t c64 = vdupq_n_s32(64);
+		uint32x4_t f1_ge_64 = vcgeq_s32(f1, c64);
+		int32x4_t q1 = vbslq_s32(f1_ge_64, f0, vsubq_s32(vaddq_s32(f0, c64), f1));
+		int32x4_t q2 = vbslq_s32(f1_ge_64, vsubq_s32(vaddq_s32(f0, f1), c64), f0);
+		uint32x4_t big = vandq_u32(is2, vcgeq_s32(f0, vdupq_n_s32(384)));
+		q1 = vbslq_s32(big, f0, q1);
+		q2 = vbslq_s32(big, vaddq_s32(f1, vdupq_n_s32(384)), q2);
+		int32x4_t p1 = vmaxq_s32(vsubq_s32(q1, c64), vdupq_n_s32(0));
+		int32x4_t p2 = vmaxq_s32(vsubq_s32(q2, c64), vdupq_n_s32(0));
+		p1 = vbslq_s32(is2, vminq_s32(p1, vdupq_n_s32(384)), p1);
+		p2 = vbslq_s32(is2, vminq_s32(p2, vdupq_n_s32(384)), p2);
+		int32x4_t q0 = vaddq_s32(p1, f2);
+		int32x4_t q3 = vaddq_s32(p2, f3);
+
+		// qmode 3
+		int32x4_t pack0 = field_neon(w, 2, 32767), pack1 = field_neon(w, 17, 32767);
+		auto div11 = [](int32x4_t v) { return vshrq_n_s32(vmulq_n_s32(v, 187), 11); };
+		auto mod176 = [](int32x4_t v) {
+			return vsubq_s32(v, vmulq_n_s32(vshrq_n_s32(vmulq_n_s32(v, 745), 17), 176));
+		};
+		int32x4_t c15 = vdupq_n_s32(15);
+		uint32x4_t is3 = vceqq_u32(qmode, vdupq_n_u32(3));
+		q0 = vbslq_s32(is3, vaddq_s32(vandq_s32(pack0, c15), vshlq_n_s32(div11(vshrq_n_s32(pack0, 8)), 4)), q0);
+		q1 = vbslq_s32(is3, mod176(vshrq_n_s32(pack0, 4)), q1);
+		q2 = vbslq_s32(is3, vaddq_s32(vandq_s32(pack1, c15), vshlq_n_s32(div11(vshrq_n_s32(pack1, 8)), 4)), q2);
+		q3 = vbslq_s32(is3, mod176(vshrq_n_s32(pack1, 4)), q3);
+
+		uint16x4_t n0 = vmovn_u32(vreinterpretq_u32_s32(dequantize_neon(q0, qmode)));
+		uint16x4_t n1 = vmovn_u32(vreinterpretq_u32_s32(dequantize_neon(q1, qmode)));
+		uint16x4_t n2 = vmovn_u32(vreinterpretq_u32_s32(dequantize_neon(q2, qmode)));
+		uint16x4_t n3 = vmovn_u32(vreinterpretq_u32_s32(dequantize_neon(q3, qmode)));
+
+		// Lanes are (block 0 word 0, block 0 word 1, block 1 word 0, block 1 word 1), and each block's pixels
+		// alternate between its two words.
+		uint32x2x2_t z01 = vzip_u32(vreinterpret_u32_u16(n0), vreinterpret_u32_u16(n1));
+		uint32x2x2_t z23 = vzip_u32(vreinterpret_u32_u16(n2), vreinterpret_u32_u16(n3));
+		uint16x8_t offset = vdupq_n_u16(PISP_COMPRESS_OFFSET);
+		vst1q_u16(dp, vqaddq_u16(vcombine_u16(vreinterpret_u16_u32(z01.val[0]), vreinterpret_u16_u32(z23.val[0])),
+								 offset));
+		vst1q_u16(dp + 8, vqaddq_u16(vcombine_u16(vreinterpret_u16_u32(z01.val[1]),
+												  vreinterpret_u16_u32(z23.val[1])),
+									 offset));
+	}
+	uncompress_row_c(sp, dp, blocks - b);
+}
+
+static void repack_row_10bit_neon(uint8_t const *src, uint8_t *dest, unsigned int width)
+{
+	unpack_10bit_row_neon<false>(src, dest, nullptr, width);
+}
+
+static void repack_row_12bit_neon(uint8_t const *src, uint8_t *dest, unsigned int width)
+{
+	unpack_12bit_row_neon<false>(src, dest, nullptr, width);
+}
+
+// For the steps thumbnails usually use, the pairs we want are every first, second or fourth 32-bit word, which the
+// de-interleaving loads pick out of a row for us. Four quads at a time.
+static void quad_sums_neon(uint16_t const *row0, uint16_t const *row1, uint32_t *sums, unsigned int count,
+						   unsigned int step)
+{
+	unsigned int i = 0;
+	if (step == 2)
+	{
+		for (; i + 4 <= count; i += 4, row0 += 8, row1 += 8)
+			vst1q_u32(sums + i, vaddq_u32(vpaddlq_u16(vld1q_u16(row0)), vpaddlq_u16(vld1q_u16(row1))));
+	}
+	else if (step == 4)
+	{
+		for (; i + 4 <= count; i += 4, row0 += 16, row1 += 16)
+		{
+			uint16x8_t p0 = vreinterpretq_u16_u32(vld2q_u32((uint32_t const *)row0).val[0]);
+			uint16x8_t p1 = vreinterpretq_u16_u32(vld2q_u32((uint32_t const *)row1).val[0]);
+			vst1q_u32(sums + i, vaddq_u32(vpaddlq_u16(p0), vpaddlq_u16(p1)));
+		}
+	}
+	else if (step == 8)
+	{
+		for (; i + 4 <= count; i += 4, row0 += 32, row1 += 32)
+		{
+			uint16x8_t p0 = vreinterpretq_u16_u32(vld4q_u32((uint32_t const *)row0).val[0]);
+			uint16x8_t p1 = vreinterpretq_u16_u32(vld4q_u32((uint32_t const *)row1).val[0]);
+			vst1q_u32(sums + i, vaddq_u32(vpaddlq_u16(p0), vpaddlq_u16(p1)));
+		}
+	}
+	quad_sums_c(row0, row1, sums + i, count - i, step);
+}
+
+#endif /* HAVE_NEON_KERNELS */
+
+namespace
+{
+
+typedef void (*UnpackRowFn)(uint8_t const *, uint8_t *, uint16_t *, unsigned int);
+typedef void (*UncompressRowFn)(uint8_t const *, uint16_t *, unsigned int);
+typedef void (*RepackRowFn)(uint8_t const *, uint8_t *, unsigned int);
+typedef void (*QuadSumsFn)(uint16_t const *, uint16_t const *, uint32_t *, unsigned int, unsigned int);
+
+struct Kernels
+{
+	UnpackRowFn unpack_10bit;
+	UnpackRowFn unpack_12bit;
+	UnpackRowFn unpack_12bit_to_8bit;
+	UnpackRowFn unpack_12bit_to_10bit;
+	UncompressRowFn uncompress;
+	RepackRowFn repack_10bit;
+	RepackRowFn repack_12bit;
+	QuadSumsFn quad_sums;
+};
+
+Kernels select_kernels()
+{
+#if HAVE_NEON_KERNELS
+	if (getauxval(AT_HWCAP) & HWCAP_ASIMD)
+	{
+		LOG(2, "DNG unpack: using NEON kernels");
+		return { unpack_10bit_row_neon<true>,	unpack_12bit_row_neon<true>, unpack_12bit_to_8bit_row_neon,
+				 unpack_12bit_to_10bit_row_neon, uncompress_row_neon,		  repack_row_10bit_neon,
+				 repack_row_12bit_neon,			 quad_sums_neon };
+	}
+#endif
+	LOG(2, "DNG unpack: using C kernels");
+	return { unpack_10bit_row_c,	   unpack_12bit_row_c, unpack_12bit_to_8bit_row_c, unpack_12bit_to_10bit_row_c,
+			 uncompress_row_c,		   repack_row_10bit_c, repack_row_12bit_c,		   quad_sums_c };
+}
+
+Kernels const &kernels()
+{
+	static const Kernels k = select_kernels();
+	return k;
+}
+
+} // namespace
+
+void unpack_10bit(uint8_t const *src, StreamInfo const &info, uint8_t *dest, uint16_t *dest16Bit)
+{
+	unsigned int w_align = info.width & ~3;
+	for (unsigned int y = 0; y < info.height; y++, src += info.stride, dest += w_align / 4 * 5, dest16Bit += w_align)
+		kernels().unpack_10bit(src, dest, dest16Bit, w_align);
+}
+
+void unpack_12bit(uint8_t const *src, StreamInfo const &info, uint8_t *dest, uint16_t *dest16Bit)
+{
+	unsigned int w_align = info.width & ~1;
+	for (unsigned int y = 0; y < info.height; y++, src += info.stride, dest += w_align / 2 * 3, dest16Bit += w_align)
+		kernels().unpack_12bit(src, dest, dest16Bit, w_align);
+}
+
+void unpack_12bit_to_8bit(uint8_t const *src, StreamInfo const &info, uint8_t *dest, uint16_t *dest16Bit)
+{
+	unsigned int w_align = info.width & ~1;
+	for (unsigned int y = 0; y < info.height; y++, src += info.stride, dest += w_align, dest16Bit += w_align)
+		kernels().unpack_12bit_to_8bit(src, dest, dest16Bit, w_align);
+}
+
+void unpack_12bit_to_10bit(uint8_t const *src, StreamInfo const &info, uint8_t *dest, uint16_t *dest16Bit)
+{
+	// Pixels go in fours, so a row can consume up to two pixels beyond w_align.
+	unsigned int w_align = info.width & ~1;
+	unsigned int w_step = (w_align + 3) & ~3;
+	for (unsigned int y = 0; y < info.height; y++, src += info.stride, dest += w_step / 4 * 5, dest16Bit += w_step)
+		kernels().unpack_12bit_to_10bit(src, dest, dest16Bit, w_align);
+}
+
+void uncompress(uint8_t const *src, StreamInfo const &info, uint16_t *dest)
+{
+	unsigned int buf_stride_pixels = (info.width + 7) & ~7;
+	for (unsigned int y = 0; y < info.height; ++y)
+		kernels().uncompress(src + y * info.stride, dest + y * buf_stride_pixels, buf_stride_pixels / 8);
+}
+
+void repack_row_10bit(uint8_t const *src, uint8_t *dest, unsigned int width)
+{
+	kernels().repack_10bit(src, dest, width);
+}
+
+void repack_row_12bit(uint8_t const *src, uint8_t *dest, unsigned int width)
+{
+	kernels().repack_12bit(src, dest, width);
+}
+
+void thumbnail_row(uint16_t const *src, unsigned int stride, uint8_t *dest, unsigned int width, unsigned int step,
+				   int shift, uint8_t const *lut)
+{
+	uint32_t sums[64];
+	for (unsigned int x = 0; x < width; x += 64)
+	{
+		unsigned int count = std::min(width - x, 64u);
+		kernels().quad_sums(src + x * step, src + stride + x * step, sums, count, step);
+		for (unsigned int i = 0; i < count; i++, dest += 3)
+		{
+			uint32_t index = shift >= 0 ? sums[i] >> shift : sums[i] << -shift;
+			dest[0] = dest[1] = dest[2] = lut[std::min(index, THUMBNAIL_LUT_SIZE - 1)];
+		}
+	}
+}
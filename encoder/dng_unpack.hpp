@@ -0,0 +1,41 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * dng_unpack.hpp - Raw unpacking kernels for the DNG encoder.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include "core/stream_info.hpp"
+
+// Each of these unpacks a whole CSI2 packed frame. "dest" receives the pixels packed MSB-first (TIFF order) at the
+// output bit depth, with no padding between rows, and "dest16Bit" one 16-bit sample per pixel. NEON versions are
+// used when the CPU has them, otherwise the plain C ones.
+void unpack_10bit(uint8_t const *src, StreamInfo const &info, uint8_t *dest, uint16_t *dest16Bit);
+void unpack_12bit(uint8_t const *src, StreamInfo const &info, uint8_t *dest, uint16_t *dest16Bit);
+void unpack_12bit_to_8bit(uint8_t const *src, StreamInfo const &info, uint8_t *dest, uint16_t *dest16Bit);
+void unpack_12bit_to_10bit(uint8_t const *src, StreamInfo const &info, uint8_t *dest, uint16_t *dest16Bit);
+
+// Decode a PiSP compressed frame into 16-bit samples, with rows padded to a multiple of 8 pixels.
+void uncompress(uint8_t const *src, StreamInfo const &info, uint16_t *dest);
+
+// How the PiSP frames we decode were compressed: the mode, and the offset added to every decoded sample. DNGs that
+// keep the compressed data (--dng-compression pisp) record these, so that they can be decoded later.
+static constexpr int PISP_COMPRESS_MODE = 1;
+static constexpr int PISP_COMPRESS_OFFSET = 2048;
+
+// Convert a single row of CSI2 packed pixels to TIFF bit order, at the same depth. "width" must be a multiple of 4
+// (10-bit) or 2 (12-bit) pixels.
+void repack_row_10bit(uint8_t const *src, uint8_t *dest, unsigned int width);
+void repack_row_12bit(uint8_t const *src, uint8_t *dest, unsigned int width);
+
+// Make one row of a grey thumbnail, as RGB. Each of its "width" pixels comes from the 2x2 Bayer quad at the top left
+// of its step x step block of "src" (16-bit samples, rows "stride" apart): the quad's sum is shifted right by
+// "shift" (left, if that is negative) and looked up in "lut", of THUMBNAIL_LUT_SIZE entries. "step" must be a power
+// of two, 2 or more.
+static constexpr unsigned int THUMBNAIL_LUT_SIZE = 4096;
+void thumbnail_row(uint16_t const *src, unsigned int stride, uint8_t *dest, unsigned int width, unsigned int step,
+				   int shift, uint8_t const *lut);
@@ -0,0 +1,318 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * encode_pool.cpp - Thread pool shared by the software still-image encoders and rpicam-still's ZSL bursts.
+ */
+
+#include <chrono>
+
+#include "core/logging.hpp"
+#include "core/memory_budget.hpp"
+#include "core/thread_utils.hpp"
+#include "core/options.hpp"
+#include "core/trace.hpp"
+
+#include "encode_pool.hpp"
+
+// Every pool in the process (one for each camera, when there are several) takes a slot while it encodes a frame, so
+// that all their encode threads between them keep no more frames on the go than there are cores, rather than each
+// pool assuming it has the whole machine to itself. A pool asked for more threads than that still gets them all.
+class EncodeSlots
+{
+public:
+	static EncodeSlots &Get()
+	{
+		static EncodeSlots slots;
+		return slots;
+	}
+	void Reserve(unsigned int threads)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		limit_ = std::max(limit_, threads);
+	}
+	void Acquire()
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		cond_.wait(lock, [this] { return busy_ < limit_; });
+		busy_++;
+	}
+	void Release()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			busy_--;
+		}
+		cond_.notify_one();
+	}
+
+private:
+	EncodeSlots() : limit_(std::max(std::thread::hardware_concurrency(), 1u)) {}
+
+	std::mutex mutex_;
+	std::condition_variable cond_;
+	unsigned int limit_;
+	unsigned int busy_ = 0;
+};
+
+EncodePool::EncodePool(Options const *options, unsigned int default_threads, std::string const &name)
+	: options_(options), name_(name), abortEncode_(false), abortOutput_(false), index_(0), frames_output_(0),
+	  max_queue_(options->Get().encode_queue), policy_(Policy::Block), queue_stats_ {}, reported_stats_ {}
+{
+	num_threads_ = options->Get().encode_threads ? options->Get().encode_threads : default_threads;
+
+	std::string const &policy = options->Get().encode_queue_policy;
+	if (policy == "drop-oldest")
+		policy_ = Policy::DropOldest;
+	else if (policy == "drop-newest")
+		policy_ = Policy::DropNewest;
+	else if (policy == "degrade")
+		policy_ = Policy::Degrade;
+}
+
+EncodePool::~EncodePool()
+{
+	Stop();
+}
+
+void EncodePool::Start(EncodeFunction encode, OutputFunction output, InputDoneFunction input_done)
+{
+	encode_ = std::move(encode);
+	output_ = std::move(output);
+	input_done_ = std::move(input_done);
+
+	std::vector<unsigned int> encode_cpus = parse_cpu_list(options_->Get().encode_affinity);
+	std::vector<unsigned int> output_cpus = parse_cpu_list(options_->Get().encode_output_affinity);
+
+	EncodeSlots::Get().Reserve(num_threads_);
+	output_thread_ = std::thread(&EncodePool::outputThread, this);
+	set_thread_affinity(output_thread_, output_cpus);
+	set_thread_priority(output_thread_, options_->Get().encode_output_priority);
+
+	for (unsigned int i = 0; i < num_threads_; i++)
+	{
+		encode_thread_.emplace_back(&EncodePool::encodeThread, this, i);
+		set_thread_affinity(encode_thread_.back(), encode_cpus);
+		set_thread_priority(encode_thread_.back(), options_->Get().encode_priority);
+	}
+
+	LOG(2, name_ << ": started " << num_threads_ << " encode threads");
+}
+
+void EncodePool::Push(void *mem, StreamInfo const &info, int64_t timestamp_us,
+					  CompletedRequestPtr const &completed_request)
+{
+	EncodeItem item;
+	item.mem = mem;
+	item.info = info;
+	item.timestamp_us = timestamp_us;
+	item.metadata = completed_request->post_process_metadata;
+	// Share ownership of the whole request, but point at its control list.
+	item.control_list_metadata =
+		std::shared_ptr<libcamera::ControlList const>(completed_request, &completed_request->metadata);
+	push(std::move(item));
+}
+
+void EncodePool::Push(void *mem, StreamInfo const &info, int64_t timestamp_us, Metadata const &metadata,
+					  libcamera::ControlList const &control_list_metadata)
+{
+	EncodeItem item;
+	item.mem = mem;
+	item.info = info;
+	item.timestamp_us = timestamp_us;
+	item.metadata = metadata;
+	item.control_list_metadata = std::make_shared<libcamera::ControlList const>(control_list_metadata);
+	push(std::move(item));
+}
+
+void EncodePool::push(EncodeItem &&item)
+{
+	TRACE_SCOPE("encode_queue", { "timestamp_us", item.timestamp_us });
+	std::unique_lock<std::mutex> lock(encode_mutex_);
+	item.index = index_++;
+
+	if (max_queue_ && encode_queue_.size() >= max_queue_ && !abortEncode_)
+	{
+		unsigned int limit = max_queue_;
+		switch (policy_)
+		{
+		case Policy::DropNewest:
+			drop(item);
+			reportQueueFull();
+			return;
+		case Policy::DropOldest:
+			drop(encode_queue_.front());
+			encode_queue_.pop();
+			break;
+		case Policy::Degrade:
+			item.degraded = true;
+			queue_stats_.degraded++;
+			limit = 2 * max_queue_;
+			[[fallthrough]];
+		case Policy::Block:
+			space_cond_var_.wait(lock, [&] { return abortEncode_ || encode_queue_.size() < limit; });
+			break;
+		}
+		reportQueueFull();
+	}
+
+	// Encoded frames that can't go out hold on to their buffers, so once those have used up the encoders' memory
+	// budget, new frames wait or are dropped. That's only worth doing while there are frames of ours still to go out,
+	// as it's those that give the memory back, so the output thread wakes us each time it finishes one.
+	MemoryBudget &budget = MemoryBudget::Get();
+	auto over_budget = [&] {
+		return !abortEncode_ && index_ - 1 > frames_output_ && !budget.Available(MemoryBudget::ENCODER);
+	};
+	if (over_budget())
+	{
+		if (!budget.Blocking())
+		{
+			budget.Refuse(MemoryBudget::ENCODER);
+			drop(item);
+			return;
+		}
+		space_cond_var_.wait(lock, [&] { return !over_budget(); });
+	}
+
+	encode_queue_.push(std::move(item));
+	encode_cond_var_.notify_one();
+}
+
+void EncodePool::drop(EncodeItem &item)
+{
+	// The frame still takes its turn on the output thread, with no buffer, so that the frames after it aren't held
+	// up.
+	queue_stats_.dropped++;
+	input_done_(item.mem);
+	OutputItem output_item = { nullptr, 0, item.timestamp_us, item.index };
+	item = EncodeItem();
+	std::lock_guard<std::mutex> lock(output_mutex_);
+	if (output_queue_.insert(output_item))
+		output_cond_var_.notify_one();
+}
+
+void EncodePool::reportQueueFull()
+{
+	// At most once a second, so as not to add to our troubles.
+	auto now = std::chrono::steady_clock::now();
+	if (now - last_report_ < std::chrono::seconds(1))
+		return;
+	last_report_ = now;
+	LOG_ERROR("WARNING: " << name_ << ": encode queue full (" << max_queue_ << " frames), "
+						  << queue_stats_.dropped - reported_stats_.dropped << " dropped and "
+						  << queue_stats_.degraded - reported_stats_.degraded << " degraded since the last report");
+	reported_stats_ = queue_stats_;
+}
+
+EncodePool::QueueStats EncodePool::GetQueueStats()
+{
+	std::lock_guard<std::mutex> lock(encode_mutex_);
+	return queue_stats_;
+}
+
+void EncodePool::Stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(encode_mutex_);
+		abortEncode_ = true;
+		encode_cond_var_.notify_all();
+		space_cond_var_.notify_all();
+	}
+	for (auto &t : encode_thread_)
+		t.join();
+	encode_thread_.clear();
+
+	{
+		std::lock_guard<std::mutex> lock(output_mutex_);
+		abortOutput_ = true;
+		output_cond_var_.notify_all();
+	}
+	if (output_thread_.joinable())
+		output_thread_.join();
+}
+
+void EncodePool::encodeThread(unsigned int num)
+{
+	std::chrono::duration<double> encode_time(0);
+	uint32_t frames = 0;
+
+	EncodeItem encode_item;
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(encode_mutex_);
+			encode_cond_var_.wait(lock, [this] { return abortEncode_ || !encode_queue_.empty(); });
+			if (encode_queue_.empty())
+			{
+				if (frames)
+					LOG(2, name_ << " thread " << num << ": encoded " << frames << " frames, average time "
+										<< encode_time.count() * 1000 / frames << "ms");
+				return;
+			}
+			encode_item = std::move(encode_queue_.front());
+			encode_queue_.pop();
+			if (max_queue_)
+				space_cond_var_.notify_one();
+		}
+
+		// A frame that fails to encode still goes to the output thread, with no buffer, so that the frames
+		// behind it are not held up waiting for its index.
+		uint8_t *encoded_buffer = nullptr;
+		size_t buffer_len = 0;
+		EncodeSlots::Get().Acquire();
+		auto start_time = std::chrono::high_resolution_clock::now();
+		try
+		{
+			TRACE_SCOPE("encode", { "timestamp_us", encode_item.timestamp_us });
+			encode_(num, encode_item, encoded_buffer, buffer_len);
+			encode_time += (std::chrono::high_resolution_clock::now() - start_time);
+			frames++;
+		}
+		catch (std::exception const &e)
+		{
+			LOG_ERROR(name_ << " encoding error: " << e.what());
+			encoded_buffer = nullptr;
+			buffer_len = 0;
+		}
+		EncodeSlots::Get().Release();
+
+		// We push this encoded buffer to another thread so that our application can take its time with the data
+		// without blocking the encode process.
+		// The input buffer can go back straight away, even if earlier frames are still being encoded.
+		input_done_(encode_item.mem);
+
+		OutputItem output_item = { encoded_buffer, buffer_len, encode_item.timestamp_us, encode_item.index };
+		// Let go of the request now rather than when the next item overwrites this one.
+		encode_item = EncodeItem();
+		std::lock_guard<std::mutex> lock(output_mutex_);
+		if (output_queue_.insert(output_item))
+			output_cond_var_.notify_one();
+	}
+}
+
+void EncodePool::outputThread()
+{
+	while (true)
+	{
+		OutputItem item;
+		{
+			// We're only woken when the next frame arrives, or to finish. Everything pushed gets output (frames that
+			// fail are output without a buffer), so once we're asked to finish we just need to run dry.
+			std::unique_lock<std::mutex> lock(output_mutex_);
+			output_cond_var_.wait(lock, [this] {
+				return output_queue_.ready() || (abortOutput_ && output_queue_.empty());
+			});
+			if (!output_queue_.ready())
+				return;
+			item = output_queue_.pop();
+		}
+
+		{
+			TRACE_SCOPE("encode_output", { "timestamp_us", item.timestamp_us }, { "bytes", item.bytes_used });
+			output_(item);
+		}
+		std::lock_guard<std::mutex> lock(encode_mutex_);
+		frames_output_++;
+		space_cond_var_.notify_one();
+	}
+}
@@ -0,0 +1,225 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * encode_pool.hpp - Thread pool shared by the software still-image encoders and rpicam-still's ZSL bursts.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <libcamera/controls.h>
+
+#include "core/completed_request.hpp"
+#include "core/metadata.hpp"
+#include "core/stream_info.hpp"
+
+struct Options;
+
+// A pool of encode threads plus a single output thread. Whichever encode thread is idle picks up the next frame,
+// and the output thread hands the results back in the order the frames were submitted. With --encode-queue, the
+// number of frames waiting for an encode thread is limited, and --encode-queue-policy says what happens to a frame
+// that arrives when the queue is full. Frames also wait, or are dropped, while the encoders' share of the memory budget
+// (--memory-budget) is used up.
+class EncodePool
+{
+public:
+	// Items are only ever moved, so the metadata they carry is shared with the request rather than copied.
+	struct EncodeItem
+	{
+		EncodeItem() = default;
+		EncodeItem(EncodeItem const &) = delete;
+		EncodeItem(EncodeItem &&) = default;
+		EncodeItem &operator=(EncodeItem const &) = delete;
+		EncodeItem &operator=(EncodeItem &&) = default;
+
+		void *mem = nullptr;
+		StreamInfo info;
+		int64_t timestamp_us = 0;
+		uint64_t index = 0;
+		// The queue was full when this frame arrived, so encode it more cheaply if there's a way to.
+		bool degraded = false;
+		Metadata metadata; // Optional metadata for EXIF
+		// Optional metadata for EXIF. Points into the request when we have one, so that it stays alive.
+		std::shared_ptr<libcamera::ControlList const> control_list_metadata;
+	};
+
+	struct OutputItem
+	{
+		void *mem; // nullptr if the frame failed to encode
+		size_t bytes_used;
+		int64_t timestamp_us;
+		uint64_t index;
+	};
+
+	// Encode the item on encode thread "num" into a newly allocated buffer. Exceptions are logged and the frame is
+	// passed to the output function with a null buffer.
+	typedef std::function<void(unsigned int num, EncodeItem &item, uint8_t *&encoded_buffer, size_t &buffer_len)>
+		EncodeFunction;
+	// Deliver an encoded frame. Called on the output thread, in submission order.
+	typedef std::function<void(OutputItem &item)> OutputFunction;
+	// Say that the input buffer "mem" is finished with. Called on the encode thread as soon as the frame has been
+	// encoded (or has failed), so not necessarily in submission order, but always before the frame is output. Frames
+	// dropped from a full queue are finished with in Push(), and are output with no buffer, like failed ones.
+	typedef std::function<void(void *mem)> InputDoneFunction;
+
+	// Frames dropped or degraded so far because the queue was full.
+	struct QueueStats
+	{
+		uint64_t dropped;
+		uint64_t degraded;
+	};
+
+	// The --encode-threads option overrides default_threads when it is set.
+	EncodePool(Options const *options, unsigned int default_threads, std::string const &name);
+	~EncodePool();
+
+	unsigned int NumThreads() const { return num_threads_; }
+	QueueStats GetQueueStats();
+
+	// Start the threads. Per-thread state indexed by thread number must be ready before this is called.
+	void Start(EncodeFunction encode, OutputFunction output, InputDoneFunction input_done);
+
+	// Queue a frame belonging to completed_request. The item holds a reference to the request until it is encoded.
+	void Push(void *mem, StreamInfo const &info, int64_t timestamp_us, CompletedRequestPtr const &completed_request);
+	// As above, but without a request, so the control list has to be copied.
+	void Push(void *mem, StreamInfo const &info, int64_t timestamp_us, Metadata const &metadata,
+			  libcamera::ControlList const &control_list_metadata);
+
+	// Finish encoding and outputting everything that has been pushed, then join the threads.
+	void Stop();
+
+private:
+	// A FIFO that keeps its storage once it has grown, so that pushing and popping frames allocates nothing.
+	template <typename T>
+	class Queue
+	{
+	public:
+		bool empty() const { return size_ == 0; }
+		size_t size() const { return size_; }
+		T &front() { return slots_[head_]; }
+		void pop()
+		{
+			slots_[head_] = T();
+			head_ = (head_ + 1) % slots_.size();
+			size_--;
+		}
+		void push(T &&item)
+		{
+			if (size_ == slots_.size())
+			{
+				std::vector<T> slots(std::max<size_t>(2 * slots_.size(), 8));
+				for (size_t i = 0; i < size_; i++)
+					slots[i] = std::move(slots_[(head_ + i) % slots_.size()]);
+				slots_ = std::move(slots);
+				head_ = 0;
+			}
+			slots_[(head_ + size_++) % slots_.size()] = std::move(item);
+		}
+
+	private:
+		std::vector<T> slots_;
+		size_t head_ = 0;
+		size_t size_ = 0;
+	};
+
+	// Encoded frames waiting for the output thread. They finish in any order, so they're put in a ring of slots by
+	// their index, starting from the next one to go out. The ring grows if a slow frame lets others get far ahead.
+	class ReorderBuffer
+	{
+	public:
+		bool empty() const { return count_ == 0; }
+		// Whether the next frame to go out is here.
+		bool ready() const { return count_ && slots_[head_].ready; }
+		// Returns true if this is the frame the output thread wants next, so that only then need it be woken.
+		bool insert(OutputItem const &item)
+		{
+			size_t offset = item.index - next_;
+			if (offset >= slots_.size())
+			{
+				std::vector<Slot> slots(std::max<size_t>({ 2 * slots_.size(), offset + 1, 8 }));
+				for (size_t i = 0; i < slots_.size(); i++)
+					slots[i] = slots_[(head_ + i) % slots_.size()];
+				slots_ = std::move(slots);
+				head_ = 0;
+			}
+			slots_[(head_ + offset) % slots_.size()] = { item, true };
+			count_++;
+			return offset == 0;
+		}
+		// Only when ready().
+		OutputItem pop()
+		{
+			Slot &slot = slots_[head_];
+			slot.ready = false;
+			head_ = (head_ + 1) % slots_.size();
+			next_++;
+			count_--;
+			return slot.item;
+		}
+
+	private:
+		struct Slot
+		{
+			OutputItem item;
+			bool ready;
+		};
+		std::vector<Slot> slots_;
+		size_t head_ = 0;
+		size_t count_ = 0;
+		uint64_t next_ = 0;
+	};
+
+	enum class Policy
+	{
+		Block,
+		DropOldest,
+		DropNewest,
+		Degrade
+	};
+
+	void push(EncodeItem &&item);
+	void drop(EncodeItem &item);
+	void reportQueueFull();
+	void encodeThread(unsigned int num);
+	void outputThread();
+
+	Options const *options_;
+	std::string name_;
+	unsigned int num_threads_;
+	EncodeFunction encode_;
+	OutputFunction output_;
+	InputDoneFunction input_done_;
+	bool abortEncode_;
+	bool abortOutput_;
+	uint64_t index_;
+	// Frames the output thread has finished with, to tell when we have any on the go.
+	std::atomic<uint64_t> frames_output_;
+
+	Queue<EncodeItem> encode_queue_;
+	std::mutex encode_mutex_;
+	std::condition_variable encode_cond_var_;
+	std::vector<std::thread> encode_thread_;
+	// For a bounded queue, all under encode_mutex_.
+	unsigned int max_queue_;
+	Policy policy_;
+	std::condition_variable space_cond_var_;
+	QueueStats queue_stats_;
+	QueueStats reported_stats_;
+	std::chrono::steady_clock::time_point last_report_;
+
+	ReorderBuffer output_queue_;
+	std::mutex output_mutex_;
+	std::condition_variable output_cond_var_;
+	std::thread output_thread_;
+};
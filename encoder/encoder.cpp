@@ -16,6 +16,7 @@
 #include "h264_encoder.hpp"
 #include "mjpeg_encoder.hpp"
 #include "null_encoder.hpp"
+#include "v4l2_jpeg_encoder.hpp"
 
 #if LIBAV_PRESENT
 #include "libav_encoder.hpp"
@@ -49,6 +50,26 @@ static Encoder *libav_codec_select(VideoOptions *options, const StreamInfo &info
 }
 #endif
 
+Encoder *Encoder::CreateJpeg(VideoOptions const *options, const StreamInfo &info)
+{
+	std::string const &backend = options->Get().jpeg_encoder;
+	// Only the VC4 platforms have a JPEG codec.
+	if (backend == "hardware" || (backend == "auto" && options->GetPlatform() == Platform::VC4))
+	{
+		try
+		{
+			return new V4l2JpegEncoder(options, info);
+		}
+		catch (std::exception const &e)
+		{
+			if (backend == "hardware")
+				throw;
+			LOG(1, "Hardware JPEG encoder unavailable (" << e.what() << "), using libjpeg");
+		}
+	}
+	return new MjpegEncoder(options);
+}
+
 Encoder *Encoder::Create(VideoOptions *options, const StreamInfo &info)
 {
 	if (strcasecmp(options->Get().codec.c_str(), "yuv420") == 0)
@@ -60,6 +81,6 @@ Encoder *Encoder::Create(VideoOptions *options, const StreamInfo &info)
 		return libav_codec_select(options, info);
 #endif
 	else if (strcasecmp(options->Get().codec.c_str(), "mjpeg") == 0)
-		return new MjpegEncoder(options);
+		return CreateJpeg(options, info);
 	throw std::runtime_error("Unrecognised codec " + options->Get().codec);
 }
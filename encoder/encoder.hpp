@@ -11,9 +11,11 @@
 
 #include <libcamera/controls.h>
 
+#include "core/completed_request.hpp"
 #include "core/stream_info.hpp"
 #include "core/video_options.hpp"
 #include "core/metadata.hpp"
+#include "encoder/encode_pool.hpp"
 
 typedef std::function<void(void *)> InputDoneCallback;
 typedef std::function<void(void *, size_t, int64_t, bool)> OutputReadyCallback;
@@ -22,20 +24,46 @@ class Encoder
 {
 public:
 	static Encoder *Create(VideoOptions *options, StreamInfo const &info);
+	// A JPEG encoder for the stream, the hardware one if --jpeg-encoder allows and there is one, otherwise libjpeg.
+	static Encoder *CreateJpeg(VideoOptions const *options, StreamInfo const &info);
 
 	Encoder(VideoOptions const *options) : options_(options) {}
 	virtual ~Encoder() {}
 	// This is where the application sets the callback it gets whenever the encoder
-	// has finished with an input buffer, so the application can re-use it.
+	// has finished with an input buffer, so the application can re-use it. The
+	// callback gets the "mem" pointer that was passed to EncodeBuffer, so buffers
+	// may be returned in any order. Encoders that always finish in order may pass
+	// nullptr instead, meaning the oldest buffer not yet returned.
 	void SetInputDoneCallback(InputDoneCallback callback) { input_done_callback_ = callback; }
 	// This callback is how the application is told that an encoded buffer is
 	// available. The application may not hang on to the memory once it returns
-	// (but the callback is already running in its own thread).
+	// (but the callback is already running in its own thread). The still image
+	// encoders also call it with a null buffer for each frame they drop or fail
+	// to encode, so that it stays in step with the frames submitted.
 	void SetOutputReadyCallback(OutputReadyCallback callback) { output_ready_callback_ = callback; }
 	// Encode the given buffer. The buffer is specified both by an fd and size
 	// describing a DMABUF, and by a mmapped userland pointer.
 	// metadata is optional and may be empty if not available.
 	virtual void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us, Metadata const &post_process_metadata = Metadata(), libcamera::ControlList const &control_list_metadata = libcamera::ControlList()) = 0;
+	// As above, for a buffer belonging to completed_request. Encoders that need the metadata after returning
+	// should keep a reference to the request rather than copying it. By default, the metadata is just passed on.
+	virtual void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us,
+							  CompletedRequestPtr const &completed_request)
+	{
+		EncodeBuffer(fd, size, mem, info, timestamp_us, completed_request->post_process_metadata,
+					 completed_request->metadata);
+	}
+
+	// Whether the encoder needs the DMABUF itself. Encoders that only read "mem" can be given a copy of the frame
+	// instead (see --encode-staging).
+	virtual bool UsesDmabuf() const { return true; }
+
+	// Whether every frame encoded comes back through the output ready callback (with a null buffer if it was
+	// dropped). Encoders that write their own container files don't, so nothing should be queued for the Output.
+	virtual bool OutputsEachFrame() const { return true; }
+
+	// Frames dropped or degraded because the encode queue was full (see --encode-queue).
+	virtual EncodePool::QueueStats GetQueueStats() { return {}; }
 
 protected:
 	InputDoneCallback input_done_callback_;
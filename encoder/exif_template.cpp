@@ -0,0 +1,319 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * exif_template.cpp - EXIF data for the JPEG and PNG encoders.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+
+#include <libexif/exif-data.h>
+
+#include "core/logging.hpp"
+
+#include "exif_template.hpp"
+
+#ifndef MAKE_STRING
+#define MAKE_STRING "Wassoc"
+#endif
+
+static const ExifByteOrder exif_byte_order = EXIF_BYTE_ORDER_INTEL;
+// What goes in front of the TIFF data in a JPEG APP1 marker (and, here, a PNG eXIf chunk).
+static const uint8_t exif_prefix[6] = { 'E', 'x', 'i', 'f', 0, 0 };
+
+// Helper function to create EXIF entry
+static ExifEntry *exif_create_tag(ExifData *exif, ExifIfd ifd, ExifTag tag)
+{
+	ExifEntry *entry = exif_content_get_entry(exif->ifd[ifd], tag);
+	if (entry)
+		return entry;
+	entry = exif_entry_new();
+	if (!entry)
+		throw std::runtime_error("failed to allocate EXIF entry");
+	entry->tag = tag;
+	exif_content_add_entry(exif->ifd[ifd], entry);
+	exif_entry_initialize(entry, entry->tag);
+	// Ensure data is allocated if entry_initialize didn't do it
+	if (entry->size > 0 && !entry->data)
+	{
+		entry->data = (unsigned char *)malloc(entry->size);
+		if (!entry->data)
+			throw std::runtime_error("failed to allocate EXIF entry data");
+		memset(entry->data, 0, entry->size);
+	}
+	exif_entry_unref(entry);
+	return entry;
+}
+
+// Helper function to set EXIF string
+static void exif_set_string(ExifEntry *entry, char const *s)
+{
+	if (entry->data)
+		free(entry->data);
+	entry->size = entry->components = strlen(s);
+	entry->data = (unsigned char *)strdup(s);
+	if (!entry->data)
+		throw std::runtime_error("failed to copy exif string");
+	entry->format = EXIF_FORMAT_ASCII;
+}
+
+// Set an ASCII entry to a fixed size, zero padded, so that it can be overwritten later with anything that fits.
+static void exif_set_padded_string(ExifEntry *entry, std::string const &s, size_t size)
+{
+	if (entry->data)
+		free(entry->data);
+	entry->size = entry->components = size;
+	entry->data = (unsigned char *)calloc(size, 1);
+	if (!entry->data)
+		throw std::runtime_error("failed to allocate exif string");
+	memcpy(entry->data, s.data(), std::min(s.size(), size - 1));
+	entry->format = EXIF_FORMAT_ASCII;
+}
+
+// The TIFF data is little endian (EXIF_BYTE_ORDER_INTEL), whatever the CPU.
+static uint32_t get_le(uint8_t const *p, unsigned int bytes)
+{
+	uint32_t value = 0;
+	for (unsigned int i = bytes; i--;)
+		value = (value << 8) | p[i];
+	return value;
+}
+
+static void put_le(uint8_t *p, uint32_t value, unsigned int bytes)
+{
+	for (unsigned int i = 0; i < bytes; i++, value >>= 8)
+		p[i] = value & 0xff;
+}
+
+// Where the value of a tag in the IFD at ifd is, as an offset into the TIFF data, or 0 if it isn't there. Values of
+// up to 4 bytes live in the directory entry itself, and bigger ones wherever the entry points.
+static size_t find_tag(uint8_t const *tiff, size_t len, size_t ifd, ExifTag tag)
+{
+	if (!ifd || ifd + 2 > len)
+		return 0;
+	unsigned int num_entries = get_le(tiff + ifd, 2);
+	for (size_t entry = ifd + 2; num_entries-- && entry + 12 <= len; entry += 12)
+	{
+		if (get_le(tiff + entry, 2) != tag)
+			continue;
+		size_t size = exif_format_get_size((ExifFormat)get_le(tiff + entry + 2, 2)) * get_le(tiff + entry + 4, 4);
+		size_t value = size <= 4 ? entry + 8 : get_le(tiff + entry + 8, 4);
+		return value + size <= len ? value : 0;
+	}
+	return 0;
+}
+
+bool ExifTemplate::Layout::operator==(Layout const &other) const
+{
+	return camera_serial_number == other.camera_serial_number && has_serial_number == other.has_serial_number &&
+		   has_exposure == other.has_exposure && has_iso == other.has_iso && comment_size == other.comment_size;
+}
+
+ExifTemplate::ExifTemplate()
+	: layout_ {}, date_time_ {}, exposure_(0), iso_(0), comment_(0), last_time_(-1), time_string_ {}
+{
+}
+
+void ExifTemplate::build(Layout const &layout)
+{
+	uint8_t *exif_buffer = nullptr;
+	unsigned int exif_len = 0;
+	ExifData *exif = nullptr;
+
+	try
+	{
+		exif = exif_data_new();
+		if (!exif)
+			throw std::runtime_error("failed to allocate EXIF data");
+		exif_data_set_byte_order(exif, exif_byte_order);
+
+		std::string camera_serial_number = layout.has_serial_number ? layout.camera_serial_number : "Unknown";
+
+		// Add basic EXIF tags to IFD0 (main image directory) for better Windows compatibility
+		ExifEntry *entry = exif_create_tag(exif, EXIF_IFD_0, EXIF_TAG_MAKE);
+		exif_set_string(entry, MAKE_STRING);
+		// Add MODEL tag - Windows Explorer often looks for this
+		entry = exif_create_tag(exif, EXIF_IFD_0, EXIF_TAG_MODEL);
+		exif_set_string(entry, std::string("Shadowgraph-v3 (SN: " + camera_serial_number + ")").c_str()); // Generic model name
+		entry = exif_create_tag(exif, EXIF_IFD_0, EXIF_TAG_SOFTWARE);
+		exif_set_string(entry, "Shadowgraph-v3");
+
+		// Add date/time to IFD0 for Windows Explorer compatibility. These, and the other per-frame values, are only
+		// placeholders here.
+		static char const *placeholder_time = "0000:00:00 00:00:00";
+		entry = exif_create_tag(exif, EXIF_IFD_0, EXIF_TAG_DATE_TIME);
+		exif_set_string(entry, placeholder_time);
+		entry = exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_DATE_TIME_ORIGINAL);
+		exif_set_string(entry, placeholder_time);
+		entry = exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_DATE_TIME_DIGITIZED);
+		exif_set_string(entry, placeholder_time);
+
+		// Add exposure time (shutter speed) - Windows Explorer expects this in EXIF sub-IFD
+		if (layout.has_exposure)
+		{
+			entry = exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_EXPOSURE_TIME);
+			ExifRational exposure = { 0, 1000000 };
+			exif_set_rational(entry->data, exif_byte_order, exposure);
+		}
+
+		// Add ISO (from gains) - Windows Explorer expects this in EXIF sub-IFD
+		if (layout.has_iso)
+			exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_ISO_SPEED_RATINGS);
+
+		// Add fixed f-stop (aperture) value of f/16 to EXIF metadata
+		entry = exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_FNUMBER);
+		// EXIF f-stop is a rational value: numerator=focal/aperture, denominator=1 (for whole numbers)
+		// For f/16, value is 16/1
+		ExifRational fnumber = { 16, 1 }; // f/16
+		exif_set_rational(entry->data, exif_byte_order, fnumber);
+
+		// The comment (lamp color and any strobe timing) goes in as the user comment
+		if (layout.comment_size)
+		{
+			entry = exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_USER_COMMENT);
+			exif_set_padded_string(entry, "", layout.comment_size);
+		}
+
+		// Set focal length to 12mm in EXIF
+		entry = exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_FOCAL_LENGTH);
+		// EXIF focal length is a rational value, so 12/1 = 12mm
+		ExifRational focal_length = { 12, 1 };
+		exif_set_rational(entry->data, exif_byte_order, focal_length);
+
+		// Add camera serial number to EXIF metadata
+		// Try IFD0 first for better Windows Explorer compatibility
+		if (layout.has_serial_number && !camera_serial_number.empty()) {
+			// Try in IFD0 for Windows Explorer compatibility
+			entry = exif_create_tag(exif, EXIF_IFD_0, EXIF_TAG_BODY_SERIAL_NUMBER);
+			exif_set_string(entry, camera_serial_number.c_str());
+			// Also set in EXIF sub-IFD for standard compliance
+			entry = exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_BODY_SERIAL_NUMBER);
+			exif_set_string(entry, camera_serial_number.c_str());
+		}
+
+		// Create the EXIF data buffer
+		// libexif should automatically set up the EXIF sub-IFD pointer when we add tags to EXIF_IFD_EXIF
+		exif_data_save_data(exif, &exif_buffer, &exif_len);
+		if (!exif_buffer || exif_len == 0)
+			throw std::runtime_error("failed to save EXIF data");
+		exif_data_unref(exif);
+		exif = nullptr;
+
+		// libexif gives us the TIFF data, which a JPEG APP1 marker needs "Exif\0\0" in front of.
+		bool needs_prefix = exif_len < 6 || memcmp(exif_buffer, "Exif", 4) != 0;
+		data_.clear();
+		if (needs_prefix)
+			data_.insert(data_.end(), exif_prefix, exif_prefix + sizeof(exif_prefix));
+		data_.insert(data_.end(), exif_buffer, exif_buffer + exif_len);
+		free(exif_buffer);
+		exif_buffer = nullptr;
+	}
+	catch (std::exception const &e)
+	{
+		if (exif)
+			exif_data_unref(exif);
+		if (exif_buffer)
+			free(exif_buffer);
+		data_.clear();
+		throw;
+	}
+
+	// Now find the values that change from frame to frame. Offsets in the TIFF data count from its header.
+	size_t base = sizeof(exif_prefix);
+	uint8_t const *tiff = data_.data() + base;
+	size_t len = data_.size() - base;
+	auto locate = [&](size_t ifd, ExifTag tag) {
+		size_t value = find_tag(tiff, len, ifd, tag);
+		return value ? base + value : 0;
+	};
+	size_t ifd0 = len >= 8 ? get_le(tiff + 4, 4) : 0;
+	size_t exif_ifd = find_tag(tiff, len, ifd0, EXIF_TAG_EXIF_IFD_POINTER);
+	exif_ifd = exif_ifd ? get_le(tiff + exif_ifd, 4) : 0;
+
+	date_time_[0] = locate(ifd0, EXIF_TAG_DATE_TIME);
+	date_time_[1] = locate(exif_ifd, EXIF_TAG_DATE_TIME_ORIGINAL);
+	date_time_[2] = locate(exif_ifd, EXIF_TAG_DATE_TIME_DIGITIZED);
+	exposure_ = layout.has_exposure ? locate(exif_ifd, EXIF_TAG_EXPOSURE_TIME) : 0;
+	iso_ = layout.has_iso ? locate(exif_ifd, EXIF_TAG_ISO_SPEED_RATINGS) : 0;
+	comment_ = layout.comment_size ? locate(exif_ifd, EXIF_TAG_USER_COMMENT) : 0;
+	if (!date_time_[0] || !date_time_[1] || !date_time_[2] || (layout.has_exposure && !exposure_) ||
+		(layout.has_iso && !iso_) || (layout.comment_size && !comment_))
+	{
+		data_.clear();
+		throw std::runtime_error("failed to find EXIF fields in template");
+	}
+
+	LOG(2, "Created EXIF template, length: " << data_.size());
+}
+
+std::string ExifTemplate::Comment(Metadata const &metadata)
+{
+	std::string comment;
+	std::string lamp_color;
+	if (metadata.Get(metadata_tags::lamp_color, lamp_color) == 0)
+		comment = "Lamp color: " + lamp_color;
+	int64_t offset;
+	if (metadata.Get(metadata_tags::strobe_offset, offset) == 0)
+		comment += (comment.empty() ? "" : ", ") + std::string("strobe offset: ") + std::to_string(offset / 1000) + " us";
+	if (metadata.Get(metadata_tags::xvs_offset, offset) == 0)
+		comment += (comment.empty() ? "" : ", ") + std::string("XVS offset: ") + std::to_string(offset / 1000) + " us";
+	return comment;
+}
+
+void ExifTemplate::Make(Metadata const &metadata, std::vector<uint8_t> &exif)
+{
+	Layout layout;
+	layout.has_serial_number = metadata.Get(metadata_tags::camera_serial_number, layout.camera_serial_number) == 0;
+
+	float exposure_time = 0;
+	layout.has_exposure = metadata.Get(metadata_tags::shutter_speed, exposure_time) == 0;
+
+	float ag = 1.0, dg = 1.0;
+	layout.has_iso = metadata.Get(metadata_tags::analogue_gain, ag) == 0;
+	metadata.Get(metadata_tags::digital_gain, dg);
+
+	std::string comment = Comment(metadata);
+	layout.comment_size = comment.empty() ? 0 : (comment.size() + 32) & ~(size_t)31;
+
+	size_t date_time[3], exposure, iso, comment_offset;
+	char time_string[20];
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (data_.empty() || !(layout == layout_))
+		{
+			build(layout);
+			layout_ = layout;
+		}
+		exif = data_;
+		std::copy(std::begin(date_time_), std::end(date_time_), date_time);
+		exposure = exposure_;
+		iso = iso_;
+		comment_offset = comment_;
+
+		std::time_t raw_time;
+		std::time(&raw_time);
+		if (raw_time != last_time_)
+		{
+			std::tm time_info;
+			localtime_r(&raw_time, &time_info);
+			std::strftime(time_string_, sizeof(time_string_), "%Y:%m:%d %H:%M:%S", &time_info);
+			last_time_ = raw_time;
+		}
+		memcpy(time_string, time_string_, sizeof(time_string));
+	}
+
+	// The date/time strings have no terminating zero in the template, hence the - 1.
+	for (size_t offset : date_time)
+		memcpy(exif.data() + offset, time_string, sizeof(time_string) - 1);
+	if (exposure)
+		put_le(exif.data() + exposure, (ExifLong)exposure_time, 4);
+	if (iso)
+		put_le(exif.data() + iso, (ExifShort)(100 * ag * dg), 2);
+	if (comment_offset)
+		memcpy(exif.data() + comment_offset, comment.data(), comment.size());
+}
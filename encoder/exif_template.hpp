@@ -0,0 +1,62 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * exif_template.hpp - EXIF data for the JPEG and PNG encoders.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "core/metadata.hpp"
+
+// Makes the EXIF data that the encoders record for each frame. Nearly all of it is the same every frame, so it is
+// built with libexif only when something structural changes (the serial number, say, or which of the optional
+// fields there are), and otherwise the saved copy just has the date/time, exposure, ISO and comment written
+// over at offsets found when it was built. Any number of encode threads can use one of these at once.
+class ExifTemplate
+{
+public:
+	ExifTemplate();
+
+	// Make the EXIF data for a frame, from its metadata, as the complete payload of an APP1 marker (so starting
+	// "Exif\0\0"). Throws if libexif fails.
+	void Make(Metadata const &metadata, std::vector<uint8_t> &exif);
+
+	// The user comment for a frame: its lamp colour and any measured strobe and XVS offsets. DNGs carry it too.
+	static std::string Comment(Metadata const &metadata);
+
+private:
+	// Everything that changes the layout of the EXIF data rather than just the values in it.
+	struct Layout
+	{
+		bool operator==(Layout const &other) const;
+
+		std::string camera_serial_number;
+		bool has_serial_number;
+		bool has_exposure;
+		bool has_iso;
+		// Room for the comment, rounded up so slightly different colour names and offsets share a template.
+		size_t comment_size;
+	};
+
+	void build(Layout const &layout);
+
+	std::mutex mutex_;
+	Layout layout_;
+	std::vector<uint8_t> data_;
+	// Offsets into data_ of the values we patch, or 0 where the field isn't there.
+	size_t date_time_[3];
+	size_t exposure_;
+	size_t iso_;
+	size_t comment_;
+	// strftime() on every frame isn't free either, so remember the time string for the current second.
+	std::time_t last_time_;
+	char time_string_[20];
+};
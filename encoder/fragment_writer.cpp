@@ -0,0 +1,161 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * fragment_writer.cpp - Write-behind writer for fragmented container files.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include "core/logging.hpp"
+
+#include "fragment_writer.hpp"
+
+FragmentWriter::FragmentWriter(std::string const &filename, size_t buffer_size, unsigned int buffers)
+	: filename_(filename), buffer_size_(buffer_size), position_(0), size_(0), closing_(false), finished_(false),
+	  error_(0)
+{
+	fd_ = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd_ < 0)
+		throw std::runtime_error("FragmentWriter: failed to open " + filename + ": " + strerror(errno));
+
+	free_.resize(std::max(buffers, 2u) - 1);
+	for (Chunk &chunk : free_)
+		chunk.data = std::make_unique<uint8_t[]>(buffer_size_);
+	current_.data = std::make_unique<uint8_t[]>(buffer_size_);
+
+	thread_ = std::thread(&FragmentWriter::writerThread, this);
+	LOG(2, "FragmentWriter: opened " << filename);
+}
+
+FragmentWriter::~FragmentWriter()
+{
+	Close();
+	thread_.join();
+}
+
+int FragmentWriter::Write(uint8_t const *data, size_t size)
+{
+	while (size)
+	{
+		size_t n = std::min(size, buffer_size_ - current_.size);
+		memcpy(current_.data.get() + current_.size, data, n);
+		current_.size += n, position_ += n, data += n, size -= n;
+		size_ = std::max(size_, position_);
+		if (current_.size == buffer_size_)
+			queue(false);
+	}
+	std::lock_guard<std::mutex> lock(mutex_);
+	return error_;
+}
+
+int FragmentWriter::Sync()
+{
+	queue(true);
+	std::lock_guard<std::mutex> lock(mutex_);
+	return error_;
+}
+
+int64_t FragmentWriter::Seek(int64_t offset, int whence)
+{
+	if (whence == SEEK_CUR)
+		offset += position_;
+	else if (whence == SEEK_END)
+		offset += size_;
+	else if (whence != SEEK_SET)
+		return -EINVAL;
+	if (offset < 0)
+		return -EINVAL;
+
+	// What we have so far still goes where it was written; the next buffer starts at the new position.
+	if (current_.size)
+		queue(false);
+	position_ = offset;
+	return position_;
+}
+
+void FragmentWriter::Close()
+{
+	if (closing_)
+		return;
+	queue(true);
+	std::lock_guard<std::mutex> lock(mutex_);
+	closing_ = true;
+	cond_.notify_one();
+}
+
+bool FragmentWriter::Finished()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return finished_;
+}
+
+void FragmentWriter::queue(bool sync)
+{
+	if (!current_.size && !sync)
+		return;
+
+	current_.offset = position_ - current_.size;
+	current_.sync = sync;
+	Chunk next;
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		// Only when the writer has fallen behind by every buffer does anyone have to wait for it.
+		free_cond_.wait(lock, [this] { return !free_.empty(); });
+		next = std::move(free_.back());
+		free_.pop_back();
+		queue_.push_back(std::move(current_));
+		cond_.notify_one();
+	}
+	current_ = std::move(next);
+	current_.size = 0;
+}
+
+void FragmentWriter::writerThread()
+{
+	while (true)
+	{
+		Chunk chunk;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			cond_.wait(lock, [this] { return closing_ || !queue_.empty(); });
+			if (queue_.empty())
+				break;
+			chunk = std::move(queue_.front());
+			queue_.pop_front();
+		}
+
+		int error = 0;
+		for (size_t done = 0; done < chunk.size && !error;)
+		{
+			ssize_t ret = pwrite(fd_, chunk.data.get() + done, chunk.size - done, chunk.offset + done);
+			if (ret > 0)
+				done += ret;
+			else if (ret == 0 || errno != EINTR)
+				error = ret ? errno : EIO;
+		}
+		if (!error && chunk.sync && fdatasync(fd_))
+			error = errno;
+		if (error)
+			LOG_ERROR("ERROR: FragmentWriter: failed to write " << filename_ << ": " << strerror(error));
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (error && !error_)
+			error_ = error;
+		free_.push_back(std::move(chunk));
+		free_cond_.notify_one();
+	}
+
+	if (close(fd_))
+		LOG_ERROR("ERROR: FragmentWriter: failed to close " << filename_ << ": " << strerror(errno));
+	LOG(2, "FragmentWriter: closed " << filename_);
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	finished_ = true;
+}
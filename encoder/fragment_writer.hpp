@@ -0,0 +1,76 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * fragment_writer.hpp - Write-behind writer for fragmented container files.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Streams one file out to disk on a thread of its own, from a fixed set of buffers allocated when it's opened, so that
+// whoever is writing never waits for the storage unless it falls behind by all of them. Data goes to disk a whole
+// buffer at a time, so that all but the last write of each fragment are the same large size. Sync() marks the end of
+// a fragment: what has been written so far goes out and is synced, so a power cut loses no more than the fragment that
+// was being made.
+class FragmentWriter
+{
+public:
+	// Throws if the file can't be opened.
+	FragmentWriter(std::string const &filename, size_t buffer_size, unsigned int buffers);
+	// Writes out anything still queued and closes the file, waiting for all of that to happen.
+	~FragmentWriter();
+
+	// These return 0, or the (positive) errno of the first write that failed.
+	int Write(uint8_t const *data, size_t size);
+	int Sync();
+	// Seeking doesn't wait for anything, as each buffer is written where it belongs.
+	int64_t Seek(int64_t offset, int whence);
+	int64_t Size() const { return size_; }
+
+	// Queue what's left and close the file once it's all written, without waiting.
+	void Close();
+	// Whether a closed file is finished with.
+	bool Finished();
+
+	std::string const &Filename() const { return filename_; }
+
+private:
+	struct Chunk
+	{
+		std::unique_ptr<uint8_t[]> data;
+		size_t size = 0;
+		int64_t offset = 0;
+		bool sync = false;
+	};
+
+	void queue(bool sync);
+	void writerThread();
+
+	std::string filename_;
+	int fd_;
+	size_t buffer_size_;
+
+	// The buffer being filled, and where in the file it goes.
+	Chunk current_;
+	int64_t position_;
+	int64_t size_;
+
+	std::mutex mutex_;
+	std::condition_variable cond_;
+	std::condition_variable free_cond_;
+	std::deque<Chunk> queue_;
+	std::vector<Chunk> free_;
+	bool closing_;
+	bool finished_;
+	int error_;
+	std::thread thread_;
+};
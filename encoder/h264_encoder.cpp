@@ -7,11 +7,13 @@
 
 #include <fcntl.h>
 #include <poll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 
 #include <linux/videodev2.h>
 
+#include <algorithm>
 #include <chrono>
 #include <iostream>
 #include "core/metadata.hpp"
@@ -101,6 +103,45 @@ H264Encoder::H264Encoder(VideoOptions const *options, StreamInfo const &info)
 		if (xioctl(fd_, VIDIOC_S_CTRL, &ctrl) < 0)
 			throw std::runtime_error("failed to set inline headers");
 	}
+	if (options->Get().low_latency)
+	{
+		// B-frames would hold frames back until the next P-frame is encoded.
+		ctrl.id = V4L2_CID_MPEG_VIDEO_B_FRAMES;
+		ctrl.value = 0;
+		if (xioctl(fd_, VIDIOC_S_CTRL, &ctrl) < 0)
+			LOG(2, "H264: no B-frames control");
+
+		// Intra refresh spreads the intra coding over a second's worth of frames, so that there are no big IDR
+		// frames to queue up behind. The codec may only offer the older per-frame macroblock count control.
+		int fps = options->Get().framerate.value_or(DEFAULT_FRAMERATE);
+		unsigned int refresh = options->Get().intra ? options->Get().intra : std::max(fps, 1);
+		bool intra_refresh = false;
+#ifdef V4L2_CID_MPEG_VIDEO_INTRA_REFRESH_PERIOD
+		ctrl.id = V4L2_CID_MPEG_VIDEO_INTRA_REFRESH_PERIOD;
+		ctrl.value = refresh;
+		intra_refresh = xioctl(fd_, VIDIOC_S_CTRL, &ctrl) == 0;
+#endif
+		if (!intra_refresh)
+		{
+			unsigned int mbs = ((info.width + 15) / 16) * ((info.height + 15) / 16);
+			ctrl.id = V4L2_CID_MPEG_VIDEO_CYCLIC_INTRA_REFRESH_MB;
+			ctrl.value = (mbs + refresh - 1) / refresh;
+			intra_refresh = xioctl(fd_, VIDIOC_S_CTRL, &ctrl) == 0;
+		}
+
+		if (!intra_refresh)
+			LOG_ERROR("WARNING: H264: intra refresh not supported, using periodic IDR frames");
+		else if (!options->Get().intra)
+		{
+			// Keep an occasional IDR frame for clients that join late, or for resuming after a pause.
+			ctrl.id = V4L2_CID_MPEG_VIDEO_H264_I_PERIOD;
+			ctrl.value = refresh * LOW_LATENCY_IDR_REFRESHES;
+			if (xioctl(fd_, VIDIOC_S_CTRL, &ctrl) < 0)
+				throw std::runtime_error("failed to set intra period");
+		}
+		LOG(2, "H264: low latency, " << (intra_refresh ? "intra refresh every " : "IDR every ") << refresh
+									 << " frames");
+	}
 
 	// Set the output and capture formats. We know exactly what they will be.
 
@@ -161,12 +202,14 @@ H264Encoder::H264Encoder(VideoOptions const *options, StreamInfo const &info)
 		input_buffers_available_.push(i);
 
 	reqbufs = {};
-	reqbufs.count = NUM_CAPTURE_BUFFERS;
+	reqbufs.count = options->Get().low_latency ? LOW_LATENCY_CAPTURE_BUFFERS : NUM_CAPTURE_BUFFERS;
 	reqbufs.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
 	reqbufs.memory = V4L2_MEMORY_MMAP;
 	if (xioctl(fd_, VIDIOC_REQBUFS, &reqbufs) < 0)
 		throw std::runtime_error("request for capture buffers failed");
 	LOG(2, "Got " << reqbufs.count << " capture buffers");
+	if (reqbufs.count > NUM_CAPTURE_BUFFERS)
+		throw std::runtime_error("codec wants too many capture buffers: " + std::to_string(reqbufs.count));
 	num_capture_buffers_ = reqbufs.count;
 
 	for (unsigned int i = 0; i < reqbufs.count; i++)
@@ -201,6 +244,10 @@ H264Encoder::H264Encoder(VideoOptions const *options, StreamInfo const &info)
 		throw std::runtime_error("failed to start capture streaming");
 	LOG(2, "Codec streaming started");
 
+	abort_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (abort_fd_ < 0)
+		throw std::runtime_error("failed to create eventfd");
+
 	output_thread_ = std::thread(&H264Encoder::outputThread, this);
 	poll_thread_ = std::thread(&H264Encoder::pollThread, this);
 }
@@ -208,8 +255,16 @@ H264Encoder::H264Encoder(VideoOptions const *options, StreamInfo const &info)
 H264Encoder::~H264Encoder()
 {
 	abortPoll_ = true;
+	uint64_t one = 1;
+	if (write(abort_fd_, &one, sizeof(one)) < 0)
+		LOG(1, "Failed to wake poll thread");
 	poll_thread_.join();
-	abortOutput_ = true;
+	close(abort_fd_);
+	{
+		std::lock_guard<std::mutex> lock(output_mutex_);
+		abortOutput_ = true;
+	}
+	output_cond_var_.notify_one();
 	output_thread_.join();
 
 	// Turn off streaming on both the output and capture queues, and "free" the
@@ -278,8 +333,17 @@ void H264Encoder::pollThread()
 {
 	while (true)
 	{
-		pollfd p = { fd_, POLLIN, 0 };
-		int ret = poll(&p, 1, 200);
+		// No timeout, so every encoded frame is passed on the moment the codec has it, and abort_fd_ wakes us up
+		// to stop.
+		pollfd p[2] = { { fd_, POLLIN, 0 }, { abort_fd_, POLLIN, 0 } };
+		int ret = poll(p, 2, -1);
+		if (ret > 0 && (p[1].revents & POLLIN))
+		{
+			// Clear it, or we'd spin while the codec gives back the last of its inputs.
+			uint64_t count;
+			if (read(abort_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN)
+				throw std::runtime_error("failed to read eventfd");
+		}
 		{
 			std::lock_guard<std::mutex> lock(input_buffers_available_mutex_);
 			if (abortPoll_ && input_buffers_available_.size() == NUM_OUTPUT_BUFFERS)
@@ -291,7 +355,7 @@ void H264Encoder::pollThread()
 				continue;
 			throw std::runtime_error("unexpected errno " + std::to_string(errno) + " from poll");
 		}
-		if (p.revents & POLLIN)
+		if (p[0].revents & POLLIN)
 		{
 			v4l2_buffer buf = {};
 			v4l2_plane planes[VIDEO_MAX_PLANES] = {};
@@ -344,24 +408,13 @@ void H264Encoder::outputThread()
 	while (true)
 	{
 		{
+			// Items still in the queue when we're asked to stop must have their callbacks.
 			std::unique_lock<std::mutex> lock(output_mutex_);
-			while (true)
-			{
-				using namespace std::chrono_literals;
-				// Must check the abort first, to allow items in the output
-				// queue to have a callback.
-				if (abortOutput_ && output_queue_.empty())
-					return;
-
-				if (!output_queue_.empty())
-				{
-					item = output_queue_.front();
-					output_queue_.pop();
-					break;
-				}
-				else
-					output_cond_var_.wait_for(lock, 200ms);
-			}
+			output_cond_var_.wait(lock, [this] { return abortOutput_ || !output_queue_.empty(); });
+			if (output_queue_.empty())
+				return;
+			item = output_queue_.front();
+			output_queue_.pop();
 		}
 
 		output_ready_callback_(item.mem, item.bytes_used, item.timestamp_us, item.keyframe);
@@ -20,6 +20,7 @@ class H264Encoder : public Encoder
 public:
 	H264Encoder(VideoOptions const *options, StreamInfo const &info);
 	~H264Encoder();
+	using Encoder::EncodeBuffer;
 	// Encode the given DMABUF.
 	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us, Metadata const &post_process_metadata = Metadata(), libcamera::ControlList const &control_list_metadata = libcamera::ControlList()) override;
 
@@ -30,6 +31,10 @@ private:
 	// dealing with the output bitstream.
 	static constexpr int NUM_OUTPUT_BUFFERS = 6;
 	static constexpr int NUM_CAPTURE_BUFFERS = 12;
+	// With --low-latency we would rather drop frames than have the bitstream queue up behind a slow network.
+	static constexpr int LOW_LATENCY_CAPTURE_BUFFERS = 3;
+	// And with intra refresh, there's still an IDR frame after this many refresh periods.
+	static constexpr int LOW_LATENCY_IDR_REFRESHES = 10;
 
 	// This thread just sits waiting for the encoder to finish stuff. It will either:
 	// * receive "output" buffers (codec inputs), which we must return to the caller
@@ -44,6 +49,8 @@ private:
 	bool abortPoll_;
 	bool abortOutput_;
 	int fd_;
+	// An eventfd that wakes the poll thread when we're asked to stop.
+	int abort_fd_;
 	struct BufferDescription
 	{
 		void *mem;
@@ -0,0 +1,181 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * jpeg_bands.cpp - Compress one YUV420 JPEG on several cores at once.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+
+#include <jpeglib.h>
+
+#include "core/logging.hpp"
+#include "post_processing_stages/parallel_rows.hpp"
+
+#include "jpeg_bands.hpp"
+
+#if JPEG_LIB_VERSION_MAJOR > 9 || (JPEG_LIB_VERSION_MAJOR == 9 && JPEG_LIB_VERSION_MINOR >= 4)
+typedef size_t jpeg_mem_len_t;
+#else
+typedef unsigned long jpeg_mem_len_t;
+#endif
+
+// Restart markers count RST0 to RST7 and round again. Starting every band on a multiple of 8 MCU rows (of 16 lines)
+// means the markers each band writes are exactly the ones it would have had in a single stream, and the marker
+// between two bands is always RST7.
+static constexpr unsigned int BAND_ALIGN = 8 * 16;
+
+struct JpegBand
+{
+	unsigned int first_row;
+	unsigned int num_rows;
+	unsigned char *data;
+	jpeg_mem_len_t size;
+};
+
+static void encode_band(uint8_t const *input, StreamInfo const &info, int quality,
+						std::vector<uint8_t> const *app1, JpegBand &band)
+{
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_compress(&cinfo);
+
+	cinfo.image_width = info.width;
+	cinfo.image_height = band.num_rows;
+	cinfo.input_components = 3;
+	cinfo.in_color_space = JCS_YCbCr;
+
+	// The defaults give every band the same quantisation and (standard) Huffman tables, which is what lets them share
+	// the first band's headers. jpeg_set_defaults() clears the restart settings, so they come after it.
+	jpeg_set_defaults(&cinfo);
+	cinfo.raw_data_in = TRUE;
+	cinfo.restart_in_rows = 1;
+	jpeg_set_quality(&cinfo, quality, TRUE);
+	band.data = nullptr;
+	band.size = 0;
+	jpeg_mem_dest(&cinfo, &band.data, &band.size);
+	jpeg_start_compress(&cinfo, TRUE);
+	if (app1)
+		jpeg_write_marker(&cinfo, JPEG_APP0 + 1, app1->data(), app1->size());
+
+	// As in YUV420_to_JPEG_fast, but the last rows are repeated at the end of the band, which only matters for the
+	// last band as the others are a whole number of MCU rows.
+	int stride2 = info.stride / 2;
+	unsigned int last_row = band.first_row + band.num_rows - 1;
+	uint8_t *Y_plane = (uint8_t *)input;
+	uint8_t *U_plane = Y_plane + info.stride * info.height;
+	uint8_t *V_plane = U_plane + stride2 * (info.height / 2);
+	uint8_t *Y_max = Y_plane + info.stride * last_row;
+	uint8_t *U_max = U_plane + stride2 * (last_row / 2);
+	uint8_t *V_max = V_plane + stride2 * (last_row / 2);
+
+	JSAMPROW y_rows[16];
+	JSAMPROW u_rows[8];
+	JSAMPROW v_rows[8];
+
+	uint8_t *Y_row = Y_plane + info.stride * band.first_row;
+	uint8_t *U_row = U_plane + stride2 * (band.first_row / 2);
+	uint8_t *V_row = V_plane + stride2 * (band.first_row / 2);
+	while (cinfo.next_scanline < band.num_rows)
+	{
+		for (int i = 0; i < 16; i++, Y_row += info.stride)
+			y_rows[i] = std::min(Y_row, Y_max);
+		for (int i = 0; i < 8; i++, U_row += stride2, V_row += stride2)
+			u_rows[i] = std::min(U_row, U_max), v_rows[i] = std::min(V_row, V_max);
+
+		JSAMPARRAY rows[] = { y_rows, u_rows, v_rows };
+		jpeg_write_raw_data(&cinfo, rows, 16);
+	}
+
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+}
+
+// Where the entropy coded data starts, just after the SOS marker segment, also returning where the SOF0 one is.
+static size_t find_scan(JpegBand const &band, size_t &sof)
+{
+	size_t pos = 2; // skip SOI
+	while (pos + 4 <= band.size && band.data[pos] == 0xff)
+	{
+		uint8_t marker = band.data[pos + 1];
+		size_t len = (band.data[pos + 2] << 8) | band.data[pos + 3];
+		if (marker == 0xc0)
+			sof = pos;
+		pos += 2 + len;
+		if (marker == 0xda)
+			return pos;
+	}
+	throw std::runtime_error("JPEG band has no scan");
+}
+
+void YUV420_to_JPEG_bands(uint8_t const *input, StreamInfo const &info, int quality, unsigned int num_bands,
+						  std::vector<uint8_t> const &app1, uint8_t *&jpeg_buffer, size_t &jpeg_len)
+{
+	if (num_bands == 0)
+		num_bands = std::max(std::thread::hardware_concurrency(), 1u);
+
+	unsigned int groups = (info.height + BAND_ALIGN - 1) / BAND_ALIGN;
+	num_bands = std::max(std::min(num_bands, groups), 1u);
+	unsigned int band_rows = (groups + num_bands - 1) / num_bands * BAND_ALIGN;
+	std::vector<JpegBand> bands;
+	for (unsigned int row = 0; row < info.height; row += band_rows)
+		bands.push_back({ row, std::min(band_rows, info.height - row), nullptr, 0 });
+
+	ParallelFor(bands.size(), [&](unsigned int i) {
+		encode_band(input, info, quality, i == 0 && !app1.empty() ? &app1 : nullptr, bands[i]);
+	});
+
+	try
+	{
+		// The first band supplies all the headers, once its height is the whole image's. Each band's data ends with
+		// an EOI, which we drop, putting an RST7 between the bands instead.
+		size_t sof = 0;
+		size_t header_len = find_scan(bands[0], sof);
+		if (!sof)
+			throw std::runtime_error("JPEG band has no SOF0");
+		std::vector<size_t> scan(bands.size());
+		size_t total = header_len + 2;
+		for (unsigned int i = 0; i < bands.size(); i++)
+		{
+			size_t unused;
+			scan[i] = i ? find_scan(bands[i], unused) : header_len;
+			total += bands[i].size - 2 - scan[i] + (i ? 2 : 0);
+		}
+
+		jpeg_buffer = (uint8_t *)malloc(total);
+		if (!jpeg_buffer)
+			throw std::runtime_error("failed to allocate JPEG buffer");
+		uint8_t *dst = jpeg_buffer;
+		memcpy(dst, bands[0].data, header_len);
+		dst[sof + 5] = info.height >> 8;
+		dst[sof + 6] = info.height & 0xff;
+		dst += header_len;
+		for (unsigned int i = 0; i < bands.size(); i++)
+		{
+			if (i)
+				*dst++ = 0xff, *dst++ = 0xd7;
+			size_t len = bands[i].size - 2 - scan[i];
+			memcpy(dst, bands[i].data + scan[i], len);
+			dst += len;
+		}
+		*dst++ = 0xff, *dst++ = 0xd9;
+		jpeg_len = dst - jpeg_buffer;
+	}
+	catch (std::exception const &)
+	{
+		for (auto &band : bands)
+			free(band.data);
+		throw;
+	}
+
+	for (auto &band : bands)
+		free(band.data);
+	LOG(2, "JPEG compressed in " << bands.size() << " bands of " << band_rows << " rows");
+}
@@ -0,0 +1,22 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * jpeg_bands.hpp - Compress one YUV420 JPEG on several cores at once.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "core/stream_info.hpp"
+
+// Compress a YUV420 image as a single baseline JPEG, in up to num_bands horizontal bands at once (0 meaning one per
+// CPU core). Each band is a separate libjpeg stream with a restart marker after every MCU row, and the entropy coded
+// segments are joined with RST markers, so the result decodes like any other JPEG with restart intervals. Any app1
+// payload is written as an APP1 marker straight after the JFIF one. The buffer comes from malloc(), and the caller
+// must free() it.
+void YUV420_to_JPEG_bands(uint8_t const *input, StreamInfo const &info, int quality, unsigned int num_bands,
+						  std::vector<uint8_t> const &app1, uint8_t *&jpeg_buffer, size_t &jpeg_len);
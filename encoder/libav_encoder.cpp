@@ -14,6 +14,7 @@
 #include <libdrm/drm_fourcc.h>
 #include <linux/videodev2.h>
 
+#include <algorithm>
 #include <chrono>
 #include <iostream>
 
@@ -74,9 +75,8 @@ void encoderOptionsGeneral(VideoOptions const *options, AVCodecContext *codec)
 	}
 }
 
-void encoderOptionsH264M2M(VideoOptions const *options, AVCodecContext *codec)
+void encoderOptionsV4l2M2M(VideoOptions const *options, AVCodecContext *codec)
 {
-	codec->pix_fmt = AV_PIX_FMT_DRM_PRIME;
 	codec->max_b_frames = 0;
 }
 
@@ -114,10 +114,58 @@ void encoderOptionsLibx264(VideoOptions const *options, AVCodecContext *codec)
 
 const std::map<std::string, std::function<void(VideoOptions const *, AVCodecContext *)>> optionsMap =
 {
-	{ "h264_v4l2m2m", encoderOptionsH264M2M },
+	{ "h264_v4l2m2m", encoderOptionsV4l2M2M },
+	{ "hevc_v4l2m2m", encoderOptionsV4l2M2M },
 	{ "libx264", encoderOptionsLibx264 },
 };
 
+// The pixel formats the codec says it takes, or nullptr if it doesn't say.
+const AVPixelFormat *codecPixelFormats(const AVCodec *codec)
+{
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(61, 13, 100)
+	const void *fmts = nullptr;
+	int num = 0;
+	if (avcodec_get_supported_config(nullptr, codec, AV_CODEC_CONFIG_PIX_FORMAT, 0, &fmts, &num) < 0)
+		return nullptr;
+	return (const AVPixelFormat *)fmts;
+#else
+	return codec->pix_fmts;
+#endif
+}
+
+// Choose how frames get to the codec. Either way the camera's buffer is used where it is, and never copied: codecs
+// that import dmabufs are given the fd in a DRM_PRIME descriptor, and everything else reads the YUV420 planes
+// straight out of the mmapped buffer.
+AVPixelFormat selectInputFormat(const AVCodec *codec)
+{
+	const AVPixelFormat *fmts = codecPixelFormats(codec);
+	if (!fmts)
+	{
+		// Not all the V4L2 M2M encoders list their formats, but they all take dmabufs.
+		std::string name = codec->name;
+		const std::string m2m { "_v4l2m2m" };
+		bool is_m2m = name.size() > m2m.size() && name.compare(name.size() - m2m.size(), m2m.size(), m2m) == 0;
+		return is_m2m ? AV_PIX_FMT_DRM_PRIME : AV_PIX_FMT_YUV420P;
+	}
+
+	bool yuv420p = false, yuvj420p = false;
+	for (const AVPixelFormat *fmt = fmts; *fmt != AV_PIX_FMT_NONE; fmt++)
+	{
+		if (*fmt == AV_PIX_FMT_DRM_PRIME)
+			return AV_PIX_FMT_DRM_PRIME;
+		yuv420p |= *fmt == AV_PIX_FMT_YUV420P;
+		yuvj420p |= *fmt == AV_PIX_FMT_YUVJ420P;
+	}
+
+	// YUVJ420P is laid out just the same, it only differs in the (deprecated) range it implies.
+	if (yuv420p)
+		return AV_PIX_FMT_YUV420P;
+	else if (yuvj420p)
+		return AV_PIX_FMT_YUVJ420P;
+
+	throw std::runtime_error(std::string("libav: ") + codec->name + " takes neither dmabufs nor YUV420 images");
+}
+
 } // namespace
 
 void LibAvEncoder::initVideoCodec(VideoOptions const *options, StreamInfo const &info)
@@ -135,7 +183,13 @@ void LibAvEncoder::initVideoCodec(VideoOptions const *options, StreamInfo const
 	// usec timebase
 	codec_ctx_[Video]->time_base = { 1, 1000 * 1000 };
 	codec_ctx_[Video]->sw_pix_fmt = AV_PIX_FMT_YUV420P;
-	codec_ctx_[Video]->pix_fmt = AV_PIX_FMT_YUV420P;
+	codec_ctx_[Video]->pix_fmt = selectInputFormat(codec);
+
+	LOG(1, "libav: " << codec->name << " (" << (codec->capabilities & AV_CODEC_CAP_HARDWARE ? "hardware" : "software")
+					 << ") is fed "
+					 << (codec_ctx_[Video]->pix_fmt == AV_PIX_FMT_DRM_PRIME ? "dmabufs (DRM_PRIME)"
+																			 : "the mmapped buffers (YUV420)")
+					 << ", without copying");
 
 	if (info.colour_space)
 	{
@@ -200,8 +254,10 @@ void LibAvEncoder::initVideoCodec(VideoOptions const *options, StreamInfo const
 			output_file_.find(tcp.c_str(), 0, tcp.length()) != std::string::npos ||
 			output_file_.find(udp.c_str(), 0, udp.length()) != std::string::npos)
 		{
-			if (options->Get().libav_video_codec == "h264_v4l2m2m" || options->Get().libav_video_codec == "libx264")
+			if (codec->id == AV_CODEC_ID_H264)
 				format = "h264";
+			else if (codec->id == AV_CODEC_ID_HEVC)
+				format = "hevc";
 			else
 				throw std::runtime_error("libav: please specify output format with the --libav-format argument");
 		}
@@ -219,15 +275,17 @@ void LibAvEncoder::initVideoCodec(VideoOptions const *options, StreamInfo const
 			output_file_ += listen;
 	}
 
-	elementary_stream_ = (options->Get().libav_format.empty() || options->Get().libav_format == "h264") &&
+	elementary_stream_ = (options->Get().libav_format.empty() || options->Get().libav_format == "h264" ||
+						  options->Get().libav_format == "hevc") &&
 						 !output_file_.empty() &&
 						 (output_file_.find("264", output_file_.length() - 3) != std::string::npos ||
-						  output_file_.find("h264", output_file_.length() - 4) != std::string::npos);
+						  output_file_.find("265", output_file_.length() - 3) != std::string::npos ||
+						  output_file_.find("hevc", output_file_.length() - 4) != std::string::npos);
 
-	if (!elementary_stream_ && (options->Get().circular || options->Get().segment || !options->Get().save_pts.empty() ||
-								options->Get().split || options->Get().initial == "pause"))
+	if (!elementary_stream_ && (options->Get().circular || !options->Get().save_pts.empty() || options->Get().split ||
+								options->Get().initial == "pause"))
 	{
-		LOG_ERROR("\nERROR: The libav encoder does not currently support the circular, segment, save_pts, "
+		LOG_ERROR("\nERROR: The libav encoder does not currently support the circular, save_pts, "
 				  "split, or pause command line options with non-elementary streams!\n");
 		throw std::runtime_error("libav: Incompatible options selected.");
 	}
@@ -237,6 +295,9 @@ void LibAvEncoder::initVideoCodec(VideoOptions const *options, StreamInfo const
 	if (!out_fmt_ctx_)
 		throw std::runtime_error("libav: cannot allocate output context, try setting with --libav-format");
 
+	if (!elementary_stream_)
+		initContainer(options);
+
 	if (out_fmt_ctx_->oformat->flags & AVFMT_GLOBALHEADER)
 		codec_ctx_[Video]->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
 
@@ -367,10 +428,215 @@ void LibAvEncoder::initAudioOutCodec(VideoOptions const *options, StreamInfo con
 	avcodec_parameters_from_context(stream_[AudioOut]->codecpar, codec_ctx_[AudioOut]);
 }
 
+namespace
+{
+
+// FragmentWriters write in buffers of this size, with this many per file.
+constexpr size_t FRAGMENT_BUFFER_SIZE = 1 << 20;
+constexpr unsigned int FRAGMENT_BUFFERS = 4;
+// The AVIOContext's own buffer in front of that, which the muxer fills a little at a time.
+constexpr int AVIO_BUFFER_SIZE = 64 * 1024;
+
+// Packets that can wait for the mux thread before the encoders have to, a couple of seconds' worth of video and audio.
+constexpr size_t MUX_QUEUE_SIZE = 128;
+// How often the mux thread's statistics are logged.
+constexpr std::chrono::seconds MUX_REPORT_INTERVAL(5);
+
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+typedef const uint8_t AvioBuffer;
+#else
+typedef uint8_t AvioBuffer;
+#endif
+
+struct FragmentIo
+{
+	std::unique_ptr<FragmentWriter> writer;
+	// The time of the last sync point the muxer marked.
+	int64_t fragment_time = AV_NOPTS_VALUE;
+};
+
+int fragmentWriteData(void *opaque, AvioBuffer *buf, int size, AVIODataMarkerType type, int64_t time)
+{
+	FragmentIo *io = static_cast<FragmentIo *>(opaque);
+	// The muxer marks the start of each fragment, so everything written before it is complete and can be synced.
+	if ((type == AVIO_DATA_MARKER_SYNC_POINT || type == AVIO_DATA_MARKER_BOUNDARY_POINT) && time != io->fragment_time)
+	{
+		io->fragment_time = time;
+		if (int error = io->writer->Sync())
+			return AVERROR(error);
+	}
+	int error = io->writer->Write(buf, size);
+	return error ? AVERROR(error) : size;
+}
+
+int fragmentWrite(void *opaque, AvioBuffer *buf, int size)
+{
+	return fragmentWriteData(opaque, buf, size, AVIO_DATA_MARKER_UNKNOWN, AV_NOPTS_VALUE);
+}
+
+int64_t fragmentSeek(void *opaque, int64_t offset, int whence)
+{
+	FragmentIo *io = static_cast<FragmentIo *>(opaque);
+	if (whence & AVSEEK_SIZE)
+		return io->writer->Size();
+	int64_t pos = io->writer->Seek(offset, whence & ~AVSEEK_FORCE);
+	return pos < 0 ? AVERROR(-pos) : pos;
+}
+
+bool endsWith(std::string const &s, std::string const &end)
+{
+	return s.size() >= end.size() && s.compare(s.size() - end.size(), end.size(), end) == 0;
+}
+
+} // namespace
+
+void LibAvEncoder::initContainer(VideoOptions const *options)
+{
+	const std::string muxer = out_fmt_ctx_->oformat->name;
+	const bool mov = muxer == "mp4" || muxer == "mov" || muxer == "ipod" || muxer == "ismv";
+	const bool hls = muxer == "hls";
+	const uint32_t fragment = options->Get().libav_fragment, segment = options->Get().segment;
+
+	if ((segment || fragment) && !mov && !hls)
+	{
+		LOG_ERROR("\nERROR: With non-elementary streams, the libav encoder supports --segment and --libav-fragment "
+				  "only for MP4/MOV and HLS output!\n");
+		throw std::runtime_error("libav: Incompatible options selected.");
+	}
+	if (!segment && !fragment)
+		return;
+
+	// A fragmented file has a header with no samples in it, followed by self-contained fragments that each start on a
+	// keyframe, so everything up to the last complete fragment can be played even if the file is never finished.
+	const std::string movflags = "+frag_keyframe+empty_moov+default_base_moof";
+	const std::string min_frag = std::to_string((uint64_t)fragment * 1000);
+	char segment_time[32];
+	snprintf(segment_time, sizeof(segment_time), "%.3f", segment / 1000.0);
+
+	if (hls)
+	{
+		// HLS with fMP4 segments, the same CMAF-style fragments as above.
+		av_dict_set(&format_opts_, "hls_segment_type", "fmp4", 0);
+		if (segment)
+			av_dict_set(&format_opts_, "hls_time", segment_time, 0);
+	}
+	else if (segment)
+	{
+		// The segment muxer starts a new file on the first keyframe after each segment time, writing the MP4/MOV
+		// into it itself.
+		if (output_file_.find('%') == std::string::npos)
+		{
+			size_t dot = output_file_.rfind('.');
+			size_t slash = output_file_.rfind('/');
+			if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+				dot = output_file_.size();
+			output_file_.insert(dot, "_%04d");
+			LOG(1, "libav: writing segments to " << output_file_);
+		}
+
+		avformat_free_context(out_fmt_ctx_);
+		out_fmt_ctx_ = nullptr;
+		avformat_alloc_output_context2(&out_fmt_ctx_, nullptr, "segment", output_file_.c_str());
+		if (!out_fmt_ctx_)
+			throw std::runtime_error("libav: cannot allocate segment output context");
+
+		av_dict_set(&format_opts_, "segment_format", muxer.c_str(), 0);
+		av_dict_set(&format_opts_, "segment_time", segment_time, 0);
+		av_dict_set(&format_opts_, "reset_timestamps", "1", 0);
+		if (fragment)
+			av_dict_set(&format_opts_, "segment_format_options",
+						("movflags=" + movflags + ":min_frag_duration=" + min_frag).c_str(), 0);
+	}
+	else
+	{
+		av_dict_set(&format_opts_, "movflags", movflags.c_str(), 0);
+		av_dict_set(&format_opts_, "min_frag_duration", min_frag.c_str(), 0);
+	}
+
+	// Files on disk get written behind the encoder, with each fragment synced as it completes.
+	if (!output_file_.empty() && output_file_ != "-" && output_file_.find("://") == std::string::npos)
+	{
+		write_fragments_ = true;
+		out_fmt_ctx_->opaque = this;
+		default_io_open_ = out_fmt_ctx_->io_open;
+		default_io_close_ = out_fmt_ctx_->LIBAV_IO_CLOSE;
+		out_fmt_ctx_->io_open = &LibAvEncoder::ioOpen;
+#if LIBAVFORMAT_VERSION_INT >= AV_VERSION_INT(59, 17, 100)
+		out_fmt_ctx_->io_close2 = &LibAvEncoder::ioClose;
+#else
+		out_fmt_ctx_->io_close = [](AVFormatContext *s, AVIOContext *pb) { ioClose(s, pb); };
+#endif
+	}
+}
+
+int LibAvEncoder::ioOpen(AVFormatContext *s, AVIOContext **pb, const char *url, int flags, AVDictionary **options)
+{
+	LibAvEncoder *enc = static_cast<LibAvEncoder *>(s->opaque);
+	if (!(flags & AVIO_FLAG_WRITE) || endsWith(url, ".m3u8"))
+		return enc->default_io_open_(s, pb, url, flags, options);
+
+	// Let go of any earlier files that are now on disk.
+	enc->closing_writers_.remove_if([](std::unique_ptr<FragmentWriter> const &w) { return w->Finished(); });
+
+	std::string filename = url;
+	if (filename.compare(0, 5, "file:") == 0)
+		filename.erase(0, 5);
+
+	FragmentIo *io = new FragmentIo;
+	try
+	{
+		io->writer = std::make_unique<FragmentWriter>(filename, FRAGMENT_BUFFER_SIZE, FRAGMENT_BUFFERS);
+	}
+	catch (std::exception const &e)
+	{
+		LOG_ERROR("ERROR: libav: " << e.what());
+		delete io;
+		return AVERROR(EIO);
+	}
+
+	uint8_t *buffer = (uint8_t *)av_malloc(AVIO_BUFFER_SIZE);
+	*pb = buffer ? avio_alloc_context(buffer, AVIO_BUFFER_SIZE, 1, io, nullptr, fragmentWrite, fragmentSeek) : nullptr;
+	if (!*pb)
+	{
+		av_free(buffer);
+		delete io;
+		return AVERROR(ENOMEM);
+	}
+	(*pb)->write_data_type = fragmentWriteData;
+	return 0;
+}
+
+int LibAvEncoder::ioClose(AVFormatContext *s, AVIOContext *pb)
+{
+	LibAvEncoder *enc = static_cast<LibAvEncoder *>(s->opaque);
+	if (!pb)
+		return 0;
+	if (pb->write_packet != fragmentWrite)
+	{
+#if LIBAVFORMAT_VERSION_INT >= AV_VERSION_INT(59, 17, 100)
+		return enc->default_io_close_(s, pb);
+#else
+		enc->default_io_close_(s, pb);
+		return 0;
+#endif
+	}
+
+	avio_flush(pb);
+	int ret = pb->error;
+	FragmentIo *io = static_cast<FragmentIo *>(pb->opaque);
+	io->writer->Close();
+	enc->closing_writers_.push_back(std::move(io->writer));
+	delete io;
+	av_freep(&pb->buffer);
+	avio_context_free(&pb);
+	return ret;
+}
+
 LibAvEncoder::LibAvEncoder(VideoOptions const *options, StreamInfo const &info)
 	: Encoder(options), output_ready_(false), abort_video_(false), abort_audio_(false), video_start_ts_(0),
 	  in_fmt_ctx_(nullptr), out_fmt_ctx_(nullptr), output_file_(options->Get().output), output_initialised_(false),
-	  elementary_stream_(false)
+	  elementary_stream_(false), format_opts_(nullptr), write_fragments_(false), default_io_open_(nullptr),
+	  default_io_close_(nullptr), abort_mux_(false), mux_error_(0), mux_stats_ {}
 {
 	avdevice_register_all();
 
@@ -389,6 +655,11 @@ LibAvEncoder::LibAvEncoder(VideoOptions const *options, StreamInfo const &info)
 
 	LOG(2, "libav: codec init completed");
 
+	if (!elementary_stream_)
+	{
+		mux_report_time_ = std::chrono::steady_clock::now();
+		mux_thread_ = std::thread(&LibAvEncoder::muxThread, this);
+	}
 	video_thread_ = std::thread(&LibAvEncoder::videoThread, this);
 
 	if (options->Get().libav_audio)
@@ -406,6 +677,9 @@ LibAvEncoder::~LibAvEncoder()
 	abort_video_ = true;
 	video_thread_.join();
 
+	// Wait for the last of the files to reach the disk.
+	closing_writers_.clear();
+	av_dict_free(&format_opts_);
 	avformat_free_context(out_fmt_ctx_);
 	avcodec_free_context(&codec_ctx_[Video]);
 
@@ -470,9 +744,11 @@ void LibAvEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const
 	}
 	else
 	{
-		frame->buf[0] = av_buffer_create((uint8_t *)mem, size, &LibAvEncoder::releaseBuffer, this, 0);
+		// The codec only reads the frame, so it gets the camera's buffer itself. Making it read-only means that
+		// anything wanting to write to it has to take a copy, rather than scribbling on a buffer still in use.
+		frame->buf[0] = av_buffer_create((uint8_t *)mem, size, &LibAvEncoder::releaseBuffer, this,
+										 AV_BUFFER_FLAG_READONLY);
 		av_image_fill_pointers(frame->data, AV_PIX_FMT_YUV420P, frame->height, frame->buf[0]->data, frame->linesize);
-		av_frame_make_writable(frame);
 	}
 
 	std::scoped_lock<std::mutex> lock(video_mutex_);
@@ -497,7 +773,10 @@ void LibAvEncoder::initOutput()
 		if (filename == "-")
 			filename = std::string("pipe:");
 
-		ret = avio_open2(&out_fmt_ctx_->pb, filename.c_str(), AVIO_FLAG_WRITE, nullptr, nullptr);
+		if (write_fragments_)
+			ret = ioOpen(out_fmt_ctx_, &out_fmt_ctx_->pb, filename.c_str(), AVIO_FLAG_WRITE, nullptr);
+		else
+			ret = avio_open2(&out_fmt_ctx_->pb, filename.c_str(), AVIO_FLAG_WRITE, nullptr, nullptr);
 		if (ret < 0)
 		{
 			av_strerror(ret, err, sizeof(err));
@@ -505,7 +784,7 @@ void LibAvEncoder::initOutput()
 		}
 	}
 
-	ret = avformat_write_header(out_fmt_ctx_, nullptr);
+	ret = avformat_write_header(out_fmt_ctx_, &format_opts_);
 	if (ret < 0)
 	{
 		av_strerror(ret, err, sizeof(err));
@@ -526,7 +805,15 @@ void LibAvEncoder::deinitOutput()
 	av_write_trailer(out_fmt_ctx_);
 
 	if (!(out_fmt_ctx_->flags & AVFMT_NOFILE))
-		avio_closep(&out_fmt_ctx_->pb);
+	{
+		if (write_fragments_)
+		{
+			ioClose(out_fmt_ctx_, out_fmt_ctx_->pb);
+			out_fmt_ctx_->pb = nullptr;
+		}
+		else
+			avio_closep(&out_fmt_ctx_->pb);
+	}
 }
 
 void LibAvEncoder::encode(AVPacket *pkt, unsigned int stream_id)
@@ -562,17 +849,28 @@ void LibAvEncoder::encode(AVPacket *pkt, unsigned int stream_id)
 
 		if (!elementary_stream_)
 		{
-			std::scoped_lock<std::mutex> lock(output_mutex_);
-			// pkt is now blank (av_interleaved_write_frame() takes ownership of
-			// its contents and resets pkt), so that no unreferencing is necessary.
-			// This would be different if one used av_write_frame().
-			ret = av_interleaved_write_frame(out_fmt_ctx_, pkt);
-			if (ret < 0)
+			// The queue takes a new reference to the packet's data and leaves pkt blank for the next one.
+			AVPacket *mux_pkt = av_packet_alloc();
+			if (!mux_pkt)
+				throw std::runtime_error("libav: cannot allocate packet for muxing");
+			av_packet_move_ref(mux_pkt, pkt);
+
+			std::unique_lock<std::mutex> lock(output_mutex_);
+			if (mux_queue_.size() >= MUX_QUEUE_SIZE)
+			{
+				mux_stats_.stalls++;
+				mux_space_cv_.wait(lock, [this] { return mux_queue_.size() < MUX_QUEUE_SIZE || mux_error_; });
+			}
+			if (mux_error_)
 			{
+				av_packet_free(&mux_pkt);
 				char err[AV_ERROR_MAX_STRING_SIZE];
-				av_strerror(ret, err, sizeof(err));
+				av_strerror(mux_error_, err, sizeof(err));
 				throw std::runtime_error("libav: error writing output: " + std::string(err));
 			}
+			mux_queue_.push_back(mux_pkt);
+			mux_stats_.max_depth = std::max(mux_stats_.max_depth, mux_queue_.size());
+			mux_cv_.notify_one();
 		}
 		else
 		{
@@ -637,9 +935,92 @@ done:
 	encode(pkt, Video);
 
 	av_packet_free(&pkt);
+	stopMuxing();
 	deinitOutput();
 }
 
+void LibAvEncoder::muxThread()
+{
+	using namespace std::chrono;
+
+	while (true)
+	{
+		AVPacket *pkt;
+		{
+			std::unique_lock<std::mutex> lock(output_mutex_);
+			mux_cv_.wait(lock, [this] { return abort_mux_ || !mux_queue_.empty(); });
+			if (mux_queue_.empty())
+				break;
+			pkt = mux_queue_.front();
+			mux_queue_.pop_front();
+			mux_space_cv_.notify_one();
+		}
+
+		// Once something has gone wrong, just throw the rest away.
+		int ret = 0;
+		auto start = steady_clock::now();
+		if (!mux_error_)
+			ret = av_interleaved_write_frame(out_fmt_ctx_, pkt);
+		auto end = steady_clock::now();
+		av_packet_free(&pkt);
+
+		std::scoped_lock<std::mutex> lock(output_mutex_);
+		if (ret < 0 && !mux_error_)
+		{
+			mux_error_ = ret;
+			mux_space_cv_.notify_all();
+		}
+		mux_stats_.packets++;
+		mux_stats_.write_time += end - start;
+		mux_stats_.max_write_time = std::max(mux_stats_.max_write_time, end - start);
+		if (end - mux_report_time_ >= MUX_REPORT_INTERVAL)
+			reportMuxStats(end);
+	}
+}
+
+void LibAvEncoder::stopMuxing()
+{
+	if (!mux_thread_.joinable())
+		return;
+
+	{
+		std::scoped_lock<std::mutex> lock(output_mutex_);
+		abort_mux_ = true;
+		mux_cv_.notify_one();
+	}
+	mux_thread_.join();
+	reportMuxStats(std::chrono::steady_clock::now());
+
+	if (mux_error_)
+	{
+		char err[AV_ERROR_MAX_STRING_SIZE];
+		av_strerror(mux_error_, err, sizeof(err));
+		LOG_ERROR("ERROR: libav: error writing output: " << err);
+	}
+}
+
+void LibAvEncoder::reportMuxStats(std::chrono::steady_clock::time_point now)
+{
+	using namespace std::chrono;
+
+	if (mux_stats_.packets)
+	{
+		auto mean = duration_cast<microseconds>(mux_stats_.write_time / mux_stats_.packets).count();
+		auto max = duration_cast<microseconds>(mux_stats_.max_write_time).count();
+		LOG(2, "libav: muxed " << mux_stats_.packets << " packets, write time mean " << mean << "us max " << max
+							   << "us, queue depth max " << mux_stats_.max_depth << "/" << MUX_QUEUE_SIZE);
+	}
+	// If the encoders had to wait, the output can't keep up.
+	if (mux_stats_.stalls)
+	{
+		auto interval = duration_cast<seconds>(now - mux_report_time_).count();
+		LOG_ERROR("WARNING: libav: output too slow, mux queue full " << mux_stats_.stalls << " times in the last "
+																	 << interval << "s");
+	}
+	mux_stats_ = {};
+	mux_report_time_ = now;
+}
+
 void LibAvEncoder::audioThread()
 {
 	const AVSampleFormat required_fmt = codec_ctx_[AudioOut]->sample_fmt;
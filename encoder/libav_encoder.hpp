@@ -8,7 +8,10 @@
 #pragma once
 
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <deque>
+#include <list>
 #include <memory>
 #include <mutex>
 #include <queue>
@@ -31,20 +34,32 @@ extern "C"
 }
 
 #include "encoder.hpp"
+#include "fragment_writer.hpp"
 #include "core/metadata.hpp"
 
+// libavformat 59.17 replaced io_close with io_close2, which can report errors.
+#if LIBAVFORMAT_VERSION_INT >= AV_VERSION_INT(59, 17, 100)
+#define LIBAV_IO_CLOSE io_close2
+#else
+#define LIBAV_IO_CLOSE io_close
+#endif
+
 class LibAvEncoder : public Encoder
 {
 public:
 	LibAvEncoder(VideoOptions const *options, StreamInfo const &info);
 	~LibAvEncoder();
+	using Encoder::EncodeBuffer;
 	// Encode the given DMABUF.
 	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us, Metadata const &post_process_metadata = Metadata(), libcamera::ControlList const &control_list_metadata = libcamera::ControlList()) override;
+	// Only elementary streams go through the Output; containers are written by the muxer.
+	bool OutputsEachFrame() const override { return elementary_stream_; }
 
 private:
 	void initVideoCodec(VideoOptions const *options, StreamInfo const &info);
 	void initAudioInCodec(VideoOptions const *options, StreamInfo const &info);
 	void initAudioOutCodec(VideoOptions const *options, StreamInfo const &info);
+	void initContainer(VideoOptions const *options);
 
 	void initOutput();
 	void deinitOutput();
@@ -52,9 +67,16 @@ private:
 
 	void videoThread();
 	void audioThread();
+	void muxThread();
+	void stopMuxing();
+	void reportMuxStats(std::chrono::steady_clock::time_point now);
 
 	static void releaseBuffer(void *opaque, uint8_t *data);
 
+	// Replacements for the muxer's own io_open and io_close that write media files through FragmentWriters.
+	static int ioOpen(AVFormatContext *s, AVIOContext **pb, const char *url, int flags, AVDictionary **options);
+	static int ioClose(AVFormatContext *s, AVIOContext *pb);
+
 	std::atomic<bool> output_ready_;
 	bool abort_video_;
 	bool abort_audio_;
@@ -67,6 +89,27 @@ private:
 	std::thread video_thread_;
 	std::thread audio_thread_;
 
+	// Encoded packets waiting for the mux thread, so that neither encoder ever waits for the output unless this fills
+	// up. Guarded by output_mutex_, as is everything else here to do with muxing.
+	std::deque<AVPacket *> mux_queue_;
+	std::condition_variable mux_cv_;
+	std::condition_variable mux_space_cv_;
+	std::thread mux_thread_;
+	bool abort_mux_;
+	// The first error from the muxer, which the encoders then throw.
+	int mux_error_;
+	// For showing whether it's the output that holds things up.
+	struct MuxStats
+	{
+		uint64_t packets;
+		uint64_t stalls; // times an encoder found the queue full
+		size_t max_depth;
+		std::chrono::steady_clock::duration write_time;
+		std::chrono::steady_clock::duration max_write_time;
+	};
+	MuxStats mux_stats_;
+	std::chrono::steady_clock::time_point mux_report_time_;
+
 	// The ordering in the enum below must not change!
 	enum Context { Video = 0, AudioOut = 1, AudioIn = 2 };
 	AVCodecContext *codec_ctx_[3];
@@ -80,4 +123,14 @@ private:
 	std::string output_file_;
 	bool output_initialised_;
 	bool elementary_stream_;
+
+	// Muxer options for the container, given to avformat_write_header.
+	AVDictionary *format_opts_;
+	// With --libav-fragment or --segment, files are written by FragmentWriters. Anything that isn't media (like an HLS
+	// playlist) still goes through the muxer's default callbacks, and closed files are kept here until they have all
+	// gone out to disk, so that starting a new segment never waits for the last one.
+	bool write_fragments_;
+	decltype(AVFormatContext::io_open) default_io_open_;
+	decltype(AVFormatContext::LIBAV_IO_CLOSE) default_io_close_;
+	std::list<std::unique_ptr<FragmentWriter>> closing_writers_;
 };
@@ -7,17 +7,17 @@
 
 #pragma once
 
-#include <condition_variable>
-#include <mutex>
-#include <queue>
-#include <thread>
+#include <vector>
 
 #include <libcamera/controls.h>
 
+#include "encode_pool.hpp"
 #include "encoder.hpp"
+#include "exif_template.hpp"
 #include "core/metadata.hpp"
 
 struct jpeg_compress_struct;
+struct jpeg_error_mgr;
 
 class MjpegEncoder : public Encoder
 {
@@ -26,46 +26,22 @@ public:
 	~MjpegEncoder();
 	// Encode the given buffer.
 	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us, Metadata const &post_process_metadata = Metadata(), libcamera::ControlList const &control_list_metadata = libcamera::ControlList()) override;
+	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us,
+					  CompletedRequestPtr const &completed_request) override;
+	bool UsesDmabuf() const override { return false; }
+	EncodePool::QueueStats GetQueueStats() override { return pool_.GetQueueStats(); }
 
 private:
-	// How many threads to use. Whichever thread is idle will pick up the next frame.
-	static const int NUM_ENC_THREADS = 4;
+	using EncodeItem = EncodePool::EncodeItem;
 
-	// These threads do the actual encoding.
-	void encodeThread(int num);
-
-	// Handle the output buffers in another thread so as not to block the encoders. The
-	// application can take its time, after which we return this buffer to the encoder for
-	// re-use.
-	void outputThread();
-
-	bool abortEncode_;
-	bool abortOutput_;
-	uint64_t index_;
-
-	struct EncodeItem
-	{
-		void *mem;
-		StreamInfo info;
-		int64_t timestamp_us;
-		uint64_t index;
-		Metadata metadata; // Optional metadata for EXIF
-	};
-	std::queue<EncodeItem> encode_queue_;
-	std::mutex encode_mutex_;
-	std::condition_variable encode_cond_var_;
-	std::thread encode_thread_[NUM_ENC_THREADS];
 	void encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &item, uint8_t *&encoded_buffer, size_t &buffer_len);
-
-	struct OutputItem
-	{
-		void *mem;
-		size_t bytes_used;
-		int64_t timestamp_us;
-		uint64_t index;
-	};
-	std::queue<OutputItem> output_queue_[NUM_ENC_THREADS];
-	std::mutex output_mutex_;
-	std::condition_variable output_cond_var_;
-	std::thread output_thread_;
+	// For --jpeg-threads, where each frame is split into bands that compress on several cores at once.
+	void encodeBands(EncodeItem &item, uint8_t *&encoded_buffer, size_t &buffer_len);
+	void outputItem(EncodePool::OutputItem &item);
+
+	EncodePool pool_;
+	// One compressor per encode thread, indexed by thread number.
+	std::vector<struct jpeg_compress_struct> cinfo_;
+	std::vector<struct jpeg_error_mgr> jerr_;
+	ExifTemplate exif_;
 };
@@ -33,7 +33,11 @@ NullEncoder::NullEncoder(VideoOptions const *options) : Encoder(options), abort_
 
 NullEncoder::~NullEncoder()
 {
-	abort_ = true;
+	{
+		std::lock_guard<std::mutex> lock(output_mutex_);
+		abort_ = true;
+	}
+	output_cond_var_.notify_one();
 	output_thread_.join();
 	LOG(2, "NullEncoder closed");
 }
@@ -57,27 +61,18 @@ void NullEncoder::outputThread()
 	while (true)
 	{
 		{
+			// Anything still queued when we stop is returned first, so that no buffer goes missing.
 			std::unique_lock<std::mutex> lock(output_mutex_);
-			while (true)
-			{
-				using namespace std::chrono_literals;
-				if (!output_queue_.empty())
-				{
-					item = output_queue_.front();
-					output_queue_.pop();
-					break;
-				}
-				else {
-					output_cond_var_.wait_for(lock, 200ms);
-				}
-				if (abort_)
-					return;
-			}
+			output_cond_var_.wait(lock, [this] { return abort_ || !output_queue_.empty(); });
+			if (output_queue_.empty())
+				return;
+			item = output_queue_.front();
+			output_queue_.pop();
 		}
 		// Ensure the input done callback happens before the output ready callback.
 		// This is needed as the metadata queue gets pushed in the former, and popped
 		// in the latter.
-		input_done_callback_(nullptr);
+		input_done_callback_(item.mem);
 		output_ready_callback_(item.mem, item.length, item.timestamp_us, true);
 	}
 }
@@ -0,0 +1,129 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * png_demosaic.cpp - Half resolution demosaic kernels for the PNG encoder.
+ */
+
+#include <algorithm>
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#define HAVE_NEON_KERNELS 1
+#endif
+
+#include "core/logging.hpp"
+
+#include "png_demosaic.hpp"
+
+// The two samples in each quad that aren't red or blue.
+static void green_samples(DemosaicParams const &params, unsigned int &g0, unsigned int &g1)
+{
+	unsigned int greens[2], n = 0;
+	for (unsigned int i = 0; i < 4; i++)
+	{
+		if (i != params.red && i != params.blue)
+			greens[n++] = i;
+	}
+	g0 = greens[0], g1 = greens[1];
+}
+
+// Plain C kernels. The NEON kernels hand them whatever is left at the end of a row.
+
+static inline uint16_t demosaic_channel(unsigned int value, DemosaicParams const &params, unsigned int c)
+{
+	value = value > params.black[c] ? value - params.black[c] : 0;
+	return std::min<uint32_t>(((uint32_t)value * params.gain[c]) >> DEMOSAIC_GAIN_SHIFT, 65535);
+}
+
+static void demosaic_half_row_c(uint16_t const *row0, uint16_t const *row1, DemosaicParams const &params,
+								unsigned int width, uint8_t *dest)
+{
+	unsigned int g0, g1;
+	green_samples(params, g0, g1);
+	for (unsigned int x = 0; x < width; x++, row0 += 2, row1 += 2)
+	{
+		unsigned int quad[4] = { row0[0], row0[1], row1[0], row1[1] };
+		uint16_t rgb[3] = { demosaic_channel(quad[params.red], params, 0),
+							demosaic_channel((quad[g0] + quad[g1]) >> 1, params, 1),
+							demosaic_channel(quad[params.blue], params, 2) };
+		for (unsigned int c = 0; c < 3; c++)
+		{
+			*dest++ = rgb[c] >> 8;
+			*dest++ = rgb[c];
+		}
+	}
+}
+
+#if HAVE_NEON_KERNELS
+
+// NEON kernels, 8 output pixels at a time. The quads are pulled apart by the de-interleaving loads, and the channels
+// interleaved again by the stores.
+
+static inline uint16x8_t demosaic_channel_neon(uint16x8_t value, uint16x8_t black, uint16x4_t gain)
+{
+	value = vqsubq_u16(value, black);
+	uint32x4_t lo = vmull_u16(vget_low_u16(value), gain);
+	uint32x4_t hi = vmull_u16(vget_high_u16(value), gain);
+	return vcombine_u16(vqshrn_n_u32(lo, DEMOSAIC_GAIN_SHIFT), vqshrn_n_u32(hi, DEMOSAIC_GAIN_SHIFT));
+}
+
+static inline uint16x8_t byte_swap_neon(uint16x8_t value)
+{
+	return vreinterpretq_u16_u8(vrev16q_u8(vreinterpretq_u8_u16(value)));
+}
+
+static void demosaic_half_row_neon(uint16_t const *row0, uint16_t const *row1, DemosaicParams const &params,
+								   unsigned int width, uint8_t *dest)
+{
+	unsigned int g0, g1;
+	green_samples(params, g0, g1);
+	uint16x8_t black[3] = { vdupq_n_u16(params.black[0]), vdupq_n_u16(params.black[1]),
+							vdupq_n_u16(params.black[2]) };
+	uint16x4_t gain[3] = { vdup_n_u16(params.gain[0]), vdup_n_u16(params.gain[1]), vdup_n_u16(params.gain[2]) };
+
+	unsigned int w_align = width & ~7;
+	for (unsigned int x = 0; x < w_align; x += 8)
+	{
+		uint16x8x2_t top = vld2q_u16(row0 + 2 * x);
+		uint16x8x2_t bottom = vld2q_u16(row1 + 2 * x);
+		uint16x8_t quad[4] = { top.val[0], top.val[1], bottom.val[0], bottom.val[1] };
+		uint16x8_t r = demosaic_channel_neon(quad[params.red], black[0], gain[0]);
+		uint16x8_t g = demosaic_channel_neon(vhaddq_u16(quad[g0], quad[g1]), black[1], gain[1]);
+		uint16x8_t b = demosaic_channel_neon(quad[params.blue], black[2], gain[2]);
+		uint16x8x3_t rgb = { { byte_swap_neon(r), byte_swap_neon(g), byte_swap_neon(b) } };
+		vst3q_u16((uint16_t *)(dest + 6 * x), rgb);
+	}
+	demosaic_half_row_c(row0 + 2 * w_align, row1 + 2 * w_align, params, width - w_align, dest + 6 * w_align);
+}
+
+#endif /* HAVE_NEON_KERNELS */
+
+namespace
+{
+
+typedef void (*DemosaicRowFn)(uint16_t const *, uint16_t const *, DemosaicParams const &, unsigned int, uint8_t *);
+
+DemosaicRowFn select_kernel()
+{
+#if HAVE_NEON_KERNELS
+	if (getauxval(AT_HWCAP) & HWCAP_ASIMD)
+	{
+		LOG(2, "PNG demosaic: using NEON kernels");
+		return demosaic_half_row_neon;
+	}
+#endif
+	LOG(2, "PNG demosaic: using C kernels");
+	return demosaic_half_row_c;
+}
+
+} // namespace
+
+void demosaic_half_row_16(uint16_t const *row0, uint16_t const *row1, DemosaicParams const &params,
+						  unsigned int width, uint8_t *dest)
+{
+	static const DemosaicRowFn fn = select_kernel();
+	fn(row0, row1, params, width, dest);
+}
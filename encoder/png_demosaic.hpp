@@ -0,0 +1,31 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * png_demosaic.hpp - Half resolution demosaic kernels for the PNG encoder.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+// How to turn each 2x2 Bayer quad into one RGB pixel. The quad's samples are numbered 0 and 1 along the top row, 2
+// and 3 along the bottom; "red" and "blue" say which of them those are, and the other two are averaged for green.
+// Each channel has its black level (on the same 16-bit scale as the samples) taken off and is then multiplied by its
+// gain, in units of 1/DEMOSAIC_GAIN_ONE, which should include whatever brings the black level back up to full range.
+static constexpr unsigned int DEMOSAIC_GAIN_SHIFT = 10;
+static constexpr unsigned int DEMOSAIC_GAIN_ONE = 1 << DEMOSAIC_GAIN_SHIFT;
+
+struct DemosaicParams
+{
+	unsigned int red;
+	unsigned int blue;
+	uint16_t black[3]; // R, G, B
+	uint16_t gain[3];
+};
+
+// Make one row of "width" RGB pixels from two rows of 16-bit samples (2 * width of them each), scaled to the full
+// 16-bit range, writing big-endian 16-bit samples as PNG wants them. The NEON version is used when the CPU has it,
+// otherwise the plain C one.
+void demosaic_half_row_16(uint16_t const *row0, uint16_t const *row1, DemosaicParams const &params,
+						  unsigned int width, uint8_t *dest);
@@ -9,180 +9,27 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <map>
 #include <sstream>
 #include <iomanip>
 #include <vector>
 #include <algorithm>
 
 #include <png.h>
-#include <libexif/exif-data.h>
+#include <zlib.h>
 #include <libcamera/control_ids.h>
+#include <libcamera/formats.h>
 
+#include "png_demosaic.hpp"
 #include "png_encoder.hpp"
 #include "core/logging.hpp"
 #include "core/metadata.hpp"
 #include <ctime>
 
-#ifndef MAKE_STRING
-#define MAKE_STRING "Wassoc"
-#endif
-
-static const ExifByteOrder exif_byte_order = EXIF_BYTE_ORDER_INTEL;
-
-// Helper function to create EXIF entry (same as MJPEG encoder)
-static ExifEntry *exif_create_tag(ExifData *exif, ExifIfd ifd, ExifTag tag)
-{
-	ExifEntry *entry = exif_content_get_entry(exif->ifd[ifd], tag);
-	if (entry)
-		return entry;
-	entry = exif_entry_new();
-	if (!entry)
-		throw std::runtime_error("failed to allocate EXIF entry");
-	entry->tag = tag;
-	exif_content_add_entry(exif->ifd[ifd], entry);
-	exif_entry_initialize(entry, entry->tag);
-	// Ensure data is allocated if entry_initialize didn't do it
-	if (entry->size > 0 && !entry->data)
-	{
-		entry->data = (unsigned char *)malloc(entry->size);
-		if (!entry->data)
-			throw std::runtime_error("failed to allocate EXIF entry data");
-		memset(entry->data, 0, entry->size);
-	}
-	exif_entry_unref(entry);
-	return entry;
-}
-
-// Helper function to set EXIF string (same as MJPEG encoder)
-static void exif_set_string(ExifEntry *entry, char const *s)
-{
-	if (entry->data)
-		free(entry->data);
-	entry->size = entry->components = strlen(s);
-	entry->data = (unsigned char *)strdup(s);
-	if (!entry->data)
-		throw std::runtime_error("failed to copy exif string");
-	entry->format = EXIF_FORMAT_ASCII;
-}
-
-// Create EXIF data from metadata using libexif (same as MJPEG encoder)
-static void create_exif_data(Metadata const &metadata, uint8_t *&exif_buffer, unsigned int &exif_len)
-{
-	exif_buffer = nullptr;
-	ExifData *exif = nullptr;
-
-	try
-	{
-		exif = exif_data_new();
-		if (!exif)
-			throw std::runtime_error("failed to allocate EXIF data");
-		exif_data_set_byte_order(exif, exif_byte_order);
-
-		std::string camera_serial_number = "Unknown";
-		auto camera_serial_number_defined = metadata.Get(std::string("exif_data.camera_serial_number"), camera_serial_number);
-
-		// Add basic EXIF tags to IFD0 (main image directory) for better Windows compatibility
-		ExifEntry *entry = exif_create_tag(exif, EXIF_IFD_0, EXIF_TAG_MAKE);
-		exif_set_string(entry, MAKE_STRING);
-		// Add MODEL tag - Windows Explorer often looks for this
-		entry = exif_create_tag(exif, EXIF_IFD_0, EXIF_TAG_MODEL);
-		exif_set_string(entry, std::string("Shadowgraph-v3 (SN: " + camera_serial_number + ")").c_str());
-		entry = exif_create_tag(exif, EXIF_IFD_0, EXIF_TAG_SOFTWARE);
-		exif_set_string(entry, "Shadowgraph-v3");
-
-		// Add date/time to IFD0 for Windows Explorer compatibility
-		std::time_t raw_time;
-		std::time(&raw_time);
-		std::tm *time_info = std::localtime(&raw_time);
-		char time_string[32];
-		std::strftime(time_string, sizeof(time_string), "%Y:%m:%d %H:%M:%S", time_info);
-		entry = exif_create_tag(exif, EXIF_IFD_0, EXIF_TAG_DATE_TIME);
-		exif_set_string(entry, time_string);
-		entry = exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_DATE_TIME_ORIGINAL);
-		exif_set_string(entry, time_string);
-		entry = exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_DATE_TIME_DIGITIZED);
-		exif_set_string(entry, time_string);
-
-		// Add exposure time (shutter speed) - Windows Explorer expects this in EXIF sub-IFD
-		float exposure_time;
-		auto exposure_time_defined = metadata.Get(std::string("exif_data.shutter_speed"), exposure_time);
-		if (exposure_time_defined == 0)
-		{
-			entry = exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_EXPOSURE_TIME);
-			ExifRational exposure = { (ExifLong)exposure_time, 1000000 };
-			exif_set_rational(entry->data, exif_byte_order, exposure);
-		}
-
-		// Add ISO (from gains) - Windows Explorer expects this in EXIF sub-IFD
-		float ag = 1.0;
-		auto agDefined = metadata.Get(std::string("exif_data.analogue_gain"), ag);
-		if (agDefined == 0)
-		{
-			entry = exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_ISO_SPEED_RATINGS);
-		}
-
-		float dg = 1.0;
-		auto dgDefined = metadata.Get(std::string("exif_data.digital_gain"), dg);
-		if (dgDefined == 0)
-		{
-			float gain = ag * (dgDefined == 0 ? dg : 1.0);
-			exif_set_short(entry->data, exif_byte_order, (ExifShort)(100 * gain));
-		}
-
-		// Add fixed f-stop (aperture) value of f/16 to EXIF metadata
-		entry = exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_FNUMBER);
-		// EXIF f-stop is a rational value: numerator=focal/aperture, denominator=1 (for whole numbers)
-		// For f/16, value is 16/1
-		ExifRational fnumber = { 16, 1 }; // f/16
-		exif_set_rational(entry->data, exif_byte_order, fnumber);
-
-		// Add lamp color to EXIF metadata as user comment
-		std::string lamp_color = "Unknown";
-		auto lampDefined = metadata.Get(std::string("exif_data.lamp_color"), lamp_color);
-		if (lampDefined == 0) {
-			entry = exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_USER_COMMENT);
-			exif_set_string(entry, std::string("Lamp color: " + lamp_color).c_str());
-		}
-
-		// Set focal length to 12mm in EXIF
-		entry = exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_FOCAL_LENGTH);
-		// EXIF focal length is a rational value, so 12/1 = 12mm
-		ExifRational focal_length = { 12, 1 };
-		exif_set_rational(entry->data, exif_byte_order, focal_length);
-
-		// Add camera serial number to EXIF metadata
-		// Try IFD0 first for better Windows Explorer compatibility
-		if (camera_serial_number_defined == 0 && !camera_serial_number.empty()) {
-			// Try in IFD0 for Windows Explorer compatibility
-			entry = exif_create_tag(exif, EXIF_IFD_0, EXIF_TAG_BODY_SERIAL_NUMBER);
-			exif_set_string(entry, camera_serial_number.c_str());
-			// Also set in EXIF sub-IFD for standard compliance
-			entry = exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_BODY_SERIAL_NUMBER);
-			exif_set_string(entry, camera_serial_number.c_str());
-		}
-
-		// Create the EXIF data buffer
-		// libexif should automatically set up the EXIF sub-IFD pointer when we add tags to EXIF_IFD_EXIF
-		exif_data_save_data(exif, &exif_buffer, &exif_len);
-		if (!exif_buffer || exif_len == 0)
-			throw std::runtime_error("failed to save EXIF data");
-		LOG(2, "Created EXIF data, length: " << exif_len);
-		exif_data_unref(exif);
-		exif = nullptr;
-	}
-	catch (std::exception const &e)
-	{
-		if (exif)
-			exif_data_unref(exif);
-		if (exif_buffer)
-			free(exif_buffer);
-		throw;
-	}
-}
-
 // Structure to hold memory buffer for PNG encoding
 struct PngMemoryBuffer
 {
+	BufferPool *pool;
 	uint8_t *data;
 	size_t size;
 	size_t capacity;
@@ -200,7 +47,7 @@ static void png_write_to_memory(png_structp png_ptr, png_bytep data, png_size_t
 		if (new_capacity < buffer->size + length)
 			new_capacity = buffer->size + length + 1024; // Add some extra space
 		
-		uint8_t *new_data = (uint8_t *)realloc(buffer->data, new_capacity);
+		uint8_t *new_data = buffer->pool->Grow(buffer->data, new_capacity);
 		if (!new_data)
 		{
 			png_error(png_ptr, "failed to allocate memory for PNG buffer");
@@ -220,49 +67,270 @@ static void png_flush_memory(png_structp png_ptr)
 	(void)png_ptr;
 }
 
+// How the frame's pixels are stored. Raw frames, from a monochrome sensor or otherwise, are written as single channel
+// images straight from the raw data: 8-bit ones as they are, anything deeper as 16-bit samples. Bayer frames deeper
+// than 8 bits may instead be demosaiced (--png-demosaic half), each 2x2 quad making one white balanced 16-bit RGB
+// pixel of a half size image. 8-bit Bayer frames are not in the table, so they are written as grey, as are other
+// formats (YUV420), whose first plane goes out as 8-bit grey.
+struct PngSource
+{
+	unsigned int bits; // significant bits per sample
+	bool packed; // CSI2 packed
+	int red; // which sample of each Bayer quad is red (see DemosaicParams), or -1 if there's no colour
+	bool demosaic;
+	DemosaicParams params;
+	unsigned int width; // of the PNG
+	unsigned int height;
+	unsigned int BytesPerSample() const { return bits > 8 ? 2 : 1; }
+	unsigned int Channels() const { return demosaic ? 3 : 1; }
+	size_t RowBytes() const { return (size_t)width * Channels() * BytesPerSample(); }
+	// For png_row. Demosaicing wants two rows of 16-bit samples as well as the row it makes.
+	size_t ScratchBytes(StreamInfo const &info) const
+	{
+		if (demosaic)
+			return (size_t)info.width * 4 + RowBytes();
+		return bits > 8 ? RowBytes() : 0;
+	}
+};
+
+static PngSource png_source(StreamInfo const &info, libcamera::ControlList const *metadata, bool demosaic)
+{
+	using namespace libcamera;
+	static const std::map<PixelFormat, PngSource> raw_formats = {
+		{ formats::R10_CSI2P, { 10, true, -1 } },
+		{ formats::R10, { 10, false, -1 } },
+		{ formats::R12_CSI2P, { 12, true, -1 } },
+		{ formats::R12, { 12, false, -1 } },
+		{ formats::R16, { 16, false, -1 } },
+
+		{ formats::SRGGB10_CSI2P, { 10, true, 0 } },
+		{ formats::SGRBG10_CSI2P, { 10, true, 1 } },
+		{ formats::SBGGR10_CSI2P, { 10, true, 3 } },
+		{ formats::SGBRG10_CSI2P, { 10, true, 2 } },
+		{ formats::SRGGB10, { 10, false, 0 } },
+		{ formats::SGRBG10, { 10, false, 1 } },
+		{ formats::SBGGR10, { 10, false, 3 } },
+		{ formats::SGBRG10, { 10, false, 2 } },
+		{ formats::SRGGB12_CSI2P, { 12, true, 0 } },
+		{ formats::SGRBG12_CSI2P, { 12, true, 1 } },
+		{ formats::SBGGR12_CSI2P, { 12, true, 3 } },
+		{ formats::SGBRG12_CSI2P, { 12, true, 2 } },
+		{ formats::SRGGB12, { 12, false, 0 } },
+		{ formats::SGRBG12, { 12, false, 1 } },
+		{ formats::SBGGR12, { 12, false, 3 } },
+		{ formats::SGBRG12, { 12, false, 2 } },
+		{ formats::SRGGB16, { 16, false, 0 } },
+		{ formats::SGRBG16, { 16, false, 1 } },
+		{ formats::SBGGR16, { 16, false, 3 } },
+		{ formats::SGBRG16, { 16, false, 2 } },
+	};
+	auto it = raw_formats.find(info.pixel_format);
+	PngSource source = it == raw_formats.end() ? PngSource { 8, false, -1 } : it->second;
+	source.demosaic = demosaic && source.red >= 0 && info.width >= 2 && info.height >= 2;
+	source.width = source.demosaic ? info.width / 2 : info.width;
+	source.height = source.demosaic ? info.height / 2 : info.height;
+	if (!source.demosaic)
+		return source;
+
+	// The black levels come in R, Gr, Gb, B order on a 16-bit scale, and the gains as R, B. Each channel's gain
+	// also stretches what's left above its black level back to the full range.
+	float black[3] = { 4096, 4096, 4096 }, gain[3] = { 1, 1, 1 };
+	if (metadata)
+	{
+		if (auto bl = metadata->get(controls::SensorBlackLevels))
+			black[0] = (*bl)[0], black[1] = ((*bl)[1] + (*bl)[2]) / 2.0f, black[2] = (*bl)[3];
+		if (auto cg = metadata->get(controls::ColourGains))
+			gain[0] = (*cg)[0], gain[2] = (*cg)[1];
+	}
+	source.params.red = source.red;
+	source.params.blue = 3 - source.red;
+	for (unsigned int c = 0; c < 3; c++)
+	{
+		black[c] = std::clamp(black[c], 0.0f, 65534.0f);
+		source.params.black[c] = black[c];
+		float scaled = gain[c] * DEMOSAIC_GAIN_ONE * 65535.0f / (65535.0f - black[c]);
+		source.params.gain[c] = std::clamp(scaled, 0.0f, 65535.0f);
+	}
+	return source;
+}
+
+// Hand each of the first "width" samples of a raw row to "put", as (x, value).
+template <typename Put>
+static void unpack_row(uint8_t const *src, unsigned int width, PngSource const &source, Put put)
+{
+	if (source.bits <= 8)
+	{
+		for (unsigned int x = 0; x < width; x++)
+			put(x, src[x]);
+	}
+	else if (source.packed && source.bits == 10)
+	{
+		for (unsigned int x = 0; x < width; x += 4, src += 5)
+		{
+			for (unsigned int i = 0; i < 4 && x + i < width; i++)
+				put(x + i, (src[i] << 2) | ((src[4] >> (2 * i)) & 3));
+		}
+	}
+	else if (source.packed)
+	{
+		for (unsigned int x = 0; x < width; x += 2, src += 3)
+		{
+			put(x, (src[0] << 4) | (src[2] & 15));
+			if (x + 1 < width)
+				put(x + 1, (src[1] << 4) | (src[2] >> 4));
+		}
+	}
+	else
+	{
+		for (unsigned int x = 0; x < width; x++)
+			put(x, src[2 * x] | (src[2 * x + 1] << 8));
+	}
+}
+
+// Row y of the image as PNG wants it. 8-bit grey rows come straight from the frame; deeper ones are unpacked into
+// "scratch" as big-endian 16-bit samples, scaled up to the full range as PNG asks (the sBIT chunk says by how much).
+// Demosaiced rows are made in "scratch" from the two raw rows they cover.
+static uint8_t const *png_row(uint8_t const *mem, StreamInfo const &info, PngSource const &source, unsigned int y,
+							  uint8_t *scratch)
+{
+	unsigned int shift = 16 - source.bits;
+	if (source.demosaic)
+	{
+		uint16_t *rows[2] = { (uint16_t *)scratch, (uint16_t *)scratch + info.width };
+		uint8_t *dest = scratch + (size_t)info.width * 4;
+		for (unsigned int i = 0; i < 2; i++)
+			unpack_row(mem + (size_t)(2 * y + i) * info.stride, info.width, source,
+					   [&](unsigned int x, unsigned int value) { rows[i][x] = value << shift; });
+		demosaic_half_row_16(rows[0], rows[1], source.params, source.width, dest);
+		return dest;
+	}
+
+	uint8_t const *src = mem + (size_t)y * info.stride;
+	if (source.bits <= 8)
+		return src;
+	unpack_row(src, info.width, source, [&](unsigned int x, unsigned int value) {
+		value <<= shift;
+		scratch[2 * x] = value >> 8;
+		scratch[2 * x + 1] = value;
+	});
+	return scratch;
+}
+
+// Parallel compression, in the style of pigz. The image data is split into row bands which are deflated as
+// independent raw deflate streams. All but the last band end with a sync flush, which leaves them byte aligned, so
+// they can simply be concatenated behind a zlib header, with their adler32 checksums combined for the trailer.
+// Don't bother splitting below this many rows per band.
+static constexpr unsigned int MIN_BAND_ROWS = 16;
+
+struct DeflateBand
+{
+	unsigned int first_row;
+	unsigned int num_rows;
+	BufferPool::Ptr data;
+	size_t size;
+	uLong adler;
+};
+
+static void deflate_band(BufferPool &buffer_pool, StreamInfo const &info, PngSource const &source, uint8_t const *mem,
+						 int level, bool last, unsigned int slot, DeflateBand &band)
+{
+	static const Bytef filter_none = PNG_FILTER_VALUE_NONE;
+	z_stream strm = {};
+	if (deflateInit2(&strm, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		throw std::runtime_error("failed to initialise deflate stream");
+
+	// The bound doesn't allow for the sync flush marker, hence a little extra.
+	size_t row_bytes = source.RowBytes();
+	size_t capacity = deflateBound(&strm, band.num_rows * (row_bytes + 1)) + 16;
+	band.data = buffer_pool.AcquirePtr(BufferPool::Key(info, slot), capacity);
+	band.adler = adler32(0, Z_NULL, 0);
+	strm.next_out = band.data.get();
+	strm.avail_out = capacity;
+
+	int ret = Z_OK;
+	std::vector<uint8_t> scratch(source.ScratchBytes(info));
+	for (unsigned int y = 0; y < band.num_rows && ret == Z_OK; y++)
+	{
+		uint8_t const *row = png_row(mem, info, source, band.first_row + y, scratch.data());
+		int flush = y + 1 < band.num_rows ? Z_NO_FLUSH : last ? Z_FINISH : Z_SYNC_FLUSH;
+		strm.next_in = const_cast<Bytef *>(&filter_none);
+		strm.avail_in = 1;
+		ret = deflate(&strm, Z_NO_FLUSH);
+		if (ret == Z_OK)
+		{
+			strm.next_in = const_cast<Bytef *>(row);
+			strm.avail_in = row_bytes;
+			ret = deflate(&strm, flush);
+		}
+		band.adler = adler32(band.adler, &filter_none, 1);
+		band.adler = adler32(band.adler, row, row_bytes);
+	}
+	band.size = capacity - strm.avail_out;
+	deflateEnd(&strm);
+
+	if (ret != (last ? Z_STREAM_END : Z_OK) || strm.avail_in)
+		throw std::runtime_error("failed to deflate PNG band");
+}
+
 PngEncoder::PngEncoder(VideoOptions const *options)
-	: Encoder(options), abortEncode_(false), abortOutput_(false), index_(0)
+	: Encoder(options), options_(options), demosaic_(options->Get().png_demosaic == "half"),
+	  num_bands_(options->Get().png_threads), deflate_abort_(false),
+	  pool_(options, 2, "PngEncoder")
 {
-	options_ = options;
-	output_thread_ = std::thread(&PngEncoder::outputThread, this);
-	for (int i = 0; i < NUM_ENC_THREADS; i++)
-		encode_thread_[i] = std::thread(std::bind(&PngEncoder::encodeThread, this, i));
+	if (num_bands_ == 0)
+		num_bands_ = std::max(std::thread::hardware_concurrency(), 1u);
+	for (unsigned int i = 1; i < num_bands_; i++)
+		deflate_threads_.emplace_back(&PngEncoder::deflateThread, this);
+	if (num_bands_ > 1)
+		LOG(2, "PngEncoder deflating in " << num_bands_ << " row bands");
+
+	pool_.Start(
+		[this](unsigned int, EncodeItem &item, uint8_t *&encoded_buffer, size_t &buffer_len) {
+			encodePNG(item, encoded_buffer, buffer_len);
+		},
+		[this](EncodePool::OutputItem &item) { outputItem(item); },
+		[this](void *mem) { input_done_callback_(mem); });
 	LOG(2, "Opened PngEncoder");
 }
 
 PngEncoder::~PngEncoder()
 {
-	abortEncode_ = true;
-	for (int i = 0; i < NUM_ENC_THREADS; i++)
-		encode_thread_[i].join();
-	abortOutput_ = true;
-	output_thread_.join();
+	pool_.Stop();
+	{
+		std::lock_guard<std::mutex> lock(deflate_mutex_);
+		deflate_abort_ = true;
+	}
+	deflate_cv_.notify_all();
+	for (auto &t : deflate_threads_)
+		t.join();
 	LOG(2, "PngEncoder closed");
 }
 
 void PngEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us, Metadata const &post_process_metadata, libcamera::ControlList const &control_list_metadata)
 {
-	(void)control_list_metadata; // Not used by PNG encoder
-	std::lock_guard<std::mutex> lock(encode_mutex_);
-	EncodeItem item = { mem, info, timestamp_us, index_++, post_process_metadata };
-	encode_queue_.push(item);
-	encode_cond_var_.notify_all();
+	pool_.Push(mem, info, timestamp_us, post_process_metadata, control_list_metadata);
+}
+
+void PngEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us,
+							  CompletedRequestPtr const &completed_request)
+{
+	pool_.Push(mem, info, timestamp_us, completed_request);
 }
 
 void PngEncoder::encodePNG(EncodeItem &item, uint8_t *&encoded_buffer, size_t &buffer_len)
 {
 	png_structp png_ptr = NULL;
 	png_infop info_ptr = NULL;
-	PngMemoryBuffer mem_buffer = { nullptr, 0, 0 };
+	PngMemoryBuffer mem_buffer = { &buffer_pool_, nullptr, 0, 0 };
 	std::vector<uint8_t> exif_data_storage; // Store EXIF data to keep it alive
+	PngSource source = png_source(item.info, item.control_list_metadata.get(), demosaic_);
 
 	try
 	{
 		// Initialize memory buffer
-		mem_buffer.capacity = item.info.width * item.info.height + 1024; // Initial estimate
-		mem_buffer.data = (uint8_t *)malloc(mem_buffer.capacity);
-		if (!mem_buffer.data)
-			throw std::runtime_error("failed to allocate PNG memory buffer");
+		mem_buffer.data = buffer_pool_.Acquire(BufferPool::Key(item.info, 0),
+											   source.RowBytes() * source.height + 1024); // Initial estimate
+		mem_buffer.capacity = buffer_pool_.Capacity(mem_buffer.data);
 		mem_buffer.size = 0;
 
 		// Create PNG structures
@@ -278,56 +346,43 @@ void PngEncoder::encodePNG(EncodeItem &item, uint8_t *&encoded_buffer, size_t &b
 			throw std::runtime_error("failed to set png error handling");
 
 		// Set image attributes
-		png_set_IHDR(png_ptr, info_ptr, item.info.width, item.info.height, 8, PNG_COLOR_TYPE_GRAY,
-					 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_BASE);
+		png_set_IHDR(png_ptr, info_ptr, source.width, source.height, 8 * source.BytesPerSample(),
+					 source.demosaic ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_GRAY, PNG_INTERLACE_NONE,
+					 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_BASE);
+		// Demosaiced samples are stretched to the full range by the white balance, so they have no sBIT.
+		if (source.bits != 8 && source.bits != 16 && !source.demosaic)
+		{
+			png_color_8 significant_bits = {};
+			significant_bits.gray = source.bits;
+			png_set_sBIT(png_ptr, info_ptr, &significant_bits);
+		}
 		// These settings get us most of the compression, but are much faster.
 		png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, PNG_FILTER_NONE);
-		// Passing 0 to not compress the image
-		png_set_compression_level(png_ptr, options_->Get().png_compression_level);
+		// Passing 0 to not compress the image. Degraded frames (the encode queue is full) get the fastest level.
+		unsigned int level = options_->Get().png_compression_level;
+		if (unsigned int const *frame_level = item.metadata.Find(metadata_tags::png_compression_level))
+			level = *frame_level;
+		if (item.degraded)
+			level = std::min(level, 1u);
+		png_set_compression_level(png_ptr, level);
 
 		// Add EXIF metadata as PNG eXIf chunk (similar to MJPEG encoder)
 		std::string temp_lamp_color;
-		if (item.metadata.Get(std::string("exif_data.lamp_color"), temp_lamp_color) == 0)
+		if (item.metadata.Get(metadata_tags::lamp_color, temp_lamp_color) == 0)
 		{
 			try
 			{
-				// Create EXIF data using libexif
-				uint8_t *exif_buffer = nullptr;
-				unsigned int exif_len = 0;
-				create_exif_data(item.metadata, exif_buffer, exif_len);
-				if (exif_buffer && exif_len > 0)
-				{
-					// Check if libexif already includes "Exif\0\0" prefix
-					// libexif's exif_data_save_data returns data starting with TIFF header (0x4949 or 0x4D4D)
-					// PNG eXIf chunk requires "Exif\0\0" prefix before TIFF data
-					bool needs_prefix = (exif_len < 6 || memcmp(exif_buffer, "Exif", 4) != 0);
-					if (needs_prefix)
-					{
-						// PNG eXIf chunk format requires "Exif\0\0" prefix
-						// libexif's exif_data_save_data returns TIFF data without this prefix
-						// So we need to prepend it
-						exif_data_storage.resize(6 + exif_len);
-						memcpy(exif_data_storage.data(), "Exif\0\0", 6);
-						memcpy(exif_data_storage.data() + 6, exif_buffer, exif_len);
-						free(exif_buffer);
-					}
-					else
-					{
-						// Already has prefix, copy directly
-						exif_data_storage.assign(exif_buffer, exif_buffer + exif_len);
-						free(exif_buffer);
-					}
-					// Create unknown chunk for EXIF
-					png_unknown_chunk exif_chunk;
-					memcpy(exif_chunk.name, "eXIf", 5); // 5 bytes: "eXIf" + null terminator
-					exif_chunk.data = exif_data_storage.data();
-					exif_chunk.size = exif_data_storage.size();
-					exif_chunk.location = PNG_HAVE_IHDR;
-					// Add the EXIF chunk
-					png_set_unknown_chunks(png_ptr, info_ptr, &exif_chunk, 1);
-					png_set_unknown_chunk_location(png_ptr, info_ptr, 0, PNG_HAVE_IHDR);
-					LOG(2, "Added EXIF data to PNG, size: " << exif_data_storage.size());
-				}
+				exif_.Make(item.metadata, exif_data_storage);
+				// Create unknown chunk for EXIF
+				png_unknown_chunk exif_chunk;
+				memcpy(exif_chunk.name, "eXIf", 5); // 5 bytes: "eXIf" + null terminator
+				exif_chunk.data = exif_data_storage.data();
+				exif_chunk.size = exif_data_storage.size();
+				exif_chunk.location = PNG_HAVE_IHDR;
+				// Add the EXIF chunk
+				png_set_unknown_chunks(png_ptr, info_ptr, &exif_chunk, 1);
+				png_set_unknown_chunk_location(png_ptr, info_ptr, 0, PNG_HAVE_IHDR);
+				LOG(2, "Added EXIF data to PNG, size: " << exif_data_storage.size());
 			}
 			catch (std::exception const &e)
 			{
@@ -338,16 +393,25 @@ void PngEncoder::encodePNG(EncodeItem &item, uint8_t *&encoded_buffer, size_t &b
 
 		
 
-		// Set up the image data
-		png_byte **row_ptrs = (png_byte **)png_malloc(png_ptr, item.info.height * sizeof(png_byte *));
-		png_byte *row = (uint8_t *)item.mem;
-		for (unsigned int i = 0; i < item.info.height; i++, row += item.info.stride)
-			row_ptrs[i] = row;
-
 		// Use custom write function to write to memory
 		png_set_write_fn(png_ptr, &mem_buffer, png_write_to_memory, png_flush_memory);
-		png_set_rows(png_ptr, info_ptr, row_ptrs);
-		png_write_png(png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
+
+		if (num_bands_ > 1 && source.height >= 2 * MIN_BAND_ROWS)
+		{
+			// Write the header chunks with libpng, but the image data ourselves.
+			png_write_info(png_ptr, info_ptr);
+			writeParallelIdat(png_ptr, item, source, level);
+			png_write_chunk(png_ptr, (png_const_bytep) "IEND", NULL, 0);
+		}
+		else
+		{
+			// A row at a time, so that deeper raw data only ever needs one row unpacking at once.
+			std::vector<uint8_t> scratch(source.ScratchBytes(item.info));
+			png_write_info(png_ptr, info_ptr);
+			for (unsigned int y = 0; y < source.height; y++)
+				png_write_row(png_ptr, png_row((uint8_t const *)item.mem, item.info, source, y, scratch.data()));
+			png_write_end(png_ptr, info_ptr);
+		}
 
 		// Transfer ownership of the buffer
 		encoded_buffer = mem_buffer.data;
@@ -355,116 +419,116 @@ void PngEncoder::encodePNG(EncodeItem &item, uint8_t *&encoded_buffer, size_t &b
 		mem_buffer.data = nullptr; // Prevent free in cleanup
 
 		// Cleanup
-		png_free(png_ptr, row_ptrs);
 		png_destroy_write_struct(&png_ptr, &info_ptr);
 	}
 	catch (std::exception const &e)
 	{
-		if (mem_buffer.data)
-			free(mem_buffer.data);
+		buffer_pool_.Release(mem_buffer.data);
 		if (png_ptr)
 			png_destroy_write_struct(&png_ptr, &info_ptr);
 		throw;
 	}
 }
 
-void PngEncoder::encodeThread(int num)
+void PngEncoder::writeParallelIdat(png_struct_def *png_ptr, EncodeItem const &item, PngSource const &source,
+								   unsigned int compression_level)
 {
-	std::chrono::duration<double> encode_time(0);
-	uint32_t frames = 0;
-
-	EncodeItem encode_item;
-	while (true)
+	// zlib only goes up to 9, and libpng treats anything above as 9 too.
+	int level = std::min(compression_level, 9u);
+	unsigned int band_rows = std::max((source.height + num_bands_ - 1) / num_bands_, MIN_BAND_ROWS);
+	std::vector<DeflateBand> bands;
+	for (unsigned int row = 0; row < source.height; row += band_rows)
+		bands.push_back({ row, std::min(band_rows, source.height - row), nullptr, 0, 0 });
+
+	// Slot 0 is the output buffer, so the bands use the ones after it.
+	uint8_t const *mem = (uint8_t const *)item.mem;
+	std::vector<std::future<void>> done;
 	{
+		std::lock_guard<std::mutex> lock(deflate_mutex_);
+		for (unsigned int i = 1; i < bands.size(); i++)
 		{
-			std::unique_lock<std::mutex> lock(encode_mutex_);
-			while (true)
-			{
-				using namespace std::chrono_literals;
-				if (abortEncode_ && encode_queue_.empty())
-				{
-					if (frames)
-						LOG(2, "Encode " << frames << " frames, average time " << encode_time.count() * 1000 / frames
-										 << "ms");
-					return;
-				}
-				if (!encode_queue_.empty())
-				{
-					encode_item = encode_queue_.front();
-					encode_queue_.pop();
-					break;
-				}
-				else
-					encode_cond_var_.wait_for(lock, 200ms);
-			}
+			std::packaged_task<void()> task([this, &item, &source, mem, level, i, &bands]() {
+				deflate_band(buffer_pool_, item.info, source, mem, level, i + 1 == bands.size(), i + 1, bands[i]);
+			});
+			done.push_back(task.get_future());
+			deflate_jobs_.push(std::move(task));
 		}
+	}
+	deflate_cv_.notify_all();
 
-		// Encode the buffer
-		uint8_t *encoded_buffer = nullptr;
-		size_t buffer_len = 0;
-		auto start_time = std::chrono::high_resolution_clock::now();
+	// Wait for every band even if one fails, as they all reference this frame.
+	std::exception_ptr error;
+	try
+	{
+		deflate_band(buffer_pool_, item.info, source, mem, level, bands.size() == 1, 1, bands[0]);
+	}
+	catch (std::exception const &)
+	{
+		error = std::current_exception();
+	}
+	for (auto &f : done)
+	{
 		try
 		{
-			encodePNG(encode_item, encoded_buffer, buffer_len);
+			f.get();
 		}
-		catch (std::exception const &e)
+		catch (std::exception const &)
 		{
-			LOG_ERROR("PNG encoding error: " << e.what());
-			// Continue to next frame
-			continue;
+			if (!error)
+				error = std::current_exception();
 		}
-		encode_time += (std::chrono::high_resolution_clock::now() - start_time);
-		frames++;
-
-		// Push encoded buffer to output queue
-		OutputItem output_item = { encoded_buffer, buffer_len, encode_item.timestamp_us, encode_item.index };
-		std::lock_guard<std::mutex> lock(output_mutex_);
-		output_queue_[num].push(output_item);
-		output_cond_var_.notify_one();
+	}
+	if (error)
+		std::rethrow_exception(error);
+
+	// The zlib header for a 32K window and the matching FLEVEL, then one IDAT chunk per band.
+	uint8_t header[2] = { 0x78, 0xda };
+	if (level < 2)
+		header[1] = 0x01;
+	else if (level < 6)
+		header[1] = 0x5e;
+	else if (level == 6)
+		header[1] = 0x9c;
+	uLong adler = bands[0].adler;
+	for (unsigned int i = 1; i < bands.size(); i++)
+		adler = adler32_combine(adler, bands[i].adler,
+								(z_off_t)bands[i].num_rows * (source.RowBytes() + 1));
+	uint8_t trailer[4] = { (uint8_t)(adler >> 24), (uint8_t)(adler >> 16), (uint8_t)(adler >> 8), (uint8_t)adler };
+
+	for (unsigned int i = 0; i < bands.size(); i++)
+	{
+		bool first = i == 0, last = i + 1 == bands.size();
+		png_uint_32 length = bands[i].size + (first ? sizeof(header) : 0) + (last ? sizeof(trailer) : 0);
+		png_write_chunk_start(png_ptr, (png_const_bytep) "IDAT", length);
+		if (first)
+			png_write_chunk_data(png_ptr, header, sizeof(header));
+		png_write_chunk_data(png_ptr, bands[i].data.get(), bands[i].size);
+		if (last)
+			png_write_chunk_data(png_ptr, trailer, sizeof(trailer));
+		png_write_chunk_end(png_ptr);
 	}
 }
 
-void PngEncoder::outputThread()
+void PngEncoder::deflateThread()
 {
-	OutputItem item;
-	uint64_t index = 0;
 	while (true)
 	{
+		std::packaged_task<void()> task;
 		{
-			std::unique_lock<std::mutex> lock(output_mutex_);
-			while (true)
-			{
-				using namespace std::chrono_literals;
-				// We look for the thread that's completed the frame we want next.
-				// If we don't find it, we wait.
-				//
-				// Must also check for an abort signal, and if set, all queues must
-				// be empty. This is done first to ensure all frame callbacks have
-				// had a chance to run.
-				bool abort = abortOutput_ ? true : false;
-				for (auto &q : output_queue_)
-				{
-					if (abort && !q.empty())
-						abort = false;
-
-					if (!q.empty() && q.front().index == index)
-					{
-						item = q.front();
-						q.pop();
-						goto got_item;
-					}
-				}
-				if (abort)
-					return;
-
-				output_cond_var_.wait_for(lock, 200ms);
-			}
+			std::unique_lock<std::mutex> lock(deflate_mutex_);
+			deflate_cv_.wait(lock, [this] { return deflate_abort_ || !deflate_jobs_.empty(); });
+			if (deflate_jobs_.empty())
+				return;
+			task = std::move(deflate_jobs_.front());
+			deflate_jobs_.pop();
 		}
-	got_item:
-		input_done_callback_(nullptr);
-
-		output_ready_callback_(item.mem, item.bytes_used, item.timestamp_us, true);
-		free(item.mem);
-		index++;
+		task();
 	}
 }
+
+void PngEncoder::outputItem(EncodePool::OutputItem &item)
+{
+	// Frames that were dropped or failed come through too, with no buffer, so the output can keep count.
+	output_ready_callback_(item.mem, item.bytes_used, item.timestamp_us, true);
+	buffer_pool_.Release((uint8_t *)item.mem);
+}
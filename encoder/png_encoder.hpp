@@ -8,17 +8,25 @@
 #pragma once
 
 #include <condition_variable>
+#include <future>
+#include <iomanip>
 #include <mutex>
 #include <queue>
-#include <thread>
 #include <sstream>
-#include <iomanip>
+#include <thread>
+#include <vector>
 
 #include <libcamera/controls.h>
 
+#include "buffer_pool.hpp"
+#include "encode_pool.hpp"
 #include "encoder.hpp"
+#include "exif_template.hpp"
 #include "core/metadata.hpp"
 
+struct png_struct_def;
+struct PngSource;
+
 class PngEncoder : public Encoder
 {
 public:
@@ -26,47 +34,32 @@ public:
 	~PngEncoder();
 	// Encode the given buffer.
 	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us, Metadata const &post_process_metadata = Metadata(), libcamera::ControlList const &control_list_metadata = libcamera::ControlList()) override;
+	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us,
+					  CompletedRequestPtr const &completed_request) override;
+	bool UsesDmabuf() const override { return false; }
+	EncodePool::QueueStats GetQueueStats() override { return pool_.GetQueueStats(); }
 
 private:
-	// These threads do the actual encoding.
-	void encodeThread(int num);
-
-	// Handle the output buffers in another thread so as not to block the encoders. The
-	// application can take its time, after which we return this buffer to the encoder for
-	// re-use.
-	void outputThread();
-
-	bool abortEncode_;
-	bool abortOutput_;
-	uint64_t index_;
-
-	// How many threads to use. Whichever thread is idle will pick up the next frame.
-	static const int NUM_ENC_THREADS = 2;
+	using EncodeItem = EncodePool::EncodeItem;
 
-	struct EncodeItem
-	{
-		void *mem;
-		StreamInfo info;
-		int64_t timestamp_us;
-		uint64_t index;
-		Metadata metadata; // Optional metadata for EXIF
-	};
-	std::queue<EncodeItem> encode_queue_;
-	std::mutex encode_mutex_;
-	std::condition_variable encode_cond_var_;
-	std::thread encode_thread_[NUM_ENC_THREADS];
 	void encodePNG(EncodeItem &item, uint8_t *&encoded_buffer, size_t &buffer_len);
+	void writeParallelIdat(png_struct_def *png_ptr, EncodeItem const &item, PngSource const &source,
+						   unsigned int compression_level);
+	void outputItem(EncodePool::OutputItem &item);
+	void deflateThread();
 
-	struct OutputItem
-	{
-		void *mem;
-		size_t bytes_used;
-		int64_t timestamp_us;
-		uint64_t index;
-	};
-	std::queue<OutputItem> output_queue_[NUM_ENC_THREADS];
-	std::mutex output_mutex_;
-	std::condition_variable output_cond_var_;
-	std::thread output_thread_;
 	VideoOptions const *options_;
+	BufferPool buffer_pool_;
+	ExifTemplate exif_;
+	// Demosaic Bayer frames into half size RGB images (--png-demosaic half).
+	bool demosaic_;
+	// Helpers for --png-threads. Each frame's row bands are queued here; the encode thread deflates the first band
+	// itself while the helpers take the rest.
+	unsigned int num_bands_;
+	std::vector<std::thread> deflate_threads_;
+	std::queue<std::packaged_task<void()>> deflate_jobs_;
+	std::mutex deflate_mutex_;
+	std::condition_variable deflate_cv_;
+	bool deflate_abort_;
+	EncodePool pool_;
 };
@@ -0,0 +1,126 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * staging_pool.cpp - Staging copies of camera frames for the software encoders.
+ */
+
+#include <sys/mman.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include "core/logging.hpp"
+#include "core/memory_budget.hpp"
+
+#include "staging_pool.hpp"
+
+// Round mappings up to the usual huge page size, which keeps MAP_HUGETLB happy and lets THP cover the whole buffer.
+static constexpr size_t HUGE_PAGE_SIZE = 2 << 20;
+
+StagingPool::StagingPool(unsigned int count) : buffers_(count, Buffer { nullptr, 0, false }), logged_(false)
+{
+}
+
+StagingPool::~StagingPool()
+{
+	for (Buffer &buffer : buffers_)
+		unmap(buffer);
+}
+
+void *StagingPool::Acquire(size_t size)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	Buffer *free_buffer = nullptr;
+	for (Buffer &buffer : buffers_)
+	{
+		if (buffer.in_use)
+			continue;
+		free_buffer = &buffer;
+		if (buffer.size >= size)
+			break;
+	}
+	if (!free_buffer)
+		return nullptr;
+
+	// Buffers are only ever mapped at the first frame, or if the stream gets bigger. One that won't fit in the
+	// memory budget isn't mapped at all, and the caller makes do without.
+	if (free_buffer->size < size)
+	{
+		unmap(*free_buffer);
+		size_t map_size = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+		if (!MemoryBudget::Get().Available(MemoryBudget::STAGING, map_size))
+		{
+			MemoryBudget::Get().Refuse(MemoryBudget::STAGING);
+			return nullptr;
+		}
+		bool huge;
+		free_buffer->mem = map(map_size, huge);
+		free_buffer->size = map_size;
+		MemoryBudget::Get().Charge(MemoryBudget::STAGING, map_size);
+		if (!logged_)
+			LOG(2, "StagingPool: " << buffers_.size() << " buffers of " << map_size << " bytes"
+								   << (huge ? " in huge pages" : ""));
+		logged_ = true;
+	}
+
+	free_buffer->in_use = true;
+	return free_buffer->mem;
+}
+
+void StagingPool::Release(void *mem)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	for (Buffer &buffer : buffers_)
+	{
+		if (buffer.mem == mem)
+		{
+			buffer.in_use = false;
+			return;
+		}
+	}
+	throw std::runtime_error("StagingPool: releasing unknown buffer");
+}
+
+void StagingPool::Reserve(size_t size)
+{
+	std::vector<void *> reserved;
+	while (void *mem = Acquire(size))
+		reserved.push_back(mem);
+	for (void *mem : reserved)
+		Release(mem);
+}
+
+void *StagingPool::map(size_t size, bool &huge)
+{
+	// Explicit huge pages need the administrator to have reserved some, so fall back to asking for transparent
+	// huge pages on a normal mapping.
+	huge = true;
+	void *mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE,
+					 -1, 0);
+	if (mem != MAP_FAILED)
+		return mem;
+
+	mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		throw std::runtime_error("StagingPool: failed to map " + std::to_string(size) + " bytes: " + strerror(errno));
+	huge = false;
+	madvise(mem, size, MADV_HUGEPAGE);
+	// Touch every page now rather than when the first frame is copied in.
+	memset(mem, 0, size);
+	return mem;
+}
+
+void StagingPool::unmap(Buffer &buffer)
+{
+	if (buffer.mem)
+	{
+		munmap(buffer.mem, buffer.size);
+		MemoryBudget::Get().Credit(MemoryBudget::STAGING, buffer.size);
+	}
+	buffer.mem = nullptr;
+	buffer.size = 0;
+}
@@ -0,0 +1,44 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * staging_pool.hpp - Staging copies of camera frames for the software encoders.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+// A small, fixed number of frame-sized buffers that camera frames can be copied into, so that the camera buffer goes
+// back to libcamera straight away and a slow encoder no longer starves the sensor of requests. Buffers are mapped
+// with huge pages where the system has them, and faulted in up front so the first frames don't pay for it. They count
+// against the staging share of the memory budget, and no more are mapped once that is used up.
+class StagingPool
+{
+public:
+	explicit StagingPool(unsigned int count);
+	~StagingPool();
+
+	// Return a buffer of at least size bytes, or nullptr if they're all in use. Safe to call from any thread.
+	void *Acquire(size_t size);
+	void Release(void *mem);
+	// Map every buffer for frames of this size now, rather than as each is first acquired.
+	void Reserve(size_t size);
+
+private:
+	struct Buffer
+	{
+		void *mem;
+		size_t size;
+		bool in_use;
+	};
+
+	static void *map(size_t size, bool &huge);
+	static void unmap(Buffer &buffer);
+
+	std::mutex mutex_;
+	std::vector<Buffer> buffers_;
+	bool logged_;
+};
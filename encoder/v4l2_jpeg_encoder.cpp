@@ -0,0 +1,393 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * v4l2_jpeg_encoder.cpp - hardware JPEG encoder, through the V4L2 M2M codec.
+ */
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <linux/videodev2.h>
+
+#include <chrono>
+#include <cstring>
+
+#include "core/logging.hpp"
+#include "core/metadata.hpp"
+#include "v4l2_jpeg_encoder.hpp"
+
+static int xioctl(int fd, unsigned long ctl, void *arg)
+{
+	int ret, num_tries = 10;
+	do
+	{
+		ret = ioctl(fd, ctl, arg);
+	} while (ret == -1 && errno == EINTR && num_tries-- > 0);
+	return ret;
+}
+
+static int get_v4l2_colorspace(std::optional<libcamera::ColorSpace> const &cs)
+{
+	if (cs == libcamera::ColorSpace::Sycc)
+		return V4L2_COLORSPACE_JPEG;
+	else if (cs == libcamera::ColorSpace::Rec709)
+		return V4L2_COLORSPACE_REC709;
+	else if (cs == libcamera::ColorSpace::Smpte170m)
+		return V4L2_COLORSPACE_SMPTE170M;
+
+	LOG(1, "V4l2JpegEncoder: surprising colour space: " << libcamera::ColorSpace::toString(cs));
+	return V4L2_COLORSPACE_JPEG;
+}
+
+// Put the APP1 marker straight after the SOI marker, or after the JFIF APP0 marker if there is one, which is where
+// libjpeg would have put it.
+static void insert_app1(uint8_t const *jpeg, size_t len, std::vector<uint8_t> const &app1, std::vector<uint8_t> &out)
+{
+	size_t pos = 2;
+	if (len >= 6 && jpeg[2] == 0xff && jpeg[3] == 0xe0)
+		pos = 4 + ((jpeg[4] << 8) | jpeg[5]);
+	pos = std::min(pos, len);
+
+	size_t marker_len = app1.size() + 2;
+	out.resize(len + 2 + marker_len);
+	uint8_t *p = out.data();
+	memcpy(p, jpeg, pos);
+	p += pos;
+	*p++ = 0xff;
+	*p++ = 0xe1;
+	*p++ = marker_len >> 8;
+	*p++ = marker_len & 0xff;
+	memcpy(p, app1.data(), app1.size());
+	p += app1.size();
+	memcpy(p, jpeg + pos, len - pos);
+}
+
+V4l2JpegEncoder::V4l2JpegEncoder(VideoOptions const *options, StreamInfo const &info)
+	: Encoder(options), abortPoll_(false), abortOutput_(false), fd_(-1), streaming_(false), num_capture_buffers_(0)
+{
+	// Whoever made us may want to fall back to libjpeg, so don't leave anything behind if this fails.
+	try
+	{
+		open(info);
+	}
+	catch (std::exception const &)
+	{
+		release();
+		throw;
+	}
+
+	output_thread_ = std::thread(&V4l2JpegEncoder::outputThread, this);
+	poll_thread_ = std::thread(&V4l2JpegEncoder::pollThread, this);
+}
+
+V4l2JpegEncoder::~V4l2JpegEncoder()
+{
+	abortPoll_ = true;
+	poll_thread_.join();
+	{
+		std::lock_guard<std::mutex> lock(output_mutex_);
+		abortOutput_ = true;
+	}
+	output_cond_var_.notify_one();
+	output_thread_.join();
+
+	release();
+	LOG(2, "V4l2JpegEncoder closed");
+}
+
+void V4l2JpegEncoder::open(StreamInfo const &info)
+{
+	const char device_name[] = "/dev/video31";
+	fd_ = ::open(device_name, O_RDWR, 0);
+	if (fd_ < 0)
+		throw std::runtime_error("failed to open V4L2 JPEG encoder");
+	LOG(2, "Opened V4l2JpegEncoder on " << device_name << " as fd " << fd_);
+
+	// Make sure this really is a JPEG encoder.
+	v4l2_fmtdesc fmtdesc = {};
+	fmtdesc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	for (; xioctl(fd_, VIDIOC_ENUM_FMT, &fmtdesc) == 0; fmtdesc.index++)
+	{
+		if (fmtdesc.pixelformat == V4L2_PIX_FMT_JPEG)
+			break;
+	}
+	if (fmtdesc.pixelformat != V4L2_PIX_FMT_JPEG)
+		throw std::runtime_error(std::string(device_name) + " does not encode JPEG");
+
+	v4l2_control ctrl = {};
+	ctrl.id = V4L2_CID_JPEG_COMPRESSION_QUALITY;
+	ctrl.value = options_->Get().quality;
+	if (xioctl(fd_, VIDIOC_S_CTRL, &ctrl) < 0)
+		throw std::runtime_error("failed to set JPEG quality");
+
+	// Set the output and capture formats.
+
+	v4l2_format fmt = {};
+	fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	fmt.fmt.pix_mp.width = info.width;
+	fmt.fmt.pix_mp.height = info.height;
+	fmt.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_YUV420;
+	fmt.fmt.pix_mp.plane_fmt[0].bytesperline = info.stride;
+	fmt.fmt.pix_mp.field = V4L2_FIELD_ANY;
+	fmt.fmt.pix_mp.colorspace = get_v4l2_colorspace(info.colour_space);
+	fmt.fmt.pix_mp.num_planes = 1;
+	if (xioctl(fd_, VIDIOC_S_FMT, &fmt) < 0)
+		throw std::runtime_error("failed to set output format");
+	if (fmt.fmt.pix_mp.width != info.width || fmt.fmt.pix_mp.height != info.height ||
+		fmt.fmt.pix_mp.plane_fmt[0].bytesperline != info.stride)
+		throw std::runtime_error("JPEG encoder can't take " + std::to_string(info.width) + "x" +
+								 std::to_string(info.height) + " images");
+
+	// A JPEG is not going to be bigger than the YUV420 image it came from.
+	fmt = {};
+	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	fmt.fmt.pix_mp.width = info.width;
+	fmt.fmt.pix_mp.height = info.height;
+	fmt.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_JPEG;
+	fmt.fmt.pix_mp.field = V4L2_FIELD_ANY;
+	fmt.fmt.pix_mp.colorspace = V4L2_COLORSPACE_DEFAULT;
+	fmt.fmt.pix_mp.num_planes = 1;
+	fmt.fmt.pix_mp.plane_fmt[0].bytesperline = 0;
+	fmt.fmt.pix_mp.plane_fmt[0].sizeimage = info.stride * info.height * 3 / 2;
+	if (xioctl(fd_, VIDIOC_S_FMT, &fmt) < 0)
+		throw std::runtime_error("failed to set capture format");
+
+	// The output queue (input to the encoder) wraps the camera's DMABUFs. The encoded JPEGs go into buffers that
+	// we allocate and mmap.
+
+	v4l2_requestbuffers reqbufs = {};
+	reqbufs.count = NUM_OUTPUT_BUFFERS;
+	reqbufs.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	reqbufs.memory = V4L2_MEMORY_DMABUF;
+	if (xioctl(fd_, VIDIOC_REQBUFS, &reqbufs) < 0)
+		throw std::runtime_error("request for output buffers failed");
+	LOG(2, "Got " << reqbufs.count << " output buffers");
+
+	for (unsigned int i = 0; i < reqbufs.count; i++)
+		input_buffers_available_.push(i);
+
+	reqbufs = {};
+	reqbufs.count = NUM_CAPTURE_BUFFERS;
+	reqbufs.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	reqbufs.memory = V4L2_MEMORY_MMAP;
+	if (xioctl(fd_, VIDIOC_REQBUFS, &reqbufs) < 0)
+		throw std::runtime_error("request for capture buffers failed");
+	LOG(2, "Got " << reqbufs.count << " capture buffers");
+
+	for (unsigned int i = 0; i < std::min<unsigned int>(reqbufs.count, NUM_CAPTURE_BUFFERS); i++)
+	{
+		v4l2_plane planes[VIDEO_MAX_PLANES];
+		v4l2_buffer buffer = {};
+		buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+		buffer.memory = V4L2_MEMORY_MMAP;
+		buffer.index = i;
+		buffer.length = 1;
+		buffer.m.planes = planes;
+		if (xioctl(fd_, VIDIOC_QUERYBUF, &buffer) < 0)
+			throw std::runtime_error("failed to capture query buffer " + std::to_string(i));
+		buffers_[i].mem = mmap(0, buffer.m.planes[0].length, PROT_READ | PROT_WRITE, MAP_SHARED, fd_,
+							   buffer.m.planes[0].m.mem_offset);
+		if (buffers_[i].mem == MAP_FAILED)
+			throw std::runtime_error("failed to mmap capture buffer " + std::to_string(i));
+		buffers_[i].size = buffer.m.planes[0].length;
+		num_capture_buffers_++;
+		if (xioctl(fd_, VIDIOC_QBUF, &buffer) < 0)
+			throw std::runtime_error("failed to queue capture buffer " + std::to_string(i));
+	}
+
+	v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	if (xioctl(fd_, VIDIOC_STREAMON, &type) < 0)
+		throw std::runtime_error("failed to start output streaming");
+	streaming_ = true;
+	type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	if (xioctl(fd_, VIDIOC_STREAMON, &type) < 0)
+		throw std::runtime_error("failed to start capture streaming");
+	LOG(1, "Using hardware JPEG encoder");
+}
+
+void V4l2JpegEncoder::release()
+{
+	if (fd_ < 0)
+		return;
+
+	if (streaming_)
+	{
+		v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+		if (xioctl(fd_, VIDIOC_STREAMOFF, &type) < 0)
+			LOG(1, "Failed to stop output streaming");
+		type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+		if (xioctl(fd_, VIDIOC_STREAMOFF, &type) < 0)
+			LOG(1, "Failed to stop capture streaming");
+	}
+
+	v4l2_requestbuffers reqbufs = {};
+	reqbufs.count = 0;
+	reqbufs.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	reqbufs.memory = V4L2_MEMORY_DMABUF;
+	if (xioctl(fd_, VIDIOC_REQBUFS, &reqbufs) < 0)
+		LOG(1, "Request to free output buffers failed");
+
+	for (int i = 0; i < num_capture_buffers_; i++)
+		if (munmap(buffers_[i].mem, buffers_[i].size) < 0)
+			LOG(1, "Failed to unmap buffer");
+	reqbufs = {};
+	reqbufs.count = 0;
+	reqbufs.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	reqbufs.memory = V4L2_MEMORY_MMAP;
+	if (xioctl(fd_, VIDIOC_REQBUFS, &reqbufs) < 0)
+		LOG(1, "Request to free capture buffers failed");
+
+	close(fd_);
+	fd_ = -1;
+}
+
+void V4l2JpegEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us, Metadata const &post_process_metadata, libcamera::ControlList const &control_list_metadata)
+{
+	(void)control_list_metadata; // Not used by the JPEG encoder
+	int index;
+	{
+		std::lock_guard<std::mutex> lock(input_buffers_available_mutex_);
+		if (input_buffers_available_.empty())
+			throw std::runtime_error("no buffers available to queue codec input");
+		index = input_buffers_available_.front();
+		input_buffers_available_.pop();
+		metadata_[timestamp_us] = post_process_metadata;
+	}
+	v4l2_buffer buf = {};
+	v4l2_plane planes[VIDEO_MAX_PLANES] = {};
+	buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	buf.index = index;
+	buf.field = V4L2_FIELD_NONE;
+	buf.memory = V4L2_MEMORY_DMABUF;
+	buf.length = 1;
+	buf.timestamp.tv_sec = timestamp_us / 1000000;
+	buf.timestamp.tv_usec = timestamp_us % 1000000;
+	buf.m.planes = planes;
+	buf.m.planes[0].m.fd = fd;
+	buf.m.planes[0].bytesused = size;
+	buf.m.planes[0].length = size;
+	if (xioctl(fd_, VIDIOC_QBUF, &buf) < 0)
+		throw std::runtime_error("failed to queue input to codec");
+}
+
+void V4l2JpegEncoder::pollThread()
+{
+	while (true)
+	{
+		pollfd p = { fd_, POLLIN, 0 };
+		int ret = poll(&p, 1, 200);
+		{
+			std::lock_guard<std::mutex> lock(input_buffers_available_mutex_);
+			if (abortPoll_ && input_buffers_available_.size() == NUM_OUTPUT_BUFFERS)
+				break;
+		}
+		if (ret == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			throw std::runtime_error("unexpected errno " + std::to_string(errno) + " from poll");
+		}
+		if (p.revents & POLLIN)
+		{
+			v4l2_buffer buf = {};
+			v4l2_plane planes[VIDEO_MAX_PLANES] = {};
+			buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+			buf.memory = V4L2_MEMORY_DMABUF;
+			buf.length = 1;
+			buf.m.planes = planes;
+			int ret = xioctl(fd_, VIDIOC_DQBUF, &buf);
+			if (ret == 0)
+			{
+				// Frames go through the codec in order, so this is the oldest one we were given.
+				{
+					std::lock_guard<std::mutex> lock(input_buffers_available_mutex_);
+					input_buffers_available_.push(buf.index);
+				}
+				input_done_callback_(nullptr);
+			}
+
+			buf = {};
+			memset(planes, 0, sizeof(planes));
+			buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+			buf.memory = V4L2_MEMORY_MMAP;
+			buf.length = 1;
+			buf.m.planes = planes;
+			ret = xioctl(fd_, VIDIOC_DQBUF, &buf);
+			if (ret == 0)
+			{
+				int64_t timestamp_us = (buf.timestamp.tv_sec * (int64_t)1000000) + buf.timestamp.tv_usec;
+				OutputItem item = { buffers_[buf.index].mem, buf.m.planes[0].bytesused, buf.m.planes[0].length,
+									buf.index, timestamp_us };
+				std::lock_guard<std::mutex> lock(output_mutex_);
+				output_queue_.push(item);
+				output_cond_var_.notify_one();
+			}
+		}
+	}
+}
+
+void V4l2JpegEncoder::outputThread()
+{
+	OutputItem item;
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(output_mutex_);
+			output_cond_var_.wait(lock, [this] { return abortOutput_ || !output_queue_.empty(); });
+			if (output_queue_.empty())
+				return;
+			item = output_queue_.front();
+			output_queue_.pop();
+		}
+
+		Metadata metadata;
+		{
+			std::lock_guard<std::mutex> lock(input_buffers_available_mutex_);
+			auto it = metadata_.find(item.timestamp_us);
+			if (it != metadata_.end())
+			{
+				metadata = std::move(it->second);
+				metadata_.erase(metadata_.begin(), std::next(it));
+			}
+		}
+
+		// As with libjpeg, frames get EXIF data when they've been tagged with their lamp colour.
+		void *mem = item.mem;
+		size_t bytes_used = item.bytes_used;
+		std::string lamp_color;
+		if (metadata.Get(metadata_tags::lamp_color, lamp_color) == 0)
+		{
+			try
+			{
+				std::vector<uint8_t> exif;
+				exif_.Make(metadata, exif);
+				if (exif.size() + 2 > 0xffff)
+					throw std::runtime_error("EXIF data too big for APP1 marker");
+				insert_app1((uint8_t const *)item.mem, item.bytes_used, exif, jpeg_);
+				mem = jpeg_.data();
+				bytes_used = jpeg_.size();
+			}
+			catch (std::exception const &e)
+			{
+				LOG_ERROR("Failed to create EXIF data: " << e.what());
+			}
+		}
+
+		output_ready_callback_(mem, bytes_used, item.timestamp_us, true);
+		v4l2_buffer buf = {};
+		v4l2_plane planes[VIDEO_MAX_PLANES] = {};
+		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+		buf.memory = V4L2_MEMORY_MMAP;
+		buf.index = item.index;
+		buf.length = 1;
+		buf.m.planes = planes;
+		buf.m.planes[0].bytesused = 0;
+		buf.m.planes[0].length = item.length;
+		if (xioctl(fd_, VIDIOC_QBUF, &buf) < 0)
+			throw std::runtime_error("failed to re-queue encoded buffer");
+	}
+}
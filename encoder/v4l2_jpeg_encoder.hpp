@@ -0,0 +1,75 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * v4l2_jpeg_encoder.hpp - hardware JPEG encoder, through the V4L2 M2M codec.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+#include "core/metadata.hpp"
+#include "encoder.hpp"
+#include "exif_template.hpp"
+
+// Encodes JPEGs on the hardware codec (bcm2835-codec on a Pi 4 and earlier), importing the camera's DMABUFs
+// directly, in the same way as the H264Encoder. The EXIF data is spliced into each JPEG as it comes out.
+class V4l2JpegEncoder : public Encoder
+{
+public:
+	V4l2JpegEncoder(VideoOptions const *options, StreamInfo const &info);
+	~V4l2JpegEncoder();
+	using Encoder::EncodeBuffer;
+	// Encode the given DMABUF.
+	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us, Metadata const &post_process_metadata = Metadata(), libcamera::ControlList const &control_list_metadata = libcamera::ControlList()) override;
+
+private:
+	// Whole frames in flight, so we need fewer of these than the H264Encoder, and the capture (encoded) buffers
+	// are big, so we don't want too many of them.
+	static constexpr int NUM_OUTPUT_BUFFERS = 6;
+	static constexpr int NUM_CAPTURE_BUFFERS = 4;
+
+	void open(StreamInfo const &info);
+	void release();
+	// As in the H264Encoder, one thread waits on the codec and another hands the JPEGs to the application.
+	void pollThread();
+	void outputThread();
+
+	bool abortPoll_;
+	bool abortOutput_;
+	int fd_;
+	bool streaming_;
+	struct BufferDescription
+	{
+		void *mem;
+		size_t size;
+	};
+	BufferDescription buffers_[NUM_CAPTURE_BUFFERS];
+	int num_capture_buffers_;
+	std::thread poll_thread_;
+	std::mutex input_buffers_available_mutex_;
+	std::queue<int> input_buffers_available_;
+	// The metadata of every frame in the codec, by timestamp, to make its EXIF data from.
+	std::map<int64_t, Metadata> metadata_;
+	ExifTemplate exif_;
+	struct OutputItem
+	{
+		void *mem;
+		size_t bytes_used;
+		size_t length;
+		unsigned int index;
+		int64_t timestamp_us;
+	};
+	std::queue<OutputItem> output_queue_;
+	std::mutex output_mutex_;
+	std::condition_variable output_cond_var_;
+	std::thread output_thread_;
+	// The JPEG with the EXIF data put in, reused from frame to frame.
+	std::vector<uint8_t> jpeg_;
+};
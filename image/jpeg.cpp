@@ -22,6 +22,7 @@
 
 #include "core/still_options.hpp"
 #include "core/stream_info.hpp"
+#include "encoder/jpeg_bands.hpp"
 
 #ifndef MAKE_STRING
 #define MAKE_STRING "Raspberry Pi"
@@ -595,8 +596,17 @@ void jpeg_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo cons
 		// YUV422 or YUV420 planar format).
 
 		jpeg_mem_len_t jpeg_len;
-		YUV_to_JPEG((uint8_t *)(mem[0].data()), info, info.width, info.height, options->Get().quality,
-					options->Get().restart, jpeg_buffer, jpeg_len);
+		if (options->Get().jpeg_threads != 1 && info.pixel_format == libcamera::formats::YUV420)
+		{
+			// The bands come with restart markers of their own, so --restart doesn't apply.
+			size_t len;
+			YUV420_to_JPEG_bands((uint8_t *)(mem[0].data()), info, options->Get().quality,
+								 options->Get().jpeg_threads, {}, jpeg_buffer, len);
+			jpeg_len = len;
+		}
+		else
+			YUV_to_JPEG((uint8_t *)(mem[0].data()), info, info.width, info.height, options->Get().quality,
+						options->Get().restart, jpeg_buffer, jpeg_len);
 		LOG(2, "JPEG size is " << jpeg_len);
 
 		// Write everything out.
@@ -0,0 +1,113 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * archive_output.cpp - Write many frames into each of a series of archive files.
+ */
+
+#include <cstring>
+#include <stdexcept>
+
+#include "core/logging.hpp"
+
+#include "archive_output.hpp"
+
+static constexpr char ARCHIVE_EXTENSION[] = ".rpa";
+// Big sequential writes are the point of all this, so give stdio a decent buffer.
+static constexpr size_t WRITE_BUFFER_SIZE = 1 << 20;
+
+// Size of archives (options->Get().archive) is given in megabytes.
+ArchiveOutput::ArchiveOutput(VideoOptions const *options)
+	: Output(options), fileNameManager_((Options *)options), max_size_((uint64_t)options->Get().archive << 20),
+	  fp_(nullptr), offset_(0), buffer_(WRITE_BUFFER_SIZE)
+{
+}
+
+ArchiveOutput::~ArchiveOutput()
+{
+	try
+	{
+		closeArchive();
+	}
+	catch (std::exception const &e)
+	{
+		LOG_ERROR("ERROR: ArchiveOutput: " << e.what());
+	}
+}
+
+void ArchiveOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
+{
+	// Start a new archive when this frame won't fit, though every archive gets at least one frame however big.
+	uint64_t needed = sizeof(ArchiveRecord) + size + (index_.size() + 2) * sizeof(ArchiveRecord) + sizeof(ArchiveTrailer);
+	if (fp_ && !index_.empty() && offset_ + needed > max_size_)
+		closeArchive();
+	if (!fp_)
+		openArchive();
+
+	ArchiveRecord record = {};
+	memcpy(record.magic, "RPAF", 4);
+	record.flags = (flags & FLAG_KEYFRAME) ? 1 : 0;
+	if (checksum_)
+		record.flags |= 2, record.crc32c = *checksum_;
+	record.offset = offset_ + sizeof(ArchiveRecord);
+	record.size = size;
+	record.timestamp_us = timestamp_us;
+	if (frame_info_)
+	{
+		record.sequence = frame_info_->sequence;
+		frame_info_->lamp_color.copy(record.lamp_color, sizeof(record.lamp_color) - 1);
+	}
+	else
+		record.sequence = index_.size();
+
+	write(&record, sizeof(record));
+	write(mem, size);
+	index_.push_back(record);
+	if (options_->Get().flush)
+		fflush(fp_);
+	LOG(2, "ArchiveOutput: frame " << index_.size() - 1 << " size " << size << " at " << record.offset);
+}
+
+void ArchiveOutput::openArchive()
+{
+	fs::path path = fileNameManager_.getNextFileName();
+	path.replace_extension(ARCHIVE_EXTENSION);
+	filename_ = path.string();
+	fp_ = fopen(filename_.c_str(), "w");
+	if (!fp_)
+		throw std::runtime_error("failed to open archive file " + filename_);
+	setvbuf(fp_, buffer_.data(), _IOFBF, buffer_.size());
+	LOG(2, "ArchiveOutput: opened archive file " << filename_);
+
+	ArchiveHeader header = {};
+	memcpy(header.magic, "RPARCHV1", 8);
+	header.record_size = sizeof(ArchiveRecord);
+	offset_ = 0;
+	write(&header, sizeof(header));
+}
+
+void ArchiveOutput::closeArchive()
+{
+	if (!fp_)
+		return;
+
+	ArchiveTrailer trailer = {};
+	trailer.index_offset = offset_;
+	trailer.count = index_.size();
+	memcpy(trailer.magic, "RPAINDX1", 8);
+	bool ok = index_.empty() || fwrite(index_.data(), index_.size() * sizeof(ArchiveRecord), 1, fp_) == 1;
+	ok = fwrite(&trailer, sizeof(trailer), 1, fp_) == 1 && ok;
+	ok = fclose(fp_) == 0 && ok;
+	fp_ = nullptr;
+	LOG(1, "ArchiveOutput: wrote " << index_.size() << " frames to " << filename_);
+	index_.clear();
+	if (!ok)
+		throw std::runtime_error("failed to finish archive file " + filename_);
+}
+
+void ArchiveOutput::write(void const *mem, size_t size)
+{
+	if (size && fwrite(mem, size, 1, fp_) != 1)
+		throw std::runtime_error("failed to write archive file " + filename_);
+	offset_ += size;
+}
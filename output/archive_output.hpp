@@ -0,0 +1,79 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * archive_output.hpp - Write many frames into each of a series of archive files.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "file_name_manager.hpp"
+#include "output.hpp"
+
+// An archive file (all values little-endian) is:
+//
+//   ArchiveHeader
+//   ArchiveRecord, frame data      - once for each frame
+//   ArchiveRecord ...              - the index, a copy of every frame's record
+//   ArchiveTrailer
+//
+// The records in front of each frame mean a file that was never finished (after a power cut, say) can still be
+// read by walking through it; the index and trailer let a reader go straight to any frame in one that was. Archives
+// from before frames could be checksummed have 64 byte records, without the last two fields.
+// utils/archive_extract.py reads them.
+
+struct ArchiveHeader
+{
+	char magic[8]; // "RPARCHV1"
+	uint32_t record_size;
+	uint32_t reserved;
+};
+static_assert(sizeof(ArchiveHeader) == 16, "ArchiveHeader should be packed");
+
+struct ArchiveRecord
+{
+	char magic[4]; // "RPAF"
+	uint32_t flags; // 1 for keyframes
+	uint64_t offset; // of the frame data, from the start of the file
+	uint64_t size;
+	int64_t timestamp_us;
+	uint64_t sequence;
+	char lamp_color[24]; // nul-padded
+	uint32_t crc32c; // of the frame data, if flags has 2 set
+	uint32_t reserved;
+};
+static_assert(sizeof(ArchiveRecord) == 72, "ArchiveRecord should be packed");
+
+struct ArchiveTrailer
+{
+	uint64_t index_offset;
+	uint64_t count;
+	char magic[8]; // "RPAINDX1"
+};
+static_assert(sizeof(ArchiveTrailer) == 24, "ArchiveTrailer should be packed");
+
+class ArchiveOutput : public Output
+{
+public:
+	ArchiveOutput(VideoOptions const *options);
+	~ArchiveOutput();
+
+protected:
+	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
+
+private:
+	void openArchive();
+	void closeArchive();
+	void write(void const *mem, size_t size);
+
+	FileNameManager fileNameManager_;
+	uint64_t max_size_;
+	FILE *fp_;
+	std::string filename_;
+	uint64_t offset_;
+	std::vector<ArchiveRecord> index_;
+	std::vector<char> buffer_;
+};
@@ -0,0 +1,79 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * binary_metadata.cpp - compact binary metadata format (--metadata-format bin)
+ */
+
+#include <cstring>
+
+#include "binary_metadata.hpp"
+
+template <typename T>
+static void put(std::vector<uint8_t> &out, T value)
+{
+	size_t offset = out.size();
+	out.resize(offset + sizeof(T));
+	memcpy(out.data() + offset, &value, sizeof(T));
+}
+
+static BinaryMetadataType binary_type(libcamera::ControlType type)
+{
+	switch (type)
+	{
+	case libcamera::ControlTypeNone:
+		return BINARY_METADATA_NONE;
+	case libcamera::ControlTypeBool:
+		return BINARY_METADATA_BOOL;
+	case libcamera::ControlTypeByte:
+		return BINARY_METADATA_BYTE;
+	case libcamera::ControlTypeInteger32:
+		return BINARY_METADATA_INT32;
+	case libcamera::ControlTypeInteger64:
+		return BINARY_METADATA_INT64;
+	case libcamera::ControlTypeFloat:
+		return BINARY_METADATA_FLOAT;
+	case libcamera::ControlTypeString:
+		return BINARY_METADATA_STRING;
+	case libcamera::ControlTypeRectangle:
+		return BINARY_METADATA_RECTANGLE;
+	case libcamera::ControlTypeSize:
+		return BINARY_METADATA_SIZE;
+	default:
+		return BINARY_METADATA_UNSIGNED;
+	}
+}
+
+std::vector<uint8_t> binary_metadata_header(libcamera::ControlIdMap const &id_map)
+{
+	std::vector<uint8_t> header(8);
+	memcpy(header.data(), "RPIMETA1", 8);
+	put<uint32_t>(header, id_map.size());
+	for (auto const &[id, control_id] : id_map)
+	{
+		std::string const &name = control_id->name();
+		put<uint32_t>(header, id);
+		put<uint16_t>(header, name.size());
+		header.insert(header.end(), name.begin(), name.end());
+	}
+	return header;
+}
+
+void binary_metadata_frame(libcamera::ControlList const &metadata, std::vector<uint8_t> &record)
+{
+	size_t start = record.size();
+	put<uint32_t>(record, 0); // size, filled in below
+	put<uint32_t>(record, metadata.size());
+	for (auto const &[id, val] : metadata)
+	{
+		libcamera::Span<const uint8_t> data = val.data();
+		uint32_t count = val.numElements();
+		put<uint32_t>(record, id);
+		put<uint8_t>(record, binary_type(val.type()));
+		put<uint8_t>(record, count ? data.size() / count : 0);
+		put<uint32_t>(record, count);
+		record.insert(record.end(), data.data(), data.data() + data.size());
+	}
+	uint32_t size = record.size() - start - sizeof(uint32_t);
+	memcpy(record.data() + start, &size, sizeof(size));
+}
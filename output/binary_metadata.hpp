@@ -0,0 +1,50 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * binary_metadata.hpp - compact binary metadata format (--metadata-format bin)
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <libcamera/controls.h>
+
+// The binary metadata file starts with a header naming the controls, then has one record for each frame, in which
+// each control is just its id, a type and the raw bytes of its value. This costs next to nothing to write compared to
+// the text formats, and utils/metadata_convert.py turns it into those whenever they are wanted. All values are in the
+// host's byte order, so little-endian on a Pi.
+//
+// Header:
+//   char[8] "RPIMETA1"
+//   uint32  number of names, then for each: uint32 id, uint16 length, char[length] name
+// Frame record:
+//   uint32  size of the rest of the record in bytes
+//   uint32  number of controls, then for each:
+//     uint32 id, uint8 type (BinaryMetadataType), uint8 element size, uint32 element count,
+//     element count * element size bytes of value
+// Strings have an element size of 1 and a count of their length, and a rectangle is 4 int32s (x, y, width, height).
+
+enum BinaryMetadataType : uint8_t
+{
+	BINARY_METADATA_NONE = 0,
+	BINARY_METADATA_BOOL = 1,
+	BINARY_METADATA_BYTE = 2,
+	BINARY_METADATA_INT32 = 3,
+	BINARY_METADATA_INT64 = 4,
+	BINARY_METADATA_FLOAT = 5,
+	BINARY_METADATA_STRING = 6,
+	BINARY_METADATA_RECTANGLE = 7,
+	BINARY_METADATA_SIZE = 8,
+	// Anything else this libcamera has (unsigned 16 and 32-bit values, say) is written as unsigned integers of its
+	// element size.
+	BINARY_METADATA_UNSIGNED = 9,
+};
+
+// The header, naming every control in the map, so that a file always has the names for any control it contains.
+std::vector<uint8_t> binary_metadata_header(libcamera::ControlIdMap const &id_map);
+
+// Append the record for one frame's metadata to "record".
+void binary_metadata_frame(libcamera::ControlList const &metadata, std::vector<uint8_t> &record);
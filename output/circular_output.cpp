@@ -5,91 +5,281 @@
  * circular_output.cpp - Write output to circular buffer which we save on exit.
  */
 
-#include "circular_output.hpp"
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
-// We're going to align the frames within the buffer to friendly byte boundaries
-static constexpr int ALIGN = 16; // power of 2, please
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
 
-struct Header
-{
-	unsigned int length;
-	bool keyframe;
-	int64_t timestamp;
-};
-static_assert(sizeof(Header) % ALIGN == 0, "Header should have aligned size");
+#include "core/memory_budget.hpp"
+
+#include "circular_output.hpp"
+
+// The part of the buffer kept free while there's no dump is 1 / HEADROOM_FRACTION of it.
+static constexpr size_t HEADROOM_FRACTION = 8;
 
 // Size of buffer (options->Get().circular) is given in megabytes.
-CircularOutput::CircularOutput(VideoOptions const *options) : Output(options), cb_(options->Get().circular << 20)
+CircularOutput::CircularOutput(VideoOptions const *options)
+	: Output(options), numbered_dumps_(options->Get().circular_trigger || options->Get().motion_postroll),
+	  buf_(options->Get().circular << 20), wptr_(0), skip_to_keyframe_(false), frames_dropped_(0), dump_count_(0),
+	  recording_motion_(false), last_motion_us_(0), trigger_(false), committed_(0), pin_(NO_POSITION), dump_end_(NO_POSITION), dump_state_(IDLE),
+	  abort_(false)
 {
+	if (options_->Get().output.empty() || (numbered_dumps_ && options_->Get().output == "-"))
+		throw std::runtime_error("circular output needs an output file");
 	// Open this now, so that we can get any complaints out of the way
-	if (options_->Get().output == "-")
-		fp_ = stdout;
-	else if (!options_->Get().output.empty())
+	if (!numbered_dumps_ && options_->Get().output != "-")
 	{
-		fp_ = fopen(options_->Get().output.c_str(), "w");
+		FILE *fp = fopen(options_->Get().output.c_str(), "w");
+		if (!fp)
+			throw std::runtime_error("could not open output file");
+		fclose(fp);
 	}
-	if (!fp_)
-		throw std::runtime_error("could not open output file");
+	// The buffer is a fixed size, so it's only counted in the memory budget, never refused by it.
+	MemoryBudget::Get().Charge(MemoryBudget::OUTPUT, buf_.size());
+	dump_thread_ = std::thread(&CircularOutput::dumpThread, this);
 }
 
 CircularOutput::~CircularOutput()
 {
-	// We do have to skip to the first I frame before dumping stuff to disk. If there are
-	// no I frames you will get nothing. Caveat emptor, methinks.
-	unsigned int total = 0, frames = 0;
-	bool seen_keyframe = false;
-	Header header;
-	FILE *fp = fp_; // can't capture a class member in a lambda
-	while (!cb_.Empty())
+	// Without triggers, we dump everything from the first keyframe on exit. If there are no keyframes you will get
+	// nothing. Caveat emptor, methinks. With them, we just let any dump in progress finish, and end any recording.
+	auto first_keyframe = std::find_if(index_.begin(), index_.end(), [](Entry const &e) { return e.keyframe; });
+	if (recording_motion_)
+		dump_end_ = wptr_;
+	if (!numbered_dumps_ && startDump(wptr_))
 	{
-		uint8_t *dst = (uint8_t *)&header;
-		cb_.Read(
-			[&dst](void *src, int n) {
-				memcpy(dst, src, n);
-				dst += n;
-			},
-			sizeof(header));
-		seen_keyframe |= header.keyframe;
-		if (seen_keyframe)
+		unsigned int frames = 0;
+		uint64_t total = 0;
+		for (auto it = first_keyframe; it != index_.end(); it++)
 		{
-			cb_.Read([fp](void *src, int n) { fwrite(src, 1, n, fp); }, header.length);
-			cb_.Skip((ALIGN - header.length) & (ALIGN - 1));
-			total += header.length;
+			Entry const &entry = *it;
 			if (fp_timestamps_)
-			{
-				Output::timestampReady(header.timestamp);
-			}
+				Output::timestampReady(entry.timestamp);
+			total += entry.length;
 			frames++;
 		}
-		else
-			cb_.Skip((header.length + ALIGN - 1) & ~(ALIGN - 1));
+		LOG(1, "Wrote " << total << " bytes (" << frames << " frames)");
 	}
-	fclose(fp_);
-	LOG(1, "Wrote " << total << " bytes (" << frames << " frames)");
+
+	{
+		// The dump thread tells us when it goes idle.
+		std::unique_lock<std::mutex> lock(mutex_);
+		cond_.notify_all();
+		cond_.wait(lock, [this] { return dump_state_.load() == IDLE; });
+	}
+	abort_ = true;
+	cond_.notify_one();
+	dump_thread_.join();
+
+	if (frames_dropped_)
+		LOG(1, "CircularOutput: " << frames_dropped_ << " frames dropped waiting for dumps to finish");
+	MemoryBudget::Get().Credit(MemoryBudget::OUTPUT, buf_.size());
+}
+
+void CircularOutput::Signal()
+{
+	if (options_->Get().circular_trigger)
+		Trigger();
+	else
+		Output::Signal();
+}
+
+void CircularOutput::Trigger()
+{
+	trigger_ = true;
+}
+
+uint64_t CircularOutput::oldest() const
+{
+	uint64_t tail = index_.empty() ? wptr_ : index_.front().offset;
+	return std::min(tail, pin_.load(std::memory_order_acquire));
 }
 
 void CircularOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
 {
-	// First make sure there's enough space.
-	int pad = (ALIGN - size) & (ALIGN - 1);
-	while (size + pad + sizeof(Header) > cb_.Available())
+	if (trigger_.exchange(false) && !startDump(wptr_))
+		LOG(1, "CircularOutput: can't dump yet, " << (dump_state_.load() != IDLE ? "already dumping" : "no keyframe"));
+
+	if (options_->Get().motion_postroll)
+		handleMotion(timestamp_us);
+
+	bool keyframe = flags & FLAG_KEYFRAME;
+	if (size > buf_.size())
+		throw std::runtime_error("circular buffer too small");
+	if (skip_to_keyframe_ && !keyframe)
+		return;
+
+	// Make space by dropping whole GOPs from the front, since a dump would have to skip them anyway. Unless a dump
+	// is running, keep a little in hand so that frames arriving just after one starts have somewhere to go while the
+	// dump thread gets going.
+	size_t limit = pin_.load(std::memory_order_acquire) == NO_POSITION ? buf_.size() - buf_.size() / HEADROOM_FRACTION
+																	   : buf_.size();
+	while (wptr_ + size - oldest() > std::max(limit, size))
+	{
+		if (pin_.load(std::memory_order_acquire) <= oldest() || index_.empty())
+		{
+			// The dump thread is still reading what we need to overwrite.
+			frames_dropped_++;
+			skip_to_keyframe_ = true;
+			return;
+		}
+		index_.pop_front();
+		while (!index_.empty() && !index_.front().keyframe)
+			index_.pop_front();
+	}
+
+	size_t pos = wptr_ % buf_.size();
+	size_t first = std::min(size, buf_.size() - pos);
+	memcpy(&buf_[pos], mem, first);
+	memcpy(&buf_[0], (uint8_t *)mem + first, size - first);
+	index_.push_back({ wptr_, size, keyframe, timestamp_us });
+	wptr_ += size;
+	skip_to_keyframe_ = false;
+	committed_.store(wptr_, std::memory_order_release);
+
+	if (dump_state_.load() != IDLE)
+		cond_.notify_one();
+}
+
+bool CircularOutput::startDump(uint64_t end)
+{
+	if (dump_state_.load() != IDLE)
+		return false;
+	auto it = std::find_if(index_.begin(), index_.end(), [](Entry const &e) { return e.keyframe; });
+	if (it == index_.end())
+		return false;
+
+	dump_filename_ = numbered_dumps_ ? dumpFilename() : options_->Get().output;
+	dump_end_ = end;
+	pin_.store(it->offset, std::memory_order_release);
+	dump_state_ = STARTING;
+	cond_.notify_one();
+	return true;
+}
+
+void CircularOutput::handleMotion(int64_t timestamp_us)
+{
+	bool motion = frame_info_ && frame_info_->motion;
+	if (motion)
+		last_motion_us_ = timestamp_us;
+
+	if (!recording_motion_)
+	{
+		// If the last recording is still being written out, this just waits for a later frame.
+		if (motion && startDump(NO_POSITION))
+		{
+			recording_motion_ = true;
+			LOG(1, "CircularOutput: motion, recording to " << dump_filename_);
+		}
+	}
+	else if (!motion && timestamp_us - last_motion_us_ > (int64_t)options_->Get().motion_postroll * 1000)
+	{
+		// The recording ends with the frame before this one; the dump thread finishes it off.
+		dump_end_ = wptr_;
+		recording_motion_ = false;
+		LOG(1, "CircularOutput: motion stopped, ending recording");
+	}
+}
+
+std::string CircularOutput::dumpFilename()
+{
+	// Number the dumps, through the output name if it has a printf directive, otherwise just before the extension.
+	std::string const &output = options_->Get().output;
+	unsigned int count = dump_count_++;
+	if (output.find('%') != std::string::npos)
+	{
+		char filename[256];
+		snprintf(filename, sizeof(filename), output.c_str(), count);
+		return filename;
+	}
+	std::filesystem::path path(output);
+	std::filesystem::path ext = path.extension();
+	path.replace_extension();
+	path += "-" + std::to_string(count);
+	path += ext;
+	return path.string();
+}
+
+void CircularOutput::dumpThread()
+{
+	int fd = -1;
+	while (true)
 	{
-		if (cb_.Empty())
-			throw std::runtime_error("circular buffer too small");
-		Header header;
-		uint8_t *dst = (uint8_t *)&header;
-		cb_.Read(
-			[&dst](void *src, int n) {
-				memcpy(dst, src, n);
-				dst += n;
-			},
-			sizeof(header));
-		cb_.Skip((header.length + ALIGN - 1) & ~(ALIGN - 1));
+		int state = dump_state_.load();
+		if (state == STARTING)
+		{
+			if (dump_filename_ == "-")
+				fd = dup(STDOUT_FILENO);
+			else
+				fd = open(dump_filename_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+			if (fd < 0)
+				LOG_ERROR("ERROR: CircularOutput: could not open " << dump_filename_);
+			else
+				LOG(1, "CircularOutput: dumping to " << dump_filename_);
+			dump_state_ = ACTIVE;
+		}
+		else if (state == ACTIVE)
+		{
+			bool done = writeDump(fd);
+			if (done || fd < 0)
+			{
+				if (fd >= 0)
+					close(fd);
+				fd = -1;
+				pin_.store(NO_POSITION, std::memory_order_release);
+				dump_end_ = NO_POSITION;
+				{
+					// Under the lock, so that the destructor can't miss it between checking and waiting.
+					std::lock_guard<std::mutex> lock(mutex_);
+					dump_state_ = IDLE;
+				}
+				cond_.notify_all();
+			}
+		}
+		else if (abort_)
+			return;
+
+		if (dump_state_.load() != STARTING)
+		{
+			// A missed notification only costs us a moment.
+			std::unique_lock<std::mutex> lock(mutex_);
+			cond_.wait_for(lock, std::chrono::milliseconds(20));
+		}
+	}
+}
+
+bool CircularOutput::writeDump(int fd)
+{
+	// Write everything complete that is (still) wanted, in at most two pieces since the buffer may wrap.
+	while (true)
+	{
+		uint64_t from = pin_.load(std::memory_order_relaxed);
+		uint64_t end = dump_end_.load();
+		uint64_t to = std::min(committed_.load(std::memory_order_acquire), end);
+		if (from >= end)
+			return true;
+		if (from >= to || fd < 0)
+			return fd < 0;
+
+		size_t pos = from % buf_.size();
+		size_t length = to - from;
+		size_t first = std::min(length, buf_.size() - pos);
+		iovec iov[2] = { { &buf_[pos], first }, { &buf_[0], length - first } };
+		ssize_t ret = writev(fd, iov, length > first ? 2 : 1);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+		{
+			LOG_ERROR("ERROR: CircularOutput: failed to write dump " << dump_filename_);
+			return true;
+		}
+		// Once this is published the output thread may overwrite what we've just written.
+		pin_.store(from + ret, std::memory_order_release);
 	}
-	Header header = { static_cast<unsigned int>(size), !!(flags & FLAG_KEYFRAME), timestamp_us };
-	cb_.Write(&header, sizeof(header));
-	cb_.Write(mem, size);
-	cb_.Pad(pad);
 }
 
 void CircularOutput::timestampReady(int64_t timestamp)
@@ -7,50 +7,24 @@
 
 #pragma once
 
-#include "output.hpp"
-
-// A simple circular buffer implementation used by the CircularOutput class.
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
 
-class CircularBuffer
-{
-public:
-	CircularBuffer(size_t size) : size_(size), buf_(size), rptr_(0), wptr_(0) {}
-	bool Empty() const { return rptr_ == wptr_; }
-	size_t Available() const { return wptr_ == rptr_ ? size_ - 1 : (size_ - wptr_ + rptr_) % size_ - 1; }
-	void Skip(unsigned int n) { rptr_ = (rptr_ + n) % size_; }
-	// The dst function allows bytes read to go straight to memory or a file etc.
-	void Read(std::function<void(void *src, unsigned int n)> dst, unsigned int n)
-	{
-		if (rptr_ + n >= size_)
-		{
-			dst(&buf_[rptr_], size_ - rptr_);
-			n -= size_ - rptr_;
-			rptr_ = 0;
-		}
-		dst(&buf_[rptr_], n);
-		rptr_ += n;
-	}
-	void Pad(unsigned int n) { wptr_ = (wptr_ + n) % size_; }
-	void Write(const void *ptr, unsigned int n)
-	{
-		if (wptr_ + n >= size_)
-		{
-			memcpy(&buf_[wptr_], ptr, size_ - wptr_);
-			n -= size_ - wptr_;
-			ptr = static_cast<const uint8_t *>(ptr) + size_ - wptr_;
-			wptr_ = 0;
-		}
-		memcpy(&buf_[wptr_], ptr, n);
-		wptr_ += n;
-	}
-
-private:
-	const size_t size_;
-	std::vector<uint8_t> buf_;
-	size_t rptr_, wptr_;
-};
+#include "output.hpp"
 
-// Write frames to a circular buffer, and dump them to disk when we quit.
+// Write frames to a circular buffer, and dump them to disk when we quit, or (with --circular-trigger) whenever
+// we're triggered. With --motion-postroll, motion reported by the motion_detect stage starts a recording instead: the
+// buffer is dumped and then live frames follow into the same file until the post-roll after the motion has passed.
+//
+// Frame data goes into the buffer back to back, and a separate index says where each frame is and whether it's a
+// keyframe, so making space drops whole GOPs and a dump starts straight at a keyframe. Dumps are written by a
+// thread of their own, with writev straight from the buffer. Only the encoder's output thread ever touches the
+// index; it shares nothing with the dump thread beyond a few atomic positions, so it never waits for a dump. If
+// it runs out of space because a dump hasn't got far enough yet, it drops frames (up to the next keyframe) instead.
 
 class CircularOutput : public Output
 {
@@ -58,11 +32,64 @@ public:
 	CircularOutput(VideoOptions const *options);
 	~CircularOutput();
 
+	void Signal() override;
+	// Dump the buffer, from its first keyframe, to a new file. Safe to call from any thread.
+	void Trigger();
+
 protected:
 	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
 	void timestampReady(int64_t timestamp) override;
 
 private:
-	CircularBuffer cb_;
-	FILE *fp_;
+	// Positions are absolute byte counts since we started, taken modulo the buffer size to index it.
+	static constexpr uint64_t NO_POSITION = UINT64_MAX;
+
+	struct Entry
+	{
+		uint64_t offset;
+		size_t length;
+		bool keyframe;
+		int64_t timestamp;
+	};
+
+	enum DumpState
+	{
+		IDLE,
+		STARTING,
+		ACTIVE
+	};
+
+	uint64_t oldest() const;
+	bool startDump(uint64_t end);
+	void dumpThread();
+	bool writeDump(int fd);
+	std::string dumpFilename();
+
+	void handleMotion(int64_t timestamp_us);
+
+	bool numbered_dumps_;
+	std::vector<uint8_t> buf_;
+	// Encoder output thread only.
+	std::deque<Entry> index_;
+	uint64_t wptr_;
+	bool skip_to_keyframe_;
+	uint64_t frames_dropped_;
+	unsigned int dump_count_;
+	bool recording_motion_;
+	int64_t last_motion_us_;
+
+	// Shared with the dump thread.
+	std::atomic<bool> trigger_;
+	std::atomic<uint64_t> committed_; // end of the last complete frame
+	std::atomic<uint64_t> pin_; // where the dump has got to; nothing from here on may be overwritten
+	std::atomic<uint64_t> dump_end_;
+	std::atomic<int> dump_state_;
+	std::string dump_filename_; // written only while IDLE
+	std::atomic<bool> abort_;
+
+	// The dump thread sleeps on this and the output thread notifies it, except on destruction, when the output thread
+	// waits here for the dump thread to go idle.
+	std::mutex mutex_;
+	std::condition_variable cond_;
+	std::thread dump_thread_;
 };
@@ -0,0 +1,16 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * crc32c.hpp - CRC-32C (Castagnoli) checksums of output frames.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// The CRC-32C of "size" bytes, as used by iSCSI, ext4 and friends (so "crc32c" in most languages' libraries). Pass
+// the result of one call as "crc" to the next to checksum data in pieces. The ARMv8 CRC instructions are used when the
+// CPU has them, otherwise a table.
+uint32_t crc32c(void const *mem, size_t size, uint32_t crc = 0);
@@ -0,0 +1,269 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * fanout_output.cpp - serve the output stream to several network clients.
+ */
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <stdexcept>
+
+#include "core/logging.hpp"
+
+#include "fanout_output.hpp"
+
+static constexpr int MAX_EVENTS = 16;
+
+FanoutOutput::FanoutOutput(VideoOptions const *options)
+	: Output(options), max_clients_(options->Get().fanout), queue_limit_(std::max(options->Get().fanout_queue, 1u)),
+	  listen_fd_(-1), epoll_fd_(-1), event_fd_(-1), abort_(false)
+{
+	char protocol[4];
+	int start, end, a, b, c, d, port;
+	if (sscanf(options->Get().output.c_str(), "%3s://%n%d.%d.%d.%d%n:%d", protocol, &start, &a, &b, &c, &d, &end,
+			   &port) != 6 ||
+		strcmp(protocol, "tcp"))
+		throw std::runtime_error("bad network address " + options->Get().output);
+	std::string address = options->Get().output.substr(start, end - start);
+
+	sockaddr_in saddr = {};
+	saddr.sin_family = AF_INET;
+	saddr.sin_port = htons(port);
+	if (inet_aton(address.c_str(), &saddr.sin_addr) == 0)
+		throw std::runtime_error("inet_aton failed for " + address);
+
+	listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd_ < 0)
+		throw std::runtime_error("unable to open listen socket");
+	int enable = 1;
+	if (setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0)
+		throw std::runtime_error("failed to setsockopt listen socket");
+	if (bind(listen_fd_, (sockaddr *)&saddr, sizeof(saddr)) < 0)
+		throw std::runtime_error("failed to bind listen socket");
+	if (listen(listen_fd_, max_clients_) < 0)
+		throw std::runtime_error("failed to listen on socket");
+
+	epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+	event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (epoll_fd_ < 0 || event_fd_ < 0)
+		throw std::runtime_error("failed to create epoll or event fd");
+	epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.fd = listen_fd_;
+	epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &ev);
+	ev.data.fd = event_fd_;
+	epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, event_fd_, &ev);
+
+	LOG(1, "FanoutOutput: serving up to " << max_clients_ << " clients on " << options->Get().output);
+	thread_ = std::thread(&FanoutOutput::serverThread, this);
+}
+
+FanoutOutput::~FanoutOutput()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+	}
+	wake();
+	thread_.join();
+
+	while (!clients_.empty())
+		removeClient(clients_.begin()->first, "shutting down");
+	close(event_fd_);
+	close(epoll_fd_);
+	close(listen_fd_);
+}
+
+void FanoutOutput::outputBuffer(void *mem, size_t size, int64_t /*timestamp_us*/, uint32_t flags)
+{
+	LOG(2, "FanoutOutput: output buffer " << mem << " size " << size);
+	bool keyframe = flags & FLAG_KEYFRAME;
+	FramePtr frame;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		for (auto &[fd, client] : clients_)
+		{
+			if (client->need_keyframe && !keyframe)
+				continue;
+			if (client->queue.size() >= queue_limit_)
+			{
+				// This client can't keep up. Whatever it's in the middle of sending finishes, so the stream stays
+				// intact, but the rest goes and it starts again from a keyframe.
+				client->frames_dropped += client->queue.size();
+				client->queue.clear();
+				client->need_keyframe = true;
+				LOG(2, "FanoutOutput: client " << client->name << " too slow, skipping to next keyframe");
+				if (!keyframe)
+					continue;
+			}
+			if (!frame)
+			{
+				// One copy, however many clients there are.
+				auto f = std::make_shared<Frame>();
+				f->data.assign((uint8_t *)mem, (uint8_t *)mem + size);
+				f->keyframe = keyframe;
+				frame = f;
+			}
+			client->need_keyframe = false;
+			client->queue.push_back(frame);
+		}
+	}
+
+	if (frame)
+		wake();
+}
+
+void FanoutOutput::wake()
+{
+	uint64_t one = 1;
+	if (write(event_fd_, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		LOG_ERROR("FanoutOutput: failed to wake server thread");
+}
+
+void FanoutOutput::serverThread()
+{
+	epoll_event events[MAX_EVENTS];
+	while (true)
+	{
+		int n = epoll_wait(epoll_fd_, events, MAX_EVENTS, -1);
+		if (n < 0 && errno != EINTR)
+		{
+			LOG_ERROR("ERROR: FanoutOutput: epoll_wait failed: " << strerror(errno));
+			return;
+		}
+
+		for (int i = 0; i < n; i++)
+		{
+			int fd = events[i].data.fd;
+			if (fd == listen_fd_)
+				acceptClients();
+			else if (fd == event_fd_)
+			{
+				uint64_t count;
+				if (read(event_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN)
+					LOG_ERROR("FanoutOutput: failed to read event fd");
+			}
+			else if (events[i].events & (EPOLLHUP | EPOLLERR | EPOLLRDHUP))
+				removeClient(fd, "disconnected");
+			else if (events[i].events & EPOLLOUT)
+			{
+				auto it = clients_.find(fd);
+				if (it != clients_.end())
+					it->second->writable = true;
+			}
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (abort_)
+				return;
+		}
+
+		// Send whatever we can to every client whose socket has room. Clients list changes only on this thread.
+		std::vector<int> failed;
+		for (auto &[fd, client] : clients_)
+		{
+			if (client->writable && !sendToClient(*client))
+				failed.push_back(fd);
+		}
+		for (int fd : failed)
+			removeClient(fd, "send failed");
+	}
+}
+
+void FanoutOutput::acceptClients()
+{
+	while (true)
+	{
+		sockaddr_in saddr = {};
+		socklen_t len = sizeof(saddr);
+		int fd = accept4(listen_fd_, (sockaddr *)&saddr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+			return;
+
+		std::string name = std::string(inet_ntoa(saddr.sin_addr)) + ":" + std::to_string(ntohs(saddr.sin_port));
+		if (clients_.size() >= max_clients_)
+		{
+			LOG(1, "FanoutOutput: refusing client " << name << ", already serving " << clients_.size());
+			close(fd);
+			continue;
+		}
+
+		// Edge triggered: we hear when a full socket gains room, and otherwise just send when there are frames.
+		epoll_event ev = {};
+		ev.events = EPOLLOUT | EPOLLET | EPOLLRDHUP;
+		ev.data.fd = fd;
+		if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) < 0)
+		{
+			close(fd);
+			continue;
+		}
+
+		auto client = std::make_unique<Client>();
+		client->fd = fd;
+		client->name = name;
+		std::lock_guard<std::mutex> lock(mutex_);
+		clients_[fd] = std::move(client);
+		LOG(1, "FanoutOutput: client " << name << " connected (" << clients_.size() << " now)");
+	}
+}
+
+void FanoutOutput::removeClient(int fd, char const *reason)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	auto it = clients_.find(fd);
+	if (it == clients_.end())
+		return;
+	Client const &client = *it->second;
+	LOG(1, "FanoutOutput: client " << client.name << " " << reason << " after " << client.frames_sent
+								   << " frames, " << client.frames_dropped << " dropped");
+	epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+	close(fd);
+	clients_.erase(it);
+}
+
+bool FanoutOutput::sendToClient(Client &client)
+{
+	while (true)
+	{
+		if (!client.current)
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (client.queue.empty())
+				return true;
+			client.current = std::move(client.queue.front());
+			client.queue.pop_front();
+			client.offset = 0;
+		}
+
+		Frame const &frame = *client.current;
+		ssize_t ret = send(client.fd, frame.data.data() + client.offset, frame.data.size() - client.offset,
+						   MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				// Wait for EPOLLOUT to say there's room again.
+				client.writable = false;
+				return true;
+			}
+			return false;
+		}
+		client.offset += ret;
+		if (client.offset == frame.data.size())
+		{
+			client.current.reset();
+			client.frames_sent++;
+		}
+	}
+}
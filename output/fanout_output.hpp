@@ -0,0 +1,73 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * fanout_output.hpp - serve the output stream to several network clients.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "output.hpp"
+
+// Listens on the tcp:// address given as the output and sends every client the stream from the next keyframe
+// after it connects. Clients are served by a thread of their own using epoll, with the frames shared between them,
+// so a slow client never holds up the encoder. Instead, a client whose queue fills up loses what was queued and
+// picks up again at the next keyframe.
+
+class FanoutOutput : public Output
+{
+public:
+	FanoutOutput(VideoOptions const *options);
+	~FanoutOutput();
+
+protected:
+	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
+
+private:
+	struct Frame
+	{
+		std::vector<uint8_t> data;
+		bool keyframe;
+	};
+	typedef std::shared_ptr<Frame const> FramePtr;
+
+	struct Client
+	{
+		int fd;
+		std::string name;
+		// Protected by mutex_.
+		std::deque<FramePtr> queue;
+		bool need_keyframe = true;
+		uint64_t frames_dropped = 0;
+		// Only touched by the server thread.
+		FramePtr current;
+		size_t offset = 0;
+		bool writable = true;
+		uint64_t frames_sent = 0;
+	};
+
+	void serverThread();
+	void acceptClients();
+	void removeClient(int fd, char const *reason);
+	bool sendToClient(Client &client);
+	void wake();
+
+	unsigned int max_clients_;
+	size_t queue_limit_;
+	int listen_fd_;
+	int epoll_fd_;
+	int event_fd_;
+
+	std::mutex mutex_;
+	std::map<int, std::unique_ptr<Client>> clients_;
+	bool abort_;
+	std::thread thread_;
+};
@@ -1,6 +1,15 @@
 #pragma once
 
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <condition_variable>
+#include <cstdio>
 #include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <thread>
+#include <vector>
 #include "core/options.hpp"
 
 namespace fs = std::filesystem;
@@ -9,10 +18,35 @@ class FileNameManager {
 public:
     FileNameManager(Options const *options) {
         options_ = options;
-        initializeCurrentOperatingDirectory();
+        if (!loadState()) {
+            initializeCurrentOperatingDirectory();
+        }
+        saveState();
         currentFileName = "";
+        if (options_->Get().dir_lookahead || options_->Get().preallocate) {
+            updateLookahead();
+            lookahead_thread_ = std::thread(&FileNameManager::lookaheadThread, this);
+        }
     }
 
+    ~FileNameManager() {
+        if (lookahead_thread_.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(lookahead_mutex_);
+                lookahead_abort_ = true;
+            }
+            lookahead_cond_.notify_one();
+            lookahead_thread_.join();
+            removeUnusedLookahead();
+        }
+    }
+
+    // Expected size of the files still to come, for --preallocate. Files of the same stream geometry come out much
+    // the same size, so the size of the last one does nicely.
+    void setExpectedFileSize(size_t size) {
+        std::lock_guard<std::mutex> lock(lookahead_mutex_);
+        lookahead_.expected_size = size;
+    }
 
     std::string getNextFileName() {
         // Making a new file will increase the current directory beyond its requested size
@@ -20,23 +54,13 @@ public:
 		    makeNewCurrentDir();
 	    }
         
-        char filename[256];
-        int n = snprintf(filename, sizeof(filename), options_->Get().output.c_str(), images_written);
-        if (n < 0)
-            throw std::runtime_error("failed to generate filename");
-
-        // Generate the next output file name.
-        // We should expect a filename to be build by the parentDir + current_directory + output file name
-        std::string fileNameString(filename);
-        fs::path pathToCurrentDir = fs::path(options_->Get().parent_directory) / current_directory_;
-        fs::path pathToFile = pathToCurrentDir / fileNameString;
-
-        if(options_->Get().force_dng && pathToFile.extension() != DNG_EXTENSION) {
-            pathToFile.replace_extension(DNG_EXTENSION);
-        }
+        fs::path pathToFile = makeFileName(images_written, current_directory_);
 
         images_written++;
         current_directory_size_++;
+        if (lookahead_thread_.joinable()) {
+            updateLookahead();
+        }
         currentFileName = pathToFile.string();
         return currentFileName;
     }
@@ -51,6 +75,11 @@ public:
 
 private:
     inline static const std::string DNG_EXTENSION = ".dng";
+    // Lives in the parent directory and records where the last run left off, so that we needn't rescan everything
+    // on startup. Its contents are "<directory number> <files in directory> <directory name>". It is only written on
+    // startup and when we move to a new directory, so as not to add a write for every file; the count is only what it
+    // was then, and the files in the directory are counted again on loading it.
+    inline static const std::string STATE_FILENAME = ".rpicam-state";
     Options const *options_;
     unsigned int directory_count_;
     unsigned int current_directory_size_;
@@ -58,17 +87,151 @@ private:
     fs::path current_directory_;
     std::string currentFileName;
 
+    // Where the lookahead thread should work from, copied from the fields above whenever they change.
+    struct LookaheadState {
+        unsigned int directory_count = 0;
+        unsigned int directory_size = 0;
+        unsigned int images_written = 0;
+        fs::path directory;
+        size_t expected_size = 0;
+    };
+    std::mutex lookahead_mutex_;
+    std::condition_variable lookahead_cond_;
+    LookaheadState lookahead_;
+    bool lookahead_changed_ = false;
+    bool lookahead_abort_ = false;
+    std::thread lookahead_thread_;
+
+    fs::path makeDirPath(unsigned int num) {
+        char dirName[256];
+        snprintf(dirName, sizeof(dirName), options_->Get().output_directory.c_str(), num);
+        return fs::path(options_->Get().parent_directory) / std::string(dirName);
+    }
+
+    fs::path makeFileName(unsigned int index, fs::path const &directory) {
+        char filename[256];
+        int n = snprintf(filename, sizeof(filename), options_->Get().output.c_str(), index);
+        if (n < 0)
+            throw std::runtime_error("failed to generate filename");
+
+        // Generate the next output file name.
+        // We should expect a filename to be build by the parentDir + current_directory + output file name
+        std::string fileNameString(filename);
+        fs::path pathToCurrentDir = fs::path(options_->Get().parent_directory) / directory;
+        fs::path pathToFile = pathToCurrentDir / fileNameString;
+
+        if(options_->Get().force_dng && pathToFile.extension() != DNG_EXTENSION) {
+            pathToFile.replace_extension(DNG_EXTENSION);
+        }
+        return pathToFile;
+    }
+
+    // The names the next "count" files will get, following the same rollover rule as getNextFileName().
+    std::vector<fs::path> plannedFileNames(LookaheadState const &state, unsigned int count) {
+        std::vector<fs::path> names;
+        unsigned int dirNum = state.directory_count;
+        unsigned int dirSize = state.directory_size;
+        fs::path directory = state.directory;
+        for (unsigned int i = 0; i < count; i++) {
+            if (dirSize >= options_->Get().max_directory_size) {
+                directory = makeDirPath(++dirNum);
+                dirSize = 0;
+            }
+            names.push_back(makeFileName(state.images_written + i, directory));
+            dirSize++;
+        }
+        return names;
+    }
+
+    void updateLookahead() {
+        {
+            std::lock_guard<std::mutex> lock(lookahead_mutex_);
+            lookahead_.directory_count = directory_count_;
+            lookahead_.directory_size = current_directory_size_;
+            lookahead_.images_written = images_written;
+            lookahead_.directory = current_directory_;
+            lookahead_changed_ = true;
+        }
+        lookahead_cond_.notify_one();
+    }
+
+    // Keeps the next --dir-lookahead directories and the next --preallocate files in existence, so that neither
+    // directory nor file creation happens on the capture path.
+    void lookaheadThread() {
+        std::unique_lock<std::mutex> lock(lookahead_mutex_);
+        while (!lookahead_abort_) {
+            LookaheadState state = lookahead_;
+            lookahead_changed_ = false;
+            lock.unlock();
+
+            std::error_code ec;
+            for (unsigned int i = 1; i <= options_->Get().dir_lookahead; i++) {
+                fs::create_directory(makeDirPath(state.directory_count + i), ec);
+            }
+            for (fs::path const &name : plannedFileNames(state, options_->Get().preallocate)) {
+                preallocateFile(name, state.expected_size);
+            }
+
+            lock.lock();
+            lookahead_cond_.wait(lock, [this] { return lookahead_abort_ || lookahead_changed_; });
+        }
+    }
+
+    void preallocateFile(fs::path const &name, size_t size) {
+        // No O_TRUNC, in case the file has been handed out and written to since we looked. FALLOC_FL_KEEP_SIZE
+        // leaves the file empty for the writer, which trims any excess when it closes the file.
+        int fd = open(name.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            return;
+        }
+        if (size) {
+            fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size);
+        }
+        close(fd);
+    }
+
+    // Files and directories made ahead of time but never used shouldn't be left to confuse the next run.
+    void removeUnusedLookahead() {
+        LookaheadState state;
+        state.directory_count = directory_count_;
+        state.directory_size = current_directory_size_;
+        state.images_written = images_written;
+        state.directory = current_directory_;
+        std::error_code ec;
+        for (fs::path const &name : plannedFileNames(state, options_->Get().preallocate)) {
+            if (fs::is_regular_file(name, ec) && fs::file_size(name, ec) == 0) {
+                fs::remove(name, ec);
+            }
+        }
+        // Only empty directories get removed.
+        for (unsigned int i = 1; i <= options_->Get().dir_lookahead; i++) {
+            fs::remove(makeDirPath(directory_count_ + i), ec);
+        }
+    }
+
+    // Whether a directory holds anything we wrote, as opposed to being empty or holding only empty files made ahead
+    // of time.
+    bool holdsData(fs::path const &dirPath) {
+        std::error_code ec;
+        for (auto const &entry : fs::directory_iterator(dirPath, ec)) {
+            if (!entry.is_regular_file(ec) || entry.file_size(ec) != 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
     void makeNewCurrentDir() {
         directory_count_++;
 
         try {
-            char newDirName[256];
-            snprintf(newDirName, sizeof(newDirName), options_->Get().output_directory.c_str(), directory_count_);
-            fs::path newOperatingDir = fs::path(options_->Get().parent_directory) / std::string(newDirName);
-            // Create the directory
-            if (fs::create_directory(newOperatingDir)) {
+            fs::path newOperatingDir = makeDirPath(directory_count_);
+            // Create the directory, unless the lookahead thread already has.
+            if (fs::create_directory(newOperatingDir) ||
+                ((options_->Get().dir_lookahead || options_->Get().preallocate) && fs::is_directory(newOperatingDir))) {
                 current_directory_size_ = 0;
                 current_directory_ = newOperatingDir;
+                saveState();
             } else {
                 std::cerr << "Directory already exists: " << newOperatingDir << std::endl;
             }
@@ -77,6 +240,73 @@ private:
         }
     }
 
+    fs::path getStatePath() {
+        return fs::path(options_->Get().parent_directory) / STATE_FILENAME;
+    }
+
+    // Pick up from the state file, if there is one and it agrees with what's on disk. Returns false if the full scan
+    // is needed instead.
+    bool loadState() {
+        std::ifstream in(getStatePath());
+        unsigned int dirNum, staleSize;
+        std::string dirName;
+        if (!(in >> dirNum >> staleSize >> dirName)) {
+            return false;
+        }
+
+        fs::path dirPath = fs::path(options_->Get().parent_directory) / dirName;
+        fs::path nextPath = makeDirPath(dirNum + 1);
+        std::error_code ec;
+        // The directory must be the one the format gives for that number, must still exist, and mustn't have been
+        // overtaken by a newer one written without updating the state (for example by an older build). A newer one
+        // that is empty was just made ahead of time.
+        if (dirPath != makeDirPath(dirNum) || !fs::is_directory(dirPath, ec) ||
+            (fs::exists(nextPath, ec) && holdsData(nextPath))) {
+            std::cerr << "Ignoring inconsistent state file " << getStatePath() << ", rescanning" << std::endl;
+            return false;
+        }
+
+        directory_count_ = dirNum;
+        current_directory_ = dirPath;
+        current_directory_size_ = countFilesWritten(dirPath);
+        return true;
+    }
+
+    // Files in the directory that hold something, leaving out any made ahead of time that were never used.
+    unsigned int countFilesWritten(fs::path const &dirPath) {
+        std::error_code ec;
+        unsigned int count = 0;
+        for (auto const &entry : fs::directory_iterator(dirPath, ec)) {
+            if (entry.is_regular_file(ec) && entry.file_size(ec) != 0) {
+                count++;
+            }
+        }
+        return count;
+    }
+
+    // Written to a temporary file and renamed over the old one, so a crash leaves either the old state or the new.
+    void saveState() {
+        if (current_directory_.empty()) {
+            return;
+        }
+        fs::path statePath = getStatePath();
+        fs::path tmpPath = statePath;
+        tmpPath += ".tmp";
+        FILE *fp = fopen(tmpPath.c_str(), "w");
+        if (!fp) {
+            return;
+        }
+        bool ok = fprintf(fp, "%u %u %s\n", directory_count_, current_directory_size_,
+                          current_directory_.filename().c_str()) > 0;
+        ok = fclose(fp) == 0 && ok;
+        if (!ok || rename(tmpPath.c_str(), statePath.c_str())) {
+            // Better no state than a wrong one.
+            std::error_code ec;
+            fs::remove(tmpPath, ec);
+            fs::remove(statePath, ec);
+        }
+    }
+
     unsigned int getDirectorySize(const fs::path& dirPath) {
         unsigned int totalSize = 0;
 
@@ -4,90 +4,211 @@
  *
  * file_output.cpp - Write output to file.
  */
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cmath>
 #include <filesystem>
 #include <string>
 #include <fstream>
 
 #include "file_output.hpp"
 #include "file_name_manager.hpp"
-#include "image/image.hpp"
 #include <libcamera/control_ids.h>
 #include <libcamera/formats.h>
-#include "core/still_options.hpp"
 #include "core/stream_info.hpp"
 #include "core/options.hpp"
+#include "core/trace.hpp"
 #include <nlohmann/json.hpp>
 
 namespace fs = std::filesystem;
 using json = nlohmann::json;
 
 FileOutput::FileOutput(VideoOptions const *options)
-	: Output(options), fp_(nullptr), file_start_time_ms_(0), fileNameManager_((Options*)options)
+	: Output(options), fp_(nullptr), file_start_time_ms_(0), fileNameManager_((Options*)options),
+	  fp_metadata_(nullptr), metadata_unflushed_(0), writer_file_open_(false),
+	  file_bytes_(0)
 {
-	// Nothing
+	if (options->Get().write_behind && options->Get().output != "-")
+		writer_ = std::make_unique<FileWriter>(options);
 }
 
 FileOutput::~FileOutput()
 {
-	closeFile();
+	try
+	{
+		closeFile();
+	}
+	catch (std::exception const &e)
+	{
+		LOG_ERROR("ERROR: FileOutput: " << e.what());
+	}
+	// Let the writer finish before the metadata is closed (and possibly merged).
+	writer_.reset();
+	closeMetadata();
 }
 
 void FileOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
 {
 	saveFile(mem, size, timestamp_us, flags);
 
-	bool isFirstFrame = getCurrentFileName().empty();
-	std::string metadataFilename = options_->Get().output_metadata_location;
-	libcamera::ControlList metadata;
-
-	if(!options_->Get().metadata.empty() && !metadata_queue_.empty() && !metadataFilename.empty()) {
-		metadata = metadata_queue_.front();
-		const libcamera::ControlIdMap *id_map = metadata.idMap();
-		json currentObject, metadataJson, metadataSummary;
-		metadataJson["filename"] = getCurrentFileName();
-		for (auto const &[id, val] : metadata)
-			metadataSummary[id_map->at(id)->name()] = val.toString();
-		metadataJson["metadata"] = metadataSummary;
-		currentObject[std::to_string(fileNameManager_.getImagesWritten())] = metadataJson;
-		if(isFirstFrame) {
-			std::ofstream outFile(metadataFilename);
-			if (!outFile.is_open())
+	if (!options_->Get().metadata.empty() && !metadata_queue_.empty() &&
+		!options_->Get().output_metadata_location.empty())
+		writeMetadata(metadata_queue_.front());
+}
+
+void FileOutput::writeMetadata(libcamera::ControlList const &metadata)
+{
+	std::string const &metadataFilename = options_->Get().output_metadata_location;
+	const libcamera::ControlIdMap *id_map = metadata.idMap();
+	json currentObject, metadataJson, metadataSummary;
+	metadataJson["filename"] = getCurrentFileName();
+	for (auto const &[id, val] : metadata)
+		metadataSummary[id_map->at(id)->name()] = val.toString();
+	metadataJson["metadata"] = metadataSummary;
+	if (frame_info_ && frame_info_->suppressed_before)
+		metadataJson["suppressed_before"] = frame_info_->suppressed_before;
+	if (frame_info_ && frame_info_->strobe_offset_ns)
+		metadataJson["strobe_offset_ns"] = *frame_info_->strobe_offset_ns;
+	if (frame_info_ && frame_info_->xvs_offset_ns)
+		metadataJson["xvs_offset_ns"] = *frame_info_->xvs_offset_ns;
+	if (frame_info_ && frame_info_->bracket_step)
+		metadataJson["bracket_step"] = *frame_info_->bracket_step;
+	if (frame_info_ && frame_info_->thermal_step)
+		metadataJson["thermal_step"] = *frame_info_->thermal_step;
+	if (frame_info_ && frame_info_->particles)
+	{
+		// Kept compact, as there's a record for every frame: each particle is [area, x, y, left, top, width, height].
+		ParticleResults const &particles = *frame_info_->particles;
+		json list = json::array();
+		for (ParticleResults::Particle const &p : particles.particles)
+			list.push_back({ p.area, std::round(p.x * 10.0) / 10.0, std::round(p.y * 10.0) / 10.0, p.box.x, p.box.y,
+							 p.box.width, p.box.height });
+		metadataJson["particles"] = { { "count", particles.count }, { "area", particles.total_area },
+									  { "list", std::move(list) } };
+	}
+	if (checksum_)
+	{
+		char crc[9];
+		snprintf(crc, sizeof(crc), "%08x", *checksum_);
+		metadataJson["crc32c"] = crc;
+	}
+	currentObject[std::to_string(fileNameManager_.getImagesWritten())] = metadataJson;
+
+	if (options_->Get().output_metadata_format == "ndjson")
+	{
+		// Each record is a complete single-line JSON object, appended with a single write, so
+		// the cost per frame stays constant however long the capture runs.
+		if (!fp_metadata_)
+		{
+			fp_metadata_ = fopen(metadataFilename.c_str(), "w");
+			if (!fp_metadata_)
 				throw std::runtime_error("failed to open metadata output file " + metadataFilename);
-			outFile << currentObject.dump(2);
-			outFile.close();
-		} else {
-			// Read existing JSON file and merge new entry
-			json existingObject;
-			std::ifstream inFile(metadataFilename);
-			if (inFile.is_open()) {
-				try {
-					inFile >> existingObject;
-				} catch (const json::parse_error&) {
-					// If parsing fails, start with empty object
-					existingObject = json::object();
-				}
-				inFile.close();
-			}
-			// Merge the new entry into the existing object
-			for (auto& [key, value] : currentObject.items()) {
-				existingObject[key] = value;
+			LOG(2, "FileOutput: opened metadata file " << metadataFilename);
+		}
+
+		std::string record = currentObject.dump() + "\n";
+		if (fwrite(record.data(), record.size(), 1, fp_metadata_) != 1)
+			throw std::runtime_error("failed to write metadata record");
+
+		unsigned int interval = options_->Get().output_metadata_flush_interval;
+		metadata_unflushed_++;
+		if (options_->Get().flush || (interval && metadata_unflushed_ >= interval))
+		{
+			fflush(fp_metadata_);
+			metadata_unflushed_ = 0;
+		}
+		return;
+	}
+
+	bool isFirstFrame = getCurrentFileName().empty();
+	if(isFirstFrame) {
+		std::ofstream outFile(metadataFilename);
+		if (!outFile.is_open())
+			throw std::runtime_error("failed to open metadata output file " + metadataFilename);
+		outFile << currentObject.dump(2);
+		outFile.close();
+	} else {
+		// Read existing JSON file and merge new entry
+		json existingObject;
+		std::ifstream inFile(metadataFilename);
+		if (inFile.is_open()) {
+			try {
+				inFile >> existingObject;
+			} catch (const json::parse_error&) {
+				// If parsing fails, start with empty object
+				existingObject = json::object();
 			}
-			// Write the complete updated JSON back to file
-			std::ofstream outFile(metadataFilename);
-			if (!outFile.is_open())
-				throw std::runtime_error("failed to open metadata output file " + metadataFilename);
-			outFile << existingObject.dump(2);
-			outFile.close();
+			inFile.close();
+		}
+		// Merge the new entry into the existing object
+		for (auto& [key, value] : currentObject.items()) {
+			existingObject[key] = value;
 		}
+		// Write the complete updated JSON back to file
+		std::ofstream outFile(metadataFilename);
+		if (!outFile.is_open())
+			throw std::runtime_error("failed to open metadata output file " + metadataFilename);
+		outFile << existingObject.dump(2);
+		outFile.close();
 	}
+}
 
+void FileOutput::closeMetadata()
+{
+	if (!fp_metadata_)
+		return;
+
+	fclose(fp_metadata_);
+	fp_metadata_ = nullptr;
+
+	// Optionally fold all the ndjson records into one JSON object, in the same layout that the
+	// "json" format produces. This only happens once, at shutdown.
+	std::string const &mergedFilename = options_->Get().output_metadata_merge;
+	if (mergedFilename.empty())
+		return;
+
+	std::ifstream inFile(options_->Get().output_metadata_location);
+	if (!inFile.is_open())
+	{
+		LOG_ERROR("FileOutput: failed to re-open metadata file " << options_->Get().output_metadata_location);
+		return;
+	}
+
+	json mergedObject = json::object();
+	std::string line;
+	while (std::getline(inFile, line))
+	{
+		if (line.empty())
+			continue;
+		try
+		{
+			for (auto &[key, value] : json::parse(line).items())
+				mergedObject[key] = value;
+		}
+		catch (const json::parse_error &)
+		{
+			// Most likely a truncated final record, e.g. after a power cut.
+			LOG_ERROR("FileOutput: skipping malformed metadata record");
+		}
+	}
+
+	std::ofstream outFile(mergedFilename);
+	if (!outFile.is_open())
+	{
+		LOG_ERROR("FileOutput: failed to open merged metadata file " << mergedFilename);
+		return;
+	}
+	outFile << mergedObject.dump(2);
+	LOG(2, "FileOutput: merged " << mergedObject.size() << " metadata records into " << mergedFilename);
 }
 
 void FileOutput::saveFile(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) {
+	TRACE_SCOPE("save_file", { "timestamp_us", timestamp_us }, { "bytes", size });
 	// We need to open a new file if we're in "segment" mode and our segment is full
 	// (though we have to wait for the next I frame), or if we're in "split" mode
 	// and recording is being restarted (this is necessarily an I-frame already).
-	if (fp_ == nullptr ||
+	if ((fp_ == nullptr && !writer_file_open_) ||
 		(options_->Get().segment && (flags & FLAG_KEYFRAME) &&
 		 timestamp_us / 1000 - file_start_time_ms_ > options_->Get().segment) ||
 		(options_->Get().split && (flags & FLAG_RESTART)))
@@ -97,7 +218,10 @@ void FileOutput::saveFile(void *mem, size_t size, int64_t timestamp_us, uint32_t
 	}
 
 	LOG(2, "FileOutput: output buffer " << mem << " size " << size);
-	if (fp_ && size)
+	file_bytes_ += size;
+	if (writer_file_open_ && size)
+		writer_->Append(mem, size);
+	else if (fp_ && size)
 	{
 		if (fwrite(mem, size, 1, fp_) != 1)
 			throw std::runtime_error("failed to write output bytes");
@@ -106,26 +230,6 @@ void FileOutput::saveFile(void *mem, size_t size, int64_t timestamp_us, uint32_t
 	}
 }
 
-void FileOutput::saveDng(void *mem) {
-	libcamera::ControlList metadata;
-	if (!options_->Get().metadata.empty())
-	{
-		metadata = metadata_queue_.front();
-	} else {
-		LOG(1, "No metadata");
-	}
-	std::string filename = fileNameManager_.getNextFileName();
-	StreamInfo *info = this->getStreamInfo();
-
-	dng_save(mem, *info, metadata, filename, "shadowgraph-v3", options_);
-}
-
-void FileOutput::savePng(void *mem) {
-	std::string filename = fileNameManager_.getNextFileName();
-	StreamInfo *info = this->getStreamInfo();
-	png_save(mem, *info, filename);
-}
-
 void FileOutput::openFile(int64_t timestamp_us)
 {
 	if (options_->Get().output == "-")
@@ -133,7 +237,23 @@ void FileOutput::openFile(int64_t timestamp_us)
 	else if (!options_->Get().output.empty())
 	{
 		std::string filename = fileNameManager_.getNextFileName();
-		fp_ = fopen(filename.c_str(), "w");
+		if (writer_)
+		{
+			writer_->Open(filename);
+			writer_file_open_ = true;
+			file_start_time_ms_ = timestamp_us / 1000;
+			return;
+		}
+		if (options_->Get().preallocate)
+		{
+			// Keep the space reserved for the file, and trim it to what we wrote when we close it.
+			int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+			fp_ = fd < 0 ? nullptr : fdopen(fd, "w");
+			if (fd >= 0 && !fp_)
+				close(fd);
+		}
+		else
+			fp_ = fopen(filename.c_str(), "w");
 		if (!fp_)
 			throw std::runtime_error("failed to open output file " + std::string(filename));
 		LOG(2, "FileOutput: opened output file " << filename);
@@ -144,12 +264,25 @@ void FileOutput::openFile(int64_t timestamp_us)
 
 void FileOutput::closeFile()
 {
+	if (file_bytes_)
+		fileNameManager_.setExpectedFileSize(file_bytes_);
+	if (writer_file_open_)
+	{
+		writer_file_open_ = false;
+		file_bytes_ = 0;
+		writer_->Close();
+	}
 	if (fp_)
 	{
 		if (options_->Get().flush)
 			fflush(fp_);
 		if (fp_ != stdout)
+		{
+			if (options_->Get().preallocate && (fflush(fp_) || ftruncate(fileno(fp_), file_bytes_)))
+				LOG_ERROR("ERROR: FileOutput: failed to trim output file");
 			fclose(fp_);
+		}
 		fp_ = nullptr;
 	}
+	file_bytes_ = 0;
 }
@@ -8,8 +8,10 @@
 #pragma once
 
 #include <filesystem>
+#include <memory>
 
 #include "file_name_manager.hpp"
+#include "file_writer.hpp"
 #include "output.hpp"
 
 namespace fs = std::filesystem;
@@ -24,15 +26,25 @@ public:
 	}
 
 protected:
+	// The buffer is always finished output from the encoder (a whole DNG, PNG or JPEG file, or a chunk of a video
+	// stream), which is only ever written out as it is. Nothing gets encoded here.
 	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
 
 private:
 	void openFile(int64_t timestamp_us);
 	void closeFile();
-	void saveDng(void *mem);
-	void savePng(void *mem);
 	void saveFile(void *mem, size_t size, int64_t timestamp_us, uint32_t flags);
+	void writeMetadata(libcamera::ControlList const &metadata);
+	void closeMetadata();
 	FILE *fp_;
 	int64_t file_start_time_ms_;
 	FileNameManager fileNameManager_;
+	// Streaming (ndjson) metadata sidecar, kept open for the lifetime of the output.
+	FILE *fp_metadata_;
+	unsigned int metadata_unflushed_;
+	// With --write-behind, files go through this instead of fp_.
+	std::unique_ptr<FileWriter> writer_;
+	bool writer_file_open_;
+	// Bytes written to the current file.
+	size_t file_bytes_;
 };
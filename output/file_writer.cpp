@@ -0,0 +1,406 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * file_writer.cpp - Write-behind writer for whole output files.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <sstream>
+#include <stdexcept>
+
+#if LIBURING_PRESENT
+#include <liburing.h>
+#endif
+
+#include "core/logging.hpp"
+#include "core/memory_budget.hpp"
+
+#include "file_writer.hpp"
+
+// Buffers are aligned, and with O_DIRECT writes padded, to this.
+static constexpr size_t ALIGNMENT = 4096;
+// Most files we put into a single io_uring submission.
+static constexpr unsigned int MAX_BATCH = 64;
+
+std::atomic<unsigned int> FileWriter::total_in_flight_ { 0 };
+std::mutex FileWriter::directories_mutex_;
+std::map<std::string, unsigned int> FileWriter::directories_;
+
+static size_t align_up(size_t size)
+{
+	return (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+}
+
+FileWriter::FileWriter(VideoOptions const *options)
+	: options_(options), max_in_flight_(std::max(options->Get().write_behind, 1u)),
+	  direct_(options->Get().write_direct), trim_(options->Get().preallocate), ring_(nullptr), have_current_(false), in_flight_(0), abort_(false),
+	  files_written_(0), max_queue_depth_(0), queue_depth_sum_(0), latency_histogram_ {}
+{
+	std::string const &backend = options->Get().write_backend;
+#if LIBURING_PRESENT
+	if (backend != "thread")
+	{
+		unsigned int batch = std::min(max_in_flight_, MAX_BATCH);
+		ring_ = new io_uring;
+		// Each file takes three entries (open, write, close) and one slot in the fixed file table.
+		int ret = io_uring_queue_init(3 * batch, ring_, 0);
+		if (ret == 0)
+		{
+			ret = io_uring_register_files_sparse(ring_, batch);
+			if (ret)
+				io_uring_queue_exit(ring_);
+		}
+		if (ret)
+		{
+			delete ring_;
+			ring_ = nullptr;
+			if (backend == "uring")
+				throw std::runtime_error("FileWriter: failed to set up io_uring: " + std::string(strerror(-ret)));
+			LOG(1, "FileWriter: io_uring unavailable (" << strerror(-ret) << "), using blocking writes");
+		}
+	}
+#else
+	if (backend == "uring")
+		throw std::runtime_error("FileWriter: io_uring support was not built in");
+#endif
+
+	thread_ = std::thread(&FileWriter::writerThread, this);
+	LOG(2, "FileWriter: up to " << max_in_flight_ << " files in flight, " << (ring_ ? "io_uring" : "blocking")
+								 << " writes" << (direct_ ? ", O_DIRECT" : ""));
+}
+
+FileWriter::~FileWriter()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+	}
+	cond_.notify_one();
+	thread_.join();
+
+#if LIBURING_PRESENT
+	if (ring_)
+	{
+		io_uring_queue_exit(ring_);
+		delete ring_;
+	}
+#endif
+
+	// Our buffers were charged to the memory budget, so hand them back.
+	size_t held = current_.capacity;
+	for (Job const &job : free_)
+		held += job.capacity;
+	MemoryBudget::Get().Credit(MemoryBudget::OUTPUT, held);
+
+	if (have_current_)
+		trackDirectory(current_.filename, -1);
+
+	reportStats();
+}
+
+static std::string directory_key(std::string const &path)
+{
+	return std::filesystem::path(path).lexically_normal().string();
+}
+
+bool FileWriter::Writing(std::string const &directory)
+{
+	std::lock_guard<std::mutex> lock(directories_mutex_);
+	return directories_.count(directory_key(directory));
+}
+
+void FileWriter::trackDirectory(std::string const &filename, int delta)
+{
+	std::string key = directory_key(std::filesystem::path(filename).parent_path().string());
+	std::lock_guard<std::mutex> lock(directories_mutex_);
+	unsigned int &count = directories_[key];
+	count += delta;
+	if (!count)
+		directories_.erase(key);
+}
+
+void FileWriter::Open(std::string const &filename)
+{
+	if (have_current_)
+		trackDirectory(current_.filename, -1);
+	trackDirectory(filename, 1);
+
+	if (!have_current_)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (!free_.empty())
+		{
+			current_ = std::move(free_.back());
+			free_.pop_back();
+		}
+	}
+	current_.filename = filename;
+	current_.size = 0;
+	have_current_ = true;
+}
+
+void FileWriter::Append(void const *mem, size_t size)
+{
+	if (!have_current_)
+		throw std::runtime_error("FileWriter: no file open");
+
+	size_t needed = current_.size + size;
+	if (needed > current_.capacity)
+	{
+		// posix_memalign has no realloc, so grow by hand. Recycled buffers mean this settles down quickly.
+		size_t capacity = align_up(std::max(needed, current_.capacity * 2));
+		void *p;
+		if (posix_memalign(&p, ALIGNMENT, capacity))
+			throw std::runtime_error("FileWriter: failed to allocate " + std::to_string(capacity) + " bytes");
+		if (current_.size)
+			memcpy(p, current_.data.get(), current_.size);
+		current_.data.reset((uint8_t *)p);
+		MemoryBudget::Get().Charge(MemoryBudget::OUTPUT, capacity);
+		MemoryBudget::Get().Credit(MemoryBudget::OUTPUT, current_.capacity);
+		current_.capacity = capacity;
+	}
+	memcpy(current_.data.get() + current_.size, mem, size);
+	current_.size += size;
+}
+
+void FileWriter::Close()
+{
+	if (!have_current_)
+		return;
+	have_current_ = false;
+
+	std::unique_lock<std::mutex> lock(mutex_);
+	if (!error_.empty())
+	{
+		std::string error = std::move(error_);
+		error_.clear();
+		trackDirectory(current_.filename, -1);
+		recycle(current_);
+		throw std::runtime_error(error);
+	}
+
+	// Files waiting to be written hold their buffers, so once those have used up the output's share of the memory
+	// budget the new file waits for some to go, or is dropped. Only while there are some to wait for, though.
+	MemoryBudget &budget = MemoryBudget::Get();
+	if (in_flight_ && !budget.Blocking() && !budget.Available(MemoryBudget::OUTPUT))
+	{
+		LOG(2, "FileWriter: dropping " << current_.filename << " over the memory budget");
+		budget.Refuse(MemoryBudget::OUTPUT);
+		trackDirectory(current_.filename, -1);
+		recycle(current_);
+		return;
+	}
+	space_cond_.wait(lock, [this, &budget] {
+		return in_flight_ < max_in_flight_ && (!in_flight_ || budget.Available(MemoryBudget::OUTPUT));
+	});
+	current_.queued = std::chrono::steady_clock::now();
+	queue_.push_back(std::move(current_));
+	current_ = Job();
+	in_flight_++;
+	total_in_flight_++;
+	max_queue_depth_ = std::max(max_queue_depth_, in_flight_);
+	queue_depth_sum_ += in_flight_;
+	cond_.notify_one();
+}
+
+void FileWriter::Flush()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	space_cond_.wait(lock, [this] { return in_flight_ == 0; });
+}
+
+void FileWriter::writerThread()
+{
+	std::vector<Job> jobs;
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			cond_.wait(lock, [this] { return abort_ || !queue_.empty(); });
+			if (queue_.empty())
+				return;
+			// Take everything that has built up, so that it all goes in one submission.
+			unsigned int n = ring_ ? std::min<size_t>(queue_.size(), std::min(max_in_flight_, MAX_BATCH)) : 1;
+			for (unsigned int i = 0; i < n; i++)
+			{
+				jobs.push_back(std::move(queue_.front()));
+				queue_.pop_front();
+			}
+		}
+
+		if (ring_)
+			writeBatch(jobs);
+		else
+			writeSync(jobs[0]);
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		for (Job &job : jobs)
+		{
+			written(job);
+			trackDirectory(job.filename, -1);
+			recycle(job);
+			in_flight_--;
+			total_in_flight_--;
+		}
+		jobs.clear();
+		space_cond_.notify_all();
+	}
+}
+
+void FileWriter::writeSync(Job &job)
+{
+	int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (trim_ ? 0 : O_TRUNC);
+	int fd = open(job.filename.c_str(), flags | (direct_ ? O_DIRECT : 0), 0644);
+	if (fd < 0 && direct_ && errno == EINVAL)
+	{
+		LOG_ERROR("WARNING: FileWriter: O_DIRECT not supported for " << job.filename << ", using buffered writes");
+		direct_ = false;
+		fd = open(job.filename.c_str(), flags, 0644);
+	}
+	if (fd < 0)
+		return fail("failed to open output file " + job.filename + ": " + strerror(errno));
+
+	// O_DIRECT writes must be whole blocks, so pad the write and trim the file back afterwards.
+	size_t length = direct_ ? align_up(job.size) : job.size;
+	if (length > job.size)
+		memset(job.data.get() + job.size, 0, length - job.size);
+	size_t done = 0;
+	while (done < length)
+	{
+		ssize_t ret = write(fd, job.data.get() + done, length - done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+		{
+			close(fd);
+			return fail("failed to write output file " + job.filename + ": " + strerror(ret < 0 ? errno : EIO));
+		}
+		done += ret;
+	}
+	if ((length != job.size || trim_) && ftruncate(fd, job.size))
+	{
+		close(fd);
+		return fail("failed to truncate output file " + job.filename + ": " + strerror(errno));
+	}
+	if (close(fd))
+		fail("failed to close output file " + job.filename + ": " + strerror(errno));
+}
+
+void FileWriter::writeBatch(std::vector<Job> &jobs)
+{
+#if LIBURING_PRESENT
+	// Each file is an open into fixed file slot i, a write and a close, linked so that each waits for the one before.
+	// A failure anywhere cancels the rest of that file's chain.
+	int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (trim_ ? 0 : O_TRUNC) | (direct_ ? O_DIRECT : 0);
+	std::vector<size_t> lengths(jobs.size());
+	for (unsigned int i = 0; i < jobs.size(); i++)
+	{
+		Job &job = jobs[i];
+		lengths[i] = direct_ ? align_up(job.size) : job.size;
+		if (lengths[i] > job.size)
+			memset(job.data.get() + job.size, 0, lengths[i] - job.size);
+
+		io_uring_sqe *sqe = io_uring_get_sqe(ring_);
+		io_uring_prep_openat_direct(sqe, AT_FDCWD, job.filename.c_str(), flags, 0644, i);
+		sqe->flags |= IOSQE_IO_LINK;
+		io_uring_sqe_set_data64(sqe, 3 * i);
+
+		sqe = io_uring_get_sqe(ring_);
+		io_uring_prep_write(sqe, i, job.data.get(), lengths[i], 0);
+		sqe->flags |= IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+		io_uring_sqe_set_data64(sqe, 3 * i + 1);
+
+		sqe = io_uring_get_sqe(ring_);
+		io_uring_prep_close_direct(sqe, i);
+		io_uring_sqe_set_data64(sqe, 3 * i + 2);
+	}
+
+	std::vector<bool> failed(jobs.size(), false);
+	int ret = io_uring_submit(ring_);
+	if (ret < 0)
+		std::fill(failed.begin(), failed.end(), true);
+	for (int i = 0; i < ret; i++)
+	{
+		io_uring_cqe *cqe;
+		if (io_uring_wait_cqe(ring_, &cqe))
+		{
+			// Shouldn't happen, but if it does we can no longer trust any of the results.
+			std::fill(failed.begin(), failed.end(), true);
+			break;
+		}
+		uint64_t data = io_uring_cqe_get_data64(cqe);
+		unsigned int index = data / 3;
+		bool is_write = data % 3 == 1;
+		if (cqe->res < 0 || (is_write && (size_t)cqe->res != lengths[index]))
+			failed[index] = true;
+		io_uring_cqe_seen(ring_, cqe);
+	}
+
+	for (unsigned int i = 0; i < jobs.size(); i++)
+	{
+		// Let the blocking path redo anything that went wrong, and report it properly if it fails again.
+		if (failed[i])
+			writeSync(jobs[i]);
+		else if ((lengths[i] != jobs[i].size || trim_) && truncate(jobs[i].filename.c_str(), jobs[i].size))
+			fail("failed to truncate output file " + jobs[i].filename + ": " + strerror(errno));
+	}
+#else
+	for (Job &job : jobs)
+		writeSync(job);
+#endif
+}
+
+void FileWriter::written(Job &job)
+{
+	auto latency = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - job.queued);
+	unsigned int bucket = 0;
+	for (int64_t ms = latency.count(); ms && bucket < latency_histogram_.size() - 1; ms >>= 1)
+		bucket++;
+	latency_histogram_[bucket]++;
+	files_written_++;
+}
+
+void FileWriter::recycle(Job &job)
+{
+	// Keep enough buffers for a full queue, plus the one being filled, unless the memory budget is used up.
+	if (job.data && free_.size() <= max_in_flight_ && MemoryBudget::Get().Available(MemoryBudget::OUTPUT))
+		free_.push_back(std::move(job));
+	else
+		MemoryBudget::Get().Credit(MemoryBudget::OUTPUT, job.capacity);
+	job = Job();
+}
+
+void FileWriter::fail(std::string const &msg)
+{
+	LOG_ERROR("ERROR: FileWriter: " << msg);
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (error_.empty())
+		error_ = msg;
+}
+
+void FileWriter::reportStats()
+{
+	if (!files_written_)
+		return;
+
+	std::stringstream ss;
+	for (unsigned int i = 0; i < latency_histogram_.size(); i++)
+	{
+		if (!latency_histogram_[i])
+			continue;
+		if (i == latency_histogram_.size() - 1)
+			ss << " >=" << (1 << (i - 1)) << "ms:" << latency_histogram_[i];
+		else
+			ss << " <" << (1 << i) << "ms:" << latency_histogram_[i];
+	}
+	LOG(1, "FileWriter: " << files_written_ << " files, queue depth max " << max_queue_depth_ << " mean "
+						  << (double)queue_depth_sum_ / files_written_);
+	LOG(1, "FileWriter: write latency" << ss.str());
+}
@@ -0,0 +1,107 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * file_writer.hpp - Write-behind writer for whole output files.
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "core/video_options.hpp"
+
+struct io_uring;
+
+// Takes complete files and writes them out on a thread of its own, so that slow storage holds up nothing but this
+// thread. Files are written with io_uring where we can (the open, write and close of each file linked together, and
+// everything that is waiting submitted as one batch), and otherwise with plain blocking calls.
+class FileWriter
+{
+public:
+	FileWriter(VideoOptions const *options);
+	~FileWriter();
+
+	// Start a new file, discarding any file that was started but not submitted.
+	void Open(std::string const &filename);
+	void Append(void const *mem, size_t size);
+	// Queue the file started by Open(). Blocks while the maximum number of files are in flight, or while the output's
+	// share of the memory budget is used up (where, with --memory-policy drop, the file is dropped instead). An error
+	// writing any earlier file is thrown from here.
+	void Close();
+
+	// Wait for everything queued to be written.
+	void Flush();
+
+	// Files queued but not yet written, across every writer in the process.
+	static unsigned int QueueDepth() { return total_in_flight_; }
+	// Whether any writer in the process has a file in the directory that isn't yet closed on disk: one opened but not
+	// queued, one queued, or one whose io_uring operations are still outstanding.
+	static bool Writing(std::string const &directory);
+
+private:
+	struct Buffer
+	{
+		void operator()(uint8_t *p) const { free(p); }
+	};
+	struct Job
+	{
+		std::string filename;
+		std::unique_ptr<uint8_t, Buffer> data;
+		size_t size = 0;
+		size_t capacity = 0;
+		std::chrono::steady_clock::time_point queued;
+	};
+
+	void writerThread();
+	void writeSync(Job &job);
+	void writeBatch(std::vector<Job> &jobs);
+	void written(Job &job);
+	void recycle(Job &job);
+	void fail(std::string const &msg);
+	static void trackDirectory(std::string const &filename, int delta);
+	void reportStats();
+
+	VideoOptions const *options_;
+	unsigned int max_in_flight_;
+	bool direct_;
+	// Files may have been preallocated (--preallocate), so don't truncate them on opening, but trim them to size
+	// once written.
+	bool trim_;
+	io_uring *ring_;
+
+	Job current_;
+	bool have_current_;
+
+	std::mutex mutex_;
+	std::condition_variable cond_;
+	std::condition_variable space_cond_;
+	std::deque<Job> queue_;
+	std::vector<Job> free_;
+	unsigned int in_flight_;
+	static std::atomic<unsigned int> total_in_flight_;
+	// Files not yet closed on disk in each directory, across every writer.
+	static std::mutex directories_mutex_;
+	static std::map<std::string, unsigned int> directories_;
+	bool abort_;
+	std::string error_;
+	std::thread thread_;
+
+	// Statistics, reported on shutdown. Latencies run from Close() until the file is closed on disk, in power of 2
+	// millisecond buckets (< 1ms, < 2ms, ... , >= 1024ms).
+	uint64_t files_written_;
+	unsigned int max_queue_depth_;
+	uint64_t queue_depth_sum_;
+	std::array<uint64_t, 12> latency_histogram_;
+};
@@ -6,11 +6,47 @@
  */
 
 #include <arpa/inet.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <poll.h>
 #include <sys/socket.h>
 
+#include <cmath>
+#include <cstring>
+#include <sstream>
+#include <thread>
+
 #include "net_output.hpp"
 
-NetOutput::NetOutput(VideoOptions const *options) : Output(options)
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef SO_TXTIME
+#define SO_TXTIME 61
+#define SCM_TXTIME SO_TXTIME
+#endif
+
+// Maximum size that sendto will accept.
+constexpr size_t MAX_UDP_SIZE = 65507;
+// Most segments the kernel will make out of one UDP GSO send.
+constexpr size_t MAX_GSO_SEGMENTS = 64;
+// How long we wait for the kernel to finish with a zerocopy buffer before giving up, and how many frames' buffers
+// may be waiting on it at once.
+constexpr int ZEROCOPY_TIMEOUT_MS = 1000;
+constexpr unsigned int ZEROCOPY_MAX_FRAMES = 8;
+constexpr std::chrono::seconds STATS_INTERVAL(10);
+// The pacer lets this many packets go back-to-back, and packets due within PACE_SLACK_NS of each other are sent
+// together, as sleeping for less isn't worth it.
+constexpr unsigned int PACE_BURST_PACKETS = 4;
+constexpr int64_t PACE_SLACK_NS = 200000;
+
+NetOutput::NetOutput(VideoOptions const *options)
+	: Output(options), gso_size_(0), udp_chunk_(MAX_UDP_SIZE), pace_fraction_(0), txtime_(false), pace_burst_(0),
+	  tokens_(0), pace_time_ns_(0), sensor_offset_ns_(0), last_frame_ns_(0), frame_interval_ns_(0), rtp_packets_(0),
+	  zerocopy_(false), zerocopy_sent_(0), zerocopy_done_(0), zerocopy_copied_(0), bytes_sent_(0), syscalls_(0),
+	  interval_bytes_(0)
 {
 	char protocol[4];
 	int start, end, a, b, c, d, port;
@@ -19,7 +55,8 @@ NetOutput::NetOutput(VideoOptions const *options) : Output(options)
 		throw std::runtime_error("bad network address " + options->Get().output);
 	std::string address = options->Get().output.substr(start, end - start);
 
-	if (strcmp(protocol, "udp") == 0)
+	bool rtp = strcmp(protocol, "rtp") == 0;
+	if (strcmp(protocol, "udp") == 0 || rtp)
 	{
 		saddr_ = {};
 		saddr_.sin_family = AF_INET;
@@ -33,6 +70,46 @@ NetOutput::NetOutput(VideoOptions const *options) : Output(options)
 
 		saddr_ptr_ = (const sockaddr *)&saddr_; // sendto needs these for udp
 		sockaddr_in_size_ = sizeof(sockaddr_in);
+
+		unsigned int gso_size = options->Get().udp_gso;
+		if (rtp)
+		{
+			if (options->Get().rtp_mtu > MAX_UDP_SIZE)
+				throw std::runtime_error("--rtp-mtu must be no more than " + std::to_string(MAX_UDP_SIZE));
+			if (options->Get().rtp_pace < 0 || options->Get().rtp_pace > 1)
+				throw std::runtime_error("--rtp-pace must be between 0 and 1");
+			if (gso_size)
+				LOG_ERROR("WARNING: NetOutput: --udp-gso is ignored for RTP output");
+
+			rtp_ = std::make_unique<RtpPacketizer>(options->Get().codec, options->Get().rtp_mtu);
+			pace_fraction_ = options->Get().rtp_pace;
+			pace_burst_ = PACE_BURST_PACKETS * options->Get().rtp_mtu;
+			frame_interval_ns_ = 1e9 / std::max(options->Get().framerate.value_or(30), 1.0f);
+
+			if (options->Get().rtp_txtime && pace_fraction_)
+			{
+				// The departure times come from the steady clock. fq takes them as they are; etf only takes CLOCK_TAI.
+				sock_txtime config = { CLOCK_MONOTONIC, 0 };
+				if (setsockopt(fd_, SOL_SOCKET, SO_TXTIME, &config, sizeof(config)) == 0)
+					txtime_ = true;
+				else
+					LOG_ERROR("WARNING: NetOutput: SO_TXTIME not supported, pacing by sleeping instead");
+			}
+			LOG(2, "NetOutput: RTP session description:\n" << rtp_->Sdp(address, port));
+		}
+		else if (gso_size && gso_size <= MAX_UDP_SIZE)
+		{
+			if (setsockopt(fd_, SOL_UDP, UDP_SEGMENT, &gso_size, sizeof(gso_size)) == 0)
+			{
+				gso_size_ = gso_size;
+				udp_chunk_ = std::min(MAX_UDP_SIZE / gso_size, MAX_GSO_SEGMENTS) * gso_size;
+				LOG(2, "NetOutput: UDP GSO with " << gso_size << " byte datagrams");
+			}
+			else
+				LOG_ERROR("WARNING: NetOutput: UDP GSO not supported, sending unsegmented datagrams");
+		}
+		else if (gso_size)
+			throw std::runtime_error("--udp-gso must be no more than " + std::to_string(MAX_UDP_SIZE));
 	}
 	else if (strcmp(protocol, "tcp") == 0)
 	{
@@ -86,29 +163,320 @@ NetOutput::NetOutput(VideoOptions const *options) : Output(options)
 
 		saddr_ptr_ = NULL; // sendto doesn't want these for tcp
 		sockaddr_in_size_ = 0;
+
+		if (options->Get().low_latency)
+		{
+			// Don't let Nagle hold back the tail of each frame waiting for an ACK.
+			int enable = 1;
+			if (setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable)) < 0)
+				LOG_ERROR("WARNING: NetOutput: failed to set TCP_NODELAY");
+		}
+
+		if (options->Get().net_zerocopy)
+		{
+			int enable = 1;
+			if (setsockopt(fd_, SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(enable)) == 0)
+				zerocopy_ = true;
+			else
+				LOG_ERROR("WARNING: NetOutput: MSG_ZEROCOPY not supported, copying instead");
+		}
 	}
 	else
 		throw std::runtime_error("unrecognised network protocol " + options->Get().output);
+
+	start_time_ = interval_start_ = std::chrono::steady_clock::now();
 }
 
 NetOutput::~NetOutput()
 {
+	// Let the kernel finish with the frames still in flight before their buffers go.
+	while (!zerocopy_in_flight_.empty() && reapZerocopy(true))
+		retireZerocopy();
+	reportStats(true);
 	close(fd_);
 }
 
-// Maximum size that sendto will accept.
-constexpr size_t MAX_UDP_SIZE = 65507;
-
-void NetOutput::outputBuffer(void *mem, size_t size, int64_t /*timestamp_us*/, uint32_t /*flags*/)
+void NetOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t /*flags*/)
 {
 	LOG(2, "NetOutput: output buffer " << mem << " size " << size);
-	size_t max_size = saddr_ptr_ ? MAX_UDP_SIZE : size;
-	for (uint8_t *ptr = (uint8_t *)mem; size;)
+	if (rtp_)
+		sendRtp((uint8_t *)mem, size, timestamp_us);
+	else if (saddr_ptr_)
+		sendUdp((uint8_t *)mem, size);
+	else if (zerocopy_)
+		sendTcpZerocopy((uint8_t *)mem, size);
+	else
+		sendTcp((uint8_t *)mem, size);
+
+	bytes_sent_ += size;
+	interval_bytes_ += size;
+	if (frame_info_ && frame_info_->sensor_timestamp_ns)
+	{
+		int64_t now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+							 std::chrono::steady_clock::now().time_since_epoch()).count();
+		int64_t latency_us = (now_ns - frame_info_->sensor_timestamp_ns) / 1000;
+		latency_.Add(latency_us);
+		interval_latency_.Add(latency_us);
+		LOG(2, "NetOutput: frame " << frame_info_->sequence << " sent " << latency_us << "us after capture");
+	}
+	if (std::chrono::steady_clock::now() - interval_start_ >= STATS_INTERVAL)
+		reportStats(false);
+}
+
+void NetOutput::sendUdp(uint8_t *mem, size_t size)
+{
+	// One message per datagram (or per GSO send), all handed to the kernel in as few calls as it will take.
+	size_t count = (size + udp_chunk_ - 1) / udp_chunk_;
+	iovs_.resize(count);
+	msgs_.resize(count);
+	for (size_t i = 0; i < count; i++)
+	{
+		iovs_[i].iov_base = mem + i * udp_chunk_;
+		iovs_[i].iov_len = std::min(udp_chunk_, size - i * udp_chunk_);
+		msgs_[i] = {};
+		msgs_[i].msg_hdr.msg_name = (void *)saddr_ptr_;
+		msgs_[i].msg_hdr.msg_namelen = sockaddr_in_size_;
+		msgs_[i].msg_hdr.msg_iov = &iovs_[i];
+		msgs_[i].msg_hdr.msg_iovlen = 1;
+	}
+	sendMessages(0, count);
+}
+
+void NetOutput::sendRtp(uint8_t *mem, size_t size, int64_t timestamp_us)
+{
+	int64_t frame_ns = timestamp_us * 1000;
+	if (frame_info_ && frame_info_->sensor_timestamp_ns)
+		sensor_offset_ns_ = frame_info_->sensor_timestamp_ns - frame_ns;
+	frame_ns += sensor_offset_ns_;
+	if (last_frame_ns_ && frame_ns > last_frame_ns_ && frame_ns - last_frame_ns_ < 1000000000)
+		frame_interval_ns_ = frame_ns - last_frame_ns_;
+	last_frame_ns_ = frame_ns;
+
+	// The RTP clock for video runs at 90kHz.
+	rtp_->Packetize(mem, size, (uint64_t)frame_ns * 9 / 100000);
+	unsigned int count = rtp_->NumPackets();
+	msgs_.resize(count);
+	departures_.resize(count);
+	control_.resize(count * CMSG_SPACE(sizeof(uint64_t)));
+
+	// This frame's packets go out at a rate that spreads them over the chosen part of the frame interval.
+	int64_t now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+						 std::chrono::steady_clock::now().time_since_epoch()).count();
+	double rate = pace_fraction_ ? size / (pace_fraction_ * frame_interval_ns_) : 0;
+	for (unsigned int i = 0; i < count; i++)
+	{
+		msgs_[i] = {};
+		msgs_[i].msg_hdr.msg_name = (void *)saddr_ptr_;
+		msgs_[i].msg_hdr.msg_namelen = sockaddr_in_size_;
+		msgs_[i].msg_hdr.msg_iov = rtp_->PacketIovs(i);
+		msgs_[i].msg_hdr.msg_iovlen = RtpPacketizer::IOVS_PER_PACKET;
+		departures_[i] = rate ? pace(rtp_->PacketSize(i), rate, now_ns) : now_ns;
+
+		if (txtime_)
+		{
+			msgs_[i].msg_hdr.msg_control = &control_[i * CMSG_SPACE(sizeof(uint64_t))];
+			msgs_[i].msg_hdr.msg_controllen = CMSG_SPACE(sizeof(uint64_t));
+			cmsghdr *cm = CMSG_FIRSTHDR(&msgs_[i].msg_hdr);
+			cm->cmsg_level = SOL_SOCKET;
+			cm->cmsg_type = SCM_TXTIME;
+			cm->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+			uint64_t txtime = departures_[i];
+			memcpy(CMSG_DATA(cm), &txtime, sizeof(txtime));
+		}
+	}
+
+	if (txtime_)
+		sendMessages(0, count);
+	else
+	{
+		for (unsigned int i = 0; i < count;)
+		{
+			unsigned int j = i + 1;
+			while (j < count && departures_[j] - departures_[i] <= PACE_SLACK_NS)
+				j++;
+			auto departure = std::chrono::steady_clock::time_point(std::chrono::nanoseconds(departures_[i]));
+			std::this_thread::sleep_until(departure);
+			sendMessages(i, j);
+			i = j;
+		}
+	}
+	rtp_packets_ += count;
+}
+
+int64_t NetOutput::pace(size_t bytes, double rate, int64_t now_ns)
+{
+	int64_t t = std::max(now_ns, pace_time_ns_);
+	tokens_ = std::min(pace_burst_, tokens_ + (t - pace_time_ns_) * rate);
+	if (tokens_ < bytes)
+	{
+		t += std::ceil((bytes - tokens_) / rate);
+		tokens_ = bytes;
+	}
+	tokens_ -= bytes;
+	pace_time_ns_ = t;
+	return t;
+}
+
+void NetOutput::sendMessages(size_t begin, size_t end)
+{
+	// One syscall for as many messages as the kernel will take.
+	for (size_t sent = begin; sent < end;)
+	{
+		int ret = sendmmsg(fd_, &msgs_[sent], end - sent, 0);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			throw std::runtime_error("failed to send data on socket: " + std::string(strerror(errno)));
+		sent += ret;
+		syscalls_++;
+	}
+}
+
+void NetOutput::sendTcp(uint8_t *mem, size_t size)
+{
+	while (size)
+	{
+		ssize_t ret = send(fd_, mem, size, 0);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			throw std::runtime_error("failed to send data on socket: " + std::string(strerror(errno)));
+		mem += ret;
+		size -= ret;
+		syscalls_++;
+	}
+}
+
+void NetOutput::sendTcpZerocopy(uint8_t *mem, size_t size)
+{
+	// Take back whichever buffers the kernel has finished with, and only wait if every one is still in flight.
+	reapZerocopy(false);
+	retireZerocopy();
+	while (zerocopy_in_flight_.size() >= ZEROCOPY_MAX_FRAMES)
+	{
+		if (!reapZerocopy(true))
+			throw std::runtime_error("timed out waiting for the network to release a zerocopy buffer");
+		retireZerocopy();
+	}
+
+	std::vector<uint8_t> buffer;
+	if (!zerocopy_free_.empty())
+	{
+		buffer = std::move(zerocopy_free_.back());
+		zerocopy_free_.pop_back();
+	}
+	buffer.assign(mem, mem + size);
+	mem = buffer.data();
+
+	uint32_t first_send = zerocopy_sent_;
+	size_t done = 0;
+	while (done < size)
+	{
+		ssize_t ret = send(fd_, mem + done, size - done, MSG_ZEROCOPY);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && errno == ENOBUFS)
+		{
+			// Too much is pinned already. Let some notifications come back, or copy if there are none to wait for.
+			if (!reapZerocopy(true))
+			{
+				sendTcp(mem + done, size - done);
+				break;
+			}
+			continue;
+		}
+		if (ret < 0)
+			throw std::runtime_error("failed to send data on socket: " + std::string(strerror(errno)));
+		done += ret;
+		zerocopy_sent_++;
+		syscalls_++;
+		reapZerocopy(false);
+	}
+
+	if (zerocopy_sent_ != first_send)
+		zerocopy_in_flight_.push_back({ std::move(buffer), zerocopy_sent_ - 1 });
+	else
+		zerocopy_free_.push_back(std::move(buffer));
+	retireZerocopy();
+}
+
+void NetOutput::retireZerocopy()
+{
+	// Sends complete in order, so the frames do too. The numbers wrap, hence the signed difference.
+	while (!zerocopy_in_flight_.empty() && (int32_t)(zerocopy_done_ - zerocopy_in_flight_.front().last_send) > 0)
 	{
-		size_t bytes_to_send = std::min(size, max_size);
-		if (sendto(fd_, ptr, bytes_to_send, 0, saddr_ptr_, sockaddr_in_size_) < 0)
-			throw std::runtime_error("failed to send data on socket");
-		ptr += bytes_to_send;
-		size -= bytes_to_send;
+		zerocopy_free_.push_back(std::move(zerocopy_in_flight_.front().data));
+		zerocopy_in_flight_.pop_front();
 	}
 }
+
+bool NetOutput::reapZerocopy(bool wait)
+{
+	if (zerocopy_done_ == zerocopy_sent_)
+		return false;
+	if (wait)
+	{
+		// Completions arrive on the socket's error queue, which poll reports as POLLERR.
+		pollfd pfd = { fd_, 0, 0 };
+		if (poll(&pfd, 1, ZEROCOPY_TIMEOUT_MS) <= 0)
+			return false;
+	}
+
+	bool reaped = false;
+	while (true)
+	{
+		char control[CMSG_SPACE(sizeof(sock_extended_err))];
+		msghdr msg = {};
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(fd_, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			break;
+		for (cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+		{
+			if (cm->cmsg_level != SOL_IP || cm->cmsg_type != IP_RECVERR)
+				continue;
+			sock_extended_err const *err = (sock_extended_err const *)CMSG_DATA(cm);
+			if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+			// [ee_info, ee_data] is the range of sends now complete, and they complete in order.
+			zerocopy_done_ = err->ee_data + 1;
+			if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				zerocopy_copied_ += err->ee_data - err->ee_info + 1;
+			reaped = true;
+		}
+	}
+	return reaped;
+}
+
+void NetOutput::reportStats(bool final)
+{
+	auto now = std::chrono::steady_clock::now();
+	std::chrono::duration<double> elapsed = now - (final ? start_time_ : interval_start_);
+	double mbps = (final ? bytes_sent_ : interval_bytes_) * 8 / 1e6 / std::max(elapsed.count(), 1e-3);
+
+	std::stringstream ss;
+	ss << "NetOutput: " << bytes_sent_ << " bytes in " << syscalls_ << " send calls, " << mbps << " Mbit/s";
+	if (!saddr_ptr_)
+	{
+		tcp_info info = {};
+		socklen_t len = sizeof(info);
+		if (getsockopt(fd_, IPPROTO_TCP, TCP_INFO, &info, &len) == 0)
+			ss << ", " << info.tcpi_total_retrans << " retransmits";
+	}
+	if (zerocopy_)
+		ss << ", " << zerocopy_copied_ << " zerocopy sends copied";
+	if (rtp_)
+		ss << ", " << rtp_packets_ << " RTP packets";
+	LatencyStats const &latency = final ? latency_ : interval_latency_;
+	if (latency.count)
+		ss << ", capture to send latency mean " << latency.total_us / (int64_t)latency.count << "us max "
+		   << latency.max_us << "us";
+	if (final)
+		LOG(1, ss.str());
+	else
+		LOG(2, ss.str());
+
+	interval_start_ = now;
+	interval_bytes_ = 0;
+	interval_latency_ = {};
+}
@@ -8,8 +8,16 @@
 #pragma once
 
 #include <netinet/in.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <vector>
 
 #include "output.hpp"
+#include "rtp_packetizer.hpp"
 
 class NetOutput : public Output
 {
@@ -21,8 +29,81 @@ protected:
 	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
 
 private:
+	void sendUdp(uint8_t *mem, size_t size);
+	void sendRtp(uint8_t *mem, size_t size, int64_t timestamp_us);
+	void sendMessages(size_t begin, size_t end);
+	int64_t pace(size_t bytes, double rate, int64_t now_ns);
+	void sendTcp(uint8_t *mem, size_t size);
+	void sendTcpZerocopy(uint8_t *mem, size_t size);
+	bool reapZerocopy(bool wait);
+	void retireZerocopy();
+	void reportStats(bool final);
+
+	// Time from the sensor starting each frame to the last of it going to the network.
+	struct LatencyStats
+	{
+		uint64_t count = 0;
+		int64_t total_us = 0;
+		int64_t max_us = 0;
+		void Add(int64_t us)
+		{
+			count++;
+			total_us += us;
+			max_us = std::max(max_us, us);
+		}
+	};
+
 	int fd_;
 	sockaddr_in saddr_;
 	const sockaddr *saddr_ptr_;
 	socklen_t sockaddr_in_size_;
+
+	// UDP datagrams are batched into sendmmsg calls, each message carrying up to udp_chunk_ bytes (which the kernel
+	// splits into gso_size_ datagrams with GSO).
+	unsigned int gso_size_;
+	size_t udp_chunk_;
+	std::vector<mmsghdr> msgs_;
+	std::vector<iovec> iovs_;
+
+	// rtp:// output is RTP over UDP, with each frame's packets paced out over part of the frame interval by a token
+	// bucket: tokens are bytes, which build up at the pacing rate to no more than pace_burst_. The pacer either
+	// sleeps until each packet is due, or with SO_TXTIME tells the kernel when to send them.
+	std::unique_ptr<RtpPacketizer> rtp_;
+	double pace_fraction_;
+	bool txtime_;
+	double pace_burst_;
+	double tokens_;
+	int64_t pace_time_ns_;
+	std::vector<int64_t> departures_;
+	std::vector<uint8_t> control_;
+	// RTP timestamps come from the sensor's clock where we have it, and from the encoder's timestamps (offset to
+	// match) where we don't.
+	int64_t sensor_offset_ns_;
+	int64_t last_frame_ns_;
+	int64_t frame_interval_ns_;
+	uint64_t rtp_packets_;
+
+	// MSG_ZEROCOPY sends are numbered by the kernel in order, and the buffer may not be reused until the
+	// notification for every send made from it has come back. The encoder has its buffer back as soon as we return,
+	// so each frame is sent from a buffer of our own, which stays in flight, with the number of the last send made
+	// from it, until then. Only when all of them are in flight do we wait for the network.
+	struct ZerocopyFrame
+	{
+		std::vector<uint8_t> data;
+		uint32_t last_send;
+	};
+	bool zerocopy_;
+	uint32_t zerocopy_sent_;
+	uint32_t zerocopy_done_;
+	uint64_t zerocopy_copied_;
+	std::deque<ZerocopyFrame> zerocopy_in_flight_;
+	std::vector<std::vector<uint8_t>> zerocopy_free_;
+
+	uint64_t bytes_sent_;
+	uint64_t syscalls_;
+	uint64_t interval_bytes_;
+	LatencyStats latency_;
+	LatencyStats interval_latency_;
+	std::chrono::steady_clock::time_point start_time_;
+	std::chrono::steady_clock::time_point interval_start_;
 };
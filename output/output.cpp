@@ -8,10 +8,15 @@
 #include <cinttypes>
 #include <stdexcept>
 
+#include "archive_output.hpp"
+#include "binary_metadata.hpp"
 #include "circular_output.hpp"
+#include "crc32c.hpp"
+#include "fanout_output.hpp"
 #include "file_output.hpp"
 #include "net_output.hpp"
 #include "output.hpp"
+#include "shm_ring.hpp"
 
 Output::Output(VideoOptions const *options)
 	: options_(options), fp_timestamps_(nullptr), state_(WAITING_KEYFRAME), time_offset_(0), last_timestamp_(0),
@@ -27,15 +32,23 @@ Output::Output(VideoOptions const *options)
 	if (!options->Get().metadata.empty())
 	{
 		const std::string &filename = options_->Get().metadata;
+		binary_metadata_ = options_->Get().metadata_format == "bin";
 
 		if (filename.compare("-"))
 		{
-			of_metadata_.open(filename, std::ios::out);
+			// A large buffer, so that the metadata goes out in a few big writes rather than one per frame.
+			metadata_file_buffer_.resize(65536);
+			of_metadata_.rdbuf()->pubsetbuf(metadata_file_buffer_.data(), metadata_file_buffer_.size());
+			of_metadata_.open(filename, std::ios::out | std::ios::binary);
 			buf_metadata_ = of_metadata_.rdbuf();
 			start_metadata_output(buf_metadata_, options_->Get().metadata_format);
 		}
 	}
 
+	if (!options->Get().shm_ring.empty())
+		shm_ring_ = std::make_unique<ShmRing>(options->Get().shm_ring, options->Get().shm_slots,
+											  (size_t)options->Get().shm_slot_size << 20);
+
 	enable_ = !options->Get().pause;
 }
 
@@ -56,6 +69,41 @@ void Output::OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyf
 {
 	// When output is enabled, we may have to wait for the next keyframe.
 	uint32_t flags = keyframe ? FLAG_KEYFRAME : FLAG_NONE;
+	{
+		// Take this whether or not the frame gets output, so that the queue stays in step.
+		std::lock_guard<std::mutex> lock(frame_info_mutex_);
+		frame_info_.reset();
+		if (!frame_info_queue_.empty())
+		{
+			frame_info_ = std::move(frame_info_queue_.front());
+			frame_info_queue_.pop_front();
+		}
+	}
+	if (!mem)
+	{
+		// A frame the encoder dropped or failed on. There's nothing to write, but its metadata is used up too.
+		if (!options_->Get().metadata.empty())
+		{
+			if (!metadata_queue_.empty())
+				metadata_queue_.pop();
+			if (!binary_metadata_queue_.empty())
+				binary_metadata_queue_.pop();
+		}
+		return;
+	}
+	// Consumers of the ring see every frame, whether or not this output is paused.
+	if (shm_ring_)
+	{
+		try
+		{
+			shm_ring_->Publish(mem, size, timestamp_us, frame_info_ ? &*frame_info_ : nullptr, streamInfo_);
+		}
+		catch (std::exception const &e)
+		{
+			LOG_ERROR("ERROR: " << e.what() << ", so no more frames go to the shared-memory ring");
+			shm_ring_.reset();
+		}
+	}
 	if (!enable_)
 		state_ = DISABLED;
 	else if (state_ == DISABLED)
@@ -70,6 +118,11 @@ void Output::OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyf
 		time_offset_ = timestamp_us - last_timestamp_;
 	last_timestamp_ = timestamp_us - time_offset_;
 
+	// Now, while the encoder has only just finished with the frame, so it's still in the cache.
+	checksum_.reset();
+	if (options_->Get().frame_checksum)
+		checksum_ = crc32c(mem, size);
+
 	outputBuffer(mem, size, last_timestamp_, flags);
 
 	// Save timestamps to a file, if that was requested.
@@ -80,10 +133,22 @@ void Output::OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyf
 
 	if (!options_->Get().metadata.empty())
 	{
-		libcamera::ControlList metadata = metadata_queue_.front();
-		write_metadata(buf_metadata_, options_->Get().metadata_format, metadata, !metadata_started_);
+		if (binary_metadata_)
+		{
+			if (!metadata_started_)
+				buf_metadata_->sputn((char const *)binary_metadata_header_.data(), binary_metadata_header_.size());
+			std::vector<uint8_t> const &record = binary_metadata_queue_.front();
+			buf_metadata_->sputn((char const *)record.data(), record.size());
+			binary_metadata_queue_.pop();
+		}
+		else
+			write_metadata(buf_metadata_, options_->Get().metadata_format, metadata_queue_.front(),
+						   !metadata_started_);
 		metadata_started_ = true;
-		metadata_queue_.pop();
+		if (!metadata_queue_.empty())
+			metadata_queue_.pop();
+		if (options_->Get().flush)
+			buf_metadata_->pubsync();
 	}
 }
 
@@ -105,10 +170,15 @@ Output *Output::Create(VideoOptions const *options)
 				 (options->Get().codec == "h264" && options->GetPlatform() != Platform::VC4);
 	const std::string out_file = options->Get().output;
 
-	if (!libav && (strncmp(out_file.c_str(), "udp://", 6) == 0 || strncmp(out_file.c_str(), "tcp://", 6) == 0))
+	if (!libav && options->Get().fanout && strncmp(out_file.c_str(), "tcp://", 6) == 0)
+		return new FanoutOutput(options);
+	else if (!libav && (strncmp(out_file.c_str(), "udp://", 6) == 0 || strncmp(out_file.c_str(), "tcp://", 6) == 0 ||
+						strncmp(out_file.c_str(), "rtp://", 6) == 0))
 		return new NetOutput(options);
 	else if (options->Get().circular)
 		return new CircularOutput(options);
+	else if (options->Get().archive && !out_file.empty() && out_file != "-")
+		return new ArchiveOutput(options);
 	else if (!out_file.empty())
 		return new FileOutput(options);
 	else
@@ -120,40 +190,79 @@ void Output::MetadataReady(libcamera::ControlList &metadata)
 	if (options_->Get().metadata.empty())
 		return;
 
-	metadata_queue_.push(metadata);
+	if (binary_metadata_)
+	{
+		if (binary_metadata_header_.empty() && metadata.idMap())
+			binary_metadata_header_ = binary_metadata_header(*metadata.idMap());
+		std::vector<uint8_t> record;
+		binary_metadata_frame(metadata, record);
+		binary_metadata_queue_.push(std::move(record));
+	}
+	if (!binary_metadata_ || !options_->Get().output_metadata_location.empty())
+		metadata_queue_.push(metadata);
+}
+
+void Output::FrameInfoReady(OutputFrameInfo const &info)
+{
+	std::lock_guard<std::mutex> lock(frame_info_mutex_);
+	// No encoder has anything like this many frames in flight, so if nothing is taking them, stop them piling up.
+	if (frame_info_queue_.size() >= MAX_FRAME_INFO_QUEUE)
+	{
+		if (!frame_info_overflow_)
+			LOG_ERROR("WARNING: Output: frame details are not being consumed, discarding the oldest");
+		frame_info_overflow_ = true;
+		frame_info_queue_.pop_front();
+	}
+	frame_info_queue_.push_back(info);
+}
+
+void Output::WithdrawFrameInfo()
+{
+	std::lock_guard<std::mutex> lock(frame_info_mutex_);
+	if (!frame_info_queue_.empty())
+		frame_info_queue_.pop_back();
 }
 
 void start_metadata_output(std::streambuf *buf, std::string fmt)
 {
 	std::ostream out(buf);
 	if (fmt == "json")
-		out << "[" << std::endl;
+		out << "[\n";
 }
 
-void write_metadata(std::streambuf *buf, std::string fmt, libcamera::ControlList &metadata, bool first_write)
+void write_metadata(std::streambuf *buf, std::string fmt, libcamera::ControlList const &metadata, bool first_write)
 {
 	std::ostream out(buf);
 	const libcamera::ControlIdMap *id_map = metadata.idMap();
-	if (fmt == "txt")
+	if (fmt == "bin")
+	{
+		std::vector<uint8_t> record;
+		if (first_write)
+			record = binary_metadata_header(*id_map);
+		binary_metadata_frame(metadata, record);
+		out.write((char const *)record.data(), record.size());
+	}
+	else if (fmt == "txt")
 	{
 		for (auto const &[id, val] : metadata)
-			out << id_map->at(id)->name() << "=" << val.toString() << std::endl;
-		out << std::endl;
+			out << id_map->at(id)->name() << "=" << val.toString() << "\n";
+		out << "\n";
 	}
 	else
 	{
 		if (!first_write)
-			out << "," << std::endl;
+			out << ",\n";
 		out << "{";
 		bool first_done = false;
 		for (auto const &[id, val] : metadata)
 		{
-			std::string arg_quote = (val.toString().find('/') != std::string::npos) ? "\"" : "";
-			out << (first_done ? "," : "") << std::endl
-				<< "    \"" << id_map->at(id)->name() << "\": " << arg_quote << val.toString() << arg_quote;
+			std::string value = val.toString();
+			std::string arg_quote = (value.find('/') != std::string::npos) ? "\"" : "";
+			out << (first_done ? ",\n" : "\n") << "    \"" << id_map->at(id)->name() << "\": " << arg_quote << value
+				<< arg_quote;
 			first_done = true;
 		}
-		out << std::endl << "}";
+		out << "\n}";
 	}
 }
 
@@ -161,5 +270,5 @@ void stop_metadata_output(std::streambuf *buf, std::string fmt)
 {
 	std::ostream out(buf);
 	if (fmt == "json")
-		out << std::endl << "]" << std::endl;
+		out << "\n]\n";
 }
@@ -10,9 +10,40 @@
 #include <cstdio>
 
 #include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <string>
+#include <vector>
 
 #include "core/video_options.hpp"
 #include "core/stream_info.hpp"
+#include "post_processing_stages/particle_analysis.hpp"
+
+// Per-frame details that don't come through the encoder, for outputs that index their frames.
+struct OutputFrameInfo
+{
+	uint64_t sequence;
+	std::string lamp_color;
+	bool motion = false;
+	// Frames like this one that the change gate suppressed before it.
+	uint64_t suppressed_before = 0;
+	// When the sensor started the frame, in ns on CLOCK_MONOTONIC (so the steady clock), or 0 if unknown.
+	int64_t sensor_timestamp_ns = 0;
+	// Measured edges on the strobe and XVS lines, in ns from the sensor timestamp, where there were any.
+	std::optional<int64_t> strobe_offset_ns;
+	std::optional<int64_t> xvs_offset_ns;
+	// The step of --bracket-exposure the frame was taken with, if known.
+	std::optional<unsigned int> bracket_step;
+	// How far the thermal governor had taken the capture down, if at all.
+	std::optional<unsigned int> thermal_step;
+	// What the particle_analysis stage found, where it ran.
+	std::optional<ParticleResults> particles;
+};
+
+class ShmRing;
 
 class Output
 {
@@ -24,6 +55,9 @@ public:
 	virtual void Signal(); // a derived class might redefine what this means
 	void OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyframe);
 	void MetadataReady(libcamera::ControlList &metadata);
+	// Call before handing the frame to the encoder, and withdraw it if the encoder then declines the frame.
+	void FrameInfoReady(OutputFrameInfo const &info);
+	void WithdrawFrameInfo();
 	void setStreamInfo(StreamInfo* info) {
 		this->streamInfo_ = info;
 	}
@@ -42,7 +76,12 @@ protected:
 	virtual void timestampReady(int64_t timestamp);
 	VideoOptions const *options_;
 	FILE *fp_timestamps_;
+	// Only kept for the text formats, and for outputs that write per-file metadata of their own.
 	std::queue<libcamera::ControlList> metadata_queue_;
+	// Details of the frame being output, if the application supplied any.
+	std::optional<OutputFrameInfo> frame_info_;
+	// The CRC-32C of the frame being output, with --frame-checksum.
+	std::optional<uint32_t> checksum_;
 
 private:
 	enum State
@@ -56,11 +95,23 @@ private:
 	int64_t time_offset_;
 	int64_t last_timestamp_;
 	std::streambuf *buf_metadata_;
+	// Declared before the stream, which must flush into it before it goes.
+	std::vector<char> metadata_file_buffer_;
 	std::ofstream of_metadata_;
 	bool metadata_started_ = false;
+	// With the bin format each frame is serialised as soon as its metadata arrives, rather than being copied.
+	bool binary_metadata_ = false;
+	std::vector<uint8_t> binary_metadata_header_;
+	std::queue<std::vector<uint8_t>> binary_metadata_queue_;
 	StreamInfo* streamInfo_ = nullptr;
+	std::mutex frame_info_mutex_;
+	std::deque<OutputFrameInfo> frame_info_queue_;
+	static constexpr unsigned int MAX_FRAME_INFO_QUEUE = 256;
+	bool frame_info_overflow_ = false;
+	// Every frame is published here too, with --shm-ring.
+	std::unique_ptr<ShmRing> shm_ring_;
 };
 
 void start_metadata_output(std::streambuf *buf, std::string fmt);
-void write_metadata(std::streambuf *buf, std::string fmt, libcamera::ControlList &metadata, bool first_write);
+void write_metadata(std::streambuf *buf, std::string fmt, libcamera::ControlList const &metadata, bool first_write);
 void stop_metadata_output(std::streambuf *buf, std::string fmt);
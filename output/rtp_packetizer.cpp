@@ -0,0 +1,262 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * rtp_packetizer.cpp - split encoded frames into RTP packets.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+
+#include "rtp_packetizer.hpp"
+
+static constexpr size_t RTP_HEADER_SIZE = 12;
+// Dynamic payload type for H.264; JPEG has a static one.
+static constexpr uint8_t PAYLOAD_TYPE_H264 = 96;
+static constexpr uint8_t PAYLOAD_TYPE_JPEG = 26;
+// The FU-A NAL unit type, from RFC 6184.
+static constexpr uint8_t NAL_TYPE_FU_A = 28;
+// RFC 2435 gives the image size in 8 pixel units in a byte.
+static constexpr unsigned int MAX_JPEG_DIMENSION = 2040;
+
+RtpPacketizer::RtpPacketizer(std::string const &codec, size_t max_packet_size)
+	: max_packet_size_(max_packet_size), timestamp_(0)
+{
+	if (codec == "h264")
+		h264_ = true, payload_type_ = PAYLOAD_TYPE_H264;
+	else if (codec == "mjpeg")
+		h264_ = false, payload_type_ = PAYLOAD_TYPE_JPEG;
+	else
+		throw std::runtime_error("RTP output supports only the h264 and mjpeg codecs");
+
+	// Big enough for the first JPEG packet's headers and tables with a reasonable amount of data after them.
+	if (max_packet_size_ < 256)
+		throw std::runtime_error("RTP packets must be at least 256 bytes");
+
+	// RFC 3550 wants the sequence number and SSRC to start somewhere random.
+	std::random_device rd;
+	ssrc_ = rd();
+	sequence_ = rd();
+}
+
+void RtpPacketizer::Packetize(uint8_t const *mem, size_t size, uint32_t timestamp)
+{
+	timestamp_ = timestamp;
+	headers_.clear();
+	header_sizes_.clear();
+	iovs_.clear();
+	sizes_.clear();
+
+	if (h264_)
+		packetizeH264(mem, size);
+	else
+		packetizeJpeg(mem, size);
+
+	if (sizes_.empty())
+		return;
+	// The marker bit ends the frame.
+	headers_[(sizes_.size() - 1) * HEADER_SPACE + 1] |= 0x80;
+	// Only now that all the headers are in place can the iovecs point at them.
+	for (unsigned int i = 0; i < sizes_.size(); i++)
+		iovs_[i * IOVS_PER_PACKET].iov_base = &headers_[i * HEADER_SPACE];
+}
+
+void RtpPacketizer::packetizeH264(uint8_t const *mem, size_t size)
+{
+	// NAL units start after each 00 00 01 (the 4 byte start code's extra zero gets trimmed off the one before).
+	uint8_t const *end = mem + size, *nal = nullptr;
+	for (uint8_t const *p = mem + std::min<size_t>(size, 2); p < end; p++)
+	{
+		p = (uint8_t const *)memchr(p, 1, end - p);
+		if (!p)
+			break;
+		if (p[-1] || p[-2])
+			continue;
+		if (nal)
+			packetizeNal(nal, p - 2 - nal);
+		nal = p + 1;
+	}
+	if (!nal)
+		throw std::runtime_error("RtpPacketizer: no H.264 start code in frame");
+	packetizeNal(nal, end - nal);
+}
+
+void RtpPacketizer::packetizeNal(uint8_t const *nal, size_t size)
+{
+	while (size && !nal[size - 1])
+		size--;
+	if (!size)
+		return;
+
+	size_t max_payload = max_packet_size_ - RTP_HEADER_SIZE;
+	if (size <= max_payload)
+	{
+		addPacket(0);
+		finishPacket(nullptr, 0, nal, size);
+		return;
+	}
+
+	// Too big for one packet, so it goes in fragmentation units. These carry the NAL header's bits in two bytes of
+	// their own, so the NAL header itself isn't sent.
+	uint8_t indicator = (nal[0] & 0xe0) | NAL_TYPE_FU_A, type = nal[0] & 0x1f;
+	for (size_t offset = 1; offset < size;)
+	{
+		size_t n = std::min(size - offset, max_payload - 2);
+		uint8_t *header = addPacket(2);
+		header[0] = indicator;
+		header[1] = type | (offset == 1 ? 0x80 : 0) | (offset + n == size ? 0x40 : 0);
+		finishPacket(nullptr, 0, nal + offset, n);
+		offset += n;
+	}
+}
+
+void RtpPacketizer::packetizeJpeg(uint8_t const *mem, size_t size)
+{
+	// Everything a receiver needs from the JPEG headers goes in the RTP payload headers, so only the entropy coded
+	// data is sent. The Huffman tables aren't sent at all, so they had better be the standard ones (which they are
+	// unless libjpeg was asked to optimise them).
+	unsigned int type = 0, width = 0, height = 0, restart_interval = 0;
+	uint8_t const *end = mem + size, *scan = nullptr;
+	qtables_.clear();
+
+	if (size < 4 || mem[0] != 0xff || mem[1] != 0xd8)
+		throw std::runtime_error("RtpPacketizer: frame is not a JPEG");
+	for (uint8_t const *p = mem + 2; !scan;)
+	{
+		if (p + 4 > end || p[0] != 0xff)
+			throw std::runtime_error("RtpPacketizer: bad JPEG marker");
+		uint8_t marker = p[1];
+		size_t length = (p[2] << 8) | p[3];
+		uint8_t const *segment = p + 4, *segment_end = p + 2 + length;
+		if (length < 2 || segment_end > end)
+			throw std::runtime_error("RtpPacketizer: truncated JPEG");
+
+		if (marker == 0xdb)
+		{
+			for (uint8_t const *q = segment; q + 65 <= segment_end; q += 65)
+			{
+				if (q[0] >> 4)
+					throw std::runtime_error("RtpPacketizer: 16-bit JPEG quantisation tables can't be sent");
+				qtables_.insert(qtables_.end(), q + 1, q + 65);
+			}
+		}
+		else if (marker == 0xc0)
+		{
+			// Y is 2x1 (type 0) or 2x2 (type 1) subsampled against Cb and Cr.
+			if (length < 17 || segment[5] != 3 || segment[10] != 0x11 || segment[13] != 0x11 ||
+				(segment[7] != 0x21 && segment[7] != 0x22))
+				throw std::runtime_error("RtpPacketizer: only YUV422 or YUV420 JPEGs can be sent");
+			height = (segment[1] << 8) | segment[2];
+			width = (segment[3] << 8) | segment[4];
+			type = segment[7] == 0x21 ? 0 : 1;
+		}
+		else if (marker == 0xdd)
+			restart_interval = (segment[0] << 8) | segment[1];
+		else if (marker == 0xda)
+			scan = segment_end;
+		else if (marker > 0xc0 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc)
+			throw std::runtime_error("RtpPacketizer: only baseline JPEGs can be sent");
+		p = segment_end;
+	}
+
+	if (!width || !height || qtables_.empty())
+		throw std::runtime_error("RtpPacketizer: JPEG has no frame header or quantisation tables");
+	if (width > MAX_JPEG_DIMENSION || height > MAX_JPEG_DIMENSION)
+		throw std::runtime_error("RtpPacketizer: JPEGs larger than " + std::to_string(MAX_JPEG_DIMENSION) +
+								 " pixels each way can't be sent");
+	if (end - scan >= 2 && end[-2] == 0xff && end[-1] == 0xd9)
+		end -= 2;
+	size_t scan_size = end - scan;
+	if (scan_size >= 1 << 24)
+		throw std::runtime_error("RtpPacketizer: JPEG too big");
+
+	size_t header_size = 8 + (restart_interval ? 4 : 0);
+	for (size_t offset = 0; offset < scan_size;)
+	{
+		// The first packet of each frame also has the quantisation tables, with a header of their own.
+		size_t tables_size = offset ? 0 : qtables_.size();
+		size_t extra_header = offset ? 0 : 4;
+		size_t n = std::min(scan_size - offset,
+							max_packet_size_ - RTP_HEADER_SIZE - header_size - extra_header - tables_size);
+		uint8_t *header = addPacket(header_size + extra_header);
+		header[0] = 0;
+		header[1] = offset >> 16;
+		header[2] = offset >> 8;
+		header[3] = offset;
+		header[4] = type + (restart_interval ? 64 : 0);
+		header[5] = 255; // quantisation tables are in-band
+		header[6] = (width + 7) / 8;
+		header[7] = (height + 7) / 8;
+		if (restart_interval)
+		{
+			// Packets needn't start and end on restart intervals, so there's no count.
+			header[8] = restart_interval >> 8;
+			header[9] = restart_interval;
+			header[10] = 0xff;
+			header[11] = 0xff;
+		}
+		if (!offset)
+		{
+			uint8_t *q = header + header_size;
+			q[0] = 0;
+			q[1] = 0; // all 8-bit tables
+			q[2] = tables_size >> 8;
+			q[3] = tables_size;
+		}
+		finishPacket(tables_size ? qtables_.data() : nullptr, tables_size, scan + offset, n);
+		offset += n;
+	}
+}
+
+uint8_t *RtpPacketizer::addPacket(size_t header_size)
+{
+	size_t i = sizes_.size();
+	headers_.resize((i + 1) * HEADER_SPACE);
+	uint8_t *header = &headers_[i * HEADER_SPACE];
+	header[0] = 0x80; // version 2
+	header[1] = payload_type_;
+	header[2] = sequence_ >> 8;
+	header[3] = sequence_;
+	header[4] = timestamp_ >> 24;
+	header[5] = timestamp_ >> 16;
+	header[6] = timestamp_ >> 8;
+	header[7] = timestamp_;
+	header[8] = ssrc_ >> 24;
+	header[9] = ssrc_ >> 16;
+	header[10] = ssrc_ >> 8;
+	header[11] = ssrc_;
+	sequence_++;
+	header_sizes_.push_back(RTP_HEADER_SIZE + header_size);
+	// A placeholder, as the header's sizes_ entry can only be filled in by finishPacket.
+	sizes_.push_back(0);
+	return header + RTP_HEADER_SIZE;
+}
+
+void RtpPacketizer::finishPacket(uint8_t const *extra, size_t extra_size, uint8_t const *payload,
+								 size_t payload_size)
+{
+	iovs_.push_back({ nullptr, header_sizes_.back() });
+	iovs_.push_back({ (void *)extra, extra_size });
+	iovs_.push_back({ (void *)payload, payload_size });
+	sizes_.back() = header_sizes_.back() + extra_size + payload_size;
+}
+
+std::string RtpPacketizer::Sdp(std::string const &address, unsigned int port) const
+{
+	std::stringstream sdp;
+	sdp << "v=0\n"
+		<< "o=- " << ssrc_ << " 0 IN IP4 " << address << "\n"
+		<< "s=rpicam-apps\n"
+		<< "c=IN IP4 " << address << "\n"
+		<< "t=0 0\n"
+		<< "m=video " << port << " RTP/AVP " << (unsigned int)payload_type_ << "\n";
+	if (h264_)
+		sdp << "a=rtpmap:" << (unsigned int)payload_type_ << " H264/90000\n"
+			<< "a=fmtp:" << (unsigned int)payload_type_ << " packetization-mode=1\n";
+	else
+		sdp << "a=rtpmap:" << (unsigned int)payload_type_ << " JPEG/90000\n";
+	return sdp.str();
+}
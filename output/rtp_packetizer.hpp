@@ -0,0 +1,65 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * rtp_packetizer.hpp - split encoded frames into RTP packets.
+ */
+
+#pragma once
+
+#include <sys/uio.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Turns each encoded frame into RTP packets: H.264 as in RFC 6184 (single NAL unit packets, and FU-A for NAL units
+// that don't fit), or MJPEG as in RFC 2435 (with the quantisation tables in-band). The payloads aren't copied; each
+// packet is a set of iovecs, its header and then a slice of the frame, so the frame must stay put until the packets
+// have been sent.
+class RtpPacketizer
+{
+public:
+	// Each packet has this many iovecs.
+	static constexpr unsigned int IOVS_PER_PACKET = 3;
+
+	// codec is "h264" or "mjpeg". No packet, header included, is bigger than max_packet_size.
+	RtpPacketizer(std::string const &codec, size_t max_packet_size);
+
+	// Packetize a frame taken at the given time on a 90kHz clock. Throws if the frame can't be sent as RTP.
+	void Packetize(uint8_t const *mem, size_t size, uint32_t timestamp);
+
+	unsigned int NumPackets() const { return sizes_.size(); }
+	iovec *PacketIovs(unsigned int i) { return &iovs_[i * IOVS_PER_PACKET]; }
+	size_t PacketSize(unsigned int i) const { return sizes_[i]; }
+
+	// A session description a receiver can be given to play the stream.
+	std::string Sdp(std::string const &address, unsigned int port) const;
+
+private:
+	// Room for the RTP header and the largest payload header (RFC 2435 main, restart and quantisation headers).
+	static constexpr size_t HEADER_SPACE = 12 + 8 + 4 + 4;
+
+	void packetizeH264(uint8_t const *mem, size_t size);
+	void packetizeNal(uint8_t const *nal, size_t size);
+	void packetizeJpeg(uint8_t const *mem, size_t size);
+
+	// Start a packet, returning where its payload header goes.
+	uint8_t *addPacket(size_t header_size);
+	void finishPacket(uint8_t const *extra, size_t extra_size, uint8_t const *payload, size_t payload_size);
+
+	bool h264_;
+	uint8_t payload_type_;
+	size_t max_packet_size_;
+	uint32_t ssrc_;
+	uint16_t sequence_;
+	uint32_t timestamp_;
+
+	// Headers, HEADER_SPACE bytes apiece, and where the rest of each packet comes from.
+	std::vector<uint8_t> headers_;
+	std::vector<size_t> header_sizes_;
+	std::vector<iovec> iovs_;
+	std::vector<size_t> sizes_;
+	// The JPEG quantisation tables, which go in the first packet of each frame.
+	std::vector<uint8_t> qtables_;
+};
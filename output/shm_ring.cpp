@@ -0,0 +1,129 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * shm_ring.cpp - Publish output frames in a shared-memory ring for other processes to read.
+ */
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "core/logging.hpp"
+
+#include "shm_ring.hpp"
+
+static constexpr size_t HEADER_SIZE = 4096;
+static constexpr size_t SLOT_HEADER_SIZE = 128;
+static constexpr size_t SLOT_ROUNDING = 1 << 20;
+
+static_assert(sizeof(ShmRingHeader) <= HEADER_SIZE && sizeof(ShmRingSlot) <= SLOT_HEADER_SIZE,
+			  "ring headers don't fit");
+
+ShmRing::ShmRing(std::string const &name, unsigned int slot_count, size_t slot_size)
+	: name_(name), slot_count_(std::max(slot_count, 1u)), slot_size_(slot_size), map_(nullptr), map_size_(0),
+	  header_(nullptr), warned_(false)
+{
+}
+
+ShmRing::~ShmRing()
+{
+	// Readers that still have it mapped keep what they have; new ones can no longer find it.
+	if (map_)
+	{
+		munmap(map_, map_size_);
+		shm_unlink(name_.c_str());
+	}
+}
+
+// The ring is only made when the first frame arrives, so that its slots can be sized to suit.
+void ShmRing::create(size_t frame_size)
+{
+	size_t slot_size = slot_size_ ? slot_size_ : SLOT_HEADER_SIZE + 2 * frame_size;
+	slot_size = (slot_size + SLOT_ROUNDING - 1) & ~(SLOT_ROUNDING - 1);
+	size_t map_size = HEADER_SIZE + slot_size * slot_count_;
+
+	int fd = shm_open(name_.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+	if (fd < 0)
+		throw std::runtime_error("failed to open shared memory " + name_ + ": " + strerror(errno));
+	if (ftruncate(fd, map_size) < 0)
+	{
+		int err = errno;
+		close(fd);
+		shm_unlink(name_.c_str());
+		throw std::runtime_error("failed to size shared memory " + name_ + ": " + strerror(err));
+	}
+	void *map = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		shm_unlink(name_.c_str());
+		throw std::runtime_error("failed to map shared memory " + name_ + ": " + strerror(errno));
+	}
+
+	// The new object is all zeroes, so only the sizes need filling in before the magic says it's ready.
+	map_ = (uint8_t *)map;
+	map_size_ = map_size;
+	slot_size_ = slot_size;
+	header_ = (ShmRingHeader *)map_;
+	header_->header_size = HEADER_SIZE;
+	header_->slot_count = slot_count_;
+	header_->slot_size = slot_size;
+	header_->slot_header_size = SLOT_HEADER_SIZE;
+	std::atomic_thread_fence(std::memory_order_release);
+	memcpy(header_->magic, "RPIRING1", sizeof(header_->magic));
+
+	LOG(1, "ShmRing: " << slot_count_ << " slots of " << (slot_size >> 20) << "MB in /dev/shm" << name_);
+}
+
+void ShmRing::Publish(void const *mem, size_t size, int64_t timestamp_us, OutputFrameInfo const *info,
+					  StreamInfo const *stream_info)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (!map_)
+		create(size);
+	if (size > slot_size_ - SLOT_HEADER_SIZE)
+	{
+		header_->skipped.fetch_add(1, std::memory_order_relaxed);
+		if (!warned_)
+			LOG_ERROR("WARNING: ShmRing: frames of " << size << " bytes are too big for the ring's slots, and are "
+													 "left out (try --shm-slot-size)");
+		warned_ = true;
+		return;
+	}
+
+	uint64_t index = header_->frames.load(std::memory_order_relaxed);
+	uint8_t *base = map_ + HEADER_SIZE + (index % slot_count_) * slot_size_;
+	ShmRingSlot *slot = (ShmRingSlot *)base;
+
+	uint32_t slot_lock = slot->lock.load(std::memory_order_relaxed);
+	slot->lock.store(slot_lock + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	slot->size = size;
+	slot->index = index;
+	slot->sequence = info ? info->sequence : index;
+	slot->timestamp_us = timestamp_us;
+	slot->sensor_timestamp_ns = info ? info->sensor_timestamp_ns : 0;
+	slot->width = stream_info ? stream_info->width : 0;
+	slot->height = stream_info ? stream_info->height : 0;
+	slot->stride = stream_info ? stream_info->stride : 0;
+	memset(slot->pixel_format, 0, sizeof(slot->pixel_format));
+	if (stream_info)
+		stream_info->pixel_format.toString().copy(slot->pixel_format, sizeof(slot->pixel_format) - 1);
+	memset(slot->lamp_color, 0, sizeof(slot->lamp_color));
+	if (info)
+		info->lamp_color.copy(slot->lamp_color, sizeof(slot->lamp_color) - 1);
+	memcpy(base + SLOT_HEADER_SIZE, mem, size);
+
+	slot->lock.store(slot_lock + 2, std::memory_order_release);
+	header_->frames.store(index + 1, std::memory_order_release);
+	header_->futex.fetch_add(1, std::memory_order_release);
+	syscall(SYS_futex, (uint32_t *)&header_->futex, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
@@ -0,0 +1,76 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * shm_ring.hpp - Publish output frames in a shared-memory ring for other processes to read.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+#include "output.hpp"
+
+// The ring is a POSIX shared memory object (so /dev/shm/<name>), laid out (all values little-endian) as:
+//
+//   ShmRingHeader, padded to header_size
+//   ShmRingSlot, frame data        - slot_count times, each slot_size bytes in all
+//
+// Frame n goes in slot n % slot_count. Each slot is guarded by a sequence lock: its lock is odd while the slot is
+// being written, so a reader copies the slot out and keeps the copy only if lock was even and unchanged from before
+// it started to after it finished. As each frame is published the futex word is bumped and any threads waiting on it
+// (FUTEX_WAIT, not private, as it is shared between processes) are woken. utils/shm_ring_read.py reads them.
+
+struct ShmRingHeader
+{
+	char magic[8]; // "RPIRING1", written last
+	uint32_t header_size; // bytes before the first slot
+	uint32_t slot_count;
+	uint64_t slot_size; // bytes from one slot to the next, a multiple of the page size
+	uint32_t slot_header_size; // bytes from the start of a slot to its data
+	std::atomic<uint32_t> futex;
+	std::atomic<uint64_t> frames; // published so far
+	std::atomic<uint64_t> skipped; // too big for a slot
+};
+static_assert(sizeof(ShmRingHeader) == 48, "ShmRingHeader should be packed");
+
+struct ShmRingSlot
+{
+	std::atomic<uint32_t> lock;
+	uint32_t size; // bytes of frame data
+	uint64_t index; // of the frame in the ring
+	uint64_t sequence;
+	int64_t timestamp_us;
+	int64_t sensor_timestamp_ns; // 0 if unknown
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	char pixel_format[20]; // of the stream, nul-padded
+	char lamp_color[16]; // nul-padded
+};
+static_assert(sizeof(ShmRingSlot) == 88, "ShmRingSlot should be packed");
+
+class ShmRing
+{
+public:
+	// Slots of slot_size bytes, or with 0 twice the size of the first frame, rounded up.
+	ShmRing(std::string const &name, unsigned int slot_count, size_t slot_size);
+	~ShmRing();
+	void Publish(void const *mem, size_t size, int64_t timestamp_us, OutputFrameInfo const *info,
+				 StreamInfo const *stream_info);
+
+private:
+	void create(size_t frame_size);
+
+	std::string name_;
+	unsigned int slot_count_;
+	size_t slot_size_;
+	std::mutex mutex_;
+	uint8_t *map_;
+	size_t map_size_;
+	ShmRingHeader *header_;
+	bool warned_;
+};
@@ -5,10 +5,22 @@
  * annotate_cv_stage.cpp - add text annotation to image
  */
 
-// The text string can include the % directives supported by FrameInfo.
+// The text string can include the % directives supported by FrameInfo. Unless "burn_in" is set, the text goes to the
+// preview as an overlay and the frames themselves are left alone.
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#define HAVE_NEON_KERNELS 1
+#endif
 
 #include <time.h>
 
+#include <algorithm>
+#include <memory>
+#include <mutex>
+
 #include <libcamera/stream.h>
 
 #include "core/frame_info.hpp"
@@ -19,10 +31,112 @@
 #include "opencv2/core.hpp"
 #include "opencv2/imgproc.hpp"
 
+#if GPU_COMPUTE_PRESENT
+#include "post_processing_stages/gpu_compute.hpp"
+
+// One invocation per 4 pixels of the Y plane, for the top left corner of the image which the text covers. The text
+// itself has been drawn into the mask on the CPU, which is cheap as it's small; the GPU blends the background box
+// and paints the text into the image.
+static const char ANNOTATE_SHADER[] = R"(#version 310 es
+layout(local_size_x = 8, local_size_y = 8) in;
+layout(rgba8, binding = 0) readonly uniform highp image2D src;
+layout(rgba8, binding = 1) writeonly uniform highp image2D dst;
+uniform highp sampler2D mask;
+uniform ivec2 mask_size;
+uniform ivec2 box;
+uniform float fg;
+uniform float bg;
+uniform float alpha;
+void main()
+{
+	ivec2 p = ivec2(gl_GlobalInvocationID.xy);
+	if (p.x * 4 >= mask_size.x || p.y >= mask_size.y)
+		return;
+	vec4 v = imageLoad(src, p);
+	for (int i = 0; i < 4; i++)
+	{
+		ivec2 q = ivec2(p.x * 4 + i, p.y);
+		if (q.x >= mask_size.x)
+			break;
+		float y = v[i] * 255.0;
+		if (all(lessThan(q, box)))
+			y = floor(bg * alpha + (1.0 - alpha) * y);
+		if (texelFetch(mask, q, 0).r > 0.5)
+			y = fg;
+		v[i] = y / 255.0;
+	}
+	imageStore(dst, p, v);
+}
+)";
+#endif
+
 using namespace cv;
 
 using Stream = libcamera::Stream;
 
+namespace
+{
+
+// Composites a row of the overlay onto the image: each pixel becomes (pixel * inv + bg_term) / 256, rounded, which
+// blends in the background box (inv = 256 - alpha * 256, bg_term = bg * alpha * 256, or 256 and 0 for none), and
+// then fg wherever the text mask is set. Done for as many whole blocks of 16 pixels as fit in the width, returning the
+// number of pixels done; whatever is left is finished off by the C code.
+typedef unsigned int (*CompositeRowFn)(uint8_t *, uint8_t const *, unsigned int, uint16_t, uint16_t, uint8_t);
+
+unsigned int composite_row_c(uint8_t *, uint8_t const *, unsigned int, uint16_t, uint16_t, uint8_t)
+{
+	return 0;
+}
+
+#if HAVE_NEON_KERNELS
+
+// inv and bg_term add up to no more than 255 * 256, so the sums fit in 16 bits.
+unsigned int composite_row_neon(uint8_t *row, uint8_t const *mask, unsigned int width, uint16_t inv,
+								uint16_t bg_term, uint8_t fg)
+{
+	const uint16x8_t b = vdupq_n_u16(bg_term);
+	const uint8x16_t f = vdupq_n_u8(fg);
+	unsigned int x = 0;
+	for (; x + 16 <= width; x += 16)
+	{
+		uint8x16_t y = vld1q_u8(row + x);
+		uint8x16_t m = vld1q_u8(mask + x);
+		uint8x8_t lo = vrshrn_n_u16(vmlaq_n_u16(b, vmovl_u8(vget_low_u8(y)), inv), 8);
+		uint8x8_t hi = vrshrn_n_u16(vmlaq_n_u16(b, vmovl_u8(vget_high_u8(y)), inv), 8);
+		vst1q_u8(row + x, vbslq_u8(vtstq_u8(m, m), f, vcombine_u8(lo, hi)));
+	}
+	return x;
+}
+
+#endif /* HAVE_NEON_KERNELS */
+
+CompositeRowFn select_composite_row()
+{
+#if HAVE_NEON_KERNELS
+	if (getauxval(AT_HWCAP) & HWCAP_ASIMD)
+	{
+		LOG(2, "AnnotateCvStage: using NEON kernels");
+		return composite_row_neon;
+	}
+#endif
+	LOG(2, "AnnotateCvStage: using C kernels");
+	return composite_row_c;
+}
+
+CompositeRowFn composite_row()
+{
+	static const CompositeRowFn fn = select_composite_row();
+	return fn;
+}
+
+void composite(uint8_t *row, uint8_t const *mask, unsigned int width, uint16_t inv, uint16_t bg_term, uint8_t fg)
+{
+	for (unsigned int x = composite_row()(row, mask, width, inv, bg_term, fg); x < width; x++)
+		row[x] = mask[x] ? fg : (row[x] * inv + bg_term + 128) >> 8;
+}
+
+} // namespace
+
 class AnnotateCvStage : public PostProcessingStage
 {
 public:
@@ -36,9 +150,25 @@ public:
 
 	bool Process(CompletedRequestPtr &completed_request) override;
 
+	void Teardown() override;
+
 	std::string placeMilliseconds(std::string text);
 
 private:
+	// The text is drawn into a mask, which is kept until the text changes, with room for strokes that stray a little
+	// outside the background box. The box is the size of the text, less anything off the edge of the image. Several
+	// frames may be in Process() at once, so a new rendering is made on the side and swapped in whole, and each frame
+	// composites from whichever one it took, or hands its overlay items to the preview.
+	struct Rendering
+	{
+		std::string text;
+		Mat mask;
+		Size box;
+		std::vector<OverlayItem> overlay;
+	};
+
+	std::shared_ptr<Rendering const> render(std::string const &text);
+
 	Stream *stream_;
 	StreamInfo info_;
 	std::string text_;
@@ -49,6 +179,15 @@ private:
 	double alpha_;
 	double adjusted_scale_;
 	int adjusted_thickness_;
+	bool use_gpu_;
+	bool burn_in_;
+	// Guards text_, which other stages may change through the metadata, and rendering_.
+	std::mutex mutex_;
+	std::shared_ptr<Rendering const> rendering_;
+#if GPU_COMPUTE_PRESENT
+	void processGpu(CompletedRequestPtr &completed_request, Rendering const &rendering);
+	std::shared_ptr<GpuCompute> gpu_;
+#endif
 };
 
 #define NAME "annotate_cv"
@@ -66,6 +205,8 @@ void AnnotateCvStage::Read(boost::property_tree::ptree const &params)
 	scale_ = params.get<double>("scale", 1.0);
 	thickness_ = params.get<int>("thickness", 2);
 	alpha_ = params.get<double>("alpha", 0.5);
+	use_gpu_ = params.get<bool>("gpu", false);
+	burn_in_ = params.get<bool>("burn_in", false);
 }
 
 void AnnotateCvStage::Configure()
@@ -80,6 +221,31 @@ void AnnotateCvStage::Configure()
 	// rather harshly quantised, not much we can do about that.
 	adjusted_scale_ = scale_ * info_.width / 1200;
 	adjusted_thickness_ = std::max(thickness_ * info_.width / 700, 1u);
+	rendering_.reset();
+
+	if (!use_gpu_ || !burn_in_)
+		return;
+#if GPU_COMPUTE_PRESENT
+	try
+	{
+		gpu_ = GpuCompute::Get();
+	}
+	catch (std::exception const &e)
+	{
+		LOG_ERROR("WARNING: AnnotateCvStage: GPU unavailable (" << e.what() << "), using the CPU");
+	}
+#else
+	LOG_ERROR("WARNING: AnnotateCvStage: built without GPU support, using the CPU");
+#endif
+}
+
+void AnnotateCvStage::Teardown()
+{
+#if GPU_COMPUTE_PRESENT
+	if (gpu_)
+		gpu_->ReleaseImages();
+	gpu_.reset();
+#endif
 }
 
 std::string AnnotateCvStage::placeMilliseconds(std::string text) {
@@ -102,36 +268,116 @@ std::string AnnotateCvStage::placeMilliseconds(std::string text) {
 	return result;
 }
 
+std::shared_ptr<AnnotateCvStage::Rendering const> AnnotateCvStage::render(std::string const &text)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (rendering_ && rendering_->text == text)
+			return rendering_;
+	}
+
+	int font = FONT_HERSHEY_SIMPLEX;
+	int baseline = 0;
+	Size size = getTextSize(text, font, adjusted_scale_, adjusted_thickness_, &baseline);
+
+	int width = std::min<int>(size.width + adjusted_thickness_, info_.width);
+	int height = std::min<int>(size.height + baseline + adjusted_thickness_, info_.height);
+	auto rendering = std::make_shared<Rendering>();
+	rendering->text = text;
+	rendering->mask = Mat::zeros(height, width, CV_8U);
+	putText(rendering->mask, text, Point(0, size.height), font, adjusted_scale_, 255, adjusted_thickness_, 0);
+	rendering->box =
+		Size(std::min<int>(size.width, info_.width), std::min<int>(size.height + baseline, info_.height));
+
+	uint32_t grey = 0x010101;
+	OverlayItem box { OverlayItem::Shape::FilledRect, 0, 0, rendering->box.width, rendering->box.height };
+	box.argb = (uint32_t)std::clamp<int>(alpha_ * 255 + 0.5, 0, 255) << 24 | std::clamp(bg_, 0, 255) * grey;
+	OverlayItem letters { OverlayItem::Shape::Mask, 0, 0, width, height };
+	letters.argb = 0xff000000 | std::clamp(fg_, 0, 255) * grey;
+	letters.mask = std::make_shared<std::vector<uint8_t>>(rendering->mask.datastart, rendering->mask.dataend);
+	rendering->overlay = { box, letters };
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	rendering_ = rendering;
+	return rendering;
+}
+
+#if GPU_COMPUTE_PRESENT
+void AnnotateCvStage::processGpu(CompletedRequestPtr &completed_request, Rendering const &rendering)
+{
+	Mat const &mask_image = rendering.mask;
+	int width = mask_image.cols, height = mask_image.rows;
+	libcamera::FrameBuffer *buffer = completed_request->buffers[stream_];
+	BufferDeviceSync sync(app_, buffer);
+	gpu_->Run([&]() {
+		GpuCompute::Image image = gpu_->Import(buffer, info_);
+		GLuint mask = gpu_->Upload("annotate_mask", mask_image.data, width, height, mask_image.step);
+		GLuint program = gpu_->Program("annotate", ANNOTATE_SHADER);
+		glUseProgram(program);
+		glUniform2i(glGetUniformLocation(program, "mask_size"), width, height);
+		glUniform2i(glGetUniformLocation(program, "box"), rendering.box.width, rendering.box.height);
+		glUniform1f(glGetUniformLocation(program, "fg"), fg_);
+		glUniform1f(glGetUniformLocation(program, "bg"), bg_);
+		glUniform1f(glGetUniformLocation(program, "alpha"), alpha_);
+		glUniform1i(glGetUniformLocation(program, "mask"), 0);
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, mask);
+		glBindImageTexture(0, image.texture, 0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA8);
+		glBindImageTexture(1, image.texture, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA8);
+		GpuCompute::Dispatch((width + 3) / 4, height);
+	});
+}
+#endif
+
 bool AnnotateCvStage::Process(CompletedRequestPtr &completed_request)
 {
-	BufferWriteSync w(app_, completed_request->buffers[stream_]);
-	libcamera::Span<uint8_t> buffer = w.Get()[0];
 	FrameInfo info(completed_request);
 
 	// Other post-processing stages can supply metadata to update the text.
-	completed_request->post_process_metadata.Get("annotate.text", text_);
-	std::string text = info.ToString(text_);
+	std::string format;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		completed_request->post_process_metadata.Get("annotate.text", text_);
+		format = text_;
+	}
+	std::string text = info.ToString(format);
 	char text_with_date[256];
 	time_t t = time(NULL);
 	tm *tm_ptr = localtime(&t);
 	if (strftime(text_with_date, sizeof(text_with_date), text.c_str(), tm_ptr) != 0)
 		text = std::string(text_with_date);
 	text = placeMilliseconds(text);
+	std::shared_ptr<Rendering const> rendering = render(text);
 
-	uint8_t *ptr = (uint8_t *)buffer.data();
-	Mat im(info_.height, info_.width, CV_8U, ptr, info_.stride);
-	int font = FONT_HERSHEY_SIMPLEX;
+	if (!burn_in_)
+	{
+		completed_request->overlay.Add(info_.width, info_.height, rendering->overlay);
+		return false;
+	}
 
-	int baseline = 0;
-	Size size = getTextSize(text, font, adjusted_scale_, adjusted_thickness_, &baseline);
+#if GPU_COMPUTE_PRESENT
+	if (gpu_)
+	{
+		processGpu(completed_request, *rendering);
+		return false;
+	}
+#endif
 
-	// Can't find a handy "draw rectangle with alpha" function...
-	for (int y = 0; y < size.height + baseline; y++, ptr += info_.stride)
+	// Only the rectangle under the overlay is touched: the box is blended in, and the text painted over it.
+	BufferWriteSync w(app_, completed_request->buffers[stream_]);
+	uint8_t *ptr = (uint8_t *)w.Get()[0].data();
+	uint16_t a = std::clamp<int>(alpha_ * 256 + 0.5, 0, 256);
+	uint16_t inv = 256 - a, bg_term = std::clamp(bg_, 0, 255) * a;
+	uint8_t fg = std::clamp(fg_, 0, 255);
+	Mat const &mask_image = rendering->mask;
+	Size const &box = rendering->box;
+	for (int y = 0; y < mask_image.rows; y++, ptr += info_.stride)
 	{
-		for (int x = 0; x < size.width; x++)
-			ptr[x] = bg_ * alpha_ + (1 - alpha_) * ptr[x];
+		uint8_t const *mask = mask_image.ptr<uint8_t>(y);
+		unsigned int box_width = y < box.height ? box.width : 0;
+		composite(ptr, mask, box_width, inv, bg_term, fg);
+		composite(ptr + box_width, mask + box_width, mask_image.cols - box_width, 256, 0, fg);
 	}
-	putText(im, text, Point(0, size.height), font, adjusted_scale_, fg_, adjusted_thickness_, 0);
 
 	return false;
 }
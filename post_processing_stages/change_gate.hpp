@@ -0,0 +1,19 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * change_gate.hpp - change gate result
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include "core/metadata.hpp"
+
+namespace metadata_tags
+{
+// On each frame the change gate lets through, the number of frames it suppressed since the last one. The
+// particle_analysis stage adds in the frames it suppresses too.
+inline constexpr MetadataTag<uint64_t> change_gate_suppressed("change_gate.suppressed");
+} // namespace metadata_tags
@@ -0,0 +1,185 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * change_gate_stage.cpp - drop frames that show no change from the last one saved
+ */
+
+// For long captures of scenes that are mostly static: each frame is compared with the last one that was let through,
+// and dropped, so never encoded or saved, unless more than "threshold" of its pixels have changed. A frame is let
+// through every "heartbeat" seconds whatever happens (0 for never), so that a capture still shows that it was
+// running. Frames are compared just as the motion detector compares them (difference_m and difference_c work the same
+// way, and use the same kernels), on a grid of around 160x120 pixels sampled from the lores stream, the main stream
+// if there is no lores one, or otherwise the raw stream. Raw pixels are sampled a byte at a time (the high byte of
+// 16-bit ones), but always in the same places, so the comparison is still fair.
+
+// Each frame that is let through carries the number of frames suppressed before it, as "change_gate.suppressed".
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <mutex>
+
+#include <libcamera/stream.h>
+
+#include "core/rpicam_app.hpp"
+
+#include "post_processing_stages/change_gate.hpp"
+#include "post_processing_stages/motion_detect_kernels.hpp"
+#include "post_processing_stages/post_processing_stage.hpp"
+
+using Stream = libcamera::Stream;
+
+class ChangeGateStage : public PostProcessingStage
+{
+public:
+	ChangeGateStage(RPiCamApp *app) : PostProcessingStage(app) {}
+
+	char const *Name() const override;
+
+	void Read(boost::property_tree::ptree const &params) override;
+
+	void Configure() override;
+
+	bool Process(CompletedRequestPtr &completed_request) override;
+
+	void Stop() override;
+
+private:
+	// Parameters.
+	float threshold_;
+	float heartbeat_;
+	float difference_m_;
+	int difference_c_;
+	bool verbose_;
+
+	Stream *stream_ = nullptr;
+	unsigned int offset_; // of the byte sampled in each pixel
+	unsigned int hskip_; // in bytes
+	unsigned int row_stride_; // between the rows sampled
+	unsigned int width_;
+	unsigned int height_;
+	uint8_t limit_[256];
+
+	// Frames are processed several at a time, so each is compared with the reference, and may replace it, under the
+	// lock. Frames can finish out of order, so one older than the reference never replaces it.
+	std::mutex mutex_;
+	std::vector<uint8_t> reference_;
+	int64_t reference_ns_;
+	unsigned int reference_sequence_;
+	uint64_t suppressed_ = 0;
+	uint64_t total_suppressed_ = 0;
+	uint64_t passed_ = 0;
+};
+
+#define NAME "change_gate"
+
+char const *ChangeGateStage::Name() const
+{
+	return NAME;
+}
+
+void ChangeGateStage::Read(boost::property_tree::ptree const &params)
+{
+	threshold_ = params.get<float>("threshold", 0.01);
+	heartbeat_ = params.get<float>("heartbeat", 60);
+	difference_m_ = std::max(params.get<float>("difference_m", 0.1), 0.0f);
+	difference_c_ = std::max(params.get<int>("difference_c", 10), 0);
+	verbose_ = params.get<int>("verbose", 0);
+}
+
+void ChangeGateStage::Configure()
+{
+	StreamInfo info;
+	stream_ = app_->LoresStream(&info);
+	if (!stream_ && (stream_ = app_->GetMainStream()))
+		info = app_->GetStreamInfo(stream_);
+	if (!stream_)
+		stream_ = app_->RawStream(&info);
+	if (!stream_ || !info.width || !info.height)
+	{
+		stream_ = nullptr;
+		return;
+	}
+
+	// Sample one byte of each pixel, the high one where raw pixels are 16 bits.
+	unsigned int bytes_per_pixel = stream_ == app_->RawStream() && info.stride >= 2 * info.width ? 2 : 1;
+	offset_ = bytes_per_pixel - 1;
+	unsigned int hskip = std::max(info.width / 160, 1u), vskip = std::max(info.height / 120, 1u);
+	hskip_ = hskip * bytes_per_pixel;
+	row_stride_ = info.stride * vskip;
+	width_ = info.width / hskip;
+	height_ = info.height / vskip;
+
+	for (int old_value = 0; old_value < 256; old_value++)
+		limit_[old_value] = std::min(std::floor(difference_m_ * old_value + difference_c_), 255.0f);
+
+	if (verbose_)
+		LOG(1, "ChangeGateStage: comparing " << width_ << "x" << height_ << " samples of the "
+											 << info.width << "x" << info.height << " image");
+
+	reference_.clear();
+	suppressed_ = 0;
+}
+
+bool ChangeGateStage::Process(CompletedRequestPtr &completed_request)
+{
+	if (!stream_)
+		return false;
+
+	std::vector<uint8_t> frame(width_ * height_);
+	{
+		BufferReadSync r(app_, completed_request->buffers[stream_]);
+		uint8_t const *image = r.Get()[0].data() + offset_;
+		for (unsigned int y = 0; y < height_; y++)
+			motion_detect_kernels().gather_row(image + y * row_stride_, frame.data() + y * width_, width_, hskip_);
+	}
+
+	auto sensor_ts = completed_request->metadata.get(libcamera::controls::SensorTimestamp);
+	int64_t now_ns = sensor_ts ? *sensor_ts
+							   : std::chrono::duration_cast<std::chrono::nanoseconds>(
+									 std::chrono::steady_clock::now().time_since_epoch()).count();
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (!reference_.empty())
+	{
+		unsigned int changed = 0;
+		for (unsigned int y = 0; y < height_; y++)
+			changed += motion_detect_kernels().count_row(reference_.data() + y * width_, frame.data() + y * width_,
+														 limit_, width_);
+		bool heartbeat = heartbeat_ > 0 && now_ns - reference_ns_ >= heartbeat_ * 1e9;
+		if (changed <= threshold_ * frame.size() && !heartbeat)
+		{
+			suppressed_++, total_suppressed_++;
+			return true;
+		}
+		if (verbose_)
+			LOG(1, "ChangeGateStage: frame " << completed_request->sequence << " let through, "
+											 << (heartbeat ? "heartbeat" : std::to_string(changed) + " changed")
+											 << ", " << suppressed_ << " suppressed before it");
+	}
+
+	completed_request->post_process_metadata.Set(metadata_tags::change_gate_suppressed, suppressed_);
+	if (reference_.empty() || completed_request->sequence > reference_sequence_)
+	{
+		reference_ = std::move(frame);
+		reference_ns_ = now_ns;
+		reference_sequence_ = completed_request->sequence;
+	}
+	suppressed_ = 0;
+	passed_++;
+	return false;
+}
+
+void ChangeGateStage::Stop()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	LOG(1, "ChangeGateStage: " << passed_ << " frames let through, " << total_suppressed_ << " suppressed");
+}
+
+static PostProcessingStage *Create(RPiCamApp *app)
+{
+	return new ChangeGateStage(app);
+}
+
+static RegisterStage reg(NAME, &Create);
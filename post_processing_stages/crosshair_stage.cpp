@@ -15,6 +15,39 @@
 
 #include "post_processing_stages/post_processing_stage.hpp"
 
+#if GPU_COMPUTE_PRESENT
+#include "post_processing_stages/gpu_compute.hpp"
+
+// One invocation per 4 pixels of the Y plane within the bounding box of the lines, starting at origin (in texels).
+// Each line is a rectangle of pixels, x0, y0 inclusive to x1, y1 exclusive.
+static const char CROSSHAIR_SHADER[] = R"(#version 310 es
+layout(local_size_x = 8, local_size_y = 8) in;
+layout(rgba8, binding = 0) readonly uniform highp image2D src;
+layout(rgba8, binding = 1) writeonly uniform highp image2D dst;
+uniform ivec2 origin;
+uniform ivec2 size;
+uniform ivec4 lines[2];
+void main()
+{
+	ivec2 p = ivec2(gl_GlobalInvocationID.xy);
+	if (any(greaterThanEqual(p, size)))
+		return;
+	p += origin;
+	vec4 v = imageLoad(src, p);
+	for (int i = 0; i < 4; i++)
+	{
+		ivec2 q = ivec2(p.x * 4 + i, p.y);
+		for (int l = 0; l < 2; l++)
+		{
+			if (all(greaterThanEqual(q, lines[l].xy)) && all(lessThan(q, lines[l].zw)))
+				v[i] = 1.0;
+		}
+	}
+	imageStore(dst, p, v);
+}
+)";
+#endif
+
 #include "opencv2/core.hpp"
 #include "opencv2/imgproc.hpp"
 
@@ -35,10 +68,18 @@ public:
 
 	bool Process(CompletedRequestPtr &completed_request) override;
 
+	void Teardown() override;
+
 private:
 	Stream *stream_;
 	StreamInfo info_;
 	int line_thickness_;
+	bool use_gpu_;
+	bool burn_in_;
+#if GPU_COMPUTE_PRESENT
+	bool processGpu(CompletedRequestPtr &completed_request);
+	std::shared_ptr<GpuCompute> gpu_;
+#endif
 };
 
 #define NAME "crosshair"
@@ -51,6 +92,8 @@ char const *CrosshairStage::Name() const
 void CrosshairStage::Read(boost::property_tree::ptree const &params)
 {
 	line_thickness_ = params.get<int>("line_thickness", 2);
+	use_gpu_ = params.get<bool>("gpu", false);
+	burn_in_ = params.get<bool>("burn_in", false);
 }
 
 void CrosshairStage::Configure()
@@ -59,14 +102,85 @@ void CrosshairStage::Configure()
 	if (!stream_ || stream_->configuration().pixelFormat != libcamera::formats::YUV420)
 		throw std::runtime_error("CrosshairStage: only YUV420 format supported");
 	info_ = app_->GetStreamInfo(stream_);
+
+	if (!use_gpu_ || !burn_in_)
+		return;
+#if GPU_COMPUTE_PRESENT
+	try
+	{
+		gpu_ = GpuCompute::Get();
+	}
+	catch (std::exception const &e)
+	{
+		LOG_ERROR("WARNING: CrosshairStage: GPU unavailable (" << e.what() << "), using the CPU");
+	}
+#else
+	LOG_ERROR("WARNING: CrosshairStage: built without GPU support, using the CPU");
+#endif
+}
+
+void CrosshairStage::Teardown()
+{
+#if GPU_COMPUTE_PRESENT
+	if (gpu_)
+		gpu_->ReleaseImages();
+	gpu_.reset();
+#endif
 }
 
+#if GPU_COMPUTE_PRESENT
+bool CrosshairStage::processGpu(CompletedRequestPtr &completed_request)
+{
+	// The same lines as the CPU draws, as rectangles of the same thickness, clipped to the image.
+	int cx = info_.width / 2, cy = info_.height / 2, t = 2;
+	int lines[8] = { cx - 300 - t / 2, cy - t / 2, cx + 300 + t / 2 + 1, cy + t / 2 + 1,
+					 cx - t / 2, cy - 300 - t / 2, cx + t / 2 + 1, cy + 300 + t / 2 + 1 };
+	for (int i = 0; i < 8; i += 2)
+	{
+		lines[i] = std::clamp(lines[i], 0, (int)info_.width);
+		lines[i + 1] = std::clamp(lines[i + 1], 0, (int)info_.height);
+	}
+	int x0 = std::min(lines[0], lines[4]) / 4, y0 = std::min(lines[1], lines[5]);
+	int x1 = (std::max(lines[2], lines[6]) + 3) / 4, y1 = std::max(lines[3], lines[7]);
+
+	libcamera::FrameBuffer *buffer = completed_request->buffers[stream_];
+	BufferDeviceSync sync(app_, buffer);
+	gpu_->Run([&]() {
+		GpuCompute::Image image = gpu_->Import(buffer, info_);
+		GLuint program = gpu_->Program("crosshair", CROSSHAIR_SHADER);
+		glUseProgram(program);
+		glUniform2i(glGetUniformLocation(program, "origin"), x0, y0);
+		glUniform2i(glGetUniformLocation(program, "size"), x1 - x0, y1 - y0);
+		glUniform4iv(glGetUniformLocation(program, "lines"), 2, lines);
+		glBindImageTexture(0, image.texture, 0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA8);
+		glBindImageTexture(1, image.texture, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA8);
+		GpuCompute::Dispatch(x1 - x0, y1 - y0);
+	});
+
+	return false;
+}
+#endif
+
 
 bool CrosshairStage::Process(CompletedRequestPtr &completed_request)
 {
 	if (!stream_)
 		return false;
 
+	if (!burn_in_)
+	{
+		int cx = info_.width / 2, cy = info_.height / 2;
+		completed_request->overlay.Add(info_.width, info_.height,
+									   { { OverlayItem::Shape::Line, cx - 300, cy, cx + 300, cy, 2 },
+										 { OverlayItem::Shape::Line, cx, cy - 300, cx, cy + 300, 2 } });
+		return false;
+	}
+
+#if GPU_COMPUTE_PRESENT
+	if (gpu_)
+		return processGpu(completed_request);
+#endif
+
 	BufferWriteSync w(app_, completed_request->buffers[stream_]);
 	libcamera::Span<uint8_t> buffer = w.Get()[0];
 	uint32_t *ptr = (uint32_t *)buffer.data();
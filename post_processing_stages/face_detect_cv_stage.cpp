@@ -7,10 +7,13 @@
 
 #include <algorithm>
 #include <chrono>
+#include <condition_variable>
 #include <iostream>
 #include <iterator>
 #include <libcamera/stream.h>
 #include <memory>
+#include <mutex>
+#include <thread>
 #include <vector>
 
 #include <libcamera/geometry.h>
@@ -37,22 +40,40 @@ public:
 
 	void Configure() override;
 
+	void Start() override;
+
 	bool Process(CompletedRequestPtr &completed_request) override;
 
 	void Stop() override;
 
 private:
-	void detectFeatures(cv::CascadeClassifier &cascade);
+	// The next frame to look for faces in: either the request itself, or a copy of its lores Y plane.
+	struct Input
+	{
+		CompletedRequestPtr request;
+		Mat image;
+		unsigned int sequence = 0;
+	};
+
+	// Part of the image to search, and the range of face sizes to search it for.
+	struct Region
+	{
+		Rect rect;
+		int min_face;
+		int max_face;
+	};
+
+	void detectionThread();
+	void detectFeatures(Input &input);
+	void search(Mat const &image, unsigned int sequence);
+	std::vector<Region> searchRegions() const;
 	void drawFeatures(cv::Mat &img);
 
 	Stream *stream_;
 	StreamInfo low_res_info_;
 	Stream *full_stream_;
 	StreamInfo full_stream_info_;
-	std::unique_ptr<std::future<void>> future_ptr_;
 	std::mutex face_mutex_;
-	std::mutex future_ptr_mutex_;
-	Mat image_;
 	std::vector<cv::Rect> faces_;
 	CascadeClassifier cascade_;
 	std::string cascadeName_;
@@ -62,6 +83,27 @@ private:
 	int max_size_;
 	int refresh_rate_;
 	int draw_features_;
+	bool hold_request_;
+	unsigned int full_scan_interval_;
+	double full_scan_scaling_factor_;
+	double roi_margin_;
+	bool verbose_;
+
+	// Inputs are double buffered, as in the TfStage. Process() fills in the pending one, replacing a frame that
+	// hasn't been started on yet, while the detection thread works on the other.
+	std::mutex input_mutex_;
+	std::condition_variable input_cond_;
+	Input inputs_[2];
+	bool have_pending_ = false;
+	bool abort_ = false;
+	std::thread thread_;
+
+	// Only the detection thread touches these. Faces are kept here in lores coordinates, for the next search.
+	std::vector<Rect> lores_faces_;
+	bool have_full_scan_ = false;
+	bool full_scan_ = false;
+	unsigned int last_full_scan_ = 0;
+	Mat equalized_;
 };
 
 #define NAME "face_detect_cv"
@@ -83,6 +125,18 @@ void FaceDetectCvStage::Read(boost::property_tree::ptree const &params)
 	max_size_ = params.get<int>("max_size", 256);
 	refresh_rate_ = params.get<int>("refresh_rate", 5);
 	draw_features_ = params.get<int>("draw_features", 1);
+	// Look for faces in the request's own buffer, rather than a copy of it. This ties up one camera buffer while
+	// each detection runs.
+	hold_request_ = params.get<int>("hold_request", 0);
+	// When non-zero, the whole image is only searched every full_scan_interval frames. The detections in between
+	// search just around the faces last found, expanded by roi_margin times their size, and for faces of about the
+	// same size.
+	full_scan_interval_ = params.get<unsigned int>("full_scan_interval", 0);
+	full_scan_scaling_factor_ = params.get<double>("full_scan_scaling_factor", scaling_factor_);
+	roi_margin_ = params.get<double>("roi_margin", 0.5);
+	verbose_ = params.get<int>("verbose", 0);
+	if (scaling_factor_ <= 1.0 || full_scan_scaling_factor_ <= 1.0)
+		throw std::runtime_error("FaceDetectCvStage: scaling factors must be greater than 1");
 }
 
 void FaceDetectCvStage::Configure()
@@ -110,25 +164,38 @@ void FaceDetectCvStage::Configure()
 		throw std::runtime_error("FaceDetectCvStage: drawing only supported for YUV420 images");
 }
 
+void FaceDetectCvStage::Start()
+{
+	abort_ = false;
+	have_pending_ = false;
+	have_full_scan_ = false;
+	lores_faces_.clear();
+	thread_ = std::thread(&FaceDetectCvStage::detectionThread, this);
+}
+
 bool FaceDetectCvStage::Process(CompletedRequestPtr &completed_request)
 {
 	if (!stream_)
 		return false;
 
+	if (completed_request->sequence % refresh_rate_ == 0)
 	{
-		std::unique_lock<std::mutex> lck(future_ptr_mutex_);
-		if (completed_request->sequence % refresh_rate_ == 0 &&
-			(!future_ptr_ || future_ptr_->wait_for(std::chrono::seconds(0)) == std::future_status::ready))
+		std::unique_lock<std::mutex> lock(input_mutex_);
+		Input &pending = inputs_[0];
+		if (hold_request_)
+			pending.request = completed_request;
+		else
 		{
+			// The pending image keeps its allocation from one frame to the next.
 			BufferReadSync r(app_, completed_request->buffers[stream_]);
 			libcamera::Span<uint8_t> buffer = r.Get()[0];
 			uint8_t *ptr = (uint8_t *)buffer.data();
 			Mat image(low_res_info_.height, low_res_info_.width, CV_8U, ptr, low_res_info_.stride);
-			image_ = image.clone();
-
-			future_ptr_ = std::make_unique<std::future<void>>();
-			*future_ptr_ = std::async(std::launch::async, [this] { detectFeatures(cascade_); });
+			image.copyTo(pending.image);
 		}
+		pending.sequence = completed_request->sequence;
+		have_pending_ = true;
+		input_cond_.notify_one();
 	}
 
 	std::unique_lock<std::mutex> lock(face_mutex_);
@@ -150,13 +217,78 @@ bool FaceDetectCvStage::Process(CompletedRequestPtr &completed_request)
 	return false;
 }
 
-void FaceDetectCvStage::detectFeatures(CascadeClassifier &cascade)
+void FaceDetectCvStage::detectionThread()
 {
-	equalizeHist(image_, image_);
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(input_mutex_);
+			input_cond_.wait(lock, [this] { return abort_ || have_pending_; });
+			if (abort_)
+				return;
+			std::swap(inputs_[0], inputs_[1]);
+			have_pending_ = false;
+		}
 
+		try
+		{
+			auto time_taken = ExecutionTime<std::micro>(&FaceDetectCvStage::detectFeatures, this, inputs_[1]).count();
+			if (verbose_)
+				LOG(1, "FaceDetectCvStage: " << (full_scan_ ? "full scan" : "tracking") << " time: " << time_taken
+											 << " us, " << lores_faces_.size() << " faces");
+		}
+		catch (std::exception const &e)
+		{
+			LOG_ERROR("ERROR: " << e.what());
+		}
+		// Let go of the camera buffer as soon as we're finished with it.
+		inputs_[1].request.reset();
+	}
+}
+
+void FaceDetectCvStage::detectFeatures(Input &input)
+{
+	if (input.request)
+	{
+		BufferReadSync r(app_, input.request->buffers[stream_]);
+		libcamera::Span<uint8_t> buffer = r.Get()[0];
+		uint8_t *ptr = (uint8_t *)buffer.data();
+		Mat image(low_res_info_.height, low_res_info_.width, CV_8U, ptr, low_res_info_.stride);
+		search(image, input.sequence);
+	}
+	else
+		search(input.image, input.sequence);
+}
+
+void FaceDetectCvStage::search(Mat const &image, unsigned int sequence)
+{
 	std::vector<Rect> temp_faces;
-	cascade.detectMultiScale(image_, temp_faces, scaling_factor_, min_neighbors_, CASCADE_SCALE_IMAGE,
-							 Size(min_size_, min_size_), Size(max_size_, max_size_));
+
+	full_scan_ = !full_scan_interval_ || !have_full_scan_ || sequence - last_full_scan_ >= full_scan_interval_;
+	if (full_scan_)
+	{
+		// The camera's buffer is never written to; the equalised image goes in a buffer of our own.
+		equalizeHist(image, equalized_);
+		cascade_.detectMultiScale(equalized_, temp_faces, full_scan_scaling_factor_, min_neighbors_,
+								  CASCADE_SCALE_IMAGE, Size(min_size_, min_size_), Size(max_size_, max_size_));
+		have_full_scan_ = true;
+		last_full_scan_ = sequence;
+	}
+	else
+	{
+		equalized_.create(image.size(), CV_8U);
+		for (Region const &region : searchRegions())
+		{
+			Mat equalized = equalized_(Rect(0, 0, region.rect.width, region.rect.height));
+			equalizeHist(image(region.rect), equalized);
+			std::vector<Rect> found;
+			cascade_.detectMultiScale(equalized, found, scaling_factor_, min_neighbors_, CASCADE_SCALE_IMAGE,
+									  Size(region.min_face, region.min_face), Size(region.max_face, region.max_face));
+			for (Rect &face : found)
+				temp_faces.push_back(face + region.rect.tl());
+		}
+	}
+	lores_faces_ = temp_faces;
 
 	// Scale faces back to the size and location in the full res image.
 	double scale_x = full_stream_info_.width / (double)low_res_info_.width;
@@ -172,6 +304,52 @@ void FaceDetectCvStage::detectFeatures(CascadeClassifier &cascade)
 	faces_ = std::move(temp_faces);
 }
 
+std::vector<FaceDetectCvStage::Region> FaceDetectCvStage::searchRegions() const
+{
+	Rect bounds(0, 0, low_res_info_.width, low_res_info_.height);
+	std::vector<Region> regions;
+	for (Rect const &face : lores_faces_)
+	{
+		int size = std::max(face.width, face.height);
+		int margin = roi_margin_ * size;
+		Rect rect = Rect(face.x - margin, face.y - margin, face.width + 2 * margin, face.height + 2 * margin) & bounds;
+		regions.push_back({ rect, size, size });
+	}
+
+	// Regions that overlap get merged, so that no part of the image is searched twice. A merged region can overlap
+	// ones that didn't overlap either of its parts, so keep going until nothing changes.
+	for (bool merged = true; merged;)
+	{
+		merged = false;
+		for (unsigned int i = 0; i < regions.size() && !merged; i++)
+		{
+			for (unsigned int j = i + 1; j < regions.size() && !merged; j++)
+			{
+				if ((regions[i].rect & regions[j].rect).area() == 0)
+					continue;
+				regions[i].rect |= regions[j].rect;
+				regions[i].min_face = std::min(regions[i].min_face, regions[j].min_face);
+				regions[i].max_face = std::max(regions[i].max_face, regions[j].max_face);
+				regions.erase(regions.begin() + j);
+				merged = true;
+			}
+		}
+	}
+
+	// Faces are looked for at a scale step or so either side of the sizes they were last seen at.
+	double step = std::max(scaling_factor_, 1.25);
+	for (Region &region : regions)
+	{
+		int limit = std::min(region.rect.width, region.rect.height);
+		region.min_face = std::max<int>(min_size_, region.min_face / step);
+		region.max_face = std::min<int>({ max_size_, (int)(region.max_face * step), limit });
+	}
+	regions.erase(std::remove_if(regions.begin(), regions.end(),
+								 [](Region const &region) { return region.max_face < region.min_face; }),
+				  regions.end());
+	return regions;
+}
+
 void FaceDetectCvStage::drawFeatures(Mat &img)
 {
 	const static Scalar colors[] = {
@@ -202,8 +380,17 @@ void FaceDetectCvStage::drawFeatures(Mat &img)
 
 void FaceDetectCvStage::Stop()
 {
-	if (future_ptr_)
-		future_ptr_->wait();
+	{
+		std::lock_guard<std::mutex> lock(input_mutex_);
+		abort_ = true;
+	}
+	input_cond_.notify_one();
+	if (thread_.joinable())
+		thread_.join();
+	// Don't keep camera buffers past the point where the camera stops.
+	for (Input &input : inputs_)
+		input.request.reset();
+	have_pending_ = false;
 }
 
 static PostProcessingStage *Create(RPiCamApp *app)
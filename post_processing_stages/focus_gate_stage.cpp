@@ -0,0 +1,132 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * focus_gate_stage.cpp - score each frame's sharpness from the focus statistics, and drop the blurred ones
+ */
+
+// The ISP (PiSP or VC4) measures the focus of every frame, and the IPA reports it as the FocusFoM control, so scoring
+// a frame's sharpness here costs nothing, and touches no pixels. A frame is blurred when its FoM is below "threshold",
+// or, with "relative" set, below that fraction of the best FoM of the last "window" frames (which copes with scenes
+// whose FoM is high or low throughout). With "drop" set, blurred frames are dropped before they get to the encoder,
+// so that they are never encoded or stored; otherwise they are only marked.
+
+// Each frame gets the post-processing metadata "focus_gate.fom" (the FoM), "focus_gate.score" (how the FoM compares
+// with the level it must reach, so 1 or more when sharp) and "focus_gate.sharp".
+
+#include <algorithm>
+#include <deque>
+#include <limits>
+#include <mutex>
+
+#include <libcamera/controls.h>
+
+#include "core/rpicam_app.hpp"
+
+#include "post_processing_stages/post_processing_stage.hpp"
+
+class FocusGateStage : public PostProcessingStage
+{
+public:
+	FocusGateStage(RPiCamApp *app) : PostProcessingStage(app) {}
+
+	char const *Name() const override;
+
+	void Read(boost::property_tree::ptree const &params) override;
+
+	void Start() override;
+
+	bool Process(CompletedRequestPtr &completed_request) override;
+
+	void Stop() override;
+
+private:
+	// Parameters.
+	double threshold_;
+	double relative_;
+	unsigned int window_;
+	bool drop_;
+	bool verbose_;
+
+	// Frames are processed several at a time, so the history and the counts are only touched under the lock.
+	std::mutex mutex_;
+	std::deque<int32_t> history_;
+	uint64_t passed_ = 0;
+	uint64_t blurred_ = 0;
+};
+
+#define NAME "focus_gate"
+
+char const *FocusGateStage::Name() const
+{
+	return NAME;
+}
+
+void FocusGateStage::Read(boost::property_tree::ptree const &params)
+{
+	threshold_ = params.get<double>("threshold", 0);
+	relative_ = params.get<double>("relative", 0);
+	window_ = std::max(params.get<unsigned int>("window", 30), 1u);
+	drop_ = params.get<int>("drop", 1);
+	verbose_ = params.get<int>("verbose", 0);
+	if (threshold_ <= 0 && relative_ <= 0)
+		throw std::runtime_error("FocusGateStage: set a threshold or a relative level, or both");
+}
+
+void FocusGateStage::Start()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	history_.clear();
+}
+
+bool FocusGateStage::Process(CompletedRequestPtr &completed_request)
+{
+	auto fom = completed_request->metadata.get(libcamera::controls::FocusFoM);
+	if (!fom)
+		return false; // no statistics, so no grounds to drop anything
+
+	// Scores are scaled so that 1 is just sharp enough, and a frame must pass both tests if both are set.
+	double score = threshold_ > 0 ? *fom / threshold_ : std::numeric_limits<double>::max();
+	bool sharp;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		history_.push_back(*fom);
+		if (history_.size() > window_)
+			history_.pop_front();
+
+		if (relative_ > 0)
+		{
+			int32_t best = *std::max_element(history_.begin(), history_.end());
+			score = std::min(score, best > 0 ? *fom / (best * relative_) : 1.0 / relative_);
+		}
+		sharp = score >= 1;
+		if (sharp)
+			passed_++;
+		else
+			blurred_++;
+	}
+
+	completed_request->post_process_metadata.Set("focus_gate.fom", *fom);
+	completed_request->post_process_metadata.Set("focus_gate.score", (float)score);
+	completed_request->post_process_metadata.Set("focus_gate.sharp", sharp);
+
+	if (verbose_)
+		LOG(1, "FocusGateStage: frame " << completed_request->sequence << " FoM " << *fom << " score " << score
+										<< (sharp ? "" : " blurred"));
+
+	return drop_ && !sharp;
+}
+
+void FocusGateStage::Stop()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	LOG(1, "FocusGateStage: " << passed_ << " frames sharp, " << blurred_ << " blurred"
+							  << (drop_ ? " and dropped" : ""));
+}
+
+static PostProcessingStage *Create(RPiCamApp *app)
+{
+	return new FocusGateStage(app);
+}
+
+static RegisterStage reg(NAME, &Create);
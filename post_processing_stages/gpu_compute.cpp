@@ -0,0 +1,304 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * gpu_compute.cpp - Headless OpenGL ES compute context for post-processing stages.
+ */
+
+#include <stdexcept>
+
+#include <libdrm/drm_fourcc.h>
+
+#include "core/logging.hpp"
+
+#include "post_processing_stages/gpu_compute.hpp"
+
+std::shared_ptr<GpuCompute> GpuCompute::Get()
+{
+	static std::mutex mutex;
+	static std::weak_ptr<GpuCompute> instance;
+
+	std::lock_guard<std::mutex> lock(mutex);
+	std::shared_ptr<GpuCompute> gpu = instance.lock();
+	if (!gpu)
+	{
+		gpu = std::shared_ptr<GpuCompute>(new GpuCompute());
+		instance = gpu;
+	}
+	return gpu;
+}
+
+GpuCompute::GpuCompute() : abort_(false), display_(EGL_NO_DISPLAY), context_(EGL_NO_CONTEXT)
+{
+	thread_ = std::thread(&GpuCompute::glThread, this);
+	try
+	{
+		Run([this]() { init(); });
+	}
+	catch (std::exception const &)
+	{
+		Run([this]() { cleanup(); });
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			abort_ = true;
+		}
+		cond_.notify_one();
+		thread_.join();
+		throw;
+	}
+}
+
+GpuCompute::~GpuCompute()
+{
+	Run([this]() { cleanup(); });
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+	}
+	cond_.notify_one();
+	thread_.join();
+}
+
+void GpuCompute::Run(std::function<void()> const &fn)
+{
+	std::packaged_task<void()> job([this, &fn]() {
+		fn();
+		// Make sure the results are in memory before anyone else (the encoder, say) looks at the buffer.
+		if (context_ != EGL_NO_CONTEXT)
+		{
+			glMemoryBarrier(GL_ALL_BARRIER_BITS);
+			glFinish();
+		}
+	});
+	std::future<void> done = job.get_future();
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		jobs_.push_back(std::move(job));
+	}
+	cond_.notify_one();
+	done.get();
+}
+
+void GpuCompute::ReleaseImages()
+{
+	Run([this]() { releaseImages(); });
+}
+
+void GpuCompute::glThread()
+{
+	while (true)
+	{
+		std::packaged_task<void()> job;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			cond_.wait(lock, [this] { return abort_ || !jobs_.empty(); });
+			if (jobs_.empty())
+				return;
+			job = std::move(jobs_.front());
+			jobs_.pop_front();
+		}
+		job();
+	}
+}
+
+void GpuCompute::init()
+{
+	// We have no window system, so we want Mesa's surfaceless platform, and a context with no surface at all.
+	if (epoxy_has_egl_extension(EGL_NO_DISPLAY, "EGL_MESA_platform_surfaceless"))
+		display_ = eglGetPlatformDisplayEXT(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+	else
+		display_ = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	if (display_ == EGL_NO_DISPLAY)
+		throw std::runtime_error("GpuCompute: no EGL display");
+
+	EGLint major, minor;
+	if (!eglInitialize(display_, &major, &minor))
+	{
+		display_ = EGL_NO_DISPLAY;
+		throw std::runtime_error("GpuCompute: eglInitialize() failed");
+	}
+
+	for (char const *ext : { "EGL_KHR_surfaceless_context", "EGL_KHR_no_config_context",
+							 "EGL_EXT_image_dma_buf_import" })
+	{
+		if (!epoxy_has_egl_extension(display_, ext))
+			throw std::runtime_error("GpuCompute: " + std::string(ext) + " not supported");
+	}
+
+	eglBindAPI(EGL_OPENGL_ES_API);
+	static const EGLint ctx_attribs[] = { EGL_CONTEXT_MAJOR_VERSION, 3, EGL_CONTEXT_MINOR_VERSION, 1, EGL_NONE };
+	context_ = eglCreateContext(display_, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, ctx_attribs);
+	if (context_ == EGL_NO_CONTEXT)
+		throw std::runtime_error("GpuCompute: failed to create an OpenGL ES 3.1 context");
+	if (!eglMakeCurrent(display_, EGL_NO_SURFACE, EGL_NO_SURFACE, context_))
+		throw std::runtime_error("GpuCompute: eglMakeCurrent failed");
+
+	// This lets us give imported buffers the immutable storage that image load/store needs.
+	if (!epoxy_has_gl_extension("GL_EXT_EGL_image_storage"))
+		throw std::runtime_error("GpuCompute: GL_EXT_EGL_image_storage not supported");
+
+	LOG(1, "GpuCompute: EGL " << major << "." << minor << ", " << (char const *)glGetString(GL_RENDERER));
+}
+
+void GpuCompute::cleanup()
+{
+	if (context_ != EGL_NO_CONTEXT)
+	{
+		releaseImages();
+		for (auto const &[name, texture] : textures_)
+			glDeleteTextures(1, &texture.texture);
+		textures_.clear();
+		for (auto const &[name, program] : programs_)
+			glDeleteProgram(program);
+		programs_.clear();
+
+		eglMakeCurrent(display_, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+		eglDestroyContext(display_, context_);
+		context_ = EGL_NO_CONTEXT;
+	}
+	if (display_ != EGL_NO_DISPLAY)
+	{
+		eglTerminate(display_);
+		display_ = EGL_NO_DISPLAY;
+	}
+}
+
+void GpuCompute::releaseImages()
+{
+	for (auto const &[fd, image] : images_)
+		glDeleteTextures(1, &image.texture);
+	images_.clear();
+}
+
+GLuint GpuCompute::Program(std::string const &name, char const *source)
+{
+	auto it = programs_.find(name);
+	if (it != programs_.end())
+		return it->second;
+
+	GLuint shader = glCreateShader(GL_COMPUTE_SHADER);
+	glShaderSource(shader, 1, &source, nullptr);
+	glCompileShader(shader);
+
+	GLint ok;
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+	if (!ok)
+	{
+		GLint size = 0;
+		glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &size);
+		std::string info(std::max(size, 1), '\0');
+		glGetShaderInfoLog(shader, size, nullptr, info.data());
+		glDeleteShader(shader);
+		throw std::runtime_error("GpuCompute: failed to compile " + name + " shader: " + info);
+	}
+
+	GLuint program = glCreateProgram();
+	glAttachShader(program, shader);
+	glLinkProgram(program);
+	glDeleteShader(shader);
+
+	glGetProgramiv(program, GL_LINK_STATUS, &ok);
+	if (!ok)
+	{
+		GLint size = 0;
+		glGetProgramiv(program, GL_INFO_LOG_LENGTH, &size);
+		std::string info(std::max(size, 1), '\0');
+		glGetProgramInfoLog(program, size, nullptr, info.data());
+		glDeleteProgram(program);
+		throw std::runtime_error("GpuCompute: failed to link " + name + " shader: " + info);
+	}
+
+	programs_[name] = program;
+	return program;
+}
+
+GpuCompute::Image GpuCompute::Import(libcamera::FrameBuffer *buffer, StreamInfo const &info)
+{
+	libcamera::FrameBuffer::Plane const &plane = buffer->planes()[0];
+	int fd = plane.fd.get();
+	unsigned int width = info.stride / 4, height = info.height * 3 / 2;
+
+	auto it = images_.find(fd);
+	if (it != images_.end())
+	{
+		if (it->second.width == width && it->second.height == height)
+			return it->second;
+		glDeleteTextures(1, &it->second.texture);
+		images_.erase(it);
+	}
+
+	// YUV420 strides are always a multiple of 4 bytes, so the whole buffer reads as an rgba8 image.
+	EGLint attribs[] = {
+		EGL_WIDTH, static_cast<EGLint>(width),
+		EGL_HEIGHT, static_cast<EGLint>(height),
+		EGL_LINUX_DRM_FOURCC_EXT, DRM_FORMAT_ABGR8888,
+		EGL_DMA_BUF_PLANE0_FD_EXT, fd,
+		EGL_DMA_BUF_PLANE0_OFFSET_EXT, static_cast<EGLint>(plane.offset),
+		EGL_DMA_BUF_PLANE0_PITCH_EXT, static_cast<EGLint>(info.stride),
+		EGL_NONE
+	};
+	EGLImage egl_image = eglCreateImageKHR(display_, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, attribs);
+	if (!egl_image)
+		throw std::runtime_error("GpuCompute: failed to import fd " + std::to_string(fd));
+
+	Image image = { 0, width, height };
+	glGenTextures(1, &image.texture);
+	glBindTexture(GL_TEXTURE_2D, image.texture);
+	glEGLImageTargetTexStorageEXT(GL_TEXTURE_2D, egl_image, nullptr);
+	eglDestroyImageKHR(display_, egl_image);
+	if (glGetError() != GL_NO_ERROR)
+	{
+		glDeleteTextures(1, &image.texture);
+		throw std::runtime_error("GpuCompute: failed to make texture from fd " + std::to_string(fd));
+	}
+
+	images_[fd] = image;
+	return image;
+}
+
+GLuint GpuCompute::Scratch(std::string const &name, unsigned int width, unsigned int height)
+{
+	Texture &texture = textures_[name];
+	if (texture.texture && texture.width == width && texture.height == height)
+		return texture.texture;
+
+	if (texture.texture)
+		glDeleteTextures(1, &texture.texture);
+	glGenTextures(1, &texture.texture);
+	glBindTexture(GL_TEXTURE_2D, texture.texture);
+	glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, width, height);
+	texture.width = width;
+	texture.height = height;
+	return texture.texture;
+}
+
+GLuint GpuCompute::Upload(std::string const &name, uint8_t const *data, unsigned int width, unsigned int height,
+						  unsigned int stride)
+{
+	Texture &texture = textures_[name];
+	if (!texture.texture)
+	{
+		glGenTextures(1, &texture.texture);
+		glBindTexture(GL_TEXTURE_2D, texture.texture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	}
+	else
+		glBindTexture(GL_TEXTURE_2D, texture.texture);
+
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, stride);
+	if (texture.width == width && texture.height == height)
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RED, GL_UNSIGNED_BYTE, data);
+	else
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, width, height, 0, GL_RED, GL_UNSIGNED_BYTE, data);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	texture.width = width;
+	texture.height = height;
+	return texture.texture;
+}
+
+void GpuCompute::Dispatch(unsigned int width, unsigned int height)
+{
+	glDispatchCompute((width + GROUP_SIZE - 1) / GROUP_SIZE, (height + GROUP_SIZE - 1) / GROUP_SIZE, 1);
+}
@@ -0,0 +1,101 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * gpu_compute.hpp - Headless OpenGL ES compute context for post-processing stages.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <libcamera/framebuffer.h>
+
+#include "core/stream_info.hpp"
+
+// We never want the X11 headers, which #define things that upset libcamera.
+#define EGL_NO_X11
+#include <epoxy/egl.h>
+#include <epoxy/gl.h>
+
+// A headless OpenGL ES 3.1 context for running compute shaders on the GPU (the V3D on a Pi), shared by all the
+// stages that use it. Image buffers are imported straight from their dmabufs, so nothing gets copied and the CPU
+// never touches the pixels. A GL context belongs to a single thread, so all GL work happens on a thread of our own,
+// and stages hand it over with Run().
+class GpuCompute
+{
+public:
+	// A YUV420 buffer as the GPU sees it: the whole buffer as rows of "stride" bytes, each texel holding 4
+	// consecutive bytes in its r, g, b and a components (rgba8). So the Y plane is the first "height" rows, and the
+	// U and V planes are the height / 2 rows after, each row holding two rows of chroma.
+	struct Image
+	{
+		GLuint texture;
+		unsigned int width; // in texels, so stride / 4
+		unsigned int height; // in rows, so height * 3 / 2
+	};
+
+	// The local work group size that all our compute shaders use.
+	static constexpr unsigned int GROUP_SIZE = 8;
+
+	// The shared instance, made if there isn't one already. Throws if there's no GPU that we can use.
+	static std::shared_ptr<GpuCompute> Get();
+
+	~GpuCompute();
+
+	// Run fn on the GL thread, and wait for both it and all the GPU work it queued to finish. Exceptions thrown
+	// by fn are rethrown here.
+	void Run(std::function<void()> const &fn);
+
+	// Forget all the imported buffers, for when the camera's buffers are about to be freed. Any thread may call this.
+	void ReleaseImages();
+
+	// Everything from here on may only be called from within Run().
+
+	// Compile and link a compute shader, only once, remembering it under the given name.
+	GLuint Program(std::string const &name, char const *source);
+	// Import the buffer for image load/store, only once, remembering it by its fd.
+	Image Import(libcamera::FrameBuffer *buffer, StreamInfo const &info);
+	// An rgba8 scratch texture of the given size, remembered under the given name and remade if the size changes.
+	GLuint Scratch(std::string const &name, unsigned int width, unsigned int height);
+	// Upload a one byte per pixel image to an r8 texture for sampling, remembered under the given name.
+	GLuint Upload(std::string const &name, uint8_t const *data, unsigned int width, unsigned int height,
+				  unsigned int stride);
+	// Dispatch enough work groups to cover width x height invocations.
+	static void Dispatch(unsigned int width, unsigned int height);
+
+private:
+	struct Texture
+	{
+		GLuint texture;
+		unsigned int width;
+		unsigned int height;
+	};
+
+	GpuCompute();
+	void glThread();
+	void init();
+	void cleanup();
+	void releaseImages();
+
+	std::thread thread_;
+	std::mutex mutex_;
+	std::condition_variable cond_;
+	std::deque<std::packaged_task<void()>> jobs_;
+	bool abort_;
+
+	// Only touched on the GL thread.
+	EGLDisplay display_;
+	EGLContext context_;
+	std::map<std::string, GLuint> programs_;
+	std::map<int, Image> images_;
+	std::map<std::string, Texture> textures_;
+};
@@ -17,6 +17,7 @@
 #include "classification/classification.hpp"
 
 #include "core/rpicam_app.hpp"
+#include "post_processing_stages/object_detect.hpp"
 
 #include "hailo_postprocessing_stage.hpp"
 
@@ -40,13 +41,20 @@ public:
 	bool Process(CompletedRequestPtr &completed_request) override;
 
 private:
-	std::vector<HailoClassificationPtr> runInference(uint8_t *frame);
+	std::vector<HailoClassificationPtr> runInference(const uint8_t *frame);
+	std::vector<HailoClassificationPtr> interpretResults(hailort::AsyncInferJob &job,
+														  std::vector<OutTensor> &output_tensors);
+	void classifyRois(CompletedRequestPtr &completed_request, const uint8_t *image, unsigned int stride,
+					  const std::vector<Detection> &rois);
 
 	PostProcessingLib postproc_;
 
 	// Config params
 	float threshold_;
 	bool do_softmax_;
+	// Classify the objects found by an earlier stage, rather than the whole image.
+	std::string roi_results_;
+	unsigned int max_rois_;
 };
 
 HailoClassifier::HailoClassifier(RPiCamApp *app)
@@ -63,6 +71,8 @@ void HailoClassifier::Read(boost::property_tree::ptree const &params)
 {
 	threshold_ = params.get<float>("threshold", 0.5f);
 	do_softmax_ = params.get<bool>("do_softmax", true);
+	roi_results_ = params.get<std::string>("roi_results", "");
+	max_rois_ = params.get<unsigned int>("max_rois", 4);
 
 	HailoPostProcessingStage::Read(params);
 }
@@ -83,7 +93,33 @@ bool HailoClassifier::Process(CompletedRequestPtr &completed_request)
 	BufferReadSync r(app_, completed_request->buffers[low_res_stream_]);
 	libcamera::Span<uint8_t> buffer = r.Get()[0];
 	std::shared_ptr<uint8_t> input;
-	uint8_t *input_ptr;
+	const uint8_t *input_ptr;
+
+	if (!roi_results_.empty())
+	{
+		std::vector<Detection> rois;
+		if (completed_request->post_process_metadata.Get(roi_results_, rois) || rois.empty())
+			return false;
+
+		if (low_res_info_.pixel_format == libcamera::formats::YUV420)
+		{
+			// The crops come out of the whole low res image in RGB. A detector running on the same image will
+			// already have made this conversion.
+			StreamInfo rgb_info;
+			rgb_info.width = low_res_info_.width;
+			rgb_info.height = low_res_info_.height;
+			rgb_info.stride = rgb_info.width * 3;
+			const uint8_t *rgb = GetRgbImage(completed_request, low_res_stream_, low_res_info_, rgb_info).data();
+			classifyRois(completed_request, rgb, rgb_info.stride, rois);
+		}
+		else if (low_res_info_.pixel_format == libcamera::formats::RGB888 ||
+				 low_res_info_.pixel_format == libcamera::formats::BGR888)
+			classifyRois(completed_request, buffer.data(), low_res_info_.stride, rois);
+		else
+			LOG_ERROR("Unexpected lores format " << low_res_info_.pixel_format);
+
+		return false;
+	}
 
 	if (low_res_info_.pixel_format == libcamera::formats::YUV420)
 	{
@@ -92,10 +128,8 @@ bool HailoClassifier::Process(CompletedRequestPtr &completed_request)
 		rgb_info.height = InputTensorSize().height;
 		rgb_info.stride = rgb_info.width * 3;
 
-		input = allocator_.Allocate(rgb_info.stride * rgb_info.height);
-		input_ptr = input.get();
-
-		Yuv420ToRgb(input.get(), buffer.data(), low_res_info_, rgb_info);
+		// Converted once per frame, and shared with any other stage that wants the same image.
+		input_ptr = GetRgbImage(completed_request, low_res_stream_, low_res_info_, rgb_info).data();
 	}
 	else if (low_res_info_.pixel_format == libcamera::formats::RGB888 ||
 			 low_res_info_.pixel_format == libcamera::formats::BGR888)
@@ -110,7 +144,7 @@ bool HailoClassifier::Process(CompletedRequestPtr &completed_request)
 			input_ptr = input.get();
 
 			for (unsigned int i = 0; i < low_res_info_.height; i++)
-				memcpy(input_ptr + i * stride, buffer.data() + i * low_res_info_.stride, stride);
+				memcpy(input.get() + i * stride, buffer.data() + i * low_res_info_.stride, stride);
 		}
 		else
 			input_ptr = buffer.data();
@@ -131,7 +165,7 @@ bool HailoClassifier::Process(CompletedRequestPtr &completed_request)
 	return false;
 }
 
-std::vector<HailoClassificationPtr> HailoClassifier::runInference(uint8_t *frame)
+std::vector<HailoClassificationPtr> HailoClassifier::runInference(const uint8_t *frame)
 {
 	hailort::AsyncInferJob job;
 	std::vector<OutTensor> output_tensors;
@@ -141,8 +175,14 @@ std::vector<HailoClassificationPtr> HailoClassifier::runInference(uint8_t *frame
 	if (status != HAILO_SUCCESS)
 		return {};
 
+	return interpretResults(job, output_tensors);
+}
+
+std::vector<HailoClassificationPtr> HailoClassifier::interpretResults(hailort::AsyncInferJob &job,
+																	   std::vector<OutTensor> &output_tensors)
+{
 	// Wait for job completion.
-	status = job.wait(1s);
+	hailo_status status = job.wait(1s);
 	if (status != HAILO_SUCCESS)
 	{
 		LOG_ERROR("Failed to wait for inference to finish, status = " << status);
@@ -161,6 +201,79 @@ std::vector<HailoClassificationPtr> HailoClassifier::runInference(uint8_t *frame
 	return detections;
 }
 
+void HailoClassifier::classifyRois(CompletedRequestPtr &completed_request, const uint8_t *image, unsigned int stride,
+								   const std::vector<Detection> &rois)
+{
+	const Size &tensor_size = InputTensorSize();
+	struct Job
+	{
+		const Detection *roi;
+		std::shared_ptr<uint8_t> input;
+		hailort::AsyncInferJob job;
+		std::vector<OutTensor> output_tensors;
+	};
+	std::vector<Job> jobs;
+	jobs.reserve(std::min<size_t>(rois.size(), max_rois_));
+
+	// Dispatch every crop before waiting for any of them, so that they are all on the device together.
+	for (auto const &roi : rois)
+	{
+		if (jobs.size() == max_rois_)
+			break;
+
+		// Detections are in output image co-ordinates, and the crop comes from the low res image.
+		const unsigned int x0 = std::max(roi.box.x, 0) * low_res_info_.width / output_stream_info_.width;
+		const unsigned int y0 = std::max(roi.box.y, 0) * low_res_info_.height / output_stream_info_.height;
+		const unsigned int x1 = std::min<unsigned int>((roi.box.x + roi.box.width) * low_res_info_.width /
+														   output_stream_info_.width, low_res_info_.width);
+		const unsigned int y1 = std::min<unsigned int>((roi.box.y + roi.box.height) * low_res_info_.height /
+														   output_stream_info_.height, low_res_info_.height);
+		if (x1 <= x0 || y1 <= y0)
+			continue;
+
+		Job job { &roi, allocator_.Allocate(tensor_size.width * tensor_size.height * 3), {}, {} };
+		if (!job.input)
+		{
+			LOG_ERROR("Could not allocate an input buffer!");
+			break;
+		}
+
+		// Nearest neighbour scaling of the crop to the size of the input tensor.
+		uint8_t *dst = job.input.get();
+		for (unsigned int j = 0; j < tensor_size.height; j++)
+		{
+			const uint8_t *row = image + (y0 + j * (y1 - y0) / tensor_size.height) * stride;
+			for (unsigned int i = 0; i < tensor_size.width; i++, dst += 3)
+				memcpy(dst, row + (x0 + i * (x1 - x0) / tensor_size.width) * 3, 3);
+		}
+
+		if (HailoPostProcessingStage::DispatchJob(job.input.get(), job.job, job.output_tensors) != HAILO_SUCCESS)
+			break;
+		jobs.push_back(std::move(job));
+	}
+
+	std::vector<Detection> results;
+	std::string text;
+	for (auto &job : jobs)
+	{
+		std::vector<HailoClassificationPtr> classes = interpretResults(job.job, job.output_tensors);
+		if (classes.empty() || classes[0]->get_confidence() < threshold_)
+			continue;
+
+		const libcamera::Rectangle &box = job.roi->box;
+		results.emplace_back(classes[0]->get_class_id(), classes[0]->get_label(), classes[0]->get_confidence(),
+							 box.x, box.y, box.width, box.height);
+		LOG(2, "Result: " << results.back().toString());
+		text += (text.empty() ? "" : ", ") + classes[0]->get_label();
+	}
+
+	if (results.size())
+	{
+		completed_request->post_process_metadata.Set("classifier.results", results);
+		completed_request->post_process_metadata.Set("annotate.text", text);
+	}
+}
+
 static PostProcessingStage *Create(RPiCamApp *app)
 {
 	return new HailoClassifier(app);
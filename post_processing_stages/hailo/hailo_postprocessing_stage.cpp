@@ -6,6 +6,8 @@
  */
 
 #include <algorithm>
+#include <filesystem>
+#include <map>
 #include <mutex>
 #include <string>
 #include <sys/mman.h>
@@ -72,7 +74,11 @@ public:
 
 		if (!_vdevice)
 		{
-			Expected<std::unique_ptr<VDevice>> vdevice_exp = VDevice::create();
+			// Every network goes on this one device, and the model scheduler switches between them as jobs arrive.
+			hailo_vdevice_params_t params;
+			hailo_init_vdevice_params(&params);
+			params.scheduling_algorithm = HAILO_SCHEDULING_ALGORITHM_ROUND_ROBIN;
+			Expected<std::unique_ptr<VDevice>> vdevice_exp = VDevice::create(params);
 			if (!vdevice_exp)
 			{
 				LOG_ERROR("Failed create vdevice, status = " << vdevice_exp.status());
@@ -88,6 +94,51 @@ private:
 	vdevice() {}
 };
 
+// Networks already loaded onto the device, by HEF file, so that stages using the same one share it.
+std::mutex networks_lock;
+std::map<std::string, std::weak_ptr<HailoNetwork>> networks;
+
+hailo_status load_network(VDevice *vdevice, const std::string &hef_file, unsigned int batch_size,
+						  std::shared_ptr<HailoNetwork> &network)
+{
+	std::scoped_lock<std::mutex> l(networks_lock);
+
+	network = networks[hef_file].lock();
+	if (network)
+	{
+		LOG(2, "Sharing the network already loaded from " << hef_file);
+		return HAILO_SUCCESS;
+	}
+
+	// Create infer model from HEF file.
+	Expected<std::shared_ptr<InferModel>> infer_model_exp = vdevice->create_infer_model(hef_file);
+	if (!infer_model_exp)
+	{
+		LOG_ERROR("Failed to create infer model, status = " << infer_model_exp.status());
+		return infer_model_exp.status();
+	}
+	std::shared_ptr<InferModel> infer_model = infer_model_exp.release();
+	infer_model->set_hw_latency_measurement_flags(HAILO_LATENCY_MEASURE);
+	if (batch_size)
+		infer_model->set_batch_size(batch_size);
+
+	// Configure the infer model
+	//infer_model->output()->set_format_type(HAILO_FORMAT_TYPE_FLOAT32);
+	Expected<ConfiguredInferModel> configured_infer_model_exp = infer_model->configure();
+	if (!configured_infer_model_exp)
+	{
+		LOG_ERROR("Failed to create configured infer model, status = " << configured_infer_model_exp.status());
+		return configured_infer_model_exp.status();
+	}
+
+	network = std::make_shared<HailoNetwork>();
+	network->infer_model = std::move(infer_model);
+	network->configured_infer_model = std::make_shared<ConfiguredInferModel>(configured_infer_model_exp.release());
+	networks[hef_file] = network;
+
+	return HAILO_SUCCESS;
+}
+
 } // namespace
 
 
@@ -104,10 +155,12 @@ void Allocator::Reset()
 {
 	std::scoped_lock<std::mutex> l(lock_);
 
-	for (auto &info : alloc_info_)
-		munmap(info.ptr, info.size);
+	for (auto const &[ptr, size] : allocations_)
+		munmap(ptr, size);
 
-	alloc_info_.clear();
+	allocations_.clear();
+	free_.clear();
+	generation_++;
 }
 
 std::shared_ptr<uint8_t> Allocator::Allocate(unsigned int size)
@@ -115,35 +168,32 @@ std::shared_ptr<uint8_t> Allocator::Allocate(unsigned int size)
 	std::scoped_lock<std::mutex> l(lock_);
 	uint8_t *ptr = nullptr;
 
-	auto info = std::find_if(alloc_info_.begin(), alloc_info_.end(),
-							 [size](const AllocInfo &info) { return info.free && info.size == size; });
-	if (info != alloc_info_.end())
+	std::vector<uint8_t *> &free_list = free_[size];
+	if (!free_list.empty())
 	{
-		info->free = false;
-		ptr = info->ptr;
+		ptr = free_list.back();
+		free_list.pop_back();
 	}
-
-	if (!ptr)
+	else
 	{
 		void *addr = mmap(NULL, size, PROT_WRITE | PROT_READ, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
 		if (addr == MAP_FAILED)
 			return {};
 
 		ptr = static_cast<uint8_t *>(addr);
-		alloc_info_.emplace_back(ptr, size, false);
+		allocations_.emplace_back(ptr, size);
 	}
 
-	return std::shared_ptr<uint8_t>(ptr, [this](uint8_t *ptr) { this->free(ptr); });
+	unsigned int generation = generation_;
+	return std::shared_ptr<uint8_t>(ptr, [this, size, generation](uint8_t *ptr) { this->free(ptr, size, generation); });
 }
 
-void Allocator::free(uint8_t *ptr)
+void Allocator::free(uint8_t *ptr, unsigned int size, unsigned int generation)
 {
 	std::scoped_lock<std::mutex> l(lock_);
 
-	auto info =	std::find_if(alloc_info_.begin(), alloc_info_.end(),
-							 [ptr](const AllocInfo &info) { return info.ptr == ptr; });
-	if (info != alloc_info_.end())
-		info->free = true;
+	if (generation == generation_)
+		free_[size].push_back(ptr);
 }
 
 HailoPostProcessingStage::HailoPostProcessingStage(RPiCamApp *app)
@@ -151,10 +201,14 @@ HailoPostProcessingStage::HailoPostProcessingStage(RPiCamApp *app)
 {
 }
 
+HailoNetwork::~HailoNetwork()
+{
+	if (configured_infer_model)
+		configured_infer_model->shutdown();
+}
+
 HailoPostProcessingStage::~HailoPostProcessingStage()
 {
-	if (init_)
-		configured_infer_model_->shutdown();
 }
 
 void HailoPostProcessingStage::Read(boost::property_tree::ptree const &params)
@@ -162,6 +216,15 @@ void HailoPostProcessingStage::Read(boost::property_tree::ptree const &params)
 	hef_file_ = params.get<std::string>("hef_file", "");
 	hef_file_8_ = params.get<std::string>("hef_file_8", "");
 	hef_file_8L_ = params.get<std::string>("hef_file_8L", "");
+	// Larger batches give better throughput, but the device only gets a full batch when there are as many frames
+	// in flight, so there need to be at least this many post-processing threads.
+	batch_size_ = params.get<unsigned int>("batch_size", 0);
+	// How the model scheduler shares the device between this network and any others. Zero leaves HailoRT's
+	// defaults alone. A higher priority network's jobs are run first, a threshold makes the scheduler wait for that
+	// many frames before switching to this network, and the timeout bounds how long it waits for them.
+	scheduler_priority_ = params.get<unsigned int>("scheduler_priority", 0);
+	scheduler_threshold_ = params.get<unsigned int>("scheduler_threshold", 0);
+	scheduler_timeout_ms_ = params.get<unsigned int>("scheduler_timeout_ms", 0);
 }
 
 void HailoPostProcessingStage::Configure()
@@ -184,6 +247,32 @@ void HailoPostProcessingStage::Configure()
 	last_frame_ = {};
 }
 
+void HailoPostProcessingStage::Start()
+{
+	latency_.Reset();
+	frames_ = 0;
+	max_in_flight_ = 0;
+	stats_start_ = std::chrono::steady_clock::now();
+}
+
+void HailoPostProcessingStage::Stop()
+{
+	reportStats();
+}
+
+void HailoPostProcessingStage::reportStats()
+{
+	uint64_t frames = frames_;
+	if (!frames)
+		return;
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - stats_start_).count();
+	LOG(1, Name() << ": " << network_name_ << ": " << frames << " frames in " << seconds << "s ("
+				  << frames / seconds << " fps), inference latency p50 " << latency_.Percentile(0.5) / 1000.0
+				  << "ms p99 " << latency_.Percentile(0.99) / 1000.0 << "ms, up to " << max_in_flight_
+				  << " frames in flight");
+}
+
 int HailoPostProcessingStage::configureHailoRT()
 {
 	vdevice_ = vdevice::get_instance();
@@ -211,26 +300,24 @@ int HailoPostProcessingStage::configureHailoRT()
 		return -1;
 	}
 
-	// Create infer model from HEF file.
-	Expected<std::shared_ptr<InferModel>> infer_model_exp = vdevice_->create_infer_model(hef_file);
-	if (!infer_model_exp)
-	{
-		LOG_ERROR("Failed to create infer model, status = " << infer_model_exp.status());
-		return infer_model_exp.status();
-	}
-	infer_model_ = infer_model_exp.release();
-	infer_model_->set_hw_latency_measurement_flags(HAILO_LATENCY_MEASURE);
-
-	// Configure the infer model
-	//infer_model_->output()->set_format_type(HAILO_FORMAT_TYPE_FLOAT32);
-	Expected<ConfiguredInferModel> configured_infer_model_exp = infer_model_->configure();
-	if (!configured_infer_model_exp)
-	{
-		LOG_ERROR("Failed to create configured infer model, status = " << configured_infer_model_exp.status());
-		return configured_infer_model_exp.status();
-	}
-	configured_infer_model_ = std::make_shared<ConfiguredInferModel>(configured_infer_model_exp.release());
-
+	std::shared_ptr<HailoNetwork> network;
+	hailo_status status = load_network(vdevice_, hef_file, batch_size_, network);
+	if (status != HAILO_SUCCESS)
+		return status;
+	network_ = network;
+	infer_model_ = network->infer_model;
+	configured_infer_model_ = network->configured_infer_model;
+	network_name_ = std::filesystem::path(hef_file).filename();
+
+	if (scheduler_priority_ && configured_infer_model_->set_scheduler_priority(scheduler_priority_) != HAILO_SUCCESS)
+		LOG_ERROR("Failed to set scheduler priority for " << network_name_);
+	if (scheduler_threshold_ && configured_infer_model_->set_scheduler_threshold(scheduler_threshold_) != HAILO_SUCCESS)
+		LOG_ERROR("Failed to set scheduler threshold for " << network_name_);
+	if (scheduler_timeout_ms_ &&
+		configured_infer_model_->set_scheduler_timeout(std::chrono::milliseconds(scheduler_timeout_ms_)) != HAILO_SUCCESS)
+		LOG_ERROR("Failed to set scheduler timeout for " << network_name_);
+
+	// Each stage has its own bindings, even on a shared network.
 	// Create infer bindings
 	Expected<ConfiguredInferModel::Bindings> bindings_exp = configured_infer_model_->create_bindings();
 	if (!bindings_exp)
@@ -240,6 +327,10 @@ int HailoPostProcessingStage::configureHailoRT()
 	}
 	bindings_ = std::move(bindings_exp.release());
 
+	Expected<size_t> queue_size = configured_infer_model_->get_async_queue_size();
+	if (queue_size)
+		LOG(2, network_name_ << ": up to " << queue_size.value() << " jobs queued on the device");
+
 	hailo_3d_image_shape_t shape = infer_model_->inputs()[0].shape();
 	input_tensor_size_ = libcamera::Size(shape.width, shape.height);
 
@@ -272,7 +363,7 @@ hailo_status HailoPostProcessingStage::DispatchJob(const uint8_t *input, AsyncIn
 		if (!output_buffer)
 		{
 			LOG_ERROR("Could not allocate an output buffer!");
-			return status;
+			return HAILO_OUT_OF_HOST_MEMORY;
 		}
 
 		status = bindings_.output(output_name)->set_buffer(MemoryView(output_buffer.get(), output_size));
@@ -288,6 +379,9 @@ hailo_status HailoPostProcessingStage::DispatchJob(const uint8_t *input, AsyncIn
 		output_tensors.emplace_back(std::move(output_buffer), output_name, quant[0], shape, format);
 	}
 
+	// Other stages may be submitting to the same network.
+	std::scoped_lock<std::mutex> network_lock(network_->lock);
+
 	// Waiting for available requests in the pipeline.
 	status = configured_infer_model_->wait_for_async_ready(1s);
 	if (status != HAILO_SUCCESS)
@@ -312,12 +406,23 @@ hailo_status HailoPostProcessingStage::DispatchJob(const uint8_t *input, AsyncIn
 
 	last_frame_ = this_frame;
 
-	// Dispatch the job.
-	Expected<AsyncInferJob> job_exp = configured_infer_model_->run_async(bindings_);
+	// Dispatch the job. Other frames may be dispatched while this one runs, up to the device's queue size.
+	max_in_flight_ = std::max(max_in_flight_, ++in_flight_);
+	Expected<AsyncInferJob> job_exp = configured_infer_model_->run_async(
+		bindings_, [this, dispatched = this_frame](const AsyncInferCompletionInfo &info) {
+			if (info.status == HAILO_SUCCESS)
+			{
+				auto latency = std::chrono::steady_clock::now() - dispatched;
+				latency_.Add(std::chrono::duration_cast<std::chrono::microseconds>(latency).count());
+				frames_++;
+			}
+			in_flight_--;
+		});
 	if (!job_exp)
 	{
+		in_flight_--;
 		LOG_ERROR("Failed to start async infer job, status = " << job_exp.status());
-		return status;
+		return job_exp.status();
 	}
 	job = job_exp.release();
 
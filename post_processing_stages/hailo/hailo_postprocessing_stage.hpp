@@ -7,12 +7,16 @@
 
 #pragma once
 
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
 #include <deque>
 #include <memory>
 #include <mutex>
+#include <set>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include <libcamera/geometry.h>
@@ -20,11 +24,14 @@
 #include <hailo/hailort.hpp>
 #include "hailo_objects.hpp"
 
+#include "core/latency_histogram.hpp"
 #include "core/rpicam_app.hpp"
 #include "post_processing_stages/post_processing_stage.hpp"
 
 #include "hailo_postproc_lib.h"
 
+// Hands out mmap'd tensor buffers, which go back on a free list of their size when the last reference is dropped.
+// Taking a buffer or returning one costs the same however many there are.
 class Allocator
 {
 public:
@@ -36,22 +43,61 @@ public:
 	std::shared_ptr<uint8_t> Allocate(unsigned int size);
 
 private:
-	void free(uint8_t *ptr);
+	void free(uint8_t *ptr, unsigned int size, unsigned int generation);
 
-	struct AllocInfo
-	{
-		AllocInfo(uint8_t *_ptr, unsigned int _size, bool _free)
-			: ptr(_ptr), size(_size), free(_free)
-		{
-		}
+	std::unordered_map<unsigned int, std::vector<uint8_t *>> free_;
+	std::vector<std::pair<uint8_t *, unsigned int>> allocations_;
+	// Buffers still held across a Reset() must not find their way onto the new free lists.
+	unsigned int generation_ = 0;
+	std::mutex lock_;
+};
 
-		uint8_t *ptr;
-		unsigned int size;
-		bool free;
+// Process() may run for several frames at once, so that the accelerator has more than one frame to work on. Stages
+// that carry state from one frame to the next use this to apply their results in sequence order. Only frames that
+// have entered are waited for, so a frame that never reaches the stage holds up nothing.
+class ResultOrder
+{
+public:
+	class Ticket
+	{
+	public:
+		Ticket(ResultOrder *order, unsigned int sequence) : order_(order), sequence_(sequence) {}
+		Ticket(Ticket const &) = delete;
+		void operator=(Ticket const &) = delete;
+		~Ticket() { order_->leave(sequence_); }
+
+		// Wait until every earlier frame that entered has finished.
+		void WaitTurn() { order_->waitTurn(sequence_); }
+
+	private:
+		ResultOrder *order_;
+		unsigned int sequence_;
 	};
 
-	std::vector<AllocInfo> alloc_info_;
+	Ticket Enter(unsigned int sequence)
+	{
+		std::scoped_lock<std::mutex> l(lock_);
+		outstanding_.insert(sequence);
+		return Ticket(this, sequence);
+	}
+
+private:
+	void waitTurn(unsigned int sequence)
+	{
+		std::unique_lock<std::mutex> l(lock_);
+		cond_.wait(l, [this, sequence] { return *outstanding_.begin() == sequence; });
+	}
+
+	void leave(unsigned int sequence)
+	{
+		std::scoped_lock<std::mutex> l(lock_);
+		outstanding_.erase(sequence);
+		cond_.notify_all();
+	}
+
+	std::set<unsigned int> outstanding_;
 	std::mutex lock_;
+	std::condition_variable cond_;
 };
 
 class OutTensor
@@ -143,6 +189,18 @@ private:
 	std::condition_variable cond_;
 };
 
+// A network loaded onto the device. Stages naming the same HEF file share one, so that it is only loaded and
+// configured once.
+struct HailoNetwork
+{
+	~HailoNetwork();
+
+	std::shared_ptr<hailort::InferModel> infer_model;
+	std::shared_ptr<hailort::ConfiguredInferModel> configured_infer_model;
+	// Serialises job submission from the stages sharing the network.
+	std::mutex lock;
+};
+
 class HailoPostProcessingStage : public PostProcessingStage
 {
 public:
@@ -153,6 +211,10 @@ public:
 
 	void Configure() override;
 
+	void Start() override;
+
+	void Stop() override;
+
 protected:
 	bool Ready() const
 	{
@@ -191,12 +253,26 @@ protected:
 private:
 	int configureHailoRT();
 	void displayThread();
+	void reportStats();
 
 	std::mutex lock_;
 	bool init_ = false;
 	std::string hef_file_, hef_file_8_, hef_file_8L_;
+	std::string network_name_;
+	std::shared_ptr<HailoNetwork> network_;
+	unsigned int batch_size_;
+	unsigned int scheduler_priority_;
+	unsigned int scheduler_threshold_;
+	unsigned int scheduler_timeout_ms_;
 	hailort::ConfiguredInferModel::Bindings bindings_;
 	std::chrono::time_point<std::chrono::steady_clock> last_frame_;
 	libcamera::Size input_tensor_size_;
 	hailo_device_identity_t device_id_;
+
+	// Throughput of this network, reported when the stage stops. Latencies run from dispatch to completion.
+	LatencyHistogram latency_;
+	std::atomic<uint64_t> frames_ = 0;
+	std::atomic<unsigned int> in_flight_ = 0;
+	unsigned int max_in_flight_ = 0;
+	std::chrono::steady_clock::time_point stats_start_;
 };
@@ -18,6 +18,7 @@
 
 #include "core/rpicam_app.hpp"
 #include "post_processing_stages/object_detect.hpp"
+#include "post_processing_stages/object_tracker.hpp"
 
 #include "detection/yolo_hailortpp.hpp"
 
@@ -63,6 +64,8 @@ private:
 
 	std::vector<LtObject> lt_objects_;
 	std::mutex lock_;
+	ObjectTracker tracker_;
+	ResultOrder result_order_;
 	PostProcessingLib postproc_nms_;
 	YoloParamsNMS *yolo_params_ = nullptr;
 
@@ -123,12 +126,18 @@ void YoloInference::Read(boost::property_tree::ptree const &params)
 	}
 	yolo_params_ = init(config_file, "");
 
+	tracker_.Read(params);
 	HailoPostProcessingStage::Read(params);
 }
 
 void YoloInference::Configure()
 {
 	HailoPostProcessingStage::Configure();
+	if (low_res_stream_ && output_stream_)
+	{
+		const Size isp_output_size = output_stream_->configuration().size;
+		tracker_.Configure(low_res_info_.width, low_res_info_.height, isp_output_size.width, isp_output_size.height);
+	}
 }
 
 bool YoloInference::Process(CompletedRequestPtr &completed_request)
@@ -145,10 +154,26 @@ bool YoloInference::Process(CompletedRequestPtr &completed_request)
 		return false;
 	}
 
+	ResultOrder::Ticket ticket = result_order_.Enter(completed_request->sequence);
 	BufferReadSync r(app_, completed_request->buffers[low_res_stream_]);
 	libcamera::Span<uint8_t> buffer = r.Get()[0];
 	std::shared_ptr<uint8_t> input;
-	uint8_t *input_ptr;
+	const uint8_t *input_ptr;
+
+	// With tracking, most frames only get the last detections followed onto them, and skip inference altogether.
+	if (tracker_.Enabled())
+	{
+		// Green stands in for the luma of an RGB lores image.
+		bool rgb = low_res_info_.pixel_format != libcamera::formats::YUV420;
+		if (!tracker_.Track(completed_request->sequence, buffer.data() + (rgb ? 1 : 0), rgb ? 3 : 1,
+							low_res_info_.stride))
+		{
+			std::vector<Detection> objects = tracker_.Results();
+			if (objects.size())
+				completed_request->post_process_metadata.Set("object_detect.results", objects);
+			return false;
+		}
+	}
 
 	if (low_res_info_.pixel_format == libcamera::formats::YUV420)
 	{
@@ -157,10 +182,8 @@ bool YoloInference::Process(CompletedRequestPtr &completed_request)
 		rgb_info.height = InputTensorSize().height;
 		rgb_info.stride = rgb_info.width * 3;
 
-		input = allocator_.Allocate(rgb_info.stride * rgb_info.height);
-		input_ptr = input.get();
-
-		Yuv420ToRgb(input.get(), buffer.data(), low_res_info_, rgb_info);
+		// Converted once per frame, and shared with any other stage that wants the same image.
+		input_ptr = GetRgbImage(completed_request, low_res_stream_, low_res_info_, rgb_info).data();
 	}
 	else if (low_res_info_.pixel_format == libcamera::formats::RGB888 ||
 			 low_res_info_.pixel_format == libcamera::formats::BGR888)
@@ -175,7 +198,7 @@ bool YoloInference::Process(CompletedRequestPtr &completed_request)
 			input_ptr = input.get();
 
 			for (unsigned int i = 0; i < low_res_info_.height; i++)
-				memcpy(input_ptr + i * stride, buffer.data() + i * low_res_info_.stride, stride);
+				memcpy(input.get() + i * stride, buffer.data() + i * low_res_info_.stride, stride);
 		}
 		else
 			input_ptr = buffer.data();
@@ -208,7 +231,9 @@ bool YoloInference::Process(CompletedRequestPtr &completed_request)
 		if (temporal_filtering_)
 		{
 			// Process() can be concurrently called through different threads for consecutive CompletedRequests if
-			// things are running behind.  So protect access to the inference state.
+			// things are running behind, or to keep several frames in flight on the device. So protect access to
+			// the inference state, and update it in frame order.
+			ticket.WaitTurn();
 			std::scoped_lock<std::mutex> l(lock_);
 
 			filterOutputObjects(objects);
@@ -226,6 +251,8 @@ bool YoloInference::Process(CompletedRequestPtr &completed_request)
 		if (objects.size())
 			completed_request->post_process_metadata.Set("object_detect.results", objects);
 	}
+	if (tracker_.Enabled())
+		tracker_.Detected(objects);
 
 	return false;
 }
@@ -261,6 +288,7 @@ std::vector<Detection> YoloInference::runInference(const uint8_t *frame, const s
 
 	// Translate results to the rpicam-apps Detection objects
 	std::vector<Detection> results;
+	unsigned int max_detections = max_detections_;
 	for (auto const &d : detections)
 	{
 		if (d->get_confidence() < threshold_)
@@ -276,7 +304,7 @@ std::vector<Detection> YoloInference::runInference(const uint8_t *frame, const s
 		results.emplace_back(d->get_class_id(), d->get_label(), d->get_confidence(), r.x, r.y, r.width, r.height);
 		LOG(2, "Object: " << results.back().toString());
 
-		if (--max_detections_ == 0)
+		if (--max_detections == 0)
 			break;
 	}
 
@@ -5,6 +5,7 @@
  * hailo_yolo_pose.cpp - Hailo pose estimation
  */
 
+#include <algorithm>
 #include <cmath>
 #include <filesystem>
 #include <memory>
@@ -12,6 +13,7 @@
 
 #include <hailo/hailort.hpp>
 
+#include <libcamera/controls.h>
 #include <libcamera/geometry.h>
 
 #include <opencv2/highgui.hpp>
@@ -22,9 +24,12 @@
 #include "instance_segmentation/yolov5seg.hpp"
 
 #include "core/rpicam_app.hpp"
+#include "post_processing_stages/segmentation.hpp"
+
 #include "hailo_postprocessing_stage.hpp"
 
 using Size = libcamera::Size;
+using Rectangle = libcamera::Rectangle;
 using PostProcFuncPtr = void (*)(HailoROIPtr, Yolov5segParams *);
 using InitFuncPtr = Yolov5segParams *(*)(std::string, std::string);
 using FreeFuncPtr = void (*)(void *);
@@ -37,13 +42,6 @@ namespace fs = std::filesystem;
 namespace
 {
 
-enum overlay_status_t
-{
-	OVERLAY_STATUS_UNINITIALIZED = -1,
-	OVERLAY_STATUS_OK,
-
-};
-
 const std::vector<cv::Scalar> color_table = {
 	cv::Scalar(255, 0, 0),	 cv::Scalar(0, 255, 0),	  cv::Scalar(0, 0, 255),	cv::Scalar(255, 255, 0),
 	cv::Scalar(0, 255, 255), cv::Scalar(255, 0, 255), cv::Scalar(255, 170, 0),	cv::Scalar(255, 0, 170),
@@ -57,113 +55,29 @@ cv::Scalar indexToColor(size_t index)
 	return color_table[index % color_table.size()];
 }
 
-class Parallel_pixel_opencv : public cv::ParallelLoopBody
-{
-protected:
-	cv::Vec3b *p;
-	float transparency;
-	int image_cols;
-	int roi_cols;
-
-public:
-	Parallel_pixel_opencv(uint8_t *ptr, float transparency, int image_cols, int roi_cols)
-		: p((cv::Vec3b *)ptr), transparency(transparency), image_cols(image_cols), roi_cols(roi_cols)
-	{
-	}
-};
-
-class ParallelPixelClassConfMask : public Parallel_pixel_opencv
-{
-private:
-	float *mask_data;
-	cv::Scalar mask_color;
-
-public:
-	ParallelPixelClassConfMask(uint8_t *ptr, uint8_t *mask_data, float transparency, int image_cols, int roi_cols,
-							   cv::Scalar mask_color)
-		: Parallel_pixel_opencv(ptr, transparency, image_cols, roi_cols), mask_data((float *)mask_data),
-		  mask_color(mask_color)
-	{
-	}
-
-	virtual void operator()(const cv::Range &r) const
-	{
-		constexpr float CONFIDENCE = 0.5;
-
-		for (int i = r.start; i != r.end; ++i)
-		{
-			if (mask_data[i] > CONFIDENCE) // confidence is above threshold
-			{
-				// i the index inside the full image, convert it to the index inside the ROI
-				int index = i / roi_cols * image_cols + i % roi_cols;
-
-				p[index][0] = p[index][0] * (1 - transparency) + mask_color[0] * transparency;
-				p[index][1] = p[index][1] * (1 - transparency) + mask_color[1] * transparency;
-				p[index][2] = p[index][2] * (1 - transparency) + mask_color[2] * transparency;
-			}
-		}
-	}
-};
-
-template <typename T>
-void calc_destination_roi_and_resize_mask(cv::Mat &destinationROI, cv::Mat &image_planes, HailoROIPtr roi,
-										  HailoMaskPtr mask, cv::Mat &resized_mask_data, T data_ptr, int cv_type)
-{
-	HailoBBox bbox = roi->get_bbox();
-	int roi_xmin = bbox.xmin() * image_planes.cols;
-	int roi_ymin = bbox.ymin() * image_planes.rows;
-	int roi_width = image_planes.cols * bbox.width();
-	int roi_height = image_planes.rows * bbox.height();
-
-	// clamp the region of interest so it is inside the image planes
-	roi_xmin = std::clamp(roi_xmin, 0, image_planes.cols);
-	roi_ymin = std::clamp(roi_ymin, 0, image_planes.rows);
-	roi_width = std::clamp(roi_width, 0, image_planes.cols - roi_xmin);
-	roi_height = std::clamp(roi_height, 0, image_planes.rows - roi_ymin);
-
-	cv::Mat mat_data = cv::Mat(mask->get_height(), mask->get_width(), cv_type, (uint8_t *)data_ptr.data());
-
-	cv::resize(mat_data, resized_mask_data, cv::Size(roi_width, roi_height), 0, 0, cv::INTER_LINEAR);
-
-	cv::Rect roi_rect(cv::Point(roi_xmin, roi_ymin), cv::Size(roi_width, roi_height));
-	destinationROI = image_planes(roi_rect);
-}
-
-overlay_status_t draw_conf_class_mask(cv::Mat &image_planes, HailoConfClassMaskPtr mask, HailoROIPtr roi,
-									  const uint mask_overlay_n_threads)
+// Where a box, in co-ordinates normalised to the image, lands in an image of the given size.
+cv::Rect boxToRect(HailoBBox const &bbox, int cols, int rows)
 {
-	cv::Mat resized_mask_data;
-	cv::Mat destinationROI;
-
-	calc_destination_roi_and_resize_mask(destinationROI, image_planes, roi, mask, resized_mask_data, mask->get_data(),
-										 CV_32F);
-	cv::Scalar mask_color = indexToColor(mask->get_class_id());
-
-	if (mask_overlay_n_threads > 0)
-		cv::setNumThreads(mask_overlay_n_threads);
-
-	// perform efficient parallel matrix iteration and color every pixel its class color
-	cv::parallel_for_(cv::Range(0, destinationROI.rows * destinationROI.cols),
-					  ParallelPixelClassConfMask(destinationROI.data, resized_mask_data.data, mask->get_transparency(),
-												 image_planes.cols, destinationROI.cols, mask_color));
-
-	return OVERLAY_STATUS_OK;
+	int x = std::clamp<int>(bbox.xmin() * cols, 0, cols);
+	int y = std::clamp<int>(bbox.ymin() * rows, 0, rows);
+	int width = std::clamp<int>(bbox.width() * cols, 0, cols - x);
+	int height = std::clamp<int>(bbox.height() * rows, 0, rows - y);
+	return cv::Rect(x, y, width, height);
 }
 
-overlay_status_t draw_all(cv::Mat &mat, HailoROIPtr roi, const uint mask_overlay_n_threads)
+// Tint the pixels under the mask, which is stretched over the box only now that we need it at that size.
+void drawMask(cv::Mat &image, InstanceMask const &mask, cv::Rect const &rect, cv::Scalar const &colour,
+			  float transparency)
 {
-	overlay_status_t ret = OVERLAY_STATUS_UNINITIALIZED;
-	for (auto &obj : roi->get_objects())
-	{
-		if (obj->get_type() == HAILO_CONF_CLASS_MASK)
-		{
-			HailoConfClassMaskPtr mask = std::dynamic_pointer_cast<HailoConfClassMask>(obj);
-			if (mask->get_height() != 0 && mask->get_width() != 0)
-				draw_conf_class_mask(mat, mask, roi, mask_overlay_n_threads);
-		}
-	}
-	ret = OVERLAY_STATUS_OK;
-	return ret;
+	if (rect.empty())
+		return;
+
+	cv::Mat covered = cv::Mat::zeros(rect.size(), CV_8U);
+	mask.Upscale(covered.data, rect.width, rect.height, covered.step);
+	cv::Mat roi = image(rect);
+	cv::Mat tinted;
+	cv::addWeighted(roi, 1 - transparency, cv::Mat(rect.size(), roi.type(), colour), transparency, 0, tinted);
+	tinted.copyTo(roi, covered);
 }
 
 } // namespace
@@ -183,7 +97,7 @@ public:
 	bool Process(CompletedRequestPtr &completed_request) override;
 
 private:
-	bool runInference(uint8_t *input, uint32_t *output);
+	bool runInference(uint8_t *input, const std::vector<Rectangle> &scaler_crops, std::vector<InstanceMask> &instances);
 
 	PostProcessingLib postproc_;
 	Yolov5segParams *yolo_params_ = nullptr;
@@ -262,8 +176,11 @@ bool YoloSegmentation::Process(CompletedRequestPtr &completed_request)
 		rgb_info.height = InputTensorSize().height;
 		rgb_info.stride = rgb_info.width * 3;
 
-		input = allocator_.Allocate(rgb_info.stride * rgb_info.height);
-		Yuv420ToRgb(input.get(), low_res_buffer.data(), low_res_info_, rgb_info);
+		// We keep our own copy for displaying the results, but the conversion itself is shared with any other stage
+		// that wants the same image.
+		std::vector<uint8_t> const &rgb = GetRgbImage(completed_request, low_res_stream_, low_res_info_, rgb_info);
+		input = allocator_.Allocate(rgb.size());
+		memcpy(input.get(), rgb.data(), rgb.size());
 	}
 	else if (low_res_info_.pixel_format == libcamera::formats::RGB888 ||
 			 low_res_info_.pixel_format == libcamera::formats::BGR888)
@@ -283,11 +200,27 @@ bool YoloSegmentation::Process(CompletedRequestPtr &completed_request)
 		return false;
 	}
 
-	BufferWriteSync w(app_, completed_request->buffers[output_stream_]);
-	libcamera::Span<uint8_t> buffer = w.Get()[0];
-	uint32_t *output = (uint32_t *)buffer.data();
+	std::vector<Rectangle> scaler_crops;
+	auto scaler_crop = completed_request->metadata.get(controls::ScalerCrop);
+	auto rpi_scaler_crop = completed_request->metadata.get(controls::rpi::ScalerCrops);
+
+	if (rpi_scaler_crop)
+	{
+		for (unsigned int i = 0; i < rpi_scaler_crop->size(); i++)
+			scaler_crops.push_back(rpi_scaler_crop->data()[i]);
+	}
+	else if (scaler_crop)
+	{
+		// Push-back twice, once for main, once for low res.
+		scaler_crops.push_back(*scaler_crop);
+		scaler_crops.push_back(*scaler_crop);
+	}
+
+	std::vector<InstanceMask> instances;
+	bool success = runInference(input.get(), scaler_crops, instances);
+	if (success)
+		completed_request->post_process_metadata.Set("segmentation.instances", instances);
 
-	bool success = runInference(input.get(), output);
 	if (show_results_ && success)
 	{
 		Msg m(MsgType::Display, std::move(input), InputTensorSize(), "Segmentation");
@@ -299,8 +232,11 @@ bool YoloSegmentation::Process(CompletedRequestPtr &completed_request)
 	return false;
 }
 
-bool YoloSegmentation::runInference(uint8_t *input, uint32_t *output)
+bool YoloSegmentation::runInference(uint8_t *input, const std::vector<Rectangle> &scaler_crops,
+									std::vector<InstanceMask> &instances)
 {
+	constexpr float MASK_CONFIDENCE = 0.5;
+
 	hailort::AsyncInferJob job;
 	std::vector<OutTensor> output_tensors;
 	hailo_status status;
@@ -337,14 +273,42 @@ bool YoloSegmentation::runInference(uint8_t *input, uint32_t *output)
 			continue;
 
 		auto bbox = detection->get_bbox();
-
-		cv::rectangle(image, cv::Point2f(bbox.xmin() * float(InputTensorSize().width),
-										 bbox.ymin() * float(InputTensorSize().height)),
-							 cv::Point2f(bbox.xmax() * float(InputTensorSize().width),
-										 bbox.ymax() * float(InputTensorSize().height)),
-					  cv::Scalar(0, 0, 255), 1);
-
-		draw_all(image, detection, 0);
+		const float x0 = std::max(bbox.xmin(), 0.0f);
+		const float x1 = std::min(bbox.xmax(), 1.0f);
+		const float y0 = std::max(bbox.ymin(), 0.0f);
+		const float y1 = std::min(bbox.ymax(), 1.0f);
+		Rectangle r = ConvertInferenceCoordinates({ x0, y0, x1 - x0, y1 - y0 }, scaler_crops);
+		Detection d(detection->get_class_id(), detection->get_label(), detection->get_confidence(), r.x, r.y,
+					r.width, r.height);
+
+		if (show_results_)
+			cv::rectangle(image, cv::Point2f(bbox.xmin() * float(InputTensorSize().width),
+											 bbox.ymin() * float(InputTensorSize().height)),
+								 cv::Point2f(bbox.xmax() * float(InputTensorSize().width),
+											 bbox.ymax() * float(InputTensorSize().height)),
+						  cv::Scalar(0, 0, 255), 1);
+
+		for (auto &obj : detection->get_objects())
+		{
+			if (obj->get_type() != HAILO_CONF_CLASS_MASK)
+				continue;
+			HailoConfClassMaskPtr mask = std::dynamic_pointer_cast<HailoConfClassMask>(obj);
+			unsigned int width = mask->get_width(), height = mask->get_height();
+			if (!width || !height)
+				continue;
+
+			// Keep the mask at the size the model made it, as one bit per pixel.
+			InstanceMask &instance = instances.emplace_back(d, width, height);
+			const float *confidence = mask->get_data().data();
+			for (unsigned int y = 0; y < height; y++)
+				for (unsigned int x = 0; x < width; x++)
+					if (*(confidence++) > MASK_CONFIDENCE)
+						instance.Set(x, y);
+
+			if (show_results_)
+				drawMask(image, instance, boxToRect(bbox, image.cols, image.rows),
+						 indexToColor(mask->get_class_id()), mask->get_transparency());
+		}
 	}
 
 	return true;
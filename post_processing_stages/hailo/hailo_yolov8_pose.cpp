@@ -85,7 +85,7 @@ bool YoloPose::Process(CompletedRequestPtr &completed_request)
 	BufferReadSync r(app_, completed_request->buffers[low_res_stream_]);
 	libcamera::Span<uint8_t> low_res_buffer = r.Get()[0];
 	std::shared_ptr<uint8_t> input;
-	uint8_t *input_ptr;
+	const uint8_t *input_ptr;
 
 	if (low_res_info_.pixel_format == libcamera::formats::YUV420)
 	{
@@ -94,10 +94,8 @@ bool YoloPose::Process(CompletedRequestPtr &completed_request)
 		rgb_info.height = InputTensorSize().height;
 		rgb_info.stride = rgb_info.width * 3;
 
-		input = allocator_.Allocate(rgb_info.stride * rgb_info.height);
-		input_ptr = input.get();
-
-		Yuv420ToRgb(input.get(), low_res_buffer.data(), low_res_info_, rgb_info);
+		// Converted once per frame, and shared with any other stage that wants the same image.
+		input_ptr = GetRgbImage(completed_request, low_res_stream_, low_res_info_, rgb_info).data();
 	}
 	else if (low_res_info_.pixel_format == libcamera::formats::RGB888 ||
 			 low_res_info_.pixel_format == libcamera::formats::BGR888)
@@ -110,7 +108,7 @@ bool YoloPose::Process(CompletedRequestPtr &completed_request)
 		// If the stride shows we have padding on the right edge of the buffer, we must copy it out to another buffer
 		// without padding.
 		for (unsigned int i = 0; i < low_res_info_.height; i++)
-			memcpy(input_ptr + i * stride, low_res_buffer.data() + i * low_res_info_.stride, stride);
+			memcpy(input.get() + i * stride, low_res_buffer.data() + i * low_res_info_.stride, stride);
 	}
 	else
 	{
@@ -22,6 +22,18 @@
 // pixel manipulations, especially when it comes to colour, are a bit random. You have
 // been warned. Enjoy!
 
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#define HAVE_NEON_KERNELS 1
+#endif
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <thread>
+
 #include <libcamera/stream.h>
 
 #include "core/rpicam_app.hpp"
@@ -30,234 +42,300 @@
 
 #include "image/image.hpp"
 
+#include "post_processing_stages/hdr_image.hpp"
 #include "post_processing_stages/histogram.hpp"
+#include "post_processing_stages/parallel_rows.hpp"
 #include "post_processing_stages/post_processing_stage.hpp"
 #include "post_processing_stages/pwl.hpp"
 
 using Stream = libcamera::Stream;
 
-struct LpFilterConfig
+namespace
 {
-	double strength; // smaller value actually smoothes more
-	Pwl threshold; // defines the level of pixel differences that will be smoothed over
-};
 
-// A TonemapPoint gives a target value within the full dynamic range where we would like
-// the given quantile (actually, inter-quantile mean) in the image's histogram to go.
-// Additionally there are limits to how much the current value can be scaled up or down.
+// Adds (sign 1) or subtracts (sign -1) a row of 8-bit pixels, less the offset, into the 16-bit accumulator, for as
+// many whole blocks of 16 pixels as fit in the width, returning the number of pixels done. Whatever is left is
+// finished off by the C code.
+typedef unsigned int (*AddRowFn)(int16_t *, uint8_t const *, unsigned int, int16_t, int16_t);
 
-struct TonemapPoint
+unsigned int add_row_c(int16_t *, uint8_t const *, unsigned int, int16_t, int16_t)
 {
-	double q; // quantile
-	double width; // width of inter-quantile mean there
-	double target; // where in the dynamic range to target it
-	double max_up; // maximum increase to current value (gain >= 1)
-	double max_down; // maximum decrease to current value (gain <= 1)
-	void Read(boost::property_tree::ptree const &params)
-	{
-		q = params.get<double>("q");
-		width = params.get<double>("width");
-		target = params.get<double>("target");
-		max_up = params.get<double>("max_up");
-		max_down = params.get<double>("max_down");
-	}
-};
+	return 0;
+}
 
-struct GlobalTonemapConfig
-{
-	std::vector<TonemapPoint> points;
-	double strength; // 1.0 follows the target tonemap, 0.0 ignores it
-};
+#if HAVE_NEON_KERNELS
 
-struct LocalTonemapConfig
+unsigned int add_row_neon(int16_t *dest, uint8_t const *src, unsigned int width, int16_t offset, int16_t sign)
 {
-	Pwl pos_strength; // gain applied to local contrast when brighter than neighbourhood
-	Pwl neg_strength; // gain applied to local contrast when darker than neighbourhood
-	double colour_scale; // allows colour saturation to be increased or reduced slightly
-};
+	const int16x8_t o = vdupq_n_s16(offset);
+	unsigned int x = 0;
+	for (; x + 16 <= width; x += 16)
+	{
+		uint8x16_t s = vld1q_u8(src + x);
+		int16x8_t lo = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(s))), o);
+		int16x8_t hi = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(s))), o);
+		vst1q_s16(dest + x, vmlaq_n_s16(vld1q_s16(dest + x), lo, sign));
+		vst1q_s16(dest + x + 8, vmlaq_n_s16(vld1q_s16(dest + x + 8), hi, sign));
+	}
+	return x;
+}
 
-struct HdrConfig
+#endif /* HAVE_NEON_KERNELS */
+
+AddRowFn select_add_row()
 {
-	unsigned int num_frames; // number of frames to accumulate
-	LpFilterConfig lp_filter; // low pass filter settings
-	GlobalTonemapConfig global_tonemap; // global tonemap settings
-	LocalTonemapConfig local_tonemap; // settings for adding back local contrast
-	std::string jpeg_filename; // set this if you want individual jpegs saved as well
-};
+#if HAVE_NEON_KERNELS
+	if (getauxval(AT_HWCAP) & HWCAP_ASIMD)
+	{
+		LOG(2, "HdrStage: using NEON kernels");
+		return add_row_neon;
+	}
+#endif
+	LOG(2, "HdrStage: using C kernels");
+	return add_row_c;
+}
 
-struct HdrImage
+AddRowFn add_row()
 {
-	HdrImage() : width(0), height(0), dynamic_range(0) {}
-	HdrImage(int w, int h, int num_pixels) : width(w), height(h), pixels(num_pixels), dynamic_range(0) {}
-	int width;
-	int height;
-	std::vector<int16_t> pixels;
-	int dynamic_range; // 1 more than the maximum pixel value
-	int16_t &P(unsigned int offset) { return pixels[offset]; }
-	int16_t P(unsigned int offset) const { return pixels[offset]; }
-	void Clear() { std::fill(pixels.begin(), pixels.end(), 0); }
-	void Accumulate(uint8_t const *src, int stride);
-	HdrImage LpFilter(LpFilterConfig const &config) const;
-	Pwl CreateTonemap(GlobalTonemapConfig const &config) const;
-	void Tonemap(HdrImage const &lp, HdrConfig const &config);
-	void Extract(uint8_t *dest, int stride) const;
-	Histogram CalculateHistogram() const;
-	void Scale(double factor);
-};
+	static const AddRowFn fn = select_add_row();
+	return fn;
+}
 
-static void add_Y_pixels(int16_t *dest, uint8_t const *src, int width, int stride, int height)
+void add_pixels(int16_t *dest, uint8_t const *src, unsigned int width, int16_t offset, int16_t sign)
 {
-	for (int y = 0; y < height; y++, src += stride)
-	{
-		for (int x = 0; x < width; x++)
-			*(dest++) += src[x];
-	}
+	for (unsigned int x = add_row()(dest, src, width, offset, sign); x < width; x++)
+		dest[x] += (src[x] - offset) * sign;
 }
 
+} // namespace
+
 // Add the new image buffer to this "accumulator" image. We just add them as
-// we don't have the horsepower to do any fancy alignment or anything.
-// Actually, spreading it across a few threads doesn't seem to help much, though
-// compiling with "gcc -mfpu=neon-fp-armv8 -ftree-vectorize" gives a big
-// improvement.
+// we don't have the horsepower to do any fancy alignment or anything. The
+// rows are split into bands across all the cores.
 
 void HdrImage::Accumulate(uint8_t const *src, int stride)
 {
-	int16_t *dest = &P(0);
+	add(src, stride, 1);
+	dynamic_range += 256;
+}
+
+// Take out an image that was accumulated earlier, to keep a rolling window of frames.
+
+void HdrImage::Remove(uint8_t const *src, int stride)
+{
+	add(src, stride, -1);
+	dynamic_range -= 256;
+}
+
+void HdrImage::add(uint8_t const *src, int stride, int sign)
+{
+	int16_t *dest_Y = &P(0);
+	int16_t *dest_UV = dest_Y + width * height;
+	uint8_t const *src_UV = src + stride * height;
 	int width2 = width / 2, stride2 = stride / 2;
-	std::thread thread1(add_Y_pixels, dest, src, width, stride, height);
 
-	dest += width * height;
-	src += stride * height;
+	// The U and V planes together make as many rows of half the width as the image is tall.
+	ParallelRows(height, [&](unsigned int begin, unsigned int end) {
+		for (unsigned int y = begin; y < end; y++)
+		{
+			add_pixels(dest_Y + y * width, src + y * stride, width, 0, sign);
+			add_pixels(dest_UV + y * width2, src_UV + y * stride2, width2, 128, sign);
+		}
+	});
+}
+
+// Let everything accumulated so far fade by a factor of (1 - 1 / n), so that a new image can be accumulated on top
+// for an exponentially weighted average of roughly the last n images.
+
+void HdrImage::Decay(int n)
+{
+	ParallelRows(height, [&](unsigned int begin, unsigned int end) {
+		unsigned int last = end == (unsigned int)height ? pixels.size() : end * width * 3 / 2;
+		for (unsigned int i = begin * width * 3 / 2; i < last; i++)
+			pixels[i] -= pixels[i] / n;
+	});
+	dynamic_range -= dynamic_range / n;
+}
+
+// Halve the width and height of the luminance, averaging each 2x2 block. This makes one more level of a pyramid on
+// which the low pass filter can run much more cheaply.
+
+HdrImage HdrImage::Downsample() const
+{
+	HdrImage out(width / 2, height / 2, (width / 2) * (height / 2));
+	out.dynamic_range = dynamic_range;
+	ParallelRows(out.height, [&](unsigned int begin, unsigned int end) {
+		for (unsigned int y = begin; y < end; y++)
+		{
+			int16_t const *row0 = &pixels[2 * y * width], *row1 = row0 + width;
+			int16_t *dest = &out.P(y * out.width);
+			for (int x = 0; x < out.width; x++)
+				dest[x] = (row0[2 * x] + row0[2 * x + 1] + row1[2 * x] + row1[2 * x + 1] + 2) >> 2;
+		}
+	});
+	return out;
+}
+
+// Bilinear upsample of the luminance to the given size, to bring a low pass filtered pyramid level back up to the
+// size of the image.
+
+HdrImage HdrImage::Upsample(int w, int h) const
+{
+	HdrImage out(w, h, w * h);
+	out.dynamic_range = dynamic_range;
 
-	// U and V components
-	for (int y = 0; y < height; y++, src += stride2)
+	// Work out the columns to interpolate between, and how much of each, just the once.
+	std::vector<int> x0(w);
+	std::vector<float> fx(w);
+	for (int x = 0; x < w; x++)
 	{
-		for (int x = 0; x < width2; x++)
-			*(dest++) += src[x] - 128;
+		float pos = std::clamp((x + 0.5f) * width / w - 0.5f, 0.0f, width - 1.0f);
+		x0[x] = std::min<int>(pos, width - 2);
+		fx[x] = pos - x0[x];
 	}
 
-	dynamic_range += 256;
-
-	thread1.join();
+	ParallelRows(h, [&](unsigned int begin, unsigned int end) {
+		for (unsigned int y = begin; y < end; y++)
+		{
+			float pos = std::clamp((y + 0.5f) * height / h - 0.5f, 0.0f, height - 1.0f);
+			int y0 = std::min<int>(pos, height - 2);
+			float fy = pos - y0;
+			int16_t const *row0 = &pixels[y0 * width], *row1 = row0 + width;
+			int16_t *dest = &out.P(y * w);
+			for (int x = 0; x < w; x++)
+			{
+				float top = row0[x0[x]] + fx[x] * (row0[x0[x] + 1] - row0[x0[x]]);
+				float bottom = row1[x0[x]] + fx[x] * (row1[x0[x] + 1] - row1[x0[x]]);
+				dest[x] = top + fy * (bottom - top) + 0.5f;
+			}
+		}
+	});
+	return out;
 }
 
-// Forward pass of the IIR low pass filter.
+namespace
+{
+
+struct LpFilterLuts
+{
+	std::vector<float> scale; // 10 / threshold, for each pixel value
+	std::vector<float> weights; // e^(-x^2) for 0 <= x <= 3, in steps of 0.1
+	float strength;
+};
 
-static void forward_pass(std::vector<double> &fwd_pixels, std::vector<double> &fwd_weight_sums, HdrImage const &in,
-						 std::vector<double> &weights, std::vector<double> &threshold, int width, int height, int size,
-						 double strength)
+// One pass of the IIR low pass filter, forwards from the top left or in reverse from the bottom right. Each pixel
+// depends on its neighbour before it in the row, and on three pixels of the row before, up to one ahead. So rows can
+// run on different threads at once, as long as each keeps a little behind the one before: a wavefront. Rows are
+// handed out in order, so the row being waited for always belongs to a thread that is already running.
 
+void lp_pass(std::vector<float> &pixels, std::vector<float> &weight_sums, HdrImage const &in, LpFilterLuts const &luts,
+			 bool reverse)
 {
-	// (Should probably initialise the top/left elements of fwd_pixels/fwd_weight_sums...)
-	for (int y = size; y < height; y++)
-	{
-		unsigned int off = y * width + size;
-		for (int x = size; x < width; x++, off++)
+	constexpr int size = 1;
+	constexpr int chunk = 256;
+	const int width = in.width, height = in.height;
+	const int rows = height - size, n = width - size;
+	const int step = reverse ? -1 : 1;
+	const unsigned int num_weights = luts.weights.size();
+
+	// How many pixels of each row have been done.
+	std::vector<std::atomic<int>> progress(height);
+	for (auto &p : progress)
+		p.store(0, std::memory_order_relaxed);
+	std::atomic<int> next_row = 0;
+
+	ParallelFor(ParallelThreads(), [&](unsigned int) {
+		for (int r; (r = next_row.fetch_add(1)) < rows;)
 		{
-			int pixel = in.P(off);
-			double scale = 10 / threshold[pixel];
-			double pixel_wt_sum = pixel * strength, wt_sum = strength;
-
-			// Compiler generates faster code from this:
-			unsigned int p[4], idx[4];
-			double wt[4];
-			p[0] = fwd_pixels[off - width - 1];
-			p[1] = fwd_pixels[off - width];
-			p[2] = fwd_pixels[off - width + 1];
-			p[3] = fwd_pixels[off - 1];
-			idx[0] = std::abs(static_cast<int>(p[0]) - pixel) * scale;
-			idx[1] = std::abs(static_cast<int>(p[1]) - pixel) * scale;
-			idx[2] = std::abs(static_cast<int>(p[2]) - pixel) * scale;
-			idx[3] = std::abs(static_cast<int>(p[3]) - pixel) * scale;
-			wt[0] = idx[0] >= weights.size() ? 0.0 : weights[idx[0]];
-			wt[1] = idx[1] >= weights.size() ? 0.0 : weights[idx[1]];
-			wt[2] = idx[2] >= weights.size() ? 0.0 : weights[idx[2]];
-			wt[3] = idx[3] >= weights.size() ? 0.0 : weights[idx[3]];
-			pixel_wt_sum += wt[0] * p[0] + wt[1] * p[1] + wt[2] * p[2] + wt[3] * p[3];
-			wt_sum += wt[0] + wt[1] + wt[2] + wt[3];
-
-			fwd_pixels[off] = pixel_wt_sum / wt_sum;
-			fwd_weight_sums[off] = wt_sum;
+			const int y = reverse ? height - 1 - size - r : size + r;
+			// The offsets of the three neighbours in the row before, and the one before in this row.
+			const int o[4] = { -step * (width + 1), -step * width, -step * (width - 1), -step };
+
+			// (Should probably initialise the first elements of the pass in pixels/weight_sums...)
+			for (int done = 0; done < n;)
+			{
+				const int end = std::min(done + chunk, n);
+				if (r)
+				{
+					const int needed = std::min(end + 1, n);
+					while (progress[y - step].load(std::memory_order_acquire) < needed)
+						std::this_thread::yield();
+				}
+
+				unsigned int off = y * width + (reverse ? width - 1 - size - done : size + done);
+				for (int i = done; i < end; i++, off += step)
+				{
+					int pixel = in.P(off);
+					float scale = luts.scale[pixel];
+					float pixel_wt_sum = pixel * luts.strength, wt_sum = luts.strength;
+
+					// Compiler generates faster code from this:
+					unsigned int p[4], idx[4];
+					float wt[4];
+					for (int k = 0; k < 4; k++)
+					{
+						p[k] = pixels[off + o[k]];
+						idx[k] = std::abs(static_cast<int>(p[k]) - pixel) * scale;
+						wt[k] = idx[k] >= num_weights ? 0.0f : luts.weights[idx[k]];
+					}
+					pixel_wt_sum += wt[0] * p[0] + wt[1] * p[1] + wt[2] * p[2] + wt[3] * p[3];
+					wt_sum += wt[0] + wt[1] + wt[2] + wt[3];
+
+					pixels[off] = pixel_wt_sum / wt_sum;
+					weight_sums[off] = wt_sum;
+				}
+
+				done = end;
+				progress[y].store(done, std::memory_order_release);
+			}
 		}
-	}
+	});
 }
 
+} // namespace
+
 // Low pass IIR filter. We perform a forwards and a reverse pass, finally combining
 // the results to get a smoothed but vaguely edge-preserving version of the
 // accumulator image. You could imagine implementing alternative (more sophisticated)
-// filters.
+// filters. Single precision is plenty for pixel values of 12 bits or so, and halves
+// the memory that the passes have to get through.
 
 HdrImage HdrImage::LpFilter(LpFilterConfig const &config) const
 {
 	// Cache threshold values, computing them would be slow.
 	std::vector<double> threshold = config.threshold.GenerateLut<double>();
 
+	LpFilterLuts luts;
+	luts.scale.resize(threshold.size());
+	for (unsigned int i = 0; i < threshold.size(); i++)
+		luts.scale[i] = 10 / threshold[i];
+
 	// Cache values of e^(-x^2) for 0 <= x <= 3, it will be much quicker
-	std::vector<double> weights(31);
+	luts.weights.resize(31);
 	for (int d = 0; d <= 30; d++)
-		weights[d] = exp(-d * d / 100.0);
-
-	int size = 1;
-	double strength = config.strength;
+		luts.weights[d] = exp(-d * d / 100.0);
 
-	// Forward pass.
-	std::vector<double> fwd_weight_sums(width * height);
-	std::vector<double> fwd_pixels(width * height);
+	luts.strength = config.strength;
 
 	HdrImage out(width, height, width * height);
 	out.dynamic_range = dynamic_range;
 
-	// Run the forward pass in other thread, so that the two passes run in parallel.
-	std::thread fwd_pass(forward_pass, std::ref(fwd_pixels), std::ref(fwd_weight_sums), std::ref(*this),
-						 std::ref(weights), std::ref(threshold), width, height, size, strength);
-
-	// Reverse pass, but otherwise the same as the forward pass. There could be a small
-	// saving in omitting it, but it's not huge given that they run in parallel.
-	std::vector<double> rev_weight_sums(width * height);
-	std::vector<double> rev_pixels(width * height);
-	// (Should probably initialise the bottom/right elements of rev_pixels/rev_weight_sums...)
-	for (int y = height - 1 - size; y >= 0; y--)
-	{
-		unsigned int off = y * width + width - 1 - size;
-		for (int x = width - 1 - size; x >= 0; x--, off--)
-		{
-			int pixel = P(off);
-			double scale = 10 / threshold[pixel];
-			double pixel_wt_sum = pixel * strength, wt_sum = strength;
-
-			// Compiler generates faster code from this:
-			unsigned int p[4], idx[4];
-			double wt[4];
-			p[0] = rev_pixels[off + width + 1];
-			p[1] = rev_pixels[off + width];
-			p[2] = rev_pixels[off + width - 1];
-			p[3] = rev_pixels[off + 1];
-			idx[0] = std::abs(static_cast<int>(p[0]) - pixel) * scale;
-			idx[1] = std::abs(static_cast<int>(p[1]) - pixel) * scale;
-			idx[2] = std::abs(static_cast<int>(p[2]) - pixel) * scale;
-			idx[3] = std::abs(static_cast<int>(p[3]) - pixel) * scale;
-			wt[0] = idx[0] >= weights.size() ? 0.0 : weights[idx[0]];
-			wt[1] = idx[1] >= weights.size() ? 0.0 : weights[idx[1]];
-			wt[2] = idx[2] >= weights.size() ? 0.0 : weights[idx[2]];
-			wt[3] = idx[3] >= weights.size() ? 0.0 : weights[idx[3]];
-			pixel_wt_sum += wt[0] * p[0] + wt[1] * p[1] + wt[2] * p[2] + wt[3] * p[3];
-			wt_sum += wt[0] + wt[1] + wt[2] + wt[3];
-
-			rev_pixels[off] = pixel_wt_sum / wt_sum;
-			rev_weight_sums[off] = wt_sum;
-		}
-	}
+	// Forward pass.
+	std::vector<float> fwd_weight_sums(width * height);
+	std::vector<float> fwd_pixels(width * height);
+	lp_pass(fwd_pixels, fwd_weight_sums, *this, luts, false);
 
-	fwd_pass.join();
+	// Reverse pass, but otherwise the same as the forward pass.
+	std::vector<float> rev_weight_sums(width * height);
+	std::vector<float> rev_pixels(width * height);
+	lp_pass(rev_pixels, rev_weight_sums, *this, luts, true);
 
 	// Combine.
-	unsigned int off = 0;
-	for (int y = 0; y < height; y++)
-	{
-		for (int x = 0; x < width; x++, off++)
+	ParallelRows(height, [&](unsigned int begin, unsigned int end) {
+		for (unsigned int off = begin * width; off < end * width; off++)
 			out.P(off) = (fwd_pixels[off] * fwd_weight_sums[off] + rev_pixels[off] * rev_weight_sums[off]) /
 						 (fwd_weight_sums[off] + rev_weight_sums[off]);
-	}
+	});
 
 	return out;
 }
@@ -266,8 +344,17 @@ Histogram HdrImage::CalculateHistogram() const
 {
 	std::vector<uint32_t> bins(dynamic_range);
 	std::fill(bins.begin(), bins.end(), 0);
-	for (int i = 0; i < width * height; i++)
-		bins[P(i)]++;
+	std::mutex mutex;
+
+	// Each band counts into bins of its own, which are added up at the end.
+	ParallelRows(height, [&](unsigned int begin, unsigned int end) {
+		std::vector<uint32_t> band_bins(dynamic_range);
+		AccumulateHistogram(&pixels[begin * width], (end - begin) * width, &band_bins[0], dynamic_range);
+		std::lock_guard<std::mutex> lock(mutex);
+		for (int i = 0; i < dynamic_range; i++)
+			bins[i] += band_bins[i];
+	}, 128);
+
 	return Histogram(&bins[0], dynamic_range);
 }
 
@@ -302,38 +389,42 @@ void HdrImage::Tonemap(HdrImage const &lp, HdrConfig const &config)
 {
 	Pwl tonemap = CreateTonemap(config.global_tonemap);
 
-	// Make LUTs for the all the Pwls, it'll be much quicker.
-	std::vector<int> tonemap_lut = tonemap.GenerateLut<int>();
-	std::vector<double> pos_strength_lut = config.local_tonemap.pos_strength.GenerateLut<double>();
-	std::vector<double> neg_strength_lut = config.local_tonemap.neg_strength.GenerateLut<double>();
+	// Make LUTs for the all the Pwls, it'll be much quicker. The strengths need no more than single precision, which
+	// keeps the tables small enough to stay in cache, and the tables clamp any pixel beyond the ends of their Pwls.
+	PwlLut<int> tonemap_lut(tonemap);
+	PwlLut<float> pos_strength_lut(config.local_tonemap.pos_strength);
+	PwlLut<float> neg_strength_lut(config.local_tonemap.neg_strength);
 	double colour_scale = config.local_tonemap.colour_scale;
 
 	int maxval = dynamic_range - 1;
-	for (int y = 0; y < height; y++)
-	{
-		unsigned int off_Y = y * width;
-		unsigned int off_U = y * width / 4 + width * height;
-		unsigned int off_V = off_U + width * height / 4;
-		for (int x = 0; x < width; x++, off_Y++)
+	// Bands start on even rows, so that each one does whole rows of chroma.
+	ParallelRows(height, [&](unsigned int begin, unsigned int end) {
+		for (int y = begin; y < (int)end; y++)
 		{
-			int Y_lp_orig = lp.P(off_Y), Y_hp = P(off_Y) - Y_lp_orig;
-			int Y_lp_mapped = tonemap_lut[Y_lp_orig];
-			double strength = (Y_hp > 0 ? pos_strength_lut : neg_strength_lut)[Y_lp_orig];
-			int Y_final = std::clamp(Y_lp_mapped + (int)(strength * Y_hp), 0, maxval);
-			P(off_Y) = Y_final;
-			if (!(x & 1) && !(y & 1))
+			unsigned int off_Y = y * width;
+			unsigned int off_U = y * width / 4 + width * height;
+			unsigned int off_V = off_U + width * height / 4;
+			for (int x = 0; x < width; x++, off_Y++)
 			{
-				double f = (Y_final + 1) / (double)(Y_lp_orig + 1);
-				// The values here are non-linear to colours can come out slightly saturated.
-				// The colour_scale allows us to tweak that a little if we want.
-				f = (f - 1) * colour_scale + 1;
-				int U = P(off_U), V = P(off_V);
-				P(off_U) = U * f;
-				P(off_V) = V * f;
-				off_U++, off_V++;
+				int Y_lp_orig = lp.P(off_Y), Y_hp = P(off_Y) - Y_lp_orig;
+				int Y_lp_mapped = tonemap_lut[Y_lp_orig];
+				float strength = (Y_hp > 0 ? pos_strength_lut : neg_strength_lut)[Y_lp_orig];
+				int Y_final = std::clamp(Y_lp_mapped + (int)(strength * Y_hp), 0, maxval);
+				P(off_Y) = Y_final;
+				if (!(x & 1) && !(y & 1))
+				{
+					double f = (Y_final + 1) / (double)(Y_lp_orig + 1);
+					// The values here are non-linear to colours can come out slightly saturated.
+					// The colour_scale allows us to tweak that a little if we want.
+					f = (f - 1) * colour_scale + 1;
+					int U = P(off_U), V = P(off_V);
+					P(off_U) = U * f;
+					P(off_V) = V * f;
+					off_U++, off_V++;
+				}
 			}
 		}
-	}
+	}, 32, 2);
 }
 
 // Write image back out to 8-bit buffer with given stride.
@@ -346,31 +437,40 @@ void HdrImage::Extract(uint8_t *dest, int stride) const
 	uint8_t *dest_y = dest;
 	uint8_t *dest_u = dest_y + stride * height, *dest_v = dest_u + stride * height / 4;
 
-	for (int y = 0; y < height; y++, dest_y += stride)
-	{
-		for (int x = 0; x < width; x++)
-			dest_y[x] = *(Y_ptr++) / ratio;
-	}
+	ParallelRows(height, [&](unsigned int begin, unsigned int end) {
+		for (unsigned int y = begin; y < end; y++)
+		{
+			for (int x = 0; x < width; x++)
+				dest_y[y * stride + x] = Y_ptr[y * width + x] / ratio;
+		}
+	});
 
 	int w = width / 2, h = height / 2, s = stride / 2;
-	for (int y = 0; y < h; y++, dest_u += s, dest_v += s)
-	{
-		for (int x = 0; x < w; x++)
+	ParallelRows(h, [&](unsigned int begin, unsigned int end) {
+		for (unsigned int y = begin; y < end; y++)
 		{
-			int U = *(U_ptr++) / ratio;
-			int V = *(V_ptr++) / ratio;
-			dest_u[x] = std::clamp(U + 128, 0, 255);
-			dest_v[x] = std::clamp(V + 128, 0, 255);
+			for (int x = 0; x < w; x++)
+			{
+				int U = U_ptr[y * w + x] / ratio;
+				int V = V_ptr[y * w + x] / ratio;
+				dest_u[y * s + x] = std::clamp(U + 128, 0, 255);
+				dest_v[y * s + x] = std::clamp(V + 128, 0, 255);
+			}
 		}
-	}
+	});
 }
 
 // Apply simple scaling to all pixels.
 
 void HdrImage::Scale(double factor)
 {
-	for (unsigned int i = 0; i < pixels.size(); i++)
-		pixels[i] *= factor;
+	constexpr unsigned int block = 65536;
+	unsigned int blocks = (pixels.size() + block - 1) / block;
+	ParallelRows(blocks, [&](unsigned int begin, unsigned int end) {
+		unsigned int last = std::min<size_t>(end * block, pixels.size());
+		for (unsigned int i = begin * block; i < last; i++)
+			pixels[i] *= factor;
+	}, 1);
 	dynamic_range *= factor;
 }
 
@@ -390,12 +490,17 @@ public:
 	bool Process(CompletedRequestPtr &completed_request) override;
 
 private:
+	void processStreaming(libcamera::Span<uint8_t> buffer);
+
 	Stream *stream_;
 	StreamInfo info_;
 	HdrConfig config_;
 	unsigned int frame_num_;
 	std::mutex mutex_;
 	HdrImage acc_, lp_;
+	// In the "window" streaming mode, the frames currently in the accumulator, oldest first.
+	std::deque<std::vector<uint8_t>> history_;
+	HdrImage work_;
 };
 
 #define NAME "hdr"
@@ -437,6 +542,13 @@ void HdrStage::Read(boost::property_tree::ptree const &params)
 	});
 
 	config_.jpeg_filename = params.get<std::string>("jpeg_filename", "");
+
+	config_.streaming = params.get<std::string>("streaming", "off");
+	if (config_.streaming != "off" && config_.streaming != "window" && config_.streaming != "exponential")
+		throw std::runtime_error("HdrStage: streaming must be off, window or exponential");
+	config_.streaming_lp_levels = params.get<unsigned int>("streaming_lp_levels", 2);
+	if (config_.num_frames == 0)
+		throw std::runtime_error("HdrStage: num_frames must be at least 1");
 }
 
 void HdrStage::AdjustConfig(std::string const &use_case, StreamConfiguration *config)
@@ -449,7 +561,15 @@ void HdrStage::AdjustConfig(std::string const &use_case, StreamConfiguration *co
 
 void HdrStage::Configure()
 {
-	stream_ = app_->StillStream(&info_);
+	// Streaming HDR works on whatever the main stream is, so will run in video and timelapse modes too.
+	if (config_.streaming != "off")
+	{
+		stream_ = app_->GetMainStream();
+		if (stream_)
+			info_ = app_->GetStreamInfo(stream_);
+	}
+	else
+		stream_ = app_->StillStream(&info_);
 	if (!stream_)
 		return;
 	if (stream_->configuration().pixelFormat != libcamera::formats::YUV420)
@@ -460,6 +580,7 @@ void HdrStage::Configure()
 	acc_ = HdrImage(info_.width, info_.height, info_.width * info_.height * 3 / 2);
 	acc_.Clear();
 	lp_ = HdrImage(info_.width, info_.height, info_.width * info_.height);
+	history_.clear();
 }
 
 bool HdrStage::Process(CompletedRequestPtr &completed_request)
@@ -469,6 +590,13 @@ bool HdrStage::Process(CompletedRequestPtr &completed_request)
 
 	std::lock_guard<std::mutex> lock(mutex_);
 
+	if (config_.streaming != "off")
+	{
+		BufferWriteSync w(app_, completed_request->buffers[stream_]);
+		processStreaming(w.Get()[0]);
+		return false;
+	}
+
 	// Once the HDR frame has been done it's not clear what to do... so let's just
 	// send the subsequent frames through unmodified.
 	if (frame_num_ >= config_.num_frames)
@@ -516,6 +644,50 @@ bool HdrStage::Process(CompletedRequestPtr &completed_request)
 	return false;
 }
 
+// Streaming HDR produces an output for every frame, from a running accumulation of the last num_frames frames.
+// The "window" mode keeps copies of them so that the oldest can be taken out again; the "exponential" mode just
+// lets older frames fade away. The low pass filter, by far the most expensive part, runs on a decimated version of
+// the image, which is upsampled again for the local tonemap.
+
+void HdrStage::processStreaming(libcamera::Span<uint8_t> buffer)
+{
+	uint8_t *image = buffer.data();
+
+	if (config_.streaming == "window")
+	{
+		std::vector<uint8_t> frame;
+		if (history_.size() >= config_.num_frames)
+		{
+			frame = std::move(history_.front());
+			history_.pop_front();
+			acc_.Remove(frame.data(), info_.stride);
+		}
+		frame.assign(image, image + buffer.size());
+		history_.push_back(std::move(frame));
+	}
+	else if (frame_num_)
+		acc_.Decay(config_.num_frames);
+	acc_.Accumulate(image, info_.stride);
+	frame_num_++;
+
+	// Bring the dynamic range to 4096, as the one-shot mode does for its recommended number of frames.
+	work_ = acc_;
+	work_.Scale(4096.0 / work_.dynamic_range);
+
+	if (config_.streaming_lp_levels)
+	{
+		HdrImage level = work_.Downsample();
+		for (unsigned int i = 1; i < config_.streaming_lp_levels && level.width >= 32 && level.height >= 32; i++)
+			level = level.Downsample();
+		lp_ = level.LpFilter(config_.lp_filter).Upsample(work_.width, work_.height);
+	}
+	else
+		lp_ = work_.LpFilter(config_.lp_filter);
+
+	work_.Tonemap(lp_, config_);
+	work_.Extract(image, info_.stride);
+}
+
 static PostProcessingStage *Create(RPiCamApp *app)
 {
 	return new HdrStage(app);
@@ -7,6 +7,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <algorithm>
 #include <vector>
 #include <cassert>
 
@@ -38,3 +39,32 @@ public:
 private:
 	std::vector<uint64_t> cumulative_;
 };
+
+// Count n values, each shifted right by "shift", into bins (adding to what is there
+// already). Values beyond the last bin are counted in it. Four sets of counters take
+// the values in turn, so that runs of equal pixels, as flat areas of an image give,
+// don't keep stalling on the same counter.
+template<typename T>
+void AccumulateHistogram(T const *values, unsigned int n, uint32_t *bins,
+			 unsigned int num_bins, unsigned int shift = 0)
+{
+	assert(num_bins);
+	std::vector<uint32_t> sub(3 * num_bins);
+	uint32_t *sub0 = bins, *sub1 = &sub[0], *sub2 = sub1 + num_bins,
+		 *sub3 = sub2 + num_bins;
+	unsigned int last = num_bins - 1, i = 0;
+	auto bin = [&](T value) {
+		return std::min<unsigned int>((unsigned int)value >> shift, last);
+	};
+	for (; i + 4 <= n; i += 4)
+	{
+		sub0[bin(values[i])]++;
+		sub1[bin(values[i + 1])]++;
+		sub2[bin(values[i + 2])]++;
+		sub3[bin(values[i + 3])]++;
+	}
+	for (; i < n; i++)
+		sub0[bin(values[i])]++;
+	for (unsigned int b = 0; b < num_bins; b++)
+		bins[b] += sub1[b] + sub2[b] + sub3[b];
+}
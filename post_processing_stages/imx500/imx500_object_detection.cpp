@@ -56,8 +56,8 @@ public:
 	bool Process(CompletedRequestPtr &completed_request) override;
 
 private:
-	int processOutputTensor(std::vector<Detection> &objects, const std::vector<float> &output_tensor,
-							const CnnOutputTensorInfo &output_tensor_info, const Rectangle &scaler_crop) const;
+	int processOutputTensor(std::vector<Detection> &objects, libcamera::Span<const float> output_tensor,
+							const CnnOutputTensorInfo &output_tensor_info, const Rectangle &scaler_crop);
 	void filterOutputObjects(std::vector<Detection> &objects);
 
 	struct LtObject
@@ -70,6 +70,8 @@ private:
 
 	std::vector<LtObject> lt_objects_;
 	std::mutex lt_lock_;
+	// Decoded from each frame's output tensor in turn, under lt_lock_, so that it keeps its allocations.
+	ObjectDetectionOutput decoded_;
 
 	// Config params
 	unsigned int max_detections_;
@@ -128,20 +130,16 @@ bool ObjectDetection::Process(CompletedRequestPtr &completed_request)
 		return false;
 	}
 
-	auto output = completed_request->metadata.get(controls::rpi::CnnOutputTensor);
-	auto info = completed_request->metadata.get(controls::rpi::CnnOutputTensorInfo);
+	OutputTensorView output = GetOutputTensors(completed_request);
 	std::vector<Detection> objects;
 
 	// Process() can be concurrently called through different threads for consecutive CompletedRequests if
 	// things are running behind.  So protect access to the lt_objects_ state object.
 	std::scoped_lock<std::mutex> l(lt_lock_);
 
-	if (output && info)
+	if (!output.data.empty() && output.info)
 	{
-		std::vector<float> output_tensor(output->data(), output->data() + output->size());
-		CnnOutputTensorInfo output_tensor_info = *reinterpret_cast<const CnnOutputTensorInfo *>(info->data());
-
-		processOutputTensor(objects, output_tensor, output_tensor_info, *scaler_crop);
+		processOutputTensor(objects, output.data, *output.info, *scaler_crop);
 
 		if (temporal_filtering_)
 		{
@@ -181,39 +179,26 @@ bool ObjectDetection::Process(CompletedRequestPtr &completed_request)
 	return IMX500PostProcessingStage::Process(completed_request);
 }
 
-static int createObjectDetectionData(ObjectDetectionOutput &output, const std::vector<float> &data,
+static int createObjectDetectionData(ObjectDetectionOutput &output, libcamera::Span<const float> data,
 									 unsigned int total_detections)
 {
-	unsigned int count = 0;
-
-	// Extract bounding box co-ordinates
-	for (unsigned int i = 0; i < total_detections; i++)
-	{
-		Bbox bbox;
-		bbox.y0 = data.at(count + i);
-		bbox.x0 = data.at(count + i + (1 * total_detections));
-		bbox.y1 = data.at(count + i + (2 * total_detections));
-		bbox.x1 = data.at(count + i + (3 * total_detections));
-		output.bboxes.push_back(bbox);
-	}
-	count += (total_detections * 4);
-
-	// Extract scores
+	// The caller has checked the size of the tensor.
+	const float *y0 = data.data();
+	const float *x0 = y0 + total_detections;
+	const float *y1 = x0 + total_detections;
+	const float *x1 = y1 + total_detections;
+	const float *scores = x1 + total_detections;
+	const float *classes = scores + total_detections;
+
+	// Extract bounding box co-ordinates, scores and class indices
+	output.bboxes.resize(total_detections);
 	for (unsigned int i = 0; i < total_detections; i++)
-	{
-		output.scores.push_back(data.at(count));
-		count++;
-	}
-
-	// Extract class indices
-	for (unsigned int i = 0; i < total_detections; i++)
-	{
-		output.classes.push_back(data.at(count));
-		count++;
-	}
+		output.bboxes[i] = { x0[i], y0[i], x1[i], y1[i] };
+	output.scores.assign(scores, scores + total_detections);
+	output.classes.assign(classes, classes + total_detections);
 
 	// Extract number of detections
-	unsigned int num_detections = data.at(count);
+	unsigned int num_detections = classes[total_detections];
 	if (num_detections > total_detections)
 	{
 		LOG(1, "Unexpected value for num_detections: " << num_detections << ", setting it to " << total_detections);
@@ -224,9 +209,8 @@ static int createObjectDetectionData(ObjectDetectionOutput &output, const std::v
 	return 0;
 }
 
-int ObjectDetection::processOutputTensor(std::vector<Detection> &objects, const std::vector<float> &output_tensor,
-										 const CnnOutputTensorInfo &output_tensor_info,
-										 const Rectangle &scaler_crop) const
+int ObjectDetection::processOutputTensor(std::vector<Detection> &objects, libcamera::Span<const float> output_tensor,
+										 const CnnOutputTensorInfo &output_tensor_info, const Rectangle &scaler_crop)
 {
 	if (output_tensor_info.num_tensors != 4)
 	{
@@ -235,7 +219,7 @@ int ObjectDetection::processOutputTensor(std::vector<Detection> &objects, const
 	}
 
 	const unsigned int total_detections = output_tensor_info.info[0].tensor_data_num / 4;
-	ObjectDetectionOutput output;
+	ObjectDetectionOutput &output = decoded_;
 
 	// 4x coords + 1x labels + 1x confidences + 1 total detections
 	if (output_tensor.size() != 6 * total_detections + 1)
@@ -5,6 +5,13 @@
  * imx500_posenet.cpp - IMX500 inference for PoseNet
  */
 
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#define HAVE_NEON_KERNELS 1
+#endif
+
 #include <algorithm>
 #include <array>
 #include <cmath>
@@ -166,23 +173,95 @@ float squared_distance(const Point &a, const Point &b)
 	return dy * dy + dx * dx;
 }
 
-std::vector<float> format_tensor(const float *data, unsigned int size, unsigned int div)
+// Rearranges one column (fixed x) of the network's channel-major output into the channel-minor layout the decoder
+// reads, dividing by div on the way. Does as many whole blocks of 4 channels by 4 rows as fit and returns how many
+// channels and rows those cover. Whatever is left is finished off by the C code in format_tensor.
+typedef void (*FormatColumnFn)(float *, const float *, unsigned int, float, unsigned int *, unsigned int *);
+
+void format_column_c(float *, const float *, unsigned int, float, unsigned int *channels_done,
+					 unsigned int *rows_done)
+{
+	*channels_done = *rows_done = 0;
+}
+
+#if HAVE_NEON_KERNELS
+
+void format_column_neon(float *dst, const float *src, unsigned int size, float div, unsigned int *channels_done,
+						unsigned int *rows_done)
 {
-	std::vector<float> tensor(size * MAP_SIZE.width * MAP_SIZE.height);
+	constexpr unsigned int plane = MAP_SIZE.width * MAP_SIZE.height;
+	const unsigned int row = size * MAP_SIZE.width;
+	const float32x4_t d = vdupq_n_f32(div);
+	const unsigned int channels = size & ~3u, rows = MAP_SIZE.height & ~3u;
 
-	for (unsigned int i = 0; i < size; i++)
+	for (unsigned int c = 0; c < channels; c += 4)
 	{
-		for (unsigned int j = 0; j < MAP_SIZE.width; j++)
+		for (unsigned int k = 0; k < rows; k += 4)
 		{
-			for (unsigned int k = 0; k < MAP_SIZE.height; k++)
-			{
-				tensor[(size * MAP_SIZE.width * k) + (size * j) + i] =
-					data[(MAP_SIZE.width * MAP_SIZE.height * i) + (j * MAP_SIZE.height) + k] / div;
-			}
+			// Rows of the block are channels, and we want its columns.
+			float32x4_t r0 = vld1q_f32(src + c * plane + k);
+			float32x4_t r1 = vld1q_f32(src + (c + 1) * plane + k);
+			float32x4_t r2 = vld1q_f32(src + (c + 2) * plane + k);
+			float32x4_t r3 = vld1q_f32(src + (c + 3) * plane + k);
+			float64x2_t t0 = vreinterpretq_f64_f32(vtrn1q_f32(r0, r1));
+			float64x2_t t1 = vreinterpretq_f64_f32(vtrn2q_f32(r0, r1));
+			float64x2_t t2 = vreinterpretq_f64_f32(vtrn1q_f32(r2, r3));
+			float64x2_t t3 = vreinterpretq_f64_f32(vtrn2q_f32(r2, r3));
+			vst1q_f32(dst + k * row + c, vdivq_f32(vreinterpretq_f32_f64(vtrn1q_f64(t0, t2)), d));
+			vst1q_f32(dst + (k + 1) * row + c, vdivq_f32(vreinterpretq_f32_f64(vtrn1q_f64(t1, t3)), d));
+			vst1q_f32(dst + (k + 2) * row + c, vdivq_f32(vreinterpretq_f32_f64(vtrn2q_f64(t0, t2)), d));
+			vst1q_f32(dst + (k + 3) * row + c, vdivq_f32(vreinterpretq_f32_f64(vtrn2q_f64(t1, t3)), d));
 		}
 	}
 
-	return tensor;
+	*channels_done = channels;
+	*rows_done = rows;
+}
+
+#endif /* HAVE_NEON_KERNELS */
+
+FormatColumnFn select_format_column()
+{
+#if HAVE_NEON_KERNELS
+	if (getauxval(AT_HWCAP) & HWCAP_ASIMD)
+	{
+		LOG(2, "PoseNet: using NEON kernels");
+		return format_column_neon;
+	}
+#endif
+	LOG(2, "PoseNet: using C kernels");
+	return format_column_c;
+}
+
+FormatColumnFn format_column()
+{
+	static const FormatColumnFn fn = select_format_column();
+	return fn;
+}
+
+// Reorders the output tensor from [size][width][height] to [height][width][size] into a buffer that is kept from one
+// frame to the next.
+void format_tensor(std::vector<float> &tensor, const float *data, unsigned int size, unsigned int div)
+{
+	constexpr unsigned int plane = MAP_SIZE.width * MAP_SIZE.height;
+	const unsigned int row = size * MAP_SIZE.width;
+
+	tensor.resize(size * plane);
+
+	for (unsigned int j = 0; j < MAP_SIZE.width; j++)
+	{
+		float *dst = tensor.data() + size * j;
+		const float *src = data + j * MAP_SIZE.height;
+		unsigned int channels_done, rows_done;
+
+		format_column()(dst, src, size, div, &channels_done, &rows_done);
+
+		for (unsigned int k = 0; k < MAP_SIZE.height; k++)
+		{
+			for (unsigned int i = k < rows_done ? channels_done : 0; i < size; i++)
+				dst[k * row + i] = src[i * plane + k] / div;
+		}
+	}
 }
 
 // Build an adjacency list of the pose graph.
@@ -201,7 +280,7 @@ AdjacencyList build_agency_list()
 	return adjacency_list;
 }
 
-bool pass_keypoint_nms(std::vector<PoseKeypoints> poses, const size_t num_poses, const KeypointWithScore &keypoint,
+bool pass_keypoint_nms(const std::vector<PoseKeypoints> &poses, const size_t num_poses, const KeypointWithScore &keypoint,
 					   const float squared_nms_radius)
 {
 	for (unsigned int i = 0; i < num_poses; ++i)
@@ -265,9 +344,10 @@ void build_bilinear_interpolation(const Point point, const unsigned int num_chan
 // sample its value at tensor(y, x, c), for c in the channels specified. This
 // is faster than calling the single channel interpolation function multiple
 // times because the computation of the positions needs to be done only once.
-std::vector<float> sample_tensor_at_multiple_channels(const std::vector<float> &tensor, const Point &point,
-													  const std::vector<int> &result_channels,
-													  unsigned int num_channels)
+template <size_t N>
+std::array<float, N> sample_tensor_at_multiple_channels(const std::vector<float> &tensor, const Point &point,
+														const std::array<int, N> &result_channels,
+														unsigned int num_channels)
 {
 	int top_left, top_right, bottom_left, bottom_right;
 	float y_lerp, x_lerp;
@@ -275,11 +355,12 @@ std::vector<float> sample_tensor_at_multiple_channels(const std::vector<float> &
 	build_bilinear_interpolation(point, num_channels, &top_left, &top_right, &bottom_left, &bottom_right, &y_lerp,
 								 &x_lerp);
 
-	std::vector<float> result;
-	for (auto &c : result_channels)
+	std::array<float, N> result;
+	for (size_t i = 0; i < N; i++)
 	{
-		result.push_back((1 - y_lerp) * ((1 - x_lerp) * tensor[top_left + c] + x_lerp * tensor[top_right + c]) +
-						 y_lerp * ((1 - x_lerp) * tensor[bottom_left + c] + x_lerp * tensor[bottom_right + c]));
+		const int c = result_channels[i];
+		result[i] = (1 - y_lerp) * ((1 - x_lerp) * tensor[top_left + c] + x_lerp * tensor[top_right + c]) +
+					y_lerp * ((1 - x_lerp) * tensor[bottom_left + c] + x_lerp * tensor[bottom_right + c]);
 	}
 
 	return result;
@@ -291,8 +372,7 @@ std::vector<float> sample_tensor_at_multiple_channels(const std::vector<float> &
 float sample_tensor_at_single_channel(const std::vector<float> &tensor, const Point &point, unsigned int num_channels,
 									  const int c)
 {
-	std::vector<float> result = sample_tensor_at_multiple_channels(tensor, point, std::vector<int> { c }, num_channels);
-	return result[0];
+	return sample_tensor_at_multiple_channels<1>(tensor, point, { c }, num_channels)[0];
 }
 
 KeypointQueue build_keypoint_queue(const std::vector<float> &scores, const std::vector<float> &short_offsets,
@@ -306,6 +386,14 @@ KeypointQueue build_keypoint_queue(const std::vector<float> &scores, const std::
 	{
 		for (unsigned int x = 0; x < MAP_SIZE.width; ++x)
 		{
+			// Most positions have no keypoint candidates at all, so don't bother looking at them one by one.
+			const float *position_scores = scores.data() + score_index;
+			if (*std::max_element(position_scores, position_scores + NUM_KEYPOINTS) < score_threshold)
+			{
+				score_index += NUM_KEYPOINTS;
+				continue;
+			}
+
 			unsigned int offset_index = 2 * score_index;
 			for (unsigned int j = 0; j < NUM_KEYPOINTS; ++j)
 			{
@@ -360,10 +448,10 @@ Point find_displaced_position(const std::vector<float> &short_offsets, const std
 	float y = source.y, x = source.x;
 
 	// Follow the mid-range offsets.
-	std::vector<int> channels = { edge_id, NUM_EDGES + edge_id };
+	std::array<int, 2> channels = { edge_id, NUM_EDGES + edge_id };
 
 	// Total size of mid_offsets is height x width x 2*2*num_edges
-	std::vector<float> offsets = sample_tensor_at_multiple_channels(mid_offsets, source, channels, 2 * 2 * NUM_EDGES);
+	std::array<float, 2> offsets = sample_tensor_at_multiple_channels(mid_offsets, source, channels, 2 * 2 * NUM_EDGES);
 	y = std::clamp(y + offsets[0], 0.0f, MAP_SIZE.height - 1.0f);
 	x = std::clamp(x + offsets[1], 0.0f, MAP_SIZE.width - 1.0f);
 
@@ -385,7 +473,7 @@ void backtrack_decode_pose(const std::vector<float> &scores, const std::vector<f
 						   const AdjacencyList &adjacency_list, PoseKeypoints &pose_keypoints,
 						   PoseKeypointScores &keypoint_scores, unsigned int offset_refinement_steps)
 {
-	const float root_score = sample_tensor_at_single_channel(scores, root.point, root.id, NUM_KEYPOINTS);
+	const float root_score = sample_tensor_at_single_channel(scores, root.point, NUM_KEYPOINTS, root.id);
 
 	// Used in order to put candidate keypoints in a priority queue w.r.t. their
 	// score. Keypoints with higher score have higher priority and will be
@@ -394,7 +482,7 @@ void backtrack_decode_pose(const std::vector<float> &scores, const std::vector<f
 	decode_queue.push(KeypointWithScore(root.point, root.id, root_score));
 
 	// Keeps track of the keypoints whose position has already been decoded.
-	std::vector<bool> keypoint_decoded(NUM_KEYPOINTS, false);
+	std::array<bool, NUM_KEYPOINTS> keypoint_decoded {};
 
 	while (!decode_queue.empty())
 	{
@@ -521,6 +609,14 @@ private:
 	std::vector<LtResults> lt_results_;
 	std::mutex lt_lock_;
 
+	// Decode buffers, kept from one frame to the next, and used under decode_lock_.
+	std::mutex decode_lock_;
+	std::vector<float> scores_;
+	std::vector<float> short_offsets_;
+	std::vector<float> mid_offsets_;
+	std::vector<PoseKeypoints> scratch_poses_;
+	std::vector<PoseKeypointScores> scratch_keypoint_scores_;
+
 	// Config params:
 	float threshold_;
 	unsigned int max_detections_;
@@ -581,27 +677,32 @@ bool PoseNet::Process(CompletedRequestPtr &completed_request)
 		return false;
 	}
 
-	auto output = completed_request->metadata.get(controls::rpi::CnnOutputTensor);
-	if (!output)
+	OutputTensorView output = GetOutputTensors(completed_request);
+	if (output.data.empty())
 	{
 		LOG_ERROR("No output tensor found in metadata!");
 		return false;
 	}
 
-	if (output->size() < NUM_HEATMAPS + NUM_SHORT_OFFSETS + NUM_MID_OFFSETS)
+	if (output.data.size() < NUM_HEATMAPS + NUM_SHORT_OFFSETS + NUM_MID_OFFSETS)
 	{
-		LOG_ERROR("Unexpected output tensor size: " << output->size());
+		LOG_ERROR("Unexpected output tensor size: " << output.data.size());
 		return false;
 	}
 
-	std::vector<float> scores =
-		format_tensor((float *)output->data(), NUM_HEATMAPS / (MAP_SIZE.width * MAP_SIZE.height), 1);
-	std::vector<float> short_offsets = format_tensor((float *)output->data() + NUM_HEATMAPS,
-													 NUM_SHORT_OFFSETS / (MAP_SIZE.width * MAP_SIZE.height), STRIDE);
-	std::vector<float> mid_offsets = format_tensor((float *)output->data() + NUM_HEATMAPS + NUM_SHORT_OFFSETS,
-												   NUM_MID_OFFSETS / (MAP_SIZE.width * MAP_SIZE.height), STRIDE);
+	std::vector<PoseResults> results;
+	{
+		std::scoped_lock<std::mutex> l(decode_lock_);
 
-	std::vector<PoseResults> results = decodeAllPoses(scores, short_offsets, mid_offsets);
+		const float *data = output.data.data();
+		format_tensor(scores_, data, NUM_HEATMAPS / (MAP_SIZE.width * MAP_SIZE.height), 1);
+		format_tensor(short_offsets_, data + NUM_HEATMAPS, NUM_SHORT_OFFSETS / (MAP_SIZE.width * MAP_SIZE.height),
+					  STRIDE);
+		format_tensor(mid_offsets_, data + NUM_HEATMAPS + NUM_SHORT_OFFSETS,
+					  NUM_MID_OFFSETS / (MAP_SIZE.width * MAP_SIZE.height), STRIDE);
+
+		results = decodeAllPoses(scores_, short_offsets_, mid_offsets_);
+	}
 	translateCoordinates(results, *scaler_crop);
 
 	std::vector<std::vector<libcamera::Point>> locations;
@@ -683,8 +784,10 @@ std::vector<PoseResults> PoseNet::decodeAllPoses(const std::vector<float> &score
 	// root part score order.
 	std::vector<float> all_instance_scores;
 
-	std::vector<PoseKeypoints> scratch_poses(NUM_KEYPOINTS);
-	std::vector<PoseKeypointScores> scratch_keypoint_scores(max_detections_);
+	std::vector<PoseKeypoints> &scratch_poses = scratch_poses_;
+	std::vector<PoseKeypointScores> &scratch_keypoint_scores = scratch_keypoint_scores_;
+	scratch_poses.resize(max_detections_);
+	scratch_keypoint_scores.resize(max_detections_);
 
 	unsigned int pose_counter = 0;
 	while (pose_counter < max_detections_ && !queue.empty())
@@ -166,6 +166,22 @@ bool IMX500PostProcessingStage::Process(CompletedRequestPtr &completed_request)
 	return false;
 }
 
+IMX500PostProcessingStage::OutputTensorView
+IMX500PostProcessingStage::GetOutputTensors(CompletedRequestPtr &completed_request)
+{
+	OutputTensorView view;
+
+	auto output = completed_request->metadata.get(controls::rpi::CnnOutputTensor);
+	if (output)
+		view.data = *output;
+
+	auto info = completed_request->metadata.get(controls::rpi::CnnOutputTensorInfo);
+	if (info && info->size() >= sizeof(CnnOutputTensorInfo))
+		view.info = reinterpret_cast<const CnnOutputTensorInfo *>(info->data());
+
+	return view;
+}
+
 Rectangle IMX500PostProcessingStage::ConvertInferenceCoordinates(const std::vector<float> &coords,
 																 const Rectangle &scaler_crop) const
 {
@@ -12,6 +12,7 @@
 
 #include <boost/property_tree/ptree.hpp>
 
+#include <libcamera/base/span.h>
 #include <libcamera/geometry.h>
 #include <libcamera/stream.h>
 
@@ -40,6 +41,17 @@ public:
 		OutputTensorInfo info[Max_Num_Tensors];
 	};
 
+	// The output tensors of a frame, used where they are in the request's metadata rather than copied out. The view
+	// is only good for as long as the request.
+	struct OutputTensorView
+	{
+		libcamera::Span<const float> data;
+		// Null if the frame came without the tensor info.
+		const CnnOutputTensorInfo *info = nullptr;
+	};
+
+	static OutputTensorView GetOutputTensors(CompletedRequestPtr &completed_request);
+
 	IMX500PostProcessingStage(RPiCamApp *app);
 	~IMX500PostProcessingStage();
 
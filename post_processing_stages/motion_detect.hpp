@@ -0,0 +1,44 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * motion_detect.hpp - motion detector tile result
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include <libcamera/geometry.h>
+
+#include "core/metadata.hpp"
+
+// Published as "motion_detect.tiles" alongside "motion_detect.result". The motion detector's region of interest is
+// cut into a grid of tiles, and each tile is flagged if enough of its pixels changed. Coordinates are in lores image
+// pixels; tiles in the last column and row may be cut short by the edge of the roi.
+struct MotionDetectTiles
+{
+	libcamera::Rectangle roi;
+	unsigned int tile_width;
+	unsigned int tile_height;
+	unsigned int columns;
+	unsigned int rows;
+	// One entry per tile, row by row, non-zero where there was motion.
+	std::vector<uint8_t> active;
+
+	bool Active(unsigned int column, unsigned int row) const { return active[row * columns + column]; }
+	libcamera::Rectangle Tile(unsigned int column, unsigned int row) const
+	{
+		int x = roi.x + column * tile_width, y = roi.y + row * tile_height;
+		return libcamera::Rectangle(x, y, std::min<unsigned int>(tile_width, roi.x + roi.width - x),
+									std::min<unsigned int>(tile_height, roi.y + roi.height - y));
+	}
+};
+
+namespace metadata_tags
+{
+inline constexpr MetadataTag<bool> motion_detect_result("motion_detect.result");
+inline constexpr MetadataTag<MotionDetectTiles> motion_detect_tiles("motion_detect.tiles");
+} // namespace metadata_tags
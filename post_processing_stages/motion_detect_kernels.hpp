@@ -0,0 +1,24 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * motion_detect_kernels.hpp - pixel kernels for the motion detector
+ */
+
+#pragma once
+
+#include <cstdint>
+
+// A pixel is different when |new - old| > limit[old], where the limits come from difference_m and difference_c.
+// Tabulating them keeps the float arithmetic out of the loops and means it vectorises easily. NEON versions are used
+// when the CPU has them, otherwise the plain C ones.
+struct MotionDetectKernels
+{
+	// Copy every hskip'th pixel of a row.
+	void (*gather_row)(uint8_t const *src, uint8_t *dest, unsigned int width, unsigned int hskip);
+	// Count the different pixels in a row, given the 256 entry limit table.
+	unsigned int (*count_row)(uint8_t const *old_row, uint8_t const *new_row, uint8_t const *limit,
+							  unsigned int width);
+};
+
+MotionDetectKernels const &motion_detect_kernels();
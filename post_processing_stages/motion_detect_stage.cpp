@@ -15,19 +15,122 @@
 // Because this gets run in parallel by the post-processing framework, it means
 // the "previous frame" is not totally guaranteed to be the actual previous one,
 // though in practice it is, and it doesn't actually matter even if it wasn't.
+// The lock is only held to swap in the new frame, so the comparisons themselves
+// really do run in parallel.
 
 // The stage adds "motion_detect.result" to the metadata. When this claims motion,
 // the application can take that as true immediately. To be sure there's no motion,
 // an application should probably wait for "a few frames" of "no motion".
 
+// The roi is also cut into tiles of tile_width x tile_height (subsampled) pixels, and
+// "motion_detect.tiles" says which of them saw motion (see motion_detect.hpp), so that
+// later stages can restrict themselves to the active parts of the image. A tile counts
+// as active when tile_threshold of its pixels are different. Set tile_width to 0 to
+// turn this off, in which case we stop looking as soon as region_threshold is reached.
+
+#include <cmath>
+#include <cstring>
+#include <memory>
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#define HAVE_NEON_KERNELS 1
+#endif
+
 #include <libcamera/stream.h>
 
 #include "core/rpicam_app.hpp"
 
+#include "post_processing_stages/motion_detect.hpp"
+#include "post_processing_stages/motion_detect_kernels.hpp"
 #include "post_processing_stages/post_processing_stage.hpp"
 
 using Stream = libcamera::Stream;
 
+// Pixel kernels (see motion_detect_kernels.hpp).
+
+static void gather_row_c(uint8_t const *src, uint8_t *dest, unsigned int width, unsigned int hskip)
+{
+	for (unsigned int x = 0; x < width; x++, src += hskip)
+		dest[x] = *src;
+}
+
+static unsigned int count_row_c(uint8_t const *old_row, uint8_t const *new_row, uint8_t const *limit,
+								unsigned int width)
+{
+	unsigned int count = 0;
+	for (unsigned int x = 0; x < width; x++)
+		count += std::abs(new_row[x] - old_row[x]) > limit[old_row[x]];
+	return count;
+}
+
+#if HAVE_NEON_KERNELS
+
+static void gather_row_neon(uint8_t const *src, uint8_t *dest, unsigned int width, unsigned int hskip)
+{
+	if (hskip == 1)
+		memcpy(dest, src, width);
+	else if (hskip == 2)
+	{
+		unsigned int x = 0;
+		for (; x + 16 <= width; x += 16)
+			vst1q_u8(dest + x, vld2q_u8(src + 2 * x).val[0]);
+		gather_row_c(src + 2 * x, dest + x, width - x, 2);
+	}
+	else
+		gather_row_c(src, dest, width, hskip);
+}
+
+static unsigned int count_row_neon(uint8_t const *old_row, uint8_t const *new_row, uint8_t const *limit,
+								   unsigned int width)
+{
+	// The 256 entry table takes four 64 byte lookups. Indices out of range leave the result alone, so each lookup just
+	// fills in its own quarter.
+	uint8x16x4_t t0 = vld1q_u8_x4(limit), t1 = vld1q_u8_x4(limit + 64);
+	uint8x16x4_t t2 = vld1q_u8_x4(limit + 128), t3 = vld1q_u8_x4(limit + 192);
+	uint8x16_t quarter = vdupq_n_u8(64), half = vdupq_n_u8(128), three_quarters = vdupq_n_u8(192);
+	unsigned int count = 0, x = 0, end = width & ~15;
+	while (x < end)
+	{
+		// Byte counters, so empty them before they can overflow.
+		uint8x16_t acc = vdupq_n_u8(0);
+		for (unsigned int stop = std::min(end, x + 255 * 16); x < stop; x += 16)
+		{
+			uint8x16_t o = vld1q_u8(old_row + x), n = vld1q_u8(new_row + x);
+			uint8x16_t l = vqtbl4q_u8(t0, o);
+			l = vqtbx4q_u8(l, t1, vsubq_u8(o, quarter));
+			l = vqtbx4q_u8(l, t2, vsubq_u8(o, half));
+			l = vqtbx4q_u8(l, t3, vsubq_u8(o, three_quarters));
+			acc = vsubq_u8(acc, vcgtq_u8(vabdq_u8(n, o), l));
+		}
+		count += vaddlvq_u8(acc);
+	}
+	return count + count_row_c(old_row + x, new_row + x, limit, width - x);
+}
+
+#endif /* HAVE_NEON_KERNELS */
+
+static MotionDetectKernels select_kernels()
+{
+#if HAVE_NEON_KERNELS
+	if (getauxval(AT_HWCAP) & HWCAP_ASIMD)
+	{
+		LOG(2, "Motion detect: using NEON kernels");
+		return { gather_row_neon, count_row_neon };
+	}
+#endif
+	LOG(2, "Motion detect: using C kernels");
+	return { gather_row_c, count_row_c };
+}
+
+MotionDetectKernels const &motion_detect_kernels()
+{
+	static const MotionDetectKernels k = select_kernels();
+	return k;
+}
+
 class MotionDetectStage : public PostProcessingStage
 {
 public:
@@ -42,7 +145,8 @@ public:
 	bool Process(CompletedRequestPtr &completed_request) override;
 
 private:
-	// In the Config, dimensions are given as fractions of the lores image size.
+	// In the Config, dimensions are given as fractions of the lores image size, except for
+	// the tiles which are in pixels of the subsampled image.
 	struct Config
 	{
 		float roi_x, roi_y;
@@ -51,6 +155,8 @@ private:
 		float difference_m;
 		int difference_c;
 		float region_threshold;
+		int tile_width, tile_height;
+		float tile_threshold;
 		int frame_period;
 		bool verbose;
 		std::string region_name;
@@ -62,7 +168,12 @@ private:
 	unsigned int roi_x_, roi_y_;
 	unsigned int roi_width_, roi_height_;
 	unsigned int region_threshold_;
-	std::vector<uint8_t> previous_frame_;
+	// Without tile output the whole roi is treated as a single tile.
+	unsigned int tile_width_, tile_height_;
+	unsigned int tile_columns_, tile_rows_;
+	std::vector<unsigned int> tile_thresholds_;
+	uint8_t limit_[256];
+	std::shared_ptr<std::vector<uint8_t>> previous_frame_;
 	bool first_time_;
 	bool motion_detected_;
 	std::mutex mutex_;
@@ -86,6 +197,9 @@ void MotionDetectStage::Read(boost::property_tree::ptree const &params)
 	config_.difference_m = params.get<float>("difference_m", 0.1);
 	config_.difference_c = params.get<int>("difference_c", 10);
 	config_.region_threshold = params.get<float>("region_threshold", 0.005);
+	config_.tile_width = params.get<int>("tile_width", 16);
+	config_.tile_height = params.get<int>("tile_height", config_.tile_width);
+	config_.tile_threshold = params.get<float>("tile_threshold", config_.region_threshold);
 	config_.frame_period = params.get<int>("frame_period", 5);
 	config_.verbose = params.get<int>("verbose", 0);
 	config_.region_name = params.get<std::string>("region_name", "");
@@ -118,11 +232,37 @@ void MotionDetectStage::Configure()
 	roi_height_ = std::clamp(roi_height_, 0u, info.height - roi_y_);
 	region_threshold_ = std::clamp(region_threshold_, 0u, roi_width_ * roi_height_);
 
+	bool tiles = config_.tile_width > 0 && config_.tile_height > 0;
+	tile_width_ = tiles ? std::min<unsigned int>(config_.tile_width, roi_width_) : roi_width_;
+	tile_height_ = tiles ? std::min<unsigned int>(config_.tile_height, roi_height_) : roi_height_;
+	tile_columns_ = tile_width_ ? (roi_width_ + tile_width_ - 1) / tile_width_ : 0;
+	tile_rows_ = tile_height_ ? (roi_height_ + tile_height_ - 1) / tile_height_ : 0;
+	tile_thresholds_.clear();
+	for (unsigned int row = 0; row < tile_rows_; row++)
+	{
+		for (unsigned int column = 0; column < tile_columns_; column++)
+		{
+			unsigned int area = std::min(tile_width_, roi_width_ - column * tile_width_) *
+								std::min(tile_height_, roi_height_ - row * tile_height_);
+			tile_thresholds_.push_back(tiles ? std::clamp<unsigned int>(config_.tile_threshold * area, 0, area)
+											 : region_threshold_);
+		}
+	}
+	if (!tiles)
+		tile_width_ = tile_height_ = 0;
+
+	// The pixels are integers, so |new - old| > m * old + c is the same as |new - old| > floor(m * old + c).
+	config_.difference_m = std::max(config_.difference_m, 0.0f);
+	config_.difference_c = std::max(config_.difference_c, 0);
+	for (int old_value = 0; old_value < 256; old_value++)
+		limit_[old_value] = std::min(std::floor(config_.difference_m * old_value + config_.difference_c), 255.0f);
+
 	if (config_.verbose)
 		LOG(1, "Lores: " << info.width << "x" << info.height << " roi: (" << roi_x_ << "," << roi_y_ << ") "
-						 << roi_width_ << "x" << roi_height_ << " threshold: " << region_threshold_);
+						 << roi_width_ << "x" << roi_height_ << " threshold: " << region_threshold_ << " tiles: "
+						 << tile_columns_ << "x" << tile_rows_);
 
-	previous_frame_.resize(roi_width_ * roi_height_);
+	previous_frame_.reset();
 	first_time_ = true;
 	motion_detected_ = false;
 }
@@ -135,54 +275,82 @@ bool MotionDetectStage::Process(CompletedRequestPtr &completed_request)
 	if (config_.frame_period && completed_request->sequence % config_.frame_period)
 		return false;
 
-	BufferReadSync r(app_, completed_request->buffers[stream_]);
-	libcamera::Span<uint8_t> buffer = r.Get()[0];
-	uint8_t *image = buffer.data();
-
-	// We need to protect access to first_time_, previous_frame_ and motion_detected_.
-	std::lock_guard<std::mutex> lock(mutex_);
-
-	if (first_time_)
+	// Take a compact copy of the subsampled roi. This is what the next frame will be compared against.
+	auto frame = std::make_shared<std::vector<uint8_t>>(roi_width_ * roi_height_);
 	{
-		first_time_ = false;
+		BufferReadSync r(app_, completed_request->buffers[stream_]);
+		uint8_t const *image = r.Get()[0].data();
 		for (unsigned int y = 0; y < roi_height_; y++)
+			motion_detect_kernels().gather_row(image + (roi_y_ + y) * lores_stride_ + roi_x_ * config_.hskip,
+											   frame->data() + y * roi_width_, roi_width_, config_.hskip);
+	}
+
+	// The lock only protects the swap. Whoever holds a frame keeps it alive, and nobody writes to it once it's in.
+	std::shared_ptr<std::vector<uint8_t>> previous;
+	bool motion_was_detected;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		previous = std::move(previous_frame_);
+		previous_frame_ = frame;
+		motion_was_detected = motion_detected_;
+		if (first_time_)
 		{
-			uint8_t *new_value_ptr = image + (roi_y_ + y) * lores_stride_ + roi_x_ * config_.hskip;
-			uint8_t *old_value_ptr = &previous_frame_[0] + y * roi_width_;
-			for (unsigned int x = 0; x < roi_width_; x++, new_value_ptr += config_.hskip)
-				*(old_value_ptr++) = *new_value_ptr;
+			first_time_ = false;
+			completed_request->post_process_metadata.Set(metadata_tags::motion_detect_result, motion_detected_);
+			return false;
 		}
-
-		completed_request->post_process_metadata.Set("motion_detect.result", motion_detected_);
-
-		return false;
 	}
 
+	// Count the different pixels in each tile, a row at a time. Once we know there's motion, tiles already
+	// known to be active can be skipped, and without tile output that means we're finished.
 	bool motion_detected = false;
 	unsigned int regions = 0;
-
-	// Count the lores pixels where the difference between the new and previous values
-	// exceeds the threshold. At the same time, update the previous image buffer.
+	std::vector<unsigned int> counts(tile_thresholds_.size(), 0);
+	std::vector<uint8_t> active(tile_thresholds_.size(), 0);
+	unsigned int tile_width = tile_width_ ? tile_width_ : roi_width_;
+	unsigned int tile_height = tile_height_ ? tile_height_ : roi_height_;
 	for (unsigned int y = 0; y < roi_height_; y++)
 	{
-		uint8_t *new_value_ptr = image + (roi_y_ + y) * lores_stride_ + roi_x_ * config_.hskip;
-		uint8_t *old_value_ptr = &previous_frame_[0] + y * roi_width_;
-		for (unsigned int x = 0; x < roi_width_; x++, new_value_ptr += config_.hskip)
+		unsigned int tile = (y / tile_height) * tile_columns_;
+		uint8_t const *old_row = previous->data() + y * roi_width_;
+		uint8_t const *new_row = frame->data() + y * roi_width_;
+		for (unsigned int x = 0; x < roi_width_; x += tile_width, tile++)
 		{
-			int new_value = *new_value_ptr;
-			int old_value = *old_value_ptr;
-			*(old_value_ptr++) = new_value;
-			regions += std::abs(new_value - old_value) > config_.difference_m * old_value + config_.difference_c;
-			motion_detected = regions >= region_threshold_;
+			if (motion_detected && active[tile])
+				continue;
+			unsigned int n = motion_detect_kernels().count_row(old_row + x, new_row + x, limit_,
+															   std::min(tile_width, roi_width_ - x));
+			counts[tile] += n;
+			regions += n;
+			active[tile] = counts[tile] >= tile_thresholds_[tile];
 		}
+		motion_detected = regions >= region_threshold_;
+		if (motion_detected && !tile_width_)
+			break;
 	}
 
-	if (config_.verbose && motion_detected != motion_detected_)
+	if (config_.verbose && motion_detected != motion_was_detected)
 		LOG(1, "Motion " << (motion_detected ? "detected" : "stopped")
 						 << (config_.region_name.empty() ? "" : " in region " + config_.region_name));
 
-	motion_detected_ = motion_detected;
-	completed_request->post_process_metadata.Set("motion_detect.result", motion_detected);
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		motion_detected_ = motion_detected;
+	}
+	completed_request->post_process_metadata.Set(metadata_tags::motion_detect_result, motion_detected);
+
+	if (tile_width_)
+	{
+		MotionDetectTiles tiles;
+		tiles.roi = libcamera::Rectangle(roi_x_ * config_.hskip, roi_y_ * config_.vskip, roi_width_ * config_.hskip,
+										 roi_height_ * config_.vskip);
+		tiles.tile_width = tile_width_ * config_.hskip;
+		tiles.tile_height = tile_height_ * config_.vskip;
+		tiles.columns = tile_columns_;
+		tiles.rows = tile_rows_;
+		tiles.active = std::move(active);
+		completed_request->post_process_metadata.Set(metadata_tags::motion_detect_tiles, std::move(tiles));
+	}
 
 	return false;
 }
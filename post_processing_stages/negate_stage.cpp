@@ -11,6 +11,24 @@
 
 #include "post_processing_stages/post_processing_stage.hpp"
 
+#if GPU_COMPUTE_PRESENT
+#include "post_processing_stages/gpu_compute.hpp"
+
+// One invocation per 4 bytes of the buffer, which is bound both for reading and for writing.
+static const char NEGATE_SHADER[] = R"(#version 310 es
+layout(local_size_x = 8, local_size_y = 8) in;
+layout(rgba8, binding = 0) readonly uniform highp image2D src;
+layout(rgba8, binding = 1) writeonly uniform highp image2D dst;
+void main()
+{
+	ivec2 p = ivec2(gl_GlobalInvocationID.xy);
+	if (any(greaterThanEqual(p, imageSize(src))))
+		return;
+	imageStore(dst, p, vec4(1.0) - imageLoad(src, p));
+}
+)";
+#endif
+
 using Stream = libcamera::Stream;
 
 class NegateStage : public PostProcessingStage
@@ -20,14 +38,21 @@ public:
 
 	char const *Name() const override;
 
-	void Read(boost::property_tree::ptree const &params) override {}
+	void Read(boost::property_tree::ptree const &params) override;
 
 	void Configure() override;
 
 	bool Process(CompletedRequestPtr &completed_request) override;
 
+	void Teardown() override;
+
 private:
 	Stream *stream_;
+	StreamInfo info_;
+	bool use_gpu_ = false;
+#if GPU_COMPUTE_PRESENT
+	std::shared_ptr<GpuCompute> gpu_;
+#endif
 };
 
 #define NAME "negate"
@@ -37,13 +62,58 @@ char const *NegateStage::Name() const
 	return NAME;
 }
 
+void NegateStage::Read(boost::property_tree::ptree const &params)
+{
+	use_gpu_ = params.get<bool>("gpu", false);
+}
+
 void NegateStage::Configure()
 {
 	stream_ = app_->GetMainStream();
+	if (!stream_)
+		return;
+	info_ = app_->GetStreamInfo(stream_);
+
+	if (!use_gpu_)
+		return;
+#if GPU_COMPUTE_PRESENT
+	// The GPU path sees the buffer as YUV420, though negating every byte is the same whatever the format.
+	if (stream_->configuration().pixelFormat != libcamera::formats::YUV420)
+		LOG_ERROR("WARNING: NegateStage: GPU only supports YUV420, using the CPU");
+	else
+	{
+		try
+		{
+			gpu_ = GpuCompute::Get();
+		}
+		catch (std::exception const &e)
+		{
+			LOG_ERROR("WARNING: NegateStage: GPU unavailable (" << e.what() << "), using the CPU");
+		}
+	}
+#else
+	LOG_ERROR("WARNING: NegateStage: built without GPU support, using the CPU");
+#endif
 }
 
 bool NegateStage::Process(CompletedRequestPtr &completed_request)
 {
+#if GPU_COMPUTE_PRESENT
+	if (gpu_)
+	{
+		libcamera::FrameBuffer *buffer = completed_request->buffers[stream_];
+		BufferDeviceSync sync(app_, buffer);
+		gpu_->Run([&]() {
+			GpuCompute::Image image = gpu_->Import(buffer, info_);
+			glUseProgram(gpu_->Program("negate", NEGATE_SHADER));
+			glBindImageTexture(0, image.texture, 0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA8);
+			glBindImageTexture(1, image.texture, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA8);
+			GpuCompute::Dispatch(image.width, image.height);
+		});
+		return false;
+	}
+#endif
+
 	BufferWriteSync w(app_, completed_request->buffers[stream_]);
 	libcamera::Span<uint8_t> buffer = w.Get()[0];
 	uint32_t *ptr = (uint32_t *)buffer.data();
@@ -55,6 +125,15 @@ bool NegateStage::Process(CompletedRequestPtr &completed_request)
 	return false;
 }
 
+void NegateStage::Teardown()
+{
+#if GPU_COMPUTE_PRESENT
+	if (gpu_)
+		gpu_->ReleaseImages();
+	gpu_.reset();
+#endif
+}
+
 static PostProcessingStage *Create(RPiCamApp *app)
 {
 	return new NegateStage(app);
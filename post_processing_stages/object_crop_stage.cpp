@@ -0,0 +1,319 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * object_crop_stage.cpp - save crops of the detected objects from the full resolution image
+ */
+
+// Saves a crop around each detected object, taken from the main image, rather than the whole frame. It needs an
+// object detection stage (object_detect_tf, or the Hailo or IMX500 ones) to run before it, and the main stream to be
+// YUV420. The crops are copied straight out of the main buffer, which is then free to go, and are encoded and written
+// on a thread of their own, so the cost of saving goes with the number of objects, not the size of the sensor.
+
+// The detection stages give their boxes in main image coordinates. Set "coordinates" to "lores" for boxes in lores
+// image pixels, which are mapped to the main image through the frame's ScalerCrop(s).
+
+// Each crop is written to <prefix><sequence>-<n>-<label>.jpg (or .png), where <sequence> is the frame's sequence
+// number and <n> counts the crops from that frame. The png crops are greyscale (only the Y plane), as png_save
+// writes them.
+
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+#include <libcamera/stream.h>
+
+#include "core/rpicam_app.hpp"
+
+#include "encoder/jpeg_bands.hpp"
+#include "image/image.hpp"
+
+#include "post_processing_stages/object_detect.hpp"
+#include "post_processing_stages/post_processing_stage.hpp"
+
+using Rectangle = libcamera::Rectangle;
+using Stream = libcamera::Stream;
+
+class ObjectCropStage : public PostProcessingStage
+{
+public:
+	ObjectCropStage(RPiCamApp *app) : PostProcessingStage(app) {}
+
+	char const *Name() const override;
+
+	void Read(boost::property_tree::ptree const &params) override;
+
+	void Configure() override;
+
+	void Start() override;
+
+	bool Process(CompletedRequestPtr &completed_request) override;
+
+	void Stop() override;
+
+private:
+	struct Crop
+	{
+		std::vector<uint8_t> image; // YUV420, or just the Y plane for png
+		StreamInfo info;
+		std::string filename;
+	};
+
+	Rectangle mainBox(Rectangle const &box, libcamera::ControlList const &metadata) const;
+	void saveThread();
+	void save(Crop &crop);
+
+	// Parameters.
+	float padding_;
+	float confidence_;
+	std::vector<std::string> labels_;
+	bool lores_coordinates_;
+	std::string prefix_;
+	bool png_;
+	int quality_;
+	unsigned int max_queue_;
+	unsigned int gap_;
+
+	Stream *main_stream_ = nullptr;
+	StreamInfo main_info_;
+	StreamInfo lores_info_;
+	int64_t last_detection_ns_ = -1;
+	std::optional<uint64_t> last_crop_frame_;
+
+	std::mutex mutex_;
+	std::condition_variable cond_;
+	std::deque<Crop> queue_;
+	bool abort_ = false;
+	std::thread thread_;
+	uint64_t saved_ = 0;
+	uint64_t dropped_ = 0;
+};
+
+#define NAME "object_crop"
+
+char const *ObjectCropStage::Name() const
+{
+	return NAME;
+}
+
+void ObjectCropStage::Read(boost::property_tree::ptree const &params)
+{
+	padding_ = params.get<float>("padding", 0.1);
+	confidence_ = params.get<float>("confidence_threshold", 0);
+	labels_ = GetJsonArray<std::string>(params, "labels");
+	lores_coordinates_ = params.get<std::string>("coordinates", "main") == "lores";
+	prefix_ = params.get<std::string>("prefix", "crop-");
+	std::string encoding = params.get<std::string>("encoding", "jpg");
+	if (encoding != "jpg" && encoding != "png")
+		throw std::runtime_error("ObjectCropStage: encoding must be jpg or png");
+	png_ = encoding == "png";
+	quality_ = params.get<int>("quality", 90);
+	max_queue_ = params.get<unsigned int>("queue", 16);
+	gap_ = params.get<unsigned int>("gap", 0);
+}
+
+void ObjectCropStage::Configure()
+{
+	main_stream_ = app_->GetMainStream();
+	if (!main_stream_)
+		return;
+	main_info_ = app_->GetStreamInfo(main_stream_);
+	if (main_info_.pixel_format != libcamera::formats::YUV420)
+		throw std::runtime_error("ObjectCropStage: main stream must be YUV420");
+	if (lores_coordinates_ && !app_->LoresStream(&lores_info_))
+		throw std::runtime_error("ObjectCropStage: lores coordinates need a lores stream");
+	last_detection_ns_ = -1;
+	last_crop_frame_.reset();
+}
+
+void ObjectCropStage::Start()
+{
+	abort_ = false;
+	thread_ = std::thread(&ObjectCropStage::saveThread, this);
+}
+
+Rectangle ObjectCropStage::mainBox(Rectangle const &box, libcamera::ControlList const &metadata) const
+{
+	if (!lores_coordinates_)
+		return box;
+
+	double x0 = box.x, y0 = box.y, x1 = box.x + box.width, y1 = box.y + box.height;
+	auto crops = metadata.get(libcamera::controls::rpi::ScalerCrops);
+	if (crops && crops->size() == 2)
+	{
+		// The lores stream has a crop of its own (on a Pi 5), so go through the sensor coordinates, from the lores
+		// crop to the main one.
+		Rectangle const &main_crop = (*crops)[0], &lores_crop = (*crops)[1];
+		auto to_main_x = [&](double x) {
+			double sensor_x = lores_crop.x + x * lores_crop.width / lores_info_.width;
+			return (sensor_x - main_crop.x) * main_info_.width / main_crop.width;
+		};
+		auto to_main_y = [&](double y) {
+			double sensor_y = lores_crop.y + y * lores_crop.height / lores_info_.height;
+			return (sensor_y - main_crop.y) * main_info_.height / main_crop.height;
+		};
+		x0 = to_main_x(x0), x1 = to_main_x(x1), y0 = to_main_y(y0), y1 = to_main_y(y1);
+	}
+	else
+	{
+		// With a single ScalerCrop, both streams are scaled from the same crop of the sensor.
+		x0 = x0 * main_info_.width / lores_info_.width, x1 = x1 * main_info_.width / lores_info_.width;
+		y0 = y0 * main_info_.height / lores_info_.height, y1 = y1 * main_info_.height / lores_info_.height;
+	}
+
+	return Rectangle(std::lround(x0), std::lround(y0), std::max<long>(std::lround(x1 - x0), 0),
+					 std::max<long>(std::lround(y1 - y0), 0));
+}
+
+bool ObjectCropStage::Process(CompletedRequestPtr &completed_request)
+{
+	if (!main_stream_)
+		return false;
+
+	std::vector<Detection> detections;
+	if (completed_request->post_process_metadata.Get("object_detect.results", detections) || detections.empty())
+		return false;
+
+	// Stages that run inference in the background attach the same results to every frame until the next ones are
+	// ready, and we only want to crop them once.
+	int64_t detection_ns;
+	if (completed_request->post_process_metadata.Get("object_detect.timestamp", detection_ns) == 0)
+	{
+		if (detection_ns == last_detection_ns_)
+			return false;
+		last_detection_ns_ = detection_ns;
+	}
+	if (last_crop_frame_ && completed_request->sequence - *last_crop_frame_ < gap_)
+		return false;
+
+	BufferReadSync r(app_, completed_request->buffers[main_stream_]);
+	uint8_t const *image = r.Get()[0].data();
+	unsigned int chroma_stride = main_info_.stride / 2;
+	uint8_t const *u_plane = image + main_info_.stride * main_info_.height;
+	uint8_t const *v_plane = u_plane + chroma_stride * (main_info_.height / 2);
+
+	unsigned int n = 0;
+	for (Detection const &d : detections)
+	{
+		if (d.confidence < confidence_ ||
+			(!labels_.empty() && std::find(labels_.begin(), labels_.end(), d.name) == labels_.end()))
+			continue;
+
+		// Pad the box, keep it within the image, and make everything even, for the subsampled chroma.
+		Rectangle box = mainBox(d.box, completed_request->metadata);
+		int pad_x = box.width * padding_, pad_y = box.height * padding_;
+		int x0 = std::clamp<int>(box.x - pad_x, 0, main_info_.width) & ~1;
+		int y0 = std::clamp<int>(box.y - pad_y, 0, main_info_.height) & ~1;
+		int x1 = std::clamp<int>(box.x + box.width + pad_x, 0, main_info_.width) & ~1;
+		int y1 = std::clamp<int>(box.y + box.height + pad_y, 0, main_info_.height) & ~1;
+		if (x1 - x0 < 16 || y1 - y0 < 16)
+			continue;
+
+		Crop crop;
+		crop.info.width = x1 - x0;
+		crop.info.height = y1 - y0;
+		crop.info.stride = crop.info.width;
+		crop.info.pixel_format = libcamera::formats::YUV420;
+		crop.image.resize(crop.info.width * crop.info.height * (png_ ? 2 : 3) / 2);
+		uint8_t *dst = crop.image.data();
+		for (int y = y0; y < y1; y++, dst += crop.info.width)
+			memcpy(dst, image + y * main_info_.stride + x0, crop.info.width);
+		if (!png_)
+		{
+			for (uint8_t const *plane : { u_plane, v_plane })
+			{
+				for (int y = y0 / 2; y < y1 / 2; y++, dst += crop.info.width / 2)
+					memcpy(dst, plane + y * chroma_stride + x0 / 2, crop.info.width / 2);
+			}
+		}
+		crop.filename = prefix_ + std::to_string(completed_request->sequence) + "-" + std::to_string(n++) + "-" +
+						d.name + (png_ ? ".png" : ".jpg");
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (queue_.size() >= max_queue_)
+		{
+			dropped_++;
+			continue;
+		}
+		queue_.push_back(std::move(crop));
+		cond_.notify_one();
+	}
+
+	if (n)
+		last_crop_frame_ = completed_request->sequence;
+
+	return false;
+}
+
+void ObjectCropStage::saveThread()
+{
+	while (true)
+	{
+		Crop crop;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			cond_.wait(lock, [this] { return abort_ || !queue_.empty(); });
+			// Finish what we've been given before stopping.
+			if (queue_.empty())
+				return;
+			crop = std::move(queue_.front());
+			queue_.pop_front();
+		}
+
+		try
+		{
+			save(crop);
+			saved_++;
+		}
+		catch (std::exception const &e)
+		{
+			LOG_ERROR("ERROR: ObjectCropStage: failed to save " << crop.filename << ": " << e.what());
+		}
+	}
+}
+
+void ObjectCropStage::save(Crop &crop)
+{
+	if (png_)
+	{
+		png_save(crop.image.data(), crop.info, crop.filename);
+		return;
+	}
+
+	uint8_t *jpeg_buffer = nullptr;
+	size_t jpeg_len = 0;
+	YUV420_to_JPEG_bands(crop.image.data(), crop.info, quality_, 1, {}, jpeg_buffer, jpeg_len);
+	FILE *fp = fopen(crop.filename.c_str(), "wb");
+	bool ok = fp && fwrite(jpeg_buffer, jpeg_len, 1, fp) == 1;
+	if (fp)
+		fclose(fp);
+	free(jpeg_buffer);
+	if (!ok)
+		throw std::runtime_error("failed to write file");
+	LOG(2, "ObjectCropStage: saved " << crop.info.width << "x" << crop.info.height << " crop to " << crop.filename);
+}
+
+void ObjectCropStage::Stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+	}
+	cond_.notify_one();
+	if (thread_.joinable())
+		thread_.join();
+	LOG(1, "ObjectCropStage: saved " << saved_ << " crops, dropped " << dropped_ << " with the queue full");
+}
+
+static PostProcessingStage *Create(RPiCamApp *app)
+{
+	return new ObjectCropStage(app);
+}
+
+static RegisterStage reg(NAME, &Create);
@@ -32,9 +32,12 @@ public:
 	bool Process(CompletedRequestPtr &completed_request) override;
 
 private:
+	void addOverlay(CompletedRequestPtr &completed_request, std::vector<Detection> const &detections);
+
 	Stream *stream_;
 	int line_thickness_;
 	double font_size_;
+	bool burn_in_;
 };
 
 #define NAME "object_detect_draw_cv"
@@ -53,6 +56,37 @@ void ObjectDetectDrawCvStage::Read(boost::property_tree::ptree const &params)
 {
 	line_thickness_ = params.get<int>("line_thickness", 1);
 	font_size_ = params.get<double>("font_size", 1.0);
+	burn_in_ = params.get<bool>("burn_in", false);
+}
+
+void ObjectDetectDrawCvStage::addOverlay(CompletedRequestPtr &completed_request,
+										 std::vector<Detection> const &detections)
+{
+	StreamInfo info = app_->GetStreamInfo(stream_);
+	std::vector<OverlayItem> items;
+	int font = FONT_HERSHEY_SIMPLEX;
+
+	for (auto &detection : detections)
+	{
+		Rectange const &box = detection.box;
+		items.push_back({ OverlayItem::Shape::Rect, box.x, box.y, box.x + (int)box.width, box.y + (int)box.height,
+						  line_thickness_ });
+
+		// The label is drawn into a mask just big enough for it, at the same place as it would go in the image.
+		std::stringstream text_stream;
+		text_stream << detection.name << " " << (int)(detection.confidence * 100) << "%";
+		std::string text = text_stream.str();
+		int baseline = 0;
+		Size size = getTextSize(text, font, font_size_, 2, &baseline);
+		Mat mask(size.height + baseline + 2, size.width + 2, CV_8U, Scalar(0));
+		putText(mask, text, Point(0, size.height), font, font_size_, 255, 2);
+		int x = box.x + 5, y = box.y + 5;
+		OverlayItem label { OverlayItem::Shape::Mask, x, y, x + mask.cols, y + mask.rows };
+		label.mask = std::make_shared<std::vector<uint8_t>>(mask.datastart, mask.dataend);
+		items.push_back(std::move(label));
+	}
+
+	completed_request->overlay.Add(info.width, info.height, std::move(items));
 }
 
 bool ObjectDetectDrawCvStage::Process(CompletedRequestPtr &completed_request)
@@ -60,15 +94,20 @@ bool ObjectDetectDrawCvStage::Process(CompletedRequestPtr &completed_request)
 	if (!stream_)
 		return false;
 
+	std::vector<Detection> detections;
+	completed_request->post_process_metadata.Get("object_detect.results", detections);
+
+	if (!burn_in_)
+	{
+		addOverlay(completed_request, detections);
+		return false;
+	}
+
 	BufferWriteSync w(app_, completed_request->buffers[stream_]);
 	libcamera::Span<uint8_t> buffer = w.Get()[0];
 	uint32_t *ptr = (uint32_t *)buffer.data();
 	StreamInfo info = app_->GetStreamInfo(stream_);
 
-	std::vector<Detection> detections;
-
-	completed_request->post_process_metadata.Get("object_detect.results", detections);
-
 	Mat image(info.height, info.width, CV_8U, ptr, info.stride);
 	Scalar colour = Scalar(255, 255, 255);
 	int font = FONT_HERSHEY_SIMPLEX;
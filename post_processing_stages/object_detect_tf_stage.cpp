@@ -6,6 +6,7 @@
  */
 
 #include "object_detect.hpp"
+#include "object_tracker.hpp"
 #include "tf_stage.hpp"
 
 using Rectangle = libcamera::Rectangle;
@@ -39,6 +40,9 @@ protected:
 
 	void checkConfiguration() override;
 
+	// With tracking, the model only runs when the tracker asks for it, rather than every refresh_rate'th frame.
+	bool wantInference(CompletedRequestPtr &completed_request) override;
+
 	// Retrieve the top-n most likely results.
 	void interpretOutputs() override;
 
@@ -52,12 +56,14 @@ private:
 	std::vector<Detection> output_results_;
 	std::vector<std::string> labels_;
 	size_t label_count_;
+	ObjectTracker tracker_;
 };
 
 void ObjectDetectTfStage::readExtras(boost::property_tree::ptree const &params)
 {
 	config()->confidence_threshold = params.get<float>("confidence_threshold", 0.5f);
 	config()->overlap_threshold = params.get<float>("overlap_threshold", 0.5f);
+	tracker_.Read(params);
 
 	std::string labels_file = params.get<std::string>("labels_file", "");
 	readLabelsFile(labels_file);
@@ -90,11 +96,31 @@ void ObjectDetectTfStage::checkConfiguration()
 {
 	if (!main_stream_)
 		throw std::runtime_error("ObjectDetectTfStage: Main stream is required");
+	if (lores_stream_)
+		tracker_.Configure(lores_info_.width, lores_info_.height, main_stream_info_.width, main_stream_info_.height);
+}
+
+bool ObjectDetectTfStage::wantInference(CompletedRequestPtr &completed_request)
+{
+	if (!tracker_.Enabled())
+		return TfStage::wantInference(completed_request);
+	BufferReadSync r(app_, completed_request->buffers[lores_stream_]);
+	return tracker_.Track(completed_request->sequence, r.Get()[0].data(), 1, lores_info_.stride);
 }
 
 void ObjectDetectTfStage::applyResults(CompletedRequestPtr &completed_request)
 {
+	if (tracker_.Enabled())
+	{
+		// The tracked boxes are where the objects are in this frame.
+		completed_request->post_process_metadata.Set("object_detect.results", tracker_.Results());
+		completed_request->post_process_metadata.Set(
+			"object_detect.timestamp",
+			completed_request->metadata.get(libcamera::controls::SensorTimestamp).value_or(output_timestamp_));
+		return;
+	}
 	completed_request->post_process_metadata.Set("object_detect.results", output_results_);
+	completed_request->post_process_metadata.Set("object_detect.timestamp", output_timestamp_);
 }
 
 static unsigned int area(const Rectangle &r)
@@ -167,6 +193,9 @@ void ObjectDetectTfStage::interpretOutputs()
 		for (auto &detection : output_results_)
 			LOG(1, detection.toString());
 	}
+
+	if (tracker_.Enabled())
+		tracker_.Detected(output_results_);
 }
 
 static PostProcessingStage *Create(RPiCamApp *app)
@@ -0,0 +1,187 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * object_tracker.cpp - follow object detections between inferences
+ */
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdlib>
+#include <stdexcept>
+
+#include "post_processing_stages/object_tracker.hpp"
+
+// Boxes are matched on a grid of up to this many samples each way, which is plenty to tell where they went.
+static constexpr int TRACK_SAMPLES = 12;
+// New motion is looked for on every this many pixels each way, and a pixel has changed if it differs by this much.
+static constexpr unsigned int MOTION_STEP = 4;
+static constexpr int MOTION_CHANGE = 25;
+
+void ObjectTracker::Read(boost::property_tree::ptree const &params)
+{
+	enabled_ = params.get<bool>("track", false);
+	max_interval_ = std::max(params.get<unsigned int>("track_max_interval", 30), 1u);
+	search_ = params.get<int>("track_search", 8);
+	lost_threshold_ = params.get<float>("track_lost_threshold", 24);
+	motion_threshold_ = params.get<float>("track_motion_threshold", 0.02);
+	if (search_ < 0)
+		throw std::runtime_error("ObjectTracker: track_search must not be negative");
+}
+
+void ObjectTracker::Configure(unsigned int lores_width, unsigned int lores_height, unsigned int main_width,
+							  unsigned int main_height)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	lores_width_ = lores_width;
+	lores_height_ = lores_height;
+	scale_x_ = main_width / (float)lores_width;
+	scale_y_ = main_height / (float)lores_height;
+	previous_.assign(lores_width * lores_height, 0);
+	have_previous_ = false;
+	tracks_.clear();
+	frames_since_detection_ = 0;
+	awaiting_ = false;
+}
+
+bool ObjectTracker::Track(unsigned int sequence, uint8_t const *image, unsigned int pixel_step, unsigned int stride)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (have_previous_ && sequence <= last_sequence_)
+		return false;
+
+	bool detect = !have_previous_;
+	if (have_previous_)
+	{
+		for (auto track = tracks_.begin(); track != tracks_.end();)
+		{
+			if (follow(*track, image, pixel_step, stride))
+				track++;
+			else
+			{
+				track = tracks_.erase(track);
+				detect = true;
+			}
+		}
+		detect |= newMotion(image, pixel_step, stride);
+	}
+	detect |= ++frames_since_detection_ >= max_interval_;
+
+	for (unsigned int y = 0; y < lores_height_; y++)
+	{
+		uint8_t const *row = image + y * stride;
+		uint8_t *dst = previous_.data() + y * lores_width_;
+		for (unsigned int x = 0; x < lores_width_; x++)
+			dst[x] = row[x * pixel_step];
+	}
+	have_previous_ = true;
+	last_sequence_ = sequence;
+
+	// Don't ask again while a detection is on its way, unless it's been so long that it must have gone astray.
+	if (awaiting_ && sequence - request_sequence_ < max_interval_)
+		return false;
+	if (detect)
+	{
+		awaiting_ = true;
+		request_sequence_ = sequence;
+	}
+	return detect;
+}
+
+bool ObjectTracker::follow(Tracked &track, uint8_t const *image, unsigned int pixel_step, unsigned int stride) const
+{
+	int width = lores_width_, height = lores_height_;
+	int x0 = std::max<int>(track.x, 0), y0 = std::max<int>(track.y, 0);
+	int x1 = std::min<int>(track.x + track.width, width), y1 = std::min<int>(track.y + track.height, height);
+	if (x1 - x0 < 4 || y1 - y0 < 4)
+		return false;
+	int step_x = std::max((x1 - x0) / TRACK_SAMPLES, 1), step_y = std::max((y1 - y0) / TRACK_SAMPLES, 1);
+	unsigned int samples = ((x1 - x0 + step_x - 1) / step_x) * ((y1 - y0 + step_y - 1) / step_y);
+
+	int pixel = pixel_step;
+	auto sad = [&](int dx, int dy, unsigned int limit) {
+		unsigned int total = 0;
+		for (int y = y0; y < y1 && total < limit; y += step_y)
+		{
+			uint8_t const *prev = previous_.data() + y * width;
+			uint8_t const *cur = image + (y + dy) * (int)stride + dx * pixel;
+			for (int x = x0; x < x1; x += step_x)
+				total += std::abs(prev[x] - cur[x * pixel]);
+		}
+		return total;
+	};
+
+	// Not moving wins ties, so that a box over something featureless stays put.
+	unsigned int best = sad(0, 0, UINT_MAX);
+	int best_dx = 0, best_dy = 0;
+	for (int dy = -search_; dy <= search_; dy++)
+	{
+		if (y0 + dy < 0 || y1 + dy > height)
+			continue;
+		for (int dx = -search_; dx <= search_; dx++)
+		{
+			if (x0 + dx < 0 || x1 + dx > width || (!dx && !dy))
+				continue;
+			unsigned int s = sad(dx, dy, best);
+			if (s < best)
+				best = s, best_dx = dx, best_dy = dy;
+		}
+	}
+
+	if (best > lost_threshold_ * samples)
+		return false;
+	track.x += best_dx;
+	track.y += best_dy;
+	float cx = track.x + track.width / 2, cy = track.y + track.height / 2;
+	return cx >= 0 && cx < width && cy >= 0 && cy < height;
+}
+
+bool ObjectTracker::inTrack(unsigned int x, unsigned int y) const
+{
+	// Allow for where the box was on the previous frame as well as where it is now.
+	return std::any_of(tracks_.begin(), tracks_.end(), [this, x, y](Tracked const &t) {
+		return x + search_ >= t.x && x < t.x + t.width + search_ && y + search_ >= t.y &&
+			   y < t.y + t.height + search_;
+	});
+}
+
+bool ObjectTracker::newMotion(uint8_t const *image, unsigned int pixel_step, unsigned int stride) const
+{
+	unsigned int changed = 0, total = 0;
+	for (unsigned int y = 0; y < lores_height_; y += MOTION_STEP)
+	{
+		uint8_t const *prev = previous_.data() + y * lores_width_;
+		uint8_t const *cur = image + y * stride;
+		for (unsigned int x = 0; x < lores_width_; x += MOTION_STEP, total++)
+		{
+			if (std::abs(prev[x] - cur[x * pixel_step]) > MOTION_CHANGE && !inTrack(x, y))
+				changed++;
+		}
+	}
+	return changed > motion_threshold_ * total;
+}
+
+void ObjectTracker::Detected(std::vector<Detection> const &detections)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	tracks_.clear();
+	for (Detection const &d : detections)
+		tracks_.push_back({ d, d.box.x / scale_x_, d.box.y / scale_y_, d.box.width / scale_x_,
+							d.box.height / scale_y_ });
+	frames_since_detection_ = 0;
+	awaiting_ = false;
+}
+
+std::vector<Detection> ObjectTracker::Results() const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	std::vector<Detection> results;
+	for (Tracked const &t : tracks_)
+	{
+		results.push_back(t.detection);
+		results.back().box = libcamera::Rectangle(std::lround(t.x * scale_x_), std::lround(t.y * scale_y_),
+												  std::lround(t.width * scale_x_), std::lround(t.height * scale_y_));
+	}
+	return results;
+}
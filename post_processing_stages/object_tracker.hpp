@@ -0,0 +1,84 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * object_tracker.hpp - follow object detections between inferences
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include <boost/property_tree/ptree.hpp>
+
+#include "post_processing_stages/object_detect.hpp"
+
+// Keeps a detector's "object_detect.results" up to date on every frame while the detector itself only runs now and
+// again. Each detection's box is followed from one lores frame to the next by block matching on the luma, and a full
+// detection is asked for only when a box can't be followed any more, when something moves outside all the boxes, or
+// when it has been "track_max_interval" frames since the last one.
+//
+// Detection stages that use it read these parameters alongside their own:
+//   track                  - follow detections between inferences (default off)
+//   track_max_interval     - frames between full detections at most (default 30)
+//   track_search           - how far a box may move between frames, in lores pixels (default 8)
+//   track_lost_threshold   - mean absolute luma difference above which a box is lost (default 24)
+//   track_motion_threshold - fraction of the image that must change outside the boxes to count as new motion
+//                            (default 0.02)
+class ObjectTracker
+{
+public:
+	void Read(boost::property_tree::ptree const &params);
+	bool Enabled() const { return enabled_; }
+
+	// Tracking happens in the lores image; detections and results are in main image coordinates.
+	void Configure(unsigned int lores_width, unsigned int lores_height, unsigned int main_width,
+				   unsigned int main_height);
+
+	// Follow the boxes into a new frame, given its luma (or any one colour channel): pixel_step bytes from one pixel
+	// to the next and stride from one row to the next. Frames should come in sequence order; any that turn up after a
+	// later one are ignored. Returns true when the frame wants a full detection run on it.
+	bool Track(unsigned int sequence, uint8_t const *image, unsigned int pixel_step, unsigned int stride);
+
+	// The results of a full detection, which replace whatever was being tracked.
+	void Detected(std::vector<Detection> const &detections);
+
+	// The detections as they are now, for attaching to the latest frame.
+	std::vector<Detection> Results() const;
+
+private:
+	struct Tracked
+	{
+		Detection detection;
+		// Where the box is in the lores image.
+		float x, y, width, height;
+	};
+
+	bool follow(Tracked &track, uint8_t const *image, unsigned int pixel_step, unsigned int stride) const;
+	bool newMotion(uint8_t const *image, unsigned int pixel_step, unsigned int stride) const;
+	bool inTrack(unsigned int x, unsigned int y) const;
+
+	bool enabled_ = false;
+	unsigned int max_interval_;
+	int search_;
+	float lost_threshold_;
+	float motion_threshold_;
+
+	unsigned int lores_width_ = 0;
+	unsigned int lores_height_ = 0;
+	float scale_x_ = 1; // main image pixels per lores pixel
+	float scale_y_ = 1;
+
+	mutable std::mutex mutex_;
+	std::vector<Tracked> tracks_;
+	// The luma of the last frame tracked, packed.
+	std::vector<uint8_t> previous_;
+	bool have_previous_ = false;
+	unsigned int last_sequence_ = 0;
+	unsigned int frames_since_detection_ = 0;
+	// A detection has been asked for, on the frame with this sequence number, but its results haven't come back yet.
+	bool awaiting_ = false;
+	unsigned int request_sequence_ = 0;
+};
@@ -0,0 +1,175 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * parallel_rows.cpp - Worker pool for splitting image processing across cores.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "parallel_rows.hpp"
+
+namespace
+{
+
+// One call to ParallelFor(). Whoever gets to an index first runs it, and the caller waits for the last one.
+struct Job
+{
+	Job(unsigned int n, std::function<void(unsigned int)> const &fn) : n(n), fn(fn), next(0), remaining(n) {}
+
+	// Run indices until there are none left to start. Returns false once none are.
+	bool RunOne()
+	{
+		unsigned int i = next.fetch_add(1);
+		if (i >= n)
+			return false;
+		try
+		{
+			fn(i);
+		}
+		catch (...)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!error)
+				error = std::current_exception();
+		}
+		if (remaining.fetch_sub(1) == 1)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			cond.notify_all();
+		}
+		return true;
+	}
+
+	unsigned int n;
+	std::function<void(unsigned int)> const &fn;
+	std::atomic<unsigned int> next;
+	std::atomic<unsigned int> remaining;
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::exception_ptr error;
+};
+
+class Pool
+{
+public:
+	Pool() : abort_(false)
+	{
+		unsigned int n = std::max(std::thread::hardware_concurrency(), 1u);
+		for (unsigned int i = 1; i < n; i++)
+			threads_.emplace_back(&Pool::workerThread, this);
+	}
+
+	~Pool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			abort_ = true;
+		}
+		cond_.notify_all();
+		for (auto &thread : threads_)
+			thread.join();
+	}
+
+	unsigned int Threads() const { return threads_.size() + 1; }
+
+	void Run(std::shared_ptr<Job> const &job)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			jobs_.push_back(job);
+		}
+		cond_.notify_all();
+
+		while (job->RunOne())
+			;
+
+		std::unique_lock<std::mutex> lock(job->mutex);
+		job->cond.wait(lock, [&job] { return job->remaining == 0; });
+	}
+
+private:
+	void workerThread()
+	{
+		while (true)
+		{
+			std::shared_ptr<Job> job;
+			{
+				std::unique_lock<std::mutex> lock(mutex_);
+				cond_.wait(lock, [this] { return abort_ || !jobs_.empty(); });
+				if (abort_)
+					return;
+				job = jobs_.front();
+				// Leave the job up for the other workers until every index has been started.
+				if (job->next >= job->n)
+				{
+					jobs_.pop_front();
+					continue;
+				}
+			}
+			job->RunOne();
+		}
+	}
+
+	std::vector<std::thread> threads_;
+	std::mutex mutex_;
+	std::condition_variable cond_;
+	std::deque<std::shared_ptr<Job>> jobs_;
+	bool abort_;
+};
+
+Pool &pool()
+{
+	static Pool pool;
+	return pool;
+}
+
+} // namespace
+
+void ParallelFor(unsigned int n, std::function<void(unsigned int)> const &fn)
+{
+	if (n == 0)
+		return;
+	if (n == 1 || pool().Threads() == 1)
+	{
+		for (unsigned int i = 0; i < n; i++)
+			fn(i);
+		return;
+	}
+
+	auto job = std::make_shared<Job>(n, fn);
+	pool().Run(job);
+	if (job->error)
+		std::rethrow_exception(job->error);
+}
+
+void ParallelRows(unsigned int rows, std::function<void(unsigned int, unsigned int)> const &fn,
+				  unsigned int min_rows, unsigned int align)
+{
+	if (!rows)
+		return;
+
+	// A few bands per thread evens things out when some threads are busy with other work.
+	unsigned int bands = std::max(std::min(rows / std::max(min_rows, 1u), 4 * ParallelThreads()), 1u);
+	unsigned int band_rows = (rows + bands - 1) / bands;
+	band_rows = (band_rows + align - 1) / align * align;
+	bands = (rows + band_rows - 1) / band_rows;
+
+	ParallelFor(bands, [&](unsigned int i) {
+		unsigned int begin = i * band_rows;
+		fn(begin, std::min(begin + band_rows, rows));
+	});
+}
+
+unsigned int ParallelThreads()
+{
+	return pool().Threads();
+}
@@ -0,0 +1,23 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * parallel_rows.hpp - Worker pool for splitting image processing across cores.
+ */
+
+#pragma once
+
+#include <functional>
+
+// Run fn(0) to fn(n - 1) on a pool of threads shared by all the post-processing stages, returning once they have all
+// finished. The calling thread runs some of them itself, so this never waits on a pool that is busy elsewhere, but
+// nor can fn count on all n running at once.
+void ParallelFor(unsigned int n, std::function<void(unsigned int)> const &fn);
+
+// Split rows [0, rows) into bands of at least min_rows, and run fn(begin, end) on each band in parallel. Bands start
+// on a multiple of align rows, which helps with subsampled chroma.
+void ParallelRows(unsigned int rows, std::function<void(unsigned int, unsigned int)> const &fn,
+				  unsigned int min_rows = 32, unsigned int align = 1);
+
+// The number of threads that ParallelFor() spreads work across, including the calling thread.
+unsigned int ParallelThreads();
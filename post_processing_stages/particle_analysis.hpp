@@ -0,0 +1,40 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * particle_analysis.hpp - particle analysis result
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <libcamera/geometry.h>
+
+#include "core/metadata.hpp"
+
+// Published as "particle_analysis.results" on every frame the particle_analysis stage looks at. Coordinates are in
+// pixels of the image that was analysed (the lores, main or raw stream).
+struct ParticleResults
+{
+	struct Particle
+	{
+		uint32_t area; // in pixels, each analysed pixel standing for skip x skip of them
+		float x, y; // centroid
+		libcamera::Rectangle box;
+	};
+
+	unsigned int width;
+	unsigned int height;
+	// All the particles found, though only the largest of them may be listed.
+	unsigned int count;
+	uint64_t total_area;
+	// Largest first.
+	std::vector<Particle> particles;
+};
+
+namespace metadata_tags
+{
+inline constexpr MetadataTag<ParticleResults> particle_analysis_results("particle_analysis.results");
+} // namespace metadata_tags
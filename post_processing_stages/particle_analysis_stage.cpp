@@ -0,0 +1,460 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * particle_analysis_stage.cpp - count and size particles, as in shadowgraph images
+ */
+
+// Finds the particles in each frame as it's captured, so that they needn't all be saved to be counted later. Each
+// pixel is compared with a rolling model of the background, and is part of a particle if it is darker than the
+// background by more than "threshold" (or brighter, with "polarity" "bright", or either with "both"). Pixels that
+// aren't part of a particle update the background, which remembers roughly the last "background_frames" frames, so it
+// follows slow changes in the lighting while particles passing through stay out of it. The foreground pixels are
+// then gathered into 8-connected particles in a single pass, each with its area, centroid and bounding box, and the
+// ones between "min_area" and "max_area" (0 for no limit) pixels are published as "particle_analysis.results", with
+// up to "max_listed" of the largest listed individually.
+
+// The lores stream is analysed if there is one, otherwise the main stream, otherwise the raw stream, which must then
+// be unpacked and is sampled from one Bayer channel, scaled to 8 bits according to the format's bit depth (Pi 4 keeps
+// unpacked pixels in the low bits of each 16-bit word, Pi 5 in the high ones). "skip" subsamples the image each way
+// beforehand, and is always even for a raw stream.
+
+// With "suppress_empty", frames with fewer than "min_particles" particles are dropped, so never encoded or saved.
+// Frames that are let through carry the number dropped before them as "change_gate.suppressed", together with any
+// the change gate dropped, so that the metadata sidecar still accounts for every frame.
+
+// The background model is shared by all the frames, so that part of the work is done under a lock; the sampling and
+// the particle finding run in parallel, like any other stage.
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <mutex>
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#define HAVE_NEON_KERNELS 1
+#endif
+
+#include <libcamera/stream.h>
+
+#include "core/rpicam_app.hpp"
+
+#include "post_processing_stages/change_gate.hpp"
+#include "post_processing_stages/motion_detect_kernels.hpp"
+#include "post_processing_stages/parallel_rows.hpp"
+#include "post_processing_stages/particle_analysis.hpp"
+#include "post_processing_stages/post_processing_stage.hpp"
+
+using Stream = libcamera::Stream;
+
+// The background is kept with this many fractional bits, which leaves room in an int16 for the difference between it
+// and a new pixel.
+static constexpr int BACKGROUND_SHIFT = 7;
+
+struct ThresholdParams
+{
+	uint8_t threshold;
+	bool dark;
+	bool bright;
+	int rate_shift; // the background moves 1 / (1 << rate_shift) of the way to each new pixel
+};
+
+// Mark the foreground pixels of a row in mask (0xff, otherwise 0), and update the background everywhere else.
+typedef void (*ThresholdRow)(uint8_t const *src, uint16_t *background, uint8_t *mask, unsigned int width,
+							 ThresholdParams const &p);
+
+static void threshold_row_c(uint8_t const *src, uint16_t *background, uint8_t *mask, unsigned int width,
+							ThresholdParams const &p)
+{
+	for (unsigned int x = 0; x < width; x++)
+	{
+		int b = background[x] >> BACKGROUND_SHIFT, v = src[x];
+		bool foreground = (p.dark && b - v > p.threshold) || (p.bright && v - b > p.threshold);
+		mask[x] = foreground ? 0xff : 0;
+		if (!foreground)
+			background[x] += ((v << BACKGROUND_SHIFT) - background[x]) >> p.rate_shift;
+	}
+}
+
+#if HAVE_NEON_KERNELS
+
+static void threshold_row_neon(uint8_t const *src, uint16_t *background, uint8_t *mask, unsigned int width,
+							   ThresholdParams const &p)
+{
+	uint8x16_t threshold = vdupq_n_u8(p.threshold);
+	uint8x16_t dark = vdupq_n_u8(p.dark ? 0xff : 0), bright = vdupq_n_u8(p.bright ? 0xff : 0);
+	int16x8_t rate = vdupq_n_s16(-p.rate_shift);
+	unsigned int x = 0;
+	for (; x + 16 <= width; x += 16)
+	{
+		uint8x16_t v = vld1q_u8(src + x);
+		uint16x8_t bg_lo = vld1q_u16(background + x), bg_hi = vld1q_u16(background + x + 8);
+		uint8x16_t b = vcombine_u8(vshrn_n_u16(bg_lo, BACKGROUND_SHIFT), vshrn_n_u16(bg_hi, BACKGROUND_SHIFT));
+		uint8x16_t fg = vorrq_u8(vandq_u8(vcgtq_u8(vqsubq_u8(b, v), threshold), dark),
+								 vandq_u8(vcgtq_u8(vqsubq_u8(v, b), threshold), bright));
+		vst1q_u8(mask + x, fg);
+
+		// Move the background towards the pixel by an arithmetic shift of the difference, just as the C does.
+		int16x8_t d_lo = vsubq_s16(vreinterpretq_s16_u16(vshll_n_u8(vget_low_u8(v), BACKGROUND_SHIFT)),
+								   vreinterpretq_s16_u16(bg_lo));
+		int16x8_t d_hi = vsubq_s16(vreinterpretq_s16_u16(vshll_n_u8(vget_high_u8(v), BACKGROUND_SHIFT)),
+								   vreinterpretq_s16_u16(bg_hi));
+		int16x8_t fg_lo = vmovl_s8(vreinterpret_s8_u8(vget_low_u8(fg)));
+		int16x8_t fg_hi = vmovl_s8(vreinterpret_s8_u8(vget_high_u8(fg)));
+		d_lo = vbicq_s16(vshlq_s16(d_lo, rate), fg_lo);
+		d_hi = vbicq_s16(vshlq_s16(d_hi, rate), fg_hi);
+		vst1q_u16(background + x, vreinterpretq_u16_s16(vaddq_s16(vreinterpretq_s16_u16(bg_lo), d_lo)));
+		vst1q_u16(background + x + 8, vreinterpretq_u16_s16(vaddq_s16(vreinterpretq_s16_u16(bg_hi), d_hi)));
+	}
+	threshold_row_c(src + x, background + x, mask + x, width - x, p);
+}
+
+#endif /* HAVE_NEON_KERNELS */
+
+static ThresholdRow select_threshold_row()
+{
+#if HAVE_NEON_KERNELS
+	if (getauxval(AT_HWCAP) & HWCAP_ASIMD)
+	{
+		LOG(2, "Particle analysis: using NEON kernels");
+		return threshold_row_neon;
+	}
+#endif
+	LOG(2, "Particle analysis: using C kernels");
+	return threshold_row_c;
+}
+
+static ThresholdRow threshold_row()
+{
+	static const ThresholdRow fn = select_threshold_row();
+	return fn;
+}
+
+class ParticleAnalysisStage : public PostProcessingStage
+{
+public:
+	ParticleAnalysisStage(RPiCamApp *app) : PostProcessingStage(app) {}
+
+	char const *Name() const override;
+
+	void Read(boost::property_tree::ptree const &params) override;
+
+	void Configure() override;
+
+	bool Process(CompletedRequestPtr &completed_request) override;
+
+	void Stop() override;
+
+private:
+	ParticleResults findParticles(std::vector<uint8_t> const &mask) const;
+
+	// Parameters.
+	unsigned int skip_;
+	ThresholdParams params_;
+	unsigned int min_area_;
+	unsigned int max_area_;
+	unsigned int max_listed_;
+	bool suppress_empty_;
+	unsigned int min_particles_;
+	bool verbose_;
+
+	Stream *stream_ = nullptr;
+	unsigned int offset_; // of the byte sampled in each pixel
+	unsigned int shift_; // for 16-bit raw pixels not already in the high byte, or 0
+	unsigned int hskip_; // in bytes
+	unsigned int row_stride_; // between the rows sampled
+	unsigned int width_;
+	unsigned int height_;
+	unsigned int stream_width_;
+	unsigned int stream_height_;
+
+	std::mutex mutex_;
+	std::vector<uint16_t> background_;
+	uint64_t suppressed_ = 0;
+	uint64_t total_suppressed_ = 0;
+	uint64_t frames_ = 0;
+	uint64_t particles_ = 0;
+};
+
+#define NAME "particle_analysis"
+
+char const *ParticleAnalysisStage::Name() const
+{
+	return NAME;
+}
+
+void ParticleAnalysisStage::Read(boost::property_tree::ptree const &params)
+{
+	skip_ = std::max(params.get<unsigned int>("skip", 1), 1u);
+	params_.threshold = std::clamp(params.get<int>("threshold", 20), 0, 255);
+	std::string polarity = params.get<std::string>("polarity", "dark");
+	if (polarity != "dark" && polarity != "bright" && polarity != "both")
+		throw std::runtime_error("ParticleAnalysisStage: polarity must be dark, bright or both");
+	params_.dark = polarity != "bright";
+	params_.bright = polarity != "dark";
+	// Round the memory of the background to a power of two frames (up to 128), so that it's a shift.
+	float frames = std::max(params.get<float>("background_frames", 32), 1.0f);
+	params_.rate_shift = std::min<int>(std::lround(std::log2(frames)), BACKGROUND_SHIFT);
+	min_area_ = params.get<unsigned int>("min_area", 4);
+	max_area_ = params.get<unsigned int>("max_area", 0);
+	max_listed_ = params.get<unsigned int>("max_listed", 256);
+	suppress_empty_ = params.get<bool>("suppress_empty", false);
+	min_particles_ = params.get<unsigned int>("min_particles", 1);
+	verbose_ = params.get<int>("verbose", 0);
+}
+
+void ParticleAnalysisStage::Configure()
+{
+	StreamInfo info;
+	stream_ = app_->LoresStream(&info);
+	if (!stream_ && (stream_ = app_->GetMainStream()))
+		info = app_->GetStreamInfo(stream_);
+	if (!stream_)
+		stream_ = app_->RawStream(&info);
+	if (!stream_ || !info.width || !info.height)
+	{
+		stream_ = nullptr;
+		return;
+	}
+
+	unsigned int bytes_per_pixel = 1, skip = skip_;
+	if (stream_ == app_->RawStream())
+	{
+		std::string format = info.pixel_format.toString();
+		if (format.find("CSI2P") != std::string::npos || format.find("PISP_COMP") != std::string::npos)
+			throw std::runtime_error("ParticleAnalysisStage: can't analyse packed raw " + format +
+									 " pixels, use an unpacked raw mode");
+		bytes_per_pixel = info.stride >= 2 * info.width ? 2 : 1;
+		// Stay on one Bayer channel.
+		skip = (skip + 1) & ~1u;
+	}
+	offset_ = bytes_per_pixel - 1;
+	shift_ = 0;
+	if (bytes_per_pixel == 2)
+	{
+		// The bit depth ends the format's name, as in SRGGB12 or R10. Pixels that fill all 16 bits can have their
+		// high byte sampled directly, others are shifted down to 8 bits.
+		std::string format = info.pixel_format.toString();
+		size_t digits = format.find_last_not_of("0123456789") + 1;
+		unsigned int depth = digits < format.size() ? std::stoul(format.substr(digits)) : 16;
+		if (depth > 8 && depth < 16)
+			offset_ = 0, shift_ = depth - 8;
+	}
+	hskip_ = skip * bytes_per_pixel;
+	row_stride_ = info.stride * skip;
+	width_ = info.width / skip;
+	height_ = info.height / skip;
+	skip_ = skip;
+	stream_width_ = info.width;
+	stream_height_ = info.height;
+
+	if (verbose_)
+		LOG(1, "ParticleAnalysisStage: analysing " << width_ << "x" << height_ << " samples of the " << info.width
+												   << "x" << info.height << " image");
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	background_.clear();
+	suppressed_ = 0;
+}
+
+bool ParticleAnalysisStage::Process(CompletedRequestPtr &completed_request)
+{
+	if (!stream_)
+		return false;
+
+	std::vector<uint8_t> frame(width_ * height_), mask(width_ * height_);
+	{
+		BufferReadSync r(app_, completed_request->buffers[stream_]);
+		uint8_t const *image = r.Get()[0].data() + offset_;
+		ParallelRows(height_, [&](unsigned int begin, unsigned int end) {
+			for (unsigned int y = begin; y < end; y++)
+			{
+				uint8_t const *src = image + y * row_stride_;
+				uint8_t *dest = frame.data() + y * width_;
+				if (!shift_)
+				{
+					motion_detect_kernels().gather_row(src, dest, width_, hskip_);
+					continue;
+				}
+				for (unsigned int x = 0; x < width_; x++, src += hskip_)
+					dest[x] = std::min((src[0] | src[1] << 8) >> shift_, 255);
+			}
+		});
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (background_.empty())
+		{
+			// Nothing to compare the first frame with, so it just starts the background off.
+			background_.resize(frame.size());
+			for (size_t i = 0; i < frame.size(); i++)
+				background_[i] = frame[i] << BACKGROUND_SHIFT;
+		}
+		else
+		{
+			ParallelRows(height_, [&](unsigned int begin, unsigned int end) {
+				for (unsigned int y = begin; y < end; y++)
+					threshold_row()(frame.data() + y * width_, background_.data() + y * width_,
+									mask.data() + y * width_, width_, params_);
+			});
+		}
+	}
+
+	ParticleResults results = findParticles(mask);
+	if (verbose_)
+		LOG(1, "ParticleAnalysisStage: frame " << completed_request->sequence << " has " << results.count
+											   << " particles, " << results.total_area << " pixels");
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	frames_++;
+	particles_ += results.count;
+	if (suppress_empty_ && results.count < min_particles_)
+	{
+		// Count what the change gate let through but we didn't, along with the frames it suppressed before it.
+		uint64_t gated = 0;
+		completed_request->post_process_metadata.Get(metadata_tags::change_gate_suppressed, gated);
+		suppressed_ += 1 + gated;
+		total_suppressed_++;
+		return true;
+	}
+
+	if (suppress_empty_)
+	{
+		uint64_t gated = 0;
+		completed_request->post_process_metadata.Get(metadata_tags::change_gate_suppressed, gated);
+		completed_request->post_process_metadata.Set(metadata_tags::change_gate_suppressed, gated + suppressed_);
+		suppressed_ = 0;
+	}
+	completed_request->post_process_metadata.Set(metadata_tags::particle_analysis_results, std::move(results));
+	return false;
+}
+
+ParticleResults ParticleAnalysisStage::findParticles(std::vector<uint8_t> const &mask) const
+{
+	// Each run of foreground pixels along a row starts a particle of its own, and is merged (union-find, with the
+	// statistics added together) with every particle touching it in the row above. That way each pixel is looked at
+	// just once, and no label image is needed.
+	struct Blob
+	{
+		uint32_t parent;
+		uint32_t area;
+		uint64_t sum_x, sum_y;
+		unsigned int x0, y0, x1, y1; // inclusive
+	};
+	struct Run
+	{
+		unsigned int start, end; // end is exclusive
+		uint32_t blob;
+	};
+	std::vector<Blob> blobs;
+	std::vector<Run> previous, current;
+
+	auto find = [&blobs](uint32_t i) {
+		while (blobs[i].parent != i)
+			i = blobs[i].parent = blobs[blobs[i].parent].parent;
+		return i;
+	};
+	auto unite = [&blobs, &find](uint32_t a, uint32_t b) {
+		a = find(a), b = find(b);
+		if (a == b)
+			return;
+		if (a > b)
+			std::swap(a, b);
+		Blob &root = blobs[a], &other = blobs[b];
+		other.parent = a;
+		root.area += other.area;
+		root.sum_x += other.sum_x;
+		root.sum_y += other.sum_y;
+		root.x0 = std::min(root.x0, other.x0);
+		root.y0 = std::min(root.y0, other.y0);
+		root.x1 = std::max(root.x1, other.x1);
+		root.y1 = std::max(root.y1, other.y1);
+	};
+
+	for (unsigned int y = 0; y < height_; y++)
+	{
+		uint8_t const *row = mask.data() + y * width_;
+		current.clear();
+		for (unsigned int x = 0; x < width_;)
+		{
+			// There's usually nothing there, so skip empty stretches 8 pixels at a time.
+			uint64_t word;
+			if (x + 8 <= width_ && (memcpy(&word, row + x, 8), !word))
+			{
+				x += 8;
+				continue;
+			}
+			if (!row[x])
+			{
+				x++;
+				continue;
+			}
+			unsigned int start = x;
+			while (x < width_ && row[x])
+				x++;
+			uint32_t n = x - start;
+			blobs.push_back({ (uint32_t)blobs.size(), n, (uint64_t)(start + x - 1) * n / 2, (uint64_t)y * n, start, y,
+							  x - 1, y });
+			current.push_back({ start, x, blobs.back().parent });
+		}
+
+		// Runs touch, diagonals included, if they overlap once each is stretched by a pixel either way.
+		size_t j = 0;
+		for (Run const &run : current)
+		{
+			while (j < previous.size() && previous[j].end < run.start)
+				j++;
+			for (size_t k = j; k < previous.size() && previous[k].start <= run.end; k++)
+				unite(previous[k].blob, run.blob);
+		}
+		std::swap(previous, current);
+	}
+
+	ParticleResults results = {};
+	results.width = stream_width_;
+	results.height = stream_height_;
+	unsigned int pixel_area = skip_ * skip_;
+	for (uint32_t i = 0; i < blobs.size(); i++)
+	{
+		Blob const &b = blobs[i];
+		uint32_t area = b.area * pixel_area;
+		if (b.parent != i || area < min_area_ || (max_area_ && area > max_area_))
+			continue;
+		results.count++;
+		results.total_area += area;
+		results.particles.push_back({ area, (b.sum_x / (float)b.area + 0.5f) * skip_,
+									  (b.sum_y / (float)b.area + 0.5f) * skip_,
+									  libcamera::Rectangle(b.x0 * skip_, b.y0 * skip_, (b.x1 - b.x0 + 1) * skip_,
+														   (b.y1 - b.y0 + 1) * skip_) });
+	}
+
+	auto larger = [](ParticleResults::Particle const &a, ParticleResults::Particle const &b) {
+		return a.area > b.area;
+	};
+	if (results.particles.size() > max_listed_)
+	{
+		std::nth_element(results.particles.begin(), results.particles.begin() + max_listed_,
+						 results.particles.end(), larger);
+		results.particles.resize(max_listed_);
+	}
+	std::sort(results.particles.begin(), results.particles.end(), larger);
+	return results;
+}
+
+void ParticleAnalysisStage::Stop()
+{
+	LOG(1, "ParticleAnalysisStage: " << particles_ << " particles in " << frames_ << " frames"
+									 << (suppress_empty_ ? ", " + std::to_string(total_suppressed_) + " suppressed"
+														 : std::string()));
+}
+
+static PostProcessingStage *Create(RPiCamApp *app)
+{
+	return new ParticleAnalysisStage(app);
+}
+
+static RegisterStage reg(NAME, &Create);
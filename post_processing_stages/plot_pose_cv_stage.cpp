@@ -62,10 +62,12 @@ public:
 	bool Process(CompletedRequestPtr &completed_request) override;
 
 private:
-	void drawFeatures(cv::Mat &img, std::vector<Point> locations, std::vector<float> confidences);
+	void addFeatures(std::vector<OverlayItem> &items, std::vector<libcamera::Point> const &locations,
+					 std::vector<float> const &confidences);
 
 	Stream *stream_;
 	float confidence_threshold_;
+	bool burn_in_;
 };
 
 #define NAME "plot_pose_cv"
@@ -83,6 +85,7 @@ void PlotPoseCvStage::Configure()
 void PlotPoseCvStage::Read(boost::property_tree::ptree const &params)
 {
 	confidence_threshold_ = params.get<float>("confidence_threshold", -1.0);
+	burn_in_ = params.get<bool>("burn_in", false);
 }
 
 bool PlotPoseCvStage::Process(CompletedRequestPtr &completed_request)
@@ -90,9 +93,6 @@ bool PlotPoseCvStage::Process(CompletedRequestPtr &completed_request)
 	if (!stream_)
 		return false;
 
-	BufferWriteSync w(app_, completed_request->buffers[stream_]);
-	libcamera::Span<uint8_t> buffer = w.Get()[0];
-	uint32_t *ptr = (uint32_t *)buffer.data();
 	StreamInfo info = app_->GetStreamInfo(stream_);
 
 	std::vector<std::vector<libcamera::Point>> lib_locations;
@@ -100,90 +100,77 @@ bool PlotPoseCvStage::Process(CompletedRequestPtr &completed_request)
 	completed_request->post_process_metadata.Get("pose_estimation.locations", lib_locations);
 	completed_request->post_process_metadata.Get("pose_estimation.confidences", confidences);
 
-	unsigned int i = 0;
-	for (auto const &loc : lib_locations)
+	std::vector<OverlayItem> items;
+	for (unsigned int i = 0; i < lib_locations.size() && i < confidences.size(); i++)
+	{
+		if (!confidences[i].empty() && !lib_locations[i].empty())
+			addFeatures(items, lib_locations[i], confidences[i]);
+	}
+
+	if (!burn_in_)
+	{
+		completed_request->overlay.Add(info.width, info.height, std::move(items));
+		return false;
+	}
+	if (items.empty())
+		return false;
+
+	BufferWriteSync w(app_, completed_request->buffers[stream_]);
+	libcamera::Span<uint8_t> buffer = w.Get()[0];
+	Mat image(info.height, info.width, CV_8U, buffer.data(), info.stride);
+	Scalar colour = Scalar(255, 255, 255);
+	for (OverlayItem const &item : items)
 	{
-		std::vector<cv::Rect> rects;
-		std::vector<Point> cv_locations;
-
-		std::vector<float> &conf = confidences[i];
-
-		if (!conf.empty() && !loc.empty())
-		{
-			Mat image(info.height, info.width, CV_8U, ptr, info.stride);
-			for (libcamera::Point lib_location : loc)
-			{
-				Point cv_location;
-				cv_location.x = lib_location.x;
-				cv_location.y = lib_location.y;
-				cv_locations.push_back(cv_location);
-			}
-			drawFeatures(image, cv_locations, conf);
-		}
+		if (item.shape == OverlayItem::Shape::Circle)
+			circle(image, Point(item.x0, item.y0), item.x1, colour, item.thickness, 8, 0);
+		else
+			line(image, Point(item.x0, item.y0), Point(item.x1, item.y1), colour, item.thickness);
 	}
 	return false;
 }
 
-void PlotPoseCvStage::drawFeatures(Mat &img, std::vector<cv::Point> locations, std::vector<float> confidences)
+void PlotPoseCvStage::addFeatures(std::vector<OverlayItem> &items, std::vector<libcamera::Point> const &locations,
+								  std::vector<float> const &confidences)
 {
-	Scalar colour = Scalar(255, 255, 255);
 	int radius = 5;
+	auto joint = [&](int a, int b) {
+		if (confidences[b] > confidence_threshold_)
+			items.push_back({ OverlayItem::Shape::Line, locations[a].x, locations[a].y, locations[b].x, locations[b].y,
+							  2 });
+	};
 
 	for (int i = 0; i < FEATURE_SIZE; i++)
 	{
 		if (confidences[i] < confidence_threshold_)
-			circle(img, locations[i], radius, colour, 2, 8, 0);
+			items.push_back({ OverlayItem::Shape::Circle, locations[i].x, locations[i].y, radius, 0, 2 });
 	}
 
 	if (confidences[leftShoulder] > confidence_threshold_)
 	{
-		if (confidences[rightShoulder] > confidence_threshold_)
-			line(img, locations[leftShoulder], locations[rightShoulder], colour, 2);
-
-		if (confidences[leftElbow] > confidence_threshold_)
-			line(img, locations[leftShoulder], locations[leftElbow], colour, 2);
-
-		if (confidences[leftHip] > confidence_threshold_)
-			line(img, locations[leftShoulder], locations[leftHip], colour, 2);
+		joint(leftShoulder, rightShoulder);
+		joint(leftShoulder, leftElbow);
+		joint(leftShoulder, leftHip);
 	}
 	if (confidences[rightShoulder] > confidence_threshold_)
 	{
-		if (confidences[rightElbow] > confidence_threshold_)
-			line(img, locations[rightShoulder], locations[rightElbow], colour, 2);
-
-		if (confidences[rightHip] > confidence_threshold_)
-			line(img, locations[rightShoulder], locations[rightHip], colour, 2);
+		joint(rightShoulder, rightElbow);
+		joint(rightShoulder, rightHip);
 	}
 	if (confidences[leftElbow] > confidence_threshold_)
-	{
-		if (confidences[leftWrist] > confidence_threshold_)
-			line(img, locations[leftElbow], locations[leftWrist], colour, 2);
-	}
+		joint(leftElbow, leftWrist);
 	if (confidences[rightElbow] > confidence_threshold_)
-	{
-		if (confidences[rightWrist] > confidence_threshold_)
-			line(img, locations[rightElbow], locations[rightWrist], colour, 2);
-	}
+		joint(rightElbow, rightWrist);
 	if (confidences[leftHip] > confidence_threshold_)
 	{
-		if (confidences[rightHip] > confidence_threshold_)
-			line(img, locations[leftHip], locations[rightHip], colour, 2);
-
-		if (confidences[leftKnee] > confidence_threshold_)
-			line(img, locations[leftHip], locations[leftKnee], colour, 2);
+		joint(leftHip, rightHip);
+		joint(leftHip, leftKnee);
 	}
 	if (confidences[leftKnee] > confidence_threshold_)
-	{
-		if (confidences[leftAnkle] > confidence_threshold_)
-			line(img, locations[leftKnee], locations[leftAnkle], colour, 2);
-	}
+		joint(leftKnee, leftAnkle);
 	if (confidences[rightKnee] > confidence_threshold_)
 	{
-		if (confidences[rightHip] > confidence_threshold_)
-			line(img, locations[rightKnee], locations[rightHip], colour, 2);
-
-		if (confidences[rightAnkle] > confidence_threshold_)
-			line(img, locations[rightKnee], locations[rightAnkle], colour, 2);
+		joint(rightKnee, rightHip);
+		joint(rightKnee, rightAnkle);
 	}
 }
 
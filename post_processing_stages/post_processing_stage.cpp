@@ -5,8 +5,90 @@
  * post_processing_stage.cpp - Post processing stage base class implementation.
  */
 
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#define HAVE_NEON_KERNELS 1
+#endif
+
+#include "core/buffer_sync.hpp"
+#include "core/logging.hpp"
+
 #include "post_processing_stage.hpp"
 
+namespace
+{
+
+// Converts a pair of YUV420 rows sharing one chroma row to RGB, for as many whole blocks of 16 pixels as fit in the
+// width, returning the number of pixels done. Whatever is left is finished off by the C code below.
+typedef unsigned int (*RgbRowsFn)(uint8_t *, uint8_t *, uint8_t const *, uint8_t const *, uint8_t const *,
+								  uint8_t const *, unsigned int);
+
+unsigned int rgb_rows_c(uint8_t *, uint8_t *, uint8_t const *, uint8_t const *, uint8_t const *, uint8_t const *,
+						unsigned int)
+{
+	return 0;
+}
+
+#if HAVE_NEON_KERNELS
+
+// The same coefficients as the C code, in 7 bit fixed point. The chroma terms are rounded where the C code
+// truncates, so results can differ by one.
+unsigned int rgb_rows_neon(uint8_t *dst0, uint8_t *dst1, uint8_t const *src_Y0, uint8_t const *src_Y1,
+						   uint8_t const *src_U, uint8_t const *src_V, unsigned int width)
+{
+	const int16x8_t offset = vdupq_n_s16(128);
+	unsigned int x = 0;
+	for (; x + 16 <= width; x += 16)
+	{
+		int16x8_t U = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(src_U + x / 2))), offset);
+		int16x8_t V = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(src_V + x / 2))), offset);
+
+		int16x8_t r = vrshrq_n_s16(vmulq_n_s16(V, 179), 7);
+		int16x8_t g = vrshrq_n_s16(vmlaq_n_s16(vmulq_n_s16(U, -44), V, -91), 7);
+		int16x8_t b = vrshrq_n_s16(vmulq_n_s16(U, 227), 7);
+		// Each chroma sample covers two pixels across.
+		int16x8x2_t r2 = vzipq_s16(r, r), g2 = vzipq_s16(g, g), b2 = vzipq_s16(b, b);
+
+		for (unsigned int row = 0; row < 2; row++)
+		{
+			uint8x16_t Y = vld1q_u8((row ? src_Y1 : src_Y0) + x);
+			int16x8_t Y_lo = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(Y)));
+			int16x8_t Y_hi = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(Y)));
+			uint8x16x3_t rgb;
+			rgb.val[0] = vcombine_u8(vqmovun_s16(vaddq_s16(Y_lo, r2.val[0])), vqmovun_s16(vaddq_s16(Y_hi, r2.val[1])));
+			rgb.val[1] = vcombine_u8(vqmovun_s16(vaddq_s16(Y_lo, g2.val[0])), vqmovun_s16(vaddq_s16(Y_hi, g2.val[1])));
+			rgb.val[2] = vcombine_u8(vqmovun_s16(vaddq_s16(Y_lo, b2.val[0])), vqmovun_s16(vaddq_s16(Y_hi, b2.val[1])));
+			vst3q_u8((row ? dst1 : dst0) + 3 * x, rgb);
+		}
+	}
+	return x;
+}
+
+#endif /* HAVE_NEON_KERNELS */
+
+RgbRowsFn select_rgb_rows()
+{
+#if HAVE_NEON_KERNELS
+	if (getauxval(AT_HWCAP) & HWCAP_ASIMD)
+	{
+		LOG(2, "YUV420 to RGB: using NEON kernels");
+		return rgb_rows_neon;
+	}
+#endif
+	LOG(2, "YUV420 to RGB: using C kernels");
+	return rgb_rows_c;
+}
+
+RgbRowsFn rgb_rows()
+{
+	static const RgbRowsFn fn = select_rgb_rows();
+	return fn;
+}
+
+} // namespace
+
 PostProcessingStage::PostProcessingStage(RPiCamApp *app) : app_(app)
 {
 }
@@ -67,7 +149,9 @@ void PostProcessingStage::Yuv420ToRgb(uint8_t *dst, const uint8_t *src, StreamIn
 		uint8_t *dst0 = &dst[y * dst_info.stride];
 		uint8_t *dst1 = dst0 + dst_info.stride;
 
-		unsigned int x = 0;
+		unsigned int x = rgb_rows()(dst0, dst1, src_Y0, src_Y1, src_U, src_V, dst_info.width);
+		src_Y0 += x, src_Y1 += x, src_U += x / 2, src_V += x / 2;
+		dst0 += 3 * x, dst1 += 3 * x;
 		for (; x < dst_w_aligned; x += 4)
 		{
 			int Y0 = *(src_Y0++);
@@ -247,6 +331,20 @@ void PostProcessingStage::Yuv420ToRgb(uint8_t *dst, const uint8_t *src, StreamIn
 	}
 }
 
+std::vector<uint8_t> const &PostProcessingStage::GetRgbImage(CompletedRequestPtr &completed_request,
+															 libcamera::Stream *stream, StreamInfo &src_info,
+															 StreamInfo &dst_info)
+{
+	std::string key = "rgb:" + std::to_string(reinterpret_cast<uintptr_t>(stream)) + ":" +
+					  std::to_string(dst_info.width) + "x" + std::to_string(dst_info.height) + ":" +
+					  std::to_string(dst_info.stride);
+	return completed_request->cache.Get(key, [&](std::vector<uint8_t> &rgb) {
+		BufferReadSync r(app_, completed_request->buffers[stream]);
+		rgb.resize(dst_info.height * dst_info.stride);
+		Yuv420ToRgb(rgb.data(), r.Get()[0].data(), src_info, dst_info);
+	});
+}
+
 static std::map<std::string, StageCreateFunc> &stages()
 {
 	static std::map<std::string, StageCreateFunc> stages;
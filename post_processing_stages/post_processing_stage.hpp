@@ -61,6 +61,11 @@ public:
 	static std::vector<uint8_t> Yuv420ToRgb(const uint8_t *src, StreamInfo &src_info, StreamInfo &dst_info);
 	static void Yuv420ToRgb(uint8_t *dst, const uint8_t *src, StreamInfo &src_info, StreamInfo &dst_info);
 
+	// The same conversion of the YUV420 image in the given stream, but made only once per frame however many stages
+	// ask for it (with the same size and stride). The result lasts as long as the request.
+	std::vector<uint8_t> const &GetRgbImage(CompletedRequestPtr &completed_request, libcamera::Stream *stream,
+											StreamInfo &src_info, StreamInfo &dst_info);
+
 protected:
 	// Helper to calculate the execution time of any callable object and return it in as a std::chrono::duration.
 	// For functions returning a value, the simplest thing would be to wrap the call in a lambda and capture
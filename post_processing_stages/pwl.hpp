@@ -8,7 +8,11 @@
 
 #include <math.h>
 
+#include <algorithm>
+#include <cstdint>
 #include <functional>
+#include <stdexcept>
+#include <type_traits>
 #include <vector>
 
 #include <boost/property_tree/ptree.hpp>
@@ -92,3 +96,35 @@ private:
 	int findSpan(double x, int span) const;
 	std::vector<Point> points_;
 };
+
+// A Pwl baked into a table of its value at every integer from 0 to the end of its domain, for the loops that would
+// otherwise evaluate it per pixel. Inputs off either end of the table are clamped to it. Interp() takes inputs with
+// "frac_bits" bits of fraction, and blends the two entries either side, so a curve over 12-bit values can map 16-bit
+// ones with no more than two loads. There is always at least one entry, so there is no default constructor, and an
+// empty Pwl (or one whose domain ends below 0) is refused.
+template <typename T> class PwlLut
+{
+public:
+	PwlLut(Pwl const &pwl) : lut_(pwl.Empty() ? std::vector<T>() : pwl.GenerateLut<T>())
+	{
+		if (lut_.empty())
+			throw std::runtime_error("PwlLut: can't make a table from an empty Pwl");
+	}
+	T operator[](int x) const { return lut_[std::clamp(x, 0, (int)lut_.size() - 1)]; }
+	T Interp(unsigned int x, unsigned int frac_bits) const
+	{
+		unsigned int i = x >> frac_bits, last = lut_.size() - 1;
+		if (i >= last)
+			return lut_[last];
+		T a = lut_[i], b = lut_[i + 1];
+		unsigned int frac = x & ((1u << frac_bits) - 1);
+		if constexpr (std::is_integral_v<T>)
+			return a + (T)(((int64_t)(b - a) * frac) >> frac_bits);
+		else
+			return a + (b - a) * (T)frac / (T)(1u << frac_bits);
+	}
+	size_t Size() const { return lut_.size(); }
+
+private:
+	std::vector<T> lut_;
+};
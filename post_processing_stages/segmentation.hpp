@@ -7,17 +7,139 @@
 
 #pragma once
 
+#include <cstdint>
+#include <cstring>
 #include <string>
 #include <vector>
 
+#include "post_processing_stages/object_detect.hpp"
+
+// A label for every pixel, at the resolution the model produced it, kept as runs of the same label along each row.
+// That is far smaller than the map itself, so it's cheap to attach to every frame, and nothing pays for a full size
+// map unless it asks for one with Decode or Upscale.
 struct Segmentation
 {
-	Segmentation(int w, int h, std::vector<std::string> l, const std::vector<uint8_t> &s)
-		: width(w), height(h), labels(l), segmentation(s)
+	// Runs never carry on from one row to the next.
+	struct Run
+	{
+		uint16_t length;
+		uint8_t label;
+	};
+
+	Segmentation(int w, int h, std::vector<std::string> l) : width(w), height(h), labels(l) { row_start.push_back(0); }
+	Segmentation(int w, int h, std::vector<std::string> l, const std::vector<uint8_t> &s) : Segmentation(w, h, l)
+	{
+		for (int y = 0; y < h; y++)
+			AddRow(&s[y * w]);
+	}
+
+	// Append the next row of width labels.
+	void AddRow(uint8_t const *row)
+	{
+		for (int x = 0; x < width;)
+		{
+			int end = x + 1;
+			while (end < width && row[end] == row[x])
+				end++;
+			runs.push_back({ static_cast<uint16_t>(end - x), row[x] });
+			x = end;
+		}
+		row_start.push_back(runs.size());
+	}
+
+	// The whole map, width by height.
+	std::vector<uint8_t> Decode() const
+	{
+		std::vector<uint8_t> map(width * height);
+		Upscale(map.data(), width, height, width);
+		return map;
+	}
+
+	// Stretch the map over a dest_width by dest_height image, choosing the nearest label for each pixel.
+	void Upscale(uint8_t *dest, unsigned int dest_width, unsigned int dest_height, unsigned int stride) const
+	{
+		int previous = -1;
+		for (unsigned int y = 0; y < dest_height; y++, dest += stride)
+		{
+			int src_y = y * height / dest_height;
+			if (src_y == previous)
+			{
+				memcpy(dest, dest - stride, dest_width);
+				continue;
+			}
+			// The run from x0 to x1 in the map is nearest to dest pixels ceil(x0 * scale) to ceil(x1 * scale).
+			unsigned int x0 = 0, dest_x0 = 0;
+			for (uint32_t i = row_start[src_y]; i < row_start[src_y + 1]; i++)
+			{
+				unsigned int x1 = x0 + runs[i].length;
+				unsigned int dest_x1 = (x1 * dest_width + width - 1) / width;
+				memset(dest + dest_x0, runs[i].label, dest_x1 - dest_x0);
+				x0 = x1, dest_x0 = dest_x1;
+			}
+			previous = src_y;
+		}
+	}
+
+	// The number of pixels with each label.
+	std::vector<unsigned int> Histogram() const
 	{
+		std::vector<unsigned int> hist(labels.size());
+		for (Run const &run : runs)
+		{
+			if (run.label < hist.size())
+				hist[run.label] += run.length;
+		}
+		return hist;
 	}
+
 	int width;
 	int height;
 	std::vector<std::string> labels;
-	std::vector<uint8_t> segmentation;
+	std::vector<Run> runs;
+	// Where each row's runs start, with one more at the end.
+	std::vector<uint32_t> row_start;
+};
+
+// The mask of one object found by an instance segmentation. The mask covers the object's box (in main image
+// co-ordinates, like object detection results) at the resolution the model produced it, one bit per pixel.
+struct InstanceMask
+{
+	InstanceMask(Detection const &d, unsigned int w, unsigned int h)
+		: detection(d), width(w), height(h), bits((w * h + 7) / 8)
+	{
+	}
+
+	bool Get(unsigned int x, unsigned int y) const
+	{
+		unsigned int i = y * width + x;
+		return (bits[i / 8] >> (i % 8)) & 1;
+	}
+	void Set(unsigned int x, unsigned int y)
+	{
+		unsigned int i = y * width + x;
+		bits[i / 8] |= 1 << (i % 8);
+	}
+
+	// Stretch the mask over a dest_width by dest_height image, writing value wherever it is set and leaving the rest.
+	void Upscale(uint8_t *dest, unsigned int dest_width, unsigned int dest_height, unsigned int stride,
+				 uint8_t value = 255) const
+	{
+		std::vector<unsigned int> src_x(dest_width);
+		for (unsigned int x = 0; x < dest_width; x++)
+			src_x[x] = x * width / dest_width;
+		for (unsigned int y = 0; y < dest_height; y++, dest += stride)
+		{
+			unsigned int src_y = y * height / dest_height;
+			for (unsigned int x = 0; x < dest_width; x++)
+			{
+				if (Get(src_x[x], src_y))
+					dest[x] = value;
+			}
+		}
+	}
+
+	Detection detection;
+	unsigned int width;
+	unsigned int height;
+	std::vector<uint8_t> bits;
 };
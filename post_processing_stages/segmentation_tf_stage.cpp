@@ -5,6 +5,13 @@
  * segmentation_tf_stage - image segmentation
  */
 
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#define HAVE_NEON_KERNELS 1
+#endif
+
 #include "segmentation.hpp"
 #include "tf_stage.hpp"
 
@@ -16,15 +23,77 @@ constexpr int HEIGHT = 257;
 struct SegmentationTfConfig : public TfConfig
 {
 	bool draw;
+	bool burn_in;
 	uint32_t threshold; // number of pixels in a category before we print its name
 };
 
 #define NAME "segmentation_tf"
 
+// Write the index of the largest of the num_categories scores of each of width pixels.
+using ArgmaxRowFn = void (*)(float const *scores, uint8_t *dest, unsigned int width, unsigned int num_categories);
+
+static void argmax_row_c(float const *scores, uint8_t *dest, unsigned int width, unsigned int num_categories)
+{
+	for (unsigned int x = 0; x < width; x++, scores += num_categories)
+		dest[x] = std::max_element(scores, scores + num_categories) - scores;
+}
+
+#if HAVE_NEON_KERNELS
+
+static void argmax_row_neon(float const *scores, uint8_t *dest, unsigned int width, unsigned int num_categories)
+{
+	unsigned int end = num_categories & ~3;
+	if (!end)
+	{
+		argmax_row_c(scores, dest, width, num_categories);
+		return;
+	}
+
+	for (unsigned int x = 0; x < width; x++, scores += num_categories)
+	{
+		// Each lane keeps the first largest score it sees, and the earliest lane holding the overall largest wins, just
+		// as std::max_element would choose.
+		float32x4_t best = vld1q_f32(scores);
+		uint32x4_t index = { 0, 1, 2, 3 }, best_index = index;
+		for (unsigned int c = 4; c < end; c += 4)
+		{
+			index = vaddq_u32(index, vdupq_n_u32(4));
+			float32x4_t s = vld1q_f32(scores + c);
+			uint32x4_t greater = vcgtq_f32(s, best);
+			best = vbslq_f32(greater, s, best);
+			best_index = vbslq_u32(greater, index, best_index);
+		}
+		float max = vmaxvq_f32(best);
+		unsigned int i = vminvq_u32(vbslq_u32(vceqq_f32(best, vdupq_n_f32(max)), best_index, vdupq_n_u32(~0u)));
+		for (unsigned int c = end; c < num_categories; c++)
+		{
+			if (scores[c] > max)
+				max = scores[c], i = c;
+		}
+		dest[x] = i;
+	}
+}
+
+#endif /* HAVE_NEON_KERNELS */
+
+static ArgmaxRowFn select_argmax_row()
+{
+#if HAVE_NEON_KERNELS
+	if (getauxval(AT_HWCAP) & HWCAP_ASIMD)
+	{
+		LOG(2, "Segmentation: using NEON kernels");
+		return argmax_row_neon;
+	}
+#endif
+	LOG(2, "Segmentation: using C kernels");
+	return argmax_row_c;
+}
+
 class SegmentationTfStage : public TfStage
 {
 public:
-	SegmentationTfStage(RPiCamApp *app) : TfStage(app, WIDTH, HEIGHT), segmentation_(WIDTH * HEIGHT)
+	SegmentationTfStage(RPiCamApp *app)
+		: TfStage(app, WIDTH, HEIGHT), segmentation_(WIDTH, HEIGHT, {}, std::vector<uint8_t>(WIDTH * HEIGHT))
 	{
 		config_ = std::make_unique<SegmentationTfConfig>();
 	}
@@ -47,7 +116,9 @@ protected:
 
 private:
 	std::vector<std::string> labels_;
-	std::vector<uint8_t> segmentation_;
+	Segmentation segmentation_;
+	// The segmentation as drawn on the preview overlay, made the first time a frame wants it.
+	std::shared_ptr<std::vector<uint8_t> const> overlay_mask_;
 };
 
 void SegmentationTfStage::readLabelsFile(const std::string &file_name)
@@ -63,9 +134,11 @@ void SegmentationTfStage::readLabelsFile(const std::string &file_name)
 void SegmentationTfStage::readExtras([[maybe_unused]] boost::property_tree::ptree const &params)
 {
 	config()->draw = params.get<int>("draw", 1);
+	config()->burn_in = params.get<bool>("burn_in", false);
 	config()->threshold = params.get<uint32_t>("threshold", 5000);
 	std::string labels_file = params.get<std::string>("labels_file", "");
 	readLabelsFile(labels_file);
+	segmentation_.labels = labels_;
 
 	// Check the output dimensions.
 	int output = interpreter_->outputs()[0];
@@ -84,25 +157,43 @@ void SegmentationTfStage::checkConfiguration()
 void SegmentationTfStage::applyResults(CompletedRequestPtr &completed_request)
 {
 	// Store the segmentation in image metadata.
-	completed_request->post_process_metadata.Set("segmentation.result",
-												Segmentation(WIDTH, HEIGHT, labels_, segmentation_));
+	completed_request->post_process_metadata.Set("segmentation.result", segmentation_);
 
 	// Optionally, draw the segmentation in the bottom right corner of the main image.
 	if (!config()->draw)
 		return;
 
-	BufferWriteSync w(app_, completed_request->buffers[main_stream_]);
-	libcamera::Span<uint8_t> buffer = w.Get()[0];
 	int y_offset = main_stream_info_.height - HEIGHT;
 	int x_offset = main_stream_info_.width - WIDTH;
 	int scale = 255 / labels_.size();
 
+	if (!config()->burn_in)
+	{
+		// White over black, in proportion to the label, is the same grey as drawing it into the image.
+		if (!overlay_mask_)
+		{
+			std::vector<uint8_t> mask = segmentation_.Decode();
+			for (uint8_t &m : mask)
+				m *= scale;
+			overlay_mask_ = std::make_shared<std::vector<uint8_t> const>(std::move(mask));
+		}
+		int x1 = main_stream_info_.width, y1 = main_stream_info_.height;
+		completed_request->overlay.Add(
+			main_stream_info_.width, main_stream_info_.height,
+			{ { OverlayItem::Shape::FilledRect, x_offset, y_offset, x1, y1, 1, 0xff000000 },
+			  { OverlayItem::Shape::Mask, x_offset, y_offset, x1, y1, 1, 0xffffffff, overlay_mask_ } });
+		return;
+	}
+
+	BufferWriteSync w(app_, completed_request->buffers[main_stream_]);
+	libcamera::Span<uint8_t> buffer = w.Get()[0];
+	uint8_t *corner = buffer.data() + y_offset * main_stream_info_.stride + x_offset;
+	segmentation_.Upscale(corner, WIDTH, HEIGHT, main_stream_info_.stride);
 	for (int y = 0; y < HEIGHT; y++)
 	{
-		uint8_t *src = &segmentation_[y * WIDTH];
-		uint8_t *dst = buffer.data() + (y + y_offset) * main_stream_info_.stride + x_offset;
+		uint8_t *dst = corner + y * main_stream_info_.stride;
 		for (int x = 0; x < WIDTH; x++)
-			*(dst++) = scale * *(src++);
+			dst[x] *= scale;
 	}
 
 	// Also make it greyscale.
@@ -121,28 +212,28 @@ void SegmentationTfStage::applyResults(CompletedRequestPtr &completed_request)
 
 void SegmentationTfStage::interpretOutputs()
 {
+	static const ArgmaxRowFn argmax_row = select_argmax_row();
 	float *output = interpreter_->tensor(interpreter_->outputs()[0])->data.f;
-	uint8_t *seg_ptr = &segmentation_[0];
 	int num_categories = labels_.size();
-	std::vector<std::pair<size_t, int>> hist(num_categories);
-	std::generate(hist.begin(), hist.end(), [i = 0]() mutable { return std::pair<size_t, int>(0, i++); });
 
-	// Extract the segmentation from the output tensor. Also accumulate a histogram.
-
-	for (int y = 0; y < HEIGHT; y++)
+	// Extract the segmentation from the output tensor. For each pixel we get a "confidence" value for every category
+	// - pick the largest.
+	segmentation_ = Segmentation(WIDTH, HEIGHT, labels_);
+	uint8_t row[WIDTH];
+	for (int y = 0; y < HEIGHT; y++, output += WIDTH * num_categories)
 	{
-		for (int x = 0; x < WIDTH; x++, output += num_categories)
-		{
-			// For each pixel we get a "confidence" value for every category - pick the largest.
-			int index = std::max_element(output, output + num_categories) - output;
-			*(seg_ptr++) = index;
-			hist[index].first++;
-		}
+		argmax_row(output, row, WIDTH, num_categories);
+		segmentation_.AddRow(row);
 	}
+	overlay_mask_.reset();
 
 	if (config()->verbose)
 	{
 		// Output the category names of the largest histogram bins.
+		std::vector<unsigned int> counts = segmentation_.Histogram();
+		std::vector<std::pair<size_t, int>> hist(num_categories);
+		for (int i = 0; i < num_categories; i++)
+			hist[i] = { counts[i], i };
 		std::sort(hist.begin(), hist.end(), [](const auto &lhs, const auto &rhs) { return lhs.first > rhs.first; });
 		for (int i = 0; i < num_categories && hist[i].first >= config()->threshold; i++)
 			std::cerr << (i ? ", " : "") << labels_[hist[i].second] << " (" << hist[i].first << ")";
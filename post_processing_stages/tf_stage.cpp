@@ -4,6 +4,20 @@
  *
  * tf_stage.hpp - base class for TensorFlowLite stages
  */
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if TFLITE_XNNPACK_PRESENT
+#include "tensorflow/lite/delegates/xnnpack/xnnpack_delegate.h"
+#endif
+#if TFLITE_GPU_PRESENT
+#include "tensorflow/lite/delegates/gpu/delegate.h"
+#endif
+#if TFLITE_EXTERNAL_DELEGATE_PRESENT
+#include "tensorflow/lite/delegates/external/external_delegate.h"
+#endif
+
 #include "tf_stage.hpp"
 
 TfStage::TfStage(RPiCamApp *app, int tf_w, int tf_h) : PostProcessingStage(app), tf_w_(tf_w), tf_h_(tf_h)
@@ -20,6 +34,15 @@ void TfStage::Read(boost::property_tree::ptree const &params)
 	config_->verbose = params.get<int>("verbose", 0);
 	config_->normalisation_offset = params.get<float>("normalisation_offset", 127.5);
 	config_->normalisation_scale = params.get<float>("normalisation_scale", 127.5);
+	config_->hold_request = params.get<int>("hold_request", 0);
+	config_->delegate = params.get<std::string>("delegate", "none");
+	config_->delegate_library = params.get<std::string>("delegate_library", "");
+	if (auto options = params.get_child_optional("delegate_options"))
+	{
+		for (auto const &[key, value] : *options)
+			config_->delegate_options.emplace_back(key, value.data());
+	}
+	config_->warm_up = params.get<unsigned int>("warm_up", 2);
 
 	initialise();
 
@@ -41,16 +64,38 @@ void TfStage::initialise()
 	if (config_->number_of_threads != -1)
 		interpreter_->SetNumThreads(config_->number_of_threads);
 
+	if (config_->delegate != "none")
+	{
+		createDelegate();
+		if (interpreter_->ModifyGraphWithDelegate(delegate_.get()) != kTfLiteOk)
+			throw std::runtime_error("TfStage: Failed to apply " + config_->delegate + " delegate");
+		LOG(1, "TfStage: Using " << config_->delegate << " delegate");
+	}
+
 	if (interpreter_->AllocateTensors() != kTfLiteOk)
 		throw std::runtime_error("TfStage: Failed to allocate tensors");
 
 	// Make an attempt to verify that the model expects this size of input.
 	int input = interpreter_->inputs()[0];
-	size_t size = interpreter_->tensor(input)->bytes;
+	TfLiteTensor const *tensor = interpreter_->tensor(input);
+	size_t size = tensor->bytes;
 	size_t check = tf_w_ * tf_h_ * 3; // assume RGB
-	if (interpreter_->tensor(input)->type == kTfLiteUInt8)
+	if (tensor->type == kTfLiteUInt8)
 		check *= sizeof(uint8_t);
-	else if (interpreter_->tensor(input)->type == kTfLiteFloat32)
+	else if (tensor->type == kTfLiteInt8)
+	{
+		check *= sizeof(int8_t);
+		// Normalise each RGB value just as for float models, then quantise it the way the tensor says.
+		if (tensor->params.scale <= 0)
+			throw std::runtime_error("TfStage: int8 input tensor has no quantisation");
+		for (unsigned int i = 0; i < 256; i++)
+		{
+			float value = (i - config_->normalisation_offset) / config_->normalisation_scale;
+			int q = std::lround(value / tensor->params.scale) + tensor->params.zero_point;
+			int8_table_[i] = std::clamp(q, -128, 127);
+		}
+	}
+	else if (tensor->type == kTfLiteFloat32)
 		check *= sizeof(float);
 	else
 		throw std::runtime_error("TfStage: Input tensor data type not supported");
@@ -60,6 +105,68 @@ void TfStage::initialise()
 		throw std::runtime_error("TfStage: Input tensor size mismatch");
 }
 
+void TfStage::createDelegate()
+{
+	std::string const &name = config_->delegate;
+#if TFLITE_XNNPACK_PRESENT
+	if (name == "xnnpack")
+	{
+		TfLiteXNNPackDelegateOptions options = TfLiteXNNPackDelegateOptionsDefault();
+		if (config_->number_of_threads > 0)
+			options.num_threads = config_->number_of_threads;
+		delegate_ = tflite::Interpreter::TfLiteDelegatePtr(TfLiteXNNPackDelegateCreate(&options),
+														   TfLiteXNNPackDelegateDelete);
+	}
+#endif
+#if TFLITE_GPU_PRESENT
+	if (name == "gpu")
+	{
+		TfLiteGpuDelegateOptionsV2 options = TfLiteGpuDelegateOptionsV2Default();
+		options.inference_preference = TFLITE_GPU_INFERENCE_PREFERENCE_SUSTAINED_SPEED;
+		delegate_ = tflite::Interpreter::TfLiteDelegatePtr(TfLiteGpuDelegateV2Create(&options),
+														   TfLiteGpuDelegateV2Delete);
+	}
+#endif
+#if TFLITE_EXTERNAL_DELEGATE_PRESENT
+	if (name == "external")
+	{
+		if (config_->delegate_library.empty())
+			throw std::runtime_error("TfStage: External delegate needs a delegate_library");
+		TfLiteExternalDelegateOptions options =
+			TfLiteExternalDelegateOptionsDefault(config_->delegate_library.c_str());
+		for (auto const &[key, value] : config_->delegate_options)
+			options.insert(&options, key.c_str(), value.c_str());
+		delegate_ = tflite::Interpreter::TfLiteDelegatePtr(TfLiteExternalDelegateCreate(&options),
+														   TfLiteExternalDelegateDelete);
+	}
+#endif
+	if (!delegate_)
+		throw std::runtime_error("TfStage: " + name + " delegate is not available");
+}
+
+void TfStage::warmUp()
+{
+	// Time the first inference separately, as that's where delegates do most of their setting up.
+	int index = interpreter_->inputs()[0];
+	TfLiteTensor *tensor = interpreter_->tensor(index);
+	double first = 0, rest = 0;
+	for (unsigned int i = 0; i < config_->warm_up; i++)
+	{
+		memset(tensor->data.raw, 0, tensor->bytes);
+		double t = ExecutionTime<std::milli>([this]() {
+					   if (interpreter_->Invoke() != kTfLiteOk)
+						   throw std::runtime_error("TfStage: Failed to invoke TFLite");
+				   }).count();
+		(i ? rest : first) += t;
+	}
+
+	if (config_->warm_up == 1)
+		LOG(1, "TfStage: First inference took " << first << " ms");
+	else if (config_->warm_up > 1)
+		LOG(1, "TfStage: First inference took " << first << " ms, then " << rest / (config_->warm_up - 1)
+												<< " ms each");
+}
+
 void TfStage::Configure()
 {
 	lores_stream_ = app_->LoresStream();
@@ -88,6 +195,19 @@ void TfStage::Configure()
 		LOG(1, "TfStage: No main stream");
 
 	checkConfiguration();
+
+	if (!warmed_up_)
+	{
+		warmUp();
+		warmed_up_ = true;
+	}
+}
+
+void TfStage::Start()
+{
+	abort_ = false;
+	have_pending_ = false;
+	thread_ = std::thread(&TfStage::inferenceThread, this);
 }
 
 bool TfStage::Process(CompletedRequestPtr &completed_request)
@@ -95,27 +215,23 @@ bool TfStage::Process(CompletedRequestPtr &completed_request)
 	if (!lores_stream_)
 		return false;
 
+	if (wantInference(completed_request))
 	{
-		std::unique_lock<std::mutex> lck(future_mutex_);
-		if (config_->refresh_rate && completed_request->sequence % config_->refresh_rate == 0 &&
-			(!future_ || future_->wait_for(std::chrono::seconds(0)) == std::future_status::ready))
+		std::unique_lock<std::mutex> lock(input_mutex_);
+		Input &pending = inputs_[0];
+		if (config_->hold_request)
+			pending.request = completed_request;
+		else
 		{
-			BufferReadSync r(app_, completed_request->buffers[lores_stream_]);
-			libcamera::Span<uint8_t> buffer = r.Get()[0];
-
-			// Copy the lores image here and let the asynchronous thread convert it to RGB.
-			// Doing the "extra" copy is in fact hugely beneficial because it turns uncacned
-			// memory into cached memory, which is then *much* quicker.
-			lores_copy_.assign(buffer.data(), buffer.data() + buffer.size());
-
-			future_ = std::make_unique<std::future<void>>();
-			*future_ = std::async(std::launch::async, [this] {
-				auto time_taken = ExecutionTime<std::micro>(&TfStage::runInference, this).count();
-
-				if (config_->verbose)
-					LOG(1, "TfStage: Inference time: " << time_taken << " ms");
-			});
+			// Copy the RGB image into the pending buffer, which keeps its allocation from one frame to the next. The
+			// conversion is made once per frame, and shared with any other stage that wants the same image.
+			StreamInfo tf_info;
+			tf_info.width = tf_w_, tf_info.height = tf_h_, tf_info.stride = tf_w_ * 3;
+			pending.rgb_image = GetRgbImage(completed_request, lores_stream_, lores_info_, tf_info);
 		}
+		pending.timestamp = completed_request->metadata.get(libcamera::controls::SensorTimestamp).value_or(0);
+		have_pending_ = true;
+		input_cond_.notify_one();
 	}
 
 	std::unique_lock<std::mutex> lock(output_mutex_);
@@ -124,35 +240,100 @@ bool TfStage::Process(CompletedRequestPtr &completed_request)
 	return false;
 }
 
-void TfStage::runInference()
+bool TfStage::wantInference(CompletedRequestPtr &completed_request)
 {
-	int input = interpreter_->inputs()[0];
+	return config_->refresh_rate && completed_request->sequence % config_->refresh_rate == 0;
+}
+
+void TfStage::inferenceThread()
+{
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(input_mutex_);
+			input_cond_.wait(lock, [this] { return abort_ || have_pending_; });
+			if (abort_)
+				return;
+			std::swap(inputs_[0], inputs_[1]);
+			have_pending_ = false;
+		}
+
+		try
+		{
+			auto time_taken = ExecutionTime<std::micro>(&TfStage::runInference, this, inputs_[1]).count();
+			if (config_->verbose)
+				LOG(1, "TfStage: Inference time: " << time_taken << " us (invoke " << invoke_time_ << " us)");
+		}
+		catch (std::exception const &e)
+		{
+			LOG_ERROR("ERROR: " << e.what());
+		}
+		// Let go of the camera buffer as soon as we're finished with it.
+		inputs_[1].request.reset();
+	}
+}
+
+void TfStage::fillInput(Input &input)
+{
+	int index = interpreter_->inputs()[0];
+	TfLiteType type = interpreter_->tensor(index)->type;
 	StreamInfo tf_info;
 	tf_info.width = tf_w_, tf_info.height = tf_h_, tf_info.stride = tf_w_ * 3;
-	std::vector<uint8_t> rgb_image = Yuv420ToRgb(lores_copy_.data(), lores_info_, tf_info);
 
-	if (interpreter_->tensor(input)->type == kTfLiteUInt8)
+	if (type == kTfLiteUInt8 || type == kTfLiteInt8)
 	{
-		uint8_t *tensor = interpreter_->typed_tensor<uint8_t>(input);
-		for (unsigned int i = 0; i < rgb_image.size(); i++)
-			tensor[i] = rgb_image[i];
+		// Both go straight into the tensor with no float conversion; int8 values are then looked up in place.
+		uint8_t *tensor = interpreter_->tensor(index)->data.uint8;
+		if (input.request)
+		{
+			BufferReadSync r(app_, input.request->buffers[lores_stream_]);
+			Yuv420ToRgb(tensor, r.Get()[0].data(), lores_info_, tf_info);
+		}
+		else
+			memcpy(tensor, input.rgb_image.data(), input.rgb_image.size());
+
+		if (type == kTfLiteInt8)
+		{
+			size_t size = tf_w_ * tf_h_ * 3;
+			for (size_t i = 0; i < size; i++)
+				tensor[i] = int8_table_[tensor[i]];
+		}
 	}
-	else if (interpreter_->tensor(input)->type == kTfLiteFloat32)
+	else if (type == kTfLiteFloat32)
 	{
-		float *tensor = interpreter_->typed_tensor<float>(input);
+		std::vector<uint8_t> const &rgb_image =
+			input.request ? GetRgbImage(input.request, lores_stream_, lores_info_, tf_info) : input.rgb_image;
+		float *tensor = interpreter_->typed_tensor<float>(index);
 		for (unsigned int i = 0; i < rgb_image.size(); i++)
 			tensor[i] = (rgb_image[i] - config_->normalisation_offset) / config_->normalisation_scale;
 	}
+}
 
-	if (interpreter_->Invoke() != kTfLiteOk)
-		throw std::runtime_error("TfStage: Failed to invoke TFLite");
+void TfStage::runInference(Input &input)
+{
+	fillInput(input);
+
+	invoke_time_ = ExecutionTime<std::micro>([this]() {
+					   if (interpreter_->Invoke() != kTfLiteOk)
+						   throw std::runtime_error("TfStage: Failed to invoke TFLite");
+				   }).count();
 
 	std::unique_lock<std::mutex> lock(output_mutex_);
 	interpretOutputs();
+	output_timestamp_ = input.timestamp;
 }
 
 void TfStage::Stop()
 {
-	if (future_)
-		future_->wait();
+	{
+		std::lock_guard<std::mutex> lock(input_mutex_);
+		abort_ = true;
+	}
+	input_cond_.notify_one();
+	if (thread_.joinable())
+		thread_.join();
+	// Don't keep camera buffers past the point where the camera stops.
+	for (Input &input : inputs_)
+		input.request.reset();
+	have_pending_ = false;
 }
@@ -7,8 +7,13 @@
 
 #pragma once
 
+#include <array>
+#include <condition_variable>
 #include <memory>
 #include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
 #include <libcamera/stream.h>
@@ -36,6 +41,18 @@ struct TfConfig
 	bool verbose = false;
 	float normalisation_offset = 127.5;
 	float normalisation_scale = 127.5;
+	// Keep hold of the request itself while inference runs, rather than a copy of its image. This ties up one camera
+	// buffer for the length of each inference, but lets uint8 and int8 models convert the image straight into the
+	// input tensor.
+	bool hold_request = false;
+	// What runs the model: "none" for TFLite's own CPU kernels, "xnnpack", "gpu", or "external" to load the delegate
+	// in delegate_library and pass it the delegate_options.
+	std::string delegate = "none";
+	std::string delegate_library;
+	std::vector<std::pair<std::string, std::string>> delegate_options;
+	// Inferences to run on a blank image when the stage is first configured, so that the first real frame isn't held
+	// up by the delegate getting ready, and to report how long an inference takes.
+	unsigned int warm_up = 2;
 };
 
 class TfStage : public PostProcessingStage
@@ -53,6 +70,8 @@ public:
 
 	void Configure() override;
 
+	void Start() override;
+
 	bool Process(CompletedRequestPtr &completed_request) override;
 
 	void Stop() override;
@@ -70,6 +89,9 @@ protected:
 	// and/or fail.
 	virtual void checkConfiguration() {}
 
+	// Whether to run the model on this frame. By default that's every refresh_rate'th frame.
+	virtual bool wantInference(CompletedRequestPtr &completed_request);
+
 	// This runs asynchronously from the main thread right after the model has run. The
 	// outputs should be processed into a form where applyResults can make use of them.
 	virtual void interpretOutputs() {}
@@ -93,14 +115,42 @@ protected:
 	StreamInfo main_stream_info_;
 
 	std::unique_ptr<tflite::FlatBufferModel> model_;
+	// The delegate must outlive the interpreter that uses it.
+	tflite::Interpreter::TfLiteDelegatePtr delegate_ { nullptr, [](TfLiteDelegate *) {} };
 	std::unique_ptr<tflite::Interpreter> interpreter_;
 
+	// The sensor timestamp (in ns) of the frame that the latest outputs were made from, which is some frames before
+	// the one they get applied to.
+	int64_t output_timestamp_ = 0;
+
 private:
-	void initialise();
-	void runInference();
+	// The next frame to run inference on: either the request itself, or a copy of its RGB image.
+	struct Input
+	{
+		CompletedRequestPtr request;
+		std::vector<uint8_t> rgb_image;
+		int64_t timestamp = 0;
+	};
 
-	std::mutex future_mutex_;
-	std::unique_ptr<std::future<void>> future_;
-	std::vector<uint8_t> lores_copy_;
+	void initialise();
+	void createDelegate();
+	void warmUp();
+	void inferenceThread();
+	void fillInput(Input &input);
+	void runInference(Input &input);
+
+	// Inputs are double buffered. Process() fills in the pending one, replacing a frame that hasn't been started on
+	// yet, while the inference thread works on the other.
+	std::mutex input_mutex_;
+	std::condition_variable input_cond_;
+	Input inputs_[2];
+	bool have_pending_ = false;
+	bool abort_ = false;
+	std::thread thread_;
 	std::mutex output_mutex_;
+	// Maps RGB values straight to the quantised values an int8 input tensor wants.
+	std::array<int8_t, 256> int8_table_;
+	bool warmed_up_ = false;
+	// How long the last Invoke took, in microseconds.
+	double invoke_time_ = 0;
 };
@@ -5,14 +5,26 @@
  * drm_preview.cpp - DRM-based preview window.
  */
 
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+
 #include <drm.h>
 #include <drm_fourcc.h>
 #include <drm_mode.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 #include "core/options.hpp"
+#include "core/overlay.hpp"
 
+#include "import_cache.hpp"
 #include "preview.hpp"
 
 class DrmPreview : public Preview
@@ -23,9 +35,13 @@ public:
 	// Display the buffer. You get given the fd back in the BufferDoneCallback
 	// once its available for re-use.
 	virtual void Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &info) override;
+	virtual void SetOverlay(OverlayLayer const &overlay) override { overlay_ = overlay; }
+	virtual void Import(int fd, size_t size, StreamInfo const &info) override;
 	// Reset the preview window, clearing the current buffers and being ready to
 	// show new ones.
 	virtual void Reset() override;
+	// Check if the preview has given up, as when the event thread fails.
+	virtual bool Quit() override;
 	// Return the maximum image size allowed.
 	virtual void MaxImageSize(unsigned int &w, unsigned int &h) const override
 	{
@@ -43,9 +59,55 @@ private:
 		uint32_t bo_handle;
 		unsigned int fb_handle;
 	};
+	// Enough for the camera buffers of a couple of streams, and then some.
+	static constexpr unsigned int MAX_BUFFERS = 32;
+	// A frame to put on the plane, and where.
+	struct Flip
+	{
+		int fd = -1;
+		unsigned int fb_handle;
+		unsigned int src_width, src_height;
+		unsigned int x, y, width, height;
+		int overlay = -1; // which of overlay_buffers_ goes on the overlay plane, if any
+	};
+	// The properties an atomic commit sets on a plane.
+	struct PlaneProperties
+	{
+		uint32_t fb_id, crtc_id;
+		uint32_t src_x, src_y, src_w, src_h;
+		uint32_t crtc_x, crtc_y, crtc_w, crtc_h;
+	};
+	// The overlay is drawn into a buffer covering the whole of the preview window, of which the rectangle the frame
+	// is shown in was last drawn at x, y, width, height.
+	struct OverlayBuffer
+	{
+		uint32_t handle = 0;
+		unsigned int fb_handle = 0;
+		uint32_t *pixels = nullptr;
+		size_t size = 0;
+		unsigned int stride = 0;
+		unsigned int x = 0, y = 0, width = 0, height = 0;
+	};
+	// One on the screen, one committed, one waiting in mailbox mode, and one to draw the next in.
+	static constexpr unsigned int NUM_OVERLAY_BUFFERS = 4;
 	void makeBuffer(int fd, size_t size, StreamInfo const &info, Buffer &buffer);
+	Buffer &getBuffer(int fd, size_t size, StreamInfo const &info);
+	void releaseBuffer(Buffer &buffer);
 	void findCrtc();
 	void findPlane();
+	void findOverlayPlane();
+	void findPlaneProperties(uint32_t plane_id, PlaneProperties &props);
+	void makeOverlayBuffers();
+	void releaseOverlayBuffers();
+	int drawOverlay(unsigned int x, unsigned int y, unsigned int width, unsigned int height);
+	void addPlane(drmModeAtomicReqPtr req, uint32_t plane_id, PlaneProperties const &props, unsigned int fb_handle,
+				  unsigned int src_width, unsigned int src_height, unsigned int x, unsigned int y, unsigned int width,
+				  unsigned int height);
+	void commit(Flip const &flip);
+	void eventThread();
+	static void pageFlipHandler(int fd, unsigned int sequence, unsigned int tv_sec, unsigned int tv_usec,
+								void *user_data);
+	void flipDone(std::vector<int> &done);
 	int drmfd_;
 	int conId_;
 	uint32_t crtcId_;
@@ -58,15 +120,73 @@ private:
 	unsigned int height_;
 	unsigned int screen_width_;
 	unsigned int screen_height_;
-	std::map<int, Buffer> buffers_; // map the DMABUF's fd to the Buffer
+	ImportCache<Buffer> buffers_; // map the DMABUF's fd to the Buffer
 	int last_fd_;
 	unsigned int max_image_width_;
 	unsigned int max_image_height_;
 	bool first_time_;
+
+	// With atomic modesetting, frames go to the plane in non-blocking commits, and the page flip event that says a new
+	// frame is on the screen hands back the one it replaced. There's only ever one commit in flight. Frames that come
+	// while it is either wait for it to finish or, in mailbox mode, replace any frame already waiting to go next.
+	bool atomic_;
+	bool mailbox_;
+	PlaneProperties plane_props_;
+	std::mutex flip_mutex_;
+	std::condition_variable flip_cond_;
+	Flip flipping_; // committed, but not yet on the screen
+	Flip next_; // mailbox mode only, to go when flipping_ is done
+	std::thread event_thread_;
+	int abort_fd_;
+	bool failed_; // the event thread has stopped with an error, so no more flips will finish
+	std::vector<int> returned_fds_; // only used by the event thread
+
+	// Stages' overlays go on a plane of their own, above the frame's, so that they are never drawn into the frame.
+	// The buffer on the plane is only redrawn when the overlay changes. Without a spare ARGB plane they aren't shown.
+	uint32_t overlay_plane_id_;
+	PlaneProperties overlay_props_;
+	uint32_t prop_overlay_zpos_;
+	uint64_t overlay_zpos_;
+	OverlayBuffer overlay_buffers_[NUM_OVERLAY_BUFFERS];
+	OverlayLayer overlay_; // to go with the next frame shown
+	OverlayLayer overlay_drawn_; // what overlay_current_ holds
+	int overlay_current_;
+	int last_overlay_; // the overlay buffer on the screen, like last_fd_
 };
 
 #define ERRSTR strerror(errno)
 
+// The id of the named property of a plane, or 0 if it hasn't got one. If value isn't null, it gets the current value.
+static uint32_t drm_plane_property(int fd, uint32_t plane_id, char const *name, uint64_t *value = nullptr)
+{
+	uint32_t id = 0;
+	drmModeObjectPropertiesPtr properties = drmModeObjectGetProperties(fd, plane_id, DRM_MODE_OBJECT_PLANE);
+	if (!properties)
+		return 0;
+	for (unsigned int i = 0; i < properties->count_props && !id; i++)
+	{
+		drmModePropertyPtr prop = drmModeGetProperty(fd, properties->props[i]);
+		if (!prop)
+			continue;
+		if (!strcmp(prop->name, name))
+		{
+			id = prop->prop_id;
+			if (value)
+				*value = properties->prop_values[i];
+		}
+		drmModeFreeProperty(prop);
+	}
+	drmModeFreeObjectProperties(properties);
+	return id;
+}
+
+static uint64_t drm_plane_type(int fd, uint32_t plane_id)
+{
+	uint64_t type = DRM_PLANE_TYPE_OVERLAY;
+	drm_plane_property(fd, plane_id, "type", &type);
+	return type;
+}
+
 void DrmPreview::findCrtc()
 {
 	int i;
@@ -213,6 +333,13 @@ void DrmPreview::findPlane()
 				continue;
 			}
 
+			// Atomic clients see the primary and cursor planes too, and we mustn't take over the primary one.
+			if (atomic_ && drm_plane_type(drmfd_, plane->plane_id) != DRM_PLANE_TYPE_OVERLAY)
+			{
+				drmModeFreePlane(plane);
+				continue;
+			}
+
 			for (j = 0; j < plane->count_formats; ++j)
 			{
 				if (plane->formats[j] == out_fourcc_)
@@ -242,7 +369,75 @@ void DrmPreview::findPlane()
 	drmModeFreePlaneResources(planes);
 }
 
-DrmPreview::DrmPreview(Options const *options) : Preview(options), last_fd_(-1), first_time_(true)
+void DrmPreview::findOverlayPlane()
+{
+	overlay_plane_id_ = 0;
+	drmModePlaneResPtr planes = drmModeGetPlaneResources(drmfd_);
+	if (!planes)
+		return;
+
+	for (unsigned int i = 0; i < planes->count_planes && !overlay_plane_id_; ++i)
+	{
+		drmModePlanePtr plane = drmModeGetPlane(drmfd_, planes->planes[i]);
+		if (!plane)
+			continue;
+		if (plane->plane_id != planeId_ && (plane->possible_crtcs & (1 << crtcIdx_)) &&
+			(!atomic_ || drm_plane_type(drmfd_, plane->plane_id) == DRM_PLANE_TYPE_OVERLAY))
+		{
+			for (unsigned int j = 0; j < plane->count_formats; ++j)
+			{
+				if (plane->formats[j] == DRM_FORMAT_ARGB8888)
+				{
+					overlay_plane_id_ = plane->plane_id;
+					break;
+				}
+			}
+		}
+		drmModeFreePlane(plane);
+	}
+	drmModeFreePlaneResources(planes);
+
+	if (!overlay_plane_id_)
+	{
+		LOG(1, "DrmPreview: no spare ARGB plane, so overlays won't be shown");
+		return;
+	}
+
+	// Make sure the overlay goes on top of the frame, where the planes say what order they go in.
+	prop_overlay_zpos_ = 0;
+	if (atomic_)
+	{
+		findPlaneProperties(overlay_plane_id_, overlay_props_);
+		uint64_t zpos;
+		if (drm_plane_property(drmfd_, planeId_, "zpos", &zpos))
+		{
+			prop_overlay_zpos_ = drm_plane_property(drmfd_, overlay_plane_id_, "zpos");
+			overlay_zpos_ = zpos + 1;
+		}
+	}
+	LOG(2, "DrmPreview: overlays go on plane " << overlay_plane_id_);
+}
+
+void DrmPreview::findPlaneProperties(uint32_t plane_id, PlaneProperties &props)
+{
+	std::pair<char const *, uint32_t *> ids[] = {
+		{ "FB_ID", &props.fb_id },   { "CRTC_ID", &props.crtc_id }, { "SRC_X", &props.src_x },
+		{ "SRC_Y", &props.src_y },   { "SRC_W", &props.src_w },     { "SRC_H", &props.src_h },
+		{ "CRTC_X", &props.crtc_x }, { "CRTC_Y", &props.crtc_y },   { "CRTC_W", &props.crtc_w },
+		{ "CRTC_H", &props.crtc_h },
+	};
+	for (auto &[name, id] : ids)
+	{
+		*id = drm_plane_property(drmfd_, plane_id, name);
+		if (!*id)
+			throw std::runtime_error("drm: plane has no " + std::string(name) + " property");
+	}
+}
+
+DrmPreview::DrmPreview(Options const *options)
+	: Preview(options), buffers_(MAX_BUFFERS, [this](Buffer &buffer) { releaseBuffer(buffer); }), last_fd_(-1),
+	  first_time_(true), atomic_(false), mailbox_(options->Get().preview_mailbox), abort_fd_(-1),
+	  failed_(false), overlay_plane_id_(0), overlay_current_(-1), last_overlay_(-1)
 {
 	drmfd_ = drmOpen("vc4", NULL);
 	if (drmfd_ < 0)
@@ -260,10 +455,19 @@ DrmPreview::DrmPreview(Options const *options) : Preview(options), last_fd_(-1),
 		if (!drmIsMaster(drmfd_))
 			throw std::runtime_error("DRM preview unavailable - not master");
 
+		// Use atomic modesetting where the driver has it, otherwise the legacy (blocking) API.
+		atomic_ = drmSetClientCap(drmfd_, DRM_CLIENT_CAP_ATOMIC, 1) == 0;
+
 		conId_ = 0;
 		findCrtc();
 		out_fourcc_ = DRM_FORMAT_YUV420;
+		planeId_ = 0;
 		findPlane();
+		if (!planeId_)
+			throw std::runtime_error("drm: no plane for YUV420");
+		if (atomic_)
+			findPlaneProperties(planeId_, plane_props_);
+		findOverlayPlane();
 	}
 	catch (std::exception const &e)
 	{
@@ -271,6 +475,19 @@ DrmPreview::DrmPreview(Options const *options) : Preview(options), last_fd_(-1),
 		throw;
 	}
 
+	if (atomic_)
+	{
+		abort_fd_ = eventfd(0, EFD_CLOEXEC);
+		if (abort_fd_ < 0)
+		{
+			close(drmfd_);
+			throw std::runtime_error("DrmPreview: failed to create eventfd");
+		}
+		event_thread_ = std::thread(&DrmPreview::eventThread, this);
+	}
+	LOG(2, "DrmPreview: using " << (atomic_ ? "atomic modesetting" : "legacy modesetting")
+								<< (atomic_ && mailbox_ ? ", mailbox mode" : ""));
+
 	// Default behaviour here is to go fullscreen.
 	if (options_->Get().fullscreen || width_ == 0 || height_ == 0 || x_ + width_ > screen_width_ ||
 		y_ + height_ > screen_height_)
@@ -283,6 +500,16 @@ DrmPreview::DrmPreview(Options const *options) : Preview(options), last_fd_(-1),
 
 DrmPreview::~DrmPreview()
 {
+	if (event_thread_.joinable())
+	{
+		uint64_t one = 1;
+		if (write(abort_fd_, &one, sizeof(one)) < 0)
+			LOG(1, "DrmPreview: failed to stop event thread");
+		event_thread_.join();
+		close(abort_fd_);
+	}
+	buffers_.Clear();
+	releaseOverlayBuffers();
 	close(drmfd_);
 }
 
@@ -389,11 +616,252 @@ void DrmPreview::makeBuffer(int fd, size_t size, StreamInfo const &info, Buffer
 		throw std::runtime_error("drmModeAddFB2 failed: " + std::string(ERRSTR));
 }
 
+DrmPreview::Buffer &DrmPreview::getBuffer(int fd, size_t size, StreamInfo const &info)
+{
+	Buffer *buffer = buffers_.Get(fd, size, info);
+	if (buffer)
+		return *buffer;
+
+	Buffer new_buffer;
+	makeBuffer(fd, size, info, new_buffer);
+	std::lock_guard<std::mutex> lock(flip_mutex_);
+	return buffers_.Add(fd, size, info, new_buffer, { last_fd_, flipping_.fd, next_.fd });
+}
+
+void DrmPreview::releaseBuffer(Buffer &buffer)
+{
+	drmModeRmFB(drmfd_, buffer.fb_handle);
+	// Apparently a "bo_handle" is a "gem" thing, and it needs closing. It feels like there
+	// ought be an API to match "drmPrimeFDToHandle" for this, but I can only find an ioctl.
+	drm_gem_close gem_close = {};
+	gem_close.handle = buffer.bo_handle;
+	if (drmIoctl(drmfd_, DRM_IOCTL_GEM_CLOSE, &gem_close) < 0)
+		// I have no idea what this would mean, so complain and try to carry on...
+		LOG(1, "DRM_IOCTL_GEM_CLOSE failed");
+}
+
+void DrmPreview::makeOverlayBuffers()
+{
+	for (OverlayBuffer &b : overlay_buffers_)
+	{
+		drm_mode_create_dumb create = {};
+		create.width = width_;
+		create.height = height_;
+		create.bpp = 32;
+		if (drmIoctl(drmfd_, DRM_IOCTL_MODE_CREATE_DUMB, &create) < 0)
+			throw std::runtime_error("DRM_IOCTL_MODE_CREATE_DUMB failed: " + std::string(ERRSTR));
+		b.handle = create.handle;
+		b.stride = create.pitch;
+		b.size = create.size;
+
+		uint32_t handles[4] = { b.handle }, pitches[4] = { b.stride }, offsets[4] = { 0 };
+		if (drmModeAddFB2(drmfd_, width_, height_, DRM_FORMAT_ARGB8888, handles, pitches, offsets, &b.fb_handle, 0))
+			throw std::runtime_error("drmModeAddFB2 failed for overlay: " + std::string(ERRSTR));
+
+		drm_mode_map_dumb map = {};
+		map.handle = b.handle;
+		if (drmIoctl(drmfd_, DRM_IOCTL_MODE_MAP_DUMB, &map) < 0)
+			throw std::runtime_error("DRM_IOCTL_MODE_MAP_DUMB failed: " + std::string(ERRSTR));
+		void *mem = mmap(0, b.size, PROT_READ | PROT_WRITE, MAP_SHARED, drmfd_, map.offset);
+		if (mem == MAP_FAILED)
+			throw std::runtime_error("failed to map overlay buffer: " + std::string(ERRSTR));
+		b.pixels = static_cast<uint32_t *>(mem);
+		memset(b.pixels, 0, b.size);
+		b.width = b.height = 0;
+	}
+	LOG(2, "DrmPreview: made " << NUM_OVERLAY_BUFFERS << " " << width_ << "x" << height_ << " overlay buffers");
+}
+
+void DrmPreview::releaseOverlayBuffers()
+{
+	for (OverlayBuffer &b : overlay_buffers_)
+	{
+		if (b.pixels)
+			munmap(b.pixels, b.size);
+		if (b.fb_handle)
+			drmModeRmFB(drmfd_, b.fb_handle);
+		if (b.handle)
+		{
+			drm_mode_destroy_dumb destroy = {};
+			destroy.handle = b.handle;
+			drmIoctl(drmfd_, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+		}
+		b = OverlayBuffer();
+	}
+	overlay_drawn_ = OverlayLayer();
+	overlay_current_ = -1;
+}
+
+int DrmPreview::drawOverlay(unsigned int x, unsigned int y, unsigned int width, unsigned int height)
+{
+	if (!overlay_plane_id_ || overlay_.items.empty())
+		return -1;
+	if (overlay_current_ >= 0 && overlay_ == overlay_drawn_)
+	{
+		OverlayBuffer const &b = overlay_buffers_[overlay_current_];
+		if (b.x == x && b.y == y && b.width == width && b.height == height)
+			return overlay_current_;
+	}
+
+	if (!overlay_buffers_[0].pixels)
+	{
+		try
+		{
+			makeOverlayBuffers();
+		}
+		catch (std::exception const &e)
+		{
+			LOG_ERROR("DrmPreview: " << e.what() << ", so overlays won't be shown");
+			releaseOverlayBuffers();
+			std::lock_guard<std::mutex> lock(flip_mutex_);
+			overlay_plane_id_ = 0;
+			return -1;
+		}
+	}
+
+	// Any buffer not on the screen or committed to go there will do, and there's always at least one.
+	int index;
+	{
+		std::lock_guard<std::mutex> lock(flip_mutex_);
+		for (index = 0; index < (int)NUM_OVERLAY_BUFFERS; index++)
+		{
+			if (index != last_overlay_ && index != flipping_.overlay && index != next_.overlay)
+				break;
+		}
+	}
+
+	OverlayBuffer &b = overlay_buffers_[index];
+	if (b.x != x || b.y != y || b.width != width || b.height != height)
+	{
+		// The frame has moved, so clear out what was drawn around it before.
+		memset(b.pixels, 0, b.size);
+		b.x = x, b.y = y, b.width = width, b.height = height;
+	}
+	overlay_.Render(b.pixels + y * (b.stride / 4) + x, width, height, b.stride);
+	overlay_drawn_ = overlay_;
+	overlay_current_ = index;
+	return index;
+}
+
+void DrmPreview::Import(int fd, size_t size, StreamInfo const &info)
+{
+	getBuffer(fd, size, info);
+}
+
+void DrmPreview::addPlane(drmModeAtomicReqPtr req, uint32_t plane_id, PlaneProperties const &props,
+						  unsigned int fb_handle, unsigned int src_width, unsigned int src_height, unsigned int x,
+						  unsigned int y, unsigned int width, unsigned int height)
+{
+	// No framebuffer turns the plane off.
+	drmModeAtomicAddProperty(req, plane_id, props.fb_id, fb_handle);
+	drmModeAtomicAddProperty(req, plane_id, props.crtc_id, fb_handle ? crtcId_ : 0);
+	drmModeAtomicAddProperty(req, plane_id, props.src_x, 0);
+	drmModeAtomicAddProperty(req, plane_id, props.src_y, 0);
+	drmModeAtomicAddProperty(req, plane_id, props.src_w, (uint64_t)src_width << 16);
+	drmModeAtomicAddProperty(req, plane_id, props.src_h, (uint64_t)src_height << 16);
+	drmModeAtomicAddProperty(req, plane_id, props.crtc_x, x);
+	drmModeAtomicAddProperty(req, plane_id, props.crtc_y, y);
+	drmModeAtomicAddProperty(req, plane_id, props.crtc_w, width);
+	drmModeAtomicAddProperty(req, plane_id, props.crtc_h, height);
+}
+
+void DrmPreview::commit(Flip const &flip)
+{
+	drmModeAtomicReqPtr req = drmModeAtomicAlloc();
+	if (!req)
+		throw std::runtime_error("drmModeAtomicAlloc failed");
+
+	addPlane(req, planeId_, plane_props_, flip.fb_handle, flip.src_width, flip.src_height, flip.x, flip.y, flip.width,
+			 flip.height);
+	// The overlay goes in the same commit as the frame, so that the two always change together.
+	if (overlay_plane_id_)
+	{
+		unsigned int fb_handle = flip.overlay >= 0 ? overlay_buffers_[flip.overlay].fb_handle : 0;
+		addPlane(req, overlay_plane_id_, overlay_props_, fb_handle, width_, height_, x_, y_, width_, height_);
+		if (fb_handle && prop_overlay_zpos_)
+			drmModeAtomicAddProperty(req, overlay_plane_id_, prop_overlay_zpos_, overlay_zpos_);
+	}
+
+	int ret = drmModeAtomicCommit(drmfd_, req, DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT, this);
+	drmModeAtomicFree(req);
+	if (ret)
+		throw std::runtime_error("drmModeAtomicCommit failed: " + std::string(strerror(-ret)));
+	flipping_ = flip;
+}
+
+void DrmPreview::pageFlipHandler(int /*fd*/, unsigned int /*sequence*/, unsigned int /*tv_sec*/,
+								 unsigned int /*tv_usec*/, void *user_data)
+{
+	DrmPreview *preview = static_cast<DrmPreview *>(user_data);
+	preview->flipDone(preview->returned_fds_);
+}
+
+void DrmPreview::flipDone(std::vector<int> &done)
+{
+	std::lock_guard<std::mutex> lock(flip_mutex_);
+	// flipping_ is on the screen now, so whatever was there before can go back.
+	if (last_fd_ >= 0)
+		done.push_back(last_fd_);
+	last_fd_ = flipping_.fd;
+	last_overlay_ = flipping_.overlay;
+	flipping_ = Flip();
+	if (next_.fd >= 0)
+	{
+		try
+		{
+			commit(next_);
+		}
+		catch (std::exception const &e)
+		{
+			LOG_ERROR("DrmPreview: " << e.what());
+			done.push_back(next_.fd);
+		}
+		next_ = Flip();
+	}
+	flip_cond_.notify_all();
+}
+
+void DrmPreview::eventThread()
+{
+	drmEventContext ev_ctx = {};
+	ev_ctx.version = 2;
+	ev_ctx.page_flip_handler = pageFlipHandler;
+
+	try
+	{
+		while (true)
+		{
+			pollfd p[2] = { { drmfd_, POLLIN, 0 }, { abort_fd_, POLLIN, 0 } };
+			int ret = poll(p, 2, -1);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret < 0)
+				throw std::runtime_error("DrmPreview: unexpected errno " + std::to_string(errno) + " from poll");
+			if (p[1].revents & POLLIN)
+				return;
+			if (!(p[0].revents & POLLIN))
+				continue;
+
+			// The callbacks happen without our lock, as the application may want to take its own locks in them.
+			drmHandleEvent(drmfd_, &ev_ctx);
+			for (int fd : returned_fds_)
+				done_callback_(fd);
+			returned_fds_.clear();
+		}
+	}
+	catch (std::exception const &e)
+	{
+		// Nothing will flip now, so stop Show() waiting for it, and have Quit() tell the application to stop.
+		LOG_ERROR("DrmPreview: event thread failed: " << e.what());
+		std::lock_guard<std::mutex> lock(flip_mutex_);
+		failed_ = true;
+		flip_cond_.notify_all();
+	}
+}
+
 void DrmPreview::Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &info)
 {
-	Buffer &buffer = buffers_[fd];
-	if (buffer.fd == -1)
-		makeBuffer(fd, span.size(), info, buffer);
+	Buffer &buffer = getBuffer(fd, span.size(), info);
 
 	unsigned int x_off = 0, y_off = 0;
 	unsigned int w = width_, h = height_;
@@ -402,32 +870,74 @@ void DrmPreview::Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &i
 	else
 		w = height_ * info.width / info.height, x_off = (width_ - w) / 2;
 
-	if (drmModeSetPlane(drmfd_, planeId_, crtcId_, buffer.fb_handle, 0, x_off + x_, y_off + y_, w, h, 0, 0,
-						buffer.info.width << 16, buffer.info.height << 16))
-		throw std::runtime_error("drmModeSetPlane failed: " + std::string(ERRSTR));
-	if (last_fd_ >= 0)
-		done_callback_(last_fd_);
-	last_fd_ = fd;
+	int overlay = drawOverlay(x_off, y_off, w, h);
+
+	if (!atomic_)
+	{
+		if (drmModeSetPlane(drmfd_, planeId_, crtcId_, buffer.fb_handle, 0, x_off + x_, y_off + y_, w, h, 0, 0,
+							buffer.info.width << 16, buffer.info.height << 16))
+			throw std::runtime_error("drmModeSetPlane failed: " + std::string(ERRSTR));
+		if (overlay != last_overlay_)
+		{
+			unsigned int fb_handle = overlay >= 0 ? overlay_buffers_[overlay].fb_handle : 0;
+			if (drmModeSetPlane(drmfd_, overlay_plane_id_, fb_handle ? crtcId_ : 0, fb_handle, 0, x_, y_, width_,
+								height_, 0, 0, width_ << 16, height_ << 16))
+				LOG(1, "DrmPreview: failed to set the overlay plane: " << ERRSTR);
+			last_overlay_ = overlay;
+		}
+		if (last_fd_ >= 0)
+			done_callback_(last_fd_);
+		last_fd_ = fd;
+		return;
+	}
+
+	Flip flip = { fd, buffer.fb_handle, buffer.info.width, buffer.info.height, x_off + x_, y_off + y_, w, h, overlay };
+	int dropped = -1;
+	{
+		std::unique_lock<std::mutex> lock(flip_mutex_);
+		if (!mailbox_)
+			flip_cond_.wait(lock, [this] { return flipping_.fd < 0 || failed_; });
+		if (failed_)
+			dropped = fd;
+		else if (flipping_.fd < 0)
+			commit(flip);
+		else
+		{
+			// Mailbox mode, and the display's busy. This frame goes next instead of any that was waiting.
+			dropped = next_.fd;
+			next_ = flip;
+		}
+	}
+	if (dropped >= 0)
+		done_callback_(dropped);
 }
 
 void DrmPreview::Reset()
 {
-	for (auto &it : buffers_)
-	{
-		drmModeRmFB(drmfd_, it.second.fb_handle);
-		// Apparently a "bo_handle" is a "gem" thing, and it needs closing. It feels like there
-		// ought be an API to match "drmPrimeFDToHandle" for this, but I can only find an ioctl.
-		drm_gem_close gem_close = {};
-		gem_close.handle = it.second.bo_handle;
-		if (drmIoctl(drmfd_, DRM_IOCTL_GEM_CLOSE, &gem_close) < 0)
-			// I have no idea what this would mean, so complain and try to carry on...
-			LOG(1, "DRM_IOCTL_GEM_CLOSE failed");
-	}
-	buffers_.clear();
+	if (atomic_)
+	{
+		// Let the last commit land before its framebuffer goes. Removing the framebuffer on the screen turns the
+		// plane off.
+		std::unique_lock<std::mutex> lock(flip_mutex_);
+		next_ = Flip();
+		flip_cond_.wait_for(lock, std::chrono::seconds(1), [this] { return flipping_.fd < 0; });
+		flipping_ = Flip();
+	}
+	if (buffers_.Imports())
+		LOG(2, "DrmPreview: " << buffers_.Stats());
+	buffers_.Clear();
 	last_fd_ = -1;
+	releaseOverlayBuffers();
+	last_overlay_ = -1;
 	first_time_ = true;
 }
 
+bool DrmPreview::Quit()
+{
+	std::lock_guard<std::mutex> lock(flip_mutex_);
+	return failed_;
+}
+
 Preview *make_drm_preview(Options const *options)
 {
 	return new DrmPreview(options);
@@ -7,12 +7,15 @@
 
 #include <map>
 #include <string>
+#include <vector>
 
 // Include libcamera stuff before X11, as X11 #defines both Status and None
 // which upsets the libcamera headers.
 
 #include "core/options.hpp"
+#include "core/overlay.hpp"
 
+#include "import_cache.hpp"
 #include "preview.hpp"
 
 #include <libdrm/drm_fourcc.h>
@@ -35,6 +38,8 @@ public:
 	// Display the buffer. You get given the fd back in the BufferDoneCallback
 	// once its available for re-use.
 	virtual void Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &info) override;
+	virtual void SetOverlay(OverlayLayer const &overlay) override { overlay_ = overlay; }
+	virtual void Import(int fd, size_t size, StreamInfo const &info) override;
 	// Reset the preview window, clearing the current buffers and being ready to
 	// show new ones.
 	virtual void Reset() override;
@@ -56,14 +61,18 @@ private:
 		StreamInfo info;
 		GLuint texture;
 	};
+	// Enough for the camera buffers of a couple of streams, and then some.
+	static constexpr unsigned int MAX_BUFFERS = 32;
 	void makeWindow(char const *name);
 	void makeBuffer(int fd, size_t size, StreamInfo const &info, Buffer &buffer);
+	Buffer &getBuffer(int fd, size_t size, StreamInfo const &info);
+	void drawOverlay(StreamInfo const &info);
 	::Display *display_;
 	EGLDisplay egl_display_;
 	Window window_;
 	EGLContext egl_context_;
 	EGLSurface egl_surface_;
-	std::map<int, Buffer> buffers_; // map the DMABUF's fd to the Buffer
+	ImportCache<Buffer> buffers_; // map the DMABUF's fd to the Buffer
 	int last_fd_;
 	bool first_time_;
 	Atom wm_delete_window_;
@@ -74,6 +83,16 @@ private:
 	int height_;
 	unsigned int max_image_width_;
 	unsigned int max_image_height_;
+	GLint program_;
+	// The stages' overlays are drawn on the CPU into a texture the size the frame is shown at, which is blended over
+	// the frame, and only redrawn when the overlay changes.
+	GLint overlay_program_;
+	GLuint overlay_texture_;
+	OverlayLayer overlay_;
+	OverlayLayer overlay_drawn_;
+	std::vector<uint32_t> overlay_pixels_;
+	unsigned int overlay_width_;
+	unsigned int overlay_height_;
 };
 
 static GLint compile_shader(GLenum target, const char *source)
@@ -130,13 +149,21 @@ static GLint link_program(GLint vs, GLint fs)
 	return prog;
 }
 
-static void gl_setup(int width, int height, int window_width, int window_height)
+// The fraction of the window's width and height that an image of the given size fills.
+static void fit_factors(int width, int height, int window_width, int window_height, float &w_factor, float &h_factor)
 {
-	float w_factor = width / (float)window_width;
-	float h_factor = height / (float)window_height;
+	w_factor = width / (float)window_width;
+	h_factor = height / (float)window_height;
 	float max_dimension = std::max(w_factor, h_factor);
 	w_factor /= max_dimension;
 	h_factor /= max_dimension;
+}
+
+// Returns the program that draws the frame, and the one that blends the (premultiplied) overlay over it.
+static GLint gl_setup(int width, int height, int window_width, int window_height, GLint &overlay_prog)
+{
+	float w_factor, h_factor;
+	fit_factors(width, height, window_width, window_height, w_factor, h_factor);
 	char vs[256];
 	snprintf(vs, sizeof(vs),
 			 "attribute vec4 pos;\n"
@@ -159,15 +186,27 @@ static void gl_setup(int width, int height, int window_width, int window_height)
 					 "}\n";
 	GLint fs_s = compile_shader(GL_FRAGMENT_SHADER, fs);
 	GLint prog = link_program(vs_s, fs_s);
+	// The overlay's pixels are uploaded as bytes, which for ARGB words come in BGRA order.
+	const char *overlay_fs = "precision mediump float;\n"
+							 "uniform sampler2D s;\n"
+							 "varying vec2 texcoord;\n"
+							 "void main() {\n"
+							 "  gl_FragColor = texture2D(s, texcoord).bgra;\n"
+							 "}\n";
+	overlay_prog = link_program(vs_s, compile_shader(GL_FRAGMENT_SHADER, overlay_fs));
 
 	glUseProgram(prog);
 
 	static const float verts[] = { -w_factor, -h_factor, w_factor, -h_factor, w_factor, h_factor, -w_factor, h_factor };
 	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, verts);
 	glEnableVertexAttribArray(0);
+	return prog;
 }
 
-EglPreview::EglPreview(Options const *options) : Preview(options), last_fd_(-1), first_time_(true)
+EglPreview::EglPreview(Options const *options)
+	: Preview(options), buffers_(MAX_BUFFERS, [](Buffer &buffer) { glDeleteTextures(1, &buffer.texture); }),
+	  last_fd_(-1), first_time_(true), program_(0), overlay_program_(0), overlay_texture_(0), overlay_width_(0),
+	  overlay_height_(0)
 {
 	display_ = XOpenDisplay(NULL);
 	if (!display_)
@@ -364,7 +403,7 @@ void EglPreview::makeBuffer(int fd, size_t size, StreamInfo const &info, Buffer
 		// This stuff has to be delayed until we know we're in the thread doing the display.
 		if (!eglMakeCurrent(egl_display_, egl_surface_, egl_surface_, egl_context_))
 			throw std::runtime_error("eglMakeCurrent failed");
-		gl_setup(info.width, info.height, width_, height_);
+		program_ = gl_setup(info.width, info.height, width_, height_, overlay_program_);
 		first_time_ = false;
 	}
 
@@ -412,29 +451,84 @@ void EglPreview::SetInfoText(const std::string &text)
 		XStoreName(display_, window_, text.c_str());
 }
 
+EglPreview::Buffer &EglPreview::getBuffer(int fd, size_t size, StreamInfo const &info)
+{
+	Buffer *buffer = buffers_.Get(fd, size, info);
+	if (buffer)
+		return *buffer;
+
+	Buffer new_buffer;
+	makeBuffer(fd, size, info, new_buffer);
+	return buffers_.Add(fd, size, info, new_buffer, { last_fd_ });
+}
+
+void EglPreview::Import(int fd, size_t size, StreamInfo const &info)
+{
+	getBuffer(fd, size, info);
+}
+
 void EglPreview::Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &info)
 {
-	Buffer &buffer = buffers_[fd];
-	if (buffer.fd == -1)
-		makeBuffer(fd, span.size(), info, buffer);
+	Buffer &buffer = getBuffer(fd, span.size(), info);
 
 	glClearColor(0, 0, 0, 0);
 	glClear(GL_COLOR_BUFFER_BIT);
 
+	glUseProgram(program_);
 	glBindTexture(GL_TEXTURE_EXTERNAL_OES, buffer.texture);
 	glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+	if (!overlay_.items.empty())
+		drawOverlay(info);
 	EGLBoolean success [[maybe_unused]] = eglSwapBuffers(egl_display_, egl_surface_);
 	if (last_fd_ >= 0)
 		done_callback_(last_fd_);
 	last_fd_ = fd;
 }
 
+void EglPreview::drawOverlay(StreamInfo const &info)
+{
+	float w_factor, h_factor;
+	fit_factors(info.width, info.height, width_, height_, w_factor, h_factor);
+	unsigned int width = std::max<int>(width_ * w_factor, 1), height = std::max<int>(height_ * h_factor, 1);
+
+	if (!overlay_texture_)
+	{
+		glGenTextures(1, &overlay_texture_);
+		glBindTexture(GL_TEXTURE_2D, overlay_texture_);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	}
+	glBindTexture(GL_TEXTURE_2D, overlay_texture_);
+
+	if (overlay_ != overlay_drawn_ || width != overlay_width_ || height != overlay_height_)
+	{
+		overlay_pixels_.resize(width * height);
+		overlay_.Render(overlay_pixels_.data(), width, height, width * 4);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, overlay_pixels_.data());
+		overlay_drawn_ = overlay_;
+		overlay_width_ = width;
+		overlay_height_ = height;
+	}
+
+	glUseProgram(overlay_program_);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+	glDisable(GL_BLEND);
+}
+
 void EglPreview::Reset()
 {
-	for (auto &it : buffers_)
-		glDeleteTextures(1, &it.second.texture);
-	buffers_.clear();
+	if (buffers_.Imports())
+		LOG(2, "EglPreview: " << buffers_.Stats());
+	buffers_.Clear();
 	last_fd_ = -1;
+	if (overlay_texture_)
+		glDeleteTextures(1, &overlay_texture_);
+	overlay_texture_ = 0;
+	overlay_drawn_ = OverlayLayer();
 	eglMakeCurrent(egl_display_, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
 	first_time_ = true;
 }
@@ -0,0 +1,126 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * import_cache.hpp - bounded cache of dmabufs imported into a preview window.
+ */
+
+#pragma once
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <map>
+#include <sstream>
+#include <string>
+
+#include "core/stream_info.hpp"
+
+// The previews import each camera buffer once (as a DRM framebuffer or an EGLImage texture), which is expensive, and
+// then reuse the import every time that buffer comes round again. Imports are looked up by fd, but an fd can be
+// closed and reused for a different buffer after the camera is reconfigured, so each import also remembers the
+// dmabuf's inode, which no other buffer shares while this one exists, and its geometry. A stale import is released
+// and made again. The cache holds at most "capacity" imports, dropping the least recently shown first.
+template <typename T>
+class ImportCache
+{
+public:
+	typedef std::function<void(T &)> Release;
+
+	ImportCache(unsigned int capacity, Release release) : capacity_(capacity), release_(release) {}
+	~ImportCache() { Clear(); }
+
+	// The import for this fd, or nullptr if it needs importing (and then adding).
+	T *Get(int fd, size_t size, StreamInfo const &info)
+	{
+		auto it = entries_.find(fd);
+		if (it == entries_.end())
+			return nullptr;
+
+		Entry &entry = it->second;
+		if (entry.ino == inode(fd) && entry.size == size && entry.width == info.width &&
+			entry.height == info.height && entry.stride == info.stride)
+		{
+			hits_++;
+			entry.last_used = ++clock_;
+			return &entry.item;
+		}
+
+		release_(entry.item);
+		entries_.erase(it);
+		stale_++;
+		return nullptr;
+	}
+
+	// Remember a new import, making room for it if we have to, but never by dropping those for busy_fds (which are
+	// on, or on their way to, the display).
+	T &Add(int fd, size_t size, StreamInfo const &info, T const &item, std::initializer_list<int> busy_fds)
+	{
+		while (entries_.size() >= capacity_)
+		{
+			auto oldest = entries_.end();
+			for (auto it = entries_.begin(); it != entries_.end(); it++)
+			{
+				bool busy = std::find(busy_fds.begin(), busy_fds.end(), it->first) != busy_fds.end();
+				if (!busy && (oldest == entries_.end() || it->second.last_used < oldest->second.last_used))
+					oldest = it;
+			}
+			if (oldest == entries_.end())
+				break;
+			release_(oldest->second.item);
+			entries_.erase(oldest);
+			evictions_++;
+		}
+
+		imports_++;
+		Entry &entry = entries_[fd];
+		entry = { item, inode(fd), size, info.width, info.height, info.stride, ++clock_ };
+		return entry.item;
+	}
+
+	void Clear()
+	{
+		for (auto &[fd, entry] : entries_)
+			release_(entry.item);
+		entries_.clear();
+	}
+
+	uint64_t Imports() const { return imports_; }
+
+	std::string Stats() const
+	{
+		std::stringstream ss;
+		ss << imports_ << " imports, " << hits_ << " reused, " << stale_ << " stale, " << evictions_ << " evicted";
+		return ss.str();
+	}
+
+private:
+	struct Entry
+	{
+		T item;
+		ino_t ino;
+		size_t size;
+		unsigned int width;
+		unsigned int height;
+		unsigned int stride;
+		uint64_t last_used;
+	};
+
+	static ino_t inode(int fd)
+	{
+		struct stat st;
+		return fstat(fd, &st) == 0 ? st.st_ino : 0;
+	}
+
+	unsigned int capacity_;
+	Release release_;
+	std::map<int, Entry> entries_;
+	uint64_t clock_ = 0;
+	uint64_t hits_ = 0;
+	uint64_t imports_ = 0;
+	uint64_t stale_ = 0;
+	uint64_t evictions_ = 0;
+};
@@ -15,6 +15,7 @@
 #include "core/stream_info.hpp"
 
 struct Options;
+struct OverlayLayer;
 
 class Preview
 {
@@ -27,9 +28,15 @@ public:
 	// is no longer displaying the buffer and it can be safely recycled.
 	void SetDoneCallback(DoneCallback callback) { done_callback_ = callback; }
 	virtual void SetInfoText(const std::string &text) {}
+	// What the post-processing stages want drawn over the next frame shown. Previews that can't draw overlays
+	// ignore them. Only call from the thread that calls Show().
+	virtual void SetOverlay(OverlayLayer const &overlay) {}
 	// Display the buffer. You get given the fd back in the BufferDoneCallback
 	// once its available for re-use.
 	virtual void Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &info) = 0;
+	// Get the buffer ready for showing, so that the first Show() of it needn't. Only call from the thread that
+	// calls Show().
+	virtual void Import(int fd, size_t size, StreamInfo const &info) {}
 	// Reset the preview window, clearing the current buffers and being ready to
 	// show new ones.
 	virtual void Reset() = 0;
@@ -5,15 +5,28 @@
  * qt_preview.cpp - Qt preview window
  */
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <condition_variable>
 #include <iostream>
 #include <mutex>
 #include <string.h>
 #include <thread>
 
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#define HAVE_NEON_KERNELS 1
+#endif
+
 // This header must be before the QT headers, as the latter #defines slot and emit!
 #include "core/options.hpp"
 
+#include "output/crc32c.hpp"
+#include "post_processing_stages/parallel_rows.hpp"
+
 #include <QApplication>
 #include <QImage>
 #include <QMainWindow>
@@ -23,17 +36,144 @@
 
 #include "preview.hpp"
 
+namespace
+{
+
+// The colour conversion for one output row: x_index holds the source pixel for each output pixel, and uv_index the
+// source chroma sample for each pair of them.
+struct RowConversion
+{
+	int offset_Y;
+	float Y, VR, UG, VG, UB;
+	unsigned int const *x_index;
+	unsigned int const *uv_index;
+};
+
+typedef void (*ConvertRowFn)(uint8_t *dest, uint8_t const *Y_row, uint8_t const *U_row, uint8_t const *V_row,
+							 unsigned int width, RowConversion const &c);
+
+void convert_row_c(uint8_t *dest, uint8_t const *Y_row, uint8_t const *U_row, uint8_t const *V_row,
+				   unsigned int width, RowConversion const &c)
+{
+	for (unsigned int x = 0; x < width; x += 2)
+	{
+		int Y0 = Y_row[c.x_index[x]] - c.offset_Y;
+		int Y1 = Y_row[c.x_index[x + 1]] - c.offset_Y;
+		int U = U_row[c.uv_index[x / 2]] - 128;
+		int V = V_row[c.uv_index[x / 2]] - 128;
+		int R0 = c.Y * Y0 + c.VR * V;
+		int G0 = c.Y * Y0 + c.UG * U + c.VG * V;
+		int B0 = c.Y * Y0 + c.UB * U;
+		int R1 = c.Y * Y1 + c.VR * V;
+		int G1 = c.Y * Y1 + c.UG * U + c.VG * V;
+		int B1 = c.Y * Y1 + c.UB * U;
+		*(dest++) = std::clamp(R0, 0, 255);
+		*(dest++) = std::clamp(G0, 0, 255);
+		*(dest++) = std::clamp(B0, 0, 255);
+		*(dest++) = std::clamp(R1, 0, 255);
+		*(dest++) = std::clamp(G1, 0, 255);
+		*(dest++) = std::clamp(B1, 0, 255);
+	}
+}
+
+#if HAVE_NEON_KERNELS
+
+void convert_row_neon(uint8_t *dest, uint8_t const *Y_row, uint8_t const *U_row, uint8_t const *V_row,
+					  unsigned int width, RowConversion const &c)
+{
+	// The products are made with vqrdmulh, which gives a * b / 32768, and come out with 6 fractional bits. Luma is
+	// shifted up by 7 and its coefficient halved, chroma shifted up by 8 and its coefficients quartered, so that
+	// everything fits in 16 bits. Saturating adds only clip sums that are out of range anyway.
+	const int16_t kY = std::lround(c.Y * 16384), kVR = std::lround(c.VR * 8192), kUG = std::lround(c.UG * 8192);
+	const int16_t kVG = std::lround(c.VG * 8192), kUB = std::lround(c.UB * 8192);
+	const int16x8_t offset_Y = vdupq_n_s16(c.offset_Y), offset_UV = vdupq_n_s16(128);
+	uint8_t Y[16], U[8], V[8];
+	unsigned int x = 0;
+	for (; x + 16 <= width; x += 16)
+	{
+		// Scaling means gathering the samples we want one at a time; the conversion then does 16 pixels at once.
+		for (unsigned int i = 0; i < 16; i++)
+			Y[i] = Y_row[c.x_index[x + i]];
+		for (unsigned int i = 0; i < 8; i++)
+		{
+			U[i] = U_row[c.uv_index[x / 2 + i]];
+			V[i] = V_row[c.uv_index[x / 2 + i]];
+		}
+
+		int16x8_t u = vshlq_n_s16(vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(U))), offset_UV), 8);
+		int16x8_t v = vshlq_n_s16(vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(V))), offset_UV), 8);
+		int16x8_t r = vqrdmulhq_n_s16(v, kVR);
+		int16x8_t g = vqaddq_s16(vqrdmulhq_n_s16(u, kUG), vqrdmulhq_n_s16(v, kVG));
+		int16x8_t b = vqrdmulhq_n_s16(u, kUB);
+		// Each chroma sample covers two pixels across.
+		int16x8x2_t r2 = vzipq_s16(r, r), g2 = vzipq_s16(g, g), b2 = vzipq_s16(b, b);
+
+		uint8x16_t y = vld1q_u8(Y);
+		int16x8_t y_lo = vqrdmulhq_n_s16(
+			vshlq_n_s16(vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(y))), offset_Y), 7), kY);
+		int16x8_t y_hi = vqrdmulhq_n_s16(
+			vshlq_n_s16(vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(y))), offset_Y), 7), kY);
+		uint8x16x3_t rgb;
+		rgb.val[0] = vcombine_u8(vqrshrun_n_s16(vqaddq_s16(y_lo, r2.val[0]), 6),
+								 vqrshrun_n_s16(vqaddq_s16(y_hi, r2.val[1]), 6));
+		rgb.val[1] = vcombine_u8(vqrshrun_n_s16(vqaddq_s16(y_lo, g2.val[0]), 6),
+								 vqrshrun_n_s16(vqaddq_s16(y_hi, g2.val[1]), 6));
+		rgb.val[2] = vcombine_u8(vqrshrun_n_s16(vqaddq_s16(y_lo, b2.val[0]), 6),
+								 vqrshrun_n_s16(vqaddq_s16(y_hi, b2.val[1]), 6));
+		vst3q_u8(dest + 3 * x, rgb);
+	}
+
+	RowConversion rest = c;
+	rest.x_index += x, rest.uv_index += x / 2;
+	convert_row_c(dest + 3 * x, Y_row, U_row, V_row, width - x, rest);
+}
+
+#endif /* HAVE_NEON_KERNELS */
+
+ConvertRowFn select_convert_row()
+{
+#if HAVE_NEON_KERNELS
+	if (getauxval(AT_HWCAP) & HWCAP_ASIMD)
+	{
+		LOG(2, "QtPreview: using NEON kernels");
+		return convert_row_neon;
+	}
+#endif
+	LOG(2, "QtPreview: using C kernels");
+	return convert_row_c;
+}
+
+} // namespace
+
 class MyMainWindow : public QMainWindow
 {
 public:
 	MyMainWindow() : QMainWindow() {}
 	bool quit = false;
+	// Nobody can see what we draw while the window is minimised or hidden.
+	std::atomic<bool> hidden = false;
 protected:
 	void closeEvent(QCloseEvent *event) override
 	{
 		event->ignore();
 		quit = true;
 	}
+	void changeEvent(QEvent *event) override
+	{
+		if (event->type() == QEvent::WindowStateChange)
+			hidden = isMinimized() || !isVisible();
+		QMainWindow::changeEvent(event);
+	}
+	void showEvent(QShowEvent *event) override
+	{
+		hidden = isMinimized();
+		QMainWindow::showEvent(event);
+	}
+	void hideEvent(QHideEvent *event) override
+	{
+		hidden = true;
+		QMainWindow::hideEvent(event);
+	}
 };
 
 class MyWidget : public QWidget
@@ -46,11 +186,14 @@ public:
 	}
 	QSize size;
 	QImage image;
+	// Cleared when the image changes, and set again once it has been painted.
+	std::atomic<bool> painted = true;
 protected:
 	void paintEvent(QPaintEvent *) override
 	{
 		QPainter painter(this);
 		painter.drawImage(rect(), image, image.rect());
+		painted = true;
 	}
 	QSize sizeHint() const override { return size; }
 };
@@ -67,8 +210,6 @@ public:
 		// This preview window is expensive, so make it small by default.
 		if (window_width_ == 0 || window_height_ == 0)
 			window_width_ = 512, window_height_ = 384;
-		// As a hint, reserve twice the binned width for our widest current camera (V3)
-		tmp_stripe_.reserve(4608);
 		thread_ = std::thread(&QtPreview::threadFunc, this, options);
 		std::unique_lock lock(mutex_);
 		while (!pane_)
@@ -83,10 +224,36 @@ public:
 	void SetInfoText(const std::string &text) override { main_window_->setWindowTitle(QString::fromStdString(text)); }
 	virtual void Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &info) override
 	{
+		// Don't convert frames that nobody will see: while the window is hidden, while the last one still hasn't been
+		// painted (as over a slow remote display), or when the frame looks just like the last one. Should paints stop
+		// coming for some other reason, carry on every so often regardless.
+		constexpr unsigned int MAX_UNPAINTED = 30;
+		if (main_window_->hidden || (!pane_->painted && ++unpainted_ < MAX_UNPAINTED) || unchanged(span, info))
+		{
+			done_callback_(fd);
+			return;
+		}
+		unpainted_ = 0;
+
 		// Quick and simple nearest-neighbour-ish resampling is used here.
 		// We further share U,V samples between adjacent output pixel pairs
 		// (even when downscaling) to speed up the conversion.
-		unsigned x_step = (info.width << 16) / window_width_;
+		if (info.width != source_width_ || info.height != source_height_)
+		{
+			unsigned x_step = (info.width << 16) / window_width_;
+			unsigned x_pos = x_step >> 1;
+			x_index_.resize(window_width_);
+			uv_index_.resize(window_width_ / 2);
+			for (unsigned int x = 0; x < window_width_; x += 2)
+			{
+				x_index_[x] = x_pos >> 16;
+				x_pos += x_step;
+				x_index_[x + 1] = x_pos >> 16;
+				uv_index_[x / 2] = x_pos >> 17;
+				x_pos += x_step;
+			}
+			source_width_ = info.width, source_height_ = info.height;
+		}
 		unsigned y_step = (info.height << 16) / window_height_;
 
 		// Choose the right matrix to convert YUV back to RGB.
@@ -95,87 +262,52 @@ public:
 			{ 1.164, 0.0, 1.596, 1.164, -0.392, -0.813, 1.164, 2.017, 0.0 }, // SMPTE170M
 			{ 1.164, 0.0, 1.793, 1.164, -0.213, -0.533, 1.164, 2.112, 0.0 }, // Rec709
 		};
-		int offsetY;
-		float coeffY, coeffVR, coeffUG, coeffVG, coeffUB;
+		int matrix;
 		if (info.colour_space == libcamera::ColorSpace::Smpte170m)
-		{
-			offsetY = 16;
-			coeffY = YUV2RGB[1][0];
-			coeffVR = YUV2RGB[1][2];
-			coeffUG = YUV2RGB[1][4];
-			coeffVG = YUV2RGB[1][5];
-			coeffUB = YUV2RGB[1][7];
-		}
+			matrix = 1;
 		else if (info.colour_space == libcamera::ColorSpace::Rec709)
-		{
-			offsetY = 16;
-			coeffY = YUV2RGB[2][0];
-			coeffVR = YUV2RGB[2][2];
-			coeffUG = YUV2RGB[2][4];
-			coeffVG = YUV2RGB[2][5];
-			coeffUB = YUV2RGB[2][7];
-		}
+			matrix = 2;
 		else
 		{
-			offsetY = 0;
-			coeffY = YUV2RGB[0][0];
-			coeffVR = YUV2RGB[0][2];
-			coeffUG = YUV2RGB[0][4];
-			coeffVG = YUV2RGB[0][5];
-			coeffUB = YUV2RGB[0][7];
+			matrix = 0;
 			if (info.colour_space != libcamera::ColorSpace::Sycc)
 				LOG(1, "QtPreview: unexpected colour space " << libcamera::ColorSpace::toString(info.colour_space));
 		}
+		RowConversion c = { matrix ? 16 : 0,
+							YUV2RGB[matrix][0],
+							YUV2RGB[matrix][2],
+							YUV2RGB[matrix][4],
+							YUV2RGB[matrix][5],
+							YUV2RGB[matrix][7],
+							x_index_.data(),
+							uv_index_.data() };
 
-		// Because the source buffer is uncached, and we want to read it a byte at a time,
-		// take a copy of each row used. This is a speedup provided memcpy() is vectorized.
-		tmp_stripe_.resize(2 * info.stride);
+		static const ConvertRowFn convert_row = select_convert_row();
 		uint8_t const *Y_start = span.data();
-		uint8_t *Y_row = &tmp_stripe_[0];
-		uint8_t *U_row = Y_row + info.stride;
-		uint8_t *V_row = U_row + (info.stride >> 1);
 
 		// Possibly this should be locked in case a repaint is happening? In practice the risk
 		// is only that there might be some tearing, so I don't think we worry. We could speed
 		// it up by getting the ISP to supply RGB, but I'm not sure I want to handle that extra
 		// possibility in our main application code, so we'll put up with the slow conversion.
-		for (unsigned int y = 0; y < window_height_; y++)
-		{
-			unsigned row = (y * y_step) >> 16;
-			uint8_t *dest = pane_->image.scanLine(y);
-			unsigned x_pos = x_step >> 1;
+		ParallelRows(window_height_, [&](unsigned int begin, unsigned int end) {
+			// Because the source buffer is uncached, and we want to read it a byte at a time,
+			// take a copy of each row used. This is a speedup provided memcpy() is vectorized.
+			std::vector<uint8_t> stripe(2 * info.stride);
+			uint8_t *Y_row = stripe.data();
+			uint8_t *U_row = Y_row + info.stride;
+			uint8_t *V_row = U_row + (info.stride >> 1);
 
-			memcpy(Y_row, Y_start + row * info.stride, info.stride);
-			memcpy(U_row, Y_start + ((4 * info.height + row) >> 1) * (info.stride >> 1), info.stride >> 1);
-			memcpy(V_row, Y_start + ((5 * info.height + row) >> 1) * (info.stride >> 1), info.stride >> 1);
-
-			for (unsigned int x = 0; x < window_width_; x += 2)
+			for (unsigned int y = begin; y < end; y++)
 			{
-				int Y0 = Y_row[x_pos >> 16];
-				x_pos += x_step;
-				int Y1 = Y_row[x_pos >> 16];
-				int U = U_row[x_pos >> 17];
-				int V = V_row[x_pos >> 17];
-				x_pos += x_step;
-				Y0 -= offsetY;
-				Y1 -= offsetY;
-				U -= 128;
-				V -= 128;
-				int R0 = coeffY * Y0 + coeffVR * V;
-				int G0 = coeffY * Y0 + coeffUG * U + coeffVG * V;
-				int B0 = coeffY * Y0 + coeffUB * U;
-				int R1 = coeffY * Y1 + coeffVR * V;
-				int G1 = coeffY * Y1 + coeffUG * U + coeffVG * V;
-				int B1 = coeffY * Y1 + coeffUB * U;
-				*(dest++) = std::clamp(R0, 0, 255);
-				*(dest++) = std::clamp(G0, 0, 255);
-				*(dest++) = std::clamp(B0, 0, 255);
-				*(dest++) = std::clamp(R1, 0, 255);
-				*(dest++) = std::clamp(G1, 0, 255);
-				*(dest++) = std::clamp(B1, 0, 255);
+				unsigned row = (y * y_step) >> 16;
+				memcpy(Y_row, Y_start + row * info.stride, info.stride);
+				memcpy(U_row, Y_start + ((4 * info.height + row) >> 1) * (info.stride >> 1), info.stride >> 1);
+				memcpy(V_row, Y_start + ((5 * info.height + row) >> 1) * (info.stride >> 1), info.stride >> 1);
+				convert_row(pane_->image.scanLine(y), Y_row, U_row, V_row, window_width_, c);
 			}
-		}
+		});
 
+		pane_->painted = false;
 		pane_->update();
 
 		// Return the buffer to the camera system.
@@ -190,6 +322,30 @@ public:
 	virtual void MaxImageSize(unsigned int &w, unsigned int &h) const override { w = h = 0; }
 
 private:
+	// Checksum every source row that the window shows, just as the conversion picks them, and compare with the last
+	// frame shown. Repeats of exactly the same frame match, whereas any change that would show up on screen does not.
+	bool unchanged(libcamera::Span<uint8_t> span, StreamInfo const &info)
+	{
+		unsigned y_step = (info.height << 16) / window_height_;
+		uint8_t const *Y_start = span.data();
+		std::vector<uint32_t> checksums(window_height_);
+		ParallelRows(window_height_, [&](unsigned int begin, unsigned int end) {
+			for (unsigned int y = begin; y < end; y++)
+			{
+				unsigned row = (y * y_step) >> 16;
+				uint8_t const *U_row = Y_start + ((4 * info.height + row) >> 1) * (info.stride >> 1);
+				uint8_t const *V_row = Y_start + ((5 * info.height + row) >> 1) * (info.stride >> 1);
+				uint32_t crc = crc32c(Y_start + row * info.stride, info.width);
+				crc = crc32c(U_row, info.width >> 1, crc);
+				checksums[y] = crc32c(V_row, info.width >> 1, crc);
+			}
+		});
+		if (checksums == last_checksums_ && info.width == source_width_ && info.height == source_height_)
+			return true;
+		last_checksums_ = std::move(checksums);
+		return false;
+	}
+
 	void threadFunc(Options const *options)
 	{
 		// This acts as Qt's event loop. Really Qt prefers to own the application's event loop
@@ -217,7 +373,12 @@ private:
 	unsigned int window_width_, window_height_;
 	std::mutex mutex_;
 	std::condition_variable cond_var_;
-	std::vector<uint8_t> tmp_stripe_;
+	// For each output pixel, the source pixel it comes from, and for each pair of them, the chroma sample.
+	std::vector<unsigned int> x_index_;
+	std::vector<unsigned int> uv_index_;
+	unsigned int source_width_ = 0, source_height_ = 0;
+	std::vector<uint32_t> last_checksums_;
+	unsigned int unpainted_ = 0;
 };
 
 Preview *make_qt_preview(Options const *options)
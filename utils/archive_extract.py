@@ -0,0 +1,138 @@
+#!/usr/bin/python3
+#
+# rpicam-apps archive (--archive) listing and extraction tool
+# Copyright (C) 2025, Raspberry Pi Ltd.
+#
+import argparse
+import os
+import struct
+import sys
+
+HEADER = struct.Struct('<8sII')
+# Archives written before --frame-checksum have the shorter records, without the checksum.
+RECORDS = {s.size: s for s in (struct.Struct('<4sIQQqQ24s'), struct.Struct('<4sIQQqQ24sII'))}
+TRAILER = struct.Struct('<QQ8s')
+FLAG_KEYFRAME = 1
+FLAG_CRC32C = 2
+
+
+def parse_record(data):
+    magic, flags, offset, size, timestamp_us, sequence, lamp_color, *crc = RECORD.unpack(data)
+    if magic != b'RPAF':
+        raise RuntimeError('bad frame record')
+    return {'flags': flags, 'offset': offset, 'size': size, 'timestamp_us': timestamp_us,
+            'sequence': sequence, 'lamp_color': lamp_color.rstrip(b'\0').decode(errors='replace'),
+            'crc32c': crc[0] if crc and flags & FLAG_CRC32C else None}
+
+
+def make_crc32c():
+    try:
+        import crc32c
+        return crc32c.crc32c
+    except ImportError:
+        pass
+    # Much slower, but needs nothing installed.
+    table = []
+    for i in range(256):
+        crc = i
+        for _ in range(8):
+            crc = (crc >> 1) ^ (0x82f63b78 if crc & 1 else 0)
+        table.append(crc)
+
+    def crc32c(data):
+        crc = 0xffffffff
+        for byte in data:
+            crc = (crc >> 8) ^ table[(crc ^ byte) & 0xff]
+        return crc ^ 0xffffffff
+    return crc32c
+
+
+def read_index(f):
+    global RECORD
+    magic, record_size, _ = HEADER.unpack(f.read(HEADER.size))
+    if magic != b'RPARCHV1' or record_size not in RECORDS:
+        raise RuntimeError('not an rpicam-apps archive')
+    RECORD = RECORDS[record_size]
+
+    # A finished archive ends with its index.
+    file_size = f.seek(0, os.SEEK_END)
+    if file_size >= HEADER.size + TRAILER.size:
+        f.seek(file_size - TRAILER.size)
+        index_offset, count, magic = TRAILER.unpack(f.read(TRAILER.size))
+        if magic == b'RPAINDX1' and index_offset + count * RECORD.size + TRAILER.size == file_size:
+            f.seek(index_offset)
+            return [parse_record(f.read(RECORD.size)) for _ in range(count)]
+
+    # Otherwise walk the frame records, stopping at the first one that's incomplete.
+    print('No index found, scanning', file=sys.stderr)
+    index = []
+    offset = HEADER.size
+    while offset + RECORD.size <= file_size:
+        f.seek(offset)
+        try:
+            record = parse_record(f.read(RECORD.size))
+        except RuntimeError:
+            break
+        if record['offset'] != offset + RECORD.size or record['offset'] + record['size'] > file_size:
+            break
+        index.append(record)
+        offset = record['offset'] + record['size']
+    return index
+
+
+def main():
+    parser = argparse.ArgumentParser(description='List or extract the frames in an rpicam-apps archive file.')
+    parser.add_argument('archive', help='Archive file')
+    parser.add_argument('frames', nargs='*', type=int, help='Indices of frames to extract (all if none are given)')
+    parser.add_argument('--list', '-l', action='store_true', help='List the frames rather than extracting them')
+    parser.add_argument('--verify', '-v', action='store_true',
+                        help='Check the frames against their checksums (--frame-checksum) rather than extracting them')
+    parser.add_argument('--output', '-o', default='frame%05d.dng',
+                        help='Output filename pattern, given the frame index (default: %(default)s)')
+    args = parser.parse_args()
+
+    with open(args.archive, 'rb') as f:
+        index = read_index(f)
+
+        if args.list:
+            print(f'{"index":>6} {"sequence":>9} {"timestamp_us":>16} {"size":>10} {"key":>3} {"crc32c":>8}  lamp')
+            for i, r in enumerate(index):
+                crc = f'{r["crc32c"]:08x}' if r['crc32c'] is not None else ''
+                print(f'{i:>6} {r["sequence"]:>9} {r["timestamp_us"]:>16} {r["size"]:>10} '
+                      f'{"y" if r["flags"] & FLAG_KEYFRAME else "":>3} {crc:>8}  {r["lamp_color"]}')
+            return
+
+        if args.verify:
+            crc32c = make_crc32c()
+            bad = unchecked = 0
+            for i in args.frames or range(len(index)):
+                if not 0 <= i < len(index):
+                    raise RuntimeError(f'no frame {i}, archive has {len(index)}')
+                if index[i]['crc32c'] is None:
+                    unchecked += 1
+                    continue
+                f.seek(index[i]['offset'])
+                if crc32c(f.read(index[i]['size'])) != index[i]['crc32c']:
+                    print(f'Frame {i} is corrupt')
+                    bad += 1
+            print(f'{bad} corrupt, {unchecked} without checksums')
+            if bad:
+                raise RuntimeError(f'{bad} corrupt frames')
+            return
+
+        for i in args.frames or range(len(index)):
+            if not 0 <= i < len(index):
+                raise RuntimeError(f'no frame {i}, archive has {len(index)}')
+            f.seek(index[i]['offset'])
+            filename = args.output % i
+            with open(filename, 'wb') as out:
+                out.write(f.read(index[i]['size']))
+            print(f'Frame {i} -> {filename}')
+
+
+if __name__ == '__main__':
+    try:
+        main()
+    except RuntimeError as e:
+        print(f'Error: {e}', file=sys.stderr)
+        sys.exit(1)
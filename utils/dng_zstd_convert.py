@@ -0,0 +1,112 @@
+#!/usr/bin/python3
+#
+# rpicam-apps zstd DNG (--dng-compression zstd) conversion tool
+# Copyright (C) 2025, Raspberry Pi Ltd.
+#
+# A zstd DNG holds its raw data in tiles compressed with zstd (TIFF compression 50000) behind a horizontal
+# differencing predictor, which libtiff reads but raw converters generally don't. This decodes the tiles and writes a
+# standard DNG with the same tiles uncompressed; every other tag is kept as it is. Needs the zstandard module
+# (pip install zstandard). Frames in an archive (--archive) can be taken out with archive_extract.py first.
+import argparse
+import os
+import struct
+import sys
+
+import numpy as np
+import zstandard
+
+from pisp_dng_convert import read_ifd, value
+
+COMPRESSION_ZSTD = 50000
+TAG_PREDICTOR = 317
+PREDICTOR_HORIZONTAL_X2 = 34892
+
+
+def put(data, entry, index, v):
+    pos, type, n, raw = entry
+    fmt = '<H' if type == 3 else '<I'
+    size = struct.calcsize(fmt)
+    where = pos + 8 if n * size <= 4 else struct.unpack('<I', raw)[0]
+    struct.pack_into(fmt, data, where + index * size, v)
+
+
+def convert(data):
+    offset, count, entries = read_ifd(data)
+    if 259 not in entries or value(data, entries[259]) != COMPRESSION_ZSTD or 324 not in entries:
+        raise RuntimeError('not a zstd DNG')
+    bits = value(data, entries[258])
+    tile_width, tile_length = value(data, entries[322]), value(data, entries[323])
+    predictor = value(data, entries[TAG_PREDICTOR]) if TAG_PREDICTOR in entries else 1
+    distance = {1: 0, 2: 1, PREDICTOR_HORIZONTAL_X2: 2}.get(predictor)
+    if bits not in (8, 16) or distance is None or tile_width % 2:
+        raise RuntimeError('unexpected layout for a zstd DNG')
+
+    num_tiles = entries[324][2]
+    offsets = [value(data, entries[324], i) for i in range(num_tiles)]
+    counts = [value(data, entries[325], i) for i in range(num_tiles)]
+    dtype = np.dtype('<u2') if bits == 16 else np.dtype(np.uint8)
+    tile_bytes = tile_width * tile_length * dtype.itemsize
+    decompressor = zstandard.ZstdDecompressor()
+
+    header = bytearray(data[:min(offsets)])
+    tiles = []
+    for i in range(num_tiles):
+        tile = decompressor.decompress(data[offsets[i]:offsets[i] + counts[i]], max_output_size=tile_bytes)
+        if len(tile) != tile_bytes:
+            raise RuntimeError(f'tile {i} is the wrong size')
+        samples = np.frombuffer(tile, dtype=dtype).reshape(tile_length, tile_width)
+        if distance:
+            # Undo the differencing, along each row separately for every "distance" samples, wrapping as it did.
+            rows = samples.reshape(tile_length, tile_width // distance, distance)
+            samples = np.cumsum(rows, axis=1, dtype=dtype).reshape(tile_length, tile_width)
+        tiles.append(samples.astype(dtype).tobytes())
+        put(header, entries[324], i, len(header) + i * tile_bytes)
+        put(header, entries[325], i, tile_bytes)
+
+    struct.pack_into('<H', header, entries[259][0] + 8, 1)
+    if TAG_PREDICTOR in entries:
+        struct.pack_into('<H', header, entries[TAG_PREDICTOR][0] + 8, 1)
+    return bytes(header) + b''.join(tiles)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Turn zstd DNGs (--dng-compression zstd) into standard ones.')
+    parser.add_argument('files', nargs='+', help='zstd DNG files')
+    parser.add_argument('--dir', '-d', help='Write the standard DNGs, with the same names, in this directory')
+    parser.add_argument('--in-place', action='store_true', help='Replace each file with its standard DNG')
+    args = parser.parse_args()
+    if args.dir and args.in_place:
+        raise RuntimeError('give only one of --dir and --in-place')
+    if args.dir:
+        os.makedirs(args.dir, exist_ok=True)
+
+    failed = 0
+    for filename in args.files:
+        if args.in_place:
+            output = filename
+        elif args.dir:
+            output = os.path.join(args.dir, os.path.basename(filename))
+        else:
+            output = os.path.splitext(filename)[0] + '-std.dng'
+        try:
+            with open(filename, 'rb') as f:
+                data = convert(f.read())
+        except (RuntimeError, zstandard.ZstdError) as e:
+            print(f'{filename}: {e}', file=sys.stderr)
+            failed += 1
+            continue
+        # Written alongside and renamed, so that a file replaced in place is never left half-written.
+        with open(output + '.tmp', 'wb') as f:
+            f.write(data)
+        os.replace(output + '.tmp', output)
+        print(f'{filename} -> {output}')
+    if failed:
+        raise RuntimeError(f'{failed} of {len(args.files)} files could not be converted')
+
+
+if __name__ == '__main__':
+    try:
+        main()
+    except (RuntimeError, OSError) as e:
+        print(f'Error: {e}', file=sys.stderr)
+        sys.exit(1)
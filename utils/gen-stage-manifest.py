@@ -0,0 +1,43 @@
+#!/usr/bin/python3
+#
+# rpicam-apps post-processing stage manifest generator
+# Copyright (C) 2025, Raspberry Pi Ltd.
+#
+# Lists the stages that a post-processing module's sources register, one name per line, so that the module need
+# only be loaded when the post-processing JSON asks for one of them. Stages are found from their
+# "static RegisterStage reg(NAME, &Create)" line, with NAME either a string or a #define of one.
+import re
+import sys
+
+DEFINE = re.compile(r'^\s*#define\s+(\w+)\s+"([^"]+)"', re.MULTILINE)
+REGISTER = re.compile(r'RegisterStage\s+\w+\s*\(\s*(?:"([^"]+)"|(\w+))\s*,')
+
+
+def stages(filename):
+    with open(filename) as f:
+        source = f.read()
+    defines = dict(DEFINE.findall(source))
+    names = []
+    for literal, macro in REGISTER.findall(source):
+        name = literal or defines.get(macro)
+        if not name:
+            raise RuntimeError(f'{filename}: can\'t tell what stage {macro} names')
+        names.append(name)
+    return names
+
+
+def main():
+    if len(sys.argv) < 3:
+        raise RuntimeError('usage: gen-stage-manifest.py OUTPUT SOURCE...')
+    names = [name for source in sys.argv[2:] for name in stages(source)]
+    with open(sys.argv[1], 'w') as f:
+        f.write('# Stages registered by this module; generated by gen-stage-manifest.py\n')
+        f.writelines(name + '\n' for name in sorted(names))
+
+
+if __name__ == '__main__':
+    try:
+        main()
+    except (RuntimeError, OSError) as e:
+        print(f'Error: {e}', file=sys.stderr)
+        sys.exit(1)
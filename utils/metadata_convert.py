@@ -0,0 +1,113 @@
+#!/usr/bin/python3
+#
+# rpicam-apps binary metadata (--metadata-format bin) conversion tool
+# Copyright (C) 2025, Raspberry Pi Ltd.
+#
+import argparse
+import json
+import struct
+import sys
+
+NAME = struct.Struct('<IH')
+RECORD = struct.Struct('<II')
+ENTRY = struct.Struct('<IBBI')
+
+# BinaryMetadataType in output/binary_metadata.hpp.
+NONE, BOOL, BYTE, INT32, INT64, FLOAT, STRING, RECTANGLE, SIZE, UNSIGNED = range(10)
+FORMATS = {BOOL: '?', BYTE: 'B', INT32: 'i', INT64: 'q', FLOAT: 'f', RECTANGLE: 'iiII', SIZE: 'II'}
+UNSIGNED_FORMATS = {1: 'B', 2: 'H', 4: 'I', 8: 'Q'}
+
+
+def read_names(f):
+    if f.read(8) != b'RPIMETA1':
+        raise RuntimeError('not an rpicam-apps binary metadata file')
+    count, = struct.unpack('<I', f.read(4))
+    names = {}
+    for _ in range(count):
+        id, length = NAME.unpack(f.read(NAME.size))
+        names[id] = f.read(length).decode(errors='replace')
+    return names
+
+
+def parse_value(type, element_size, count, data):
+    if type == NONE:
+        return None
+    if type == STRING:
+        return data.decode(errors='replace')
+    fmt = FORMATS.get(type) if type != UNSIGNED else UNSIGNED_FORMATS.get(element_size)
+    if fmt is None or (count and struct.calcsize('<' + fmt) != element_size):
+        return data.hex()
+    values = [v if len(v) > 1 else v[0] for v in struct.iter_unpack('<' + fmt, data)]
+    return values[0] if count == 1 else values
+
+
+def read_frames(f, names):
+    # A file cut short ends at the last complete record.
+    while True:
+        header = f.read(RECORD.size)
+        if len(header) < RECORD.size:
+            return
+        size, count = RECORD.unpack(header)
+        body = f.read(size - 4)
+        if len(body) < size - 4:
+            return
+        frame = {}
+        offset = 0
+        for _ in range(count):
+            id, type, element_size, elements = ENTRY.unpack_from(body, offset)
+            offset += ENTRY.size
+            data = body[offset:offset + element_size * elements]
+            offset += element_size * elements
+            frame[names.get(id, f'control_{id}')] = (type, parse_value(type, element_size, elements, data))
+        yield frame
+
+
+# Write values the way libcamera's ControlValue::toString() would, as the txt and json formats do.
+def to_string(type, value):
+    if isinstance(value, list) and type not in (RECTANGLE, SIZE):
+        return '[ ' + ', '.join(to_string(type, v) for v in value) + ' ]'
+    if type == BOOL:
+        return 'true' if value else 'false'
+    if type == FLOAT:
+        return f'{value:f}'
+    if type == RECTANGLE:
+        if value and isinstance(value[0], tuple):
+            return '[ ' + ', '.join(to_string(type, v) for v in value) + ' ]'
+        return f'({value[0]}, {value[1]})/{value[2]}x{value[3]}'
+    if type == SIZE:
+        if value and isinstance(value[0], tuple):
+            return '[ ' + ', '.join(to_string(type, v) for v in value) + ' ]'
+        return f'{value[0]}x{value[1]}'
+    return str(value)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Convert rpicam-apps binary metadata to the json or txt format.')
+    parser.add_argument('input', help='Binary metadata file')
+    parser.add_argument('--format', '-f', choices=['json', 'txt'], default='json',
+                        help='Format to convert to (default: %(default)s)')
+    parser.add_argument('--output', '-o', help='Output file (default: stdout)')
+    args = parser.parse_args()
+
+    with open(args.input, 'rb') as f, (open(args.output, 'w') if args.output else sys.stdout) as out:
+        names = read_names(f)
+        if args.format == 'txt':
+            for frame in read_frames(f, names):
+                for name, (type, value) in frame.items():
+                    out.write(f'{name}={to_string(type, value)}\n')
+                out.write('\n')
+        else:
+            frames = []
+            for frame in read_frames(f, names):
+                frames.append({name: value if type not in (RECTANGLE, SIZE) else to_string(type, value)
+                               for name, (type, value) in frame.items()})
+            json.dump(frames, out, indent=4)
+            out.write('\n')
+
+
+if __name__ == '__main__':
+    try:
+        main()
+    except RuntimeError as e:
+        print(f'Error: {e}', file=sys.stderr)
+        sys.exit(1)
@@ -0,0 +1,149 @@
+#!/usr/bin/python3
+#
+# Synchronised capture from several rpicam-raw daemons (--daemon-socket), on one Pi or many
+# Copyright (C) 2025, Raspberry Pi Ltd.
+#
+# Each camera runs rpicam-raw as a daemon, with --sync server on one of them and --sync client on the others (so the
+# sensors run in step), and only the one named by --lamp driving the lamp. This sends each daemon the same capture
+# command, and pairs up the frames they report by their FrameWallClock, so that each set of matching frames, one from
+# every camera, gets a capture index shared by them all. Each camera writes to a directory of its own under --dir
+# (on its own machine, for a remote one), and the sets are written to a manifest giving, for each capture index, the
+# frame of each camera's burst (which is also the order its files are written in) that belongs to it. The lamp is
+# driven once for each set, by the one camera.
+#
+# For example:
+#   multicam_capture.py --camera left=/run/left.sock --camera right=tcp:pi2.local:5000 --lamp left \
+#       --frames 100 --pattern R,G,B --dir /data/run1
+import argparse
+import json
+import os
+import socket
+import sys
+import threading
+
+
+def connect(address):
+    if address.startswith('tcp:'):
+        host, port = address[4:].rsplit(':', 1)
+        return socket.create_connection((host, int(port)))
+    s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    s.connect(address)
+    return s
+
+
+class Camera:
+    def __init__(self, name, address):
+        self.name = name
+        self.socket = connect(address)
+        self.file = self.socket.makefile('r')
+        self.frames = []
+        self.error = None
+
+    def command(self, line):
+        self.socket.sendall((line + '\n').encode())
+        reply = self.file.readline().split()
+        if not reply or reply[0] != 'OK':
+            raise RuntimeError(f'{self.name}: {" ".join(reply) or "no reply"}')
+        return reply[1]
+
+    # Collect the FRAME reports until the burst is DONE.
+    def collect(self, id):
+        try:
+            for line in self.file:
+                words = line.split()
+                if words[:2] == ['FRAME', id]:
+                    self.frames.append({'n': int(words[2]), 'sequence': int(words[3]),
+                                        'wall_clock_us': int(words[4])})
+                elif words[:2] == ['DONE', id]:
+                    return
+            self.error = 'connection closed before the capture finished'
+        except (OSError, ValueError, IndexError) as e:
+            self.error = str(e)
+
+
+# Pair each frame of the first camera with the closest frame of each of the others, taking them in order, and keep
+# the sets where every camera has a frame within the tolerance.
+def match(cameras, tolerance_us):
+    reference, others = cameras[0], cameras[1:]
+    positions = [0] * len(others)
+    sets = []
+    for frame in reference.frames:
+        members = {reference.name: frame}
+        for i, camera in enumerate(others):
+            frames = camera.frames
+            while positions[i] + 1 < len(frames) and \
+                    abs(frames[positions[i] + 1]['wall_clock_us'] - frame['wall_clock_us']) <= \
+                    abs(frames[positions[i]]['wall_clock_us'] - frame['wall_clock_us']):
+                positions[i] += 1
+            if positions[i] < len(frames) and \
+                    abs(frames[positions[i]]['wall_clock_us'] - frame['wall_clock_us']) <= tolerance_us:
+                members[camera.name] = frames[positions[i]]
+                positions[i] += 1
+        if len(members) == len(cameras):
+            sets.append({'index': len(sets), 'wall_clock_us': frame['wall_clock_us'], 'frames': members})
+    return sets
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Capture matched sets of frames from several rpicam-raw daemons.')
+    parser.add_argument('--camera', action='append', required=True, metavar='NAME=SOCKET',
+                        help='A camera daemon, by Unix socket path or tcp:HOST:PORT (give two or more)')
+    parser.add_argument('--lamp', help='The camera whose daemon drives the lamp (default: the first)')
+    parser.add_argument('--frames', type=int, default=1, help='Frames to capture on each camera')
+    parser.add_argument('--pattern', help='Lamp pattern for the capture, as R,G,B')
+    parser.add_argument('--dir', required=True, help='Directory for the capture, with one under it for each camera')
+    parser.add_argument('--tolerance-us', type=int, default=1000,
+                        help='Furthest apart frames can be to belong to the same set (default: %(default)s)')
+    parser.add_argument('--manifest', help='Where to write the sets (default: sets.json in --dir)')
+    args = parser.parse_args()
+
+    cameras = []
+    for spec in args.camera:
+        name, _, address = spec.partition('=')
+        if not address:
+            raise RuntimeError(f'expected NAME=SOCKET, not {spec}')
+        cameras.append(Camera(name, address))
+    lamp = args.lamp or cameras[0].name
+    if lamp not in [c.name for c in cameras]:
+        raise RuntimeError(f'no camera called {lamp}')
+
+    # Start every camera before waiting for any, so that their bursts overlap as closely as they can.
+    threads = []
+    for camera in cameras:
+        line = f'capture frames={args.frames} report=frames dir={os.path.join(args.dir, camera.name)}'
+        if args.pattern and camera.name == lamp:
+            line += f' pattern={args.pattern}'
+        id = camera.command(line)
+        threads.append(threading.Thread(target=camera.collect, args=(id,)))
+        threads[-1].start()
+    for thread in threads:
+        thread.join()
+    for camera in cameras:
+        if camera.error:
+            raise RuntimeError(f'{camera.name}: {camera.error}')
+
+    sets = match(cameras, args.tolerance_us)
+    matched = {camera.name: {s['frames'][camera.name]['n'] for s in sets} for camera in cameras}
+    manifest = {
+        'cameras': [camera.name for camera in cameras],
+        'lamp': lamp,
+        'sets': sets,
+        'unmatched': {camera.name: [f for f in camera.frames if f['n'] not in matched[camera.name]]
+                      for camera in cameras},
+    }
+    filename = args.manifest or os.path.join(args.dir, 'sets.json')
+    os.makedirs(os.path.dirname(filename) or '.', exist_ok=True)
+    with open(filename, 'w') as f:
+        json.dump(manifest, f, indent=2)
+    print(f'{len(sets)} matched sets of {len(cameras)} cameras -> {filename}')
+    for camera in cameras:
+        if manifest['unmatched'][camera.name]:
+            print(f'{camera.name}: {len(manifest["unmatched"][camera.name])} frames had no match', file=sys.stderr)
+
+
+if __name__ == '__main__':
+    try:
+        main()
+    except (RuntimeError, OSError) as e:
+        print(f'Error: {e}', file=sys.stderr)
+        sys.exit(1)
@@ -0,0 +1,154 @@
+#!/usr/bin/python3
+#
+# rpicam-apps native PiSP DNG (--dng-compression pisp) conversion tool
+# Copyright (C) 2025, Raspberry Pi Ltd.
+#
+# A native PiSP DNG holds the camera's compressed raw data exactly as it came from the sensor, a byte a pixel in
+# 8-pixel blocks, marked with a private compression scheme and a private tag giving the compression mode and offset.
+# This decodes it, just as the DNG encoder would have done at capture time, and writes a standard DNG with 16-bit
+# samples; every other tag is kept as it is. Frames in an archive (--archive) can be taken out with archive_extract.py
+# first.
+import argparse
+import os
+import struct
+import sys
+
+import numpy as np
+
+COMPRESSION_PISP = 65000
+TAG_PISP_COMPRESSION = 65000
+ENTRY = struct.Struct('<HHI4s')
+
+
+def read_ifd(data):
+    if data[:4] != b'II*\0':
+        raise RuntimeError('not a little-endian TIFF file')
+    offset, = struct.unpack_from('<I', data, 4)
+    count, = struct.unpack_from('<H', data, offset)
+    entries = {}
+    for i in range(count):
+        pos = offset + 2 + 12 * i
+        tag, type, n, value = ENTRY.unpack_from(data, pos)
+        entries[tag] = (pos, type, n, value)
+    return offset, count, entries
+
+
+def value(data, entry, index=0):
+    pos, type, n, raw = entry
+    fmt = '<H' if type == 3 else '<I'
+    size = struct.calcsize(fmt)
+    if n * size <= 4:
+        return struct.unpack_from(fmt, raw, index * size)[0]
+    offset, = struct.unpack('<I', raw)
+    return struct.unpack_from(fmt, data, offset + index * size)[0]
+
+
+def dequantize(q, qmode):
+    d = np.select([qmode == 0, qmode == 1, qmode == 2],
+                  [np.where(q < 320, 16 * q, 32 * (q - 160)), 64 * q, 128 * q],
+                  np.where(q < 94, 256 * q, np.minimum(0xFFFF, 512 * (q - 47))))
+    return d & 0xFFFF
+
+
+# Four samples, for every other pixel of a block, from each 32-bit word (subBlockFunction in dng_unpack.cpp).
+def sub_block(w):
+    qmode = w & 3
+    field0, field1, field2, field3 = (w >> 2) & 511, (w >> 11) & 127, (w >> 18) & 127, (w >> 25) & 127
+    wide = (qmode == 2) & (field0 >= 384)
+    q1 = np.where(wide, field0, np.where(field1 >= 64, field0, field0 + 64 - field1))
+    q2 = np.where(wide, field1 + 384, np.where(field1 >= 64, field0 + field1 - 64, field0))
+    p1, p2 = np.maximum(0, q1 - 64), np.maximum(0, q2 - 64)
+    p1, p2 = np.where(qmode == 2, np.minimum(384, p1), p1), np.where(qmode == 2, np.minimum(384, p2), p2)
+    q = [p1 + field2, q1, q2, p2 + field3]
+
+    pack0, pack1 = (w >> 2) & 32767, (w >> 17) & 32767
+    packed = [(pack0 & 15) + 16 * ((pack0 >> 8) // 11), (pack0 >> 4) % 176,
+              (pack1 & 15) + 16 * ((pack1 >> 8) // 11), (pack1 >> 4) % 176]
+    return np.stack([dequantize(np.where(qmode == 3, b, a), qmode) for a, b in zip(q, packed)], axis=-1)
+
+
+def postprocess(a, mode, offset):
+    if mode & 2:
+        a = np.select([(mode == 3) & (a < 0x4000), a < 0x1000, a < 0x1800, a < 0x3000, a < 0x6000, a < 0xC000],
+                      [a >> 2, a >> 4, (a - 0x800) >> 3, (a - 0x1000) >> 2, (a - 0x2000) >> 1, a - 0x4000],
+                      2 * (a - 0x8000))
+    return np.minimum(0xFFFF, a + offset)
+
+
+def uncompress(payload, width, height, mode, offset):
+    blocks = np.frombuffer(payload, dtype=np.uint8).reshape(height, width // 8, 8)
+    if not mode & 1:
+        return postprocess(blocks.reshape(height, width).astype(np.int64) << 8, mode, offset)
+    words = blocks.view('<u4').astype(np.int64)
+    # Word 0 of a block has its even pixels and word 1 its odd ones.
+    samples = np.stack([sub_block(words[..., 0]), sub_block(words[..., 1])], axis=-1)
+    return postprocess(samples.reshape(height, width), mode, offset)
+
+
+def convert(data):
+    offset, count, entries = read_ifd(data)
+    if 259 not in entries or value(data, entries[259]) != COMPRESSION_PISP or TAG_PISP_COMPRESSION not in entries:
+        raise RuntimeError('not a native PiSP DNG')
+    width, height = value(data, entries[256]), value(data, entries[257])
+    strip_offset, strip_size = value(data, entries[273]), value(data, entries[279])
+    mode, comp_offset = value(data, entries[TAG_PISP_COMPRESSION]), value(data, entries[TAG_PISP_COMPRESSION], 1)
+    if width % 8 or strip_size != width * height or strip_offset + strip_size > len(data):
+        raise RuntimeError('unexpected layout for a native PiSP DNG')
+
+    samples = uncompress(data[strip_offset:strip_offset + strip_size], width, height, mode, comp_offset)
+
+    header = bytearray(data[:strip_offset])
+    struct.pack_into('<H', header, entries[258][0] + 8, 16)
+    struct.pack_into('<H', header, entries[259][0] + 8, 1)
+    struct.pack_into('<I', header, entries[279][0] + 8, 2 * width * height)
+    # The private tag is the IFD's last (the entries are in tag order), so dropping it only means moving the next
+    # IFD offset up.
+    last = offset + 2 + 12 * (count - 1)
+    if entries[TAG_PISP_COMPRESSION][0] == last:
+        struct.pack_into('<H', header, offset, count - 1)
+        header[last:last + 4] = header[last + 12:last + 16]
+        header[last + 4:last + 16] = bytes(12)
+    return bytes(header) + samples.astype('<u2').tobytes()
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Turn native PiSP DNGs (--dng-compression pisp) into standard ones.')
+    parser.add_argument('files', nargs='+', help='Native PiSP DNG files')
+    parser.add_argument('--dir', '-d', help='Write the standard DNGs, with the same names, in this directory')
+    parser.add_argument('--in-place', action='store_true', help='Replace each file with its standard DNG')
+    args = parser.parse_args()
+    if args.dir and args.in_place:
+        raise RuntimeError('give only one of --dir and --in-place')
+    if args.dir:
+        os.makedirs(args.dir, exist_ok=True)
+
+    failed = 0
+    for filename in args.files:
+        if args.in_place:
+            output = filename
+        elif args.dir:
+            output = os.path.join(args.dir, os.path.basename(filename))
+        else:
+            output = os.path.splitext(filename)[0] + '-std.dng'
+        try:
+            with open(filename, 'rb') as f:
+                data = convert(f.read())
+        except RuntimeError as e:
+            print(f'{filename}: {e}', file=sys.stderr)
+            failed += 1
+            continue
+        # Written alongside and renamed, so that a file replaced in place is never left half-written.
+        with open(output + '.tmp', 'wb') as f:
+            f.write(data)
+        os.replace(output + '.tmp', output)
+        print(f'{filename} -> {output}')
+    if failed:
+        raise RuntimeError(f'{failed} of {len(args.files)} files could not be converted')
+
+
+if __name__ == '__main__':
+    try:
+        main()
+    except (RuntimeError, OSError) as e:
+        print(f'Error: {e}', file=sys.stderr)
+        sys.exit(1)
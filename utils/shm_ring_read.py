@@ -0,0 +1,127 @@
+#!/usr/bin/python3
+#
+# rpicam-apps shared-memory frame ring (--shm-ring) reader
+# Copyright (C) 2025, Raspberry Pi Ltd.
+#
+# Follows the ring as frames are published, printing each one's details and optionally saving it. The layout is
+# described in output/shm_ring.hpp. Frames the reader falls too far behind to copy before they are overwritten are
+# counted as missed, never read half-written.
+import argparse
+import ctypes
+import mmap
+import os
+import struct
+import sys
+import time
+
+HEADER = struct.Struct('<8sIIQIIQQ')
+SLOT = struct.Struct('<IIQQqqIII20s16s')
+FUTEX_OFFSET = 28
+FRAMES_OFFSET = 32
+FUTEX_WAIT = 0
+SYS_FUTEX = {'aarch64': 98, 'armv7l': 240, 'armv6l': 240, 'x86_64': 202}.get(os.uname().machine)
+
+
+class Ring:
+    def __init__(self, name):
+        path = '/dev/shm/' + name.lstrip('/')
+        # Mapped through libc rather than the mmap module, so that the futex word has an address to wait on.
+        self.libc = ctypes.CDLL(None, use_errno=True)
+        self.libc.mmap.restype = ctypes.c_void_p
+        self.libc.mmap.argtypes = [ctypes.c_void_p, ctypes.c_size_t, ctypes.c_int, ctypes.c_int, ctypes.c_int,
+                                   ctypes.c_long]
+        fd = os.open(path, os.O_RDONLY)
+        try:
+            size = os.fstat(fd).st_size
+            self.base = self.libc.mmap(None, size, mmap.PROT_READ, mmap.MAP_SHARED, fd, 0)
+        finally:
+            os.close(fd)
+        if self.base in (None, ctypes.c_void_p(-1).value):
+            raise RuntimeError(f'failed to map {path}: {os.strerror(ctypes.get_errno())}')
+        magic, self.header_size, self.slot_count, self.slot_size, self.slot_header_size, _, _, _ = \
+            HEADER.unpack(self.bytes(0, HEADER.size))
+        if magic != b'RPIRING1':
+            raise RuntimeError(f'{path} is not an rpicam-apps frame ring (or is not ready yet)')
+
+    def bytes(self, offset, size):
+        return ctypes.string_at(self.base + offset, size)
+
+    def word(self, offset, fmt):
+        return struct.unpack(fmt, self.bytes(offset, struct.calcsize(fmt)))[0]
+
+    def frames(self):
+        return self.word(FRAMES_OFFSET, '<Q')
+
+    # Wait for the next frame to be published, with the futex where we can, or else by polling.
+    def wait(self, frames, timeout):
+        if SYS_FUTEX is None:
+            time.sleep(0.001)
+            return
+        value = self.word(FUTEX_OFFSET, '<I')
+        if self.frames() == frames:
+            ts = struct.pack('@qq', int(timeout), int((timeout % 1) * 1e9))
+            self.libc.syscall(SYS_FUTEX, ctypes.c_void_p(self.base + FUTEX_OFFSET), FUTEX_WAIT,
+                              ctypes.c_uint32(value), ts, None, 0)
+
+    # Copy frame n out of its slot, or return None if it has been overwritten.
+    def read(self, n):
+        offset = self.header_size + (n % self.slot_count) * self.slot_size
+        before = self.word(offset, '<I')
+        header = SLOT.unpack(self.bytes(offset, SLOT.size))
+        data = self.bytes(offset + self.slot_header_size, min(header[1], self.slot_size - self.slot_header_size))
+        after = self.word(offset, '<I')
+        if before & 1 or before != after or header[2] != n:
+            return None
+        lock, size, index, sequence, timestamp_us, sensor_ns, width, height, stride, fmt, lamp = header
+        return {'index': index, 'sequence': sequence, 'timestamp_us': timestamp_us,
+                'sensor_timestamp_ns': sensor_ns, 'width': width, 'height': height, 'stride': stride,
+                'pixel_format': fmt.rstrip(b'\0').decode(), 'lamp_color': lamp.rstrip(b'\0').decode(),
+                'size': size}, data
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Follow the frames rpicam-apps publishes with --shm-ring.')
+    parser.add_argument('name', help='Name given to --shm-ring, such as /rpicam-raw')
+    parser.add_argument('--count', type=int, default=0, help='Stop after this many frames (0 = never)')
+    parser.add_argument('--dir', help='Save each frame in this directory')
+    parser.add_argument('--suffix', default='dng', help='Suffix of the saved frames (default: %(default)s)')
+    args = parser.parse_args()
+
+    ring = Ring(args.name)
+    if args.dir:
+        os.makedirs(args.dir, exist_ok=True)
+    n = ring.frames()
+    read = missed = 0
+    while not args.count or read < args.count:
+        frames = ring.frames()
+        if frames == n:
+            ring.wait(frames, 1.0)
+            continue
+        # Skip anything already overwritten.
+        if frames - n > ring.slot_count:
+            missed += frames - n - ring.slot_count
+            n = frames - ring.slot_count
+        frame = ring.read(n)
+        n += 1
+        if frame is None:
+            missed += 1
+            continue
+        info, data = frame
+        read += 1
+        print(f'{info["index"]}: sequence {info["sequence"]} {info["width"]}x{info["height"]} '
+              f'{info["pixel_format"]} {info["lamp_color"] or "-"} {info["size"]} bytes')
+        if args.dir:
+            with open(os.path.join(args.dir, f'frame_{info["sequence"]:06d}.{args.suffix}'), 'wb') as f:
+                f.write(data)
+    if missed:
+        print(f'{missed} frames missed', file=sys.stderr)
+
+
+if __name__ == '__main__':
+    try:
+        main()
+    except KeyboardInterrupt:
+        pass
+    except (RuntimeError, OSError) as e:
+        print(f'Error: {e}', file=sys.stderr)
+        sys.exit(1)
@@ -0,0 +1,321 @@
+#pragma once
+
+#include <netdb.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "runtimesettings.hpp"
+
+// Listens on a Unix socket, or on TCP with a path of "tcp:HOST:PORT", for capture commands, for when rpicam-raw runs
+// as a daemon with the camera kept streaming. Commands are lines of text:
+//   capture [frames=N] [pattern=R,G,B] [dir=PATH] [report=frames]
+//                                                    - start a capture burst, answered "OK <id>" and, once every
+//                                                      frame has been handed to the encoder, "DONE <id> <frames>";
+//                                                      with report=frames, each frame is also reported as
+//                                                      "FRAME <id> <n> <sequence> <wall clock us>" as it goes
+//   status                                          - answered "IDLE" or "BUSY <id>"
+//   set KEY=VALUE...                                - change settings (see RuntimeSettings) while running, all of
+//                                                      them or, answered "ERR <reason>", none; answered "OK"
+//   settings                                        - answered "OK" and the current settings, as KEY=VALUE...
+//   trigger                                         - save the --raw-ring, answered "OK" (control socket only)
+//   quit                                            - shut the daemon down
+// Anything else is answered "ERR <reason>". A client may keep its connection open and send any number of commands.
+// The socket is served by a thread of its own; the capture loop picks commands up with poll() once per frame, and
+// settings from the store whenever its generation changes. Without captures, only the settings can be used (for a
+// control socket of an ordinary capture rather than a daemon).
+class CaptureServer {
+public:
+    struct Command {
+        unsigned int id;
+        unsigned int frames;
+        std::string pattern;
+        std::string dir;
+        bool report_frames;
+        unsigned int client;
+    };
+
+    CaptureServer(std::string const& path, RuntimeSettingsStore* settings = nullptr, bool captures = true)
+        : path(path), settings(settings), captures(captures) {
+        if (path.compare(0, 4, "tcp:") == 0) {
+            listenTcp(path.substr(4));
+        } else {
+            listenUnix();
+        }
+        wake_fd = eventfd(0, EFD_CLOEXEC);
+        if (wake_fd < 0) {
+            close(listen_fd);
+            if (!tcp) {
+                unlink(path.c_str());
+            }
+            throw std::runtime_error("CaptureServer: failed to create eventfd");
+        }
+        worker = std::thread(&CaptureServer::run, this);
+    }
+
+    ~CaptureServer() {
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) < 0) {
+            std::cerr << "CaptureServer: failed to wake server thread" << std::endl;
+        }
+        worker.join();
+        for (auto const& [client, fd] : clients) {
+            close(fd);
+        }
+        close(wake_fd);
+        close(listen_fd);
+        if (!tcp) {
+            unlink(path.c_str());
+        }
+    }
+
+    // The next capture command, if there is one. Doesn't block.
+    std::optional<Command> poll() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (commands.empty()) {
+            return std::nullopt;
+        }
+        Command command = std::move(commands.front());
+        commands.pop_front();
+        busy_id = command.id;
+        return command;
+    }
+
+    // Report a capture burst finished, to whoever asked for it if they're still there.
+    void finished(Command const& command, unsigned int frames) {
+        std::lock_guard<std::mutex> lock(mutex);
+        busy_id = 0;
+        reply(command.client, "DONE " + std::to_string(command.id) + " " + std::to_string(frames));
+    }
+
+    // Report a frame of the burst handed to the encoder, if the command asked for that.
+    void frame(Command const& command, unsigned int n, uint64_t sequence, int64_t wall_clock_us) {
+        if (!command.report_frames) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        reply(command.client, "FRAME " + std::to_string(command.id) + " " + std::to_string(n) + " " +
+                                  std::to_string(sequence) + " " + std::to_string(wall_clock_us));
+    }
+
+    bool quitRequested() const { return quit_requested; }
+    // Whether "trigger" has been sent since we last asked.
+    bool triggerRequested() { return trigger_requested.exchange(false); }
+
+private:
+    void listenUnix() {
+        listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listen_fd < 0) {
+            throw std::runtime_error("CaptureServer: failed to create socket");
+        }
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path)) {
+            close(listen_fd);
+            throw std::runtime_error("CaptureServer: socket path too long: " + path);
+        }
+        strcpy(addr.sun_path, path.c_str());
+        // A socket left behind by an earlier run would make the bind fail.
+        unlink(path.c_str());
+        if (bind(listen_fd, (sockaddr*)&addr, sizeof(addr)) || listen(listen_fd, 4)) {
+            std::string error = strerror(errno);
+            close(listen_fd);
+            throw std::runtime_error("CaptureServer: failed to listen on " + path + ": " + error);
+        }
+    }
+
+    // For a coordinator on another machine. There's no authentication, so give the address of an interface on a
+    // network that is trusted.
+    void listenTcp(std::string const& address) {
+        tcp = true;
+        size_t colon = address.rfind(':');
+        if (colon == std::string::npos) {
+            throw std::runtime_error("CaptureServer: expected tcp:HOST:PORT, not " + path);
+        }
+        addrinfo hints = {}, *info = nullptr;
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        std::string host = address.substr(0, colon), port = address.substr(colon + 1);
+        if (getaddrinfo(host.c_str(), port.c_str(), &hints, &info) || !info) {
+            throw std::runtime_error("CaptureServer: can't resolve " + address);
+        }
+        listen_fd = socket(info->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int one = 1;
+        bool ok = listen_fd >= 0 && !setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) &&
+                  !bind(listen_fd, info->ai_addr, info->ai_addrlen) && !listen(listen_fd, 4);
+        std::string error = strerror(errno);
+        freeaddrinfo(info);
+        if (!ok) {
+            if (listen_fd >= 0) {
+                close(listen_fd);
+            }
+            throw std::runtime_error("CaptureServer: failed to listen on " + address + ": " + error);
+        }
+    }
+
+    void run() {
+        std::map<unsigned int, std::string> partial;
+        while (true) {
+            std::vector<pollfd> fds = { { wake_fd, POLLIN, 0 }, { listen_fd, POLLIN, 0 } };
+            std::vector<unsigned int> ids;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                for (auto const& [client, fd] : clients) {
+                    fds.push_back({ fd, POLLIN, 0 });
+                    ids.push_back(client);
+                }
+            }
+            if (::poll(fds.data(), fds.size(), -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                std::cerr << "CaptureServer: poll failed: " << strerror(errno) << std::endl;
+                return;
+            }
+            if (fds[0].revents) {
+                return;
+            }
+            if (fds[1].revents & POLLIN) {
+                int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+                if (fd >= 0) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    clients[next_client++] = fd;
+                }
+            }
+            for (unsigned int i = 0; i < ids.size(); i++) {
+                if (!fds[i + 2].revents) {
+                    continue;
+                }
+                char buf[512];
+                ssize_t n = read(fds[i + 2].fd, buf, sizeof(buf));
+                if (n <= 0) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    close(fds[i + 2].fd);
+                    clients.erase(ids[i]);
+                    partial.erase(ids[i]);
+                    continue;
+                }
+                std::string& text = partial[ids[i]];
+                text.append(buf, n);
+                size_t end;
+                while ((end = text.find('\n')) != std::string::npos) {
+                    std::string line = text.substr(0, end);
+                    text.erase(0, end + 1);
+                    handle(ids[i], line);
+                }
+                if (text.size() > 4096) {
+                    // Nobody sends commands this long on purpose.
+                    text.clear();
+                }
+            }
+        }
+    }
+
+    void handle(unsigned int client, std::string const& line) {
+        std::istringstream words(line);
+        std::string verb;
+        words >> verb;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (verb == "capture" && !captures) {
+            reply(client, "ERR captures are only taken by a daemon");
+        } else if (verb == "capture") {
+            Command command = { 0, 0, "", "", false, client };
+            std::string word;
+            while (words >> word) {
+                size_t eq = word.find('=');
+                std::string key = word.substr(0, eq);
+                std::string value = eq == std::string::npos ? "" : word.substr(eq + 1);
+                if (key == "frames") {
+                    try {
+                        command.frames = std::stoul(value);
+                    } catch (std::exception const&) {
+                        return reply(client, "ERR bad frame count " + value);
+                    }
+                } else if (key == "pattern") {
+                    command.pattern = value;
+                } else if (key == "dir") {
+                    command.dir = value;
+                } else if (key == "report" && value == "frames") {
+                    command.report_frames = true;
+                } else {
+                    return reply(client, "ERR unknown argument " + key);
+                }
+            }
+            command.id = next_id++;
+            commands.push_back(command);
+            reply(client, "OK " + std::to_string(command.id));
+        } else if (verb == "status") {
+            reply(client, busy_id ? "BUSY " + std::to_string(busy_id) : std::string("IDLE"));
+        } else if (verb == "set" && settings) {
+            std::vector<std::pair<std::string, std::string>> values;
+            std::string word;
+            while (words >> word) {
+                size_t eq = word.find('=');
+                if (eq == std::string::npos) {
+                    return reply(client, "ERR expected KEY=VALUE, not " + word);
+                }
+                values.emplace_back(word.substr(0, eq), word.substr(eq + 1));
+            }
+            std::string error = settings->update(values);
+            reply(client, error.empty() ? "OK" : "ERR " + error);
+        } else if (verb == "settings" && settings) {
+            reply(client, "OK " + settings->get()->toString());
+        } else if (verb == "trigger" && captures) {
+            reply(client, "ERR triggers are only taken by a control socket");
+        } else if (verb == "trigger") {
+            trigger_requested = true;
+            reply(client, "OK");
+        } else if (verb == "quit") {
+            quit_requested = true;
+            reply(client, "OK");
+        } else if (!verb.empty()) {
+            reply(client, "ERR unknown command " + verb);
+        }
+    }
+
+    // Call with the mutex held.
+    void reply(unsigned int client, std::string const& text) {
+        auto it = clients.find(client);
+        if (it == clients.end()) {
+            return;
+        }
+        std::string line = text + "\n";
+        if (send(it->second, line.data(), line.size(), MSG_NOSIGNAL | MSG_DONTWAIT) < 0) {
+            std::cerr << "CaptureServer: failed to reply to client: " << strerror(errno) << std::endl;
+        }
+    }
+
+    std::string path;
+    RuntimeSettingsStore* settings;
+    bool captures;
+    bool tcp = false;
+    int listen_fd;
+    int wake_fd;
+    std::thread worker;
+
+    std::mutex mutex;
+    std::map<unsigned int, int> clients;
+    unsigned int next_client = 1;
+    std::deque<Command> commands;
+    unsigned int next_id = 1;
+    unsigned int busy_id = 0;
+    std::atomic<bool> quit_requested = false;
+    std::atomic<bool> trigger_requested = false;
+};
@@ -1,17 +1,65 @@
+#pragma once
+
 #include <iostream>
 #include <string>
 #include <vector>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <cerrno>
 #include <fcntl.h>
 #include <unistd.h>
 #include <termios.h>
+#include <sys/epoll.h>
+
+#include "core/trace.hpp"
 
 class GpioHandler {
+public:
+    // Result of a queued lamp colour change. "sent" is when the first attempt started and "time" when the lamp
+    // acknowledged the change, or when the command went out in fire-and-forget mode.
+    struct LampAck {
+        uint64_t sequence;
+        std::string color;
+        bool ok;
+        std::chrono::steady_clock::time_point sent;
+        std::chrono::steady_clock::time_point time;
+    };
+    // Called on the lamp I/O thread once a queued change has completed, so it should not block.
+    typedef std::function<void(LampAck const&)> LampCallback;
+    // With an uploaded pattern, a reading of how many illumination trigger edges the controller has stepped on since
+    // it was armed, taken between "sent" and "time".
+    struct LampReadback {
+        uint64_t edges;
+        bool ok;
+        std::chrono::steady_clock::time_point sent;
+        std::chrono::steady_clock::time_point time;
+    };
+    typedef std::function<void(LampReadback const&)> ReadbackCallback;
+
 private:
+    struct LampCommand {
+        uint64_t sequence;
+        std::string color;
+        std::string active_channels;
+        // Instead of the change, upload this pattern command and arm the controller to step through it.
+        std::string upload;
+        std::promise<LampAck> promise;
+        LampCallback callback;
+    };
+
     int tx_serial_fd;
     int rx_serial_fd;
+    int rx_epoll_fd;
     bool tx_serial_open;
     bool rx_serial_open;
     bool fire_and_forget;
+    bool binary_protocol;
     unsigned int red_brightness;
     unsigned int green_brightness;
     unsigned int blue_brightness;
@@ -21,36 +69,306 @@ private:
     std::vector<std::string> lamp_pattern_vec;
     unsigned int lamp_pattern_index;
     std::string current_lamp_color;
-    
+    // How long to wait for an "OK" before retrying a command. The binary protocol's is worked out from the baud rate.
+    std::chrono::microseconds ack_timeout = std::chrono::milliseconds(1000);
+    static constexpr int max_attempts = 3;
+
+    // The binary protocol (see exchangeFrames). Up to "window" frames are sent before the first is acknowledged.
+    static constexpr char frame_start = (char)0xa5;
+    static constexpr size_t max_payload = 1024;
+    static constexpr size_t window = 16;
+    uint8_t next_frame_sequence = 0;
+    std::string rx_buffer;
+
+    // One command of a run sent by exchange(), and how it went. "time" is when it was acknowledged, or when it went
+    // out in fire-and-forget mode, and "value" is whatever came after the "OK".
+    struct Exchange {
+        std::string command;
+        bool ok;
+        std::string value;
+        std::chrono::steady_clock::time_point time;
+    };
+
+    // Lamp colour changes are made on their own thread so that the serial round trips never hold up the caller.
+    std::thread io_thread;
+    std::mutex queue_mutex;
+    std::condition_variable queue_cv;
+    std::deque<LampCommand> command_queue;
+    bool io_thread_abort;
+    // Readbacks of an uploaded pattern's progress, taken by the I/O thread whenever it's otherwise idle.
+    std::chrono::milliseconds readback_interval = std::chrono::milliseconds(0);
+    ReadbackCallback readback_callback;
+
     // Send a command string over serial
     bool sendCommand(const std::string& command) {
         if (!tx_serial_open || tx_serial_fd < 0) {
             return false;
         }
-        
+
         std::string formatted_command = "$," + command + "\r\n";
         ssize_t written = write(tx_serial_fd, formatted_command.c_str(), formatted_command.length());
         if (written < 0) {
             return false;
         }
-        
+
         // Flush to ensure data is sent
         tcdrain(tx_serial_fd);
         return true;
     }
 
-    std::string readResponse() {
+    // Throw away anything still sitting in the RX buffer, such as a late "OK" for an attempt we already gave up on.
+    void discardInput() {
         if (!rx_serial_open || rx_serial_fd < 0) {
-            return "";
+            return;
         }
         char buffer[512];
-        ssize_t bytes_read = read(rx_serial_fd, buffer, sizeof(buffer));
-        if (bytes_read < 0) {
-            return "";
+        while (read(rx_serial_fd, buffer, sizeof(buffer)) > 0) {
         }
-        return std::string(buffer, bytes_read);
     }
-    
+
+    // Wait until there's something to read on the RX line, or the deadline passes, then append all of it to
+    // "response".
+    bool readInput(std::chrono::steady_clock::time_point deadline, std::string& response) {
+        if (!rx_serial_open || rx_serial_fd < 0 || rx_epoll_fd < 0) {
+            return false;
+        }
+        while (true) {
+            auto remaining = std::chrono::ceil<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+            if (remaining.count() <= 0) {
+                return false;
+            }
+            struct epoll_event event;
+            int n = epoll_wait(rx_epoll_fd, &event, 1, remaining.count());
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return false;
+            }
+            char buffer[512];
+            ssize_t bytes_read;
+            size_t before = response.size();
+            while ((bytes_read = read(rx_serial_fd, buffer, sizeof(buffer))) > 0) {
+                response.append(buffer, bytes_read);
+            }
+            return response.size() > before || bytes_read == 0 || errno == EAGAIN || errno == EINTR;
+        }
+    }
+
+    // Wait until an "OK" arrives or the deadline passes. If "line" is given, wait for the rest of the line after the
+    // "OK" too, and return it there.
+    bool waitForAck(std::chrono::steady_clock::time_point deadline, std::string* line = nullptr) {
+        std::string response;
+        while (readInput(deadline, response)) {
+            size_t ok = response.find("OK");
+            if (ok != std::string::npos && !line) {
+                return true;
+            }
+            size_t end = ok == std::string::npos ? ok : response.find('\n', ok);
+            if (end != std::string::npos) {
+                *line = response.substr(ok + 2, end - ok - 2);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // CRC-16/CCITT-FALSE.
+    static uint16_t crc16(uint8_t const* data, size_t size) {
+        uint16_t crc = 0xffff;
+        for (size_t i = 0; i < size; i++) {
+            crc ^= data[i] << 8;
+            for (int bit = 0; bit < 8; bit++) {
+                crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+            }
+        }
+        return crc;
+    }
+
+    static std::string frame(uint8_t sequence, std::string const& payload) {
+        std::string bytes = { frame_start, (char)sequence, (char)(payload.size() & 0xff), (char)(payload.size() >> 8) };
+        bytes += payload;
+        uint16_t crc = crc16((uint8_t const*)bytes.data() + 1, bytes.size() - 1);
+        bytes += (char)(crc & 0xff);
+        bytes += (char)(crc >> 8);
+        return bytes;
+    }
+
+    // Take the next good frame out of what has been received, skipping anything that isn't one.
+    bool parseFrame(uint8_t& sequence, std::string& payload) {
+        while (true) {
+            size_t start = rx_buffer.find(frame_start);
+            if (start == std::string::npos) {
+                rx_buffer.clear();
+                return false;
+            }
+            rx_buffer.erase(0, start);
+            if (rx_buffer.size() < 4) {
+                return false;
+            }
+            size_t size = (uint8_t)rx_buffer[2] | (uint8_t)rx_buffer[3] << 8;
+            if (size <= max_payload && rx_buffer.size() < size + 6) {
+                return false;
+            }
+            uint16_t crc = size <= max_payload ? (uint8_t)rx_buffer[size + 4] | (uint8_t)rx_buffer[size + 5] << 8 : 0;
+            if (size > max_payload || crc != crc16((uint8_t const*)rx_buffer.data() + 1, size + 3)) {
+                rx_buffer.erase(0, 1);
+                continue;
+            }
+            sequence = rx_buffer[1];
+            payload = rx_buffer.substr(4, size);
+            rx_buffer.erase(0, size + 6);
+            return true;
+        }
+    }
+
+    // Sequence numbers run 1 to 255, after a 0 to start the count.
+    uint8_t nextFrameSequence() {
+        uint8_t sequence = next_frame_sequence;
+        next_frame_sequence = sequence == 255 ? 1 : sequence + 1;
+        return sequence;
+    }
+
+    bool writeAll(std::string const& bytes) {
+        if (!tx_serial_open || tx_serial_fd < 0) {
+            return false;
+        }
+        for (size_t done = 0; done < bytes.size();) {
+            ssize_t written = write(tx_serial_fd, bytes.data() + done, bytes.size() - done);
+            if (written < 0 && errno != EINTR) {
+                return false;
+            }
+            done += written > 0 ? written : 0;
+        }
+        tcdrain(tx_serial_fd);
+        return true;
+    }
+
+    // The binary protocol (--lamp-protocol binary) frames each command as 0xa5, a sequence number, the payload length
+    // (16 bits, little endian), the payload - the command as it would be sent in ASCII, without the "$," and "\r\n" -
+    // and a CRC-16/CCITT-FALSE of everything after the 0xa5, little endian. The controller runs frames strictly in
+    // sequence: it answers each one it runs with a frame of the same sequence number holding "OK" (or "OK,<value>"
+    // for a query, or anything else if it refused the command), answers a repeat of one of the last "window" it ran
+    // without running it again, drops unanswered any other that isn't the next it expects, and always runs sequence
+    // number 0, counting on from there. So a whole run of commands goes out without waiting, up to "window" at a
+    // time, and an answer to one stands for everything before it; anything unanswered is sent again from the first
+    // such command. One that fails every attempt is given up on, and the count starts again from a 0 sent on its
+    // own, so that nothing after it can be taken for a repeat. Fire-and-forget frames are all sent as 0.
+    void exchangeFrames(std::vector<Exchange>& commands) {
+        if (fire_and_forget) {
+            std::string bytes;
+            for (auto const& command : commands) {
+                bytes += frame(0, command.command);
+            }
+            writeAll(bytes);
+            for (auto& command : commands) {
+                command.ok = true;
+                command.time = std::chrono::steady_clock::now();
+            }
+            return;
+        }
+        discardInput();
+        rx_buffer.clear();
+        std::vector<uint8_t> sequences(commands.size());
+        // The first command not yet answered, the first not yet sent, and the first with no sequence number yet.
+        size_t base = 0, next = 0, numbered = 0;
+        int attempts = 0;
+        auto deadline = std::chrono::steady_clock::now();
+        while (base < commands.size()) {
+            auto limit = [&] { return next > base && sequences[base] == 0 ? 1 : window; };
+            if (next < commands.size() && next - base < limit()) {
+                std::string bytes;
+                for (; next < commands.size() && next - base < limit(); next++) {
+                    if (next == numbered) {
+                        sequences[numbered++] = nextFrameSequence();
+                    }
+                    bytes += frame(sequences[next], commands[next].command);
+                }
+                writeAll(bytes);
+                deadline = std::chrono::steady_clock::now() + ack_timeout;
+                continue;
+            }
+            uint8_t sequence;
+            std::string payload;
+            bool answered = parseFrame(sequence, payload);
+            while (!answered && readInput(deadline, rx_buffer)) {
+                answered = parseFrame(sequence, payload);
+            }
+            if (answered) {
+                size_t i = base;
+                while (i < next && sequences[i] != sequence) {
+                    i++;
+                }
+                if (i == next) {
+                    continue;
+                }
+                auto now = std::chrono::steady_clock::now();
+                for (; base <= i; base++) {
+                    commands[base].ok = true;
+                    commands[base].time = now;
+                }
+                if (payload.compare(0, 2, "OK") == 0) {
+                    commands[i].value = payload.substr(2);
+                } else {
+                    commands[i].ok = false;
+                }
+                attempts = 0;
+                deadline = now + ack_timeout;
+                continue;
+            }
+            if (++attempts == max_attempts) {
+                commands[base].ok = false;
+                commands[base].time = std::chrono::steady_clock::now();
+                base++;
+                attempts = 0;
+                numbered = base;
+                next_frame_sequence = 0;
+            }
+            next = base;
+        }
+    }
+
+    // Send a run of commands in order and, unless we're in fire-and-forget mode, wait for each to be acknowledged,
+    // retrying a few times. With the ASCII protocol each command waits for the last; "want_value" says to wait for
+    // the rest of the line after each "OK" too.
+    void exchange(std::vector<Exchange>& commands, bool want_value = false) {
+        if (binary_protocol) {
+            exchangeFrames(commands);
+            return;
+        }
+        for (auto& command : commands) {
+            command.ok = fire_and_forget;
+            if (fire_and_forget) {
+                sendCommand(command.command);
+            }
+            for (int attempt = 0; attempt < max_attempts && !command.ok; attempt++) {
+                discardInput();
+                sendCommand(command.command);
+                command.ok = waitForAck(std::chrono::steady_clock::now() + ack_timeout,
+                                        want_value ? &command.value : nullptr);
+            }
+            command.time = std::chrono::steady_clock::now();
+        }
+    }
+
+    bool transact(const std::string& command) {
+        std::vector<Exchange> commands = { { command, false, "", {} } };
+        exchange(commands);
+        return commands[0].ok;
+    }
+
+    // Send a command that is answered with "OK" and a value, and return the value. There's no fire-and-forget for
+    // these.
+    bool query(const std::string& command, std::string& value) {
+        if (!rx_serial_open) {
+            return false;
+        }
+        std::vector<Exchange> commands = { { command, false, "", {} } };
+        exchange(commands, true);
+        value = commands[0].value;
+        return commands[0].ok;
+    }
+
     // Initialize serial port
     bool initSerial(const std::string& device, speed_t baud_rate = B115200, bool is_tx = true) {
         // Open the serial port
@@ -62,13 +380,14 @@ private:
             }
             current_serial_fd = tx_serial_fd;
         } else {
-            rx_serial_fd = open(device.c_str(), O_RDWR | O_NOCTTY);
+            // Responses are waited for with epoll, so reads never need to block.
+            rx_serial_fd = open(device.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
             if (rx_serial_fd < 0) {
                 return false;
             }
             current_serial_fd = rx_serial_fd;
         }
-        
+
         // Configure termios structure
         struct termios tty;
         if (tcgetattr(current_serial_fd, &tty) != 0) {
@@ -80,11 +399,11 @@ private:
             }
             return false;
         }
-        
+
         // Set baud rate
         cfsetospeed(&tty, baud_rate);
         cfsetispeed(&tty, baud_rate);
-        
+
         // 8N1: 8 data bits, no parity, 1 stop bit
         tty.c_cflag &= ~PARENB;         // No parity
         tty.c_cflag &= ~CSTOPB;         // 1 stop bit
@@ -92,20 +411,20 @@ private:
         tty.c_cflag |= CS8;              // 8 data bits
         tty.c_cflag &= ~CRTSCTS;         // No hardware flow control
         tty.c_cflag |= CREAD | CLOCAL;   // Enable receiver, ignore modem controls
-        
+
         // Input flags
         tty.c_iflag &= ~(IXON | IXOFF | IXANY); // Disable software flow control
         tty.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL);
-        
+
         // Output flags
         tty.c_oflag &= ~OPOST;          // Raw output
-        
+
         // Local flags
         tty.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN); // Raw mode
-        
+
         // Control characters
         tty.c_cc[VMIN] = 0;              // Non-blocking read
-        tty.c_cc[VTIME] = 10;         // 1 second timeout
+        tty.c_cc[VTIME] = 0;             // The ACK timeout is handled by waitForAck
 
         // Apply settings
         if (tcsetattr(current_serial_fd, TCSANOW, &tty) != 0) {
@@ -117,13 +436,26 @@ private:
             }
             return false;
         }
-        
+
         // Flush any existing data
         tcflush(current_serial_fd, TCIOFLUSH);
-        
+
         if (is_tx) {
             tx_serial_open = true;
         } else {
+            rx_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+            struct epoll_event event = {};
+            event.events = EPOLLIN;
+            event.data.fd = rx_serial_fd;
+            if (rx_epoll_fd < 0 || epoll_ctl(rx_epoll_fd, EPOLL_CTL_ADD, rx_serial_fd, &event) != 0) {
+                if (rx_epoll_fd >= 0) {
+                    close(rx_epoll_fd);
+                    rx_epoll_fd = -1;
+                }
+                close(rx_serial_fd);
+                rx_serial_fd = -1;
+                return false;
+            }
             rx_serial_open = true;
         }
         return true;
@@ -133,224 +465,335 @@ private:
         if (channel > 3) {
             return false;
         }
-        bool success = false;
-        int retries = 0;
-        std::string command = "l," + std::to_string(channel) + "," + std::to_string(brightness) + ',';
-        if (fire_and_forget) {
-            sendCommand(command);
-            return true;
-        }
-        while (!success && retries < 3) {
-            sendCommand(command);
-            std::string response = readResponse();
-            if (response.find("OK") != std::string::npos) {
-                success = true;
-            } else {
-                success = false;
-            }
-            retries++;
-        }
-        return success;
+        return transact("l," + std::to_string(channel) + "," + std::to_string(brightness) + ',');
     }
 
-    bool setActiveChannels(std::string active_channels) {
-        bool success = false;
-        int retries = 0;
-        std::string command = "r," + active_channels;
-        if (fire_and_forget) {
-            sendCommand(command);
-            return true;
-        }
-        while (!success && retries < 3) {
-            sendCommand(command);
-            std::string response = readResponse();
-            if (response.find("OK") != std::string::npos) {
-                success = true;
-            } else {
-                success = false;
+    bool turnOffLamp() {
+        return transact("off,");
+    }
+
+    bool disableIlluminationTrigger() {
+        return transact("t,0,");
+    }
+
+    bool enableIlluminationTrigger() {
+        return transact("t,1,");
+    }
+
+    // The uploaded pattern protocol. "p,<steps>,<mask>,...," loads a pattern, each step a mask of the channels it
+    // lights (bit 0 red, 1 green, 2 blue). "a,1," arms the controller: it lights the first step, moves on a step at
+    // every illumination trigger edge, and counts the edges from zero; "a,0," stops it. "i," is answered
+    // "OK,<edges>".
+    bool armPattern(bool arm) {
+        return transact(arm ? "a,1," : "a,0,");
+    }
+
+    void readback(ReadbackCallback const& callback) {
+        TRACE_SCOPE("lamp_readback");
+        auto sent = std::chrono::steady_clock::now();
+        std::string value;
+        LampReadback reading = { 0, query("i,", value), sent, std::chrono::steady_clock::now() };
+        if (reading.ok) {
+            try {
+                reading.edges = std::stoull(value.substr(value.find_first_not_of(", ")));
+            } catch (std::exception const&) {
+                reading.ok = false;
             }
-            retries++;
         }
-        return success;
+        callback(reading);
     }
 
-    bool turnOffLamp() {
-        bool success = false;
-        int retries = 0;
-        std::string command = "off,";
-        if (fire_and_forget) {
-            sendCommand(command);
-            return true;
+    // The channels a colour of the pattern lights, as a list for the "r" command and as an upload mask.
+    static std::string activeChannels(std::string const& color, unsigned int* mask = nullptr) {
+        static const char* channel_names[] = { "0,", "1,", "2," };
+        unsigned int channels = 0;
+        for (char letter : color) {
+            if (letter == 'R' || letter == 'r') {
+                channels |= 1;
+            } else if (letter == 'G' || letter == 'g') {
+                channels |= 2;
+            } else if (letter == 'B' || letter == 'b') {
+                channels |= 4;
+            } else if (letter == 'W' || letter == 'w') {
+                channels |= 7;
+            }
+        }
+        if (!channels) {
+            channels = 1;
         }
-        while (!success && retries < 3) {
-            sendCommand(command);
-            std::string response = readResponse();
-            if (response.find("OK") != std::string::npos) {
-                success = true;
+        if (mask) {
+            *mask = channels;
+        }
+        std::string active_channels;
+        for (unsigned int i = 0; i < 3; i++) {
+            if (channels & (1 << i)) {
+                active_channels += channel_names[i];
             }
-            retries++;
         }
-        return success;
+        return active_channels;
     }
 
-    bool turnOnLamp() {
-        bool success = false;
-        int retries = 0;
-        std::string command = "on,";
-        if (fire_and_forget) {
-            sendCommand(command);
-            return true;
+    // The commands a queued change is made with.
+    std::vector<std::string> commandsFor(LampCommand const& command) const {
+        if (!command.upload.empty()) {
+            return { "a,0,", command.upload, "a,1," };
         }
-        while (!success && retries < 3) {
-            sendCommand(command);
-            std::string response = readResponse();
-            if (response.find("OK") != std::string::npos) {
-                success = true;
-            }
-            retries++;
+        std::vector<std::string> commands = { "r," + command.active_channels };
+        if (illumination_trigger_disabled) {
+            // sending a 'on' command will update the LED channels to match the set active channels
+            commands.push_back("on,");
         }
-        return success;
+        return commands;
     }
 
-    bool disableIlluminationTrigger() {
-        bool success = false;
-        int retries = 0;
-        std::string command = "t,0,";
-        if (fire_and_forget) {
-            sendCommand(command);
-            return true;
-        }
-        while (!success && retries < 3) {
-            sendCommand(command);
-            std::string response = readResponse();
-            if (response.find("OK") != std::string::npos) {
-                success = true;
+    void ioThread() {
+        auto next_readback = std::chrono::steady_clock::now();
+        while (true) {
+            std::deque<LampCommand> batch;
+            {
+                std::unique_lock<std::mutex> lock(queue_mutex);
+                auto ready = [this] { return io_thread_abort || !command_queue.empty(); };
+                if (readback_callback) {
+                    queue_cv.wait_until(lock, next_readback, ready);
+                } else {
+                    queue_cv.wait(lock, ready);
+                }
+                if (command_queue.empty() && io_thread_abort) {
+                    return;
+                }
+                if (command_queue.empty()) {
+                    ReadbackCallback callback = readback_callback;
+                    lock.unlock();
+                    readback(callback);
+                    next_readback = std::chrono::steady_clock::now() + readback_interval;
+                    continue;
+                }
+                batch.swap(command_queue);
+            }
+
+            // Everything queued goes out as one run, so that the binary protocol can pipeline it.
+            auto sent = std::chrono::steady_clock::now();
+            std::vector<Exchange> commands;
+            std::vector<size_t> ends;
+            for (auto const& command : batch) {
+                for (auto& text : commandsFor(command)) {
+                    commands.push_back({ std::move(text), false, "", {} });
+                }
+                ends.push_back(commands.size());
+            }
+            {
+                TRACE_SCOPE("lamp_commands", { "commands", commands.size() }, { "sequence", batch.front().sequence });
+                exchange(commands);
+            }
+
+            size_t begin = 0;
+            for (size_t i = 0; i < batch.size(); begin = ends[i++]) {
+                LampCommand& command = batch[i];
+                bool ok = true;
+                for (size_t j = begin; j < ends[i]; j++) {
+                    ok = ok && commands[j].ok;
+                }
+                if (!command.upload.empty()) {
+                    // Read the new pattern's progress back straight away, so that frames can be tagged from it soon.
+                    next_readback = std::chrono::steady_clock::now();
+                }
+                LampAck ack = { command.sequence, command.color, ok, sent, commands[ends[i] - 1].time };
+                if (command.callback) {
+                    command.callback(ack);
+                }
+                command.promise.set_value(ack);
             }
-            retries++;
         }
-        return success;
     }
 
-    bool enableIlluminationTrigger() {
-        bool success = false;
-        int retries = 0;
-        std::string command = "t,1,";
-        if (fire_and_forget) {
-            sendCommand(command);
-            return true;
+    // Parse lamp_pattern into a vector of strings, delimited by ','
+    void parseLampPattern(std::string const& lamp_pattern) {
+        lamp_pattern_vec.clear();
+        size_t start = 0, end = 0;
+        while ((end = lamp_pattern.find(',', start)) != std::string::npos) {
+            lamp_pattern_vec.push_back(lamp_pattern.substr(start, end - start));
+            start = end + 1;
         }
-        while (!success && retries < 3) {
-            sendCommand(command);
-            std::string response = readResponse();
-            if (response.find("OK") != std::string::npos) {
-                success = true;
+        lamp_pattern_vec.push_back(lamp_pattern.substr(start));
+        lamp_pattern_index = 0;
+        current_lamp_color = lamp_pattern_vec[lamp_pattern_index];
+    }
+
+public:
+    // The termios speed for a baud rate, or B0 if there isn't one.
+    static speed_t baudRate(unsigned int baud) {
+        static const std::pair<unsigned int, speed_t> rates[] = {
+            { 9600, B9600 }, { 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 }, { 115200, B115200 },
+            { 230400, B230400 }, { 460800, B460800 }, { 500000, B500000 }, { 576000, B576000 }, { 921600, B921600 },
+            { 1000000, B1000000 }, { 1152000, B1152000 }, { 1500000, B1500000 }, { 2000000, B2000000 },
+            { 2500000, B2500000 }, { 3000000, B3000000 }, { 3500000, B3500000 }, { 4000000, B4000000 },
+        };
+        for (auto const& rate : rates) {
+            if (rate.first == baud) {
+                return rate.second;
             }
-            retries++;
         }
-        return success;
+        return B0;
     }
 
-public:
-    GpioHandler(std::string lamp_pattern = "R", unsigned int r_brightness = 100, unsigned int g_brightness = 100, unsigned int b_brightness = 100, bool disable_illumination_trigger = false, bool should_fire_and_forget = false, speed_t baud_rate = B9600) {
+    GpioHandler(std::string lamp_pattern = "R", unsigned int r_brightness = 100, unsigned int g_brightness = 100, unsigned int b_brightness = 100, bool disable_illumination_trigger = false, bool should_fire_and_forget = false, unsigned int baud = 9600, bool use_binary_protocol = false) {
         tx_serial_fd = -1;
         rx_serial_fd = -1;
+        rx_epoll_fd = -1;
         tx_serial_open = false;
         rx_serial_open = false;
+        io_thread_abort = false;
         red_brightness = r_brightness;
         green_brightness = g_brightness;
         blue_brightness = b_brightness;
         illumination_trigger_disabled = disable_illumination_trigger;
         fire_and_forget = should_fire_and_forget;
-        // Initialize serial port
-        if (!initSerial(tx_serial_device, baud_rate, true)) {
-            // Failed to open serial port
-            return;
+        binary_protocol = use_binary_protocol;
+        if (binary_protocol) {
+            // Time for the controller to turn a command round, and for a good few bytes of answer to come back.
+            ack_timeout = std::chrono::milliseconds(10) + std::chrono::microseconds(640000000ULL / baud);
         }
-        if (!fire_and_forget) {
-            if (!initSerial(rx_serial_device, baud_rate, false)) {
-                // Failed to open serial port
-                fire_and_forget = true;
+
+        parseLampPattern(lamp_pattern);
+
+        // Initialize serial port
+        speed_t baud_rate = baudRate(baud);
+        if (baud_rate == B0) {
+            std::cerr << "GpioHandler: unsupported baud rate " << baud << std::endl;
+        } else if (initSerial(tx_serial_device, baud_rate, true)) {
+            if (!fire_and_forget) {
+                if (!initSerial(rx_serial_device, baud_rate, false)) {
+                    // Failed to open serial port
+                    fire_and_forget = true;
+                }
             }
-        }
 
-        setChannelBrightness(0, red_brightness);
-        setChannelBrightness(1, green_brightness);
-        setChannelBrightness(2, blue_brightness);
-        turnOffLamp();
-        if (illumination_trigger_disabled) {
-            disableIlluminationTrigger();
-        } else {
-            enableIlluminationTrigger();
+            setChannelBrightness(0, red_brightness);
+            setChannelBrightness(1, green_brightness);
+            setChannelBrightness(2, blue_brightness);
+            turnOffLamp();
+            if (illumination_trigger_disabled) {
+                disableIlluminationTrigger();
+            } else {
+                enableIlluminationTrigger();
+            }
         }
 
-        // Parse lamp_pattern into a vector of strings, delimited by ','
-        size_t start = 0, end = 0;
-        while ((end = lamp_pattern.find(',', start)) != std::string::npos) {
-            lamp_pattern_vec.push_back(lamp_pattern.substr(start, end - start));
-            start = end + 1;
-        }
-        lamp_pattern_vec.push_back(lamp_pattern.substr(start));
-        lamp_pattern_index = 0;
-        current_lamp_color = lamp_pattern_vec[lamp_pattern_index];
+        io_thread = std::thread(&GpioHandler::ioThread, this);
     }
 
     ~GpioHandler() {
         closeGpio();
     }
 
+    // Switch to a new pattern. The next queueNextLampColor() starts it from its first colour.
+    void setLampPattern(std::string const& lamp_pattern) {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        parseLampPattern(lamp_pattern);
+    }
+
     std::string getCurrentLampColor() {
+        std::lock_guard<std::mutex> lock(queue_mutex);
         return current_lamp_color;
     }
 
-    void setNextLampColor() {
-        bool wasColorSet = false;
+    std::vector<std::string> getLampPattern() {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        return lamp_pattern_vec;
+    }
+
+    // Upload the whole pattern to the controller, to step through by itself from its first colour at each
+    // illumination trigger edge (--lamp-upload), so that nothing need be sent per frame. Returns straight away.
+    std::future<LampAck> queueUploadLampPattern(LampCallback callback = nullptr) {
+        LampCommand command;
+        command.sequence = 0;
+        command.callback = std::move(callback);
+        std::future<LampAck> future = command.promise.get_future();
+
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        command.upload = "p," + std::to_string(lamp_pattern_vec.size()) + ",";
+        for (auto const& color : lamp_pattern_vec) {
+            unsigned int mask;
+            activeChannels(color, &mask);
+            command.upload += std::to_string(mask) + ",";
+        }
+        command.color = lamp_pattern_vec[0];
+        current_lamp_color = lamp_pattern_vec[0];
+        lamp_pattern_index = 0;
+
+        command_queue.push_back(std::move(command));
+        queue_cv.notify_one();
+        return future;
+    }
+
+    // Read an uploaded pattern's progress back every "interval", while there's nothing else to send, passing each
+    // reading to "callback" on the I/O thread. Needs the RX line, so nothing is read back in fire-and-forget mode.
+    void startReadback(std::chrono::milliseconds interval, ReadbackCallback callback) {
+        if (!rx_serial_open) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        readback_interval = interval;
+        readback_callback = std::move(callback);
+        queue_cv.notify_one();
+    }
+
+    // Queue a change to the next colour in the pattern and return straight away. "sequence" is passed back in the
+    // LampAck to say which frame the change was made for.
+    std::future<LampAck> queueNextLampColor(uint64_t sequence = 0, LampCallback callback = nullptr) {
+        LampCommand command;
+        command.sequence = sequence;
+        command.callback = std::move(callback);
+        std::future<LampAck> future = command.promise.get_future();
+
+        std::lock_guard<std::mutex> lock(queue_mutex);
         if (lamp_pattern_index == lamp_pattern_vec.size()) {
             lamp_pattern_index = 0;
         }
-        std::string active_channels = "";
         current_lamp_color = lamp_pattern_vec[lamp_pattern_index];
-        for (unsigned int i = 0; i < current_lamp_color.size(); i++) {
-            char letter = current_lamp_color[i];
-            if (letter == 'R' || letter == 'r') {
-                active_channels += "0,";
-                wasColorSet = true;
-            } else if (letter == 'G' || letter == 'g') {
-                active_channels += "1,";
-                wasColorSet = true;
-            } else if (letter == 'B' || letter == 'b') {
-                active_channels += "2,";
-                wasColorSet = true;
-            } else if (letter == 'W' || letter == 'w') {
-                active_channels += "0,1,2,";
-                wasColorSet = true;
-            }
-        }
-        if (!wasColorSet) {
-            active_channels += "0,";
-        }
-        setActiveChannels(active_channels);
-        if (illumination_trigger_disabled) {
-            // sending a 'on' command will update the LED channels to match the set active channels
-            turnOnLamp();
-        }
-        
+        command.color = current_lamp_color;
+        command.active_channels = activeChannels(current_lamp_color);
         lamp_pattern_index++;
+
+        command_queue.push_back(std::move(command));
+        queue_cv.notify_one();
+        return future;
+    }
+
+    // As queueNextLampColor, but wait for the change to complete.
+    void setNextLampColor() {
+        queueNextLampColor().wait();
     }
-    
+
     void closeGpio() {
+        // Let any queued colour changes finish first
+        if (io_thread.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(queue_mutex);
+                io_thread_abort = true;
+            }
+            queue_cv.notify_one();
+            io_thread.join();
+        }
+
         // Turn off all colors before closing
+        if (readback_callback) {
+            armPattern(false);
+        }
         turnOffLamp();
         disableIlluminationTrigger();
-        
+
         if (tx_serial_open && tx_serial_fd >= 0) {
             close(tx_serial_fd);
             tx_serial_fd = -1;
             tx_serial_open = false;
         }
         if (rx_serial_open && rx_serial_fd >= 0) {
+            close(rx_epoll_fd);
+            rx_epoll_fd = -1;
             close(rx_serial_fd);
             rx_serial_fd = -1;
             rx_serial_open = false;
         }
     }
-};
\ No newline at end of file
+};
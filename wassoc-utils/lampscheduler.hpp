@@ -0,0 +1,160 @@
+#pragma once
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "gpiohandler.hpp"
+
+// Works out which lamp colour each frame was exposed under. The lamp I/O thread reports when every colour change
+// was sent and acknowledged (on the steady clock, which is CLOCK_MONOTONIC like the sensor timestamps), and frames
+// are then matched against those times rather than against whatever colour happens to be current when the frame is
+// dequeued.
+class LampScheduler {
+public:
+    struct Attribution {
+        std::string color;
+        // The lamp was changing, or a change went unacknowledged, while the frame was being exposed.
+        bool mixed;
+    };
+
+    // Call just before queueing a colour change, so that frames dequeued while it is still in flight aren't
+    // attributed as though it had never been asked for.
+    void onQueued() {
+        std::lock_guard<std::mutex> lock(mutex);
+        transitions.push_back({ "", toNs(std::chrono::steady_clock::now()), pending, true });
+    }
+
+    // Record a completed colour change. Changes complete in the order they were queued. Safe to call from the lamp
+    // I/O thread.
+    void onAck(GpioHandler::LampAck const& ack) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto& t : transitions) {
+            if (t.acked_ns == pending) {
+                t = { ack.color, toNs(ack.sent), toNs(ack.time), ack.ok };
+                return;
+            }
+        }
+    }
+
+    // Attribute a frame whose exposure ran from start_ns to end_ns. Frames must be passed in order.
+    Attribution attribute(int64_t start_ns, int64_t end_ns) {
+        std::lock_guard<std::mutex> lock(mutex);
+        // Transitions finished before this frame started only matter for the colour they leave behind.
+        while (transitions.size() > 1 && transitions[1].acked_ns <= start_ns) {
+            transitions.pop_front();
+        }
+
+        Attribution attribution = { "Unknown", false };
+        for (auto const& t : transitions) {
+            if (t.acked_ns <= start_ns) {
+                attribution.color = t.color;
+                attribution.mixed = !t.ok;
+            } else if (t.sent_ns < end_ns) {
+                attribution.mixed = true;
+            }
+        }
+        return attribution;
+    }
+
+private:
+    struct Transition {
+        std::string color;
+        int64_t sent_ns;
+        int64_t acked_ns;
+        bool ok;
+    };
+
+    static constexpr int64_t pending = INT64_MAX;
+
+    static int64_t toNs(std::chrono::steady_clock::time_point t) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+    }
+
+    std::mutex mutex;
+    std::deque<Transition> transitions;
+};
+
+// Works out which lamp colour each frame was exposed under when the controller steps through an uploaded pattern by
+// itself (--lamp-upload), one step per illumination trigger edge and so one per frame. A frame's step then follows
+// from its sequence number, once we know which sequence number the controller's count of edges lines up with. Armed
+// before the camera starts, the first frame is the first step; otherwise, and to catch any edges missed or extra,
+// the count is read back every so often and tied to a frame through the timing of the frames.
+class LampStepTracker {
+public:
+    // Start over with a pattern the controller acknowledged at "armed", from the upload's callback so that no
+    // readback can come in between. "synced" says the first frame from here is its first step.
+    void reset(std::vector<std::string> const& new_pattern, bool synced, std::chrono::steady_clock::time_point armed) {
+        std::lock_guard<std::mutex> lock(mutex);
+        pattern = new_pattern;
+        offset = synced ? std::optional<int64_t>(0) : std::nullopt;
+        readings.clear();
+        reset_ns = toNs(armed);
+    }
+
+    // Record a readback of the controller's count. Safe to call from the lamp I/O thread.
+    void onReadback(GpioHandler::LampReadback const& reading) {
+        std::lock_guard<std::mutex> lock(mutex);
+        // Readings from before the pattern we have now count the wrong pattern's steps.
+        if (!reading.ok || toNs(reading.sent) < reset_ns) {
+            return;
+        }
+        readings.push_back({ reading.edges, (toNs(reading.sent) + toNs(reading.time)) / 2 });
+    }
+
+    // The colour of frame "sequence", which started at start_ns with frames every frame_ns, or "Unknown" until the
+    // count has been read back after a pattern was uploaded while the camera was running.
+    std::string attribute(uint64_t sequence, int64_t start_ns, int64_t frame_ns) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (Reading const& r : readings) {
+            // The last frame to start by the time of the reading was the one that made its last edge. Readings that
+            // come too close to a frame starting, or too far from this one, can't be pinned to a frame.
+            if (!frame_ns || std::abs(r.time_ns - start_ns) > max_reading_age_ns || !r.edges) {
+                continue;
+            }
+            double frames = (double)(r.time_ns - start_ns) / frame_ns;
+            double whole = std::floor(frames);
+            if (frames - whole < 0.15 || frames - whole > 0.85) {
+                continue;
+            }
+            int64_t measured = (int64_t)r.edges - 1 - ((int64_t)sequence + (int64_t)whole);
+            if (offset && *offset != measured) {
+                std::cerr << "LampStepTracker: lamp controller " << measured - *offset
+                          << " steps out from the frames, resyncing" << std::endl;
+            }
+            offset = measured;
+        }
+        readings.clear();
+
+        if (!offset || pattern.empty()) {
+            return "Unknown";
+        }
+        int64_t n = pattern.size();
+        return pattern[(((int64_t)sequence + *offset) % n + n) % n];
+    }
+
+private:
+    struct Reading {
+        uint64_t edges;
+        int64_t time_ns;
+    };
+
+    static constexpr int64_t max_reading_age_ns = 2000000000;
+
+    static int64_t toNs(std::chrono::steady_clock::time_point t) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+    }
+
+    std::mutex mutex;
+    std::vector<std::string> pattern;
+    // Add to a frame's sequence number to get the controller's step for it, modulo the pattern length.
+    std::optional<int64_t> offset;
+    std::deque<Reading> readings;
+    int64_t reset_ns = 0;
+};
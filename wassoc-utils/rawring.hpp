@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstring>
+#include <deque>
+#include <iostream>
+
+#include <libcamera/controls.h>
+
+#include "core/metadata.hpp"
+#include "core/stream_info.hpp"
+#include "encoder/staging_pool.hpp"
+#include "output/output.hpp"
+
+// The last few raw frames, copied out of the camera's buffers so that those go straight back to the camera, for
+// --raw-ring. Nothing is encoded until something triggers a save, when the whole ring is taken out and encoded
+// oldest first. The copies live in a fixed set of buffers, mapped when the first frame arrives; a buffer is only
+// reused once the frame in it has been forgotten, or encoded and handed back.
+class RawRing {
+public:
+    struct Frame {
+        void* mem;
+        size_t size;
+        StreamInfo info;
+        int64_t timestamp_us;
+        Metadata post_process_metadata;
+        libcamera::ControlList metadata;
+        OutputFrameInfo frame_info;
+    };
+
+    explicit RawRing(unsigned int frames) : pool(frames) {}
+
+    // Copy a frame in, forgetting the oldest if there's no room. Returns false, keeping nothing, if every buffer is
+    // still being encoded from the last save.
+    bool push(void const* src, Frame frame) {
+        if (!reserved) {
+            pool.Reserve(frame.size);
+            reserved = true;
+        }
+        frame.mem = pool.Acquire(frame.size);
+        if (!frame.mem && !frames.empty()) {
+            pool.Release(frames.front().mem);
+            frames.pop_front();
+            frame.mem = pool.Acquire(frame.size);
+        }
+        if (!frame.mem) {
+            lost++;
+            return false;
+        }
+        memcpy(frame.mem, src, frame.size);
+        frames.push_back(std::move(frame));
+        return true;
+    }
+
+    // Everything in the ring, oldest first, leaving it empty. Each frame's buffer must come back through release().
+    std::deque<Frame> take() {
+        std::deque<Frame> taken;
+        taken.swap(frames);
+        return taken;
+    }
+
+    // Hand back the buffer of a frame that was taken. Safe to call from any thread.
+    void release(void* mem) { pool.Release(mem); }
+
+    size_t size() const { return frames.size(); }
+    // Frames that couldn't be kept because the last save was still being encoded.
+    uint64_t framesLost() const { return lost; }
+
+private:
+    StagingPool pool;
+    bool reserved = false;
+    std::deque<Frame> frames;
+    uint64_t lost = 0;
+};
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <sys/stat.h>
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// The capture settings rpicam-raw lets you change while it runs, over its control socket, without restarting the
+// camera. A change is made by copying the current snapshot, applying and checking every new value, and swapping the
+// finished snapshot in, so anything reading the settings sees either the whole of a change or none of it. Readers
+// take one snapshot per frame, so that each frame is handled under one consistent set of them.
+struct RuntimeSettings {
+    std::string lamp_pattern;
+    unsigned int every_nth_frame = 1;
+    float capture_interval = 0;
+    unsigned int png_compression_level = 1;
+    std::string parent_directory;
+
+    // Set one value from its text, returning what was wrong with it, or "" if nothing.
+    std::string set(std::string const& key, std::string const& value) {
+        try {
+            size_t end = 0;
+            if (key == "pattern") {
+                if (value.empty() || value.front() == ',' || value.back() == ',' ||
+                    value.find(",,") != std::string::npos) {
+                    return "bad lamp pattern " + value;
+                }
+                lamp_pattern = value;
+            } else if (key == "every_nth_frame") {
+                unsigned long n = std::stoul(value, &end);
+                if (end != value.size() || n < 1) {
+                    return "bad every_nth_frame " + value;
+                }
+                every_nth_frame = n;
+            } else if (key == "capture_interval") {
+                float interval = std::stof(value, &end);
+                if (end != value.size() || interval < 0) {
+                    return "bad capture_interval " + value;
+                }
+                capture_interval = interval;
+            } else if (key == "png_level") {
+                unsigned long level = std::stoul(value, &end);
+                if (end != value.size() || level > 9) {
+                    return "bad png_level " + value + " (0 to 9)";
+                }
+                png_compression_level = level;
+            } else if (key == "dir") {
+                struct stat st;
+                if (stat(value.c_str(), &st) || !S_ISDIR(st.st_mode)) {
+                    return "no such directory " + value;
+                }
+                parent_directory = value;
+            } else {
+                return "unknown setting " + key;
+            }
+        } catch (std::exception const&) {
+            return "bad " + key + " " + value;
+        }
+        return "";
+    }
+
+    std::string toString() const {
+        std::ostringstream text;
+        text << "pattern=" << lamp_pattern << " every_nth_frame=" << every_nth_frame << " capture_interval="
+             << capture_interval << " png_level=" << png_compression_level << " dir=" << parent_directory;
+        return text.str();
+    }
+};
+
+class RuntimeSettingsStore {
+public:
+    // check, if given, can turn down a snapshot that is fine in itself but that the application can't use, by
+    // returning the reason.
+    using Check = std::function<std::string(RuntimeSettings const&, RuntimeSettings const&)>;
+
+    explicit RuntimeSettingsStore(RuntimeSettings const& initial, Check check = nullptr)
+        : current(std::make_shared<RuntimeSettings const>(initial)), check(std::move(check)) {}
+
+    std::shared_ptr<RuntimeSettings const> get() const { return std::atomic_load(&current); }
+
+    // Goes up by one with every change, so that a reader can tell cheaply whether to take a new snapshot.
+    uint64_t generation() const { return changes.load(std::memory_order_acquire); }
+
+    // Make all of the changes, or, returning the reason, none of them.
+    std::string update(std::vector<std::pair<std::string, std::string>> const& values) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::shared_ptr<RuntimeSettings const> old = get();
+        RuntimeSettings next = *old;
+        for (auto const& [key, value] : values) {
+            std::string error = next.set(key, value);
+            if (!error.empty()) {
+                return error;
+            }
+        }
+        if (check) {
+            std::string error = check(*old, next);
+            if (!error.empty()) {
+                return error;
+            }
+        }
+        std::atomic_store(&current, std::make_shared<RuntimeSettings const>(next));
+        changes.fetch_add(1, std::memory_order_release);
+        return "";
+    }
+
+    // Start again from these, unchecked.
+    void reset(RuntimeSettings const& settings) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::atomic_store(&current, std::make_shared<RuntimeSettings const>(settings));
+        changes.fetch_add(1, std::memory_order_release);
+    }
+
+private:
+    std::shared_ptr<RuntimeSettings const> current;
+    Check check;
+    std::mutex mutex;
+    std::atomic<uint64_t> changes = 0;
+};
@@ -0,0 +1,211 @@
+#pragma once
+
+#include <sys/statvfs.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+
+// Watches the free space on the output filesystem so that a long unattended capture doesn't run the card out of
+// space and die mid-write. A thread of its own checks statvfs every few seconds and, once free space drops below
+// the minimum, applies the chosen policy:
+//   decimate - double the frame decimation at each check while short of space, stopping if things get twice as bad,
+//   ring     - delete the oldest output directories until there is room again,
+//   stop     - ask the capture loop to finish cleanly.
+// Checks also report how fast space is being used against how fast it can be used and still last out: until the end
+// of the run if we know when that is, otherwise we say how long is left at the current rate. So as not to fill the log
+// of a long run, that's only when the outlook changes: when the rate goes over or back under what's sustainable, or,
+// with no end time, when free space goes under or back over the minimum.
+class StorageGovernor {
+public:
+    enum class Policy { Decimate, Ring, Stop };
+
+    StorageGovernor(std::string const& parent_directory, std::string const& output_directory, Policy policy,
+                    uint64_t min_free_bytes, std::chrono::seconds interval, unsigned int keep_newest = 1,
+                    std::chrono::steady_clock::time_point end_time = std::chrono::steady_clock::time_point::max())
+        : parent_directory(parent_directory), directory_prefix(output_directory.substr(0, output_directory.find('%'))),
+          policy(policy), min_free_bytes(min_free_bytes), interval(interval), keep_newest(keep_newest),
+          end_time(end_time) {
+        worker = std::thread(&StorageGovernor::run, this);
+    }
+
+    ~StorageGovernor() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            abort = true;
+        }
+        cond.notify_one();
+        worker.join();
+    }
+
+    // Multiply the frame decimation by this.
+    unsigned int decimation() const { return decimation_factor; }
+    // The capture loop should finish up.
+    bool shouldStop() const { return stop_requested; }
+
+private:
+    static constexpr unsigned int max_decimation = 1024;
+    // Take ring deletion this far past the minimum, so we aren't deleting a directory at every check.
+    static constexpr uint64_t ring_headroom_percent = 10;
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!abort) {
+            lock.unlock();
+            check();
+            lock.lock();
+            cond.wait_for(lock, interval, [this] { return abort; });
+        }
+    }
+
+    bool freeSpace(uint64_t& free_bytes) {
+        struct statvfs st;
+        if (statvfs(parent_directory.c_str(), &st)) {
+            return false;
+        }
+        free_bytes = (uint64_t)st.f_bavail * st.f_frsize;
+        return true;
+    }
+
+    void check() {
+        auto now = std::chrono::steady_clock::now();
+        uint64_t free_bytes;
+        if (!freeSpace(free_bytes)) {
+            std::cerr << "StorageGovernor: can't read free space on " << parent_directory << std::endl;
+            return;
+        }
+
+        report(now, free_bytes);
+        if (free_bytes < min_free_bytes) {
+            switch (policy) {
+            case Policy::Decimate:
+                if (free_bytes < min_free_bytes / 2) {
+                    requestStop(free_bytes);
+                } else if (decimation_factor < max_decimation && consumed(free_bytes)) {
+                    decimation_factor = decimation_factor * 2;
+                    std::cerr << "StorageGovernor: " << (free_bytes >> 20) << "MB free, saving only 1 in "
+                              << decimation_factor << " of the usual frames" << std::endl;
+                }
+                break;
+            case Policy::Ring:
+                deleteOldest(free_bytes);
+                break;
+            case Policy::Stop:
+                requestStop(free_bytes);
+                break;
+            }
+        }
+        last_free_bytes = free_bytes;
+        last_check = now;
+    }
+
+    bool consumed(uint64_t free_bytes) const {
+        return last_check != std::chrono::steady_clock::time_point() && free_bytes < last_free_bytes;
+    }
+
+    void report(std::chrono::steady_clock::time_point now, uint64_t free_bytes) {
+        if (last_check == std::chrono::steady_clock::time_point()) {
+            return;
+        }
+        double seconds = std::chrono::duration<double>(now - last_check).count();
+        double rate = free_bytes < last_free_bytes ? (last_free_bytes - free_bytes) / seconds : 0;
+        double usable = free_bytes > min_free_bytes ? free_bytes - min_free_bytes : 0;
+        int on_track;
+        if (end_time != std::chrono::steady_clock::time_point::max()) {
+            double remaining = std::max(std::chrono::duration<double>(end_time - now).count(), 1.0);
+            on_track = rate <= usable / remaining;
+        } else {
+            on_track = usable > 0;
+        }
+        if (on_track == last_on_track) {
+            return;
+        }
+        last_on_track = on_track;
+
+        std::cerr << "StorageGovernor: " << (free_bytes >> 20) << "MB free, writing " << rate / (1 << 20) << "MB/s";
+        if (end_time != std::chrono::steady_clock::time_point::max()) {
+            double remaining = std::max(std::chrono::duration<double>(end_time - now).count(), 1.0);
+            std::cerr << " against a sustainable " << usable / remaining / (1 << 20) << "MB/s";
+        } else if (rate > 0) {
+            std::cerr << ", " << usable / rate / 3600 << " hours to the " << (min_free_bytes >> 20) << "MB minimum";
+        }
+        std::cerr << std::endl;
+    }
+
+    void requestStop(uint64_t free_bytes) {
+        if (!stop_requested) {
+            std::cerr << "StorageGovernor: only " << (free_bytes >> 20) << "MB free, stopping" << std::endl;
+            stop_requested = true;
+        }
+    }
+
+    void deleteOldest(uint64_t free_bytes) {
+        namespace fs = std::filesystem;
+        uint64_t target = min_free_bytes + min_free_bytes * ring_headroom_percent / 100;
+        std::error_code ec;
+
+        // Output directories by number. The newest are the one being written and any made ahead of time, so they're
+        // never candidates.
+        std::map<unsigned long, fs::path> directories;
+        for (auto const& entry : fs::directory_iterator(parent_directory, ec)) {
+            std::string name = entry.path().filename().string();
+            if (!entry.is_directory(ec) || name.rfind(directory_prefix, 0) != 0) {
+                continue;
+            }
+            std::string suffix = name.substr(directory_prefix.size());
+            if (suffix.empty() || suffix.find_first_not_of("0123456789") != std::string::npos) {
+                continue;
+            }
+            directories[std::stoul(suffix)] = entry.path();
+        }
+        for (unsigned int i = 0; i < keep_newest && !directories.empty(); i++) {
+            directories.erase(std::prev(directories.end()));
+        }
+
+        for (auto const& [num, path] : directories) {
+            if (free_bytes >= target) {
+                return;
+            }
+            uintmax_t removed = fs::remove_all(path, ec);
+            if (ec) {
+                std::cerr << "StorageGovernor: failed to delete " << path << ": " << ec.message() << std::endl;
+                break;
+            }
+            std::cerr << "StorageGovernor: deleted " << path << " (" << removed << " files)" << std::endl;
+            if (!freeSpace(free_bytes)) {
+                return;
+            }
+        }
+        if (free_bytes < min_free_bytes / 2) {
+            // Nothing left to delete that would help.
+            requestStop(free_bytes);
+        }
+    }
+
+    std::string parent_directory;
+    std::string directory_prefix;
+    Policy policy;
+    uint64_t min_free_bytes;
+    std::chrono::seconds interval;
+    unsigned int keep_newest;
+    std::chrono::steady_clock::time_point end_time;
+
+    std::chrono::steady_clock::time_point last_check;
+    uint64_t last_free_bytes = 0;
+    int last_on_track = -1; // not yet reported
+    std::atomic<unsigned int> decimation_factor { 1 };
+    std::atomic<bool> stop_requested { false };
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool abort = false;
+    std::thread worker;
+};
@@ -0,0 +1,253 @@
+#pragma once
+
+#include <dirent.h>
+#include <gpiod.h>
+#include <poll.h>
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+
+// Times the rising edges on the lamp's strobe line and on the sensor's XVS (vertical sync) line, from libgpiod line
+// events, so that each frame can be checked against when the lamp actually fired rather than when we asked it to.
+// The kernel stamps the events on CLOCK_MONOTONIC, the clock SensorTimestamp is on, when the edge comes in, so
+// they're as good as the interrupt latency whenever our thread gets round to reading them. Either line may be left
+// out. Frames are matched in order, so edges are forgotten once a frame after them has been matched. Both the v1 and
+// the v2 libgpiod APIs are supported; the build defines LIBGPIOD_V2 for the latter.
+class StrobeMonitor {
+public:
+    enum LineId { STROBE, XVS, NUM_LINES };
+
+    // Each line is given as "<chip>:<offset>", the chip by name, path, label or number, as "gpiochip0:17", or empty
+    // to leave it out.
+    StrobeMonitor(std::string const& strobe, std::string const& xvs) {
+        std::string const* specs[NUM_LINES] = { &strobe, &xvs };
+        for (int i = 0; i < NUM_LINES; i++) {
+            if (!specs[i]->empty() && !openLine(lines[i], *specs[i])) {
+                std::cerr << "StrobeMonitor: failed to watch GPIO line " << *specs[i] << std::endl;
+            }
+        }
+        worker = std::thread(&StrobeMonitor::run, this);
+    }
+
+    ~StrobeMonitor() {
+        abort = true;
+        worker.join();
+        for (Line& line : lines) {
+            closeLine(line);
+        }
+    }
+
+    bool watching(LineId id) const { return lines[id].fd >= 0; }
+
+    // The first rising edge on a line between "from_ns" and "to_ns", if there was one. Edges before "from_ns" are
+    // forgotten.
+    std::optional<int64_t> edge(LineId id, int64_t from_ns, int64_t to_ns) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::deque<int64_t>& edges = lines[id].edges;
+        while (!edges.empty() && edges.front() < from_ns) {
+            edges.pop_front();
+        }
+        if (edges.empty() || edges.front() > to_ns) {
+            return std::nullopt;
+        }
+        return edges.front();
+    }
+
+private:
+    struct Line {
+        gpiod_chip* chip = nullptr;
+#ifdef LIBGPIOD_V2
+        gpiod_line_request* request = nullptr;
+        gpiod_edge_event_buffer* events = nullptr;
+#else
+        gpiod_line* line = nullptr;
+#endif
+        int fd = -1;
+        std::deque<int64_t> edges;
+    };
+
+    // A couple of seconds of edges at full frame rate, should frames stop being matched for a while.
+    static constexpr size_t max_edges = 1024;
+
+    static bool openLine(Line& line, std::string const& spec) {
+        size_t colon = spec.rfind(':');
+        if (colon == std::string::npos) {
+            return false;
+        }
+        unsigned int offset;
+        try {
+            offset = std::stoul(spec.substr(colon + 1));
+        } catch (std::exception const&) {
+            return false;
+        }
+#ifdef LIBGPIOD_V2
+        line.chip = openChip(spec.substr(0, colon));
+        if (!line.chip) {
+            return false;
+        }
+        gpiod_line_settings* settings = gpiod_line_settings_new();
+        gpiod_line_config* line_config = gpiod_line_config_new();
+        gpiod_request_config* request_config = gpiod_request_config_new();
+        if (settings && line_config && request_config) {
+            gpiod_line_settings_set_direction(settings, GPIOD_LINE_DIRECTION_INPUT);
+            gpiod_line_settings_set_edge_detection(settings, GPIOD_LINE_EDGE_RISING);
+            gpiod_line_settings_set_event_clock(settings, GPIOD_LINE_CLOCK_MONOTONIC);
+            gpiod_request_config_set_consumer(request_config, "rpicam-raw");
+            if (gpiod_line_config_add_line_settings(line_config, &offset, 1, settings) == 0) {
+                line.request = gpiod_chip_request_lines(line.chip, request_config, line_config);
+            }
+        }
+        gpiod_request_config_free(request_config);
+        gpiod_line_config_free(line_config);
+        gpiod_line_settings_free(settings);
+        if (line.request) {
+            line.events = gpiod_edge_event_buffer_new(1);
+        }
+        if (!line.events) {
+            closeLine(line);
+            return false;
+        }
+        line.fd = gpiod_line_request_get_fd(line.request);
+#else
+        line.chip = gpiod_chip_open_lookup(spec.substr(0, colon).c_str());
+        if (!line.chip) {
+            return false;
+        }
+        line.line = gpiod_chip_get_line(line.chip, offset);
+        if (!line.line || gpiod_line_request_rising_edge_events(line.line, "rpicam-raw") < 0) {
+            line.line = nullptr;
+            closeLine(line);
+            return false;
+        }
+        line.fd = gpiod_line_event_get_fd(line.line);
+#endif
+        return true;
+    }
+
+#ifdef LIBGPIOD_V2
+    // v2 only opens chips by path, so look the chip up by name, number or label as v1's gpiod_chip_open_lookup did.
+    static gpiod_chip* openChip(std::string const& name) {
+        if (name.find('/') != std::string::npos) {
+            return gpiod_chip_open(name.c_str());
+        }
+        if (!name.empty() && name.find_first_not_of("0123456789") == std::string::npos) {
+            return gpiod_chip_open(("/dev/gpiochip" + name).c_str());
+        }
+        if (gpiod_chip* chip = gpiod_chip_open(("/dev/" + name).c_str())) {
+            return chip;
+        }
+        DIR* dir = opendir("/dev");
+        if (!dir) {
+            return nullptr;
+        }
+        gpiod_chip* found = nullptr;
+        while (dirent* entry = readdir(dir)) {
+            if (std::string(entry->d_name).rfind("gpiochip", 0) != 0) {
+                continue;
+            }
+            gpiod_chip* chip = gpiod_chip_open(("/dev/" + std::string(entry->d_name)).c_str());
+            gpiod_chip_info* info = chip ? gpiod_chip_get_info(chip) : nullptr;
+            bool match = info && name == gpiod_chip_info_get_label(info);
+            if (info) {
+                gpiod_chip_info_free(info);
+            }
+            if (match) {
+                found = chip;
+                break;
+            }
+            if (chip) {
+                gpiod_chip_close(chip);
+            }
+        }
+        closedir(dir);
+        return found;
+    }
+#endif
+
+    static void closeLine(Line& line) {
+#ifdef LIBGPIOD_V2
+        if (line.events) {
+            gpiod_edge_event_buffer_free(line.events);
+            line.events = nullptr;
+        }
+        if (line.request) {
+            gpiod_line_request_release(line.request);
+            line.request = nullptr;
+        }
+#else
+        if (line.line) {
+            gpiod_line_release(line.line);
+            line.line = nullptr;
+        }
+#endif
+        if (line.chip) {
+            gpiod_chip_close(line.chip);
+            line.chip = nullptr;
+        }
+        line.fd = -1;
+    }
+
+    // The time of the next edge on the line, in ns on CLOCK_MONOTONIC.
+    static std::optional<int64_t> readEdge(Line& line) {
+#ifdef LIBGPIOD_V2
+        if (gpiod_line_request_read_edge_events(line.request, line.events, 1) < 1) {
+            return std::nullopt;
+        }
+        return (int64_t)gpiod_edge_event_get_timestamp_ns(gpiod_edge_event_buffer_get_event(line.events, 0));
+#else
+        struct gpiod_line_event event;
+        if (gpiod_line_event_read(line.line, &event) < 0) {
+            return std::nullopt;
+        }
+        return event.ts.tv_sec * 1000000000LL + event.ts.tv_nsec;
+#endif
+    }
+
+    void run() {
+        struct pollfd fds[NUM_LINES];
+        int ids[NUM_LINES];
+        int num_fds = 0;
+        for (int i = 0; i < NUM_LINES; i++) {
+            if (lines[i].fd >= 0) {
+                fds[num_fds] = { lines[i].fd, POLLIN, 0 };
+                ids[num_fds++] = i;
+            }
+        }
+        if (!num_fds) {
+            return;
+        }
+
+        while (!abort) {
+            // Wake up every so often to see if we're done.
+            if (poll(fds, num_fds, 100) <= 0) {
+                continue;
+            }
+            for (int i = 0; i < num_fds; i++) {
+                if (!(fds[i].revents & POLLIN)) {
+                    continue;
+                }
+                Line& line = lines[ids[i]];
+                std::optional<int64_t> ns = readEdge(line);
+                if (!ns) {
+                    continue;
+                }
+                std::lock_guard<std::mutex> lock(mutex);
+                if (line.edges.size() == max_edges) {
+                    line.edges.pop_front();
+                }
+                line.edges.push_back(*ns);
+            }
+        }
+    }
+
+    Line lines[NUM_LINES];
+    std::mutex mutex;
+    std::atomic<bool> abort { false };
+    std::thread worker;
+};
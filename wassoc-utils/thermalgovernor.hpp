@@ -0,0 +1,113 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Backs the capture off before the SoC gets hot enough to throttle, rather than letting throttling slow the encoders
+// until frames are dropped. A thread of its own reads the SoC temperature, the ARM clock and, where the firmware
+// reports it, whether it is already throttling, every couple of seconds. While the SoC is over the temperature limit
+// or throttling the capture is taken a step further down, and once it is back below the limit by the hysteresis it
+// comes a step back up; steps back up wait longer, so that we settle where the SoC can keep up rather than bouncing
+// between the two. The steps are:
+//   1    - cap PNG compression at level 1, the cheapest that still compresses,
+//   2..n - that, and keep only every step'th frame of those we would have kept.
+class ThermalGovernor {
+public:
+    ThermalGovernor(float limit_celsius, float hysteresis_celsius)
+        : limit_mc(limit_celsius * 1000), hysteresis_mc(hysteresis_celsius * 1000) {
+        worker = std::thread(&ThermalGovernor::run, this);
+    }
+
+    ~ThermalGovernor() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            abort = true;
+        }
+        cond.notify_one();
+        worker.join();
+    }
+
+    // How far the capture has been taken down, 0 when not at all.
+    unsigned int step() const { return current_step; }
+    // Multiply the frame decimation by this.
+    unsigned int decimation() const { return std::max(current_step.load(), 1u); }
+    // The PNG compression level to use in place of "level".
+    unsigned int pngLevel(unsigned int level) const { return current_step ? std::min(level, 1u) : level; }
+
+private:
+    static constexpr unsigned int max_step = 4;
+    static constexpr auto interval = std::chrono::seconds(2);
+    static constexpr auto step_down_wait = std::chrono::seconds(10);
+    static constexpr auto step_up_wait = std::chrono::seconds(30);
+    static constexpr char const* temp_file = "/sys/class/thermal/thermal_zone0/temp";
+    static constexpr char const* clock_file = "/sys/devices/system/cpu/cpu0/cpufreq/scaling_cur_freq";
+    static constexpr char const* throttled_file = "/sys/devices/platform/soc/soc:firmware/get_throttled";
+    // In get_throttled, as from vcgencmd: ARM frequency capped, throttled now, soft temperature limit active.
+    static constexpr unsigned long throttled_now_mask = 0x2 | 0x4 | 0x8;
+
+    static bool readNumber(char const* file, long& value, int base = 10) {
+        std::ifstream in(file);
+        std::string text;
+        if (!(in >> text)) {
+            return false;
+        }
+        try {
+            value = std::stol(text, nullptr, base);
+        } catch (std::exception const&) {
+            return false;
+        }
+        return true;
+    }
+
+    void run() {
+        long temp_mc;
+        if (!readNumber(temp_file, temp_mc)) {
+            std::cerr << "ThermalGovernor: can't read the SoC temperature from " << temp_file << std::endl;
+            return;
+        }
+        auto last_change = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!cond.wait_for(lock, interval, [this] { return abort; })) {
+            long throttled = 0, clock_khz = 0;
+            if (!readNumber(temp_file, temp_mc)) {
+                continue;
+            }
+            readNumber(throttled_file, throttled, 16);
+            readNumber(clock_file, clock_khz);
+            bool hot = temp_mc >= limit_mc || (throttled & throttled_now_mask);
+            bool cool = temp_mc < limit_mc - hysteresis_mc && !(throttled & throttled_now_mask);
+
+            auto now = std::chrono::steady_clock::now();
+            unsigned int step = current_step;
+            if (hot && step < max_step && now - last_change >= step_down_wait) {
+                step++;
+            } else if (cool && step > 0 && now - last_change >= step_up_wait) {
+                step--;
+            } else {
+                continue;
+            }
+            current_step = step;
+            last_change = now;
+            std::cerr << "ThermalGovernor: SoC at " << temp_mc / 1000.0 << "C, ARM clock " << clock_khz / 1000
+                      << "MHz" << (throttled & throttled_now_mask ? ", throttling" : "") << ", now at step " << step
+                      << " (PNG level cap " << (step ? "1" : "none") << ", decimation " << decimation() << ")"
+                      << std::endl;
+        }
+    }
+
+    long limit_mc;
+    long hysteresis_mc;
+    std::atomic<unsigned int> current_step { 0 };
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool abort = false;
+    std::thread worker;
+};
@@ -0,0 +1,374 @@
+#pragma once
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include "output/crc32c.hpp"
+
+// Uploads finished output directories, so that they needn't sit on the card until something else copies them off
+// (and competes with the capture for the card while it does). A thread of its own looks for directories that have
+// been rolled over from - every numbered output directory but the newest "keep_newest", which are being written or
+// were made ahead of time - and that "writing" says have nothing still on its way to disk, and PUTs each file in them
+// to "<url>/<directory>/<file>" over HTTP. S3, SFTP and the like are reached through a gateway that takes PUTs
+// (rclone serve webdav or s3, say). Each file goes with an x-amz-checksum-crc32c header, which S3 (and gateways in
+// front of it) check. A directory that has gone up is marked with an empty ".uploaded" file, or deleted if asked.
+//
+// Files are read at idle I/O priority, so the card serves the capture first, and sent no faster than the rate limit.
+// Whenever "pressure" (how far the capture's file writer is behind) reaches "backoff_depth", sending stops until it
+// drops again and then starts over from a much lower rate, which doubles every second it isn't pushed back.
+class Uploader {
+public:
+    Uploader(std::string const& url, std::string const& parent_directory, std::string const& output_directory,
+             double rate_bytes_per_sec, bool delete_after, unsigned int keep_newest,
+             std::function<unsigned int()> pressure, unsigned int backoff_depth,
+             std::function<bool(std::string const&)> writing)
+        : parent_directory(parent_directory), directory_prefix(output_directory.substr(0, output_directory.find('%'))),
+          rate_limit(rate_bytes_per_sec), delete_after(delete_after), keep_newest(keep_newest),
+          pressure(std::move(pressure)), backoff_depth(std::max(backoff_depth, 1u)), writing(std::move(writing)) {
+        if (!parseUrl(url)) {
+            throw std::runtime_error("Uploader: can't use URL " + url + ", expected http://HOST[:PORT][/PATH]");
+        }
+        worker = std::thread(&Uploader::run, this);
+    }
+
+    ~Uploader() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            abort = true;
+        }
+        cond.notify_one();
+        worker.join();
+    }
+
+    uint64_t bytesUploaded() const { return bytes_uploaded; }
+    unsigned int directoriesUploaded() const { return directories_uploaded; }
+
+private:
+    static constexpr char const* MARKER = ".uploaded";
+    static constexpr auto scan_interval = std::chrono::seconds(10);
+    static constexpr auto retry_interval = std::chrono::seconds(60);
+    // Sent in pieces this big, so the rate limit and the back-off act quickly.
+    static constexpr size_t chunk_size = 256 << 10;
+    static constexpr double min_rate_scale = 1.0 / 64;
+    static constexpr int io_timeout_secs = 30;
+
+    bool parseUrl(std::string const& url) {
+        if (url.compare(0, 7, "http://") != 0) {
+            return false;
+        }
+        std::string rest = url.substr(7);
+        size_t slash = rest.find('/');
+        std::string authority = rest.substr(0, slash);
+        base_path = slash == std::string::npos ? "" : rest.substr(slash);
+        while (!base_path.empty() && base_path.back() == '/') {
+            base_path.pop_back();
+        }
+        host_header = authority;
+        size_t colon = authority.rfind(':');
+        host = authority.substr(0, colon);
+        port = colon == std::string::npos ? "80" : authority.substr(colon + 1);
+        return !host.empty() && !port.empty();
+    }
+
+    // Wait for "duration", or until we're asked to stop. Returns false if we were.
+    bool sleepFor(std::chrono::steady_clock::duration duration) {
+        std::unique_lock<std::mutex> lock(mutex);
+        return !cond.wait_for(lock, duration, [this] { return abort.load(); });
+    }
+
+    void run() {
+        // The idle class, which only gets the disk when nobody else wants it.
+        constexpr int IOPRIO_CLASS_IDLE = 3, IOPRIO_CLASS_SHIFT = 13, IOPRIO_WHO_PROCESS = 1;
+        if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT)) {
+            std::cerr << "Uploader: couldn't lower our I/O priority" << std::endl;
+        }
+        std::cerr << "Uploader: uploading finished directories to http://" << host_header << base_path << std::endl;
+
+        while (true) {
+            bool failed = false;
+            for (auto const& path : finishedDirectories()) {
+                if (!uploadDirectory(path)) {
+                    failed = true;
+                    break;
+                }
+            }
+            if (!sleepFor(failed ? retry_interval : scan_interval)) {
+                return;
+            }
+        }
+    }
+
+    std::vector<std::filesystem::path> finishedDirectories() {
+        namespace fs = std::filesystem;
+        std::error_code ec;
+        std::map<unsigned long, fs::path> directories;
+        for (auto const& entry : fs::directory_iterator(parent_directory, ec)) {
+            std::string name = entry.path().filename().string();
+            if (!entry.is_directory(ec) || name.rfind(directory_prefix, 0) != 0) {
+                continue;
+            }
+            std::string suffix = name.substr(directory_prefix.size());
+            if (suffix.empty() || suffix.find_first_not_of("0123456789") != std::string::npos) {
+                continue;
+            }
+            directories[std::stoul(suffix)] = entry.path();
+        }
+        for (unsigned int i = 0; i < keep_newest && !directories.empty(); i++) {
+            directories.erase(std::prev(directories.end()));
+        }
+
+        // Files are written behind the capture, so the last of them may still be going in after the rollover.
+        std::vector<fs::path> finished;
+        for (auto const& [num, path] : directories) {
+            if (!fs::exists(path / MARKER, ec) && !isWriting(path)) {
+                finished.push_back(path);
+            }
+        }
+        return finished;
+    }
+
+    bool uploadDirectory(std::filesystem::path const& path) {
+        namespace fs = std::filesystem;
+        std::error_code ec;
+        std::vector<fs::path> files;
+        for (auto const& entry : fs::directory_iterator(path, ec)) {
+            if (entry.is_regular_file(ec)) {
+                files.push_back(entry.path());
+            }
+        }
+        if (ec) {
+            // The storage governor may have deleted it from under us; we'll see next time.
+            return true;
+        }
+        std::sort(files.begin(), files.end());
+
+        uint64_t bytes = 0;
+        for (auto const& file : files) {
+            if (!uploadFile(file, path.filename().string() + "/" + file.filename().string(), bytes)) {
+                return false;
+            }
+        }
+        if (isWriting(path)) {
+            // Something went in while we were uploading, so go over it all again once it's done.
+            std::cerr << "Uploader: " << path << " was written to during its upload, will retry" << std::endl;
+            return true;
+        }
+        bytes_uploaded += bytes;
+        directories_uploaded++;
+
+        if (delete_after) {
+            fs::remove_all(path, ec);
+            if (ec) {
+                std::cerr << "Uploader: failed to delete " << path << ": " << ec.message() << std::endl;
+            } else {
+                std::cerr << "Uploader: uploaded and deleted " << path << " (" << files.size() << " files, "
+                          << (bytes >> 20) << "MB)" << std::endl;
+            }
+        } else {
+            std::ofstream marker(path / MARKER);
+            std::cerr << "Uploader: uploaded " << path << " (" << files.size() << " files, " << (bytes >> 20) << "MB)"
+                      << std::endl;
+        }
+        return true;
+    }
+
+    bool uploadFile(std::filesystem::path const& file, std::string const& name, uint64_t& bytes) {
+        // Read it all in first, as the checksum has to go ahead of it. Our files are a frame, or a few, each.
+        std::vector<char> data;
+        {
+            std::ifstream in(file, std::ios::binary);
+            if (!in) {
+                std::cerr << "Uploader: can't read " << file << std::endl;
+                return false;
+            }
+            data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        }
+        uint32_t crc = crc32c(data.data(), data.size());
+
+        int fd = connectToServer();
+        if (fd < 0) {
+            return false;
+        }
+        std::string request = "PUT " + base_path + "/" + name + " HTTP/1.1\r\nHost: " + host_header +
+                              "\r\nContent-Length: " + std::to_string(data.size()) +
+                              "\r\nContent-Type: application/octet-stream\r\nx-amz-checksum-crc32c: " +
+                              checksumHeader(crc) + "\r\nConnection: close\r\n\r\n";
+        bool ok = sendAll(fd, request.data(), request.size());
+        for (size_t sent = 0; ok && sent < data.size(); sent += chunk_size) {
+            size_t n = std::min(chunk_size, data.size() - sent);
+            ok = throttle(n) && sendAll(fd, data.data() + sent, n);
+        }
+        int status = ok ? readStatus(fd) : 0;
+        close(fd);
+
+        if (status < 200 || status >= 300) {
+            if (!abort) {
+                std::cerr << "Uploader: failed to upload " << file
+                          << (status ? ", server answered " + std::to_string(status) : std::string()) << std::endl;
+            }
+            return false;
+        }
+        bytes += data.size();
+        return true;
+    }
+
+    // The header wants the big-endian checksum in base64.
+    static std::string checksumHeader(uint32_t crc) {
+        static char const alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        uint8_t bytes[4] = { (uint8_t)(crc >> 24), (uint8_t)(crc >> 16), (uint8_t)(crc >> 8), (uint8_t)crc };
+        uint32_t first = (bytes[0] << 16) | (bytes[1] << 8) | bytes[2];
+        uint32_t last = bytes[3] << 16;
+        std::string out;
+        for (int shift = 18; shift >= 0; shift -= 6) {
+            out += alphabet[(first >> shift) & 63];
+        }
+        out += alphabet[(last >> 18) & 63];
+        out += alphabet[(last >> 12) & 63];
+        return out + "==";
+    }
+
+    int connectToServer() {
+        struct addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        struct addrinfo* result;
+        if (getaddrinfo(host.c_str(), port.c_str(), &hints, &result)) {
+            std::cerr << "Uploader: can't resolve " << host << std::endl;
+            return -1;
+        }
+        int fd = -1;
+        for (struct addrinfo* ai = result; ai && fd < 0; ai = ai->ai_next) {
+            fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+            if (fd < 0) {
+                continue;
+            }
+            struct timeval timeout = { io_timeout_secs, 0 };
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            if (connect(fd, ai->ai_addr, ai->ai_addrlen)) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(result);
+        if (fd < 0) {
+            std::cerr << "Uploader: can't connect to " << host_header << std::endl;
+        }
+        return fd;
+    }
+
+    bool sendAll(int fd, char const* data, size_t size) {
+        while (size) {
+            ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return false;
+            }
+            data += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    bool isWriting(std::filesystem::path const& path) const { return writing && writing(path.string()); }
+
+    // The status code from the response, or 0 if there wasn't one.
+    static int readStatus(int fd) {
+        std::string response;
+        char buf[256];
+        while (response.find("\r\n") == std::string::npos && response.size() < 4096) {
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            response.append(buf, n);
+        }
+        int status = 0;
+        if (sscanf(response.c_str(), "HTTP/%*d.%*d %d", &status) != 1) {
+            return 0;
+        }
+        return status;
+    }
+
+    // Hold off before sending "bytes" more. Returns false if we're asked to stop.
+    bool throttle(size_t bytes) {
+        auto now = std::chrono::steady_clock::now();
+        bool pushed_back = false;
+        while (pressure && pressure() >= backoff_depth) {
+            if (!pushed_back) {
+                rate_scale = std::max(rate_scale / 8, min_rate_scale);
+                pushed_back = true;
+            }
+            if (!sleepFor(std::chrono::milliseconds(100))) {
+                return false;
+            }
+            now = std::chrono::steady_clock::now();
+            next_send = now;
+        }
+        if (now - last_increase >= std::chrono::seconds(1)) {
+            rate_scale = std::min(rate_scale * 2, 1.0);
+            last_increase = now;
+        }
+        if (rate_limit <= 0) {
+            return !abort;
+        }
+
+        // Pace the pieces out evenly, rather than letting them go in bursts.
+        next_send = std::max(next_send, now);
+        auto wait = next_send - now;
+        next_send += std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(bytes / (rate_limit * rate_scale)));
+        return wait.count() <= 0 ? !abort : sleepFor(wait);
+    }
+
+    std::string parent_directory;
+    std::string directory_prefix;
+    std::string host;
+    std::string port;
+    std::string host_header;
+    std::string base_path;
+    double rate_limit;
+    bool delete_after;
+    unsigned int keep_newest;
+    std::function<unsigned int()> pressure;
+    unsigned int backoff_depth;
+    std::function<bool(std::string const&)> writing;
+
+    double rate_scale = 1.0;
+    std::chrono::steady_clock::time_point next_send;
+    std::chrono::steady_clock::time_point last_increase;
+    std::atomic<uint64_t> bytes_uploaded { 0 };
+    std::atomic<unsigned int> directories_uploaded { 0 };
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    // Set under the mutex, so that sleepFor can't miss it, but read without it while sending.
+    std::atomic<bool> abort { false };
+    std::thread worker;
+};